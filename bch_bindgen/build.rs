@@ -50,6 +50,7 @@ fn main() {
         })
         .allowlist_function("bcachefs_usage")
         .allowlist_function("raid_init")
+        .allowlist_function("raid_tune")
         .allowlist_function("cmd_.*")
         .allowlist_function(".*_cmds")
         .allowlist_function(".*bch2_.*")
@@ -51,6 +51,66 @@ pub enum BkeyValC<'a> {
     logged_op_finsert(&'a c::bch_logged_op_finsert),
 }
 
+/// An owned key + value, copied out of the btree - the Rust analogue of the C
+/// bch2_bkey_buf. Unlike BkeySC, which borrows from the iterator and dies
+/// when it advances, a BkeyBuf stays valid indefinitely and can be sent to
+/// other threads; the backing Vec is reused across copy_from() calls, so
+/// iterating millions of keys through one (or a slice, via
+/// BtreeIter::fill_keys()) does no per-key allocation in steady state.
+#[derive(Default)]
+pub struct BkeyBuf {
+    buf: Vec<u64>,
+}
+
+impl BkeyBuf {
+    pub fn new() -> BkeyBuf {
+        Default::default()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.buf.is_empty()
+    }
+
+    pub fn clear(&mut self) {
+        self.buf.clear();
+    }
+
+    /// Copy a borrowed key into this buffer; the iterator's unpacked key and
+    /// the value aren't contiguous, so they're copied separately.
+    pub fn copy_from(&mut self, k: &BkeySC) {
+        let bkey_u64s = std::mem::size_of::<c::bkey>() / 8;
+        let u64s = std::cmp::max(k.k.u64s as usize, bkey_u64s);
+
+        self.buf.clear();
+        self.buf.reserve(u64s);
+        unsafe {
+            std::ptr::copy_nonoverlapping(
+                k.k as *const c::bkey as *const u64,
+                self.buf.as_mut_ptr(),
+                bkey_u64s);
+            std::ptr::copy_nonoverlapping(
+                k.v as *const c::bch_val as *const u64,
+                self.buf.as_mut_ptr().add(bkey_u64s),
+                u64s - bkey_u64s);
+            self.buf.set_len(u64s);
+        }
+    }
+
+    /// Borrow the stored key back as a BkeySC; panics if empty.
+    pub fn as_bkey_s_c(&self) -> BkeySC {
+        let bkey_u64s = std::mem::size_of::<c::bkey>() / 8;
+
+        assert!(self.buf.len() >= bkey_u64s);
+        unsafe {
+            BkeySC {
+                k: &*(self.buf.as_ptr() as *const c::bkey),
+                v: &*(self.buf.as_ptr().add(bkey_u64s) as *const c::bch_val),
+                iter: PhantomData,
+            }
+        }
+    }
+}
+
 impl<'a, 'b> BkeySC<'a> {
     unsafe fn to_raw(&self) -> c::bkey_s_c {
         c::bkey_s_c { k: self.k, v: self.v }
@@ -1,6 +1,6 @@
 use crate::SPOS_MAX;
 use crate::c;
-use crate::bkey::BkeySC;
+use crate::bkey::{BkeyBuf, BkeySC};
 use crate::fs::Fs;
 use crate::errcode::{bch_errcode, errptr_to_result_c};
 use crate::printbuf_to_formatter;
@@ -95,6 +95,30 @@ impl<'t> BtreeIter<'t> {
             c::bch2_btree_iter_advance(&mut self.raw);
         }
     }
+
+    /// Bulk fill: copy consecutive keys up to @end into caller supplied
+    /// buffers, advancing past each, and return how many were filled (short
+    /// counts mean the end of the range). The buffers own their keys, so
+    /// callers can batch up a slice's worth and process - or hand off to
+    /// another thread - without holding the iterator borrow per key.
+    pub fn fill_keys(&mut self, end: c::bpos, bufs: &mut [BkeyBuf])
+        -> Result<usize, bch_errcode>
+    {
+        let mut nr = 0;
+
+        while nr < bufs.len() {
+            match self.peek_and_restart()? {
+                Some(k) if !(k.k.p > end) => {
+                    bufs[nr].copy_from(&k);
+                    nr += 1;
+                }
+                _ => break,
+            }
+            self.advance();
+        }
+
+        Ok(nr)
+    }
 }
 
 impl<'t> Drop for BtreeIter<'t> {
@@ -159,10 +159,31 @@ impl FromStr for c::bpos {
 
 pub fn printbuf_to_formatter<F>(f: &mut fmt::Formatter<'_>, func: F) -> fmt::Result
     where F: Fn(*mut c::printbuf) {
-    let mut buf = c::printbuf::new();
+    // One printbuf per thread, reset between uses instead of freed: bulk
+    // listing formats a printbuf per key, and allocating a fresh one each
+    // time meant a malloc/free pair per key.
+    thread_local! {
+        static BUF: std::cell::RefCell<c::printbuf> =
+            std::cell::RefCell::new(c::printbuf::new());
+    }
+
+    BUF.with(|buf| {
+        let mut buf = buf.borrow_mut();
+
+        // printbuf_reset() is a static inline, not reachable through
+        // bindgen - mirror it here:
+        buf.pos = 0;
+        buf.set_allocation_failure(false);
+        buf.indent = 0;
+        buf.nr_tabstops = 0;
+        buf.cur_tabstop = 0;
 
-    func(&mut buf);
+        func(&mut *buf);
 
-    let s = unsafe { CStr::from_ptr(buf.buf) };
-    f.write_str(s.to_str().unwrap())
+        if buf.buf.is_null() {
+            return Ok(());
+        }
+        let s = unsafe { CStr::from_ptr(buf.buf) };
+        f.write_str(s.to_str().unwrap())
+    })
 }
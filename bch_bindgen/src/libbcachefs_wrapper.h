@@ -7,6 +7,7 @@
 #include "libbcachefs/errcode.h"
 #include "libbcachefs/error.h"
 #include "libbcachefs/opts.h"
+#include "libbcachefs/snapshot.h"
 #include "libbcachefs.h"
 #include "crypto.h"
 #include "include/linux/bio.h"
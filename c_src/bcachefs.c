@@ -36,6 +36,11 @@ void bcachefs_usage(void)
 	     "  set-option               Set a filesystem option\n"
 	     "  reset-counters           Reset all counters on an unmounted device\n"
 	     "\n"
+	     "Commands for event counters:\n"
+	     "  counters record          Sample counters to a ring file at an interval\n"
+	     "  counters report          Summarize rates/percentiles from a recording\n"
+	     "  top                      Live per-second counter rates for a filesystem\n"
+	     "\n"
 	     "Mount:\n"
 	     "  mount                    Mount a filesystem\n"
 	     "\n"
@@ -52,6 +57,11 @@ void bcachefs_usage(void)
 #endif
 	     "Commands for managing a running filesystem:\n"
 	     "  fs usage                 Show disk usage\n"
+	     "  daemon                   Hold a read-only filesystem handle open for queries\n"
+	     "  query                    Query a running bcachefs daemon\n"
+	     "  internals latency        Show latency percentiles per event\n"
+	     "  internals btree-cache    Show btree node cache telemetry\n"
+	     "  internals buckets-waiting Show buckets waiting for journal occupancy\n"
 	     "\n"
 	     "Commands for managing devices within a running filesystem:\n"
 	     "  device add               Add a new device to an existing filesystem\n"
@@ -86,7 +96,8 @@ void bcachefs_usage(void)
 	     "\n"
 	     "Debug:\n"
 	     "These commands work on offline, unmounted filesystems\n"
-	     "  dump                     Dump filesystem metadata to a qcow2 image\n"
+	     "  dump                     Dump filesystem metadata to a qcow2 or sparse image\n"
+	     "  dump-restore             Restore a sparse dump image to a device\n"
 	     "  list                     List filesystem metadata in textual form\n"
 	     "  list_journal             List contents of journal\n"
 	     "\n"
@@ -95,6 +106,8 @@ void bcachefs_usage(void)
 	     "\n"
 	     "Miscellaneous:\n"
          "  completions              Generate shell completions\n"
+	     "  bench-crypto             Benchmark encryption primitive throughput\n"
+	     "  bench-compression        Measure compression on sampled extents\n"
 	     "  version                  Display the version of the invoked bcachefs tool\n");
 }
 
@@ -145,6 +158,40 @@ int device_cmds(int argc, char *argv[])
 		return cmd_device_resize(argc, argv);
 	if (!strcmp(cmd, "resize-journal"))
 		return cmd_device_resize_journal(argc, argv);
+	if (!strcmp(cmd, "benchmark"))
+		return cmd_device_benchmark(argc, argv);
+
+	return 0;
+}
+
+int internals_cmds(int argc, char *argv[])
+{
+	char *cmd = pop_cmd(&argc, argv);
+
+	if (argc < 1)
+		return internals_usage();
+	if (!strcmp(cmd, "latency"))
+		return cmd_internals_latency(argc, argv);
+	if (!strcmp(cmd, "btree-cache"))
+		return cmd_internals_btree_cache(argc, argv);
+	if (!strcmp(cmd, "buckets-waiting"))
+		return cmd_internals_buckets_waiting(argc, argv);
+
+	return 0;
+}
+
+int counters_cmds(int argc, char *argv[])
+{
+	char *cmd = pop_cmd(&argc, argv);
+
+	if (argc < 1) {
+		bcachefs_usage();
+		exit(EXIT_FAILURE);
+	}
+	if (!strcmp(cmd, "record"))
+		return cmd_counters_record(argc, argv);
+	if (!strcmp(cmd, "report"))
+		return cmd_counters_report(argc, argv);
 
 	return 0;
 }
@@ -157,6 +204,10 @@ int data_cmds(int argc, char *argv[])
 		return data_usage();
 	if (!strcmp(cmd, "rereplicate"))
 		return cmd_data_rereplicate(argc, argv);
+	if (!strcmp(cmd, "scrub"))
+		return cmd_data_scrub(argc, argv);
+	if (!strcmp(cmd, "defragment"))
+		return cmd_data_defragment(argc, argv);
 	if (!strcmp(cmd, "job"))
 		return cmd_data_job(argc, argv);
 
@@ -1,4 +1,5 @@
 #include <dirent.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
@@ -7,17 +8,47 @@
 #include <unistd.h>
 
 #include "libbcachefs/bcachefs_ioctl.h"
+#include "libbcachefs/darray.h"
 
 #include "cmds.h"
 #include "libbcachefs.h"
 
-static void propagate_recurse(int dirfd)
+/*
+ * Propagation is one REINHERIT_ATTRS ioctl per directory entry, so on big
+ * trees the walk is entirely syscall bound - run it with a pool of threads
+ * servicing a shared queue of open directories. Ordering doesn't matter:
+ * REINHERIT_ATTRS only looks at an entry and its (already updated) parent.
+ */
+#define PROPAGATE_MAX_THREADS	16
+
+struct propagate_state {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	DARRAY(int)		dirs;		/* dirfds waiting to be walked */
+	unsigned		outstanding;	/* dirs queued or being walked */
+	u64			nr_done;	/* entries propagated to */
+};
+
+static void propagate_dir_push(struct propagate_state *s, int fd)
+{
+	pthread_mutex_lock(&s->lock);
+	s->outstanding++;
+	if (darray_push(&s->dirs, fd))
+		die("malloc error");
+	pthread_cond_broadcast(&s->wait);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Takes ownership of dirfd: */
+static void propagate_one_dir(struct propagate_state *s, int dirfd)
 {
 	DIR *dir = fdopendir(dirfd);
 	struct dirent *d;
+	u64 nr = 0;
 
 	if (!dir) {
 		fprintf(stderr, "fdopendir() error: %m\n");
+		close(dirfd);
 		return;
 	}
 
@@ -34,12 +65,16 @@ static void propagate_recurse(int dirfd)
 			continue;
 		}
 
+		nr++;
+
 		if (!ret) /* did no work */
 			continue;
 
-		struct stat st = xfstatat(dirfd, d->d_name,
-					  AT_SYMLINK_NOFOLLOW);
-		if (!S_ISDIR(st.st_mode))
+		/* d_type saves a stat per non-directory when available: */
+		if (d->d_type != DT_UNKNOWN
+		    ? d->d_type != DT_DIR
+		    : !S_ISDIR(xfstatat(dirfd, d->d_name,
+					AT_SYMLINK_NOFOLLOW).st_mode))
 			continue;
 
 		int fd = openat(dirfd, d->d_name, O_RDONLY);
@@ -47,12 +82,92 @@ static void propagate_recurse(int dirfd)
 			fprintf(stderr, "error opening %s: %m\n", d->d_name);
 			continue;
 		}
-		propagate_recurse(fd);
-		close(fd);
+		propagate_dir_push(s, fd);
 	}
 
 	if (errno)
 		die("readdir error: %m");
+	closedir(dir);
+
+	pthread_mutex_lock(&s->lock);
+	s->nr_done += nr;
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void *propagate_thread(void *arg)
+{
+	struct propagate_state *s = arg;
+
+	pthread_mutex_lock(&s->lock);
+	while (1) {
+		if (s->dirs.nr) {
+			int fd = s->dirs.data[--s->dirs.nr];
+
+			pthread_mutex_unlock(&s->lock);
+			propagate_one_dir(s, fd);
+			pthread_mutex_lock(&s->lock);
+
+			if (!--s->outstanding)
+				pthread_cond_broadcast(&s->wait);
+		} else if (!s->outstanding) {
+			break;
+		} else {
+			pthread_cond_wait(&s->wait, &s->lock);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/* Takes ownership of dirfd: */
+static void propagate_recurse(int dirfd)
+{
+	struct propagate_state s = {
+		.lock	= PTHREAD_MUTEX_INITIALIZER,
+		.wait	= PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t threads[PROPAGATE_MAX_THREADS];
+	long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	u64 prev = 0;
+	bool printed = false;
+	unsigned i;
+
+	nr_threads = clamp_t(long, nr_threads, 1, PROPAGATE_MAX_THREADS);
+
+	propagate_dir_push(&s, dirfd);
+
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, propagate_thread, &s))
+			die("pthread_create error: %m");
+
+	while (1) {
+		pthread_mutex_lock(&s.lock);
+		bool done = !s.outstanding;
+		u64 nr = s.nr_done;
+		pthread_mutex_unlock(&s.lock);
+
+		/*
+		 * We poll once a second, so the delta since the last readout
+		 * is already a per second rate:
+		 */
+		if (nr || printed) {
+			printf("\33[2K\r%llu entries (%llu/sec)", nr, nr - prev);
+			fflush(stdout);
+			printed = true;
+		}
+		prev = nr;
+
+		if (done)
+			break;
+		sleep(1);
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	darray_exit(&s.dirs);
+	if (printed)
+		printf("\n");
 }
 
 static void do_setattr(char *path, struct bch_opt_strs opts)
@@ -80,7 +195,6 @@ static void do_setattr(char *path, struct bch_opt_strs opts)
 		die("error opening %s: %m", path);
 
 	propagate_recurse(dirfd);
-	close(dirfd);
 }
 
 static void setattr_usage(void)
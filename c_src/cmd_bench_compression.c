@@ -0,0 +1,270 @@
+/*
+ * bcachefs bench-compression - sample extents from an offline filesystem and
+ * report what each compression algorithm would have achieved on them, through
+ * the real write path compression code, so background_compression can be
+ * chosen from measurements instead of guesswork.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "tools-util.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/bkey_buf.h"
+#include "libbcachefs/btree_iter.h"
+#include "libbcachefs/compress.h"
+#include "libbcachefs/errcode.h"
+#include "libbcachefs/extents.h"
+#include "libbcachefs/io_read.h"
+#include "libbcachefs/opts.h"
+#include "libbcachefs/super.h"
+
+static void bench_compression_usage(void)
+{
+	puts("bcachefs bench-compression - measure compression on sampled extents\n"
+	     "Usage: bcachefs bench-compression [OPTION]... <devices>\n"
+	     "\n"
+	     "Options:\n"
+	     "  -n, --nr-samples=nr       Number of extents to sample (default 128)\n"
+	     "  -h, --help                Display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+static const struct {
+	const char			*name;
+	struct bch_compression_opt	opt;
+} bench_variants[] = {
+	{ "lz4",	{ .type = BCH_COMPRESSION_OPT_lz4		} },
+	{ "lz4:9",	{ .type = BCH_COMPRESSION_OPT_lz4,  .level = 9	} },
+	{ "gzip",	{ .type = BCH_COMPRESSION_OPT_gzip		} },
+	{ "zstd",	{ .type = BCH_COMPRESSION_OPT_zstd		} },
+	{ "zstd:15",	{ .type = BCH_COMPRESSION_OPT_zstd, .level = 15	} },
+};
+
+struct bench_totals {
+	u64	src_bytes;
+	u64	dst_bytes;
+	u64	time_ns;
+};
+
+static u64 ns_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void userbio_init(struct bio *bio, struct bio_vec *bv,
+			 void *buf, size_t size)
+{
+	bio_init(bio, NULL, bv, 1, 0);
+	bio->bi_iter.bi_size	= size;
+	bv->bv_page		= buf;
+	bv->bv_len		= size;
+	bv->bv_offset		= 0;
+}
+
+static void bench_read_endio(struct bio *bio)
+{
+	closure_put(bio->bi_private);
+}
+
+/*
+ * Read up to encoded_extent_max bytes of @k's data through the normal read
+ * path (which handles decompression, decryption and checksum verification),
+ * returning the number of bytes read or 0 on error:
+ */
+static unsigned read_sample(struct btree_trans *trans, struct bkey_s_c k,
+			    void *buf)
+{
+	struct bch_fs *c = trans->c;
+	unsigned bytes = round_down(min(k.k->size << 9,
+					c->opts.encoded_extent_max),
+				    block_bytes(c));
+	struct bch_io_failures failed = { .nr = 0 };
+	struct bch_read_bio rbio;
+	struct bio_vec bv;
+	struct closure cl;
+	int ret;
+
+	if (!bytes)
+		return 0;
+
+	closure_init_stack(&cl);
+
+	userbio_init(&rbio.bio, &bv, buf, bytes);
+	bio_set_op_attrs(&rbio.bio, REQ_OP_READ, REQ_SYNC);
+	rbio.bio.bi_iter.bi_sector = bkey_start_offset(k.k);
+
+	closure_get(&cl);
+	rbio.bio.bi_end_io	= bench_read_endio;
+	rbio.bio.bi_private	= &cl;
+
+	rbio_init(&rbio.bio, bch2_opts_to_inode_opts(c->opts));
+
+	ret = lockrestart_do(trans,
+		__bch2_read_extent(trans, &rbio, rbio.bio.bi_iter,
+				   bkey_start_pos(k.k), BTREE_ID_extents, k,
+				   0, &failed, BCH_READ_LAST_FRAGMENT));
+	closure_sync(&cl);
+
+	return ret || rbio.bio.bi_status ? 0 : bytes;
+}
+
+static void bench_sample(struct bch_fs *c, struct bench_totals *totals,
+			 void *src_buf, unsigned bytes, void *dst_buf)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(bench_variants); i++) {
+		struct bio src, dst;
+		struct bio_vec src_bv, dst_bv;
+		size_t src_len = 0, dst_len = 0;
+
+		userbio_init(&src, &src_bv, src_buf, bytes);
+		userbio_init(&dst, &dst_bv, dst_buf, bytes);
+
+		u64 start = ns_now();
+		unsigned type = bch2_bio_compress(c, &dst, &dst_len,
+						  &src, &src_len,
+				bch2_compression_encode(bench_variants[i].opt));
+		u64 time = ns_now() - start;
+
+		/* Didn't get smaller - charge it at its input size: */
+		if (!type) {
+			src_len	= bytes;
+			dst_len	= bytes;
+		}
+
+		totals[i].src_bytes	+= src_len;
+		totals[i].dst_bytes	+= dst_len;
+		totals[i].time_ns	+= time;
+	}
+}
+
+int cmd_bench_compression(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "nr-samples",		required_argument,	NULL, 'n' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_opts opts = bch2_opts_empty();
+	unsigned nr_samples = 128;
+	int opt;
+
+	opt_set(opts, nochanges,	true);
+	opt_set(opts, norecovery,	true);
+	opt_set(opts, read_only,	true);
+	opt_set(opts, degraded,		true);
+	opt_set(opts, errors,		BCH_ON_ERROR_continue);
+
+	while ((opt = getopt_long(argc, argv, "n:h",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 'n':
+			if (kstrtouint(optarg, 10, &nr_samples) || !nr_samples)
+				die("error parsing nr_samples");
+			break;
+		case 'h':
+			bench_compression_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s) to open");
+
+	darray_str devs = get_or_split_cmdline_devs(argc, argv);
+
+	struct bch_fs *c = bch2_fs_open(devs.data, devs.nr, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", argv[0], bch2_err_str(PTR_ERR(c)));
+
+	for (unsigned i = 0; i < ARRAY_SIZE(bench_variants); i++)
+		if (bch2_check_set_has_compressed_data(c,
+				bch2_compression_encode(bench_variants[i].opt)))
+			die("error initializing compression workspaces");
+
+	struct bkey_buf *samples = xcalloc(nr_samples, sizeof(*samples));
+	struct bench_totals totals[ARRAY_SIZE(bench_variants)] = { 0 };
+	u64 nr_seen = 0, nr_read = 0, bytes_read = 0;
+	struct btree_trans *trans = bch2_trans_get(c);
+
+	for (unsigned i = 0; i < nr_samples; i++)
+		bch2_bkey_buf_init(&samples[i]);
+
+	srand(ns_now());
+
+	/*
+	 * Reservoir sample so the extents benchmarked are uniformly random
+	 * over the whole filesystem, not just whatever sorts first:
+	 */
+	int ret = for_each_btree_key(trans, iter, BTREE_ID_extents, POS_MIN,
+				     BTREE_ITER_ALL_SNAPSHOTS|
+				     BTREE_ITER_PREFETCH, k, ({
+		if (bkey_extent_is_direct_data(k.k)) {
+			u64 j = nr_seen < nr_samples
+				? nr_seen
+				: rand() % (nr_seen + 1);
+
+			if (j < nr_samples)
+				bch2_bkey_buf_reassemble(&samples[j], c, k);
+			nr_seen++;
+		}
+		0;
+	}));
+	if (ret)
+		die("error walking extents: %s", bch2_err_str(ret));
+
+	void *src_buf	= xmalloc(c->opts.encoded_extent_max);
+	void *dst_buf	= xmalloc(c->opts.encoded_extent_max);
+
+	for (unsigned i = 0; i < min_t(u64, nr_samples, nr_seen); i++) {
+		struct bkey_s_c s = bkey_i_to_s_c(samples[i].k);
+		unsigned bytes = read_sample(trans, s, src_buf);
+
+		if (!bytes)
+			continue;
+
+		bench_sample(c, totals, src_buf, bytes, dst_buf);
+		nr_read++;
+		bytes_read += bytes;
+	}
+
+	bch2_trans_put(trans);
+
+	printf("sampled %llu of %llu extents, %llu bytes\n\n",
+	       (unsigned long long) nr_read,
+	       (unsigned long long) nr_seen,
+	       (unsigned long long) bytes_read);
+	printf("%-10s %8s %12s\n", "algorithm", "ratio", "compress");
+
+	for (unsigned i = 0; i < ARRAY_SIZE(bench_variants); i++) {
+		struct bench_totals *t = &totals[i];
+
+		if (!t->src_bytes || !t->time_ns)
+			continue;
+
+		printf("%-10s %7.2fx %7llu MB/s\n",
+		       bench_variants[i].name,
+		       (double) t->src_bytes / t->dst_bytes,
+		       (unsigned long long) (t->src_bytes * 1000 / t->time_ns));
+	}
+
+	for (unsigned i = 0; i < nr_samples; i++)
+		bch2_bkey_buf_exit(&samples[i], c);
+	free(samples);
+	free(src_buf);
+	free(dst_buf);
+
+	bch2_fs_stop(c);
+	return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Throughput benchmark for the encryption primitives behind bch2_encrypt():
+ * chacha20 via the skcipher shim and poly1305 via the shash shim, i.e. the
+ * same code paths encrypted-filesystem fsck runs all data and metadata
+ * through. The actual cipher implementation is selected at runtime by the
+ * backend (libsodium picks its vectorized variants when the CPU has them),
+ * so this reports what encrypted I/O will actually get on this machine.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/err.h>
+#include <linux/scatterlist.h>
+
+#include <crypto/chacha.h>
+#include <crypto/hash.h>
+#include <crypto/poly1305.h>
+#include <crypto/skcipher.h>
+
+#include "cmds.h"
+
+static u64 ns_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static u64 chacha20_mbps(void *buf, size_t len, unsigned reps)
+{
+	struct crypto_sync_skcipher *tfm =
+		crypto_alloc_sync_skcipher("chacha20", 0, 0);
+	u8 key[CHACHA_KEY_SIZE]	= { 1 };
+	u8 iv[CHACHA_IV_SIZE]	= { 0 };
+	struct scatterlist sg;
+	unsigned i;
+
+	if (IS_ERR(tfm))
+		die("error allocating chacha20 cipher");
+
+	if (crypto_skcipher_setkey(&tfm->base, key, sizeof(key)))
+		die("error setting chacha20 key");
+
+	sg_init_one(&sg, buf, len);
+
+	SYNC_SKCIPHER_REQUEST_ON_STACK(req, tfm);
+	skcipher_request_set_sync_tfm(req, tfm);
+	skcipher_request_set_crypt(req, &sg, &sg, len, iv);
+
+	u64 start = ns_now();
+
+	for (i = 0; i < reps; i++)
+		if (crypto_skcipher_encrypt(req))
+			die("error from crypto_skcipher_encrypt()");
+
+	u64 t = ns_now() - start;
+
+	crypto_free_sync_skcipher(tfm);
+
+	return (u64) len * reps * 1000 / t;
+}
+
+static u64 poly1305_mbps(const void *buf, size_t len, unsigned reps)
+{
+	struct crypto_shash *tfm = crypto_alloc_shash("poly1305", 0, 0);
+	u8 key[POLY1305_KEY_SIZE]	= { 1 };
+	u8 digest[POLY1305_DIGEST_SIZE];
+	unsigned i;
+
+	if (IS_ERR(tfm))
+		die("error allocating poly1305 hash");
+
+	SHASH_DESC_ON_STACK(desc, tfm);
+	desc->tfm = tfm;
+
+	u64 start = ns_now();
+
+	for (i = 0; i < reps; i++) {
+		/* the shim takes the one time key as the first update: */
+		if (crypto_shash_init(desc) ?:
+		    crypto_shash_update(desc, key, sizeof(key)) ?:
+		    crypto_shash_update(desc, buf, len) ?:
+		    crypto_shash_final(desc, digest))
+			die("error from poly1305 shash");
+	}
+
+	u64 t = ns_now() - start;
+
+	crypto_free_shash(tfm);
+
+	return (u64) len * reps * 1000 / t;
+}
+
+int cmd_bench_crypto(int argc, char *argv[])
+{
+	size_t sizes[] = { 4096, 65536, 1 << 20 };
+	size_t bytes_per_size = 1 << 30;
+	void *buf = xmalloc(sizes[ARRAY_SIZE(sizes) - 1]);
+	unsigned i;
+
+	memset(buf, 0x5a, sizes[ARRAY_SIZE(sizes) - 1]);
+
+	printf("%10s %14s %14s\n", "bufsize", "chacha20", "poly1305");
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		unsigned reps = bytes_per_size / sizes[i];
+
+		printf("%10zu %9llu MB/s %9llu MB/s\n",
+		       sizes[i],
+		       (unsigned long long) chacha20_mbps(buf, sizes[i], reps),
+		       (unsigned long long) poly1305_mbps(buf, sizes[i], reps));
+	}
+
+	free(buf);
+	return 0;
+}
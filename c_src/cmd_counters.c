@@ -1,8 +1,700 @@
+#include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "cmds.h"
 #include "libbcachefs.h"
 #include "libbcachefs/super-io.h"
+#include "libbcachefs/varint.h"
+
+static const char * const counter_names[] = {
+#define x(t, ...) #t,
+	BCH_PERSISTENT_COUNTERS()
+#undef x
+};
+
+/*
+ * counters record/report: sample the superblock counters into a compact
+ * delta-encoded ring file, for rate/percentile reporting without an external
+ * poller.
+ *
+ * File layout: header, then a byte ring of records. Each record is a 16 bit
+ * payload length followed by a type byte, a varint timestamp and one varint
+ * per counter - absolute values for keyframes, deltas from the previous
+ * record otherwise. A keyframe is written periodically (and whenever a
+ * counter goes backwards, i.e. reset-counters was run) so a reader can start
+ * decoding even after the ring has wrapped over older records. A 0xffff
+ * length is a pad: the rest of the ring is skipped and the next record is at
+ * offset 0.
+ */
+struct ctr_ring_hdr {
+	char		magic[8];
+	__le16		version;
+	__le16		nr_counters;
+	__le32		data_bytes;
+	__le64		oldest;
+	__le64		write;
+	__le64		used;
+};
+
+#define CTR_RING_MAGIC		"bchctrs\0"
+#define CTR_RING_VERSION	1
+#define CTR_PAD			0xffff
+#define CTR_KEYFRAME_INTERVAL	64
+
+#define CTR_REC_KEYFRAME	0
+#define CTR_REC_DELTA		1
+
+/* worst case payload: type byte + 10 byte varints throughout */
+#define CTR_REC_MAX		(1 + 10 * (BCH_PERSISTENT_COUNTER_NR + 1))
+
+static void ring_write_hdr(int fd, struct ctr_ring_hdr *h)
+{
+	xpwrite(fd, h, sizeof(*h), 0, "counter ring header");
+}
+
+static void ring_pop_oldest(int fd, struct ctr_ring_hdr *h)
+{
+	u64 data_bytes	= le32_to_cpu(h->data_bytes);
+	u64 oldest	= le64_to_cpu(h->oldest);
+	u64 adv;
+
+	if (data_bytes - oldest < 2) {
+		adv = data_bytes - oldest;
+	} else {
+		__le16 len;
+
+		xpread(fd, &len, sizeof(len), sizeof(*h) + oldest);
+		adv = le16_to_cpu(len) == CTR_PAD
+			? data_bytes - oldest
+			: 2 + le16_to_cpu(len);
+	}
+
+	h->oldest	= cpu_to_le64((oldest + adv) % data_bytes);
+	h->used		= cpu_to_le64(le64_to_cpu(h->used) - adv);
+}
+
+static void ring_append(int fd, struct ctr_ring_hdr *h,
+			const void *rec, unsigned len)
+{
+	u64 data_bytes	= le32_to_cpu(h->data_bytes);
+	u64 need	= 2 + len;
+
+	BUG_ON(need + 2 > data_bytes);
+
+	while (data_bytes - le64_to_cpu(h->used) < need + 2)
+		ring_pop_oldest(fd, h);
+
+	u64 w = le64_to_cpu(h->write);
+
+	if (data_bytes - w < need) {
+		if (data_bytes - w >= 2) {
+			__le16 pad = cpu_to_le16(CTR_PAD);
+
+			xpwrite(fd, &pad, sizeof(pad), sizeof(*h) + w,
+				"counter ring pad");
+		}
+
+		h->used = cpu_to_le64(le64_to_cpu(h->used) + data_bytes - w);
+		w = 0;
+
+		while (data_bytes - le64_to_cpu(h->used) < need)
+			ring_pop_oldest(fd, h);
+	}
+
+	__le16 len_le = cpu_to_le16(len);
+
+	xpwrite(fd, &len_le, sizeof(len_le), sizeof(*h) + w, "counter record");
+	xpwrite(fd, rec, len, sizeof(*h) + w + 2, "counter record");
+
+	h->write	= cpu_to_le64((w + need) % data_bytes);
+	h->used		= cpu_to_le64(le64_to_cpu(h->used) + need);
+}
+
+static void read_sb_counters(const char *dev, u64 *v)
+{
+	struct bch_opts opts = bch2_opts_empty();
+	struct bch_sb_handle sb;
+
+	opt_set(opts, noexcl,	true);
+	opt_set(opts, nochanges, true);
+
+	int ret = bch2_read_super(dev, &opts, &sb);
+	if (ret)
+		die("Error opening %s: %s", dev, bch2_err_str(ret));
+
+	struct bch_sb_field_counters *ctrs = bch2_sb_field_get(sb.sb, counters);
+
+	memset(v, 0, sizeof(*v) * BCH_PERSISTENT_COUNTER_NR);
+
+	if (ctrs) {
+		unsigned nr = min_t(unsigned, BCH_PERSISTENT_COUNTER_NR,
+			(__le64 *) vstruct_end(&ctrs->field) - &ctrs->d[0]);
+
+		for (unsigned i = 0; i < nr; i++)
+			v[i] = le64_to_cpu(ctrs->d[i]);
+	}
+
+	bch2_free_super(&sb);
+}
+
+static unsigned encode_rec(u8 *buf, u8 type, u64 t,
+			   const u64 *v, const u64 *prev)
+{
+	u8 *p = buf;
+
+	*p++ = type;
+	p += bch2_varint_encode(p, t);
+
+	for (unsigned i = 0; i < BCH_PERSISTENT_COUNTER_NR; i++)
+		p += bch2_varint_encode(p, type == CTR_REC_KEYFRAME
+					? v[i] : v[i] - prev[i]);
+	return p - buf;
+}
+
+static volatile sig_atomic_t record_stopping;
+
+static void record_sighandler(int sig)
+{
+	record_stopping = 1;
+}
+
+static void counters_record_usage(void)
+{
+	puts("bcachefs counters record - sample superblock counters to a ring file\n"
+	     "Usage: bcachefs counters record [OPTION]... device\n"
+	     "\n"
+	     "Options:\n"
+	     "  -o, --output=file           Ring file to record to (required)\n"
+	     "  -i, --interval=seconds      Sample interval (default 10)\n"
+	     "  -s, --size=size             Ring size (default 1M)\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+int cmd_counters_record(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "output",		required_argument,	NULL, 'o' },
+		{ "interval",		required_argument,	NULL, 'i' },
+		{ "size",		required_argument,	NULL, 's' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	const char *out_path = NULL;
+	u64 ring_size = 1 << 20;
+	unsigned interval = 10;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "o:i:s:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'i':
+			if (kstrtouint(optarg, 10, &interval) || !interval)
+				die("invalid interval");
+			break;
+		case 's':
+			if (bch2_strtoull_h(optarg, &ring_size))
+				die("invalid ring size");
+			break;
+		case 'h':
+			counters_record_usage();
+			break;
+		}
+	args_shift(optind);
+
+	char *dev = arg_pop();
+	if (!dev)
+		die("please supply a device");
+	if (argc)
+		die("too many arguments");
+	if (!out_path)
+		die("please supply an output file (-o)");
+	if (ring_size < CTR_REC_MAX * 4)
+		die("ring size too small");
+
+	struct ctr_ring_hdr h;
+	int fd = open(out_path, O_RDWR|O_CREAT, 0644);
+	if (fd < 0)
+		die("Error opening %s: %m", out_path);
+
+	/* resume an existing recording, or initialize a new ring: */
+	if (pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+	    !memcmp(h.magic, CTR_RING_MAGIC, sizeof(h.magic))) {
+		if (le16_to_cpu(h.version) != CTR_RING_VERSION ||
+		    le16_to_cpu(h.nr_counters) != BCH_PERSISTENT_COUNTER_NR)
+			die("%s: version or counter list mismatch", out_path);
+	} else {
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, CTR_RING_MAGIC, sizeof(h.magic));
+		h.version	= cpu_to_le16(CTR_RING_VERSION);
+		h.nr_counters	= cpu_to_le16(BCH_PERSISTENT_COUNTER_NR);
+		h.data_bytes	= cpu_to_le32(ring_size);
+
+		if (ftruncate(fd, sizeof(h) + ring_size))
+			die("truncate error: %m");
+		ring_write_hdr(fd, &h);
+	}
+
+	signal(SIGINT,	record_sighandler);
+	signal(SIGTERM,	record_sighandler);
+
+	u64 v[BCH_PERSISTENT_COUNTER_NR], prev[BCH_PERSISTENT_COUNTER_NR];
+	u8 rec[CTR_REC_MAX];
+	unsigned since_keyframe = 0;
+	u64 prev_t = 0;
+	bool have_prev = false;
+
+	while (!record_stopping) {
+		u64 t = time(NULL);
+
+		read_sb_counters(dev, v);
+
+		/* counters went backwards == reset-counters was run: */
+		bool keyframe = !have_prev ||
+			since_keyframe >= CTR_KEYFRAME_INTERVAL;
+		for (unsigned i = 0; !keyframe && i < BCH_PERSISTENT_COUNTER_NR; i++)
+			keyframe |= v[i] < prev[i];
+
+		unsigned len = keyframe
+			? encode_rec(rec, CTR_REC_KEYFRAME, t, v, NULL)
+			: encode_rec(rec, CTR_REC_DELTA, t - prev_t, v, prev);
+
+		ring_append(fd, &h, rec, len);
+		ring_write_hdr(fd, &h);
+
+		memcpy(prev, v, sizeof(v));
+		prev_t		= t;
+		have_prev	= true;
+		since_keyframe	= keyframe ? 0 : since_keyframe + 1;
+
+		for (unsigned i = 0; i < interval && !record_stopping; i++)
+			sleep(1);
+	}
+
+	close(fd);
+	return 0;
+}
+
+static int cmp_double(const void *_l, const void *_r)
+{
+	const double *l = _l, *r = _r;
+
+	return *l < *r ? -1 : *l > *r ? 1 : 0;
+}
+
+static double percentile(double *sorted, unsigned nr, unsigned p)
+{
+	return sorted[(nr - 1) * p / 100];
+}
+
+static void counters_report_usage(void)
+{
+	puts("bcachefs counters report - summarize a recorded counter ring file\n"
+	     "Usage: bcachefs counters report file\n"
+	     "\n"
+	     "Options:\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+int cmd_counters_report(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "help",			0, NULL, 'h' },
+		{ NULL }
+	};
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'h':
+			counters_report_usage();
+			break;
+		}
+	args_shift(optind);
+
+	char *path = arg_pop();
+	if (!path)
+		die("please supply a recorded file");
+	if (argc)
+		die("too many arguments");
+
+	int fd = xopen(path, O_RDONLY);
+	struct ctr_ring_hdr h;
+
+	xpread(fd, &h, sizeof(h), 0);
+	if (memcmp(h.magic, CTR_RING_MAGIC, sizeof(h.magic)) ||
+	    le16_to_cpu(h.version) != CTR_RING_VERSION)
+		die("%s: not a counter recording", path);
+
+	unsigned nr_counters = le16_to_cpu(h.nr_counters);
+	u64 data_bytes = le32_to_cpu(h.data_bytes);
+
+	if (nr_counters > BCH_PERSISTENT_COUNTER_NR)
+		die("%s: too many counters (newer tools?)", path);
+
+	u8 *data = xmalloc(data_bytes);
+	xpread(fd, data, data_bytes, sizeof(h));
+	close(fd);
+
+	u64 v[BCH_PERSISTENT_COUNTER_NR], prev[BCH_PERSISTENT_COUNTER_NR];
+	double *rates[BCH_PERSISTENT_COUNTER_NR];
+	u64 total[BCH_PERSISTENT_COUNTER_NR] = { 0 };
+	unsigned nr_samples = 0, max_samples;
+	u64 t = 0, prev_t = 0, first_t = 0;
+	bool have_key = false, have_prev = false;
+
+	/* every record is at least 2 + 2 bytes: */
+	max_samples = data_bytes / 4;
+	for (unsigned i = 0; i < BCH_PERSISTENT_COUNTER_NR; i++)
+		rates[i] = xmalloc(sizeof(double) * max_samples);
+
+	u64 off		= le64_to_cpu(h.oldest);
+	u64 remaining	= le64_to_cpu(h.used);
+
+	while (remaining) {
+		if (data_bytes - off < 2) {
+			remaining -= data_bytes - off;
+			off = 0;
+			continue;
+		}
+
+		u16 len = le16_to_cpu(*(__le16 *) (data + off));
+
+		if (len == CTR_PAD) {
+			remaining -= data_bytes - off;
+			off = 0;
+			continue;
+		}
+
+		const u8 *p = data + off + 2, *end = p + len;
+		u8 type = *p++;
+		u64 val;
+		int ret;
+
+		ret = bch2_varint_decode(p, end, &val);
+		if (ret < 0)
+			die("%s: decode error", path);
+		p += ret;
+
+		if (type == CTR_REC_KEYFRAME) {
+			t = val;
+			for (unsigned i = 0; i < nr_counters; i++) {
+				ret = bch2_varint_decode(p, end, &v[i]);
+				if (ret < 0)
+					die("%s: decode error", path);
+				p += ret;
+			}
+			have_key = true;
+		} else if (have_key) {
+			t += val;
+			for (unsigned i = 0; i < nr_counters; i++) {
+				u64 d;
+
+				ret = bch2_varint_decode(p, end, &d);
+				if (ret < 0)
+					die("%s: decode error", path);
+				p += ret;
+				v[i] = prev[i] + d;
+			}
+		}
+
+		if (have_key) {
+			if (!have_prev)
+				first_t = t;
+
+			if (have_prev && t > prev_t) {
+				double dt = t - prev_t;
+
+				for (unsigned i = 0; i < nr_counters; i++) {
+					u64 d = v[i] >= prev[i]
+						? v[i] - prev[i] : 0;
+
+					rates[i][nr_samples] = d / dt;
+					total[i] += d;
+				}
+				nr_samples++;
+			}
+
+			memcpy(prev, v, sizeof(v));
+			prev_t = t;
+			have_prev = true;
+		}
+
+		off = (off + 2 + len) % data_bytes;
+		remaining -= 2 + len;
+	}
+
+	if (!nr_samples)
+		die("%s: no samples (need at least two records)", path);
+
+	printf("%u samples over %llu seconds\n\n", nr_samples, prev_t - first_t);
+	printf("%-36s %12s %10s %10s %10s %10s\n",
+	       "counter", "total", "avg/s", "p50/s", "p90/s", "p99/s");
+
+	for (unsigned i = 0; i < nr_counters; i++) {
+		if (!total[i])
+			continue;
+
+		double avg = prev_t > first_t
+			? (double) total[i] / (prev_t - first_t) : 0;
+
+		qsort(rates[i], nr_samples, sizeof(double), cmp_double);
+
+		printf("%-36s %12llu %10.1f %10.1f %10.1f %10.1f\n",
+		       i < ARRAY_SIZE(counter_names) ? counter_names[i] : "?",
+		       total[i], avg,
+		       percentile(rates[i], nr_samples, 50),
+		       percentile(rates[i], nr_samples, 90),
+		       percentile(rates[i], nr_samples, 99));
+	}
+
+	for (unsigned i = 0; i < BCH_PERSISTENT_COUNTER_NR; i++)
+		free(rates[i]);
+	free(data);
+	return 0;
+}
+
+/*
+ * bcachefs top: live viewer for counter rates, plus time_stats summaries when
+ * the filesystem is mounted through the kernel and exposes them in sysfs.
+ *
+ * Sampling rereads the superblock once per interval and never issues an ioctl
+ * against the filesystem, so watching a workload doesn't perturb it.
+ */
+
+struct top_entry {
+	unsigned	idx;
+	u64		rate;
+	u64		smoothed;
+	u64		total;
+};
+
+static int top_entry_cmp(const void *_l, const void *_r)
+{
+	const struct top_entry *l = _l, *r = _r;
+
+	return cmp_int(r->smoothed, l->smoothed) ?:
+		cmp_int(r->total, l->total) ?:
+		cmp_int(l->idx, r->idx);
+}
+
+static char *top_sysfs_dir(const char *dev)
+{
+	struct bch_opts opts = bch2_opts_empty();
+	struct bch_sb_handle sb;
+	char uuid[40];
+
+	opt_set(opts, noexcl,	true);
+	opt_set(opts, nochanges, true);
+
+	if (bch2_read_super(dev, &opts, &sb))
+		return NULL;
+
+	uuid_unparse(sb.sb->user_uuid.b, uuid);
+	bch2_free_super(&sb);
+
+	char *dir = mprintf("/sys/fs/bcachefs/%s/time_stats", uuid);
+	struct stat st;
+
+	if (stat(dir, &st) || !S_ISDIR(st.st_mode)) {
+		free(dir);
+		return NULL;
+	}
+
+	return dir;
+}
+
+struct top_time_stat {
+	char		name[32];
+	u64		count;
+	char		mean[32];
+};
+
+/* Pull event count and mean duration out of a sysfs time_stats file: */
+static bool top_time_stat_read(const char *dir, const char *name,
+			       struct top_time_stat *s)
+{
+	char *path = mprintf("%s/%s", dir, name);
+	FILE *f = fopen(path, "r");
+	char *line = NULL;
+	size_t n = 0;
+	bool in_duration = false;
+
+	free(path);
+	if (!f)
+		return false;
+
+	snprintf(s->name, sizeof(s->name), "%s", name);
+	snprintf(s->mean, sizeof(s->mean), "-");
+	s->count = 0;
+
+	while (getline(&line, &n, f) >= 0) {
+		if (sscanf(line, " count: %llu", &s->count) == 1)
+			continue;
+
+		if (strstr(line, "duration of events"))
+			in_duration = true;
+		else if (strstr(line, "time between events"))
+			in_duration = false;
+		else if (in_duration) {
+			char v[16], u[16];
+
+			if (sscanf(line, " mean: %15s %15s", v, u) == 2)
+				snprintf(s->mean, sizeof(s->mean), "%s %s", v, u);
+		}
+	}
+
+	free(line);
+	fclose(f);
+	return s->count != 0;
+}
+
+static void top_usage(void)
+{
+	puts("bcachefs top - live per-second counter rates for a filesystem\n"
+	     "Usage: bcachefs top [OPTION]... device\n"
+	     "\n"
+	     "Shows per-second rates from the superblock counters, and mean\n"
+	     "durations from the kernel's time_stats when the filesystem is\n"
+	     "mounted and visible in sysfs\n"
+	     "\n"
+	     "Options:\n"
+	     "  -i, --interval=seconds      Sample interval (default 1)\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+int cmd_top(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "interval",		required_argument,	NULL, 'i' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	unsigned interval = 1;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "i:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'i':
+			if (kstrtouint(optarg, 10, &interval) || !interval)
+				die("invalid interval");
+			break;
+		case 'h':
+			top_usage();
+			break;
+		}
+	args_shift(optind);
+
+	char *dev = arg_pop();
+	if (!dev)
+		die("please supply a device");
+	if (argc)
+		die("too many arguments");
+
+	char *sysfs = top_sysfs_dir(dev);
+
+	static u64 v[BCH_PERSISTENT_COUNTER_NR], prev[BCH_PERSISTENT_COUNTER_NR],
+		   start[BCH_PERSISTENT_COUNTER_NR], smoothed[BCH_PERSISTENT_COUNTER_NR];
+	struct top_entry e[BCH_PERSISTENT_COUNTER_NR];
+	struct top_time_stat stats[64];
+	bool have_prev = false;
+
+	while (1) {
+		read_sb_counters(dev, v);
+
+		if (!have_prev) {
+			memcpy(start, v, sizeof(v));
+			memcpy(prev, v, sizeof(v));
+			have_prev = true;
+			sleep(interval);
+			continue;
+		}
+
+		unsigned nr = 0;
+		for (unsigned i = 0; i < BCH_PERSISTENT_COUNTER_NR; i++) {
+			/* counters went backwards == reset-counters was run: */
+			u64 rate = v[i] >= prev[i]
+				? (v[i] - prev[i]) / interval : 0;
+
+			smoothed[i] = smoothed[i]
+				? (smoothed[i] * 7 + rate) / 8 : rate;
+
+			u64 total = v[i] >= start[i] ? v[i] - start[i] : v[i];
+			if (!total && !smoothed[i])
+				continue;
+
+			e[nr++] = (struct top_entry) {
+				.idx		= i,
+				.rate		= rate,
+				.smoothed	= smoothed[i],
+				.total		= total,
+			};
+		}
+
+		qsort(e, nr, sizeof(e[0]), top_entry_cmp);
+
+		unsigned nr_stats = 0;
+		if (sysfs) {
+			DIR *d = opendir(sysfs);
+			struct dirent *de;
+
+			while (d && nr_stats < ARRAY_SIZE(stats) &&
+			       (de = readdir(d)))
+				if (de->d_name[0] != '.' &&
+				    top_time_stat_read(sysfs, de->d_name,
+						       &stats[nr_stats]))
+					nr_stats++;
+			if (d)
+				closedir(d);
+		}
+
+		struct winsize ws = { .ws_row = 24 };
+		ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
+
+		unsigned rows = ws.ws_row > 8 ? ws.ws_row - 4 : 4;
+		if (nr_stats)
+			rows = max_t(int, 5, (int) rows - (int) nr_stats - 3);
+		nr = min(nr, rows);
+
+		printf("\33[H\33[J");
+		printf("bcachefs top - %s, %u sec interval\n\n", dev, interval);
+		printf("%-40s %12s %12s %14s\n",
+		       "counter", "rate/s", "smoothed/s", "total");
+
+		for (unsigned i = 0; i < nr; i++)
+			printf("%-40s %12llu %12llu %14llu\n",
+			       counter_names[e[i].idx],
+			       e[i].rate, e[i].smoothed, e[i].total);
+
+		if (nr_stats) {
+			printf("\n%-32s %14s %20s\n",
+			       "time stats", "count", "mean duration");
+			for (unsigned i = 0; i < nr_stats; i++)
+				printf("%-32s %14llu %20s\n",
+				       stats[i].name, stats[i].count,
+				       stats[i].mean);
+		}
+
+		fflush(stdout);
+
+		memcpy(prev, v, sizeof(v));
+		sleep(interval);
+	}
+}
 
 static void reset_counters_usage(void)
 {
@@ -0,0 +1,422 @@
+/*
+ * Persistent filesystem handle daemon:
+ *
+ * Every tool invocation that needs a struct bch_fs pays for bch2_fs_open() -
+ * reading in alloc info and journal and replaying state from scratch, multiple
+ * seconds on a big filesystem. For repeated inspection queries that cost
+ * dwarfs the actual work, so `bcachefs daemon` holds one read-only bch_fs
+ * open and serves inspection requests over a unix socket; `bcachefs query`
+ * is the matching client.
+ *
+ * The filesystem is opened with nochanges, so the daemon never writes; a
+ * daemon must be stopped (`bcachefs query stop`, or a signal) before the
+ * filesystem can be opened read-write by anything else.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "libbcachefs/alloc_background.h"
+#include "libbcachefs/buckets.h"
+#include "libbcachefs/errcode.h"
+#include "libbcachefs/opts.h"
+#include "libbcachefs/sb-members.h"
+#include "libbcachefs/super.h"
+#include "libbcachefs/super-io.h"
+#include "tools-util.h"
+
+#define DAEMON_SOCK_DEFAULT	"/run/bcachefs.sock"
+#define DAEMON_REQUEST_MAX	4096
+#define DAEMON_MAX_ARGS		32
+
+static const char *daemon_sock_path(const char *opt_path)
+{
+	return opt_path ?: getenv("BCACHEFS_DAEMON_SOCK") ?: DAEMON_SOCK_DEFAULT;
+}
+
+/* server: */
+
+static volatile sig_atomic_t daemon_got_signal;
+
+static void daemon_sighandler(int sig)
+{
+	daemon_got_signal = 1;
+}
+
+static void daemon_fs_usage_to_text(struct bch_fs *c, struct printbuf *out)
+{
+	if (!out->nr_tabstops) {
+		printbuf_tabstop_push(out, 16);
+		printbuf_tabstop_push(out, 20);
+	}
+
+	for_each_member_device(c, ca) {
+		struct bch_dev_usage u = bch2_dev_usage_read(ca);
+
+		prt_printf(out, "%s (device %u):", ca->name, ca->dev_idx);
+		prt_newline(out);
+
+		for (unsigned i = 0; i < BCH_DATA_NR; i++) {
+			prt_str(out, "  ");
+			bch2_prt_data_type(out, i);
+			prt_char(out, ':');
+			prt_tab(out);
+			prt_printf(out, "%llu buckets", u.d[i].buckets);
+			prt_tab_rjust(out);
+			prt_units_u64(out, u.d[i].sectors << 9);
+			prt_newline(out);
+		}
+	}
+}
+
+/*
+ * Device health, from the blkdev shim's per-device latency and error ewmas
+ * plus the cumulative member error counters - only meaningful from a
+ * long-lived process like the daemon, which is why this lives here and not
+ * under `bcachefs device`:
+ */
+static void daemon_health_to_text(struct bch_fs *c, struct printbuf *out)
+{
+	if (!out->nr_tabstops)
+		printbuf_tabstop_push(out, 24);
+
+	for_each_member_device(c, ca) {
+		struct block_device *bdev = ca->disk_sb.bdev;
+
+		prt_printf(out, "%s (device %u):", ca->name, ca->dev_idx);
+		prt_newline(out);
+
+		prt_str(out, "  read latency:");
+		prt_tab(out);
+		bch2_pr_time_units(out, bdev ? bdev_io_latency(bdev, READ) : 0);
+		prt_newline(out);
+
+		prt_str(out, "  write latency:");
+		prt_tab(out);
+		bch2_pr_time_units(out, bdev ? bdev_io_latency(bdev, WRITE) : 0);
+		prt_newline(out);
+
+		prt_str(out, "  error score:");
+		prt_tab(out);
+		prt_printf(out, "%llu/%u", bdev ? bdev_io_error_score(bdev) : 0,
+			   BDEV_ERROR_SCORE_MAX);
+		prt_newline(out);
+
+		for (unsigned i = 0; i < BCH_MEMBER_ERROR_NR; i++) {
+			prt_printf(out, "  %s errors:", bch2_member_error_strs[i]);
+			prt_tab(out);
+			prt_printf(out, "%llu", (u64) atomic64_read(&ca->errors[i]));
+			prt_newline(out);
+		}
+	}
+}
+
+static void daemon_options_to_text(struct bch_fs *c, const char *name,
+				   struct printbuf *out)
+{
+	if (name) {
+		int id = bch2_opt_lookup(name);
+
+		if (id < 0) {
+			prt_printf(out, "error: unknown option %s", name);
+			prt_newline(out);
+			return;
+		}
+
+		bch2_opt_to_text(out, c, c->disk_sb.sb, bch2_opt_table + id,
+				 bch2_opt_get_by_id(&c->opts, id),
+				 OPT_SHOW_FULL_LIST);
+		prt_newline(out);
+		return;
+	}
+
+	printbuf_tabstop_push(out, 32);
+
+	for (unsigned id = 0; id < bch2_opts_nr; id++) {
+		const struct bch_option *opt = bch2_opt_table + id;
+
+		if (!(opt->flags & OPT_FS))
+			continue;
+
+		prt_printf(out, "%s:", opt->attr.name);
+		prt_tab(out);
+		bch2_opt_to_text(out, c, c->disk_sb.sb, opt,
+				 bch2_opt_get_by_id(&c->opts, id),
+				 OPT_SHOW_FULL_LIST);
+		prt_newline(out);
+	}
+}
+
+/* returns true if the daemon should exit: */
+static bool daemon_dispatch(struct bch_fs *c, int argc, char **argv,
+			    struct printbuf *out)
+{
+	if (!argc) {
+		prt_str(out, "error: empty request\n");
+	} else if (!strcmp(argv[0], "ping")) {
+		prt_str(out, "pong\n");
+	} else if (!strcmp(argv[0], "super")) {
+		unsigned fields = bch2_sb_field_get(c->disk_sb.sb, members_v2)
+			? 1 << BCH_SB_FIELD_members_v2
+			: 1 << BCH_SB_FIELD_members_v1;
+
+		out->human_readable_units = true;
+		mutex_lock(&c->sb_lock);
+		bch2_sb_to_text(out, c->disk_sb.sb, false, fields);
+		mutex_unlock(&c->sb_lock);
+	} else if (!strcmp(argv[0], "usage")) {
+		out->human_readable_units = true;
+		daemon_fs_usage_to_text(c, out);
+	} else if (!strcmp(argv[0], "health")) {
+		daemon_health_to_text(c, out);
+	} else if (!strcmp(argv[0], "option")) {
+		daemon_options_to_text(c, argc > 1 ? argv[1] : NULL, out);
+	} else if (!strcmp(argv[0], "stop")) {
+		prt_str(out, "stopping\n");
+		return true;
+	} else {
+		prt_printf(out, "error: unknown request %s", argv[0]);
+		prt_newline(out);
+	}
+
+	return false;
+}
+
+static int daemon_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		die("socket path %s too long", path);
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		die("error creating socket: %m");
+
+	unlink(path);
+	if (bind(fd, (void *) &addr, sizeof(addr)))
+		die("error binding %s: %m", path);
+	if (listen(fd, 16))
+		die("error listening on %s: %m", path);
+
+	return fd;
+}
+
+/* requests are argv words separated by nuls, ended by client shutdown(): */
+static int daemon_read_request(int fd, char *buf, char **argv, int max_args)
+{
+	size_t len = 0;
+	int argc = 0;
+
+	while (len < DAEMON_REQUEST_MAX - 1) {
+		ssize_t r = read(fd, buf + len, DAEMON_REQUEST_MAX - 1 - len);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		if (!r)
+			break;
+		len += r;
+	}
+	buf[len] = '\0';
+
+	for (char *p = buf; p < buf + len && argc < max_args; p += strlen(p) + 1)
+		argv[argc++] = p;
+
+	return argc;
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t w = write(fd, buf, len);
+
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return;
+		buf += w;
+		len -= w;
+	}
+}
+
+static void daemon_usage(void)
+{
+	puts("bcachefs daemon - hold a read-only filesystem handle open,\n"
+	     "serving inspection queries over a unix socket\n"
+	     "Usage: bcachefs daemon [OPTION].. devices\n"
+	     "\n"
+	     "Options:\n"
+	     "  -s, --socket=path           socket to listen on\n"
+	     "                              (default $BCACHEFS_DAEMON_SOCK or " DAEMON_SOCK_DEFAULT ")\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+int cmd_daemon(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "socket",		required_argument,	NULL, 's' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	const char *sock_path = NULL;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "s:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 's':
+			sock_path = optarg;
+			break;
+		case 'h':
+			daemon_usage();
+			break;
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("please supply device(s)");
+
+	struct bch_opts opts = bch2_opts_empty();
+
+	opt_set(opts, nochanges,	true);
+	opt_set(opts, read_only,	true);
+	opt_set(opts, norecovery,	true);
+	opt_set(opts, degraded,		true);
+	opt_set(opts, errors,		BCH_ON_ERROR_continue);
+
+	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", argv[0], bch2_err_str(PTR_ERR(c)));
+
+	sock_path = daemon_sock_path(sock_path);
+	int listen_fd = daemon_listen(sock_path);
+
+	struct sigaction sa = { .sa_handler = daemon_sighandler };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("serving %s on %s\n", argv[0], sock_path);
+
+	bool stop = false;
+	while (!stop && !daemon_got_signal) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			die("accept error: %m");
+		}
+
+		char buf[DAEMON_REQUEST_MAX];
+		char *req_argv[DAEMON_MAX_ARGS];
+		int req_argc = daemon_read_request(fd, buf, req_argv,
+						   DAEMON_MAX_ARGS);
+
+		if (req_argc >= 0) {
+			struct printbuf out = PRINTBUF;
+
+			stop = daemon_dispatch(c, req_argc, req_argv, &out);
+			write_all(fd, out.buf, out.pos);
+			printbuf_exit(&out);
+		}
+
+		close(fd);
+	}
+
+	close(listen_fd);
+	unlink(sock_path);
+	bch2_fs_stop(c);
+	return 0;
+}
+
+/* client: */
+
+static void query_usage(void)
+{
+	puts("bcachefs query - query a running bcachefs daemon\n"
+	     "Usage: bcachefs query [OPTION].. request [args]\n"
+	     "\n"
+	     "Requests:\n"
+	     "  ping                        check that the daemon is alive\n"
+	     "  super                       print superblock information\n"
+	     "  usage                       print per device disk usage\n"
+	     "  health                      print per device latency and error scores\n"
+	     "  option [name]               print filesystem option(s)\n"
+	     "  stop                        stop the daemon\n"
+	     "\n"
+	     "Options:\n"
+	     "  -s, --socket=path           socket the daemon is listening on\n"
+	     "                              (default $BCACHEFS_DAEMON_SOCK or " DAEMON_SOCK_DEFAULT ")\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+int cmd_query(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "socket",		required_argument,	NULL, 's' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	const char *sock_path = NULL;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "s:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 's':
+			sock_path = optarg;
+			break;
+		case 'h':
+			query_usage();
+			break;
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("please supply a request");
+
+	sock_path = daemon_sock_path(sock_path);
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen(sock_path) >= sizeof(addr.sun_path))
+		die("socket path %s too long", sock_path);
+	strcpy(addr.sun_path, sock_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		die("error creating socket: %m");
+
+	if (connect(fd, (void *) &addr, sizeof(addr)))
+		die("error connecting to %s (is the daemon running?): %m",
+		    sock_path);
+
+	for (int i = 0; i < argc; i++)
+		write_all(fd, argv[i], strlen(argv[i]) + 1);
+	shutdown(fd, SHUT_WR);
+
+	char buf[4096];
+	ssize_t r;
+	while ((r = read(fd, buf, sizeof(buf))) != 0) {
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			die("error reading reply: %m");
+		fwrite(buf, 1, r, stdout);
+	}
+
+	close(fd);
+	return 0;
+}
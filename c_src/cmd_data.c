@@ -1,11 +1,22 @@
 
 
+#include <getopt.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "libbcachefs/bcachefs_ioctl.h"
+#include "libbcachefs/alloc_foreground.h"
+#include "libbcachefs/backpointers.h"
 #include "libbcachefs/btree_cache.h"
+#include "libbcachefs/btree_io.h"
+#include "libbcachefs/checksum.h"
+#include "libbcachefs/errcode.h"
+#include "libbcachefs/extents.h"
 #include "libbcachefs/move.h"
+#include "libbcachefs/sb-members.h"
+#include "libbcachefs/super.h"
 
 #include "cmds.h"
 #include "libbcachefs.h"
@@ -17,6 +28,8 @@ int data_usage(void)
 	     "\n"
 	     "Commands:\n"
 	     "  rereplicate                     Rereplicate degraded data\n"
+	     "  scrub                           Verify checksums of all data and metadata\n"
+	     "  defragment                      Rewrite fragmented extents contiguously (offline)\n"
 	     "  job                             Kick off low level data jobs\n"
 	     "\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
@@ -64,6 +77,431 @@ int cmd_data_rereplicate(int argc, char *argv[])
 	});
 }
 
+static void data_scrub_usage(void)
+{
+	puts("bcachefs data scrub\n"
+	     "Usage: bcachefs data scrub [OPTION]... <devices>\n"
+	     "\n"
+	     "Walks each device's buckets in physical order via the backpointers\n"
+	     "btree, reads all data and btree nodes sequentially, verifies\n"
+	     "checksums and reports a per-device error map\n"
+	     "\n"
+	     "Options:\n"
+	     "  -r, --rate=rate             limit reads to rate, in MB/s\n"
+	     "  -s, --sample=N              verify-lite: only check 1 of every N\n"
+	     "                              buckets, chosen by hash of bucket number;\n"
+	     "                              escalates to a full pass on any error\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "\n"
+	     "Exits with status 1 if any errors were found\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * Scrub: the backpointers btree is keyed by device and bucket offset, so
+ * iterating it gives us every extent and btree node replica on a device in
+ * physical order - on rotational storage that's the difference between a
+ * sequential pass and a filesystem-order seek storm.
+ *
+ * Reads bypass the btree node cache and go straight to the device being
+ * scrubbed: we're verifying what's actually on disk, per replica.
+ */
+
+#define SCRUB_BUF_ALIGN		4096U
+
+struct scrub_stats {
+	u64		sectors_scrubbed;
+	u64		nr_scrubbed;
+	u64		nr_csum_errors;
+	u64		nr_io_errors;
+	u64		nr_missing;
+};
+
+struct scrub_ctx {
+	unsigned	sample;		/* check 1 of every N buckets, 0 = all */
+	u64		rate_bytes;	/* bytes/sec, 0 = unlimited */
+	u64		bytes_done;
+	struct timespec	start;
+	void		*buf;
+	size_t		buf_bytes;
+	struct btree	*scratch;
+	struct scrub_stats stats;
+};
+
+static void scrub_rate_limit(struct scrub_ctx *ctx, size_t bytes)
+{
+	struct timespec now;
+
+	if (!ctx->rate_bytes)
+		return;
+
+	ctx->bytes_done += bytes;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	u64 elapsed_ns = (now.tv_sec - ctx->start.tv_sec) * NSEC_PER_SEC +
+		(now.tv_nsec - ctx->start.tv_nsec);
+	u64 expected_ns = ctx->bytes_done * NSEC_PER_SEC / ctx->rate_bytes;
+
+	if (expected_ns > elapsed_ns)
+		usleep((expected_ns - elapsed_ns) / NSEC_PER_USEC);
+}
+
+/*
+ * Read @len bytes at @offset through an aligned bounce buffer (the fd is
+ * O_DIRECT), returning a pointer to the data or NULL on IO error:
+ */
+static void *scrub_read(struct scrub_ctx *ctx, int fd, size_t len, u64 offset)
+{
+	u64 start	= round_down(offset, SCRUB_BUF_ALIGN);
+	size_t pad	= offset - start;
+	size_t window	= round_up(pad + len, SCRUB_BUF_ALIGN);
+	size_t done	= 0;
+
+	if (window > ctx->buf_bytes) {
+		free(ctx->buf);
+		ctx->buf_bytes	= window;
+		ctx->buf	= aligned_alloc(SCRUB_BUF_ALIGN, window);
+		if (!ctx->buf)
+			die("error allocating scrub buffer");
+	}
+
+	while (done < pad + len) {
+		ssize_t r = pread(fd, ctx->buf + done, window - done, start + done);
+
+		if (r <= 0)
+			return NULL;
+		done += r;
+	}
+
+	scrub_rate_limit(ctx, done);
+	return ctx->buf + pad;
+}
+
+static void scrub_error(struct bch_fs *c, struct bpos bp_pos,
+			struct bch_backpointer bp, const char *msg)
+{
+	struct printbuf buf = PRINTBUF;
+
+	prt_printf(&buf, "  bucket %llu ",
+		   bp_pos_to_bucket(c, bp_pos).offset);
+	bch2_backpointer_to_text(&buf, &bp);
+	printf("%s: %s\n", buf.buf, msg);
+	printbuf_exit(&buf);
+}
+
+static void scrub_btree_node(struct bch_fs *c, struct bch_dev *ca,
+			     struct scrub_ctx *ctx,
+			     struct bpos bp_pos, struct bch_backpointer bp,
+			     struct bkey_i *k)
+{
+	if (!ctx->scratch) {
+		ctx->scratch = __bch2_btree_node_mem_alloc(c);
+		if (!ctx->scratch)
+			die("error allocating node verify buffer");
+		list_del_init(&ctx->scratch->list);
+	}
+
+	struct btree *v = ctx->scratch;
+
+	bkey_copy(&v->key, k);
+	v->written	= 0;
+	v->c.level	= bp.level - 1;
+	v->c.btree_id	= bp.btree_id;
+	bch2_btree_keys_init(v);
+
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(k));
+	bkey_for_each_ptr(ptrs, ptr) {
+		if (ptr->dev != ca->dev_idx)
+			continue;
+
+		void *data = scrub_read(ctx, ca->disk_sb.bdev->bd_fd,
+					btree_buf_bytes(v),
+					(u64) ptr->offset << 9);
+		if (!data) {
+			scrub_error(c, bp_pos, bp, "IO error");
+			ctx->stats.nr_io_errors++;
+			return;
+		}
+
+		memcpy(v->data, data, btree_buf_bytes(v));
+
+		bool saw_error = false;
+		int ret = bch2_btree_node_read_done(c, ca, v, false, &saw_error);
+		if (ret || saw_error) {
+			scrub_error(c, bp_pos, bp,
+				    ret ? bch2_err_str(ret)
+					: "recoverable bset errors (node readable with repair)");
+			ctx->stats.nr_csum_errors++;
+		}
+
+		ctx->stats.sectors_scrubbed += btree_buf_bytes(v) >> 9;
+		return;
+	}
+}
+
+static void scrub_data(struct bch_fs *c, struct bch_dev *ca,
+		       struct scrub_ctx *ctx,
+		       struct bpos bp_pos, struct bch_backpointer bp,
+		       struct bversion version, struct extent_ptr_decoded p)
+{
+	size_t bytes	= (size_t) p.crc.compressed_size << 9;
+	u64 offset	= (u64) (p.ptr.offset - p.crc.offset) << 9;
+
+	void *data = scrub_read(ctx, ca->disk_sb.bdev->bd_fd, bytes, offset);
+	if (!data) {
+		scrub_error(c, bp_pos, bp, "IO error");
+		ctx->stats.nr_io_errors++;
+		return;
+	}
+
+	ctx->stats.sectors_scrubbed += p.crc.compressed_size;
+
+	if (!p.crc.csum_type)
+		return;
+
+	struct nonce nonce = extent_nonce(version, p.crc);
+	struct bch_csum csum = bch2_checksum(c, p.crc.csum_type, nonce, data, bytes);
+
+	if (bch2_crc_cmp(csum, p.crc.csum)) {
+		scrub_error(c, bp_pos, bp, "checksum error");
+		ctx->stats.nr_csum_errors++;
+	}
+}
+
+static int scrub_one(struct btree_trans *trans, struct bch_dev *ca,
+		     struct scrub_ctx *ctx,
+		     struct bpos bp_pos, struct bch_backpointer bp)
+{
+	struct bch_fs *c = trans->c;
+	BKEY_PADDED_ONSTACK(k, BKEY_EXTENT_U64s_MAX) tmp;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+
+	k = bch2_backpointer_get_key(trans, &iter, bp_pos, bp, 0);
+	int ret = bkey_err(k);
+	if (ret)
+		return ret;
+	if (!k.k) {
+		ctx->stats.nr_missing++;
+		return 0;
+	}
+
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+	bool found = false;
+
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry)
+		if (p.ptr.dev == ca->dev_idx) {
+			found = true;
+			break;
+		}
+
+	bkey_reassemble(&tmp.k, k);
+	bch2_trans_iter_exit(trans, &iter);
+
+	/* Don't hold btree locks over (rate limited) IO: */
+	bch2_trans_unlock(trans);
+
+	if (!found) {
+		ctx->stats.nr_missing++;
+		return 0;
+	}
+
+	if (bp.level)
+		scrub_btree_node(c, ca, ctx, bp_pos, bp, &tmp.k);
+	else
+		scrub_data(c, ca, ctx, bp_pos, bp, tmp.k.k.version, p);
+
+	ctx->stats.nr_scrubbed++;
+	return 0;
+}
+
+/*
+ * Sampling: select buckets by hash of bucket number, not by interval - extents
+ * aren't distributed uniformly across buckets, and hashing also makes the
+ * sample independent of allocation order. The selection is deterministic, so
+ * coverage is a well-defined 1/N subset rather than a different roll per run:
+ */
+static bool scrub_bucket_sampled(struct bch_fs *c, struct scrub_ctx *ctx,
+				 struct bpos bp_pos)
+{
+	return !ctx->sample ||
+		!(hash_64(bp_pos_to_bucket(c, bp_pos).offset, 32) % ctx->sample);
+}
+
+static int scrub_device(struct bch_fs *c, struct bch_dev *ca, struct scrub_ctx *ctx)
+{
+	int ret;
+
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	ctx->bytes_done = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ctx->start);
+
+	printf("Device %u (%s):\n", ca->dev_idx, ca->name);
+	if (ctx->sample)
+		printf("  sampling 1 of every %u buckets\n", ctx->sample);
+
+	ret = bch2_trans_run(c,
+		for_each_btree_key_upto(trans, iter, BTREE_ID_backpointers,
+				POS(ca->dev_idx, 0), POS(ca->dev_idx, U64_MAX),
+				0, k,
+			k.k->type == KEY_TYPE_backpointer &&
+			scrub_bucket_sampled(c, ctx, k.k->p)
+				? scrub_one(trans, ca, ctx, k.k->p,
+					    *bkey_s_c_to_backpointer(k).v)
+				: 0));
+	if (ret)
+		return ret;
+
+	struct scrub_stats *s = &ctx->stats;
+	printf("  %llu sectors in %llu extents/nodes scrubbed, %llu checksum errors, %llu IO errors",
+	       s->sectors_scrubbed, s->nr_scrubbed,
+	       s->nr_csum_errors, s->nr_io_errors);
+	if (s->nr_missing)
+		printf(", %llu backpointers with no matching key", s->nr_missing);
+	printf("\n");
+	return 0;
+}
+
+int cmd_data_scrub(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "rate",		required_argument,	NULL, 'r' },
+		{ "sample",		required_argument,	NULL, 's' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_opts opts = bch2_opts_empty();
+	struct scrub_ctx ctx = {};
+	u64 rate_mb;
+	int opt;
+
+	opt_set(opts, read_only,	true);
+	opt_set(opts, nochanges,	true);
+	opt_set(opts, degraded,		true);
+	opt_set(opts, errors,		BCH_ON_ERROR_continue);
+	opt_set(opts, fix_errors,	FSCK_FIX_no);
+
+	while ((opt = getopt_long(argc, argv, "r:s:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'r':
+			if (kstrtou64(optarg, 10, &rate_mb) || !rate_mb)
+				die("invalid rate");
+			ctx.rate_bytes = rate_mb << 20;
+			break;
+		case 's':
+			if (kstrtouint(optarg, 10, &ctx.sample) || !ctx.sample)
+				die("invalid sample rate");
+			break;
+		case 'h':
+			data_scrub_usage();
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s) to scrub");
+
+	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(c))
+		die("error opening devices: %s", bch2_err_str(PTR_ERR(c)));
+
+	u64 nr_errors = 0;
+	int ret = 0;
+
+	for_each_online_member(c, ca) {
+		if (!ret)
+			ret = scrub_device(c, ca, &ctx);
+
+		/*
+		 * A sampled pass finding anything means this device can't be
+		 * trusted on statistical coverage alone:
+		 */
+		if (!ret && ctx.sample &&
+		    (ctx.stats.nr_csum_errors || ctx.stats.nr_io_errors)) {
+			printf("  errors found while sampling, escalating to full verify\n");
+
+			unsigned sample = ctx.sample;
+			ctx.sample = 0;
+			ret = scrub_device(c, ca, &ctx);
+			ctx.sample = sample;
+		}
+
+		nr_errors += ctx.stats.nr_csum_errors + ctx.stats.nr_io_errors;
+	}
+
+	if (ret)
+		die("scrub error: %s", bch2_err_str(ret));
+
+	free(ctx.buf);
+	bch2_fs_stop(c);
+
+	return nr_errors != 0;
+}
+
+static void data_defragment_usage(void)
+{
+	puts("bcachefs data defragment\n"
+	     "Usage: bcachefs data defragment [OPTION]... <devices>\n"
+	     "\n"
+	     "Rewrites runs of small logically adjacent extents through a single\n"
+	     "write point: the new allocations are physically contiguous, so the\n"
+	     "rewritten pieces merge back into max-sized extents. Runs offline, on\n"
+	     "an unmounted filesystem\n"
+	     "\n"
+	     "Options:\n"
+	     "  -t sectors                  rewrite extents smaller than this\n"
+	     "                              (default 128)\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+int cmd_data_defragment(int argc, char *argv[])
+{
+	struct bch_opts opts = bch2_opts_empty();
+	unsigned frag_sectors = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:h")) != -1)
+		switch (opt) {
+		case 't':
+			if (kstrtouint(optarg, 10, &frag_sectors))
+				die("invalid fragmentation threshold");
+			break;
+		case 'h':
+			data_defragment_usage();
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s) to defragment");
+
+	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(c))
+		die("error opening devices: %s", bch2_err_str(PTR_ERR(c)));
+
+	struct bch_move_stats stats;
+
+	bch2_move_stats_init(&stats, "defragment");
+
+	int ret = bch2_defragment_data(c,
+				BBPOS(0, POS_MIN),
+				BBPOS(BTREE_ID_NR, POS_MAX),
+				frag_sectors, &stats,
+				writepoint_hashed((unsigned long) current));
+	if (ret)
+		die("defragment error: %s", bch2_err_str(ret));
+
+	printf("%llu sectors rewritten\n",
+	       (u64) atomic64_read(&stats.sectors_moved));
+
+	bch2_fs_stop(c);
+	return 0;
+}
+
 static void data_job_usage(void)
 {
 	puts("bcachefs data job\n"
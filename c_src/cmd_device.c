@@ -10,6 +10,7 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "libbcachefs/bcachefs.h"
@@ -37,6 +38,7 @@ int device_usage(void)
             "  set-state               mark a device as failed\n"
             "  resize                  resize filesystem on a device\n"
             "  resize-journal          resize journal on a device\n"
+            "  benchmark               measure read performance, store it in the superblock\n"
             "\n"
             "Report bugs to <linux-bcachefs@vger.kernel.org>");
        return 0;
@@ -51,30 +53,183 @@ static void device_add_usage(void)
 	     "  -S, --fs_size=size          Size of filesystem on device\n"
 	     "  -B, --bucket=size           Bucket size\n"
 	     "  -D, --discard               Enable discards\n"
+	     "  -C, --discard_chunk=size    Discard in chunks of this size (default 2G)\n"
 	     "  -l, --label=label           Disk label\n"
 	     "  -f, --force                 Use device even if it appears to already be formatted\n"
+	     "  -R, --rebalance             Migrate data off the fullest devices after adding,\n"
+	     "                              until free space is roughly equal across devices\n"
+	     "  -r, --rate=rate             Limit rebalance moves to rate, in MB/s\n"
 	     "  -h, --help                  Display this help and exit\n"
 	     "\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 }
 
+/*
+ * Post-add rebalance: rather than rewriting everything like data rereplicate,
+ * migrate data off the fullest device - the allocator prefers the emptiest
+ * devices, so moved extents land mostly on the new one - and stop the move job
+ * early once free space has evened out. Progress state is just the device
+ * usage numbers, so an interrupted rebalance resumes by running it again.
+ */
+#define REBALANCE_SLACK_PERCENT		5
+
+static unsigned dev_fullness_pct(struct bchfs_handle fs, unsigned idx)
+{
+	struct bch_ioctl_dev_usage_v2 *u = bchu_dev_usage(fs, idx);
+	u64 used = 0;
+	unsigned i, ret;
+
+	for (i = 0; i < u->nr_data_types; i++)
+		switch (i) {
+		case BCH_DATA_free:
+		case BCH_DATA_need_discard:
+		case BCH_DATA_need_gc_gens:
+			break;
+		default:
+			used += u->d[i].buckets;
+		}
+
+	ret = u->nr_buckets ? used * 100 / u->nr_buckets : 0;
+	free(u);
+	return ret;
+}
+
+/*
+ * Returns true if the migrate job ran to completion (nothing left that can be
+ * moved off @src), false if we stopped it at the fullness target:
+ */
+static bool dev_migrate_until_balanced(struct bchfs_handle fs, unsigned src,
+				       unsigned target_pct, unsigned rate_mb)
+{
+	struct bch_ioctl_data cmd = {
+		.op		= BCH_DATA_OP_migrate,
+		.start_btree	= 0,
+		.start_pos	= POS_MIN,
+		.end_btree	= BTREE_ID_NR,
+		.end_pos	= POS_MAX,
+		.migrate.dev	= src,
+	};
+	int progress_fd = xioctl(fs.ioctl_fd, BCH_IOCTL_DATA, &cmd);
+	u64 rate_sectors = (u64) rate_mb << (20 - 9);
+	u64 prev_done = 0;
+	bool done = false;
+
+	while (1) {
+		struct bch_ioctl_data_event e;
+
+		if (read(progress_fd, &e, sizeof(e)) != sizeof(e))
+			die("error reading from progress fd: %m");
+
+		if (e.type)
+			continue;
+
+		if (e.p.data_type == U8_MAX) {
+			done = true;
+			break;
+		}
+
+		unsigned pct = dev_fullness_pct(fs, src);
+
+		printf("\33[2K\rdevice %u: %u%% full, target %u%%",
+		       src, pct, target_pct);
+		fflush(stdout);
+
+		if (pct <= target_pct)
+			break;
+
+		/*
+		 * Rate limiting is done from this side, by stopping the job
+		 * and sleeping off the overshoot before reissuing it - same
+		 * scheme as bchu_data_rate(). We can only resume from the
+		 * reported position in the user data phase; otherwise restart
+		 * from the beginning, where already-migrated extents no longer
+		 * match the job's predicate:
+		 */
+		u64 d = prev_done && e.p.sectors_done >= prev_done
+			? e.p.sectors_done - prev_done
+			: 0;
+		prev_done = e.p.sectors_done;
+
+		if (rate_sectors && d > rate_sectors) {
+			close(progress_fd);
+			sleep(d / rate_sectors);
+
+			if (e.p.data_type == BCH_DATA_user) {
+				cmd.start_btree	= e.p.btree_id;
+				cmd.start_pos	= e.p.pos;
+			}
+
+			progress_fd	= xioctl(fs.ioctl_fd, BCH_IOCTL_DATA, &cmd);
+			prev_done	= 0;
+			continue;
+		}
+
+		sleep(1);
+	}
+
+	/* closing the progress fd stops the job: */
+	close(progress_fd);
+	printf("\n");
+	return done;
+}
+
+static void dev_add_rebalance(struct bchfs_handle fs, unsigned rate_mb)
+{
+	dev_names devs = bchu_fs_get_devices(fs);
+
+	while (1) {
+		unsigned min_pct = 100, max_pct = 0, mean_pct = 0, src = 0;
+
+		darray_for_each(devs, dev) {
+			unsigned pct = dev_fullness_pct(fs, dev->idx);
+
+			if (pct > max_pct) {
+				max_pct = pct;
+				src = dev->idx;
+			}
+			min_pct	 = min(min_pct, pct);
+			mean_pct += pct;
+		}
+		mean_pct /= devs.nr;
+
+		if (max_pct <= min_pct + REBALANCE_SLACK_PERCENT) {
+			printf("Devices balanced: fullness %u%%-%u%%\n",
+			       min_pct, max_pct);
+			break;
+		}
+
+		printf("Fullness %u%%-%u%%: migrating data off device %u\n",
+		       min_pct, max_pct, src);
+
+		if (dev_migrate_until_balanced(fs, src, mean_pct, rate_mb)) {
+			printf("Nothing further to move off device %u\n", src);
+			break;
+		}
+	}
+}
+
 int cmd_device_add(int argc, char *argv[])
 {
 	static const struct option longopts[] = {
 		{ "fs_size",		required_argument,	NULL, 'S' },
 		{ "bucket",		required_argument,	NULL, 'B' },
 		{ "discard",		no_argument,		NULL, 'D' },
+		{ "discard_chunk",	required_argument,	NULL, 'C' },
 		{ "label",		required_argument,	NULL, 'l' },
 		{ "force",		no_argument,		NULL, 'f' },
+		{ "rebalance",		no_argument,		NULL, 'R' },
+		{ "rate",		required_argument,	NULL, 'r' },
 		{ "help",		no_argument,		NULL, 'h' },
 		{ NULL }
 	};
 	struct format_opts format_opts	= format_opts_default();
 	struct dev_opts dev_opts	= dev_opts_default();
-	bool force = false;
+	bool force = false, rebalance = false;
+	u64 discard_chunk = 0;
+	unsigned rate_mb = 0;
 	int opt;
 
-	while ((opt = getopt_long(argc, argv, "t:fh",
+	while ((opt = getopt_long(argc, argv, "t:C:fRr:h",
 				  longopts, NULL)) != -1)
 		switch (opt) {
 		case 'S':
@@ -88,12 +243,23 @@ int cmd_device_add(int argc, char *argv[])
 		case 'D':
 			dev_opts.discard = true;
 			break;
+		case 'C':
+			if (bch2_strtoull_h(optarg, &discard_chunk))
+				die("bad discard_chunk %s", optarg);
+			break;
 		case 'l':
 			dev_opts.label = strdup(optarg);
 			break;
 		case 'f':
 			force = true;
 			break;
+		case 'R':
+			rebalance = true;
+			break;
+		case 'r':
+			if (kstrtouint(optarg, 10, &rate_mb) || !rate_mb)
+				die("invalid rate");
+			break;
 		case 'h':
 			device_add_usage();
 			exit(EXIT_SUCCESS);
@@ -117,6 +283,18 @@ int cmd_device_add(int argc, char *argv[])
 	if (ret)
 		die("Error opening %s: %s", dev_opts.path, strerror(-ret));
 
+	/*
+	 * The bulk discard overlaps with writing the new member superblock; we
+	 * wait before the add ioctl, after which the filesystem can allocate
+	 * from the device:
+	 */
+	struct discard_ctx discard = { 0 };
+
+	if (dev_opts.discard)
+		discard_dev_push(&discard, dev_opts.path, dev_opts.bdev->bd_fd);
+
+	discard_start(&discard, discard_chunk);
+
 	struct bch_opt_strs fs_opt_strs;
 	memset(&fs_opt_strs, 0, sizeof(fs_opt_strs));
 
@@ -132,7 +310,13 @@ int cmd_device_add(int argc, char *argv[])
 					format_opts,
 					&dev_opts, 1);
 	free(sb);
+
+	discard_wait(&discard, false);
+
 	bchu_disk_add(fs, dev_opts.path);
+
+	if (rebalance)
+		dev_add_rebalance(fs, rate_mb);
 	return 0;
 }
 
@@ -294,6 +478,7 @@ static void device_evacuate_usage(void)
 	     "Usage: bcachefs device evacuate [OPTION]... device\n"
 	     "\n"
 	     "Options:\n"
+	     "  -r, --rate=rate             Limit the move rate, in MB/s\n"
 	     "  -h, --help                  Display this help and exit\n"
 	     "\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
@@ -301,10 +486,20 @@ static void device_evacuate_usage(void)
 
 int cmd_device_evacuate(int argc, char *argv[])
 {
+	static const struct option longopts[] = {
+		{ "rate",		required_argument,	NULL, 'r' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	unsigned rate_mb = 0;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "h")) != -1)
+	while ((opt = getopt_long(argc, argv, "r:h", longopts, NULL)) != -1)
 		switch (opt) {
+		case 'r':
+			if (kstrtouint(optarg, 10, &rate_mb) || !rate_mb)
+				die("invalid rate");
+			break;
 		case 'h':
 			device_evacuate_usage();
 			exit(EXIT_SUCCESS);
@@ -330,14 +525,14 @@ int cmd_device_evacuate(int argc, char *argv[])
 
 	free(u);
 
-	return bchu_data(fs, (struct bch_ioctl_data) {
+	return bchu_data_rate(fs, (struct bch_ioctl_data) {
 		.op		= BCH_DATA_OP_migrate,
 		.start_btree	= 0,
 		.start_pos	= POS_MIN,
 		.end_btree	= BTREE_ID_NR,
 		.end_pos	= POS_MAX,
 		.migrate.dev	= dev_idx,
-	});
+	}, rate_mb);
 }
 
 static void device_set_state_usage(void)
@@ -645,3 +840,119 @@ int cmd_device_resize_journal(int argc, char *argv[])
 	}
 	return 0;
 }
+
+static void device_benchmark_usage(void)
+{
+	puts("bcachefs device benchmark - measure device read performance\n"
+	     "Usage: bcachefs device benchmark [OPTION]... <devices>\n"
+	     "\n"
+	     "Measures sequential (1MiB ops) and random (4KiB ops) read rates on\n"
+	     "every member device given and records them in the superblock members\n"
+	     "section, where replica selection uses them as an initial latency\n"
+	     "estimate until runtime measurements take over.  Write rates are not\n"
+	     "measured: that would mean writing over live data.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -t, --time=seconds        Measurement time per test (default 2)\n"
+	     "  -h, --help                Display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+#define BENCH_SEQ_BYTES		(1U << 20)
+#define BENCH_RAND_BYTES	4096U
+
+static u32 benchmark_read(struct bch_dev *ca, void *buf,
+			  unsigned op_bytes, bool random, unsigned seconds)
+{
+	int fd = ca->disk_sb.bdev->bd_fd;
+	u64 dev_bytes = ca->mi.nbuckets * ((u64) ca->mi.bucket_size << 9);
+	u64 nr_ops = dev_bytes / op_bytes;
+	u64 offset = 0, ops = 0, elapsed_ns;
+	struct timespec start, now;
+
+	if (!nr_ops)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	do {
+		if (random)
+			offset = (((u64) rand() << 31 | rand()) % nr_ops) * op_bytes;
+
+		ssize_t r = pread(fd, buf, op_bytes, offset);
+		if (r != op_bytes)
+			die("read error benchmarking %s: %m", ca->name);
+
+		offset += op_bytes;
+		if (offset + op_bytes > dev_bytes)
+			offset = 0;
+		ops++;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed_ns = (now.tv_sec - start.tv_sec) * NSEC_PER_SEC +
+			now.tv_nsec - start.tv_nsec;
+	} while (elapsed_ns < (u64) seconds * NSEC_PER_SEC);
+
+	return div64_u64(ops * NSEC_PER_SEC, elapsed_ns);
+}
+
+int cmd_device_benchmark(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "time",		1, NULL, 't' },
+		{ "help",		0, NULL, 'h' },
+		{ NULL }
+	};
+	unsigned seconds = 2;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "t:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 't':
+			if (kstrtouint(optarg, 10, &seconds) || !seconds)
+				die("invalid measurement time %s", optarg);
+			break;
+		case 'h':
+			device_benchmark_usage();
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s) to benchmark");
+
+	struct bch_opts opts = bch2_opts_empty();
+	opt_set(opts, nostart, true);
+
+	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", argv[0], bch2_err_str(PTR_ERR(c)));
+
+	void *buf = bdev_aligned_buf_get(BENCH_SEQ_BYTES);
+
+	srand(time(NULL));
+
+	for_each_online_member(c, ca) {
+		printf("benchmarking %s:\n", ca->name);
+
+		u32 seq_rate  = benchmark_read(ca, buf, BENCH_SEQ_BYTES, false, seconds);
+		u32 rand_rate = benchmark_read(ca, buf, BENCH_RAND_BYTES, true, seconds);
+
+		printf("  sequential read: %u MiB/s\n", seq_rate);
+		printf("  random read:     %u iops\n", rand_rate);
+
+		mutex_lock(&c->sb_lock);
+		struct bch_member *m = bch2_members_v2_get_mut(c->disk_sb.sb, ca->dev_idx);
+		m->iops[BCH_IOPS_seqread]  = cpu_to_le32(seq_rate);
+		m->iops[BCH_IOPS_randread] = cpu_to_le32(rand_rate);
+		mutex_unlock(&c->sb_lock);
+	}
+
+	mutex_lock(&c->sb_lock);
+	bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
+
+	bdev_aligned_buf_put(buf);
+	bch2_fs_stop(c);
+	return 0;
+}
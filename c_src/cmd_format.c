@@ -25,7 +25,9 @@
 #include "crypto.h"
 #include "libbcachefs/darray.h"
 #include "libbcachefs/errcode.h"
+#include "libbcachefs/journal.h"
 #include "libbcachefs/opts.h"
+#include "libbcachefs/sb-members.h"
 #include "libbcachefs/super-io.h"
 #include "libbcachefs/util.h"
 
@@ -40,8 +42,11 @@ x(0,	superblock_size,	required_argument)	\
 x(0,	bucket_size,		required_argument)	\
 x('l',	label,			required_argument)	\
 x(0,	discard,		no_argument)		\
+x(0,	discard_chunk,		required_argument)	\
 x(0,	data_allowed,		required_argument)	\
 x(0,	durability,		required_argument)	\
+x(0,	expect_inodes,		required_argument)	\
+x(0,	expect_data_size,	required_argument)	\
 x(0,	version,		required_argument)	\
 x(0,	no_initialize,		no_argument)		\
 x('f',	force,			no_argument)		\
@@ -65,6 +70,10 @@ static void usage(void)
 	     "  -L, --fs_label=label\n"
 	     "  -U, --uuid=uuid\n"
 	     "      --superblock_size=size\n"
+	     "      --discard_chunk=size    Discard in chunks of this size (default 2G)\n"
+	     "      --expect_inodes=#       Expected number of inodes, sizes metadata for a bulk load\n"
+	     "      --expect_data_size=size Expected amount of data, sizes the journal and btree\n"
+	     "                              nodes for a bulk load\n"
 	     "\n"
 	     "Device specific options:");
 
@@ -120,6 +129,8 @@ int cmd_format(int argc, char *argv[])
 	struct dev_opts dev_opts = dev_opts_default();
 	bool force = false, no_passphrase = false, quiet = false, initialize = true, verbose = false;
 	bool unconsumed_dev_option = false;
+	u64 discard_chunk = 0;
+	u64 expect_inodes = 0, expect_data_size = 0;
 	unsigned v;
 	int opt;
 
@@ -185,6 +196,10 @@ int cmd_format(int argc, char *argv[])
 			dev_opts.discard = true;
 			unconsumed_dev_option = true;
 			break;
+		case O_discard_chunk:
+			if (bch2_strtoull_h(optarg, &discard_chunk))
+				die("bad discard_chunk %s", optarg);
+			break;
 		case O_data_allowed:
 			dev_opts.data_allowed =
 				read_flag_list_or_die(optarg,
@@ -197,6 +212,14 @@ int cmd_format(int argc, char *argv[])
 				die("invalid durability");
 			unconsumed_dev_option = true;
 			break;
+		case O_expect_inodes:
+			if (bch2_strtoull_h(optarg, &expect_inodes))
+				die("bad expect_inodes %s", optarg);
+			break;
+		case O_expect_data_size:
+			if (bch2_strtoull_h(optarg, &expect_data_size))
+				die("bad expect_data_size %s", optarg);
+			break;
 		case O_version:
 			if (kstrtouint(optarg, 10, &opts.version))
 				die("invalid version");
@@ -247,6 +270,31 @@ int cmd_format(int argc, char *argv[])
 			die("Error opening %s: %s", dev_opts.path, strerror(-ret));
 	}
 
+	/*
+	 * Workload hints: bulk loading a fresh filesystem spends its first
+	 * hour splitting undersized btree nodes and cycling an undersized
+	 * journal. When we're told what's coming, format with bigger btree
+	 * nodes (bch2_pick_bucket_size() scales the bucket size to match) and
+	 * grow the journal below, before first use:
+	 */
+	if ((expect_inodes	> 1U << 20 ||
+	     expect_data_size	> 1ULL << 40) &&
+	    !opt_defined(fs_opts, btree_node_size))
+		opt_set(fs_opts, btree_node_size, 512 << 10);
+
+	/*
+	 * The bulk discard overlaps with the superblock writes; we wait before
+	 * the first mount since the allocator can place the journal and btree
+	 * roots anywhere:
+	 */
+	struct discard_ctx discard = { 0 };
+
+	darray_for_each(devices, dev)
+		if (dev->discard)
+			discard_dev_push(&discard, dev->path, dev->bdev->bd_fd);
+
+	discard_start(&discard, discard_chunk);
+
 	struct bch_sb *sb =
 		bch2_format(fs_opt_strs,
 			    fs_opts,
@@ -273,6 +321,8 @@ int cmd_format(int argc, char *argv[])
 
 	darray_exit(&devices);
 
+	discard_wait(&discard, quiet);
+
 	if (initialize) {
 		struct bch_opts mount_opts = bch2_opts_empty();
 
@@ -290,6 +340,25 @@ int cmd_format(int argc, char *argv[])
 			die("error opening %s: %s", device_paths.data[0],
 			    bch2_err_str(PTR_ERR(c)));
 
+		if (expect_data_size) {
+			/* ~2% of the expected ingest, split across devices: */
+			u64 per_dev = min(expect_data_size / 50, 32ULL << 30) /
+				device_paths.nr;
+
+			for_each_online_member(c, ca) {
+				u64 nr = min((per_dev >> 9) / ca->mi.bucket_size,
+					     ca->mi.nbuckets / 4);
+
+				if (nr <= ca->journal.nr)
+					continue;
+
+				int ret = bch2_set_nr_journal_buckets(c, ca, nr);
+				if (ret)
+					fprintf(stderr, "error sizing journal on %s: %s\n",
+						ca->name, bch2_err_str(ret));
+			}
+		}
+
 		bch2_fs_stop(c);
 	}
 
@@ -306,6 +375,8 @@ static void show_super_usage(void)
 	     "Options:\n"
 	     "  -f, --fields=(fields)       list of sections to print\n"
 	     "      --field-only=fiel)      print superblock section only, no header\n"
+	     "  -r, --raw                   dump superblock as raw binary - the whole\n"
+	     "                              superblock, or one --field-only section\n"
 	     "  -l, --layout                print superblock layout\n"
 	     "  -h, --help                  display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
@@ -317,17 +388,19 @@ int cmd_show_super(int argc, char *argv[])
 	static const struct option longopts[] = {
 		{ "fields",			1, NULL, 'f' },
 		{ "field-only",			1, NULL, 'F' },
+		{ "raw",			0, NULL, 'r' },
 		{ "layout",			0, NULL, 'l' },
 		{ "help",			0, NULL, 'h' },
 		{ NULL }
 	};
 	unsigned fields = 0;
 	int field_only = -1;
+	bool raw = false;
 	bool print_layout = false;
 	bool print_default_fields = true;
 	int opt;
 
-	while ((opt = getopt_long(argc, argv, "f:lh", longopts, NULL)) != -1)
+	while ((opt = getopt_long(argc, argv, "f:rlh", longopts, NULL)) != -1)
 		switch (opt) {
 		case 'f':
 			fields = !strcmp(optarg, "all")
@@ -341,6 +414,9 @@ int cmd_show_super(int argc, char *argv[])
 					bch2_sb_fields, "superblock field");
 			print_default_fields = false;
 			break;
+		case 'r':
+			raw = true;
+			break;
 		case 'l':
 			print_layout = true;
 			break;
@@ -356,16 +432,62 @@ int cmd_show_super(int argc, char *argv[])
 	if (argc)
 		die("too many arguments");
 
+	if (raw && fields)
+		die("--raw dumps the entire superblock, or one --field-only section");
+
 	struct bch_opts opts = bch2_opts_empty();
 
 	opt_set(opts, noexcl,	true);
 	opt_set(opts, nochanges, true);
 
+	/*
+	 * Field-selective queries and raw export needn't deep-validate
+	 * sections we won't decode - members are always validated, the other
+	 * field validate fns depend on them:
+	 */
+	if (raw || !print_default_fields) {
+		u64 validate_fields =
+			BIT_ULL(BCH_SB_FIELD_members_v1)|
+			BIT_ULL(BCH_SB_FIELD_members_v2)|
+			fields;
+
+		if (field_only >= 0)
+			validate_fields |= BIT_ULL(field_only);
+		if (raw && print_default_fields && field_only < 0)
+			validate_fields = 0;
+
+		opt_set(opts, sb_validate_fields, validate_fields);
+	}
+
 	struct bch_sb_handle sb;
 	int ret = bch2_read_super(dev, &opts, &sb);
 	if (ret)
 		die("Error opening %s: %s", dev, bch2_err_str(ret));
 
+	if (raw) {
+		const void *start = sb.sb;
+		size_t len = vstruct_bytes(sb.sb);
+
+		if (field_only >= 0) {
+			struct bch_sb_field *f = bch2_sb_field_get_id(sb.sb, field_only);
+
+			if (!f)
+				die("superblock section %s not present",
+				    bch2_sb_fields[field_only]);
+			start	= f;
+			len	= vstruct_bytes(f);
+		}
+
+		if (isatty(STDOUT_FILENO))
+			die("Not dumping raw superblock to a terminal");
+
+		if (fwrite(start, len, 1, stdout) != 1)
+			die("error writing superblock: %m");
+
+		bch2_free_super(&sb);
+		return 0;
+	}
+
 	if (print_default_fields) {
 		fields |= bch2_sb_field_get(sb.sb, members_v2)
 			? 1 << BCH_SB_FIELD_members_v2
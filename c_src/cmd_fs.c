@@ -1,6 +1,10 @@
+#include <errno.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <uuid/uuid.h>
 
@@ -14,6 +18,7 @@
 #include "libbcachefs/super-io.h"
 
 #include "cmds.h"
+#include "json.h"
 #include "libbcachefs.h"
 
 static void __dev_usage_type_to_text(struct printbuf *out,
@@ -128,20 +133,17 @@ static struct dev_name *dev_idx_to_name(dev_names *dev_names, unsigned idx)
 	return NULL;
 }
 
-static void replicas_usage_to_text(struct printbuf *out,
-				   const struct bch_replicas_usage *r,
-				   dev_names *dev_names)
+static unsigned replicas_devs_str(char *devs,
+				  const struct bch_replicas_entry_v1 *r,
+				  dev_names *dev_names)
 {
-	if (!r->sectors)
-		return;
+	unsigned durability = 0;
+	char *d = devs;
 
-	char devs[4096], *d = devs;
 	*d++ = '[';
 
-	unsigned durability = 0;
-
-	for (unsigned i = 0; i < r->r.nr_devs; i++) {
-		unsigned dev_idx = r->r.devs[i];
+	for (unsigned i = 0; i < r->nr_devs; i++) {
+		unsigned dev_idx = r->devs[i];
 		struct dev_name *dev = dev_idx_to_name(dev_names, dev_idx);
 
 		durability += dev->durability;
@@ -156,6 +158,19 @@ static void replicas_usage_to_text(struct printbuf *out,
 	*d++ = ']';
 	*d++ = '\0';
 
+	return durability;
+}
+
+static void replicas_usage_to_text(struct printbuf *out,
+				   const struct bch_replicas_usage *r,
+				   dev_names *dev_names)
+{
+	if (!r->sectors)
+		return;
+
+	char devs[4096];
+	unsigned durability = replicas_devs_str(devs, &r->r, dev_names);
+
 	bch2_prt_data_type(out, r->r.data_type);
 	prt_char(out, ':');
 	prt_tab(out);
@@ -180,12 +195,10 @@ static void replicas_usage_to_text(struct printbuf *out,
 	     _r = replicas_usage_next(_r),				\
 	     BUG_ON((void *) _r > (void *) (_u)->replicas + (_u)->replica_entries_bytes))
 
-static void fs_usage_to_text(struct printbuf *out, const char *path)
+static void fs_usage_to_text(struct printbuf *out, struct bchfs_handle fs)
 {
 	unsigned i;
 
-	struct bchfs_handle fs = bcache_fs_open(path);
-
 	dev_names dev_names = bchu_fs_get_devices(fs);
 
 	struct bch_ioctl_fs_usage *u = bchu_fs_usage(fs);
@@ -291,8 +304,275 @@ static void fs_usage_to_text(struct printbuf *out, const char *path)
 		free(dev->label);
 	}
 	darray_exit(&dev_names);
+}
+
+static const char *data_type_str(unsigned type, char *buf)
+{
+	if (type < BCH_DATA_NR)
+		return __bch2_data_types[type];
+
+	sprintf(buf, "%u", type);
+	return buf;
+}
+
+/*
+ * JSON output emits typed values straight from the ioctl structs - no
+ * printbuf rendering, no unit formatting - for fleet tooling that would
+ * otherwise scrape the human text:
+ */
+static void fs_usage_to_json(FILE *out, struct bchfs_handle fs)
+{
+	dev_names dev_names = bchu_fs_get_devices(fs);
+	struct bch_ioctl_fs_usage *u = bchu_fs_usage(fs);
+	char uuid_str[40], type_buf[16];
+	struct json_out j;
+	unsigned i;
+
+	json_begin(&j, out);
+
+	uuid_unparse_lower(fs.uuid.b, uuid_str);
+	json_str(&j, "uuid",			uuid_str);
+	json_u64(&j, "capacity_bytes",		u->capacity << 9);
+	json_u64(&j, "used_bytes",		u->used << 9);
+	json_u64(&j, "online_reserved_bytes",	u->online_reserved << 9);
+
+	json_arr_start(&j, "persistent_reserved");
+	for (i = 0; i < BCH_REPLICAS_MAX; i++) {
+		if (!u->persistent_reserved[i])
+			continue;
+
+		json_obj_start(&j, NULL);
+		json_u64(&j, "replicas",	i);
+		json_u64(&j, "bytes",		u->persistent_reserved[i] << 9);
+		json_obj_end(&j);
+	}
+	json_arr_end(&j);
+
+	struct bch_replicas_usage *r;
+
+	json_arr_start(&j, "replicas");
+	for_each_usage_replica(u, r) {
+		if (!r->sectors)
+			continue;
+
+		json_obj_start(&j, NULL);
+		json_str(&j, "data_type", data_type_str(r->r.data_type, type_buf));
+		json_u64(&j, "required",	r->r.nr_required);
+		json_u64(&j, "total",		r->r.nr_devs);
+		json_u64(&j, "bytes",		r->sectors << 9);
+
+		json_arr_start(&j, "devices");
+		for (i = 0; i < r->r.nr_devs; i++)
+			json_u64(&j, NULL, r->r.devs[i]);
+		json_arr_end(&j);
+		json_obj_end(&j);
+	}
+	json_arr_end(&j);
+
+	free(u);
+
+	json_arr_start(&j, "devices");
+	darray_for_each(dev_names, dev) {
+		struct bch_ioctl_dev_usage_v2 *du = bchu_dev_usage(fs, dev->idx);
+
+		json_obj_start(&j, NULL);
+		json_u64(&j, "idx",		dev->idx);
+		if (dev->dev)
+			json_str(&j, "device",	dev->dev);
+		else
+			json_null(&j, "device");
+		if (dev->label)
+			json_str(&j, "label",	dev->label);
+		else
+			json_null(&j, "label");
+		json_str(&j, "state",		bch2_member_states[du->state]);
+		json_u64(&j, "bucket_size_bytes", du->bucket_size << 9);
+		json_u64(&j, "nr_buckets",	du->nr_buckets);
+		json_u64(&j, "capacity_bytes",	(du->nr_buckets * du->bucket_size) << 9);
+
+		json_arr_start(&j, "data_types");
+		for (i = 0; i < du->nr_data_types; i++) {
+			u64 sectors = du->d[i].sectors;
+
+			switch (i) {
+			case BCH_DATA_free:
+			case BCH_DATA_need_discard:
+			case BCH_DATA_need_gc_gens:
+				sectors = du->d[i].buckets * du->bucket_size;
+				break;
+			}
+
+			json_obj_start(&j, NULL);
+			json_str(&j, "data_type", data_type_str(i, type_buf));
+			json_u64(&j, "buckets",		du->d[i].buckets);
+			json_u64(&j, "bytes",		sectors << 9);
+			json_u64(&j, "fragmented_bytes", du->d[i].fragmented << 9);
+			json_obj_end(&j);
+		}
+		json_arr_end(&j);
+		json_obj_end(&j);
+		free(du);
+	}
+	json_arr_end(&j);
+
+	json_end(&j);
+
+	darray_for_each(dev_names, dev) {
+		free(dev->dev);
+		free(dev->label);
+	}
+	darray_exit(&dev_names);
+}
+
+/*
+ * Usage snapshot cache: reading full usage pulls the entire replicas table
+ * and per device accounting via ioctls, which can take many seconds on big
+ * filesystems - too slow for frequent monitoring. Every full read refreshes
+ * a snapshot in /run (tmpfs), and --fast serves a recent snapshot instead of
+ * re-reading everything. Snapshots with human readable units get their own
+ * file, so mixing flags can't serve wrong units:
+ */
+#define FS_USAGE_CACHE_MAX_AGE	30
+
+static char *fs_usage_cache_path(uuid_t uuid, bool human_readable)
+{
+	char uuid_str[40];
 
-	bcache_fs_close(fs);
+	uuid_unparse_lower(uuid, uuid_str);
+	return mprintf("/run/bcachefs/usage.%s%s", uuid_str,
+		       human_readable ? ".h" : "");
+}
+
+static bool fs_usage_from_cache(uuid_t uuid, bool human_readable)
+{
+	char *path = fs_usage_cache_path(uuid, human_readable);
+	struct stat st;
+	bool ret = false;
+
+	if (!stat(path, &st) &&
+	    time(NULL) - st.st_mtime <= FS_USAGE_CACHE_MAX_AGE) {
+		FILE *f = fopen(path, "r");
+
+		if (f) {
+			char buf[4096];
+			size_t n;
+
+			while ((n = fread(buf, 1, sizeof(buf), f)))
+				fwrite(buf, 1, n, stdout);
+			fclose(f);
+			ret = true;
+		}
+	}
+
+	free(path);
+	return ret;
+}
+
+static void fs_usage_update_cache(uuid_t uuid, bool human_readable,
+				  const char *text)
+{
+	char *path = fs_usage_cache_path(uuid, human_readable);
+	char *tmp = mprintf("%s.tmp", path);
+
+	/* best effort: */
+	if (!mkdir("/run/bcachefs", 0755) || errno == EEXIST) {
+		FILE *f = fopen(tmp, "w");
+
+		if (f) {
+			fputs(text, f);
+			if (!fclose(f))
+				rename(tmp, path);
+		}
+	}
+
+	free(tmp);
+	free(path);
+}
+
+static struct bch_replicas_usage *
+replicas_usage_find(struct bch_ioctl_fs_usage *u,
+		    const struct bch_replicas_entry_v1 *search)
+{
+	struct bch_replicas_usage *r;
+
+	for_each_usage_replica(u, r)
+		if (replicas_entry_bytes(&r->r) == replicas_entry_bytes(search) &&
+		    !memcmp(&r->r, search, replicas_entry_bytes(search)))
+			return r;
+	return NULL;
+}
+
+static void prt_units_delta(struct printbuf *out, u64 new, u64 old)
+{
+	prt_str(out, new >= old ? " (+" : " (-");
+	prt_units_u64(out, (new >= old ? new - old : old - new) << 9);
+	prt_char(out, ')');
+}
+
+/*
+ * Watch mode: there's no kernel notification for accounting changes, so poll
+ * - but only the filesystem usage ioctl, skipping the per device reads, and
+ * only print what changed since the last sample:
+ */
+static void fs_usage_watch(const char *path, unsigned interval,
+			   bool human_readable)
+{
+	struct bchfs_handle fs = bcache_fs_open(path);
+	dev_names dev_names = bchu_fs_get_devices(fs);
+	struct bch_ioctl_fs_usage *prev = NULL;
+
+	while (1) {
+		struct bch_ioctl_fs_usage *u = bchu_fs_usage(fs);
+		struct printbuf buf = PRINTBUF;
+		struct bch_replicas_usage *r;
+		char now[32];
+		time_t t = time(NULL);
+
+		buf.human_readable_units = human_readable;
+
+		strftime(now, sizeof(now), "%H:%M:%S", localtime(&t));
+
+		if (!prev || u->used != prev->used) {
+			prt_printf(&buf, "%s used ", now);
+			prt_units_u64(&buf, u->used << 9);
+			if (prev)
+				prt_units_delta(&buf, u->used, prev->used);
+			prt_str(&buf, " of ");
+			prt_units_u64(&buf, u->capacity << 9);
+			prt_newline(&buf);
+		}
+
+		for_each_usage_replica(u, r) {
+			struct bch_replicas_usage *p = prev
+				? replicas_usage_find(prev, &r->r)
+				: NULL;
+
+			if (prev && p && p->sectors == r->sectors)
+				continue;
+			if (!r->sectors)
+				continue;
+
+			char devs[4096];
+
+			replicas_devs_str(devs, &r->r, &dev_names);
+
+			prt_str(&buf, "  ");
+			bch2_prt_data_type(&buf, r->r.data_type);
+			prt_printf(&buf, ": %s ", devs);
+			prt_units_u64(&buf, r->sectors << 9);
+			if (p)
+				prt_units_delta(&buf, r->sectors, p->sectors);
+			prt_newline(&buf);
+		}
+
+		fputs(buf.buf, stdout);
+		fflush(stdout);
+		printbuf_exit(&buf);
+
+		free(prev);
+		prev = u;
+		sleep(interval);
+	}
 }
 
 static void fs_usage_usage(void)
@@ -302,6 +582,9 @@ static void fs_usage_usage(void)
 	     "\n"
 	     "Options:\n"
 	     "  -h, --human-readable              Human readable units\n"
+	     "  -j, --json                        JSON output, typed values, no unit formatting\n"
+	     "  -f, --fast                        Use a recent usage snapshot, if available\n"
+	     "  -w, --watch=seconds               Poll periodically, print only changes\n"
 	     "  -H, --help                        Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 }
@@ -311,19 +594,35 @@ int cmd_fs_usage(int argc, char *argv[])
 	static const struct option longopts[] = {
 		{ "help",		no_argument,		NULL, 'H' },
 		{ "human-readable",     no_argument,            NULL, 'h' },
+		{ "json",		no_argument,		NULL, 'j' },
+		{ "fast",		no_argument,		NULL, 'f' },
+		{ "watch",		required_argument,	NULL, 'w' },
 		{ NULL }
 	};
 	bool human_readable = false;
+	bool json = false;
+	bool fast = false;
+	unsigned watch = 0;
 	struct printbuf buf = PRINTBUF;
 	char *fs;
 	int opt;
 
-	while ((opt = getopt_long(argc, argv, "h",
+	while ((opt = getopt_long(argc, argv, "hjfw:",
 				  longopts, NULL)) != -1)
 		switch (opt) {
 		case 'h':
 			human_readable = true;
 			break;
+		case 'j':
+			json = true;
+			break;
+		case 'f':
+			fast = true;
+			break;
+		case 'w':
+			if (kstrtouint(optarg, 10, &watch) || !watch)
+				die("invalid watch interval");
+			break;
 		case 'H':
 			fs_usage_usage();
 			exit(EXIT_SUCCESS);
@@ -333,18 +632,38 @@ int cmd_fs_usage(int argc, char *argv[])
 		}
 	args_shift(optind);
 
+	if (watch) {
+		fs_usage_watch(argc ? argv[0] : ".", watch, human_readable);
+		/* never returns */
+	}
+
+	char *default_argv[] = { ".", NULL };
 	if (!argc) {
+		argc = 1;
+		argv = default_argv;
+	}
+
+	while ((fs = arg_pop())) {
+		struct bchfs_handle fs_handle = bcache_fs_open(fs);
+
+		if (json) {
+			fs_usage_to_json(stdout, fs_handle);
+			bcache_fs_close(fs_handle);
+			continue;
+		}
+
+		if (fast && fs_usage_from_cache(fs_handle.uuid.b, human_readable)) {
+			bcache_fs_close(fs_handle);
+			continue;
+		}
+
 		printbuf_reset(&buf);
 		buf.human_readable_units = human_readable;
-		fs_usage_to_text(&buf, ".");
+		fs_usage_to_text(&buf, fs_handle);
 		printf("%s", buf.buf);
-	} else {
-		while ((fs = arg_pop())) {
-			printbuf_reset(&buf);
-			buf.human_readable_units = human_readable;
-			fs_usage_to_text(&buf, fs);
-			printf("%s", buf.buf);
-		}
+
+		fs_usage_update_cache(fs_handle.uuid.b, human_readable, buf.buf);
+		bcache_fs_close(fs_handle);
 	}
 
 	printbuf_exit(&buf);
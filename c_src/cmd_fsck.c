@@ -1,11 +1,16 @@
 
 #include <getopt.h>
+#include <pthread.h>
 #include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include "cmds.h"
+#include "libbcachefs/btree_cache.h"
+#include "libbcachefs/btree_iter.h"
 #include "libbcachefs/error.h"
 #include "libbcachefs.h"
 #include "libbcachefs/super.h"
+#include "prewarm.h"
 #include "tools-util.h"
 
 static void fsck_usage(void)
@@ -19,13 +24,47 @@ static void fsck_usage(void)
 	     "  -y                      Assume \"yes\" to all questions\n"
 	     "  -f                      Force checking even if filesystem is marked clean\n"
 	     "  -r, --ratelimit_errors  Don't display more than 10 errors of a given type\n"
+	     "      --prewarm=file      Bulk read the btree nodes a previous run saved to\n"
+	     "                          <file> before checking, and save this run's nodes\n"
+	     "                          back to it on exit\n"
 	     "  -R, --reconstruct_alloc Reconstruct the alloc btree\n"
 	     "  -k, --kernel            Use the in-kernel fsck implementation\n"
+	     "  -T, --restart-report    Print top transaction restart sites on exit\n"
+	     "      --cache-stats=sec   Print btree cache telemetry every <sec> seconds\n"
 	     "  -v                      Be verbose\n"
 	     "  -h, --help              Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 }
 
+static u64 ns_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * --cache-stats: periodically print btree node cache telemetry to stderr
+ * while the check runs, for right-sizing cache memory on long fscks:
+ */
+static struct bch_fs *cache_stats_c;
+static unsigned cache_stats_interval;
+
+static void *cache_stats_thread(void *arg)
+{
+	while (true) {
+		sleep(cache_stats_interval);
+
+		struct printbuf buf = PRINTBUF;
+
+		bch2_btree_cache_to_text(&buf, cache_stats_c);
+		fprintf(stderr, "btree cache:\n%s\n", buf.buf);
+		printbuf_exit(&buf);
+	}
+	return NULL;
+}
+
 static void setnonblocking(int fd)
 {
 	int flags = fcntl(fd, F_GETFL);
@@ -104,10 +143,14 @@ int cmd_fsck(int argc, char *argv[])
 		{ "ratelimit_errors",	no_argument,		NULL, 'r' },
 		{ "reconstruct_alloc",	no_argument,		NULL, 'R' },
 		{ "kernel",		no_argument,		NULL, 'k' },
+		{ "prewarm",		required_argument,	NULL, 'w' },
+		{ "restart-report",	no_argument,		NULL, 'T' },
+		{ "cache-stats",	required_argument,	NULL, 'C' },
 		{ "help",		no_argument,		NULL, 'h' },
 		{ NULL }
 	};
-	bool kernel = false;
+	char *prewarm = NULL;
+	bool kernel = false, restart_report = false;
 	int opt, ret = 0;
 	struct printbuf opts_str = PRINTBUF;
 
@@ -117,7 +160,7 @@ int cmd_fsck(int argc, char *argv[])
 	append_opt(&opts_str, "read_only");
 
 	while ((opt = getopt_long(argc, argv,
-				  "apynfo:rRkvh",
+				  "apynfo:rRkTC:vh",
 				  longopts, NULL)) != -1)
 		switch (opt) {
 		case 'a': /* outdated alias for -p */
@@ -144,6 +187,17 @@ int cmd_fsck(int argc, char *argv[])
 		case 'k':
 			kernel = true;
 			break;
+		case 'w':
+			prewarm = optarg;
+			break;
+		case 'T':
+			restart_report = true;
+			break;
+		case 'C':
+			if (kstrtouint(optarg, 10, &cache_stats_interval) ||
+			    !cache_stats_interval)
+				die("invalid cache stats interval");
+			break;
 		case 'v':
 			append_opt(&opts_str, "verbose");
 			break;
@@ -170,10 +224,31 @@ int cmd_fsck(int argc, char *argv[])
 			if (dev_mounted(*i))
 				return fsck_online(*i);
 
+		if (prewarm)
+			opt_set(opts, nostart, true);
+
+		u64 start_ns = ns_now();
+
 		struct bch_fs *c = bch2_fs_open(devs.data, devs.nr, opts);
 		if (IS_ERR(c))
 			exit(8);
 
+		pthread_t stats_thread;
+
+		if (cache_stats_interval) {
+			cache_stats_c = c;
+			if (pthread_create(&stats_thread, NULL,
+					   cache_stats_thread, NULL))
+				die("error creating cache stats thread: %m");
+		}
+
+		if (prewarm) {
+			btree_prewarm_load(c, prewarm);
+
+			if (bch2_fs_start(c))
+				exit(8);
+		}
+
 		if (test_bit(BCH_FS_errors_fixed, &c->flags)) {
 			fprintf(stderr, "%s: errors fixed\n", c->name);
 			ret |= 1;
@@ -183,6 +258,23 @@ int cmd_fsck(int argc, char *argv[])
 			ret |= 4;
 		}
 
+		if (prewarm)
+			btree_prewarm_save(c, prewarm);
+
+		if (restart_report) {
+			struct printbuf buf = PRINTBUF;
+
+			bch2_trans_restarts_to_text(&buf, c, ns_now() - start_ns);
+			fputs(buf.buf, stderr);
+			printbuf_exit(&buf);
+		}
+
+		/* sleep() is a cancellation point, so c can't be in use: */
+		if (cache_stats_interval) {
+			pthread_cancel(stats_thread);
+			pthread_join(stats_thread, NULL);
+		}
+
 		bch2_fs_stop(c);
 	} else {
 		struct bch_ioctl_fsck_offline *fsck = calloc(sizeof(*fsck) +
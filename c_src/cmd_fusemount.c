@@ -1,8 +1,8 @@
 #ifdef BCACHEFS_FUSE
 
 #include <errno.h>
-#include <float.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/statvfs.h>
 
@@ -16,15 +16,21 @@
 #include "libbcachefs/alloc_foreground.h"
 #include "libbcachefs/btree_iter.h"
 #include "libbcachefs/buckets.h"
+#include "libbcachefs/darray.h"
 #include "libbcachefs/dirent.h"
 #include "libbcachefs/errcode.h"
 #include "libbcachefs/error.h"
+#include "libbcachefs/extents.h"
 #include "libbcachefs/fs-common.h"
 #include "libbcachefs/inode.h"
 #include "libbcachefs/io_read.h"
 #include "libbcachefs/io_write.h"
+#include "libbcachefs/journal.h"
 #include "libbcachefs/opts.h"
+#include "libbcachefs/reflink.h"
+#include "libbcachefs/subvolume.h"
 #include "libbcachefs/super.h"
+#include "libbcachefs/xattr.h"
 
 /* mode_to_type(): */
 #include "libbcachefs/fs.h"
@@ -43,6 +49,372 @@ struct write_aligned_op_t {
 };
 
 
+/*
+ * The io paths themselves are thread safe - they're the same code the kernel
+ * runs - but the kernel serializes buffered writes and truncates on the inode
+ * lock, which doesn't exist here: unaligned writes read-modify-write the first
+ * and last blocks, and two of those racing on the same block lose data. A
+ * striped lock table stands in for the inode lock now that the session loop is
+ * multithreaded:
+ */
+static pthread_mutex_t fuse_inode_locks[64] = {
+	[0 ... 63] = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_mutex_t *fuse_inode_lock(subvol_inum inum)
+{
+	pthread_mutex_t *lock =
+		&fuse_inode_locks[inum.inum % ARRAY_SIZE(fuse_inode_locks)];
+
+	pthread_mutex_lock(lock);
+	return lock;
+}
+
+/*
+ * Write coalescing: even in writeback cache mode the kernel splits streaming
+ * writes into fixed size requests, and issuing a btree update (plus the
+ * unaligned read-modify-write) per request is slow. Sequential writes are
+ * instead appended to a per-inode buffer and issued as one bch2 write when the
+ * buffer fills, the pattern breaks, or another operation needs to observe the
+ * data.
+ *
+ * One buffer per lock stripe, protected by the corresponding
+ * fuse_inode_locks entry; len == 0 means the slot is clean.
+ */
+#define FUSE_WB_BUF_SIZE	(1U << 20)
+
+struct fuse_wb_buf {
+	subvol_inum		inum;
+	void			*buf;
+	off_t			start;
+	size_t			len;
+};
+
+static struct fuse_wb_buf fuse_wb_bufs[ARRAY_SIZE(fuse_inode_locks)];
+
+static int fuse_wb_flush_locked(struct bch_fs *, struct fuse_wb_buf *);
+static int fuse_wb_flush_inum(struct bch_fs *, subvol_inum);
+static int fuse_wb_flush_all(struct bch_fs *);
+
+/*
+ * The io paths need page aligned bounce buffers, sized by align_io(); keep a
+ * small pool of them instead of hitting the allocator on every read and write
+ * request:
+ */
+struct fuse_io_buf {
+	void			*buf;
+	size_t			size;
+};
+
+static pthread_mutex_t io_buf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fuse_io_buf io_buf_pool[16];
+static unsigned io_buf_nr;
+
+static void *io_buf_get(size_t size)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&io_buf_lock);
+	for (unsigned i = 0; i < io_buf_nr; i++)
+		if (io_buf_pool[i].size >= size) {
+			buf = io_buf_pool[i].buf;
+			io_buf_pool[i] = io_buf_pool[--io_buf_nr];
+			break;
+		}
+	pthread_mutex_unlock(&io_buf_lock);
+
+	return buf ?: aligned_alloc(PAGE_SIZE, size);
+}
+
+static void io_buf_put(void *buf, size_t size)
+{
+	pthread_mutex_lock(&io_buf_lock);
+	if (buf && io_buf_nr < ARRAY_SIZE(io_buf_pool)) {
+		io_buf_pool[io_buf_nr++] =
+			(struct fuse_io_buf) { .buf = buf, .size = size };
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&io_buf_lock);
+
+	free(buf);
+}
+
+/*
+ * Readahead: the kernel splits streaming reads into fixed size requests, and
+ * a synchronous bch2_read round trip per request leaves the device idle most
+ * of the time. Track the expected next offset per inode; when reads turn out
+ * sequential, keep one window of data buffered ahead of the stream and refill
+ * it asynchronously - requests are then served by memcpy while the next
+ * window reads in parallel. The window starts at FUSE_RA_MIN_SIZE and doubles
+ * per sequential hit up to the readahead_max mount option.
+ *
+ * One state per lock stripe, like the write buffers, protected by the
+ * corresponding fuse_inode_locks entry.
+ */
+#define FUSE_RA_MIN_SIZE	(256U << 10)
+
+static size_t fuse_ra_max;	/* bytes; 0 disables readahead */
+
+struct fuse_ra_buf {
+	subvol_inum		inum;
+	off_t			next_offset;	/* for sequentiality detection */
+	size_t			window;		/* 0 until a sequential hit */
+
+	/* data ready to serve: */
+	void			*buf;
+	off_t			start;
+	size_t			len;
+
+	/* prefetch in flight: */
+	void			*pf_buf;
+	off_t			pf_start;
+	size_t			pf_len;
+	bool			pf_busy;
+	struct closure		cl;
+	struct bch_read_bio	rbio;
+	struct bio_vec		bv;
+};
+
+static struct fuse_ra_buf fuse_ra_bufs[ARRAY_SIZE(fuse_inode_locks)];
+
+static void fuse_ra_invalidate_locked(subvol_inum);
+
+/*
+ * Lookup cache: the kernel caches dentries, but only until entry_timeout
+ * expires, and repeated misses on names that don't exist (think a compiler
+ * probing include paths) keep coming back to us and hitting the dirent btree
+ * every time. A small direct mapped cache of (directory, name) -> inode
+ * number short circuits that; child == 0 records a negative entry.
+ *
+ * Invalidation is by generation: every namespace modification bumps its
+ * directory's generation stripe, orphaning all cached entries for it.
+ */
+#define FUSE_LOOKUP_CACHE_SIZE	2048
+#define FUSE_LOOKUP_NAME_MAX	97
+
+struct fuse_lookup_ent {
+	u64		dir;
+	u64		gen;
+	u64		child;
+	u16		name_len;
+	char		name[FUSE_LOOKUP_NAME_MAX + 1];
+};
+
+static pthread_mutex_t fuse_lookup_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fuse_lookup_ent fuse_lookup_cache[FUSE_LOOKUP_CACHE_SIZE];
+static u64 fuse_lookup_gens[64];
+
+static u32 fuse_lookup_hash(u64 dir, const char *name, size_t len)
+{
+	u32 h = 2166136261U;
+
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ name[i]) * 16777619U;
+
+	h = (h ^ dir) * 16777619U;
+	return (h ^ (dir >> 32)) * 16777619U;
+}
+
+static void fuse_lookup_cache_inval(subvol_inum dir)
+{
+	pthread_mutex_lock(&fuse_lookup_cache_lock);
+	fuse_lookup_gens[dir.inum % ARRAY_SIZE(fuse_lookup_gens)]++;
+	pthread_mutex_unlock(&fuse_lookup_cache_lock);
+}
+
+static bool fuse_lookup_cache_get(subvol_inum dir, const char *name, u64 *child)
+{
+	size_t len = strlen(name);
+	bool hit = false;
+
+	if (len > FUSE_LOOKUP_NAME_MAX)
+		return false;
+
+	pthread_mutex_lock(&fuse_lookup_cache_lock);
+
+	struct fuse_lookup_ent *e =
+		&fuse_lookup_cache[fuse_lookup_hash(dir.inum, name, len) &
+				   (FUSE_LOOKUP_CACHE_SIZE - 1)];
+
+	if (e->dir == dir.inum &&
+	    e->gen == fuse_lookup_gens[dir.inum % ARRAY_SIZE(fuse_lookup_gens)] &&
+	    e->name_len == len &&
+	    !memcmp(e->name, name, len)) {
+		*child = e->child;
+		hit = true;
+	}
+
+	pthread_mutex_unlock(&fuse_lookup_cache_lock);
+	return hit;
+}
+
+static void fuse_lookup_cache_set(subvol_inum dir, const char *name, u64 child)
+{
+	size_t len = strlen(name);
+
+	if (len > FUSE_LOOKUP_NAME_MAX)
+		return;
+
+	pthread_mutex_lock(&fuse_lookup_cache_lock);
+
+	struct fuse_lookup_ent *e =
+		&fuse_lookup_cache[fuse_lookup_hash(dir.inum, name, len) &
+				   (FUSE_LOOKUP_CACHE_SIZE - 1)];
+
+	e->dir		= dir.inum;
+	e->gen		= fuse_lookup_gens[dir.inum % ARRAY_SIZE(fuse_lookup_gens)];
+	e->child	= child;
+	e->name_len	= len;
+	memcpy(e->name, name, len);
+
+	pthread_mutex_unlock(&fuse_lookup_cache_lock);
+}
+
+/*
+ * Per-directory string hash info: the hash type and seed are fixed at inode
+ * creation, but recomputing them for every lookup means refetching the
+ * directory inode - and, on filesystems predating new_siphash, a SHA256
+ * digest per call.  Shares generations with the lookup cache, so a slot dies
+ * with its directory (unlink bumps the victim's generation stripe).
+ */
+#define FUSE_HASH_INFO_CACHE_SIZE	256
+
+struct fuse_hash_info_ent {
+	u64			dir;
+	u64			gen;
+	bool			valid;
+	struct bch_hash_info	hash_info;
+};
+
+static struct fuse_hash_info_ent fuse_hash_info_cache[FUSE_HASH_INFO_CACHE_SIZE];
+
+static bool fuse_hash_info_cache_get(subvol_inum dir, struct bch_hash_info *info)
+{
+	bool hit = false;
+
+	pthread_mutex_lock(&fuse_lookup_cache_lock);
+
+	struct fuse_hash_info_ent *e =
+		&fuse_hash_info_cache[dir.inum & (FUSE_HASH_INFO_CACHE_SIZE - 1)];
+
+	if (e->valid &&
+	    e->dir == dir.inum &&
+	    e->gen == fuse_lookup_gens[dir.inum % ARRAY_SIZE(fuse_lookup_gens)]) {
+		*info = e->hash_info;
+		hit = true;
+	}
+
+	pthread_mutex_unlock(&fuse_lookup_cache_lock);
+	return hit;
+}
+
+static void fuse_hash_info_cache_set(subvol_inum dir,
+				     const struct bch_hash_info *info)
+{
+	pthread_mutex_lock(&fuse_lookup_cache_lock);
+
+	struct fuse_hash_info_ent *e =
+		&fuse_hash_info_cache[dir.inum & (FUSE_HASH_INFO_CACHE_SIZE - 1)];
+
+	e->dir		= dir.inum;
+	e->gen		= fuse_lookup_gens[dir.inum % ARRAY_SIZE(fuse_lookup_gens)];
+	e->valid	= true;
+	e->hash_info	= *info;
+
+	pthread_mutex_unlock(&fuse_lookup_cache_lock);
+}
+
+/*
+ * Extent mapping cache: repeated reads of the same file re-resolve the extent
+ * mapping through a full btree walk every time - in the kernel the page cache
+ * absorbs those, here we have nothing. Cache the resolved extent key per
+ * inode; a read entirely inside a cached extent goes straight to
+ * __bch2_read_extent(), so checksum verification, decompression and the
+ * stale-pointer retry machinery are unaffected (a read of a since-moved
+ * extent retries through the normal btree walk).
+ *
+ * Direct mapped by inode number; invalidated by bumping the inode's
+ * generation stripe on writes and truncates. Reflink pointers aren't cached,
+ * since the resolved key's position is in reflink address space.
+ */
+#define FUSE_EXTENT_CACHE_SIZE	256
+
+struct fuse_cached_extent {
+	subvol_inum	inum;
+	u64		gen;
+	u32		snapshot;
+	u64		start, end;	/* logical sectors */
+	u64		k[BKEY_EXTENT_U64s_MAX];
+};
+
+static pthread_mutex_t fuse_extent_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fuse_cached_extent fuse_extent_cache[FUSE_EXTENT_CACHE_SIZE];
+static u64 fuse_extent_gens[64];
+
+static void fuse_extent_cache_inval(subvol_inum inum)
+{
+	pthread_mutex_lock(&fuse_extent_cache_lock);
+	fuse_extent_gens[inum.inum % ARRAY_SIZE(fuse_extent_gens)]++;
+	pthread_mutex_unlock(&fuse_extent_cache_lock);
+}
+
+static struct fuse_cached_extent *fuse_extent_cache_slot(subvol_inum inum)
+{
+	return &fuse_extent_cache[inum.inum & (FUSE_EXTENT_CACHE_SIZE - 1)];
+}
+
+static bool fuse_extent_cache_get(subvol_inum inum, u64 sector, u64 end_sector,
+				  struct bkey_i *k, u32 *snapshot, u64 *start)
+{
+	struct fuse_cached_extent *e = fuse_extent_cache_slot(inum);
+	bool hit = false;
+
+	pthread_mutex_lock(&fuse_extent_cache_lock);
+
+	if (e->inum.subvol	== inum.subvol &&
+	    e->inum.inum	== inum.inum &&
+	    e->gen		== fuse_extent_gens[inum.inum % ARRAY_SIZE(fuse_extent_gens)] &&
+	    e->start		<= sector &&
+	    e->end		>= end_sector) {
+		bkey_copy(k, (struct bkey_i *) e->k);
+		*snapshot	= e->snapshot;
+		*start		= e->start;
+		hit = true;
+	}
+
+	pthread_mutex_unlock(&fuse_extent_cache_lock);
+	return hit;
+}
+
+static void fuse_extent_cache_set(subvol_inum inum, u32 snapshot,
+				  struct bkey_s_c k)
+{
+	struct fuse_cached_extent *e = fuse_extent_cache_slot(inum);
+
+	if (k.k->u64s > BKEY_EXTENT_U64s_MAX)
+		return;
+
+	pthread_mutex_lock(&fuse_extent_cache_lock);
+
+	e->inum		= inum;
+	e->gen		= fuse_extent_gens[inum.inum % ARRAY_SIZE(fuse_extent_gens)];
+	e->snapshot	= snapshot;
+	e->start	= bkey_start_offset(k.k);
+	e->end		= k.k->p.offset;
+	bkey_reassemble((struct bkey_i *) e->k, k);
+
+	pthread_mutex_unlock(&fuse_extent_cache_lock);
+}
+
+/*
+ * This process is the only writer, so the kernel can cache entries and
+ * attributes generously; negative dentries are kept short lived since we
+ * can't push invalidations for them:
+ */
+#define FUSE_ATTR_TIMEOUT	3600.0
+#define FUSE_ENTRY_TIMEOUT	3600.0
+#define FUSE_NEGATIVE_TIMEOUT	1.0
+
 static inline subvol_inum map_root_ino(u64 ino)
 {
 	return (subvol_inum) { 1, ino == 1 ? 4096 : ino };
@@ -79,8 +451,8 @@ static struct fuse_entry_param inode_to_entry(struct bch_fs *c,
 		.ino		= unmap_root_ino(bi->bi_inum),
 		.generation	= bi->bi_generation,
 		.attr		= inode_to_stat(c, bi),
-		.attr_timeout	= DBL_MAX,
-		.entry_timeout	= DBL_MAX,
+		.attr_timeout	= FUSE_ATTR_TIMEOUT,
+		.entry_timeout	= FUSE_ENTRY_TIMEOUT,
 	};
 }
 
@@ -92,6 +464,10 @@ static void bcachefs_fuse_init(void *arg, struct fuse_conn_info *conn)
 	} else
 		fuse_log(FUSE_LOG_DEBUG, "fuse_init: writeback not capable\n");
 
+	/* let libfuse splice data to/from the kernel instead of copying: */
+	conn->want |= conn->capable &
+		(FUSE_CAP_SPLICE_WRITE|FUSE_CAP_SPLICE_READ|FUSE_CAP_SPLICE_MOVE);
+
 	//conn->want |= FUSE_CAP_POSIX_ACL;
 }
 
@@ -99,6 +475,7 @@ static void bcachefs_fuse_destroy(void *arg)
 {
 	struct bch_fs *c = arg;
 
+	fuse_wb_flush_all(c);
 	bch2_fs_stop(c);
 }
 
@@ -110,30 +487,61 @@ static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir_ino,
 	struct bch_inode_unpacked bi;
 	struct qstr qstr = QSTR(name);
 	subvol_inum inum;
+	u64 child;
 	int ret;
 
 	fuse_log(FUSE_LOG_DEBUG, "fuse_lookup(dir=%llu name=%s)\n",
 		 dir.inum, name);
 
-	ret = bch2_inode_find_by_inum(c, dir, &bi);
-	if (ret) {
-		fuse_reply_err(req, -ret);
-		return;
+	if (fuse_lookup_cache_get(dir, name, &child)) {
+		if (!child) {
+			struct fuse_entry_param e = {
+				.entry_timeout	= FUSE_NEGATIVE_TIMEOUT,
+			};
+			fuse_reply_entry(req, &e);
+			return;
+		}
+
+		inum = (subvol_inum) { dir.subvol, child };
+
+		ret =   fuse_wb_flush_inum(c, inum) ?:
+			bch2_inode_find_by_inum(c, inum, &bi);
+		if (!ret) {
+			struct fuse_entry_param e = inode_to_entry(c, &bi);
+			fuse_reply_entry(req, &e);
+			return;
+		}
+
+		/* stale cache entry, fall back to the real lookup: */
+		fuse_lookup_cache_inval(dir);
 	}
 
-	struct bch_hash_info hash_info = bch2_hash_info_init(c, &bi);
+	struct bch_hash_info hash_info;
+	if (!fuse_hash_info_cache_get(dir, &hash_info)) {
+		ret = bch2_inode_find_by_inum(c, dir, &bi);
+		if (ret) {
+			fuse_reply_err(req, -ret);
+			return;
+		}
+
+		hash_info = bch2_hash_info_init(c, &bi);
+		fuse_hash_info_cache_set(dir, &hash_info);
+	}
 
 	ret = bch2_dirent_lookup(c, dir, &hash_info, &qstr, &inum);
 	if (ret) {
 		struct fuse_entry_param e = {
-			.attr_timeout	= DBL_MAX,
-			.entry_timeout	= DBL_MAX,
+			.entry_timeout	= FUSE_NEGATIVE_TIMEOUT,
 		};
+		fuse_lookup_cache_set(dir, name, 0);
 		fuse_reply_entry(req, &e);
 		return;
 	}
 
-	ret = bch2_inode_find_by_inum(c, inum, &bi);
+	fuse_lookup_cache_set(dir, name, inum.inum);
+
+	ret =   fuse_wb_flush_inum(c, inum) ?:
+		bch2_inode_find_by_inum(c, inum, &bi);
 	if (ret)
 		goto err;
 
@@ -158,7 +566,8 @@ static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
 
 	fuse_log(FUSE_LOG_DEBUG, "fuse_getattr(inum=%llu)\n", inum.inum);
 
-	int ret = bch2_inode_find_by_inum(c, inum, &bi);
+	int ret =   fuse_wb_flush_inum(c, inum) ?:
+		    bch2_inode_find_by_inum(c, inum, &bi);
 	if (ret) {
 		fuse_log(FUSE_LOG_DEBUG, "fuse_getattr error %i\n", ret);
 		fuse_reply_err(req, -ret);
@@ -168,7 +577,7 @@ static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
 	fuse_log(FUSE_LOG_DEBUG, "fuse_getattr success\n");
 
 	attr = inode_to_stat(c, &bi);
-	fuse_reply_attr(req, &attr, DBL_MAX);
+	fuse_reply_attr(req, &attr, FUSE_ATTR_TIMEOUT);
 }
 
 static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t ino,
@@ -186,6 +595,29 @@ static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t ino,
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_setattr(%llu, %x)\n", inum.inum, to_set);
 
+	/*
+	 * Truncates race with the write path's read-modify-write, and any
+	 * buffered writes have to be issued first so they don't clobber the new
+	 * i_size:
+	 */
+	pthread_mutex_t *lock = fuse_inode_lock(inum);
+	struct fuse_wb_buf *wb =
+		&fuse_wb_bufs[inum.inum % ARRAY_SIZE(fuse_inode_locks)];
+
+	fuse_ra_invalidate_locked(inum);
+	fuse_extent_cache_inval(inum);
+
+	if (wb->len &&
+	    wb->inum.subvol == inum.subvol &&
+	    wb->inum.inum   == inum.inum) {
+		ret = fuse_wb_flush_locked(c, wb);
+		if (ret) {
+			pthread_mutex_unlock(lock);
+			fuse_reply_err(req, -ret);
+			return;
+		}
+	}
+
 	trans = bch2_trans_get(c);
 retry:
 	bch2_trans_begin(trans);
@@ -223,9 +655,11 @@ err:
 
 	bch2_trans_put(trans);
 
+	pthread_mutex_unlock(lock);
+
 	if (!ret) {
 		*attr = inode_to_stat(c, &inode_u);
-		fuse_reply_attr(req, attr, DBL_MAX);
+		fuse_reply_attr(req, attr, FUSE_ATTR_TIMEOUT);
 	} else {
 		fuse_reply_err(req, -ret);
 	}
@@ -242,12 +676,15 @@ static int do_create(struct bch_fs *c, subvol_inum dir,
 
 	bch2_inode_init_early(c, new_inode);
 
-	return bch2_trans_do(c, NULL, NULL, 0,
+	int ret = bch2_trans_do(c, NULL, NULL, 0,
 			bch2_create_trans(trans,
 				dir, &dir_u,
 				new_inode, &qstr,
 				uid, gid, mode, rdev, NULL, NULL,
 				(subvol_inum) { 0 }, 0));
+	if (!ret)
+		fuse_lookup_cache_inval(dir);
+	return ret;
 }
 
 static void bcachefs_fuse_mknod(fuse_req_t req, fuse_ino_t dir_ino,
@@ -299,6 +736,11 @@ static void bcachefs_fuse_unlink(fuse_req_t req, fuse_ino_t dir_ino,
 				BCH_TRANS_COMMIT_no_enospc,
 			    bch2_unlink_trans(trans, dir, &dir_u,
 					      &inode_u, &qstr, false));
+	if (!ret) {
+		fuse_lookup_cache_inval(dir);
+		/* if the victim was a cached directory, kill its slot too: */
+		fuse_lookup_cache_inval((subvol_inum) { dir.subvol, inode_u.bi_inum });
+	}
 
 	fuse_reply_err(req, -ret);
 }
@@ -337,6 +779,10 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 				  &src_inode_u, &dst_inode_u,
 				  &src_name, &dst_name,
 				  BCH_RENAME));
+	if (!ret) {
+		fuse_lookup_cache_inval(src_dir);
+		fuse_lookup_cache_inval(dst_dir);
+	}
 
 	fuse_reply_err(req, -ret);
 }
@@ -357,6 +803,8 @@ static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t ino,
 	ret = bch2_trans_do(c, NULL, NULL, 0,
 			    bch2_link_trans(trans, newparent, &dir_u,
 					    inum, &inode_u, &qstr));
+	if (!ret)
+		fuse_lookup_cache_inval(newparent);
 
 	if (!ret) {
 		struct fuse_entry_param e = inode_to_entry(c, &inode_u);
@@ -455,6 +903,100 @@ static size_t align_fix_up_bytes(const struct fuse_align_io *align,
 	return bytes;
 }
 
+/*
+ * Serve a read through the extent mapping cache: on a miss, one btree walk
+ * resolves the extent covering the read and fills the cache; on a hit the
+ * btree isn't touched at all. Returns nonzero if the read can't be served
+ * this way (crosses extents, reflink, hole) and the caller should fall back
+ * to the full read path.
+ */
+static int fuse_read_extent(struct bch_fs *c, subvol_inum inum,
+			    struct bch_io_opts io_opts, size_t aligned_size,
+			    off_t aligned_offset, void *buf)
+{
+	u64 sector	= aligned_offset >> 9;
+	u64 end_sector	= (aligned_offset + aligned_size) >> 9;
+	u64 _k[BKEY_EXTENT_U64s_MAX];
+	struct bkey_i *k = (struct bkey_i *) _k;
+	u32 snapshot;
+	u64 start;
+	int ret;
+
+	if (!fuse_extent_cache_get(inum, sector, end_sector, k, &snapshot, &start)) {
+		struct btree_trans *trans = bch2_trans_get(c);
+		struct btree_iter iter = { NULL };
+		struct bkey_s_c old;
+retry:
+		bch2_trans_begin(trans);
+
+		ret = bch2_subvolume_get_snapshot(trans, inum.subvol, &snapshot);
+		if (ret)
+			goto err;
+
+		bch2_trans_iter_init(trans, &iter, BTREE_ID_extents,
+				     SPOS(inum.inum, sector, snapshot),
+				     BTREE_ITER_SLOTS);
+		old = bch2_btree_iter_peek_slot(&iter);
+		ret = bkey_err(old);
+
+		if (!ret &&
+		    (!bkey_extent_is_data(old.k) ||
+		     old.k->type == KEY_TYPE_reflink_p ||
+		     old.k->u64s > BKEY_EXTENT_U64s_MAX ||
+		     bkey_start_offset(old.k) > sector ||
+		     old.k->p.offset < end_sector))
+			ret = -ENOENT;
+
+		if (!ret) {
+			bkey_reassemble(k, old);
+			fuse_extent_cache_set(inum, snapshot, old);
+		}
+
+		bch2_trans_iter_exit(trans, &iter);
+err:
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+			goto retry;
+		bch2_trans_put(trans);
+		if (ret)
+			return ret;
+
+		start = bkey_start_offset(&k->k);
+	}
+
+	struct bch_read_bio rbio;
+	struct bio_vec bv;
+	userbio_init(&rbio.bio, &bv, buf, aligned_size);
+	bio_set_op_attrs(&rbio.bio, REQ_OP_READ, REQ_SYNC);
+	rbio.bio.bi_iter.bi_sector	= sector;
+
+	struct closure cl;
+	closure_init_stack(&cl);
+
+	closure_get(&cl);
+	rbio_init(&rbio.bio, io_opts);
+	rbio.bio.bi_end_io		= bcachefs_fuse_read_endio;
+	rbio.bio.bi_private		= &cl;
+	rbio.c				= c;
+	rbio.start_time			= local_clock();
+	rbio.subvol			= inum.subvol;
+
+	struct bch_io_failures failed = { .nr = 0 };
+	struct btree_trans *trans = bch2_trans_get(c);
+
+	ret = __bch2_read_extent(trans, &rbio, rbio.bio.bi_iter,
+				 SPOS(inum.inum, sector, snapshot),
+				 BTREE_ID_extents, bkey_i_to_s_c(k),
+				 sector - start, &failed,
+				 BCH_READ_RETRY_IF_STALE|
+				 BCH_READ_MAY_PROMOTE|
+				 BCH_READ_USER_MAPPED|
+				 BCH_READ_LAST_FRAGMENT);
+	closure_sync(&cl);
+	bch2_trans_put(trans);
+
+	return ret ?: -blk_status_to_errno(rbio.bio.bi_status);
+}
+
 /*
  * Read aligned data.
  */
@@ -468,6 +1010,9 @@ static int read_aligned(struct bch_fs *c, subvol_inum inum, size_t aligned_size,
 	if (get_inode_io_opts(c, inum, &io_opts))
 		return -ENOENT;
 
+	if (!fuse_read_extent(c, inum, io_opts, aligned_size, aligned_offset, buf))
+		return 0;
+
 	struct bch_read_bio rbio;
 	struct bio_vec bv;
 	userbio_init(&rbio.bio, &bv, buf, aligned_size);
@@ -488,6 +1033,77 @@ static int read_aligned(struct bch_fs *c, subvol_inum inum, size_t aligned_size,
 	return -blk_status_to_errno(rbio.bio.bi_status);
 }
 
+/*
+ * Wait for an in flight prefetch; on success the prefetched data becomes the
+ * buffer we serve from. Caller holds the stripe lock.
+ */
+static void fuse_ra_pf_finish(struct fuse_ra_buf *ra)
+{
+	if (!ra->pf_busy)
+		return;
+
+	closure_sync(&ra->cl);
+	ra->pf_busy = false;
+
+	if (!blk_status_to_errno(ra->rbio.bio.bi_status)) {
+		swap(ra->buf, ra->pf_buf);
+		ra->start	= ra->pf_start;
+		ra->len		= ra->pf_len;
+	}
+}
+
+static void fuse_ra_invalidate_locked(subvol_inum inum)
+{
+	struct fuse_ra_buf *ra =
+		&fuse_ra_bufs[inum.inum % ARRAY_SIZE(fuse_inode_locks)];
+
+	if (ra->inum.subvol == inum.subvol &&
+	    ra->inum.inum   == inum.inum) {
+		fuse_ra_pf_finish(ra);
+		ra->len		= 0;
+		ra->next_offset	= -1;
+	}
+}
+
+static void fuse_ra_pf_submit(struct bch_fs *c, struct fuse_ra_buf *ra,
+			      subvol_inum inum, off_t start, size_t len)
+{
+	struct bch_io_opts io_opts;
+
+	BUG_ON(ra->pf_busy);
+
+	if (get_inode_io_opts(c, inum, &io_opts))
+		return;
+
+	if (!ra->pf_buf) {
+		ra->pf_buf = aligned_alloc(PAGE_SIZE, fuse_ra_max);
+		BUG_ON(!ra->pf_buf);
+	}
+
+	ra->pf_start	= start;
+	ra->pf_len	= len;
+	ra->pf_busy	= true;
+
+	userbio_init(&ra->rbio.bio, &ra->bv, ra->pf_buf, len);
+	bio_set_op_attrs(&ra->rbio.bio, REQ_OP_READ, 0);
+	ra->rbio.bio.bi_iter.bi_sector	= start >> 9;
+
+	closure_init_stack(&ra->cl);
+	closure_get(&ra->cl);
+	ra->rbio.bio.bi_end_io		= bcachefs_fuse_read_endio;
+	ra->rbio.bio.bi_private		= &ra->cl;
+
+	bch2_read(c, rbio_init(&ra->rbio.bio, io_opts), inum);
+}
+
+static bool fuse_ra_covers(off_t start, size_t len,
+			   const struct fuse_align_io *align)
+{
+	return len &&
+		align->start >= start &&
+		align->end <= start + (off_t) len;
+}
+
 static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t ino,
 			       size_t size, off_t offset,
 			       struct fuse_file_info *fi)
@@ -500,7 +1116,8 @@ static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t ino,
 
 	/* Check inode size. */
 	struct bch_inode_unpacked bi;
-	int ret = bch2_inode_find_by_inum(c, inum, &bi);
+	int ret =   fuse_wb_flush_inum(c, inum) ?:
+		    bch2_inode_find_by_inum(c, inum, &bi);
 	if (ret) {
 		fuse_reply_err(req, -ret);
 		return;
@@ -515,20 +1132,75 @@ static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t ino,
 
 	struct fuse_align_io align = align_io(c, size, offset);
 
-	void *buf = aligned_alloc(PAGE_SIZE, align.size);
+	void *buf = io_buf_get(align.size);
 	if (!buf) {
 		fuse_reply_err(req, ENOMEM);
 		return;
 	}
 
-	ret = read_aligned(c, inum, align.size, align.start, buf);
+	pthread_mutex_t *lock = fuse_inode_lock(inum);
+	struct fuse_ra_buf *ra =
+		&fuse_ra_bufs[inum.inum % ARRAY_SIZE(fuse_inode_locks)];
+
+	bool same = ra->inum.subvol == inum.subvol &&
+		    ra->inum.inum   == inum.inum;
+
+	if (!same) {
+		/* steal the slot from its previous owner: */
+		fuse_ra_pf_finish(ra);
+		ra->len		= 0;
+		ra->window	= 0;
+		ra->inum	= inum;
+	} else if (fuse_ra_max && offset == ra->next_offset) {
+		ra->window = min(ra->window ? ra->window * 2 : FUSE_RA_MIN_SIZE,
+				 fuse_ra_max);
+	} else {
+		ra->window	= 0;
+	}
+	ra->next_offset = offset + size;
 
-	if (likely(!ret))
-		fuse_reply_buf(req, buf + align.pad_start, size);
-	else
+	bool hit = fuse_ra_covers(ra->start, ra->len, &align);
+
+	if (!hit && ra->pf_busy &&
+	    fuse_ra_covers(ra->pf_start, ra->pf_len, &align)) {
+		fuse_ra_pf_finish(ra);
+		hit = fuse_ra_covers(ra->start, ra->len, &align);
+	}
+
+	if (hit) {
+		memcpy(buf, ra->buf + (align.start - ra->start), align.size);
+		ret = 0;
+	} else {
+		/* the prefetch machinery shares one rbio; wait it out: */
+		fuse_ra_pf_finish(ra);
+		ret = read_aligned(c, inum, align.size, align.start, buf);
+	}
+
+	/* keep a window in flight ahead of a sequential stream: */
+	if (!ret && ra->window && !ra->pf_busy) {
+		off_t buffered_end = ra->len
+			? ra->start + (off_t) ra->len
+			: align.end;
+		off_t file_end = round_up((off_t) bi.bi_size, block_bytes(c));
+
+		if (buffered_end < file_end)
+			fuse_ra_pf_submit(c, ra, inum, buffered_end,
+					  min_t(off_t, ra->window,
+						file_end - buffered_end));
+	}
+
+	pthread_mutex_unlock(lock);
+
+	if (likely(!ret)) {
+		struct fuse_bufvec bv = FUSE_BUFVEC_INIT(size);
+
+		bv.buf[0].mem = buf + align.pad_start;
+		fuse_reply_data(req, &bv, FUSE_BUF_SPLICE_MOVE);
+	} else {
 		fuse_reply_err(req, -ret);
+	}
 
-	free(buf);
+	io_buf_put(buf, align.size);
 }
 
 static int inode_update_times(struct bch_fs *c, subvol_inum inum)
@@ -592,6 +1264,12 @@ static int write_aligned(struct bch_fs *c, subvol_inum inum,
 	op->pos		= POS(inum.inum, aligned_offset >> 9);
 	op->new_i_size	= new_i_size;
 	op->end_io = bcachefs_fuse_write_endio;
+	/*
+	 * @buf is our own bounce buffer, unmodified and unread until the write
+	 * completes - checksum (and encrypt) in place rather than copying into
+	 * yet another buffer:
+	 */
+	op->flags	|= BCH_WRITE_PAGES_STABLE|BCH_WRITE_PAGES_OWNED;
 
 	userbio_init(&op->wbio.bio, &bv, buf, aligned_size);
 	bio_set_op_attrs(&op->wbio.bio, REQ_OP_WRITE, REQ_SYNC);
@@ -614,24 +1292,20 @@ static int write_aligned(struct bch_fs *c, subvol_inum inum,
 	return op->error;
 }
 
-static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t ino,
-				const char *buf, size_t size,
-				off_t offset,
-				struct fuse_file_info *fi)
+static int write_unaligned(struct bch_fs *c, subvol_inum inum,
+			   const char *buf, size_t size, off_t offset,
+			   size_t *written)
 {
-	subvol_inum inum = map_root_ino(ino);
-	struct bch_fs *c	= fuse_req_userdata(req);
 	struct bch_io_opts	io_opts;
 	size_t			aligned_written;
 	int			ret = 0;
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write(%llu, %zd, %lld)\n",
-		 inum, size, offset);
-
 	struct fuse_align_io align = align_io(c, size, offset);
-	void *aligned_buf = aligned_alloc(PAGE_SIZE, align.size);
+	void *aligned_buf = io_buf_get(align.size);
 	BUG_ON(!aligned_buf);
 
+	*written = 0;
+
 	if (get_inode_io_opts(c, inum, &io_opts)) {
 		ret = -ENOENT;
 		goto err;
@@ -675,13 +1349,13 @@ static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t ino,
 			    offset + size, &aligned_written);
 
 	/* Figure out how many unaligned bytes were written. */
-	size_t written = align_fix_up_bytes(&align, aligned_written);
-	BUG_ON(written > size);
+	*written = align_fix_up_bytes(&align, aligned_written);
+	BUG_ON(*written > size);
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write: wrote %zd bytes\n",
-		 written);
+	fuse_log(FUSE_LOG_DEBUG, "write_unaligned: wrote %zd bytes\n",
+		 *written);
 
-	if (written > 0)
+	if (*written > 0)
 		ret = 0;
 
 	/*
@@ -690,24 +1364,122 @@ static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t ino,
 	 */
 	if (!ret)
 		ret = inode_update_times(c, inum);
-
-	if (!ret) {
-		BUG_ON(written == 0);
-		fuse_reply_write(req, written);
-		free(aligned_buf);
-		return;
-	}
-
 err:
-	fuse_reply_err(req, -ret);
-	free(aligned_buf);
+	io_buf_put(aligned_buf, align.size);
+	return ret;
 }
 
-static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
-				  fuse_ino_t dir_ino, const char *name)
+static int fuse_wb_flush_locked(struct bch_fs *c, struct fuse_wb_buf *wb)
 {
-	subvol_inum dir = map_root_ino(dir_ino);
-	struct bch_fs *c = fuse_req_userdata(req);
+	size_t written;
+	int ret = write_unaligned(c, wb->inum, wb->buf, wb->len,
+				  wb->start, &written);
+
+	if (!ret && written != wb->len)
+		ret = -EIO;
+
+	wb->len = 0;
+	return ret;
+}
+
+static int fuse_wb_flush_inum(struct bch_fs *c, subvol_inum inum)
+{
+	pthread_mutex_t *lock = fuse_inode_lock(inum);
+	struct fuse_wb_buf *wb =
+		&fuse_wb_bufs[inum.inum % ARRAY_SIZE(fuse_inode_locks)];
+	int ret = 0;
+
+	if (wb->len &&
+	    wb->inum.subvol == inum.subvol &&
+	    wb->inum.inum   == inum.inum)
+		ret = fuse_wb_flush_locked(c, wb);
+
+	pthread_mutex_unlock(lock);
+	return ret;
+}
+
+static int fuse_wb_flush_all(struct bch_fs *c)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < ARRAY_SIZE(fuse_wb_bufs); i++) {
+		pthread_mutex_lock(&fuse_inode_locks[i]);
+		if (fuse_wb_bufs[i].len)
+			ret = fuse_wb_flush_locked(c, &fuse_wb_bufs[i]) ?: ret;
+		pthread_mutex_unlock(&fuse_inode_locks[i]);
+	}
+
+	return ret;
+}
+
+static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t ino,
+				const char *buf, size_t size,
+				off_t offset,
+				struct fuse_file_info *fi)
+{
+	subvol_inum inum = map_root_ino(ino);
+	struct bch_fs *c = fuse_req_userdata(req);
+	size_t written;
+	int ret = 0;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write(%llu, %zd, %lld)\n",
+		 inum, size, offset);
+
+	pthread_mutex_t *lock = fuse_inode_lock(inum);
+	struct fuse_wb_buf *wb =
+		&fuse_wb_bufs[inum.inum % ARRAY_SIZE(fuse_inode_locks)];
+
+	fuse_ra_invalidate_locked(inum);
+	fuse_extent_cache_inval(inum);
+
+	/*
+	 * Flush first if the buffer belongs to a different inode, this write
+	 * doesn't extend the buffered range, or it wouldn't fit:
+	 */
+	if (wb->len &&
+	    (wb->inum.subvol != inum.subvol ||
+	     wb->inum.inum   != inum.inum ||
+	     offset != wb->start + (off_t) wb->len ||
+	     wb->len + size > FUSE_WB_BUF_SIZE)) {
+		ret = fuse_wb_flush_locked(c, wb);
+		if (ret)
+			goto err;
+	}
+
+	if (size >= FUSE_WB_BUF_SIZE) {
+		/* Too big to batch up, issue it directly: */
+		ret = write_unaligned(c, inum, buf, size, offset, &written);
+		if (ret)
+			goto err;
+	} else {
+		if (!wb->buf) {
+			wb->buf = aligned_alloc(PAGE_SIZE, FUSE_WB_BUF_SIZE);
+			BUG_ON(!wb->buf);
+		}
+
+		if (!wb->len) {
+			wb->inum	= inum;
+			wb->start	= offset;
+		}
+
+		memcpy(wb->buf + wb->len, buf, size);
+		wb->len += size;
+		written = size;
+	}
+
+	pthread_mutex_unlock(lock);
+	fuse_reply_write(req, written);
+	return;
+err:
+	pthread_mutex_unlock(lock);
+	fuse_reply_err(req, -ret);
+}
+
+static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
+				  fuse_ino_t dir_ino, const char *name)
+{
+	subvol_inum dir = map_root_ino(dir_ino);
+	struct bch_fs *c = fuse_req_userdata(req);
 	struct bch_inode_unpacked new_inode;
 	size_t link_len = strlen(link);
 	int ret;
@@ -795,32 +1567,41 @@ err:
 	free(buf);
 }
 
-#if 0
 /*
  * FUSE flush is essentially the close() call, however it is not guaranteed
  * that one flush happens per open/create.
  *
- * It doesn't have to do anything, and is mostly relevant for NFS-style
- * filesystems where close has some relationship to caching.
+ * With writeback caching and the coalescing buffer, close() is where buffered
+ * writes have to be issued so a subsequent open sees them:
  */
-static void bcachefs_fuse_flush(fuse_req_t req, fuse_ino_t inum,
+static void bcachefs_fuse_flush(fuse_req_t req, fuse_ino_t ino,
 				struct fuse_file_info *fi)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
+
+	fuse_reply_err(req, -fuse_wb_flush_inum(c, map_root_ino(ino)));
 }
 
-static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t inum,
+static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t ino,
 				  struct fuse_file_info *fi)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
+
+	fuse_reply_err(req, -fuse_wb_flush_inum(c, map_root_ino(ino)));
 }
 
-static void bcachefs_fuse_fsync(fuse_req_t req, fuse_ino_t inum, int datasync,
+static void bcachefs_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
 				struct fuse_file_info *fi)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
+
+	int ret =   fuse_wb_flush_inum(c, map_root_ino(ino)) ?:
+		    bch2_journal_flush(&c->journal);
+
+	fuse_reply_err(req, -ret);
 }
 
+#if 0
 static void bcachefs_fuse_opendir(fuse_req_t req, fuse_ino_t inum,
 				  struct fuse_file_info *fi)
 {
@@ -963,14 +1744,239 @@ reply:
 	free(buf);
 }
 
-#if 0
-static void bcachefs_fuse_readdirplus(fuse_req_t req, fuse_ino_t dir,
+/*
+ * readdirplus: as readdir, but each entry carries full attributes, saving the
+ * kernel a lookup round trip per name - which is what `ls -l` on a large
+ * directory otherwise degenerates to.
+ *
+ * Dirents are hash ordered, so attribute lookups for one reply's worth of
+ * entries land all over the inodes btree: collect the names first, then fetch
+ * the inode records in one pass over BTREE_ID_inodes in inode number order
+ * rather than doing a full btree descent per entry.
+ */
+struct fuse_rdp_ent {
+	u64			ino;
+	u64			off;
+	u32			name_off;
+	u32			name_len;
+	u32			type;
+};
+
+typedef DARRAY(struct fuse_rdp_ent) fuse_rdp_ents;
+
+struct fuse_rdp_context {
+	struct dir_context	ctx;
+	darray_char		names;
+	fuse_rdp_ents		ents;
+	size_t			size_est;
+	size_t			bufsize;
+};
+
+/* struct fuse_entry_out in the kernel ABI is 128 bytes: */
+#define FUSE_NAME_OFFSET_PLUS	(128 + FUSE_NAME_OFFSET)
+
+static int fuse_filldir_plus(struct dir_context *_ctx,
+			     const char *name, int namelen,
+			     loff_t pos, u64 ino, unsigned type)
+{
+	struct fuse_rdp_context *ctx =
+		container_of(_ctx, struct fuse_rdp_context, ctx);
+	size_t entlen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_PLUS + namelen);
+
+	if (ctx->size_est + entlen > ctx->bufsize)
+		return -1;
+
+	struct fuse_rdp_ent e = {
+		.ino		= ino,
+		.off		= pos + 1,
+		.name_off	= ctx->names.nr,
+		.name_len	= namelen,
+		.type		= type,
+	};
+
+	if (darray_push(&ctx->ents, e) ||
+	    darray_make_room(&ctx->names, namelen + 1))
+		return -1;
+
+	memcpy(&ctx->names.data[ctx->names.nr], name, namelen);
+	ctx->names.data[ctx->names.nr + namelen] = '\0';
+	ctx->names.nr += namelen + 1;
+
+	ctx->size_est += entlen;
+	return 0;
+}
+
+struct fuse_rdp_sort {
+	u64			ino;
+	u32			idx;
+};
+
+static int fuse_rdp_sort_cmp(const void *_l, const void *_r)
+{
+	const struct fuse_rdp_sort *l = _l, *r = _r;
+
+	return l->ino < r->ino ? -1 : l->ino > r->ino ? 1 : 0;
+}
+
+static int fuse_rdp_lookup_inodes(struct bch_fs *c, subvol_inum dir,
+				  fuse_rdp_ents *ents,
+				  struct bch_inode_unpacked *inodes,
+				  bool *found)
+{
+	struct fuse_rdp_sort *sorted = xmalloc(ents->nr * sizeof(*sorted));
+	struct btree_trans *trans = bch2_trans_get(c);
+	struct btree_iter iter = { NULL };
+	u32 snapshot;
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < ents->nr; i++)
+		sorted[i] = (struct fuse_rdp_sort) {
+			.ino	= ents->data[i].ino,
+			.idx	= i,
+		};
+	qsort(sorted, ents->nr, sizeof(*sorted), fuse_rdp_sort_cmp);
+retry:
+	bch2_trans_begin(trans);
+
+	ret = bch2_subvolume_get_snapshot(trans, dir.subvol, &snapshot);
+	if (ret)
+		goto err;
+
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_inodes,
+			     SPOS(0, 0, snapshot), 0);
+
+	for (i = 0; i < ents->nr; i++) {
+		u32 idx = sorted[i].idx;
+
+		bch2_btree_iter_set_pos(&iter,
+				SPOS(0, sorted[i].ino, snapshot));
+
+		struct bkey_s_c k = bch2_btree_iter_peek_slot(&iter);
+		ret = bkey_err(k);
+		if (ret)
+			goto err;
+
+		found[idx] = bkey_is_inode(k.k) &&
+			!bch2_inode_unpack(k, &inodes[idx]);
+	}
+err:
+	bch2_trans_iter_exit(trans, &iter);
+	if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+		goto retry;
+
+	bch2_trans_put(trans);
+	free(sorted);
+	return ret;
+}
+
+static void bcachefs_fuse_readdirplus(fuse_req_t req, fuse_ino_t dir_ino,
 				      size_t size, off_t off,
 				      struct fuse_file_info *fi)
 {
+	subvol_inum dir = map_root_ino(dir_ino);
+	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_inode_unpacked bi;
+	struct bch_inode_unpacked *inodes = NULL;
+	bool *found = NULL;
+	char *buf = calloc(size, 1);
+	char *outp = buf;
+	size_t outsz = size;
+	struct fuse_rdp_context ctx = {
+		.ctx.actor	= fuse_filldir_plus,
+		.ctx.pos	= off,
+	};
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readdirplus(dir=%llu, "
+		 "size=%zu, off=%lld)\n", dir.inum, size, off);
+
+	/* the attributes we reply with must reflect buffered writes: */
+	ret =   fuse_wb_flush_all(c) ?:
+		bch2_inode_find_by_inum(c, dir, &bi);
+	if (ret)
+		goto reply;
+
+	if (!S_ISDIR(bi.bi_mode)) {
+		ret = -ENOTDIR;
+		goto reply;
+	}
 
+	/*
+	 * . and ..: zero nodeid means no attributes attached, the kernel
+	 * falls back to lookup (and doesn't take a reference):
+	 */
+	while (ctx.ctx.pos < 2) {
+		struct fuse_entry_param e = {
+			.attr.st_ino	= ctx.ctx.pos ? 1 : dir_ino,
+			.attr.st_mode	= S_IFDIR,
+		};
+		size_t len = fuse_add_direntry_plus(req, outp, outsz,
+					ctx.ctx.pos ? ".." : ".",
+					&e, ctx.ctx.pos + 1);
+		if (len > outsz)
+			goto out;
+
+		outp	+= len;
+		outsz	-= len;
+		ctx.ctx.pos++;
+	}
+
+	ctx.bufsize = outsz;
+
+	ret = bch2_readdir(c, dir, &ctx.ctx);
+	if (ret)
+		goto reply;
+
+	if (ctx.ents.nr) {
+		inodes	= xmalloc(ctx.ents.nr * sizeof(*inodes));
+		found	= xcalloc(ctx.ents.nr, sizeof(*found));
+
+		ret = fuse_rdp_lookup_inodes(c, dir, &ctx.ents, inodes, found);
+		if (ret)
+			goto reply;
+	}
+
+	darray_for_each(ctx.ents, e) {
+		size_t i = e - ctx.ents.data;
+		struct fuse_entry_param ep = { 0 };
+
+		if (found[i]) {
+			ep = inode_to_entry(c, &inodes[i]);
+		} else {
+			/* raced with an unlink; leave nodeid 0: */
+			ep.attr.st_ino	= unmap_root_ino(e->ino);
+			ep.attr.st_mode	= e->type << 12;
+		}
+
+		size_t len = fuse_add_direntry_plus(req, outp, outsz,
+					&ctx.names.data[e->name_off],
+					&ep, e->off);
+		if (len > outsz)
+			break;
+
+		outp	+= len;
+		outsz	-= len;
+	}
+out:
+	ret = 0;
+reply:
+	if (!ret) {
+		fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readdirplus reply %zd\n",
+			 outp - buf);
+		fuse_reply_buf(req, buf, outp - buf);
+	} else {
+		fuse_reply_err(req, -ret);
+	}
+
+	free(found);
+	free(inodes);
+	darray_exit(&ctx.names);
+	darray_exit(&ctx.ents);
+	free(buf);
 }
 
+#if 0
 static void bcachefs_fuse_releasedir(fuse_req_t req, fuse_ino_t inum,
 				     struct fuse_file_info *fi)
 {
@@ -1011,25 +2017,224 @@ static void bcachefs_fuse_setxattr(fuse_req_t req, fuse_ino_t inum,
 	struct bch_fs *c = fuse_req_userdata(req);
 }
 
-static void bcachefs_fuse_getxattr(fuse_req_t req, fuse_ino_t inum,
-				   const char *name, size_t size)
+static void bcachefs_fuse_removexattr(fuse_req_t req, fuse_ino_t inum,
+				      const char *name)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
+}
+#endif
+
+/*
+ * Bulk xattr scanning: backup tools read several xattrs per file over millions
+ * of files, and each listxattr/getxattr would otherwise be its own btree
+ * descent. Those scans proceed in roughly inode order, so on a miss we fetch
+ * all the xattrs for a whole window of inodes with one BTREE_ID_xattrs range
+ * scan, group them by inode, and serve subsequent calls within the window from
+ * that. No invalidation needed: the xattr write paths aren't wired up in the
+ * fuse frontend.
+ */
+#define FUSE_XATTR_WINDOW	1024	/* inodes per scan */
+
+struct fuse_cached_xattr {
+	u64			inum;
+	u8			type;
+	u8			name_len;
+	u16			val_len;
+	u32			off;	/* name then value, in @data */
+};
+
+typedef DARRAY(struct fuse_cached_xattr) fuse_cached_xattrs;
+
+static struct {
+	pthread_mutex_t		lock;
+	u32			subvol;
+	u64			start, end;	/* inodes covered, end exclusive */
+	fuse_cached_xattrs	ents;
+	darray_char		data;
+} xattr_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* On disk x_type -> full xattr name prefix (ACL "names" have no suffix): */
+static const char * const fuse_xattr_prefixes[] = {
+	[KEY_TYPE_XATTR_INDEX_USER]			= "user.",
+	[KEY_TYPE_XATTR_INDEX_POSIX_ACL_ACCESS]	= "system.posix_acl_access",
+	[KEY_TYPE_XATTR_INDEX_POSIX_ACL_DEFAULT]	= "system.posix_acl_default",
+	[KEY_TYPE_XATTR_INDEX_TRUSTED]			= "trusted.",
+	[KEY_TYPE_XATTR_INDEX_SECURITY]			= "security.",
+};
+
+static int fuse_xattr_window_fill(struct bch_fs *c, subvol_inum inum)
+{
+	struct btree_trans *trans = bch2_trans_get(c);
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	u32 snapshot;
+	int ret;
+
+	xattr_cache.subvol	= inum.subvol;
+	xattr_cache.start	= inum.inum;
+	xattr_cache.end		= inum.inum + FUSE_XATTR_WINDOW;
+retry:
+	bch2_trans_begin(trans);
+	iter = (struct btree_iter) { NULL };
+	xattr_cache.ents.nr	= 0;
+	xattr_cache.data.nr	= 0;
+
+	ret = bch2_subvolume_get_snapshot(trans, inum.subvol, &snapshot);
+	if (ret)
+		goto err;
+
+	for_each_btree_key_upto_norestart(trans, iter, BTREE_ID_xattrs,
+			SPOS(xattr_cache.start, 0, snapshot),
+			POS(xattr_cache.end - 1, U64_MAX), 0, k, ret) {
+		if (k.k->type != KEY_TYPE_xattr)
+			continue;
+
+		const struct bch_xattr *x = bkey_s_c_to_xattr(k).v;
+		struct fuse_cached_xattr e = {
+			.inum		= k.k->p.inode,
+			.type		= x->x_type,
+			.name_len	= x->x_name_len,
+			.val_len	= le16_to_cpu(x->x_val_len),
+			.off		= xattr_cache.data.nr,
+		};
+
+		if (darray_push(&xattr_cache.ents, e) ||
+		    darray_make_room(&xattr_cache.data,
+				     e.name_len + e.val_len)) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		/* the value follows the name in the bkey: */
+		memcpy(&xattr_cache.data.data[xattr_cache.data.nr],
+		       x->x_name, e.name_len + e.val_len);
+		xattr_cache.data.nr += e.name_len + e.val_len;
+	}
+	bch2_trans_iter_exit(trans, &iter);
+err:
+	if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+		goto retry;
+
+	bch2_trans_put(trans);
+	if (ret)
+		xattr_cache.end = xattr_cache.start;	/* don't serve partial results */
+	return ret;
+}
 
-	fuse_reply_xattr(req, );
+/* Must be called with xattr_cache.lock held: */
+static int fuse_xattr_window_get(struct bch_fs *c, subvol_inum inum)
+{
+	return inum.subvol == xattr_cache.subvol &&
+		inum.inum >= xattr_cache.start &&
+		inum.inum <  xattr_cache.end
+		? 0
+		: fuse_xattr_window_fill(c, inum);
 }
 
-static void bcachefs_fuse_listxattr(fuse_req_t req, fuse_ino_t inum, size_t size)
+static void bcachefs_fuse_getxattr(fuse_req_t req, fuse_ino_t ino,
+				   const char *name, size_t size)
 {
+	subvol_inum inum = map_root_ino(ino);
 	struct bch_fs *c = fuse_req_userdata(req);
+	char *val = NULL;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_getxattr(%llu, %s, size=%zu)\n",
+		 inum.inum, name, size);
+
+	pthread_mutex_lock(&xattr_cache.lock);
+
+	ret = fuse_xattr_window_get(c, inum);
+	if (ret)
+		goto err;
+
+	ret = -ENODATA;
+	darray_for_each(xattr_cache.ents, e) {
+		if (e->inum != inum.inum ||
+		    e->type >= ARRAY_SIZE(fuse_xattr_prefixes) ||
+		    !fuse_xattr_prefixes[e->type])
+			continue;
+
+		const char *prefix = fuse_xattr_prefixes[e->type];
+		size_t prefix_len = strlen(prefix);
+
+		if (strlen(name) != prefix_len + e->name_len ||
+		    memcmp(name, prefix, prefix_len) ||
+		    memcmp(name + prefix_len,
+			   &xattr_cache.data.data[e->off], e->name_len))
+			continue;
+
+		val = xmalloc(e->val_len + 1);
+		memcpy(val, &xattr_cache.data.data[e->off + e->name_len],
+		       e->val_len);
+		ret = e->val_len;
+		break;
+	}
+err:
+	pthread_mutex_unlock(&xattr_cache.lock);
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else if (!size)
+		fuse_reply_xattr(req, ret);
+	else if (ret <= size)
+		fuse_reply_buf(req, val, ret);
+	else
+		fuse_reply_err(req, ERANGE);
+	free(val);
 }
 
-static void bcachefs_fuse_removexattr(fuse_req_t req, fuse_ino_t inum,
-				      const char *name)
+static void bcachefs_fuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
+	subvol_inum inum = map_root_ino(ino);
 	struct bch_fs *c = fuse_req_userdata(req);
+	darray_char out = { 0 };
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_listxattr(%llu, size=%zu)\n",
+		 inum.inum, size);
+
+	pthread_mutex_lock(&xattr_cache.lock);
+
+	ret = fuse_xattr_window_get(c, inum);
+	if (ret)
+		goto err;
+
+	darray_for_each(xattr_cache.ents, e) {
+		if (e->inum != inum.inum ||
+		    e->type >= ARRAY_SIZE(fuse_xattr_prefixes) ||
+		    !fuse_xattr_prefixes[e->type])
+			continue;
+
+		const char *prefix = fuse_xattr_prefixes[e->type];
+		size_t prefix_len = strlen(prefix);
+
+		if (darray_make_room(&out, prefix_len + e->name_len + 1)) {
+			ret = -ENOMEM;
+			goto err;
+		}
+
+		memcpy(&out.data[out.nr], prefix, prefix_len);
+		memcpy(&out.data[out.nr + prefix_len],
+		       &xattr_cache.data.data[e->off], e->name_len);
+		out.data[out.nr + prefix_len + e->name_len] = '\0';
+		out.nr += prefix_len + e->name_len + 1;
+	}
+err:
+	pthread_mutex_unlock(&xattr_cache.lock);
+
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else if (!size)
+		fuse_reply_xattr(req, out.nr);
+	else if (out.nr <= size)
+		fuse_reply_buf(req, out.data, out.nr);
+	else
+		fuse_reply_err(req, ERANGE);
+	darray_exit(&out);
 }
-#endif
 
 static void bcachefs_fuse_create(fuse_req_t req, fuse_ino_t dir_ino,
 				 const char *name, mode_t mode,
@@ -1054,6 +2259,102 @@ err:
 	fuse_reply_err(req, -ret);
 }
 
+static void bcachefs_fuse_copy_file_range(fuse_req_t req,
+					  fuse_ino_t ino_in, off_t off_in,
+					  struct fuse_file_info *fi_in,
+					  fuse_ino_t ino_out, off_t off_out,
+					  struct fuse_file_info *fi_out,
+					  size_t len, int flags)
+{
+	subvol_inum src = map_root_ino(ino_in);
+	subvol_inum dst = map_root_ino(ino_out);
+	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_inode_unpacked src_bi;
+	s64 i_sectors_delta = 0;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG,
+		 "bcachefs_fuse_copy_file_range(%llu@%lld -> %llu@%lld, %zu)\n",
+		 src.inum, (long long) off_in, dst.inum, (long long) off_out,
+		 len);
+
+	if (flags) {
+		ret = -EINVAL;
+		goto err;
+	}
+
+	/*
+	 * Extents can only be remapped at block granularity; unaligned copies
+	 * get EOPNOTSUPP and the caller falls back to reads and writes:
+	 */
+	if ((off_in | off_out) & (block_bytes(c) - 1)) {
+		ret = -EOPNOTSUPP;
+		goto err;
+	}
+
+	/* Flush buffered writes, so the extents to remap are in the btree: */
+	ret = fuse_wb_flush_inum(c, src) ?:
+	      fuse_wb_flush_inum(c, dst);
+	if (ret)
+		goto err;
+
+	ret = bch2_inode_find_by_inum(c, src, &src_bi);
+	if (ret)
+		goto err;
+
+	if ((u64) off_in >= src_bi.bi_size) {
+		fuse_reply_write(req, 0);
+		return;
+	}
+	len = min_t(u64, len, src_bi.bi_size - off_in);
+
+	/*
+	 * A trailing partial block can't normally be remapped, but when the
+	 * range ends at source EOF the last block's extents cover it - remap
+	 * rounded up, the destination's i_size caps what's visible. Partial
+	 * blocks in the middle of the file remap short; the caller retries
+	 * the unaligned remainder and hits the EOPNOTSUPP fallback above.
+	 */
+	u64 aligned_len = (u64) off_in + len == src_bi.bi_size
+		? round_up(len, block_bytes(c))
+		: round_down(len, block_bytes(c));
+	if (!aligned_len) {
+		ret = -EOPNOTSUPP;
+		goto err;
+	}
+
+	s64 sectors = bch2_remap_range(c,
+				       dst, off_out >> 9,
+				       src, off_in >> 9,
+				       aligned_len >> 9,
+				       off_out + min_t(u64, len, aligned_len),
+				       &i_sectors_delta);
+	if (sectors < 0) {
+		ret = sectors;
+		goto err;
+	}
+
+	/*
+	 * The remap changed the destination's extents without going through
+	 * the write path, so its generation was never bumped - drop cached
+	 * extents and any buffered readahead or reads keep serving pre-copy
+	 * data:
+	 */
+	pthread_mutex_t *lock = fuse_inode_lock(dst);
+	fuse_ra_invalidate_locked(dst);
+	fuse_extent_cache_inval(dst);
+	pthread_mutex_unlock(lock);
+
+	ret = inode_update_times(c, dst);
+	if (ret)
+		goto err;
+
+	fuse_reply_write(req, min_t(u64, (u64) sectors << 9, len));
+	return;
+err:
+	fuse_reply_err(req, -ret);
+}
+
 #if 0
 static void bcachefs_fuse_write_buf(fuse_req_t req, fuse_ino_t inum,
 				    struct fuse_bufvec *bufv, off_t off,
@@ -1087,18 +2388,18 @@ static const struct fuse_lowlevel_ops bcachefs_fuse_ops = {
 	.open		= bcachefs_fuse_open,
 	.read		= bcachefs_fuse_read,
 	.write		= bcachefs_fuse_write,
-	//.flush	= bcachefs_fuse_flush,
-	//.release	= bcachefs_fuse_release,
-	//.fsync	= bcachefs_fuse_fsync,
+	.flush		= bcachefs_fuse_flush,
+	.release	= bcachefs_fuse_release,
+	.fsync		= bcachefs_fuse_fsync,
 	//.opendir	= bcachefs_fuse_opendir,
 	.readdir	= bcachefs_fuse_readdir,
-	//.readdirplus	= bcachefs_fuse_readdirplus,
+	.readdirplus	= bcachefs_fuse_readdirplus,
 	//.releasedir	= bcachefs_fuse_releasedir,
 	//.fsyncdir	= bcachefs_fuse_fsyncdir,
 	.statfs		= bcachefs_fuse_statfs,
 	//.setxattr	= bcachefs_fuse_setxattr,
-	//.getxattr	= bcachefs_fuse_getxattr,
-	//.listxattr	= bcachefs_fuse_listxattr,
+	.getxattr	= bcachefs_fuse_getxattr,
+	.listxattr	= bcachefs_fuse_listxattr,
 	//.removexattr	= bcachefs_fuse_removexattr,
 	.create		= bcachefs_fuse_create,
 
@@ -1109,6 +2410,7 @@ static const struct fuse_lowlevel_ops bcachefs_fuse_ops = {
 #endif
 	//.write_buf	= bcachefs_fuse_write_buf,
 	//.fallocate	= bcachefs_fuse_fallocate,
+	.copy_file_range = bcachefs_fuse_copy_file_range,
 
 };
 
@@ -1120,6 +2422,7 @@ struct bf_context {
 	char            *devices_str;
 	char            **devices;
 	int             nr_devices;
+	unsigned        readahead_max_mb;
 };
 
 static void bf_context_free(struct bf_context *ctx)
@@ -1133,6 +2436,7 @@ static void bf_context_free(struct bf_context *ctx)
 }
 
 static struct fuse_opt bf_opts[] = {
+	{ "readahead_max=%u", offsetof(struct bf_context, readahead_max_mb), 0 },
 	FUSE_OPT_END
 };
 
@@ -1195,13 +2499,16 @@ static void usage(char *argv[])
 	printf("Usage: %s fusemount [options] <dev>[:dev2:...] <mountpoint>\n",
 	       argv[0]);
 	printf("\n");
+	printf("    -o readahead_max=N    max readahead window for sequential reads,\n");
+	printf("                          in MB (default 2, 0 disables)\n");
+	printf("\n");
 }
 
 int cmd_fusemount(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	struct bch_opts bch_opts = bch2_opts_empty();
-	struct bf_context ctx = { 0 };
+	struct bf_context ctx = { .readahead_max_mb = 2 };
 	struct bch_fs *c = NULL;
 	int ret = 0, i;
 
@@ -1209,6 +2516,8 @@ int cmd_fusemount(int argc, char *argv[])
 	if (fuse_opt_parse(&args, &ctx, bf_opts, bf_opt_proc) < 0)
 		die("fuse_opt_parse err: %m");
 
+	fuse_ra_max = (size_t) ctx.readahead_max_mb << 20;
+
 	struct fuse_cmdline_opts fuse_opts;
 	if (fuse_parse_cmdline(&args, &fuse_opts) < 0)
 		die("fuse_parse_cmdline err: %m");
@@ -1285,7 +2594,16 @@ int cmd_fusemount(int argc, char *argv[])
 
 	fuse_daemonize(fuse_opts.foreground);
 
-	ret = fuse_session_loop(se);
+	if (fuse_opts.singlethread) {
+		ret = fuse_session_loop(se);
+	} else {
+		struct fuse_loop_config config = {
+			.clone_fd		= fuse_opts.clone_fd,
+			.max_idle_threads	= fuse_opts.max_idle_threads,
+		};
+
+		ret = fuse_session_loop_mt(se, &config);
+	}
 
 	/* Cleanup */
 	fuse_session_unmount(se);
@@ -0,0 +1,280 @@
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libbcachefs/darray.h"
+
+#include "cmds.h"
+#include "libbcachefs.h"
+
+/*
+ * Summarize the kernel's per-event time_stats: one row per event with count,
+ * max and the histogram-derived p50/p90/p99, pulled from
+ * /sys/fs/bcachefs/<uuid>/time_stats/. The full per-event output (means,
+ * stddevs, buckets) is still there for digging; this is the one-screen view
+ * for "which latency tail got worse".
+ */
+
+static u64 stats_parse_u64(const char *buf, const char *field)
+{
+	const char *p = strstr(buf, field);
+
+	return p ? strtoull(p + strlen(field), NULL, 10) : 0;
+}
+
+static char *stats_parse_str(const char *buf, const char *field)
+{
+	const char *p = strstr(buf, field);
+
+	if (!p)
+		return strdup("-");
+
+	p += strlen(field);
+	while (*p == ' ' || *p == '\t')
+		p++;
+
+	const char *e = p;
+	while (*e && *e != '\n')
+		e++;
+	while (e > p && e[-1] == ' ')
+		e--;
+
+	char *ret = xmalloc(e - p + 1);
+	memcpy(ret, p, e - p);
+	ret[e - p] = '\0';
+	return ret;
+}
+
+static int cmp_str(const void *_l, const void *_r)
+{
+	const char * const *l = _l, * const *r = _r;
+
+	return strcmp(*l, *r);
+}
+
+static void internals_latency_usage(void)
+{
+	puts("bcachefs internals latency - show latency percentiles per event\n"
+	     "Usage: bcachefs internals latency [OPTION]... <mountpoint>\n"
+	     "\n"
+	     "Options:\n"
+	     "  -a, --all                   Include events that haven't fired\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+int cmd_internals_latency(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "all",			0, NULL, 'a' },
+		{ "help",			0, NULL, 'h' },
+		{ NULL }
+	};
+	bool show_all = false;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "ah", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'a':
+			show_all = true;
+			break;
+		case 'h':
+			internals_latency_usage();
+			break;
+		}
+	args_shift(optind);
+
+	char *fs_path = arg_pop();
+	if (!fs_path)
+		fs_path = ".";
+	if (argc)
+		die("too many arguments");
+
+	struct bchfs_handle fs = bcache_fs_open(fs_path);
+
+	int dirfd = xopenat(fs.sysfs_fd, "time_stats", O_RDONLY);
+	DIR *dir = fdopendir(dirfd);
+	if (!dir)
+		die("fdopendir error: %m");
+
+	DARRAY(char *) names = { 0 };
+	struct dirent *d;
+
+	while ((errno = 0), (d = readdir(dir)))
+		if (d->d_name[0] != '.')
+			darray_push(&names, strdup(d->d_name));
+	if (errno)
+		die("readdir error: %m");
+
+	qsort(names.data, names.nr, sizeof(names.data[0]), cmp_str);
+
+	printf("%-36s %10s %10s %10s %10s %10s\n",
+	       "event", "count", "p50", "p90", "p99", "max");
+
+	darray_for_each(names, name) {
+		char *buf	= read_file_str(dirfd, *name);
+		u64 count	= stats_parse_u64(buf, "count:");
+
+		if (count || show_all) {
+			char *p50 = stats_parse_str(buf, "p50: ");
+			char *p90 = stats_parse_str(buf, "p90: ");
+			char *p99 = stats_parse_str(buf, "p99: ");
+			char *max = stats_parse_str(buf, "max:");
+
+			printf("%-36s %10llu %10s %10s %10s %10s\n",
+			       *name, count, p50, p90, p99, max);
+
+			free(p50);
+			free(p90);
+			free(p99);
+			free(max);
+		}
+
+		free(buf);
+		free(*name);
+	}
+
+	darray_exit(&names);
+	closedir(dir);
+	bcache_fs_close(fs);
+	return 0;
+}
+
+static void internals_watch(struct bchfs_handle fs, const char *file,
+			    unsigned interval)
+{
+	while (true) {
+		char *buf = read_file_str(fs.sysfs_fd, file);
+
+		if (interval) {
+			time_t now = time(NULL);
+			char tstamp[64];
+
+			strftime(tstamp, sizeof(tstamp), "%F %T",
+				 localtime(&now));
+			printf("--- %s\n", tstamp);
+		}
+		puts(buf);
+		free(buf);
+
+		if (!interval)
+			break;
+		sleep(interval);
+	}
+}
+
+static void internals_btree_cache_usage(void)
+{
+	puts("bcachefs internals btree-cache - show btree node cache telemetry\n"
+	     "Usage: bcachefs internals btree-cache [OPTION]... <mountpoint>\n"
+	     "\n"
+	     "Options:\n"
+	     "  -w, --watch=seconds         Refresh every @seconds\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+int cmd_internals_btree_cache(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "watch",			required_argument, NULL, 'w' },
+		{ "help",			0, NULL, 'h' },
+		{ NULL }
+	};
+	unsigned interval = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "w:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'w':
+			if (kstrtouint(optarg, 10, &interval) || !interval)
+				die("invalid interval");
+			break;
+		case 'h':
+			internals_btree_cache_usage();
+			break;
+		}
+	args_shift(optind);
+
+	char *fs_path = arg_pop();
+	if (!fs_path)
+		fs_path = ".";
+	if (argc)
+		die("too many arguments");
+
+	struct bchfs_handle fs = bcache_fs_open(fs_path);
+
+	internals_watch(fs, "internal/btree_cache", interval);
+
+	bcache_fs_close(fs);
+	return 0;
+}
+
+static void internals_buckets_waiting_usage(void)
+{
+	puts("bcachefs internals buckets-waiting - show buckets waiting for journal table occupancy\n"
+	     "Usage: bcachefs internals buckets-waiting [OPTION]... <mountpoint>\n"
+	     "\n"
+	     "Options:\n"
+	     "  -w, --watch=seconds         Refresh every @seconds\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+int cmd_internals_buckets_waiting(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "watch",			required_argument, NULL, 'w' },
+		{ "help",			0, NULL, 'h' },
+		{ NULL }
+	};
+	unsigned interval = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "w:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'w':
+			if (kstrtouint(optarg, 10, &interval) || !interval)
+				die("invalid interval");
+			break;
+		case 'h':
+			internals_buckets_waiting_usage();
+			break;
+		}
+	args_shift(optind);
+
+	char *fs_path = arg_pop();
+	if (!fs_path)
+		fs_path = ".";
+	if (argc)
+		die("too many arguments");
+
+	struct bchfs_handle fs = bcache_fs_open(fs_path);
+
+	internals_watch(fs, "internal/buckets_waiting_for_journal", interval);
+
+	bcache_fs_close(fs);
+	return 0;
+}
+
+int internals_usage(void)
+{
+	puts("bcachefs internals - view internal filesystem statistics\n"
+	     "Usage: bcachefs internals <CMD> [OPTION]\n"
+	     "\n"
+	     "Commands:\n"
+	     "  latency                  Show latency percentiles per event\n"
+	     "  btree-cache              Show btree node cache telemetry\n"
+	     "  buckets-waiting          Show buckets waiting for journal table occupancy\n"
+	     "\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	return 0;
+}
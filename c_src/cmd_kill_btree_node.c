@@ -9,6 +9,7 @@
 
 #include "libbcachefs/bcachefs.h"
 #include "libbcachefs/btree_iter.h"
+#include "libbcachefs/darray.h"
 #include "libbcachefs/errcode.h"
 #include "libbcachefs/error.h"
 #include "libbcachefs/sb-members.h"
@@ -23,21 +24,144 @@ static void kill_btree_node_usage(void)
 	     "  -b (extents|inodes|dirents|xattrs)    Btree to delete from\n"
 	     "  -l level                              Levle to delete from (0 == leaves)\n"
 	     "  -i index                              Index of btree node to kill\n"
+	     "  -p inode:offset                       Kill the node covering pos, found\n"
+	     "                                        by direct descent instead of a walk\n"
 	     "  -h                                    Display this help and exit\n"
+	     "\n"
+	     "-i and -p may be given multiple times, each using the -b/-l in effect at\n"
+	     "that point; index targets on the same btree and level are resolved in a\n"
+	     "single walk.\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 }
 
+struct kill_node {
+	enum btree_id	btree;
+	unsigned	level;
+	bool		have_pos;
+	struct bpos	pos;
+	u64		idx;
+};
+
+static int kill_node_cmp(const void *_l, const void *_r)
+{
+	const struct kill_node *l = _l, *r = _r;
+
+	return  cmp_int(l->btree, r->btree) ?:
+		cmp_int(l->level, r->level) ?:
+		cmp_int(l->have_pos, r->have_pos) ?:
+		cmp_int(l->idx, r->idx);
+}
+
+static int kill_node(struct bch_fs *c, struct btree *b, void *zeroes)
+{
+	struct printbuf buf = PRINTBUF;
+
+	bch2_bkey_val_to_text(&buf, c, bkey_i_to_s_c(&b->key));
+	bch_info(c, "killing btree node %s", buf.buf);
+	printbuf_exit(&buf);
+
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(&b->key));
+	bkey_for_each_ptr(ptrs, ptr) {
+		struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
+
+		int ret = pwrite(ca->disk_sb.bdev->bd_fd, zeroes,
+				 c->opts.block_size, ptr->offset << 9);
+		if (ret != c->opts.block_size) {
+			bch_err(c, "pwrite error: expected %u got %i %s",
+				c->opts.block_size, ret, strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	return 0;
+}
+
+static int kill_node_at_pos(struct bch_fs *c, struct btree_trans *trans,
+			    struct kill_node *t, void *zeroes)
+{
+	struct btree_iter iter;
+	struct btree *b;
+	int ret;
+retry:
+	bch2_trans_node_iter_init(trans, &iter, t->btree, t->pos, 0, t->level, 0);
+	b = bch2_btree_iter_peek_node(&iter);
+	ret = PTR_ERR_OR_ZERO(b);
+	if (bch2_err_matches(ret, BCH_ERR_transaction_restart)) {
+		bch2_trans_iter_exit(trans, &iter);
+		goto retry;
+	}
+	if (ret) {
+		bch_err(c, "error %s descending to node", bch2_err_str(ret));
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (!b || b->c.level != t->level) {
+		bch_err(c, "no node at btree %s level %u pos %llu:%llu",
+			bch2_btree_id_str(t->btree), t->level,
+			t->pos.inode, t->pos.offset);
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	ret = kill_node(c, b, zeroes);
+out:
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+/*
+ * Kill @nr index targets, sorted by index, on the same btree and level, in a
+ * single walk:
+ */
+static int kill_nodes_by_index(struct bch_fs *c, struct btree_trans *trans,
+			       struct kill_node *t, unsigned nr, void *zeroes)
+{
+	struct btree_iter iter;
+	struct btree *b;
+	u64 idx = 0;
+	unsigned done = 0;
+	int ret;
+
+	__for_each_btree_node(trans, iter, t->btree, POS_MIN, 0, t->level, 0, b, ret) {
+		if (b->c.level != t->level)
+			continue;
+
+		while (done < nr && t[done].idx == idx) {
+			ret = kill_node(c, b, zeroes);
+			if (ret)
+				goto out;
+			done++;
+		}
+
+		if (done == nr)
+			break;
+		idx++;
+	}
+
+	if (ret) {
+		bch_err(c, "error %s walking btree nodes", bch2_err_str(ret));
+		ret = EXIT_FAILURE;
+	} else if (done < nr) {
+		bch_err(c, "node at index %llu not found", t[done].idx);
+		ret = EXIT_FAILURE;
+	}
+out:
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
 int cmd_kill_btree_node(int argc, char *argv[])
 {
 	struct bch_opts opts = bch2_opts_empty();
+	DARRAY(struct kill_node) targets = {};
 	enum btree_id btree_id = 0;
 	unsigned level = 0;
-	u64 node_index = 0;
 	int opt;
 
 	opt_set(opts, read_only,	true);
 
-	while ((opt = getopt(argc, argv, "b:l:i:h")) != -1)
+	while ((opt = getopt(argc, argv, "b:l:i:p:h")) != -1)
 		switch (opt) {
 		case 'b':
 			btree_id = read_string_list_or_die(optarg,
@@ -47,10 +171,30 @@ int cmd_kill_btree_node(int argc, char *argv[])
 			if (kstrtouint(optarg, 10, &level) || level >= BTREE_MAX_DEPTH)
 				die("invalid level");
 			break;
-		case 'i':
-			if (kstrtoull(optarg, 10, &node_index))
+		case 'i': {
+			struct kill_node n = {
+				.btree	= btree_id,
+				.level	= level,
+			};
+
+			if (kstrtoull(optarg, 10, &n.idx))
 				die("invalid index %s", optarg);
+			if (darray_push(&targets, n))
+				die("allocation failure");
 			break;
+		}
+		case 'p': {
+			struct kill_node n = {
+				.btree		= btree_id,
+				.level		= level,
+				.have_pos	= true,
+				.pos		= bpos_parse(optarg),
+			};
+
+			if (darray_push(&targets, n))
+				die("allocation failure");
+			break;
+		}
 		case 'h':
 			kill_btree_node_usage();
 			exit(EXIT_SUCCESS);
@@ -60,13 +204,23 @@ int cmd_kill_btree_node(int argc, char *argv[])
 	if (!argc)
 		die("Please supply device(s)");
 
+	if (!targets.nr) {
+		struct kill_node n = {
+			.btree	= btree_id,
+			.level	= level,
+		};
+
+		if (darray_push(&targets, n))
+			die("allocation failure");
+	}
+
+	qsort(targets.data, targets.nr, sizeof(targets.data[0]), kill_node_cmp);
+
 	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
 	if (IS_ERR(c))
 		die("error opening %s: %s", argv[0], bch2_err_str(PTR_ERR(c)));
 
 	struct btree_trans *trans = bch2_trans_get(c);
-	struct btree_iter iter;
-	struct btree *b;
 	int ret;
 	void *zeroes;
 
@@ -74,42 +228,29 @@ int cmd_kill_btree_node(int argc, char *argv[])
 	if (ret)
 		die("error %s from posix_memalign", bch2_err_str(ret));
 
-	__for_each_btree_node(trans, iter, btree_id, POS_MIN, 0, level, 0, b, ret) {
-		if (b->c.level != level)
-			continue;
+	unsigned i = 0;
+	while (i < targets.nr && !ret) {
+		struct kill_node *t = &targets.data[i];
 
-		if (!node_index) {
-			struct printbuf buf = PRINTBUF;
-			bch2_bkey_val_to_text(&buf, c, bkey_i_to_s_c(&b->key));
-			bch_info(c, "killing btree node %s", buf.buf);
-			printbuf_exit(&buf);
-
-			struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(&b->key));
-			bkey_for_each_ptr(ptrs, ptr) {
-				struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
-
-				ret = pwrite(ca->disk_sb.bdev->bd_fd, zeroes,
-					     c->opts.block_size, ptr->offset << 9);
-				if (ret != c->opts.block_size) {
-					bch_err(c, "pwrite error: expected %u got %i %s",
-						c->opts.block_size, ret, strerror(errno));
-					ret = EXIT_FAILURE;
-					goto done;
-				}
-			}
-			goto done;
-		}
+		if (t->have_pos) {
+			ret = kill_node_at_pos(c, trans, t, zeroes);
+			i++;
+		} else {
+			unsigned j = i + 1;
 
-		node_index--;
+			while (j < targets.nr &&
+			       targets.data[j].btree == t->btree &&
+			       targets.data[j].level == t->level &&
+			       !targets.data[j].have_pos)
+				j++;
+
+			ret = kill_nodes_by_index(c, trans, t, j - i, zeroes);
+			i = j;
+		}
 	}
-	if (ret)
-		bch_err(c, "error %i walking btree nodes", ret);
-	else
-		bch_err(c, "node at specified index not found");
-	ret = EXIT_FAILURE;
-done:
-	bch2_trans_iter_exit(trans, &iter);
+
 	bch2_trans_put(trans);
+	darray_exit(&targets);
 
 	bch2_fs_stop(c);
 	return ret;
@@ -1,14 +1,20 @@
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
 
 #include "cmds.h"
 #include "libbcachefs.h"
 #include "tools-util.h"
 
 #include "libbcachefs/bcachefs.h"
+#include "libbcachefs/btree_cache.h"
 #include "libbcachefs/btree_iter.h"
 #include "libbcachefs/errcode.h"
 #include "libbcachefs/error.h"
@@ -30,6 +36,9 @@ static void list_journal_usage(void)
 	     "  -t, --transaction-filter=bbpos    Filter transactions not updating <bbpos>\n"
 	     "                                    Or entries not matching the range <bbpos-bbpos>\n"
 	     "  -k, --key-filter=btree            Filter keys not updating btree\n"
+	     "  -s, --snapshot=id                 Filter key entries without keys in snapshot <id>\n"
+	     "                                    (exact id match - the snapshot tree isn't read here)\n"
+	     "  -S, --stats-only                  Print per-btree update counts instead of entries\n"
 	     "  -v, --verbose                     Verbose mode\n"
 	     "  -h, --help                        Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
@@ -54,6 +63,205 @@ static inline bool entry_is_transaction_start(struct jset_entry *entry)
 typedef DARRAY(struct bbpos_range) d_bbpos_range;
 typedef DARRAY(enum btree_id) d_btree_id;
 
+/*
+ * Sidecar journal index:
+ *
+ * Filtering decodes every key of every transaction to decide what to print,
+ * which dominates repeated filtered queries against a big journal. The first
+ * scan writes a compact index - per journal seq, the location of the entry
+ * and a bitmap of btrees it updates - which later runs mmap and binary
+ * search to skip entries that can't match a transaction filter without
+ * looking at their contents.
+ *
+ * The index is keyed by superblock seq: any superblock write invalidates it
+ * and the next run rebuilds.
+ */
+
+#define JOURNAL_INDEX_MAGIC	0x6a6f75726e696478ULL	/* "journidx" */
+#define JOURNAL_INDEX_VERSION	1
+
+struct journal_index_header {
+	__le64		magic;
+	__le32		version;
+	__le32		pad;
+	__le64		sb_seq;
+	__le64		nr;
+};
+
+struct journal_index_entry {
+	__le64		seq;
+	__le64		btree_bitmap;
+	__le32		dev;
+	__le32		bucket;
+	__le32		bucket_offset;
+	__le32		sectors;
+};
+
+struct journal_index {
+	struct journal_index_header	*hdr;
+	struct journal_index_entry	*entries;
+	size_t				bytes;
+};
+
+static void journal_index_path(struct bch_fs *c, char *path, size_t len)
+{
+	char uuid[40];
+
+	uuid_unparse_lower(c->sb.user_uuid.b, uuid);
+	snprintf(path, len, "/var/lib/bcachefs/journal-index-%s", uuid);
+}
+
+static u64 entry_btree_bitmap(struct jset *j)
+{
+	u64 bitmap = 0;
+
+	vstruct_for_each(j, entry)
+		if ((entry->type == BCH_JSET_ENTRY_btree_root ||
+		     entry->type == BCH_JSET_ENTRY_btree_keys ||
+		     entry->type == BCH_JSET_ENTRY_overwrite) &&
+		    entry->btree_id < 64)
+			bitmap |= 1ULL << entry->btree_id;
+
+	return bitmap;
+}
+
+static void journal_index_write(struct bch_fs *c)
+{
+	struct journal_replay *p, **_p;
+	struct genradix_iter iter;
+	struct journal_index_header hdr = {
+		.magic		= cpu_to_le64(JOURNAL_INDEX_MAGIC),
+		.version	= cpu_to_le32(JOURNAL_INDEX_VERSION),
+		.sb_seq		= c->disk_sb.sb->seq,
+	};
+	char path[PATH_MAX];
+	u64 nr = 0;
+	FILE *f;
+
+	journal_index_path(c, path, sizeof(path));
+	mkdir("/var/lib/bcachefs", 0755);
+
+	f = fopen(path, "we");
+	if (!f)
+		return;
+
+	/* header rewritten with the entry count once we know it: */
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto err;
+
+	genradix_for_each(&c->journal_entries, iter, _p) {
+		p = *_p;
+		if (!p)
+			continue;
+
+		struct journal_index_entry e = {
+			.seq		= p->j.seq,
+			.btree_bitmap	= cpu_to_le64(entry_btree_bitmap(&p->j)),
+			.dev		= cpu_to_le32(p->ptrs[0].dev),
+			.bucket		= cpu_to_le32(p->ptrs[0].bucket),
+			.bucket_offset	= cpu_to_le32(p->ptrs[0].bucket_offset),
+			.sectors	= cpu_to_le32(vstruct_sectors(&p->j,
+						c->block_bits)),
+		};
+
+		if (fwrite(&e, sizeof(e), 1, f) != 1)
+			goto err;
+		nr++;
+	}
+
+	hdr.nr = cpu_to_le64(nr);
+	if (fseek(f, 0, SEEK_SET) ||
+	    fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto err;
+
+	fclose(f);
+	return;
+err:
+	fclose(f);
+	unlink(path);
+}
+
+static int journal_index_load(struct bch_fs *c, struct journal_index *idx)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	void *m;
+	int fd;
+
+	journal_index_path(c, path, sizeof(path));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) ||
+	    (size_t) st.st_size < sizeof(*idx->hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return -1;
+
+	idx->hdr	= m;
+	idx->entries	= m + sizeof(*idx->hdr);
+	idx->bytes	= st.st_size;
+
+	if (le64_to_cpu(idx->hdr->magic)	!= JOURNAL_INDEX_MAGIC ||
+	    le32_to_cpu(idx->hdr->version)	!= JOURNAL_INDEX_VERSION ||
+	    idx->hdr->sb_seq			!= c->disk_sb.sb->seq ||
+	    sizeof(*idx->hdr) + le64_to_cpu(idx->hdr->nr) * sizeof(*idx->entries) !=
+	    (size_t) st.st_size) {
+		munmap(m, st.st_size);
+		idx->hdr = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void journal_index_exit(struct journal_index *idx)
+{
+	if (idx->hdr)
+		munmap(idx->hdr, idx->bytes);
+}
+
+/* entries are written in seq order, so seq lookup is a binary search: */
+static struct journal_index_entry *journal_index_find(struct journal_index *idx,
+						      u64 seq)
+{
+	size_t l = 0, r = le64_to_cpu(idx->hdr->nr);
+
+	while (l < r) {
+		size_t m = l + (r - l) / 2;
+
+		if (le64_to_cpu(idx->entries[m].seq) < seq)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return l < le64_to_cpu(idx->hdr->nr) &&
+		le64_to_cpu(idx->entries[l].seq) == seq
+		? &idx->entries[l]
+		: NULL;
+}
+
+/* the btrees a transaction filter could possibly match: */
+static u64 filter_btree_bitmap(d_bbpos_range filter)
+{
+	u64 bitmap = 0;
+
+	darray_for_each(filter, i)
+		for (unsigned id = i->start.btree;
+		     id <= min_t(unsigned, i->end.btree, 63); id++)
+			bitmap |= 1ULL << id;
+
+	return bitmap;
+}
+
 static bool bkey_matches_filter(d_bbpos_range filter, struct jset_entry *entry, struct bkey_i *k)
 {
 	darray_for_each(filter, i) {
@@ -98,11 +306,12 @@ static bool should_print_transaction(struct jset_entry *entry, struct jset_entry
 	return false;
 }
 
-static bool should_print_entry(struct jset_entry *entry, d_btree_id filter)
+static bool should_print_entry(struct jset_entry *entry, d_btree_id filter,
+			       u32 snapshot)
 {
 	struct bkey_i *k;
 
-	if (!filter.nr)
+	if (!filter.nr && !snapshot)
 		return true;
 
 	if (entry->type != BCH_JSET_ENTRY_btree_root &&
@@ -110,21 +319,188 @@ static bool should_print_entry(struct jset_entry *entry, d_btree_id filter)
 	    entry->type != BCH_JSET_ENTRY_overwrite)
 		return true;
 
-	jset_entry_for_each_key(entry, k)
+	if (filter.nr) {
+		bool match = false;
+
 		darray_for_each(filter, id)
 			if (entry->btree_id == *id)
+				match = true;
+		if (!match)
+			return false;
+	}
+
+	if (snapshot) {
+		jset_entry_for_each_key(entry, k)
+			if (k->k.p.snapshot == snapshot)
 				return true;
+		return false;
+	}
 
-	return false;
+	return true;
+}
+
+/*
+ * Render one journal entry into @out, byte for byte what the old inline
+ * printf() loop produced. @buf is a reusable scratch buffer for the pieces
+ * that get starred when the entry is blacklisted.
+ */
+static void journal_replay_to_text(struct printbuf *out, struct printbuf *buf,
+				   struct bch_fs *c, struct journal_replay *p,
+				   d_bbpos_range transaction_filter,
+				   d_btree_id key_filter,
+				   u32 snapshot)
+{
+	bool blacklisted = p->ignore ||
+		bch2_journal_seq_is_blacklisted(c,
+				le64_to_cpu(p->j.seq), false);
+
+	printbuf_reset(buf);
+
+	if (!transaction_filter.nr) {
+		if (blacklisted)
+			prt_str(out, "blacklisted ");
+
+		prt_printf(out, "journal entry     %llu\n", le64_to_cpu(p->j.seq));
+
+		prt_printf(buf,
+			   "  version         %u\n"
+			   "  last seq        %llu\n"
+			   "  flush           %u\n"
+			   "  written at      ",
+			   le32_to_cpu(p->j.version),
+			   le64_to_cpu(p->j.last_seq),
+			   !JSET_NO_FLUSH(&p->j));
+		bch2_journal_ptrs_to_text(buf, c, p);
+
+		if (blacklisted)
+			star_start_of_lines(buf->buf);
+		prt_printf(out, "%s\n", buf->buf);
+		printbuf_reset(buf);
+	}
+
+	struct jset_entry *entry = p->j.start;
+	struct jset_entry *end = vstruct_last(&p->j);
+	while (entry != end) {
+
+		/*
+		 * log entries denote the start of a new transaction
+		 * commit:
+		 */
+		if (entry_is_transaction_start(entry)) {
+			if (!should_print_transaction(entry, end, transaction_filter)) {
+				do {
+					entry = vstruct_next(entry);
+				} while (entry != end && !entry_is_transaction_start(entry));
+
+				continue;
+			}
+
+			prt_newline(buf);
+		}
+
+		if (!should_print_entry(entry, key_filter, snapshot))
+			goto next;
+
+		bool highlight = entry_matches_transaction_filter(entry, transaction_filter);
+		if (highlight)
+			prt_str(out, RED);
+
+		printbuf_indent_add(buf, 4);
+		bch2_journal_entry_to_text(buf, c, entry);
+
+		if (blacklisted)
+			star_start_of_lines(buf->buf);
+		prt_printf(out, "%s\n", buf->buf);
+		printbuf_reset(buf);
+
+		if (highlight)
+			prt_str(out, NORMAL);
+next:
+		entry = vstruct_next(entry);
+	}
+}
+
+/*
+ * Rendering keys to text is far slower than reading the journal: decoding a
+ * big journal is I/O bound but printing it was CPU bound, single threaded.
+ * Render entries to printbufs on a pool of worker threads, in batches, and
+ * have the main thread emit each batch with large vectored writes.
+ *
+ * Per-slot output buffers and per-worker scratch buffers are reset, not
+ * freed, between batches, so steady state does no allocation.
+ */
+#define RENDER_THREADS		8
+#define RENDER_BATCH		1024
+
+typedef DARRAY(struct journal_replay *) d_journal_replay;
+
+struct journal_render_state {
+	struct bch_fs		*c;
+	d_bbpos_range		transaction_filter;
+	d_btree_id		key_filter;
+	u32			snapshot;
+
+	struct journal_replay	**entries;
+	size_t			nr;
+	size_t			next;
+	pthread_mutex_t		lock;
+
+	struct printbuf		*out;
+};
+
+static void *journal_render_thread(void *_s)
+{
+	struct journal_render_state *s = _s;
+	struct printbuf buf = PRINTBUF;
+
+	while (1) {
+		pthread_mutex_lock(&s->lock);
+		size_t i = s->next++;
+		pthread_mutex_unlock(&s->lock);
+
+		if (i >= s->nr)
+			break;
+
+		journal_replay_to_text(&s->out[i], &buf, s->c, s->entries[i],
+				       s->transaction_filter,
+				       s->key_filter,
+				       s->snapshot);
+	}
+
+	printbuf_exit(&buf);
+	return NULL;
+}
+
+static void writev_all(int fd, struct iovec *iov, unsigned nr)
+{
+	while (nr) {
+		ssize_t w = writev(fd, iov, min_t(unsigned, nr, IOV_MAX));
+		if (w < 0)
+			die("write error: %m");
+
+		while (nr && (size_t) w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			nr--;
+		}
+
+		if (w) {
+			iov->iov_base	+= w;
+			iov->iov_len	-= w;
+		}
+	}
 }
 
 static void journal_entries_print(struct bch_fs *c, unsigned nr_entries,
 				  d_bbpos_range transaction_filter,
-				  d_btree_id key_filter)
+				  d_btree_id key_filter,
+				  u32 snapshot,
+				  struct journal_index *idx)
 {
 	struct journal_replay *p, **_p;
 	struct genradix_iter iter;
-	struct printbuf buf = PRINTBUF;
+	d_journal_replay entries = { 0 };
+	u64 filter_bitmap = filter_btree_bitmap(transaction_filter);
 
 	genradix_for_each(&c->journal_entries, iter, _p) {
 		p = *_p;
@@ -134,77 +510,121 @@ static void journal_entries_print(struct bch_fs *c, unsigned nr_entries,
 		if (le64_to_cpu(p->j.seq) + nr_entries < atomic64_read(&c->journal.seq))
 			continue;
 
-		bool blacklisted = p->ignore ||
-			bch2_journal_seq_is_blacklisted(c,
-					le64_to_cpu(p->j.seq), false);
-
-		if (!transaction_filter.nr) {
-			if (blacklisted)
-				printf("blacklisted ");
-
-			printf("journal entry     %llu\n", le64_to_cpu(p->j.seq));
+		/*
+		 * If the index says this entry updates none of the btrees the
+		 * transaction filter covers, skip it without decoding:
+		 */
+		if (transaction_filter.nr && idx->hdr) {
+			struct journal_index_entry *e =
+				journal_index_find(idx, le64_to_cpu(p->j.seq));
 
-			printbuf_reset(&buf);
-
-			prt_printf(&buf,
-				   "  version         %u\n"
-				   "  last seq        %llu\n"
-				   "  flush           %u\n"
-				   "  written at      ",
-				   le32_to_cpu(p->j.version),
-				   le64_to_cpu(p->j.last_seq),
-				   !JSET_NO_FLUSH(&p->j));
-			bch2_journal_ptrs_to_text(&buf, c, p);
-
-			if (blacklisted)
-				star_start_of_lines(buf.buf);
-			printf("%s\n", buf.buf);
-			printbuf_reset(&buf);
+			if (e && !(le64_to_cpu(e->btree_bitmap) & filter_bitmap))
+				continue;
 		}
 
-		struct jset_entry *entry = p->j.start;
-		struct jset_entry *end = vstruct_last(&p->j);
-		while (entry != end) {
+		darray_push(&entries, p);
+	}
 
-			/*
-			 * log entries denote the start of a new transaction
-			 * commit:
-			 */
-			if (entry_is_transaction_start(entry)) {
-				if (!should_print_transaction(entry, end, transaction_filter)) {
-					do {
-						entry = vstruct_next(entry);
-					} while (entry != end && !entry_is_transaction_start(entry));
+	struct journal_render_state s = {
+		.c			= c,
+		.transaction_filter	= transaction_filter,
+		.key_filter		= key_filter,
+		.snapshot		= snapshot,
+		.lock			= PTHREAD_MUTEX_INITIALIZER,
+		.out			= xcalloc(RENDER_BATCH, sizeof(struct printbuf)),
+	};
+	struct iovec *iov = xcalloc(RENDER_BATCH, sizeof(struct iovec));
+	size_t start;
+
+	fflush(stdout);
+
+	for (start = 0; start < entries.nr; start += RENDER_BATCH) {
+		size_t nr = min_t(size_t, entries.nr - start, RENDER_BATCH);
+		pthread_t threads[RENDER_THREADS];
+		unsigned nr_threads = min_t(size_t, RENDER_THREADS, nr);
+		unsigned i, nr_iov = 0;
+
+		s.entries	= entries.data + start;
+		s.nr		= nr;
+		s.next		= 0;
+
+		for (i = 0; i < nr_threads; i++)
+			if (pthread_create(&threads[i], NULL, journal_render_thread, &s))
+				die("pthread_create error: %m");
+		for (i = 0; i < nr_threads; i++)
+			pthread_join(threads[i], NULL);
+
+		for (i = 0; i < nr; i++)
+			if (s.out[i].pos) {
+				iov[nr_iov].iov_base	= s.out[i].buf;
+				iov[nr_iov].iov_len	= s.out[i].pos;
+				nr_iov++;
+			}
 
-					continue;
-				}
+		writev_all(STDOUT_FILENO, iov, nr_iov);
 
-				prt_newline(&buf);
-			}
+		for (i = 0; i < nr; i++)
+			printbuf_reset(&s.out[i]);
+	}
 
-			if (!should_print_entry(entry, key_filter))
-				goto next;
+	for (unsigned i = 0; i < RENDER_BATCH; i++)
+		printbuf_exit(&s.out[i]);
+	free(iov);
+	free(s.out);
+	darray_exit(&entries);
+}
 
-			bool highlight = entry_matches_transaction_filter(entry, transaction_filter);
-			if (highlight)
-				fputs(RED, stdout);
+static void journal_stats_print(struct bch_fs *c, unsigned nr_entries)
+{
+	struct journal_replay *p, **_p;
+	struct genradix_iter iter;
+	u64 keys[64] = { 0 }, overwrites[64] = { 0 };
+	u64 nr_journal_entries = 0, nr_transactions = 0;
+	struct bkey_i *k;
+	unsigned id;
 
-			printbuf_indent_add(&buf, 4);
-			bch2_journal_entry_to_text(&buf, c, entry);
+	genradix_for_each(&c->journal_entries, iter, _p) {
+		p = *_p;
+		if (!p)
+			continue;
 
-			if (blacklisted)
-				star_start_of_lines(buf.buf);
-			printf("%s\n", buf.buf);
-			printbuf_reset(&buf);
+		if (le64_to_cpu(p->j.seq) + nr_entries < atomic64_read(&c->journal.seq))
+			continue;
 
-			if (highlight)
-				fputs(NORMAL, stdout);
-next:
-			entry = vstruct_next(entry);
+		nr_journal_entries++;
+
+		vstruct_for_each(&p->j, entry) {
+			if (entry_is_transaction_start(entry))
+				nr_transactions++;
+
+			if (entry->btree_id >= ARRAY_SIZE(keys))
+				continue;
+
+			switch (entry->type) {
+			case BCH_JSET_ENTRY_btree_root:
+			case BCH_JSET_ENTRY_btree_keys:
+				jset_entry_for_each_key(entry, k)
+					keys[entry->btree_id]++;
+				break;
+			case BCH_JSET_ENTRY_overwrite:
+				jset_entry_for_each_key(entry, k)
+					overwrites[entry->btree_id]++;
+				break;
+			}
 		}
 	}
 
-	printbuf_exit(&buf);
+	printf("journal entries:  %llu\n", nr_journal_entries);
+	printf("transactions:     %llu\n", nr_transactions);
+	printf("\n%-24s %12s %12s\n", "btree", "updates", "overwrites");
+
+	for (id = 0; id < ARRAY_SIZE(keys); id++)
+		if (keys[id] || overwrites[id])
+			printf("%-24s %12llu %12llu\n",
+			       id < BTREE_ID_NR
+			       ? bch2_btree_id_str(id)
+			       : "(unknown)",
+			       keys[id], overwrites[id]);
 }
 
 int cmd_list_journal(int argc, char *argv[])
@@ -213,6 +633,8 @@ int cmd_list_journal(int argc, char *argv[])
 		{ "nr-entries",		required_argument,	NULL, 'n' },
 		{ "transaction-filter",	required_argument,	NULL, 't' },
 		{ "key-filter",		required_argument,	NULL, 'k' },
+		{ "snapshot",		required_argument,	NULL, 's' },
+		{ "stats-only",		no_argument,		NULL, 'S' },
 		{ "verbose",		no_argument,		NULL, 'v' },
 		{ "help",		no_argument,		NULL, 'h' },
 		{ NULL }
@@ -221,10 +643,13 @@ int cmd_list_journal(int argc, char *argv[])
 	u32 nr_entries = U32_MAX;
 	d_bbpos_range	transaction_filter = { 0 };
 	d_btree_id	key_filter = { 0 };
+	u32 snapshot = 0;
+	bool stats_only = false;
 	int opt;
 
 	opt_set(opts, nochanges,	true);
 	opt_set(opts, norecovery,	true);
+	opt_set(opts, mmap_io,		true);
 	opt_set(opts, read_only,	true);
 	opt_set(opts, degraded,		true);
 	opt_set(opts, errors,		BCH_ON_ERROR_continue);
@@ -232,7 +657,7 @@ int cmd_list_journal(int argc, char *argv[])
 	opt_set(opts, keep_journal,	true);
 	opt_set(opts, read_journal_only,true);
 
-	while ((opt = getopt_long(argc, argv, "an:t:k:vh",
+	while ((opt = getopt_long(argc, argv, "an:t:k:s:Svh",
 				  longopts, NULL)) != -1)
 		switch (opt) {
 		case 'a':
@@ -249,6 +674,13 @@ int cmd_list_journal(int argc, char *argv[])
 		case 'k':
 			darray_push(&key_filter, read_string_list_or_die(optarg, __bch2_btree_ids, "btree id"));
 			break;
+		case 's':
+			if (kstrtouint(optarg, 10, &snapshot))
+				die("error parsing snapshot id");
+			break;
+		case 'S':
+			stats_only = true;
+			break;
 		case 'v':
 			opt_set(opts, verbose, true);
 			break;
@@ -267,7 +699,18 @@ int cmd_list_journal(int argc, char *argv[])
 	if (IS_ERR(c))
 		die("error opening %s: %s", argv[0], bch2_err_str(PTR_ERR(c)));
 
-	journal_entries_print(c, nr_entries, transaction_filter, key_filter);
+	struct journal_index idx = { NULL };
+
+	if (journal_index_load(c, &idx))
+		journal_index_write(c);
+
+	if (stats_only)
+		journal_stats_print(c, nr_entries);
+	else
+		journal_entries_print(c, nr_entries, transaction_filter, key_filter,
+				      snapshot, &idx);
+
+	journal_index_exit(&idx);
 	bch2_fs_stop(c);
 	return 0;
 }
@@ -2,6 +2,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/xattr.h>
 #include <sys/ioctl.h>
@@ -9,6 +11,7 @@
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/vfs.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <linux/fiemap.h>
@@ -34,6 +37,7 @@
 #include "libbcachefs/fs-common.h"
 #include "libbcachefs/inode.h"
 #include "libbcachefs/io_write.h"
+#include "libbcachefs/keylist.h"
 #include "libbcachefs/replicas.h"
 #include "libbcachefs/str_hash.h"
 #include "libbcachefs/super.h"
@@ -206,10 +210,16 @@ static void copy_times(struct bch_fs *c, struct bch_inode_unpacked *dst,
 	dst->bi_ctime = timespec_to_bch2_time(c, src->st_ctim);
 }
 
+/*
+ * xattrs are copied via the /proc/self/fd magic link so names stay relative
+ * to the directory fd - chdir() is process wide and the tree walk is
+ * multithreaded:
+ */
 static void copy_xattrs(struct bch_fs *c, struct bch_inode_unpacked *dst,
-			char *src)
+			int src_fd, const char *name)
 {
 	struct bch_hash_info hash_info = bch2_hash_info_init(c, dst);
+	char *src = mprintf("/proc/self/fd/%i/%s", src_fd, name);
 
 	char attrs[XATTR_LIST_MAX];
 	ssize_t attrs_size = llistxattr(src, attrs, sizeof(attrs));
@@ -239,11 +249,25 @@ static void copy_xattrs(struct bch_fs *c, struct bch_inode_unpacked *dst,
 		if (ret < 0)
 			die("error creating xattr: %s", bch2_err_str(ret));
 	}
+
+	free(src);
 }
 
 #define WRITE_DATA_BUF	(1 << 20)
+#define LINK_DATA_BATCH	8
+
+/* each copy thread gets its own data buffer: */
+static __thread char *migrate_buf;
 
-static char buf[WRITE_DATA_BUF] __aligned(PAGE_SIZE);
+static char *migrate_thread_buf(void)
+{
+	if (!migrate_buf) {
+		migrate_buf = aligned_alloc(PAGE_SIZE, WRITE_DATA_BUF);
+		if (!migrate_buf)
+			die("error allocating copy buffer");
+	}
+	return migrate_buf;
+}
 
 static void write_data(struct bch_fs *c,
 		       struct bch_inode_unpacked *dst_inode,
@@ -264,7 +288,12 @@ static void write_data(struct bch_fs *c,
 	op.nr_replicas	= 1;
 	op.subvol	= 1;
 	op.pos		= SPOS(dst_inode->bi_inum, dst_offset >> 9, U32_MAX);
-	op.flags |= BCH_WRITE_SYNC;
+	/*
+	 * The copy buffer is private to this thread and isn't touched until
+	 * the (synchronous) write completes, so the write path can checksum -
+	 * and encrypt, in place - directly from it instead of bouncing:
+	 */
+	op.flags |= BCH_WRITE_SYNC|BCH_WRITE_PAGES_STABLE|BCH_WRITE_PAGES_OWNED;
 
 	int ret = bch2_disk_reservation_get(c, &op.res, len >> 9,
 					    c->opts.data_replicas, 0);
@@ -284,8 +313,10 @@ static void copy_data(struct bch_fs *c,
 		      struct bch_inode_unpacked *dst_inode,
 		      int src_fd, u64 start, u64 end)
 {
+	char *buf = migrate_thread_buf();
+
 	while (start < end) {
-		unsigned len = min_t(u64, end - start, sizeof(buf));
+		unsigned len = min_t(u64, end - start, WRITE_DATA_BUF);
 		unsigned pad = round_up(len, block_bytes(c)) - len;
 
 		xpread(src_fd, buf, len, start);
@@ -312,60 +343,269 @@ static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 	BUG_ON(physical + length > bucket_to_sector(ca, ca->mi.nbuckets));
 
 	while (length) {
-		struct bkey_i_extent *e;
-		BKEY_PADDED_ONSTACK(k, BKEY_EXTENT_VAL_U64s_MAX) k;
-		u64 b = sector_to_bucket(ca, physical);
+		u64 buf[LINK_DATA_BATCH * BKEY_EXTENT_U64s_MAX];
+		struct keylist keys;
 		struct disk_reservation res;
-		unsigned sectors;
+		unsigned nr = 0, total = 0;
 		int ret;
 
-		sectors = min(ca->mi.bucket_size -
-			      (physical & (ca->mi.bucket_size - 1)),
-			      length);
-
-		e = bkey_extent_init(&k.k);
-		e->k.p.inode	= dst->bi_inum;
-		e->k.p.offset	= logical + sectors;
-		e->k.p.snapshot	= U32_MAX;
-		e->k.size	= sectors;
-		bch2_bkey_append_ptr(&e->k_i, (struct bch_extent_ptr) {
-					.offset = physical,
-					.dev = 0,
-					.gen = *bucket_gen(ca, b),
-				  });
-
-		ret = bch2_disk_reservation_get(c, &res, sectors, 1,
+		bch2_keylist_init(&keys, buf);
+
+		/*
+		 * Batch up bucket sized chunks and bulk insert the sorted run
+		 * with a single transaction commit, instead of a commit per
+		 * chunk:
+		 */
+		while (length && nr < LINK_DATA_BATCH) {
+			struct bkey_i_extent *e;
+			u64 b = sector_to_bucket(ca, physical);
+			unsigned sectors =
+				min(ca->mi.bucket_size -
+				    (physical & (ca->mi.bucket_size - 1)),
+				    length);
+
+			e = bkey_extent_init(keys.top);
+			e->k.p.inode	= dst->bi_inum;
+			e->k.p.offset	= logical + sectors;
+			e->k.p.snapshot	= U32_MAX;
+			e->k.size	= sectors;
+			bch2_bkey_append_ptr(&e->k_i, (struct bch_extent_ptr) {
+						.offset = physical,
+						.dev = 0,
+						.gen = *bucket_gen(ca, b),
+					  });
+			bch2_keylist_push(&keys);
+
+			total		+= sectors;
+			logical		+= sectors;
+			physical	+= sectors;
+			length		-= sectors;
+			nr++;
+		}
+
+		ret = bch2_disk_reservation_get(c, &res, total, 1,
 						BCH_DISK_RESERVATION_NOFAIL);
 		if (ret)
 			die("error reserving space in new filesystem: %s",
 			    bch2_err_str(ret));
 
-		ret = bch2_btree_insert(c, BTREE_ID_extents, &e->k_i, &res, 0);
+		ret = bch2_trans_do(c, &res, NULL, 0,
+			bch2_btree_bulk_insert(trans, BTREE_ID_extents,
+					       &keys, 0));
 		if (ret)
 			die("btree insert error %s", bch2_err_str(ret));
 
 		bch2_disk_reservation_put(c, &res);
 
-		dst->bi_sectors	+= sectors;
-		logical		+= sectors;
-		physical	+= sectors;
-		length		-= sectors;
+		dst->bi_sectors	+= total;
 	}
 }
 
 static void copy_link(struct bch_fs *c, struct bch_inode_unpacked *dst,
-		      char *src)
+		      int src_fd, const char *name)
 {
-	ssize_t ret = readlink(src, buf, sizeof(buf));
+	char *buf = migrate_thread_buf();
+
+	ssize_t ret = readlinkat(src_fd, name, buf, WRITE_DATA_BUF);
 	if (ret < 0)
 		die("readlink error: %m");
 
 	write_data(c, dst, 0, buf, round_up(ret, block_bytes(c)));
 }
 
-static void copy_file(struct bch_fs *c, struct bch_inode_unpacked *dst,
+/*
+ * The tree walk is parallel: directories are pushed onto a shared queue and
+ * pulled off by a pool of worker threads, so statting, fiemapping and btree
+ * insertion for different subtrees all proceed concurrently (the bch2 write
+ * paths have their own locking). Each worker owns the inode of the directory
+ * it's processing - creates by child directories' workers only touch their
+ * own copies - so only the queue, the hardlink table and the extents list
+ * need the lock.
+ */
+struct dir_job {
+	struct bch_inode_unpacked inode;
+	int			fd;
+	char			*path;
+};
+
+typedef DARRAY(struct dir_job) dir_jobs;
+
+/* *dst_inum value while the inode is being created, see copy_dir(): */
+#define HARDLINK_CREATING	U64_MAX
+
+/*
+ * Source filesystems can share extents between files (reflink copies,
+ * snapshots, dedup). Linking each file's copy of a shared range directly
+ * would reference the same sectors from multiple extent keys, double
+ * counting the buckets - so shared ranges become proper reflinks: the first
+ * file to see one creates an indirect extent for it, and every file then
+ * points at that with a reflink pointer, preserving the sharing (and the
+ * space savings) in the new filesystem.
+ */
+struct migrate_reflink {
+	u64			idx;		/* sectors, into the reflink btree */
+	u64			sectors;
+};
+
+struct copy_fs_state {
+	u64			bcachefs_inum;
+	dev_t			dev;
+
+	GENRADIX(u64)		hardlinks;
+	GENRADIX(struct migrate_reflink) reflinks;
+	u64			reflink_pos;
+	ranges			extents;
+
+	struct bch_fs		*c;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	dir_jobs		dirs;
+	size_t			nr_pending;
+};
+
+static void link_reflink_v(struct bch_fs *c, u64 idx, u64 physical, u64 length)
+{
+	struct bch_dev *ca = c->devs[0];
+
+	bch2_check_set_feature(c, BCH_FEATURE_reflink);
+
+	physical	>>= 9;
+	length		>>= 9;
+
+	while (length) {
+		u64 buf[LINK_DATA_BATCH * BKEY_EXTENT_U64s_MAX];
+		struct keylist keys;
+		struct disk_reservation res;
+		unsigned nr = 0, total = 0;
+		int ret;
+
+		bch2_keylist_init(&keys, buf);
+
+		while (length && nr < LINK_DATA_BATCH) {
+			struct bkey_i_reflink_v *r;
+			u64 b = sector_to_bucket(ca, physical);
+			unsigned sectors =
+				min(ca->mi.bucket_size -
+				    (physical & (ca->mi.bucket_size - 1)),
+				    length);
+			struct bch_extent_ptr ptr = {
+				.offset	= physical,
+				.dev	= 0,
+				.gen	= *bucket_gen(ca, b),
+			};
+			ptr.type = 1 << BCH_EXTENT_ENTRY_ptr;
+
+			r = bkey_reflink_v_init(keys.top);
+			r->k.p		= POS(0, idx + sectors);
+			r->k.size	= sectors;
+			r->v.refcount	= 0;
+
+			/* bch2_bkey_append_ptr() doesn't do reflink_v: */
+			memcpy((void *) &r->v + bkey_val_bytes(&r->k),
+			       &ptr, sizeof(ptr));
+			r->k.u64s++;
+
+			bch2_keylist_push(&keys);
+
+			total		+= sectors;
+			idx		+= sectors;
+			physical	+= sectors;
+			length		-= sectors;
+			nr++;
+		}
+
+		ret = bch2_disk_reservation_get(c, &res, total, 1,
+						BCH_DISK_RESERVATION_NOFAIL);
+		if (ret)
+			die("error reserving space in new filesystem: %s",
+			    bch2_err_str(ret));
+
+		ret = bch2_trans_do(c, &res, NULL, 0,
+			bch2_btree_bulk_insert(trans, BTREE_ID_reflink,
+					       &keys, 0));
+		if (ret)
+			die("btree insert error %s", bch2_err_str(ret));
+
+		bch2_disk_reservation_put(c, &res);
+	}
+}
+
+static void link_reflink_p(struct bch_fs *c, struct bch_inode_unpacked *dst,
+			   u64 logical, u64 idx, u64 sectors)
+{
+	struct bkey_i_reflink_p p;
+	int ret;
+
+	bkey_reflink_p_init(&p.k_i);
+	p.k.p.inode	= dst->bi_inum;
+	p.k.p.offset	= (logical >> 9) + sectors;
+	p.k.p.snapshot	= U32_MAX;
+	p.k.size	= sectors;
+	p.v.idx		= cpu_to_le64(idx);
+
+	/*
+	 * No disk reservation: the indirect extent owns the sectors, this
+	 * just takes a reference (via the reflink_p trigger):
+	 */
+	ret = bch2_trans_do(c, NULL, NULL, 0,
+		bch2_btree_insert_trans(trans, BTREE_ID_extents, &p.k_i, 0));
+	if (ret)
+		die("btree insert error %s", bch2_err_str(ret));
+
+	dst->bi_sectors += sectors;
+}
+
+static void copy_file_shared(struct copy_fs_state *s, struct bch_fs *c,
+			     struct bch_inode_unpacked *dst,
+			     int src_fd, u64 src_size,
+			     struct fiemap_extent *e)
+{
+	u64 sectors = e->fe_length >> 9;
+
+	pthread_mutex_lock(&s->lock);
+	struct migrate_reflink *r =
+		genradix_ptr_alloc(&s->reflinks, e->fe_physical >> 9,
+				   GFP_KERNEL);
+	if (!r)
+		die("error allocating reflink map");
+
+	if (!r->sectors) {
+		/*
+		 * First file to reference this range: create the indirect
+		 * extent, under the lock so other references can't race
+		 * ahead of it:
+		 */
+		r->idx		= s->reflink_pos;
+		r->sectors	= sectors;
+		s->reflink_pos	+= sectors;
+
+		range_add(&s->extents, e->fe_physical, e->fe_length);
+		link_reflink_v(c, r->idx, e->fe_physical, e->fe_length);
+	}
+
+	u64 idx		= r->idx;
+	u64 r_sectors	= r->sectors;
+	pthread_mutex_unlock(&s->lock);
+
+	if (r_sectors != sectors) {
+		/*
+		 * Files can share a range while fiemap reports different
+		 * boundaries in each (btrfs splits extents per file); too
+		 * rare to be worth tracking sub-range references, just copy:
+		 */
+		copy_data(c, dst, src_fd, e->fe_logical,
+			  e->fe_logical + min(src_size - e->fe_logical,
+					      e->fe_length));
+		return;
+	}
+
+	link_reflink_p(c, dst, e->fe_logical, idx, sectors);
+}
+
+static void copy_file(struct copy_fs_state *s,
+		      struct bch_fs *c, struct bch_inode_unpacked *dst,
 		      int src_fd, u64 src_size,
-		      char *src_path, ranges *extents)
+		      char *src_path)
 {
 	struct fiemap_iter iter;
 	struct fiemap_extent e;
@@ -410,19 +650,37 @@ static void copy_file(struct bch_fs *c, struct bch_inode_unpacked *dst,
 		if ((e.fe_physical	& (block_bytes(c) - 1)))
 			die("Unaligned extent in %s - can't handle", src_path);
 
-		range_add(extents, e.fe_physical, e.fe_length);
+		if (e.fe_flags & FIEMAP_EXTENT_SHARED) {
+			copy_file_shared(s, c, dst, src_fd, src_size, &e);
+			continue;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		range_add(&s->extents, e.fe_physical, e.fe_length);
+		pthread_mutex_unlock(&s->lock);
+
 		link_data(c, dst, e.fe_logical, e.fe_physical, e.fe_length);
 	}
 	fiemap_iter_exit(&iter);
 }
 
-struct copy_fs_state {
-	u64			bcachefs_inum;
-	dev_t			dev;
+static void queue_dir_copy(struct copy_fs_state *s,
+			   struct bch_inode_unpacked *inode,
+			   int fd, char *path)
+{
+	struct dir_job job = {
+		.inode	= *inode,
+		.fd	= fd,
+		.path	= path,
+	};
 
-	GENRADIX(u64)		hardlinks;
-	ranges			extents;
-};
+	pthread_mutex_lock(&s->lock);
+	if (darray_push(&s->dirs, job))
+		die("error allocating directory queue");
+	s->nr_pending++;
+	pthread_cond_signal(&s->wait);
+	pthread_mutex_unlock(&s->lock);
+}
 
 static void copy_dir(struct copy_fs_state *s,
 		     struct bch_fs *c,
@@ -436,9 +694,6 @@ static void copy_dir(struct copy_fs_state *s,
 		struct bch_inode_unpacked inode;
 		int fd;
 
-		if (fchdir(src_fd))
-			die("chdir error: %m");
-
 		struct stat stat =
 			xfstatat(src_fd, d->d_name, AT_SYMLINK_NOFOLLOW);
 
@@ -453,45 +708,72 @@ static void copy_dir(struct copy_fs_state *s,
 		if (stat.st_dev != s->dev)
 			die("%s does not have correct st_dev!", child_path);
 
-		u64 *dst_inum = S_ISREG(stat.st_mode)
-			? genradix_ptr_alloc(&s->hardlinks, stat.st_ino, GFP_KERNEL)
-			: NULL;
+		u64 *dst_inum = NULL;
+
+		if (S_ISREG(stat.st_mode)) {
+			/*
+			 * Another worker may be seeing this inode via a
+			 * different link right now; whoever gets here first
+			 * creates it, everyone else waits and hardlinks:
+			 */
+			pthread_mutex_lock(&s->lock);
+			dst_inum = genradix_ptr_alloc(&s->hardlinks,
+						      stat.st_ino, GFP_KERNEL);
+			if (!dst_inum)
+				die("error allocating hardlink table");
+
+			while (*dst_inum == HARDLINK_CREATING)
+				pthread_cond_wait(&s->wait, &s->lock);
+
+			if (*dst_inum) {
+				u64 inum = *dst_inum;
+
+				pthread_mutex_unlock(&s->lock);
+				create_link(c, dst, d->d_name, inum, S_IFREG);
+				goto next;
+			}
 
-		if (dst_inum && *dst_inum) {
-			create_link(c, dst, d->d_name, *dst_inum, S_IFREG);
-			goto next;
+			*dst_inum = HARDLINK_CREATING;
+			pthread_mutex_unlock(&s->lock);
 		}
 
 		inode = create_file(c, dst, d->d_name,
 				    stat.st_uid, stat.st_gid,
 				    stat.st_mode, stat.st_rdev);
 
-		if (dst_inum)
+		if (dst_inum) {
+			pthread_mutex_lock(&s->lock);
 			*dst_inum = inode.bi_inum;
+			pthread_cond_broadcast(&s->wait);
+			pthread_mutex_unlock(&s->lock);
+		}
 
 		copy_times(c, &inode, &stat);
-		copy_xattrs(c, &inode, d->d_name);
+		copy_xattrs(c, &inode, src_fd, d->d_name);
 
 		/* copy xattrs */
 
 		switch (mode_to_type(stat.st_mode)) {
 		case DT_DIR:
-			fd = xopen(d->d_name, O_RDONLY|O_NOATIME);
-			copy_dir(s, c, &inode, fd, child_path);
-			close(fd);
-			break;
+			fd = openat(src_fd, d->d_name, O_RDONLY|O_NOATIME);
+			if (fd < 0)
+				die("error opening %s: %m", child_path);
+			/* the worker that picks it up owns path and inode: */
+			queue_dir_copy(s, &inode, fd, child_path);
+			continue;
 		case DT_REG:
 			inode.bi_size = stat.st_size;
 
-			fd = xopen(d->d_name, O_RDONLY|O_NOATIME);
-			copy_file(c, &inode, fd, stat.st_size,
-				  child_path, &s->extents);
+			fd = openat(src_fd, d->d_name, O_RDONLY|O_NOATIME);
+			if (fd < 0)
+				die("error opening %s: %m", child_path);
+			copy_file(s, c, &inode, fd, stat.st_size, child_path);
 			close(fd);
 			break;
 		case DT_LNK:
 			inode.bi_size = stat.st_size;
 
-			copy_link(c, &inode, d->d_name);
+			copy_link(c, &inode, src_fd, d->d_name);
 			break;
 		case DT_FIFO:
 		case DT_CHR:
@@ -514,6 +796,34 @@ next:
 	closedir(dir);
 }
 
+static void *copy_dir_thread(void *_s)
+{
+	struct copy_fs_state *s = _s;
+
+	pthread_mutex_lock(&s->lock);
+	while (1) {
+		if (s->dirs.nr) {
+			struct dir_job job = s->dirs.data[--s->dirs.nr];
+
+			pthread_mutex_unlock(&s->lock);
+
+			copy_dir(s, s->c, &job.inode, job.fd, job.path);
+			update_inode(s->c, &job.inode);
+			free(job.path);
+
+			pthread_mutex_lock(&s->lock);
+			if (!--s->nr_pending)
+				pthread_cond_broadcast(&s->wait);
+		} else if (s->nr_pending) {
+			pthread_cond_wait(&s->wait, &s->lock);
+		} else {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
 static ranges reserve_new_fs_space(const char *file_path, unsigned block_size,
 				   u64 size, u64 *bcachefs_inum, dev_t dev,
 				   bool force)
@@ -582,6 +892,8 @@ static void reserve_old_fs_space(struct bch_fs *c,
 	update_inode(c, &dst);
 }
 
+#define COPY_FS_THREADS	8
+
 static void copy_fs(struct bch_fs *c, int src_fd, const char *src_path,
 		    u64 bcachefs_inum, ranges *extents)
 {
@@ -593,28 +905,692 @@ static void copy_fs(struct bch_fs *c, int src_fd, const char *src_path,
 	if (ret)
 		die("error looking up root directory: %s", bch2_err_str(ret));
 
-	if (fchdir(src_fd))
-		die("chdir error: %m");
-
 	struct stat stat = xfstat(src_fd);
 	copy_times(c, &root_inode, &stat);
-	copy_xattrs(c, &root_inode, ".");
+	copy_xattrs(c, &root_inode, src_fd, ".");
 
 	struct copy_fs_state s = {
 		.bcachefs_inum	= bcachefs_inum,
 		.dev		= stat.st_dev,
 		.extents	= *extents,
+		.c		= c,
+		.lock		= PTHREAD_MUTEX_INITIALIZER,
+		.wait		= PTHREAD_COND_INITIALIZER,
 	};
 
 	/* now, copy: */
-	copy_dir(&s, c, &root_inode, src_fd, src_path);
+	int root_fd = dup(src_fd);
+	if (root_fd < 0)
+		die("dup error: %m");
+
+	queue_dir_copy(&s, &root_inode, root_fd, strdup(src_path));
+
+	pthread_t threads[COPY_FS_THREADS];
+	unsigned i;
+
+	for (i = 0; i < COPY_FS_THREADS; i++)
+		if (pthread_create(&threads[i], NULL, copy_dir_thread, &s))
+			die("error creating copy thread: %m");
+	for (i = 0; i < COPY_FS_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	/*
+	 * The root directory's job wrote back its own copy of the root inode;
+	 * refetch it so the link counts from the copy are preserved:
+	 */
+	ret = bch2_inode_find_by_inum(c, (subvol_inum) { 1, BCACHEFS_ROOT_INO },
+				      &root_inode);
+	if (ret)
+		die("error looking up root directory: %s", bch2_err_str(ret));
 
 	reserve_old_fs_space(c, &root_inode, &s.extents);
 
 	update_inode(c, &root_inode);
 
+	darray_exit(&s.dirs);
 	darray_exit(&s.extents);
 	genradix_free(&s.hardlinks);
+	genradix_free(&s.reflinks);
+}
+
+/*
+ * migrate --from-archive: stream a tar/pax archive directly into a freshly
+ * formatted filesystem, without extracting to an intermediate filesystem
+ * first (which doubles the I/O for provisioning flows whose source data is
+ * tar streams).
+ *
+ * The archive itself can only be parsed sequentially, so one reader thread
+ * walks headers and creates inodes/dirents, while file data is handed to a
+ * pool of worker threads in ~1MB chunks that go through the normal write
+ * path - checksummed (and encrypted) in place, no bounce - so the stream
+ * parse, metadata transactions and data writes all overlap.
+ */
+
+#define TAR_BLOCK		512
+
+struct tar_header {
+	char		name[100];
+	char		mode[8];
+	char		uid[8];
+	char		gid[8];
+	char		size[12];
+	char		mtime[12];
+	char		chksum[8];
+	char		typeflag;
+	char		linkname[100];
+	char		magic[6];
+	char		version[2];
+	char		uname[32];
+	char		gname[32];
+	char		devmajor[8];
+	char		devminor[8];
+	char		prefix[155];
+	char		pad[12];
+};
+
+static void read_full(int fd, void *buf, size_t len)
+{
+	while (len) {
+		ssize_t r = read(fd, buf, len);
+
+		if (r < 0)
+			die("error reading archive: %m");
+		if (!r)
+			die("unexpected end of archive");
+		buf += r;
+		len -= r;
+	}
+}
+
+static u64 tar_num(const char *f, unsigned len)
+{
+	u64 v = 0;
+	unsigned i;
+
+	/* GNU base-256 extension, for values that don't fit in octal: */
+	if (f[0] & 0x80) {
+		v = f[0] & 0x7f;
+		for (i = 1; i < len; i++)
+			v = (v << 8) | (u8) f[i];
+		return v;
+	}
+
+	for (i = 0; i < len && f[i]; i++)
+		if (f[i] >= '0' && f[i] <= '7')
+			v = (v << 3) | (f[i] - '0');
+	return v;
+}
+
+static bool tar_header_csum_ok(struct tar_header *h)
+{
+	const u8 *p = (void *) h;
+	unsigned sum = 0, i;
+
+	for (i = 0; i < TAR_BLOCK; i++)
+		sum += (i >= offsetof(struct tar_header, chksum) &&
+			i <  offsetof(struct tar_header, chksum) + 8)
+			? ' ' : p[i];
+
+	return sum == tar_num(h->chksum, sizeof(h->chksum));
+}
+
+static bool tar_block_zero(const void *_b)
+{
+	const u64 *b = _b;
+	unsigned i;
+
+	for (i = 0; i < TAR_BLOCK / sizeof(u64); i++)
+		if (b[i])
+			return false;
+	return true;
+}
+
+struct archive_dir {
+	char				*path;
+	struct bch_inode_unpacked	inode;
+};
+
+struct archive_filename {
+	char				*path;
+	u64				inum;
+};
+
+struct archive_hardlink {
+	u64				dir_inum;
+	char				*name;
+	u64				inum;
+};
+
+/*
+ * A regular file being streamed: the reader holds a reference while it's
+ * still queueing chunks, each queued chunk holds one; whoever drops the last
+ * reference writes the inode back with the final sector count.
+ */
+struct archive_open_file {
+	struct bch_inode_unpacked	inode;
+	unsigned			pending;
+};
+
+struct archive_job {
+	struct archive_open_file	*file;
+	u64				offset;
+	unsigned			len;
+	char				*buf;
+};
+
+#define ARCHIVE_THREADS		8
+#define ARCHIVE_MAX_JOBS	64
+
+struct archive_state {
+	struct bch_fs			*c;
+	int				fd;
+
+	DARRAY(struct archive_dir)	dirs;
+	DARRAY(struct archive_filename)	files;
+	DARRAY(struct archive_hardlink)	links;
+
+	pthread_mutex_t			lock;
+	pthread_cond_t			wait;
+	DARRAY(struct archive_job)	jobs;
+	bool				eof;
+};
+
+static void archive_file_put(struct archive_state *s,
+			     struct archive_open_file *f, u64 sectors)
+{
+	pthread_mutex_lock(&s->lock);
+	f->inode.bi_sectors += sectors;
+	bool last = !--f->pending;
+	pthread_mutex_unlock(&s->lock);
+
+	if (last) {
+		update_inode(s->c, &f->inode);
+		free(f);
+	}
+}
+
+static void *archive_write_thread(void *_s)
+{
+	struct archive_state *s = _s;
+
+	pthread_mutex_lock(&s->lock);
+	while (1) {
+		if (s->jobs.nr) {
+			struct archive_job job = s->jobs.data[--s->jobs.nr];
+			struct bch_inode_unpacked ino = job.file->inode;
+
+			/* the reader may be waiting on a full queue: */
+			pthread_cond_broadcast(&s->wait);
+			pthread_mutex_unlock(&s->lock);
+
+			ino.bi_sectors = 0;
+			write_data(s->c, &ino, job.offset, job.buf, job.len);
+			free(job.buf);
+			archive_file_put(s, job.file, ino.bi_sectors);
+
+			pthread_mutex_lock(&s->lock);
+		} else if (!s->eof) {
+			pthread_cond_wait(&s->wait, &s->lock);
+		} else {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+static void archive_queue_write(struct archive_state *s,
+				struct archive_open_file *f,
+				u64 offset, unsigned len, char *buf)
+{
+	struct archive_job job = {
+		.file	= f,
+		.offset	= offset,
+		.len	= len,
+		.buf	= buf,
+	};
+
+	pthread_mutex_lock(&s->lock);
+	while (s->jobs.nr >= ARCHIVE_MAX_JOBS)
+		pthread_cond_wait(&s->wait, &s->lock);
+	if (darray_push(&s->jobs, job))
+		die("error allocating write queue");
+	f->pending++;
+	pthread_cond_broadcast(&s->wait);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static struct bch_inode_unpacked *archive_find_dir(struct archive_state *s,
+						   const char *path)
+{
+	/* tar entries cluster by directory, so search most recent first: */
+	size_t i;
+
+	for (i = s->dirs.nr; i; i--)
+		if (!strcmp(s->dirs.data[i - 1].path, path))
+			return &s->dirs.data[i - 1].inode;
+	return NULL;
+}
+
+/*
+ * Look up a directory by path, creating missing parents with default
+ * ownership like tar does on extract. Returned pointers are only valid until
+ * the next directory is created:
+ */
+static struct bch_inode_unpacked *archive_dir_lookup(struct archive_state *s,
+						     const char *path)
+{
+	struct bch_inode_unpacked *d = archive_find_dir(s, path);
+
+	if (d)
+		return d;
+
+	char *dir = strdup(path);
+	char *slash = strrchr(dir, '/');
+	struct bch_inode_unpacked *parent;
+	const char *base;
+
+	if (slash) {
+		*slash = '\0';
+		base = slash + 1;
+		parent = archive_dir_lookup(s, dir);
+	} else {
+		base = dir;
+		parent = &s->dirs.data[0].inode;	/* root */
+	}
+
+	struct archive_dir new = {
+		.path	= strdup(path),
+		.inode	= create_file(s->c, parent, base, 0, 0, S_IFDIR|0755, 0),
+	};
+
+	free(dir);
+	if (darray_push(&s->dirs, new))
+		die("error allocating directory table");
+	return &s->dirs.data[s->dirs.nr - 1].inode;
+}
+
+/* Strip leading "./" and "/", trailing "/"; returns NULL for "." and "": */
+static char *archive_normalize_path(const char *path)
+{
+	while (path[0] == '/' ||
+	       (path[0] == '.' && path[1] == '/'))
+		path += path[0] == '/' ? 1 : 2;
+
+	if (!*path || !strcmp(path, "."))
+		return NULL;
+
+	char *ret = strdup(path);
+	size_t len = strlen(ret);
+
+	while (len && ret[len - 1] == '/')
+		ret[--len] = '\0';
+
+	if (!len) {
+		free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+/* pax extended header overrides for the next entry: */
+struct pax_override {
+	char		*path;
+	char		*linkpath;
+	u64		size;
+	bool		have_size;
+};
+
+static void pax_override_reset(struct pax_override *o)
+{
+	free(o->path);
+	free(o->linkpath);
+	memset(o, 0, sizeof(*o));
+}
+
+/* pax records are "%u key=value\n", length counting the whole record: */
+static void archive_parse_pax(char *data, size_t len, struct pax_override *o)
+{
+	while (len) {
+		size_t reclen = strtoul(data, NULL, 10);
+		char *space	= memchr(data, ' ', len);
+		char *end	= data + reclen;
+
+		if (!reclen || reclen > len || !space || space >= end)
+			die("malformed pax header");
+
+		char *eq = memchr(space + 1, '=', end - space - 1);
+		if (!eq || end[-1] != '\n')
+			die("malformed pax header");
+
+		char *key = space + 1;
+		*eq = '\0';
+		end[-1] = '\0';
+
+		if (!strcmp(key, "path")) {
+			free(o->path);
+			o->path = strdup(eq + 1);
+		} else if (!strcmp(key, "linkpath")) {
+			free(o->linkpath);
+			o->linkpath = strdup(eq + 1);
+		} else if (!strcmp(key, "size")) {
+			o->size = strtoull(eq + 1, NULL, 10);
+			o->have_size = true;
+		}
+
+		data	+= reclen;
+		len	-= reclen;
+	}
+}
+
+static void archive_set_times(struct bch_fs *c, struct bch_inode_unpacked *inode,
+			      u64 mtime)
+{
+	struct timespec ts = { .tv_sec = mtime };
+
+	inode->bi_atime = timespec_to_bch2_time(c, ts);
+	inode->bi_mtime = timespec_to_bch2_time(c, ts);
+	inode->bi_ctime = timespec_to_bch2_time(c, ts);
+}
+
+static void copy_archive(struct bch_fs *c, int fd)
+{
+	struct archive_state s = {
+		.c	= c,
+		.fd	= fd,
+		.lock	= PTHREAD_MUTEX_INITIALIZER,
+		.wait	= PTHREAD_COND_INITIALIZER,
+	};
+	struct pax_override o = {};
+	pthread_t threads[ARCHIVE_THREADS];
+	unsigned i;
+
+	struct bch_inode_unpacked root_inode;
+	int ret = bch2_inode_find_by_inum(c, (subvol_inum) { 1, BCACHEFS_ROOT_INO },
+					  &root_inode);
+	if (ret)
+		die("error looking up root directory: %s", bch2_err_str(ret));
+
+	if (darray_push(&s.dirs, ((struct archive_dir) {
+				.path	= strdup(""),
+				.inode	= root_inode, })))
+		die("error allocating directory table");
+
+	for (i = 0; i < ARCHIVE_THREADS; i++)
+		if (pthread_create(&threads[i], NULL, archive_write_thread, &s))
+			die("error creating write thread: %m");
+
+	while (1) {
+		struct tar_header h;
+
+		read_full(fd, &h, sizeof(h));
+		if (tar_block_zero(&h))
+			break;
+
+		if (!tar_header_csum_ok(&h))
+			die("bad tar header checksum");
+
+		u64 size	= o.have_size ? o.size : tar_num(h.size, sizeof(h.size));
+		u64 data_bytes	= round_up(size, TAR_BLOCK);
+
+		/* metadata entries: consume, apply, restart loop: */
+		switch (h.typeflag) {
+		case 'x':	/* pax extended header */
+		case 'L':	/* GNU long name */
+		case 'K': {	/* GNU long link target */
+			char *data = xmalloc(data_bytes + 1);
+
+			read_full(fd, data, data_bytes);
+			data[size] = '\0';
+
+			if (h.typeflag == 'x') {
+				archive_parse_pax(data, size, &o);
+			} else {
+				char **dst = h.typeflag == 'L'
+					? &o.path : &o.linkpath;
+				free(*dst);
+				*dst = strdup(data);
+			}
+			free(data);
+			continue;
+		}
+		case 'g': {	/* pax global header: not supported, skip */
+			char *data = xmalloc(data_bytes);
+
+			read_full(fd, data, data_bytes);
+			free(data);
+			continue;
+		}
+		}
+
+		/* ustar splits long paths across prefix and name: */
+		char name[101], linkname[101], prefixed[257];
+		memcpy(name, h.name, 100);		name[100] = '\0';
+		memcpy(linkname, h.linkname, 100);	linkname[100] = '\0';
+
+		const char *raw_path = o.path ?: name;
+		if (!o.path && h.prefix[0] && !memcmp(h.magic, "ustar", 5)) {
+			snprintf(prefixed, sizeof(prefixed), "%.155s/%s",
+				 h.prefix, name);
+			raw_path = prefixed;
+		}
+
+		char *path = archive_normalize_path(raw_path);
+		if (!path) {
+			/* "./": archive root; times apply to the fs root */
+			if (h.typeflag == '5')
+				archive_set_times(c, &s.dirs.data[0].inode,
+						  tar_num(h.mtime, sizeof(h.mtime)));
+			pax_override_reset(&o);
+			continue;
+		}
+
+		uid_t uid	= tar_num(h.uid, sizeof(h.uid));
+		gid_t gid	= tar_num(h.gid, sizeof(h.gid));
+		mode_t mode	= tar_num(h.mode, sizeof(h.mode)) & 07777;
+		u64 mtime	= tar_num(h.mtime, sizeof(h.mtime));
+
+		char *slash = strrchr(path, '/');
+		const char *base = slash ? slash + 1 : path;
+		struct bch_inode_unpacked *parent;
+
+		if (slash) {
+			char *dir = strndup(path, slash - path);
+
+			parent = archive_dir_lookup(&s, dir);
+			free(dir);
+		} else {
+			parent = &s.dirs.data[0].inode;
+		}
+
+		switch (h.typeflag) {
+		case '0':
+		case '7':	/* contiguous file: treat as regular */
+		case '\0': {
+			struct archive_open_file *f = xmalloc(sizeof(*f));
+
+			f->inode = create_file(c, parent, base, uid, gid,
+					       S_IFREG|mode, 0);
+			f->inode.bi_size = size;
+			archive_set_times(c, &f->inode, mtime);
+			f->pending = 1;
+
+			if (darray_push(&s.files, ((struct archive_filename) {
+						.path	= strdup(path),
+						.inum	= f->inode.bi_inum, })))
+				die("error allocating file table");
+
+			u64 offset = 0, remaining = size;
+			while (remaining) {
+				unsigned len	 = min_t(u64, remaining, WRITE_DATA_BUF);
+				unsigned aligned = round_up(len, block_bytes(c));
+				char *buf = aligned_alloc(PAGE_SIZE,
+						round_up(aligned, PAGE_SIZE));
+				if (!buf)
+					die("error allocating write buffer");
+
+				read_full(fd, buf, len);
+				memset(buf + len, 0, aligned - len);
+				archive_queue_write(&s, f, offset, aligned, buf);
+
+				offset		+= len;
+				remaining	-= len;
+			}
+
+			/* trailing padding up to the next tar block: */
+			char pad[TAR_BLOCK];
+			read_full(fd, pad, data_bytes - size);
+
+			archive_file_put(&s, f, 0);
+			break;
+		}
+		case '5': {
+			struct bch_inode_unpacked *d = archive_find_dir(&s, path);
+
+			if (!d) {
+				struct archive_dir new = {
+					.path	= strdup(path),
+					.inode	= create_file(c, parent, base,
+							uid, gid, S_IFDIR|mode, 0),
+				};
+
+				if (darray_push(&s.dirs, new))
+					die("error allocating directory table");
+				d = &s.dirs.data[s.dirs.nr - 1].inode;
+			} else {
+				/* created implicitly, apply the real metadata: */
+				d->bi_mode	= S_IFDIR|mode;
+				d->bi_uid	= uid;
+				d->bi_gid	= gid;
+			}
+			archive_set_times(c, d, mtime);
+			break;
+		}
+		case '2': {
+			const char *target = o.linkpath ?: linkname;
+			struct bch_inode_unpacked inode =
+				create_file(c, parent, base, uid, gid,
+					    S_IFLNK|0777, 0);
+
+			inode.bi_size = strlen(target);
+			archive_set_times(c, &inode, mtime);
+
+			char *buf = migrate_thread_buf();
+			unsigned len = round_up(inode.bi_size, block_bytes(c));
+
+			memcpy(buf, target, inode.bi_size);
+			memset(buf + inode.bi_size, 0, len - inode.bi_size);
+			write_data(c, &inode, 0, buf, len);
+
+			update_inode(c, &inode);
+			break;
+		}
+		case '1': {
+			char *target = archive_normalize_path(o.linkpath ?: linkname);
+			u64 inum = 0;
+
+			darray_for_each(s.files, f)
+				if (target && !strcmp(f->path, target))
+					inum = f->inum;
+			if (!inum)
+				die("hardlink target %s not in archive",
+				    o.linkpath ?: linkname);
+			free(target);
+
+			/*
+			 * The target may still have writes in flight, and
+			 * whichever thread drops the last chunk reference
+			 * writes the inode back with a link count from before
+			 * bch2_link_trans()'s bump - so defer link creation
+			 * until the write threads are joined, like the
+			 * directory writeback:
+			 */
+			if (darray_push(&s.links, ((struct archive_hardlink) {
+						.dir_inum = parent->bi_inum,
+						.name	  = strdup(base),
+						.inum	  = inum, })))
+				die("error allocating hardlink table");
+			break;
+		}
+		case '3':
+		case '4':
+		case '6': {
+			mode_t type = h.typeflag == '3' ? S_IFCHR
+				    : h.typeflag == '4' ? S_IFBLK
+				    : S_IFIFO;
+			dev_t rdev = makedev(tar_num(h.devmajor, sizeof(h.devmajor)),
+					     tar_num(h.devminor, sizeof(h.devminor)));
+			struct bch_inode_unpacked inode =
+				create_file(c, parent, base, uid, gid,
+					    type|mode, rdev);
+
+			archive_set_times(c, &inode, mtime);
+			update_inode(c, &inode);
+			break;
+		}
+		default:
+			die("unknown tar entry type '%c' for %s",
+			    h.typeflag, path);
+		}
+
+		free(path);
+		pax_override_reset(&o);
+	}
+
+	pthread_mutex_lock(&s.lock);
+	s.eof = true;
+	pthread_cond_broadcast(&s.wait);
+	pthread_mutex_unlock(&s.lock);
+
+	for (i = 0; i < ARCHIVE_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	/* all file inodes are on disk now; safe to bump link counts: */
+	darray_for_each(s.links, l) {
+		struct bch_inode_unpacked d = { .bi_inum = l->dir_inum };
+
+		create_link(c, &d, l->name, l->inum, S_IFREG);
+		free(l->name);
+	}
+
+	/*
+	 * Directory inodes are written back last, so mtimes aren't clobbered
+	 * by child creation:
+	 */
+	darray_for_each(s.dirs, d) {
+		update_inode(c, &d->inode);
+		free(d->path);
+	}
+	darray_for_each(s.files, f)
+		free(f->path);
+
+	pax_override_reset(&o);
+	darray_exit(&s.dirs);
+	darray_exit(&s.files);
+	darray_exit(&s.links);
+	darray_exit(&s.jobs);
+}
+
+static int migrate_from_archive(const char *archive_path,
+				char **devs, unsigned nr_devs)
+{
+	int fd = !strcmp(archive_path, "-")
+		? STDIN_FILENO
+		: xopen(archive_path, O_RDONLY);
+
+	struct bch_opts opts = bch2_opts_empty();
+	struct bch_fs *c = bch2_fs_open(devs, nr_devs, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", devs[0], bch2_err_str(PTR_ERR(c)));
+
+	copy_archive(c, fd);
+
+	bch2_fs_stop(c);
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	printf("Archive migration complete\n");
+	return 0;
 }
 
 static void find_superblock_space(ranges extents,
@@ -638,6 +1614,290 @@ static void find_superblock_space(ranges extents,
 	die("Couldn't find a valid location for superblock");
 }
 
+/*
+ * migrate --estimate: walk the source filesystem with the same stat/fiemap
+ * logic as the real migration, but instead of writing anything report what the
+ * migration would do - how much data gets rewritten vs. linked in place, how
+ * big the new btrees will be, and roughly how long it will take based on a
+ * quick throughput sample of the device.
+ */
+
+struct estimate_state {
+	dev_t		dev;
+
+	GENRADIX(u64)	hardlinks;
+
+	unsigned	block_bytes;
+	u64		nr_dirs;
+	u64		nr_files;
+	u64		nr_symlinks;
+	u64		nr_special;
+	u64		nr_hardlinks;
+	u64		nr_extents;
+	u64		nr_unaligned;
+	u64		file_bytes;
+	u64		copy_bytes;	/* must be rewritten */
+	u64		link_bytes;	/* migrated in place */
+	u64		dirent_bytes;	/* projected dirent key bytes */
+
+	u64		size_hist[64];	/* log2 file size */
+	u64		extent_hist[32];/* log2 extents per file */
+};
+
+static u64 ns_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void estimate_file(struct estimate_state *s, int fd, u64 size)
+{
+	struct fiemap_iter iter;
+	struct fiemap_extent e;
+	u64 nr = 0;
+
+	fiemap_for_each(fd, iter, e) {
+		nr++;
+		s->nr_extents++;
+
+		u64 len = min(size - e.fe_logical, e.fe_length);
+
+		if (e.fe_flags & (FIEMAP_EXTENT_UNKNOWN|
+				  FIEMAP_EXTENT_ENCODED|
+				  FIEMAP_EXTENT_NOT_ALIGNED|
+				  FIEMAP_EXTENT_DATA_INLINE)) {
+			s->copy_bytes += len;
+			continue;
+		}
+
+		if ((e.fe_logical	& (s->block_bytes - 1)) ||
+		    (e.fe_length	& (s->block_bytes - 1)) ||
+		    (e.fe_physical	& (s->block_bytes - 1))) {
+			/* copy_file() would die on these: */
+			s->nr_unaligned++;
+			s->copy_bytes += len;
+			continue;
+		}
+
+		/* data below 1MB is copied out of the superblock's way: */
+		if (e.fe_physical < 1 << 20)
+			s->copy_bytes += len;
+		else
+			s->link_bytes += e.fe_length;
+	}
+	fiemap_iter_exit(&iter);
+
+	s->file_bytes += size;
+	s->size_hist[size ? ilog2(size) : 0]++;
+	s->extent_hist[nr ? min_t(unsigned, ilog2(nr), 31) : 0]++;
+}
+
+static void estimate_dir(struct estimate_state *s, int src_fd,
+			 const char *src_path)
+{
+	DIR *dir = fdopendir(src_fd);
+	struct dirent *d;
+
+	while ((errno = 0), (d = readdir(dir))) {
+		int fd;
+
+		if (!strcmp(d->d_name, ".") ||
+		    !strcmp(d->d_name, "..") ||
+		    !strcmp(d->d_name, "lost+found"))
+			continue;
+
+		struct stat stat =
+			xfstatat(src_fd, d->d_name, AT_SYMLINK_NOFOLLOW);
+
+		if (stat.st_dev != s->dev)
+			die("%s/%s does not have correct st_dev!",
+			    src_path, d->d_name);
+
+		s->dirent_bytes += sizeof(struct bkey) +
+			round_up(8 + strlen(d->d_name), 8);
+
+		if (S_ISREG(stat.st_mode)) {
+			u64 *seen = genradix_ptr_alloc(&s->hardlinks,
+						       stat.st_ino, GFP_KERNEL);
+			if (!seen)
+				die("error allocating hardlink table");
+			if ((*seen)++) {
+				s->nr_hardlinks++;
+				continue;
+			}
+		}
+
+		switch (mode_to_type(stat.st_mode)) {
+		case DT_DIR: {
+			char *child_path = mprintf("%s/%s", src_path, d->d_name);
+
+			fd = xopenat(src_fd, d->d_name, O_RDONLY|O_NOATIME);
+			s->nr_dirs++;
+			estimate_dir(s, fd, child_path);
+			free(child_path);
+			break;
+		}
+		case DT_REG:
+			fd = xopenat(src_fd, d->d_name, O_RDONLY|O_NOATIME);
+			s->nr_files++;
+			estimate_file(s, fd, stat.st_size);
+			close(fd);
+			break;
+		case DT_LNK:
+			s->nr_symlinks++;
+			s->copy_bytes += round_up(stat.st_size, s->block_bytes);
+			break;
+		default:
+			s->nr_special++;
+			break;
+		}
+	}
+
+	if (errno)
+		die("readdir error: %m");
+	closedir(dir);
+}
+
+/*
+ * Quick device throughput sample: timed 1MB reads, O_DIRECT so the page cache
+ * doesn't flatter us, spread across the device so we average over any
+ * zoning/seek effects:
+ */
+#define THROUGHPUT_SAMPLES	16
+#define THROUGHPUT_SAMPLE_LEN	(1U << 20)
+
+static u64 sample_dev_throughput(const char *dev_path)
+{
+	int fd = open(dev_path, O_RDONLY|O_DIRECT);
+	if (fd < 0)
+		return 0;
+
+	u64 size = get_size(fd);
+	char *buf = aligned_alloc(PAGE_SIZE, THROUGHPUT_SAMPLE_LEN);
+	if (!buf)
+		die("error allocating sample buffer");
+
+	u64 start = ns_now();
+	unsigned i;
+
+	for (i = 0; i < THROUGHPUT_SAMPLES; i++) {
+		u64 offset = round_down(size / THROUGHPUT_SAMPLES * i,
+					THROUGHPUT_SAMPLE_LEN);
+
+		if (offset + THROUGHPUT_SAMPLE_LEN > size)
+			break;
+		xpread(fd, buf, THROUGHPUT_SAMPLE_LEN, offset);
+	}
+
+	u64 ns = ns_now() - start;
+
+	free(buf);
+	close(fd);
+
+	return ns ? (u64) i * THROUGHPUT_SAMPLE_LEN * 1000000000ULL / ns : 0;
+}
+
+static void print_hist(u64 *hist, unsigned nr)
+{
+	unsigned i, last = 0;
+
+	for (i = 0; i < nr; i++)
+		if (hist[i])
+			last = i;
+
+	for (i = 0; i <= last; i++)
+		printf("  < %-12llu %llu\n", 2ULL << i, hist[i]);
+}
+
+static int migrate_estimate(const char *fs_path, int fs_fd, dev_t dev)
+{
+	char *dev_path = dev_t_to_path(dev);
+	int dev_fd = xopen(dev_path, O_RDONLY);
+
+	struct estimate_state s = {
+		.dev		= dev,
+		.block_bytes	= get_blocksize(dev_fd),
+	};
+
+	printf("Estimating migration of %s (%s):\n", fs_path, dev_path);
+
+	u64 walk_start = ns_now();
+	estimate_dir(&s, dup(fs_fd), fs_path);
+	u64 walk_ns = ns_now() - walk_start;
+
+	u64 throughput = sample_dev_throughput(dev_path);
+
+	u64 nr_inodes = s.nr_dirs + s.nr_files + s.nr_symlinks + s.nr_special;
+
+	/*
+	 * Key size projections: one extent key per fiemap extent for linked
+	 * data plus one per 1MB write for copied data, a packed inode per
+	 * file, and the dirent bytes accumulated during the walk. Scale by
+	 * 3/2 for typical btree node fill:
+	 */
+	u64 extent_bytes = (s.nr_extents + s.copy_bytes / WRITE_DATA_BUF) *
+		(sizeof(struct bkey) + sizeof(struct bch_extent_ptr));
+	u64 inode_bytes	 = nr_inodes * (sizeof(struct bkey) + 100);
+	u64 btree_bytes	 = (extent_bytes + inode_bytes + s.dirent_bytes) * 3 / 2;
+
+	printf("\n"
+	       "Files:               %llu\n"
+	       "Directories:         %llu\n"
+	       "Symlinks:            %llu\n"
+	       "Special files:       %llu\n"
+	       "Hardlinks:           %llu\n"
+	       "Extents:             %llu\n",
+	       s.nr_files, s.nr_dirs, s.nr_symlinks, s.nr_special,
+	       s.nr_hardlinks, s.nr_extents);
+
+	if (s.nr_unaligned)
+		printf("\n"
+		       "WARNING: %llu unaligned extents; migration would rewrite them\n"
+		       "(older bcachefs-tools would have refused to continue)\n",
+		       s.nr_unaligned);
+
+	printf("\n"
+	       "File data:           %llu MiB\n"
+	       "  linked in place:   %llu MiB\n"
+	       "  rewritten:         %llu MiB\n"
+	       "Projected metadata:  %llu MiB\n",
+	       s.file_bytes		>> 20,
+	       s.link_bytes		>> 20,
+	       s.copy_bytes		>> 20,
+	       (btree_bytes >> 20) + 1);
+
+	printf("\nFile sizes (bytes):\n");
+	print_hist(s.size_hist, ARRAY_SIZE(s.size_hist));
+	printf("\nExtents per file:\n");
+	print_hist(s.extent_hist, ARRAY_SIZE(s.extent_hist));
+
+	if (throughput) {
+		/*
+		 * Rewritten data is read and written back to the same device;
+		 * the metadata walk repeats during the real migration:
+		 */
+		u64 io_bytes	= 2 * s.copy_bytes + btree_bytes;
+		u64 est_sec	= io_bytes / throughput + walk_ns / 1000000000ULL;
+
+		printf("\n"
+		       "Device throughput:   %llu MiB/s (sampled)\n"
+		       "Estimated time:      %llu min %llu sec\n",
+		       throughput >> 20,
+		       est_sec / 60, est_sec % 60);
+	} else {
+		printf("\nCouldn't sample device throughput, no time estimate\n");
+	}
+
+	printf("\nNothing was written; run without --estimate to migrate\n");
+
+	genradix_free(&s.hardlinks);
+	close(dev_fd);
+	free(dev_path);
+	return 0;
+}
+
 static void migrate_usage(void)
 {
 	puts("bcachefs migrate - migrate an existing filesystem to bcachefs\n"
@@ -647,6 +1907,9 @@ static void migrate_usage(void)
 	     "  -f fs                  Root of filesystem to migrate(s)\n"
 	     "      --encrypted        Enable whole filesystem encryption (chacha20/poly1305)\n"
 	     "      --no_passphrase    Don't encrypt master encryption key\n"
+	     "      --estimate         Dry run: report space/time estimates, don't migrate\n"
+	     "      --from-archive=file  Stream a tar/pax archive ('-' for stdin) into an\n"
+	     "                         already formatted filesystem given as device argument(s)\n"
 	     "  -F                     Force, even if metadata file already exists\n"
 	     "  -h                     Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
@@ -655,6 +1918,8 @@ static void migrate_usage(void)
 static const struct option migrate_opts[] = {
 	{ "encrypted",		no_argument, NULL, 'e' },
 	{ "no_passphrase",	no_argument, NULL, 'p' },
+	{ "estimate",		no_argument, NULL, 'E' },
+	{ "from-archive",	required_argument, NULL, 'A' },
 	{ NULL }
 };
 
@@ -662,7 +1927,7 @@ static int migrate_fs(const char		*fs_path,
 		      struct bch_opt_strs	fs_opt_strs,
 		      struct bch_opts		fs_opts,
 		      struct format_opts	format_opts,
-		      bool force)
+		      bool force, bool estimate)
 {
 	if (!path_is_fs_root(fs_path))
 		die("%s is not a filysestem root", fs_path);
@@ -673,6 +1938,9 @@ static int migrate_fs(const char		*fs_path,
 	if (!S_ISDIR(stat.st_mode))
 		die("%s is not a directory", fs_path);
 
+	if (estimate)
+		return migrate_estimate(fs_path, fs_fd, stat.st_dev);
+
 	struct dev_opts dev = dev_opts_default();
 
 	dev.path = dev_t_to_path(stat.st_dev);
@@ -767,7 +2035,8 @@ int cmd_migrate(int argc, char *argv[])
 {
 	struct format_opts format_opts = format_opts_default();
 	char *fs_path = NULL;
-	bool no_passphrase = false, force = false;
+	char *from_archive = NULL;
+	bool no_passphrase = false, force = false, estimate = false;
 	int opt;
 
 	struct bch_opt_strs fs_opt_strs =
@@ -786,6 +2055,12 @@ int cmd_migrate(int argc, char *argv[])
 		case 'p':
 			no_passphrase = true;
 			break;
+		case 'E':
+			estimate = true;
+			break;
+		case 'A':
+			from_archive = optarg;
+			break;
 		case 'F':
 			force = true;
 			break;
@@ -794,16 +2069,23 @@ int cmd_migrate(int argc, char *argv[])
 			exit(EXIT_SUCCESS);
 		}
 
+	if (from_archive) {
+		args_shift(optind);
+		if (!argc)
+			die("Please supply device(s) to stream the archive into");
+		return migrate_from_archive(from_archive, argv, argc);
+	}
+
 	if (!fs_path)
 		die("Please specify a filesystem to migrate");
 
-	if (format_opts.encrypted && !no_passphrase)
+	if (format_opts.encrypted && !no_passphrase && !estimate)
 		format_opts.passphrase = read_passphrase_twice("Enter passphrase: ");
 
 	int ret = migrate_fs(fs_path,
 			     fs_opt_strs,
 			     fs_opts,
-			     format_opts, force);
+			     format_opts, force, estimate);
 	bch2_opt_strs_free(&fs_opt_strs);
 	return ret;
 }
@@ -70,20 +70,31 @@ int cmd_set_option(int argc, char *argv[])
 	}
 
 	for (i = 0; i < bch2_opts_nr; i++) {
-		u64 v = bch2_opt_get_by_id(&new_opts, i);
-
 		if (!bch2_opt_defined_by_id(&new_opts, i))
 			continue;
 
-		ret = bch2_opt_check_may_set(c, i, v);
+		ret = bch2_opt_check_may_set(c, i, bch2_opt_get_by_id(&new_opts, i));
 		if (ret < 0) {
 			fprintf(stderr, "error setting %s: %i\n",
 				bch2_opt_table[i].attr.name, ret);
 			break;
 		}
+	}
+
+	/* Batch all the changes into a single superblock write: */
+	if (!ret) {
+		mutex_lock(&c->sb_lock);
+		for (i = 0; i < bch2_opts_nr; i++) {
+			u64 v = bch2_opt_get_by_id(&new_opts, i);
 
-		bch2_opt_set_sb(c, bch2_opt_table + i, v);
-		bch2_opt_set_by_id(&c->opts, i, v);
+			if (!bch2_opt_defined_by_id(&new_opts, i))
+				continue;
+
+			__bch2_opt_set_sb(c->disk_sb.sb, bch2_opt_table + i, v);
+			bch2_opt_set_by_id(&c->opts, i, v);
+		}
+		bch2_write_super(c);
+		mutex_unlock(&c->sb_lock);
 	}
 
 	bch2_fs_stop(c);
@@ -12,10 +12,21 @@
 int cmd_format(int argc, char *argv[]);
 int cmd_show_super(int argc, char *argv[]);
 int cmd_reset_counters(int argc, char *argv[]);
+int cmd_counters_record(int argc, char *argv[]);
+int cmd_counters_report(int argc, char *argv[]);
+int cmd_top(int argc, char *argv[]);
 int cmd_set_option(int argc, char *argv[]);
 
 int cmd_fs_usage(int argc, char *argv[]);
 
+int cmd_daemon(int argc, char *argv[]);
+int cmd_query(int argc, char *argv[]);
+
+int internals_usage(void);
+int cmd_internals_latency(int argc, char *argv[]);
+int cmd_internals_btree_cache(int argc, char *argv[]);
+int cmd_internals_buckets_waiting(int argc, char *argv[]);
+
 int device_usage(void);
 int cmd_device_add(int argc, char *argv[]);
 int cmd_device_remove(int argc, char *argv[]);
@@ -25,9 +36,12 @@ int cmd_device_evacuate(int argc, char *argv[]);
 int cmd_device_set_state(int argc, char *argv[]);
 int cmd_device_resize(int argc, char *argv[]);
 int cmd_device_resize_journal(int argc, char *argv[]);
+int cmd_device_benchmark(int argc, char *argv[]);
 
 int data_usage(void);
 int cmd_data_rereplicate(int argc, char *argv[]);
+int cmd_data_scrub(int argc, char *argv[]);
+int cmd_data_defragment(int argc, char *argv[]);
 int cmd_data_job(int argc, char *argv[]);
 
 int cmd_unlock(int argc, char *argv[]);
@@ -37,6 +51,7 @@ int cmd_remove_passphrase(int argc, char *argv[]);
 int cmd_fsck(int argc, char *argv[]);
 
 int cmd_dump(int argc, char *argv[]);
+int cmd_dump_restore(int argc, char *argv[]);
 int cmd_list_journal(int argc, char *argv[]);
 int cmd_kill_btree_node(int argc, char *argv[]);
 
@@ -44,6 +59,8 @@ int cmd_migrate(int argc, char *argv[]);
 int cmd_migrate_superblock(int argc, char *argv[]);
 
 int cmd_version(int argc, char *argv[]);
+int cmd_bench_crypto(int argc, char *argv[]);
+int cmd_bench_compression(int argc, char *argv[]);
 
 int cmd_setattr(int argc, char *argv[]);
 
@@ -56,6 +73,8 @@ int cmd_fusemount(int argc, char *argv[]);
 
 void bcachefs_usage(void);
 int device_cmds(int argc, char *argv[]);
+int counters_cmds(int argc, char *argv[]);
+int internals_cmds(int argc, char *argv[]);
 int fs_cmds(int argc, char *argv[]);
 int data_cmds(int argc, char *argv[]);
 int subvolume_cmds(int argc, char *argv[]);
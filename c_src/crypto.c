@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,8 +11,10 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <asm/unaligned.h>
 #include <keyutils.h>
 #include <linux/random.h>
+#include <sodium/crypto_hash_sha256.h>
 #include <sodium/crypto_pwhash_scryptsalsa208sha256.h>
 #include <uuid/uuid.h>
 
@@ -75,6 +78,231 @@ char *read_passphrase_twice(const char *prompt)
 	return pass;
 }
 
+/*
+ * scrypt's p parameter specifies p independent, serially memory-hard mixes of
+ * the (cheap) PBKDF2 expansion of the passphrase - libsodium runs them back to
+ * back on a single core, which is where nearly all of `bcachefs unlock`'s
+ * runtime goes. The code below reimplements scrypt so the p mixes can be
+ * spread across a thread pool; output is identical to
+ * crypto_pwhash_scryptsalsa208sha256_ll().
+ */
+
+static void hmac_sha256(const void *key, size_t keylen,
+			const void *msg, size_t msglen,
+			u8 digest[32])
+{
+	u8 khash[32], pad[64 + 32];
+	u8 *buf = xmalloc(64 + msglen);
+
+	if (keylen > 64) {
+		crypto_hash_sha256(khash, key, keylen);
+		key = khash;
+		keylen = 32;
+	}
+
+	memset(buf, 0x36, 64);
+	for (size_t i = 0; i < keylen; i++)
+		buf[i] ^= ((const u8 *) key)[i];
+	memcpy(buf + 64, msg, msglen);
+	crypto_hash_sha256(pad + 64, buf, 64 + msglen);
+
+	memset(pad, 0x5c, 64);
+	for (size_t i = 0; i < keylen; i++)
+		pad[i] ^= ((const u8 *) key)[i];
+	crypto_hash_sha256(digest, pad, sizeof(pad));
+
+	memzero_explicit(buf, 64 + msglen);
+	free(buf);
+	memzero_explicit(pad, sizeof(pad));
+	memzero_explicit(khash, sizeof(khash));
+}
+
+/* PBKDF2-HMAC-SHA256 with a single iteration, as scrypt uses it: */
+static void pbkdf2_sha256_c1(const char *passphrase,
+			     const void *salt, size_t saltlen,
+			     void *_out, size_t outlen)
+{
+	u8 *saltblk = xmalloc(saltlen + 4);
+	u8 *out = _out;
+	u32 i = 0;
+
+	memcpy(saltblk, salt, saltlen);
+
+	while (outlen) {
+		u8 digest[32];
+		size_t b = min(outlen, sizeof(digest));
+
+		i++;
+		saltblk[saltlen]     = i >> 24;
+		saltblk[saltlen + 1] = i >> 16;
+		saltblk[saltlen + 2] = i >> 8;
+		saltblk[saltlen + 3] = i;
+
+		hmac_sha256(passphrase, strlen(passphrase),
+			    saltblk, saltlen + 4, digest);
+		memcpy(out, digest, b);
+		out += b;
+		outlen -= b;
+	}
+
+	memzero_explicit(saltblk, saltlen + 4);
+	free(saltblk);
+}
+
+static void salsa20_8(u32 B[16])
+{
+	u32 x[16];
+
+	memcpy(x, B, 64);
+
+	for (unsigned i = 0; i < 8; i += 2) {
+#define R(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+		x[ 4] ^= R(x[ 0] + x[12],  7); x[ 8] ^= R(x[ 4] + x[ 0],  9);
+		x[12] ^= R(x[ 8] + x[ 4], 13); x[ 0] ^= R(x[12] + x[ 8], 18);
+		x[ 9] ^= R(x[ 5] + x[ 1],  7); x[13] ^= R(x[ 9] + x[ 5],  9);
+		x[ 1] ^= R(x[13] + x[ 9], 13); x[ 5] ^= R(x[ 1] + x[13], 18);
+		x[14] ^= R(x[10] + x[ 6],  7); x[ 2] ^= R(x[14] + x[10],  9);
+		x[ 6] ^= R(x[ 2] + x[14], 13); x[10] ^= R(x[ 6] + x[ 2], 18);
+		x[ 3] ^= R(x[15] + x[11],  7); x[ 7] ^= R(x[ 3] + x[15],  9);
+		x[11] ^= R(x[ 7] + x[ 3], 13); x[15] ^= R(x[11] + x[ 7], 18);
+
+		x[ 1] ^= R(x[ 0] + x[ 3],  7); x[ 2] ^= R(x[ 1] + x[ 0],  9);
+		x[ 3] ^= R(x[ 2] + x[ 1], 13); x[ 0] ^= R(x[ 3] + x[ 2], 18);
+		x[ 6] ^= R(x[ 5] + x[ 4],  7); x[ 7] ^= R(x[ 6] + x[ 5],  9);
+		x[ 4] ^= R(x[ 7] + x[ 6], 13); x[ 5] ^= R(x[ 4] + x[ 7], 18);
+		x[11] ^= R(x[10] + x[ 9],  7); x[ 8] ^= R(x[11] + x[10],  9);
+		x[ 9] ^= R(x[ 8] + x[11], 13); x[10] ^= R(x[ 9] + x[ 8], 18);
+		x[12] ^= R(x[15] + x[14],  7); x[13] ^= R(x[12] + x[15],  9);
+		x[14] ^= R(x[13] + x[12], 13); x[15] ^= R(x[14] + x[13], 18);
+#undef R
+	}
+
+	for (unsigned i = 0; i < 16; i++)
+		B[i] += x[i];
+}
+
+static void blkxor(u32 *dst, const u32 *src, size_t words)
+{
+	while (words--)
+		*dst++ ^= *src++;
+}
+
+static void blockmix_salsa8(const u32 *Bin, u32 *Bout, u32 *X, unsigned r)
+{
+	memcpy(X, &Bin[(2 * r - 1) * 16], 64);
+
+	for (unsigned i = 0; i < 2 * r; i += 2) {
+		blkxor(X, &Bin[i * 16], 16);
+		salsa20_8(X);
+		memcpy(&Bout[i * 8], X, 64);
+
+		blkxor(X, &Bin[i * 16 + 16], 16);
+		salsa20_8(X);
+		memcpy(&Bout[i * 8 + r * 16], X, 64);
+	}
+}
+
+static u64 integerify(const u32 *B, unsigned r)
+{
+	const u32 *X = &B[(2 * r - 1) * 16];
+
+	return ((u64) X[1] << 32) + X[0];
+}
+
+/* The sequential memory-hard part of scrypt, on a single 128r byte block: */
+static void scrypt_smix(u8 *B, unsigned r, u64 N, u32 *V, u32 *XY)
+{
+	u32 *X = XY, *Y = &XY[32 * r], *Z = &XY[64 * r];
+
+	for (unsigned k = 0; k < 32 * r; k++)
+		X[k] = get_unaligned_le32(&B[4 * k]);
+
+	for (u64 i = 0; i < N; i += 2) {
+		memcpy(&V[i * (32 * r)], X, 128 * r);
+		blockmix_salsa8(X, Y, Z, r);
+
+		memcpy(&V[(i + 1) * (32 * r)], Y, 128 * r);
+		blockmix_salsa8(Y, X, Z, r);
+	}
+
+	for (u64 i = 0; i < N; i += 2) {
+		u64 j = integerify(X, r) & (N - 1);
+
+		blkxor(X, &V[j * (32 * r)], 32 * r);
+		blockmix_salsa8(X, Y, Z, r);
+
+		j = integerify(Y, r) & (N - 1);
+		blkxor(Y, &V[j * (32 * r)], 32 * r);
+		blockmix_salsa8(Y, X, Z, r);
+	}
+
+	for (unsigned k = 0; k < 32 * r; k++)
+		put_unaligned_le32(X[k], &B[4 * k]);
+}
+
+struct scrypt_thread {
+	pthread_t	thread;
+	u8		*B;
+	u64		N;
+	unsigned	r;
+	unsigned	p;
+	unsigned	nr_threads;
+	unsigned	idx;
+};
+
+static void *scrypt_thread_fn(void *arg)
+{
+	struct scrypt_thread *t = arg;
+	u32 *V	= xmalloc(128 * t->r * t->N);
+	u32 *XY	= xmalloc(256 * t->r + 64);
+
+	for (unsigned i = t->idx; i < t->p; i += t->nr_threads)
+		scrypt_smix(t->B + (size_t) i * 128 * t->r, t->r, t->N, V, XY);
+
+	memzero_explicit(V, 128 * t->r * t->N);
+	free(V);
+	free(XY);
+	return NULL;
+}
+
+static void scrypt_parallel(const char *passphrase,
+			    const void *salt, size_t saltlen,
+			    u64 N, unsigned r, unsigned p,
+			    void *key, size_t keylen)
+{
+	size_t Blen = (size_t) p * 128 * r;
+	u8 *B = xmalloc(Blen);
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned nr_threads = min_t(long, p, max(nr_cpus, 1L));
+	struct scrypt_thread *threads = xcalloc(nr_threads, sizeof(*threads));
+
+	pbkdf2_sha256_c1(passphrase, salt, saltlen, B, Blen);
+
+	for (unsigned i = 0; i < nr_threads; i++) {
+		threads[i] = (struct scrypt_thread) {
+			.B		= B,
+			.N		= N,
+			.r		= r,
+			.p		= p,
+			.nr_threads	= nr_threads,
+			.idx		= i,
+		};
+
+		if (pthread_create(&threads[i].thread, NULL,
+				   scrypt_thread_fn, &threads[i]))
+			die("error creating kdf thread");
+	}
+
+	for (unsigned i = 0; i < nr_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	pbkdf2_sha256_c1(passphrase, B, Blen, key, keylen);
+
+	memzero_explicit(B, Blen);
+	free(B);
+	free(threads);
+}
+
 struct bch_key derive_passphrase(struct bch_sb_field_crypt *crypt,
 				 const char *passphrase)
 {
@@ -83,7 +311,17 @@ struct bch_key derive_passphrase(struct bch_sb_field_crypt *crypt,
 	int ret;
 
 	switch (BCH_CRYPT_KDF_TYPE(crypt)) {
-	case BCH_KDF_SCRYPT:
+	case BCH_KDF_SCRYPT: {
+		unsigned p = 1U << BCH_KDF_SCRYPT_P(crypt);
+
+		if (p > 1 && sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+			scrypt_parallel(passphrase, salt, sizeof(salt),
+					1ULL << BCH_KDF_SCRYPT_N(crypt),
+					1U << BCH_KDF_SCRYPT_R(crypt), p,
+					&key, sizeof(key));
+			break;
+		}
+
 		ret = crypto_pwhash_scryptsalsa208sha256_ll(
 			(void *) passphrase, strlen(passphrase),
 			salt, sizeof(salt),
@@ -94,6 +332,7 @@ struct bch_key derive_passphrase(struct bch_sb_field_crypt *crypt,
 		if (ret)
 			die("scrypt error: %i", ret);
 		break;
+	}
 	default:
 		die("unknown kdf type %llu", BCH_CRYPT_KDF_TYPE(crypt));
 	}
@@ -172,6 +411,25 @@ void bch2_add_key(struct bch_sb *sb,
 	memzero_explicit(&sb_key, sizeof(sb_key));
 }
 
+/*
+ * Cache an already derived key in the session keyring, so that a sequence of
+ * commands against the same filesystem (fsck, then mount, then fs usage) only
+ * prompts for the passphrase and runs the KDF once:
+ */
+void bch2_stash_key(struct bch_sb *sb, struct bch_key *key)
+{
+	char uuid[40];
+	uuid_unparse_lower(sb->user_uuid.b, uuid);
+
+	char *description = mprintf("bcachefs:%s", uuid);
+
+	/* Best effort - we still hold the key if this fails: */
+	add_key("user", description, key, sizeof(*key),
+		KEY_SPEC_SESSION_KEYRING);
+
+	free(description);
+}
+
 void bch_sb_crypt_init(struct bch_sb *sb,
 		       struct bch_sb_field_crypt *crypt,
 		       const char *passphrase)
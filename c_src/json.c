@@ -0,0 +1,113 @@
+#include <string.h>
+
+#include <linux/bug.h>
+
+#include "json.h"
+
+static void json_comma(struct json_out *j)
+{
+	BUG_ON(j->depth >= JSON_MAX_DEPTH);
+
+	if (j->need_comma[j->depth])
+		fputc(',', j->f);
+	j->need_comma[j->depth] = true;
+}
+
+static void json_field(struct json_out *j, const char *field)
+{
+	json_comma(j);
+	if (field)
+		fprintf(j->f, "\"%s\":", field);
+}
+
+static void json_str_escaped(struct json_out *j, const char *s)
+{
+	fputc('"', j->f);
+	for (; *s; s++)
+		switch (*s) {
+		case '"':
+			fputs("\\\"", j->f);
+			break;
+		case '\\':
+			fputs("\\\\", j->f);
+			break;
+		case '\n':
+			fputs("\\n", j->f);
+			break;
+		case '\t':
+			fputs("\\t", j->f);
+			break;
+		default:
+			if ((unsigned char) *s < 0x20)
+				fprintf(j->f, "\\u%04x", *s);
+			else
+				fputc(*s, j->f);
+		}
+	fputc('"', j->f);
+}
+
+void json_begin(struct json_out *j, FILE *f)
+{
+	memset(j, 0, sizeof(*j));
+	j->f = f;
+	json_obj_start(j, NULL);
+}
+
+void json_end(struct json_out *j)
+{
+	json_obj_end(j);
+	BUG_ON(j->depth);
+	fputc('\n', j->f);
+}
+
+void json_obj_start(struct json_out *j, const char *field)
+{
+	json_field(j, field);
+	fputc('{', j->f);
+	j->need_comma[++j->depth] = false;
+}
+
+void json_obj_end(struct json_out *j)
+{
+	BUG_ON(!j->depth);
+	j->depth--;
+	fputc('}', j->f);
+}
+
+void json_arr_start(struct json_out *j, const char *field)
+{
+	json_field(j, field);
+	fputc('[', j->f);
+	j->need_comma[++j->depth] = false;
+}
+
+void json_arr_end(struct json_out *j)
+{
+	BUG_ON(!j->depth);
+	j->depth--;
+	fputc(']', j->f);
+}
+
+void json_str(struct json_out *j, const char *field, const char *val)
+{
+	json_field(j, field);
+	json_str_escaped(j, val);
+}
+
+void json_u64(struct json_out *j, const char *field, u64 v)
+{
+	json_field(j, field);
+	fprintf(j->f, "%llu", v);
+}
+
+void json_bool(struct json_out *j, const char *field, bool v)
+{
+	json_field(j, field);
+	fputs(v ? "true" : "false", j->f);
+}
+
+void json_null(struct json_out *j, const char *field)
+{
+	json_field(j, field);
+	fputs("null", j->f);
+}
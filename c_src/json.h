@@ -0,0 +1,37 @@
+#ifndef _JSON_H
+#define _JSON_H
+
+/*
+ * Minimal streaming JSON writer for inspection commands: typed values are
+ * emitted directly from the ioctl/superblock structs, so machine consumers
+ * don't have to re-parse the human text output (and we skip the printbuf
+ * formatting entirely).
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <linux/types.h>
+
+#define JSON_MAX_DEPTH	32
+
+struct json_out {
+	FILE		*f;
+	unsigned	depth;
+	bool		need_comma[JSON_MAX_DEPTH];
+};
+
+void json_begin(struct json_out *, FILE *);
+void json_end(struct json_out *);
+
+void json_obj_start(struct json_out *, const char *);
+void json_obj_end(struct json_out *);
+void json_arr_start(struct json_out *, const char *);
+void json_arr_end(struct json_out *);
+
+void json_str(struct json_out *, const char *, const char *);
+void json_u64(struct json_out *, const char *, u64);
+void json_bool(struct json_out *, const char *, bool);
+void json_null(struct json_out *, const char *);
+
+#endif /* _JSON_H */
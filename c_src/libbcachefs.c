@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -122,6 +123,38 @@ void bch2_check_bucket_size(struct bch_opts opts, struct dev_opts *dev)
 		    dev->bucket_size, (u32) U16_MAX << 9);
 }
 
+/*
+ * Initial superblock writes are done with a thread per device: zeroing the
+ * start of the disk and writing out the superblocks (both at the start and
+ * the backup at the end of the device) is mostly waiting on IO, and with
+ * wide arrays doing it serially dominates format time. Each job owns a
+ * private copy of the superblock with that device's dev_idx/layout.
+ */
+struct format_dev_job {
+	struct bch_sb	*sb;
+	struct dev_opts	*dev;
+};
+
+static void *format_dev_thread(void *_job)
+{
+	struct format_dev_job *job = _job;
+	struct dev_opts *i = job->dev;
+
+	if (i->sb_offset == BCH_SB_SECTOR) {
+		/* Zero start of disk */
+		static const char zeroes[BCH_SB_SECTOR << 9];
+
+		xpwrite(i->bdev->bd_fd, zeroes, BCH_SB_SECTOR << 9, 0,
+			"zeroing start of disk");
+	}
+
+	bch2_super_write(i->bdev->bd_fd, job->sb);
+	close(i->bdev->bd_fd);
+
+	free(job->sb);
+	return NULL;
+}
+
 static unsigned parse_target(struct bch_sb_handle *sb,
 			     struct dev_opts *devs, size_t nr_devs,
 			     const char *s)
@@ -296,6 +329,9 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 
 	bch2_sb_members_cpy_v2_v1(&sb);
 
+	struct format_dev_job *jobs = xcalloc(nr_devs, sizeof(*jobs));
+	pthread_t *threads = xcalloc(nr_devs, sizeof(*threads));
+
 	for (i = devs; i < devs + nr_devs; i++) {
 		u64 size_sectors = i->size >> 9;
 
@@ -325,18 +361,31 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 			l->sb_offset[l->nr_superblocks++] = cpu_to_le64(backup_sb);
 		}
 
-		if (i->sb_offset == BCH_SB_SECTOR) {
-			/* Zero start of disk */
-			static const char zeroes[BCH_SB_SECTOR << 9];
+		/*
+		 * bch2_super_write() writes past vstruct_bytes() up to the
+		 * block size rounded size, so pad the copy:
+		 */
+		size_t sb_bytes = round_up(vstruct_bytes(sb.sb), 4096UL);
+		struct bch_sb *sb_copy = xcalloc(1, sb_bytes);
 
-			xpwrite(i->bdev->bd_fd, zeroes, BCH_SB_SECTOR << 9, 0,
-				"zeroing start of disk");
-		}
+		memcpy(sb_copy, sb.sb, vstruct_bytes(sb.sb));
+
+		struct format_dev_job *job = &jobs[i - devs];
+
+		job->sb		= sb_copy;
+		job->dev	= i;
 
-		bch2_super_write(i->bdev->bd_fd, sb.sb);
-		close(i->bdev->bd_fd);
+		if (pthread_create(&threads[i - devs], NULL,
+				   format_dev_thread, job))
+			die("error creating format thread: %m");
 	}
 
+	for (i = devs; i < devs + nr_devs; i++)
+		pthread_join(threads[i - devs], NULL);
+
+	free(threads);
+	free(jobs);
+
 	return sb.sb;
 }
 
@@ -345,10 +394,19 @@ void bch2_super_write(int fd, struct bch_sb *sb)
 	struct nonce nonce = { 0 };
 	unsigned bs = get_blocksize(fd);
 
+	/*
+	 * Write the superblocks in reverse layout order, so that the one at
+	 * the default location - the one opening the filesystem looks at
+	 * first - lands last, after the backups are durable; it's the commit
+	 * point for the whole write:
+	 */
 	unsigned i;
-	for (i = 0; i < sb->layout.nr_superblocks; i++) {
+	for (i = sb->layout.nr_superblocks; i--;) {
 		sb->offset = sb->layout.sb_offset[i];
 
+		if (!i && sb->layout.nr_superblocks > 1)
+			fsync(fd);
+
 		if (sb->offset == BCH_SB_SECTOR) {
 			/* Write backup layout */
 
@@ -510,9 +568,12 @@ int bchu_dev_path_to_idx(struct bchfs_handle fs, const char *dev_path)
 	return idx;
 }
 
-int bchu_data(struct bchfs_handle fs, struct bch_ioctl_data cmd)
+int bchu_data_rate(struct bchfs_handle fs, struct bch_ioctl_data cmd,
+		   unsigned rate_mb)
 {
 	int progress_fd = xioctl(fs.ioctl_fd, BCH_IOCTL_DATA, &cmd);
+	u64 rate_sectors = (u64) rate_mb << (20 - 9);
+	u64 prev_done = 0, rate = 0;
 
 	while (1) {
 		struct bch_ioctl_data_event e;
@@ -543,7 +604,50 @@ int bchu_data(struct bchfs_handle fs, struct bch_ioctl_data cmd)
 			       e.p.pos.offset);
 		}
 
+		/*
+		 * Sectors moved since the last event, smoothed; we poll once
+		 * a second so the delta is already a per-second rate:
+		 */
+		u64 d = prev_done && e.p.sectors_done >= prev_done
+			? e.p.sectors_done - prev_done
+			: 0;
+		if (d)
+			rate = rate ? (rate * 7 + d) / 8 : d;
+		prev_done = e.p.sectors_done;
+
+		if (rate && e.p.sectors_total > e.p.sectors_done) {
+			u64 secs = (e.p.sectors_total - e.p.sectors_done) / rate;
+
+			printf(" (%llu MiB/s, ETA %02llu:%02llu:%02llu)",
+			       rate >> 11,
+			       secs / 3600, (secs / 60) % 60, secs % 60);
+		}
+
 		fflush(stdout);
+
+		/*
+		 * The kernel runs data jobs flat out; the rate cap is enforced
+		 * from this side by stopping the job (closing the progress fd
+		 * ends it) and reissuing it after sleeping off the overshoot.
+		 * Resuming from the reported position is only valid once the
+		 * job is in its user data phase - earlier (btree metadata)
+		 * phases restart from the beginning, where the job's predicate
+		 * skips over work already done:
+		 */
+		if (rate_sectors && d > rate_sectors) {
+			close(progress_fd);
+			sleep(d / rate_sectors);
+
+			if (e.p.data_type == BCH_DATA_user) {
+				cmd.start_btree	= e.p.btree_id;
+				cmd.start_pos	= e.p.pos;
+			}
+
+			progress_fd	= xioctl(fs.ioctl_fd, BCH_IOCTL_DATA, &cmd);
+			prev_done	= 0;
+			continue;
+		}
+
 		sleep(1);
 	}
 	printf("\nDone\n");
@@ -552,6 +656,11 @@ int bchu_data(struct bchfs_handle fs, struct bch_ioctl_data cmd)
 	return 0;
 }
 
+int bchu_data(struct bchfs_handle fs, struct bch_ioctl_data cmd)
+{
+	return bchu_data_rate(fs, cmd, 0);
+}
+
 /* option parsing */
 
 void bch2_opt_strs_free(struct bch_opt_strs *opts)
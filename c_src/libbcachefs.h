@@ -253,6 +253,7 @@ static inline void bchu_disk_resize_journal(struct bchfs_handle fs,
 }
 
 int bchu_data(struct bchfs_handle, struct bch_ioctl_data);
+int bchu_data_rate(struct bchfs_handle, struct bch_ioctl_data, unsigned);
 
 struct dev_name {
 	unsigned	idx;
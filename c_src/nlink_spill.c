@@ -0,0 +1,286 @@
+/*
+ * External sort spill for fsck's hardlink count pass:
+ *
+ * check_nlinks builds an in-memory table with one entry per inode that could
+ * be hardlinked; on filesystems with billions of inodes that table runs to
+ * many gigabytes, and the fallback when it can't be allocated re-walks the
+ * entire dirents btree once per table-sized chunk of the inode space.
+ *
+ * Userspace fsck can do better with a spill file: dirent target inums are
+ * buffered in a fixed-size run, sorted, and appended to an unlinked temporary
+ * file; the sorted runs are then merged through a small heap while the inodes
+ * btree is walked in inum order, so link counts stream out of the merge with
+ * memory bounded by the run buffer plus one read buffer per run, regardless
+ * of inode count.
+ *
+ * The merge only yields bare inums, with no snapshot visibility state - the
+ * caller is responsible for only using this on filesystems where every link
+ * is visible to its target, i.e. a single snapshot.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <linux/sort.h>
+
+#include "nlink_spill.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/darray.h"
+
+#define NLINK_SPILL_RUN_ENTRIES		(1U << 21)	/* 16MB sort buffer */
+#define NLINK_SPILL_READ_ENTRIES	(1U << 12)	/* per run, during merge */
+
+struct nlink_spill_run {
+	u64		offset;		/* entries, into the spill file */
+	u64		nr;		/* entries not yet read */
+	u64		*buf;
+	size_t		buf_pos;
+	size_t		buf_nr;
+};
+
+struct nlink_merge_ent {
+	u64		head;
+	unsigned	run;
+};
+
+struct nlink_spill {
+	struct bch_fs	*c;
+	FILE		*f;
+	int		fd;
+
+	u64		*buf;
+	size_t		buf_nr;
+	u64		file_entries;
+	DARRAY(struct nlink_spill_run) runs;
+
+	/* merge state: */
+	struct nlink_merge_ent *heap;
+	unsigned	heap_nr;
+	u64		next;		/* smallest unconsumed entry, U64_MAX at eof */
+	u64		last_inum;	/* for replays after transaction restart */
+	u32		last_count;
+};
+
+static int u64_cmp(const void *_l, const void *_r)
+{
+	const u64 *l = _l, *r = _r;
+
+	return cmp_int(*l, *r);
+}
+
+struct nlink_spill *bch2_nlink_spill_new(struct bch_fs *c)
+{
+	struct nlink_spill *s = calloc(1, sizeof(*s));
+
+	if (!s)
+		return NULL;
+
+	s->c		= c;
+	s->last_inum	= U64_MAX;
+	s->f		= tmpfile();
+	if (!s->f) {
+		bch_err(c, "error creating nlink spill file: %m");
+		goto err;
+	}
+	s->fd = fileno(s->f);
+
+	s->buf = malloc(NLINK_SPILL_RUN_ENTRIES * sizeof(u64));
+	if (!s->buf)
+		goto err;
+
+	return s;
+err:
+	bch2_nlink_spill_free(s);
+	return NULL;
+}
+
+static int nlink_spill_flush_run(struct nlink_spill *s)
+{
+	if (!s->buf_nr)
+		return 0;
+
+	sort(s->buf, s->buf_nr, sizeof(u64), u64_cmp, NULL);
+
+	if (pwrite(s->fd, s->buf, s->buf_nr * sizeof(u64),
+		   s->file_entries * sizeof(u64)) !=
+	    (ssize_t) (s->buf_nr * sizeof(u64))) {
+		bch_err(s->c, "error writing nlink spill file: %m");
+		return -EIO;
+	}
+
+	struct nlink_spill_run run = {
+		.offset	= s->file_entries,
+		.nr	= s->buf_nr,
+	};
+
+	if (darray_push(&s->runs, run))
+		return -BCH_ERR_ENOMEM_fsck_add_nlink;
+
+	s->file_entries	+= s->buf_nr;
+	s->buf_nr	= 0;
+	return 0;
+}
+
+int bch2_nlink_spill_add(struct nlink_spill *s, u64 inum)
+{
+	s->buf[s->buf_nr++] = inum;
+
+	return s->buf_nr == NLINK_SPILL_RUN_ENTRIES
+		? nlink_spill_flush_run(s)
+		: 0;
+}
+
+static int run_peek(struct nlink_spill *s, struct nlink_spill_run *r, u64 *v)
+{
+	if (r->buf_pos == r->buf_nr) {
+		size_t nr = min_t(u64, r->nr, NLINK_SPILL_READ_ENTRIES);
+
+		if (!nr) {
+			*v = U64_MAX;
+			return 0;
+		}
+
+		if (pread(s->fd, r->buf, nr * sizeof(u64),
+			  r->offset * sizeof(u64)) != (ssize_t) (nr * sizeof(u64))) {
+			bch_err(s->c, "error reading nlink spill file: %m");
+			return -EIO;
+		}
+
+		r->offset	+= nr;
+		r->nr		-= nr;
+		r->buf_pos	= 0;
+		r->buf_nr	= nr;
+	}
+
+	*v = r->buf[r->buf_pos];
+	return 0;
+}
+
+static void merge_sift_down(struct nlink_spill *s, unsigned i)
+{
+	while (1) {
+		unsigned l = i * 2 + 1, r = l + 1, min = i;
+
+		if (l < s->heap_nr && s->heap[l].head < s->heap[min].head)
+			min = l;
+		if (r < s->heap_nr && s->heap[r].head < s->heap[min].head)
+			min = r;
+		if (min == i)
+			break;
+
+		swap(s->heap[i], s->heap[min]);
+		i = min;
+	}
+}
+
+static int merge_next(struct nlink_spill *s, u64 *inum)
+{
+	*inum = s->next;
+
+	if (!s->heap_nr) {
+		s->next = U64_MAX;
+		return 0;
+	}
+
+	struct nlink_spill_run *r = &s->runs.data[s->heap[0].run];
+	u64 head;
+	int ret;
+
+	r->buf_pos++;
+	ret = run_peek(s, r, &head);
+	if (ret)
+		return ret;
+
+	if (head == U64_MAX)
+		s->heap[0] = s->heap[--s->heap_nr];
+	else
+		s->heap[0].head = head;
+	merge_sift_down(s, 0);
+
+	s->next = s->heap_nr ? s->heap[0].head : U64_MAX;
+	return 0;
+}
+
+int bch2_nlink_spill_merge_start(struct nlink_spill *s)
+{
+	int ret = nlink_spill_flush_run(s);
+	if (ret)
+		return ret;
+
+	free(s->buf);
+	s->buf = NULL;
+
+	s->heap = calloc(s->runs.nr ?: 1, sizeof(s->heap[0]));
+	if (!s->heap)
+		return -BCH_ERR_ENOMEM_fsck_add_nlink;
+
+	darray_for_each(s->runs, r) {
+		r->buf = malloc(NLINK_SPILL_READ_ENTRIES * sizeof(u64));
+		if (!r->buf)
+			return -BCH_ERR_ENOMEM_fsck_add_nlink;
+
+		u64 head;
+		ret = run_peek(s, r, &head);
+		if (ret)
+			return ret;
+
+		if (head != U64_MAX)
+			s->heap[s->heap_nr++] = (struct nlink_merge_ent) {
+				.head	= head,
+				.run	= r - s->runs.data,
+			};
+	}
+
+	for (unsigned i = s->heap_nr / 2; i--;)
+		merge_sift_down(s, i);
+
+	s->next = s->heap_nr ? s->heap[0].head : U64_MAX;
+	return 0;
+}
+
+/*
+ * Advance the merged stream past @inum, returning the number of links that
+ * point at it; inums must be passed in increasing order, except that the most
+ * recent inum may be repeated (a transaction restart replays the current key).
+ */
+int bch2_nlink_spill_count(struct nlink_spill *s, u64 inum, u32 *count)
+{
+	if (inum == s->last_inum) {
+		*count = s->last_count;
+		return 0;
+	}
+
+	*count = 0;
+
+	while (s->next <= inum) {
+		u64 v;
+		int ret = merge_next(s, &v);
+		if (ret)
+			return ret;
+
+		if (v == inum)
+			(*count)++;
+	}
+
+	s->last_inum	= inum;
+	s->last_count	= *count;
+	return 0;
+}
+
+void bch2_nlink_spill_free(struct nlink_spill *s)
+{
+	if (!s)
+		return;
+
+	darray_for_each(s->runs, r)
+		free(r->buf);
+	darray_exit(&s->runs);
+	free(s->heap);
+	free(s->buf);
+	if (s->f)
+		fclose(s->f);
+	free(s);
+}
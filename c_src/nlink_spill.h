@@ -0,0 +1,15 @@
+#ifndef _NLINK_SPILL_H
+#define _NLINK_SPILL_H
+
+#include <linux/types.h>
+
+struct bch_fs;
+struct nlink_spill;
+
+struct nlink_spill *bch2_nlink_spill_new(struct bch_fs *);
+int bch2_nlink_spill_add(struct nlink_spill *, u64);
+int bch2_nlink_spill_merge_start(struct nlink_spill *);
+int bch2_nlink_spill_count(struct nlink_spill *, u64, u32 *);
+void bch2_nlink_spill_free(struct nlink_spill *);
+
+#endif /* _NLINK_SPILL_H */
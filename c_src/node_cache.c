@@ -0,0 +1,230 @@
+/*
+ * Shared read-only btree node cache:
+ *
+ * Inspection tools (list, list_journal, dump) are commonly run against the
+ * same offline filesystem concurrently or back to back, and each process used
+ * to read every btree node it touched from disk itself. Instead, cache raw
+ * node reads in a shared memory file keyed by filesystem UUID, so other
+ * processes can satisfy their reads with a memcpy.
+ *
+ * The cache is direct mapped; each slot has a sequence lock (odd = writer in
+ * progress) and a crc over the cached data, so torn reads and writes are
+ * detected. Slots are keyed by the node's full bkey plus the superblock
+ * sequence number - anything that modifies the filesystem bumps the
+ * superblock seq, invalidating the entire cache - and hits still go through
+ * bch2_btree_node_read_done()'s usual checksum verification, falling back to
+ * a disk read on any failure.
+ *
+ * Only processes running with nochanges use the cache; a process that might
+ * write the filesystem must not serve reads from (or publish to) a cache
+ * shared with other invocations.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+
+#include "node_cache.h"
+#include "tools-util.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/btree_cache.h"
+#include "libbcachefs/super-io.h"
+
+#define NODE_CACHE_MAGIC	0x65646f6e68636200ULL
+#define NODE_CACHE_SLOTS	8192
+
+struct node_cache_hdr {
+	__le64			magic;
+	__le32			node_size;
+	__le32			nr_slots;
+};
+
+struct node_cache_slot {
+	u64			seq;	/* odd: write in progress */
+	__le64			sb_seq;
+	__le32			crc;
+	u8			btree_id;
+	u8			level;
+	u8			key_u64s;
+	u8			pad;
+	u64			key[BKEY_BTREE_PTR_U64s_MAX];
+	u8			data[];
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	int			state;	/* 0 unknown, 1 usable, < 0 disabled */
+	void			*map;
+	size_t			bytes;
+	u32			node_size;
+} cache = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+};
+
+static size_t slot_bytes(void)
+{
+	return sizeof(struct node_cache_slot) + cache.node_size;
+}
+
+static struct node_cache_slot *slot_for_key(const struct bkey_i *k)
+{
+	u32 idx = crc32c(0, k, bkey_bytes(&k->k)) % NODE_CACHE_SLOTS;
+
+	return cache.map + sizeof(struct node_cache_hdr) + idx * slot_bytes();
+}
+
+static int node_cache_open(struct bch_fs *c)
+{
+	char uuid[40];
+
+	uuid_unparse_lower(c->sb.user_uuid.b, uuid);
+	char *path = mprintf("/dev/shm/bcachefs-btree-%s", uuid);
+
+	int fd = open(path, O_RDWR|O_CREAT, 0600);
+	free(path);
+	if (fd < 0)
+		return -1;
+
+	cache.node_size	= c->opts.btree_node_size;
+	cache.bytes	= sizeof(struct node_cache_hdr) +
+		(size_t) NODE_CACHE_SLOTS * slot_bytes();
+
+	struct node_cache_hdr want = {
+		.magic		= cpu_to_le64(NODE_CACHE_MAGIC),
+		.node_size	= cpu_to_le32(cache.node_size),
+		.nr_slots	= cpu_to_le32(NODE_CACHE_SLOTS),
+	};
+
+	/* flock serializes initialization; released when fd is closed: */
+	flock(fd, LOCK_EX);
+
+	struct stat st = xfstat(fd);
+	bool create = !st.st_size;
+
+	if ((create
+	     ? ftruncate(fd, cache.bytes)
+	     : st.st_size != (off_t) cache.bytes)) {
+		close(fd);
+		return -1;
+	}
+
+	cache.map = mmap(NULL, cache.bytes, PROT_READ|PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+	if (cache.map == MAP_FAILED) {
+		cache.map = NULL;
+		close(fd);
+		return -1;
+	}
+
+	struct node_cache_hdr *hdr = cache.map;
+
+	if (create)
+		*hdr = want;
+	else if (memcmp(hdr, &want, sizeof(want))) {
+		munmap(cache.map, cache.bytes);
+		cache.map = NULL;
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 1;
+}
+
+static bool node_cache_init(struct bch_fs *c)
+{
+	if (!c->opts.nochanges)
+		return false;
+
+	int state = __atomic_load_n(&cache.state, __ATOMIC_ACQUIRE);
+	if (state)
+		return state > 0;
+
+	pthread_mutex_lock(&cache.lock);
+	if (!cache.state)
+		__atomic_store_n(&cache.state, node_cache_open(c),
+				 __ATOMIC_RELEASE);
+	state = cache.state;
+	pthread_mutex_unlock(&cache.lock);
+
+	return state > 0;
+}
+
+bool bch2_node_cache_read(struct bch_fs *c, struct btree *b)
+{
+	if (!node_cache_init(c) ||
+	    btree_buf_bytes(b) != cache.node_size)
+		return false;
+
+	struct node_cache_slot *s = slot_for_key(&b->key);
+
+	u64 seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+
+	if ((seq & 1) ||
+	    s->sb_seq	!= c->disk_sb.sb->seq ||
+	    s->btree_id	!= b->c.btree_id ||
+	    s->level	!= b->c.level ||
+	    s->key_u64s	!= b->key.k.u64s ||
+	    memcmp(s->key, &b->key, bkey_bytes(&b->key.k)))
+		return false;
+
+	memcpy(b->data, s->data, cache.node_size);
+
+	/*
+	 * The crc and the sequence number recheck both catch a writer racing
+	 * with our copy:
+	 */
+	return crc32c(0, b->data, cache.node_size) == le32_to_cpu(s->crc) &&
+		__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == seq;
+}
+
+/*
+ * Publishing happens in two steps, around verification of the freshly read
+ * node: save_start() claims the slot and copies in the raw data while it's
+ * still untouched in b->data, save_end() makes it visible to readers - or
+ * poisons it, if verification failed:
+ */
+void *bch2_node_cache_save_start(struct bch_fs *c, struct btree *b)
+{
+	if (!node_cache_init(c) ||
+	    btree_buf_bytes(b) != cache.node_size)
+		return NULL;
+
+	struct node_cache_slot *s = slot_for_key(&b->key);
+
+	u64 seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+
+	if ((seq & 1) ||
+	    !__atomic_compare_exchange_n(&s->seq, &seq, seq + 1, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return NULL;
+
+	s->sb_seq	= c->disk_sb.sb->seq;
+	s->btree_id	= b->c.btree_id;
+	s->level	= b->c.level;
+	s->key_u64s	= b->key.k.u64s;
+	memcpy(s->key, &b->key, bkey_bytes(&b->key.k));
+	memcpy(s->data, b->data, cache.node_size);
+	s->crc		= cpu_to_le32(crc32c(0, s->data, cache.node_size));
+
+	return s;
+}
+
+void bch2_node_cache_save_end(struct bch_fs *c, void *_s, bool commit)
+{
+	struct node_cache_slot *s = _s;
+
+	if (!s)
+		return;
+
+	if (!commit)
+		s->key_u64s = 0;	/* never matches */
+
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
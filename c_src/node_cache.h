@@ -0,0 +1,13 @@
+#ifndef _NODE_CACHE_H
+#define _NODE_CACHE_H
+
+#include <stdbool.h>
+
+struct bch_fs;
+struct btree;
+
+bool bch2_node_cache_read(struct bch_fs *, struct btree *);
+void *bch2_node_cache_save_start(struct bch_fs *, struct btree *);
+void bch2_node_cache_save_end(struct bch_fs *, void *, bool);
+
+#endif /* _NODE_CACHE_H */
@@ -0,0 +1,166 @@
+/*
+ * Btree node cache prewarm files:
+ *
+ * fsck and dump walk the btree in key order, which on disk is essentially
+ * random order - and every invocation starts with a cold btree node cache, so
+ * repeated diagnostic runs on the same filesystem pay for the same seek-bound
+ * reads every time. But the set of nodes a run touches barely changes between
+ * invocations: on shutdown we write out the keys of the nodes that ended up in
+ * the btree node cache, and on the next run read them all back in a single
+ * pass sorted by device LBA, before the btree walk starts issuing dependent
+ * reads one level at a time.
+ *
+ * The prewarm file is purely advisory: entries that fail validation, or that
+ * no longer match what's on disk, are skipped - node reads are verified
+ * against the key as usual.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "prewarm.h"
+#include "tools-util.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/btree_cache.h"
+#include "libbcachefs/btree_iter.h"
+#include "libbcachefs/extents.h"
+#include "linux/sort.h"
+
+#define PREWARM_MAGIC		0x6d72777270686362ULL /* bchprwrm */
+
+struct prewarm_hdr {
+	__le64			magic;
+	__uuid_t		uuid;
+	__le32			nr;
+	__le32			pad;
+};
+
+struct prewarm_entry {
+	__u8			btree_id;
+	__u8			level;
+	__u8			pad[6];
+	__u64			key[BKEY_BTREE_PTR_U64s_MAX];
+};
+
+typedef DARRAY(struct prewarm_entry) prewarm_entries;
+
+static const struct bch_extent_ptr *prewarm_entry_ptr(const struct prewarm_entry *e)
+{
+	struct bkey_ptrs_c ptrs =
+		bch2_bkey_ptrs_c(bkey_i_to_s_c((const struct bkey_i *) e->key));
+
+	bkey_for_each_ptr(ptrs, ptr)
+		return ptr;
+	return NULL;
+}
+
+static bool prewarm_entry_valid(const struct prewarm_entry *e)
+{
+	const struct bkey_i *k = (const struct bkey_i *) e->key;
+
+	return e->btree_id < BTREE_ID_NR &&
+		e->level < BTREE_MAX_DEPTH &&
+		k->k.u64s >= BKEY_U64s &&
+		k->k.u64s <= BKEY_BTREE_PTR_U64s_MAX &&
+		(k->k.type == KEY_TYPE_btree_ptr ||
+		 k->k.type == KEY_TYPE_btree_ptr_v2) &&
+		prewarm_entry_ptr(e);
+}
+
+static int prewarm_entry_cmp(const void *_l, const void *_r)
+{
+	const struct bch_extent_ptr *l = prewarm_entry_ptr(_l);
+	const struct bch_extent_ptr *r = prewarm_entry_ptr(_r);
+
+	return  cmp_int(l->dev, r->dev) ?:
+		cmp_int(l->offset, r->offset);
+}
+
+void btree_prewarm_load(struct bch_fs *c, const char *path)
+{
+	prewarm_entries entries = { 0 };
+	struct prewarm_hdr hdr;
+	struct prewarm_entry e;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	struct stat st = xfstat(fd);
+	if (st.st_size < (off_t) sizeof(hdr))
+		goto out;
+
+	xpread(fd, &hdr, sizeof(hdr), 0);
+
+	if (le64_to_cpu(hdr.magic) != PREWARM_MAGIC ||
+	    memcmp(&hdr.uuid, &c->sb.user_uuid, sizeof(hdr.uuid)) ||
+	    st.st_size != (off_t) (sizeof(hdr) +
+				   le32_to_cpu(hdr.nr) * sizeof(e)))
+		goto out;
+
+	for (unsigned i = 0; i < le32_to_cpu(hdr.nr); i++) {
+		xpread(fd, &e, sizeof(e), sizeof(hdr) + i * sizeof(e));
+
+		if (prewarm_entry_valid(&e))
+			darray_push(&entries, e);
+	}
+
+	sort(entries.data, entries.nr, sizeof(e), prewarm_entry_cmp, NULL);
+
+	/*
+	 * Reads are issued in LBA order and complete asynchronously; the btree
+	 * walk that follows finds nodes already in cache (or waits on the read
+	 * in flight) instead of issuing its own reads in key order. Failures
+	 * (e.g. stale entries pointing at reused buckets) are ignored:
+	 */
+	struct btree_trans *trans = bch2_trans_get(c);
+
+	darray_for_each(entries, i)
+		bch2_btree_node_prefetch(trans, NULL,
+					 (struct bkey_i *) i->key,
+					 i->btree_id, i->level);
+
+	bch2_trans_put(trans);
+out:
+	darray_exit(&entries);
+	close(fd);
+}
+
+void btree_prewarm_save(struct bch_fs *c, const char *path)
+{
+	prewarm_entries entries = { 0 };
+	struct btree *b;
+
+	mutex_lock(&c->btree_cache.lock);
+	list_for_each_entry(b, &c->btree_cache.live, list) {
+		if (btree_node_fake(b))
+			continue;
+
+		struct prewarm_entry e = {
+			.btree_id	= b->c.btree_id,
+			.level		= b->c.level,
+		};
+
+		bkey_copy((struct bkey_i *) e.key, &b->key);
+		darray_push(&entries, e);
+	}
+	mutex_unlock(&c->btree_cache.lock);
+
+	struct prewarm_hdr hdr = {
+		.magic	= cpu_to_le64(PREWARM_MAGIC),
+		.nr	= cpu_to_le32(entries.nr),
+	};
+	memcpy(&hdr.uuid, &c->sb.user_uuid, sizeof(hdr.uuid));
+
+	int fd = xopen(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+
+	xpwrite(fd, &hdr, sizeof(hdr), 0, "prewarm header");
+	xpwrite(fd, entries.data, entries.nr * sizeof(entries.data[0]),
+		sizeof(hdr), "prewarm entries");
+
+	close(fd);
+	darray_exit(&entries);
+}
@@ -0,0 +1,9 @@
+#ifndef _PREWARM_H
+#define _PREWARM_H
+
+struct bch_fs;
+
+void btree_prewarm_load(struct bch_fs *, const char *);
+void btree_prewarm_save(struct bch_fs *, const char *);
+
+#endif /* _PREWARM_H */
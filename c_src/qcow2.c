@@ -1,14 +1,28 @@
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <zstd.h>
 
 #include "qcow2.h"
 #include "tools-util.h"
 
 #define QCOW_MAGIC		(('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
-#define QCOW_VERSION		2
+#define QCOW_VERSION2		2
+#define QCOW_VERSION3		3
 #define QCOW_OFLAG_COPIED	(1LL << 63)
+#define QCOW_OFLAG_COMPRESSED	(1LL << 62)
+
+/* v3 incompatible feature bits: */
+#define QCOW_INCOMPAT_COMPRESSION (1ULL << 3)
+
+#define QCOW_COMPRESSION_ZSTD	1
+
+#define QCOW2_COPY_THREADS	8
+#define QCOW2_COPY_CHUNK	(4U << 20)
+#define QCOW2_ZSTD_LEVEL	3
 
 struct qcow2_hdr {
 	u32			magic;
@@ -29,106 +43,385 @@ struct qcow2_hdr {
 
 	u32			nb_snapshots;
 	u64			snapshots_offset;
+
+	/* Version 3 only: */
+	u64			incompatible_features;
+	u64			compatible_features;
+	u64			autoclear_features;
+	u32			refcount_order;
+	u32			header_length;
+	u8			compression_type;
+	u8			pad[7];
 };
 
-struct qcow2_image {
-	int			fd;
-	u32			block_size;
-	u64			*l1_table;
-	u64			l1_offset;
-	u32			l1_index;
-	u64			*l2_table;
-	u64			offset;
+/*
+ * With raw clusters every data block's destination is known before any data is
+ * copied - blocks are laid out in range order starting at @data_start - so the
+ * L1/L2 tables are built up front and the copy is farmed out to threads
+ * claiming large chunks from a shared cursor.
+ *
+ * Compressed cluster sizes aren't known up front: threads instead compress a
+ * chunk, then allocate output space from @out_cursor and fill in their L2
+ * entries as they go (each block is owned by exactly one thread, and the L2
+ * tables themselves are preallocated). Either way the tables are written out
+ * after the data.
+ *
+ * qcow2_write_image_seq() reuses this for the append-only mode: same layout,
+ * but a single writer emitting everything in file order.
+ */
+struct qcow2_copy {
+	int			infd;
+	int			outfd;
+	unsigned		block_size;
+	bool			compress;
+	u32			csize_shift;
+	u64			data_start;
+	u64			**l2_tables;
+	unsigned		l2_size;
+	ranges			*data;
+	u64			*prefix;	/* data bytes before each range */
+	u64			total;
+
+	pthread_mutex_t		lock;
+	u64			cursor;		/* next unclaimed byte, in
+						 * cumulative data space */
+	size_t			range_idx;
+	u64			out_cursor;	/* compressed output allocator */
 };
 
-static void flush_l2(struct qcow2_image *img)
+/* write() wrapper for the sequential path - output fd may not be seekable: */
+static void swrite(int fd, const void *_buf, size_t len, const char *msg)
 {
-	if (img->l1_index != -1) {
-		img->l1_table[img->l1_index] =
-			cpu_to_be64(img->offset|QCOW_OFLAG_COPIED);
-		xpwrite(img->fd, img->l2_table, img->block_size, img->offset,
-			"qcow2 l2 table");
-		img->offset += img->block_size;
-
-		memset(img->l2_table, 0, img->block_size);
-		img->l1_index = -1;
+	const char *buf = _buf;
+
+	while (len) {
+		ssize_t r = write(fd, buf, len);
+
+		if (r < 0)
+			die("error writing %s: %m", msg);
+		buf += r;
+		len -= r;
 	}
 }
 
-static void add_l2(struct qcow2_image *img, u64 src_blk, u64 dst_offset)
+static void qcow2_set_l2(struct qcow2_copy *c, u64 src_blk, u64 entry)
 {
-	unsigned l2_size = img->block_size / sizeof(u64);
-	u64 l1_index = src_blk / l2_size;
-	u64 l2_index = src_blk & (l2_size - 1);
+	u64 l1_index = src_blk / c->l2_size;
+	u64 l2_index = src_blk & (c->l2_size - 1);
 
-	if (img->l1_index != l1_index) {
-		flush_l2(img);
-		img->l1_index = l1_index;
+	c->l2_tables[l1_index][l2_index] = cpu_to_be64(entry);
+}
+
+static void qcow2_copy_compressed(struct qcow2_copy *c, ZSTD_CCtx *cctx,
+				  char *buf, char *cbuf, u32 *csizes,
+				  u64 src, u64 len)
+{
+	unsigned bs = c->block_size;
+	u64 out = 0, base;
+	size_t nr = 0, i;
+
+	for (u64 b = 0; b < len; b += bs) {
+		size_t csize = ZSTD_compressCCtx(cctx,
+				cbuf + out, 2 * bs,
+				buf + b, bs, QCOW2_ZSTD_LEVEL);
+		if (ZSTD_isError(csize))
+			die("zstd error compressing cluster: %s",
+			    ZSTD_getErrorName(csize));
+
+		csizes[nr++] = csize;
+		/* compressed clusters are packed at sector granularity: */
+		out += round_up(csize, 512ULL);
 	}
 
-	img->l2_table[l2_index] = cpu_to_be64(dst_offset|QCOW_OFLAG_COPIED);
+	pthread_mutex_lock(&c->lock);
+	base = c->out_cursor;
+	c->out_cursor += out;
+	pthread_mutex_unlock(&c->lock);
+
+	xpwrite(c->outfd, cbuf, out, base, "qcow2 compressed data");
+
+	out = 0;
+	for (i = 0; i < nr; i++) {
+		u64 nb_sectors = DIV_ROUND_UP(csizes[i], 512U);
+
+		qcow2_set_l2(c, (src + i * bs) / bs,
+			     QCOW_OFLAG_COMPRESSED|
+			     ((nb_sectors - 1) << c->csize_shift)|
+			     (base + out));
+		out += nb_sectors << 9;
+	}
 }
 
-void qcow2_write_image(int infd, int outfd, ranges *data,
-		       unsigned block_size)
+static void *qcow2_copy_thread(void *p)
+{
+	struct qcow2_copy *c = p;
+	char *buf = aligned_alloc(4096, QCOW2_COPY_CHUNK);
+	char *cbuf = NULL;
+	u32 *csizes = NULL;
+	ZSTD_CCtx *cctx = NULL;
+
+	if (!buf)
+		die("error allocating copy buffer");
+
+	if (c->compress) {
+		cbuf	= aligned_alloc(4096, 2 * QCOW2_COPY_CHUNK);
+		csizes	= xmalloc((QCOW2_COPY_CHUNK / 512) * sizeof(u32));
+		cctx	= ZSTD_createCCtx();
+		if (!cbuf || !cctx)
+			die("error allocating compression state");
+	}
+
+	while (1) {
+		u64 start, len, src;
+		struct range *r;
+
+		pthread_mutex_lock(&c->lock);
+
+		while (c->range_idx < c->data->nr &&
+		       c->cursor >= c->prefix[c->range_idx] +
+		       (c->data->data[c->range_idx].end -
+			c->data->data[c->range_idx].start))
+			c->range_idx++;
+
+		if (c->range_idx == c->data->nr) {
+			pthread_mutex_unlock(&c->lock);
+			break;
+		}
+
+		r	= &c->data->data[c->range_idx];
+		start	= c->cursor;
+		len	= min_t(u64, QCOW2_COPY_CHUNK,
+				(r->end - r->start) - (start - c->prefix[c->range_idx]));
+		c->cursor += len;
+
+		pthread_mutex_unlock(&c->lock);
+
+		src	= r->start + (start - c->prefix[c->range_idx]);
+
+		xpread(c->infd, buf, len, src);
+
+		if (c->compress)
+			qcow2_copy_compressed(c, cctx, buf, cbuf, csizes, src, len);
+		else
+			xpwrite(c->outfd, buf, len, c->data_start + start,
+				"qcow2 data");
+	}
+
+	ZSTD_freeCCtx(cctx);
+	free(csizes);
+	free(cbuf);
+	free(buf);
+	return NULL;
+}
+
+/* Fill @buf (one block) with the header, plus the backing file name if any: */
+static void qcow2_build_header_block(char *buf, struct qcow2_opts opts,
+				     u64 image_size, unsigned l1_size,
+				     u64 l1_table_offset)
+{
+	struct qcow2_hdr hdr = { 0 };
+
+	hdr.magic		= cpu_to_be32(QCOW_MAGIC);
+	hdr.version		= cpu_to_be32(opts.compress
+					      ? QCOW_VERSION3 : QCOW_VERSION2);
+	hdr.block_bits		= cpu_to_be32(ilog2(opts.block_size));
+	hdr.size		= cpu_to_be64(image_size);
+	hdr.l1_size		= cpu_to_be32(l1_size);
+	hdr.l1_table_offset	= cpu_to_be64(l1_table_offset);
+
+	if (opts.compress) {
+		hdr.incompatible_features = cpu_to_be64(QCOW_INCOMPAT_COMPRESSION);
+		hdr.refcount_order	= cpu_to_be32(4);
+		hdr.header_length	= cpu_to_be32(sizeof(hdr));
+		hdr.compression_type	= QCOW_COMPRESSION_ZSTD;
+	}
+
+	memset(buf, 0, opts.block_size);
+
+	if (opts.backing_file) {
+		size_t len = strlen(opts.backing_file);
+
+		if (sizeof(hdr) + len > opts.block_size)
+			die("backing file name too long");
+
+		hdr.backing_file_offset	= cpu_to_be64(sizeof(hdr));
+		hdr.backing_file_size	= cpu_to_be32(len);
+		memcpy(buf + sizeof(hdr), opts.backing_file, len);
+	}
+
+	memcpy(buf, &hdr, sizeof(hdr));
+}
+
+/*
+ * Strictly append-only variant, for zoned/SMR devices and object storage
+ * backends that want the image in file order: with raw clusters every offset -
+ * the tables' included - is known before any data is written, so we can emit
+ * header block, data clusters, L2 tables and L1 table with a single sequential
+ * writer and never seek backwards. @outfd may be a pipe.
+ */
+static void qcow2_write_image_seq(int infd, int outfd, struct qcow2_copy *c,
+				  struct qcow2_opts opts, u64 image_size,
+				  u64 *l1_table, unsigned l1_size, char *buf)
 {
+	unsigned block_size = c->block_size;
+	u64 l2_start = c->data_start + c->total, nr_l2 = 0;
+	char *data_buf = aligned_alloc(4096, QCOW2_COPY_CHUNK);
+	size_t i;
+
+	if (!data_buf)
+		die("error allocating copy buffer");
+
+	for (i = 0; i < l1_size; i++)
+		if (c->l2_tables[i]) {
+			l1_table[i] = cpu_to_be64((l2_start + nr_l2 * block_size)|
+						  QCOW_OFLAG_COPIED);
+			nr_l2++;
+		}
+
+	/* Write header: */
+	qcow2_build_header_block(buf, opts, image_size, l1_size,
+				 l2_start + nr_l2 * block_size);
+	swrite(outfd, buf, block_size, "qcow2 header");
+
+	/* Write data, in range order: */
+	darray_for_each(*c->data, r)
+		for (u64 src = r->start; src < r->end; src += QCOW2_COPY_CHUNK) {
+			u64 len = min_t(u64, QCOW2_COPY_CHUNK, r->end - src);
+
+			xpread(infd, data_buf, len, src);
+			swrite(outfd, data_buf, len, "qcow2 data");
+		}
+
+	/* Write L2 tables: */
+	for (i = 0; i < l1_size; i++)
+		if (c->l2_tables[i]) {
+			swrite(outfd, c->l2_tables[i], block_size,
+			       "qcow2 l2 table");
+			free(c->l2_tables[i]);
+		}
+
+	/* Write L1 table: */
+	swrite(outfd, l1_table, l1_size * sizeof(u64), "qcow2 l1 table");
+
+	free(data_buf);
+}
+
+void qcow2_write_image_opts(int infd, int outfd, ranges *data,
+			    struct qcow2_opts opts)
+{
+	unsigned block_size = opts.block_size;
 	u64 image_size = get_size(infd);
 	unsigned l2_size = block_size / sizeof(u64);
 	unsigned l1_size = DIV_ROUND_UP(image_size, (u64) block_size * l2_size);
-	struct qcow2_hdr hdr = { 0 };
-	struct qcow2_image img = {
-		.fd		= outfd,
-		.block_size	= block_size,
-		.l2_table	= xcalloc(l2_size, sizeof(u64)),
-		.l1_table	= xcalloc(l1_size, sizeof(u64)),
-		.l1_index	= -1,
-		.offset		= round_up(sizeof(hdr), block_size),
-	};
+	u64 *l1_table = xcalloc(l1_size, sizeof(u64));
+	u64 **l2_tables = xcalloc(l1_size, sizeof(u64 *));
 	char *buf = xmalloc(block_size);
-	u64 src_offset, dst_offset;
+	u64 offset, dst_offset, total = 0;
+	size_t i;
 
 	assert(is_power_of_2(block_size));
 
+	/*
+	 * Compressed cluster sizes aren't known until the data's been
+	 * compressed, but the header needs the L1 table offset - can't be
+	 * append-only:
+	 */
+	if (opts.sequential && opts.compress)
+		die("sequential qcow2 output is incompatible with compression");
+
 	ranges_roundup(data, block_size);
 	ranges_sort_merge(data);
 
-	/* Write data: */
+	struct qcow2_copy copy = {
+		.infd		= infd,
+		.outfd		= outfd,
+		.block_size	= block_size,
+		.compress	= opts.compress,
+		.csize_shift	= 62 - (ilog2(block_size) - 8),
+		.data_start	= round_up(sizeof(struct qcow2_hdr), (u64) block_size),
+		.l2_tables	= l2_tables,
+		.l2_size	= l2_size,
+		.data		= data,
+		.prefix		= xcalloc(max_t(size_t, data->nr, 1), sizeof(u64)),
+		.lock		= PTHREAD_MUTEX_INITIALIZER,
+	};
+
+	i = 0;
+	darray_for_each(*data, r) {
+		copy.prefix[i++] = total;
+		total += r->end - r->start;
+	}
+	copy.total	= total;
+	copy.out_cursor	= copy.data_start;
+
+	/*
+	 * Preallocate L2 tables; for raw clusters the entries themselves are
+	 * known already, compressed ones are filled in by the copy threads:
+	 */
+	offset = copy.data_start;
 	darray_for_each(*data, r)
-		for (src_offset = r->start;
-		     src_offset < r->end;
-		     src_offset += block_size) {
-			dst_offset = img.offset;
-			img.offset += img.block_size;
-
-			xpread(infd, buf, block_size, src_offset);
-			xpwrite(outfd, buf, block_size, dst_offset,
-				"qcow2 data");
+		for (u64 src = r->start; src < r->end;
+		     src += block_size, offset += block_size) {
+			u64 src_blk  = src / block_size;
+			u64 l1_index = src_blk / l2_size;
 
-			add_l2(&img, src_offset / block_size, dst_offset);
+			if (!l2_tables[l1_index])
+				l2_tables[l1_index] = xcalloc(l2_size, sizeof(u64));
+
+			if (!opts.compress)
+				qcow2_set_l2(&copy, src_blk,
+					     offset|QCOW_OFLAG_COPIED);
 		}
 
-	flush_l2(&img);
+	if (opts.sequential) {
+		qcow2_write_image_seq(infd, outfd, &copy, opts, image_size,
+				      l1_table, l1_size, buf);
+		goto out;
+	}
+
+	/* Write data: */
+	unsigned nr_threads = min_t(u64, QCOW2_COPY_THREADS,
+				    DIV_ROUND_UP(total, QCOW2_COPY_CHUNK));
+	pthread_t threads[QCOW2_COPY_THREADS];
+
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, qcow2_copy_thread, &copy))
+			die("error creating copy thread: %m");
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Write L2 tables: */
+	offset = opts.compress
+		? round_up(copy.out_cursor, (u64) block_size)
+		: copy.data_start + total;
+	for (i = 0; i < l1_size; i++)
+		if (l2_tables[i]) {
+			l1_table[i] = cpu_to_be64(offset|QCOW_OFLAG_COPIED);
+			xpwrite(outfd, l2_tables[i], block_size, offset,
+				"qcow2 l2 table");
+			offset += block_size;
+			free(l2_tables[i]);
+		}
 
 	/* Write L1 table: */
-	dst_offset		= img.offset;
-	img.offset		+= round_up(l1_size * sizeof(u64), block_size);
-	xpwrite(img.fd, img.l1_table, l1_size * sizeof(u64), dst_offset,
+	dst_offset		= offset;
+	xpwrite(outfd, l1_table, l1_size * sizeof(u64), dst_offset,
 		"qcow2 l1 table");
 
 	/* Write header: */
-	hdr.magic		= cpu_to_be32(QCOW_MAGIC);
-	hdr.version		= cpu_to_be32(QCOW_VERSION);
-	hdr.block_bits		= cpu_to_be32(ilog2(block_size));
-	hdr.size		= cpu_to_be64(image_size);
-	hdr.l1_size		= cpu_to_be32(l1_size);
-	hdr.l1_table_offset	= cpu_to_be64(dst_offset);
-
-	memset(buf, 0, block_size);
-	memcpy(buf, &hdr, sizeof(hdr));
-	xpwrite(img.fd, buf, block_size, 0,
+	qcow2_build_header_block(buf, opts, image_size, l1_size, dst_offset);
+	xpwrite(outfd, buf, block_size, 0,
 		"qcow2 header");
-
-	free(img.l2_table);
-	free(img.l1_table);
+out:
+	free(copy.prefix);
+	free(l2_tables);
+	free(l1_table);
 	free(buf);
 }
+
+void qcow2_write_image(int infd, int outfd, ranges *data,
+		       unsigned block_size)
+{
+	qcow2_write_image_opts(infd, outfd, data,
+			       (struct qcow2_opts) { .block_size = block_size });
+}
@@ -4,6 +4,14 @@
 #include <linux/types.h>
 #include "tools-util.h"
 
+struct qcow2_opts {
+	unsigned	block_size;
+	bool		compress;
+	bool		sequential;
+	const char	*backing_file;
+};
+
+void qcow2_write_image_opts(int, int, ranges *, struct qcow2_opts);
 void qcow2_write_image(int, int, ranges *, unsigned);
 
 #endif /* _QCOW2_H */
@@ -5,6 +5,7 @@
 #include <limits.h>
 #include <linux/fs.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +13,7 @@
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <blkid.h>
@@ -19,6 +21,7 @@
 
 #include "libbcachefs.h"
 #include "libbcachefs/bcachefs_ioctl.h"
+#include "linux/blkdev.h"
 #include "linux/sort.h"
 #include "tools-util.h"
 #include "libbcachefs/util.h"
@@ -51,8 +54,65 @@ char *mprintf(const char *fmt, ...)
 	return str;
 }
 
+/*
+ * O_DIRECT handling: block devices are opened O_DIRECT by default so tool
+ * runs don't trash the host's page cache, but callers pass arbitrary heap
+ * buffers at byte granularity. Transfers that don't meet the device's
+ * alignment requirements bounce through the aligned buffer pool.
+ */
+
+#define DIRECT_IO_BOUNCE_BYTES	(1U << 20)
+
+static unsigned fd_direct_align(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	return flags >= 0 && (flags & O_DIRECT) ? get_blocksize(fd) : 0;
+}
+
+static bool io_is_aligned(const void *buf, size_t count, off_t offset, unsigned bs)
+{
+	return !(((unsigned long) buf | count | offset) & (bs - 1));
+}
+
+static void xpread_direct(int fd, void *buf, size_t count, off_t offset, unsigned bs)
+{
+	void *bounce = bdev_aligned_buf_get(DIRECT_IO_BOUNCE_BYTES);
+
+	if (!bounce)
+		die("error allocating aligned buffer");
+
+	while (count) {
+		off_t aligned	= round_down(offset, bs);
+		size_t pad	= offset - aligned;
+		size_t len	= min_t(size_t, round_up(pad + count, bs),
+					DIRECT_IO_BOUNCE_BYTES);
+		ssize_t r	= pread(fd, bounce, len, aligned);
+
+		if (r < 0)
+			die("read error: %m");
+		if ((size_t) r <= pad)
+			die("pread error: unexpected eof");
+
+		size_t b = min_t(size_t, r - pad, count);
+		memcpy(buf, bounce + pad, b);
+		buf	+= b;
+		count	-= b;
+		offset	+= b;
+	}
+
+	bdev_aligned_buf_put(bounce);
+}
+
 void xpread(int fd, void *buf, size_t count, off_t offset)
 {
+	unsigned bs = fd_direct_align(fd);
+
+	if (bs && !io_is_aligned(buf, count, offset, bs)) {
+		xpread_direct(fd, buf, count, offset, bs);
+		return;
+	}
+
 	while (count) {
 		ssize_t r = pread(fd, buf, count, offset);
 
@@ -65,8 +125,57 @@ void xpread(int fd, void *buf, size_t count, off_t offset)
 	}
 }
 
+static void xpwrite_direct(int fd, const void *buf, size_t count, off_t offset,
+			   unsigned bs, const char *msg)
+{
+	void *bounce = bdev_aligned_buf_get(DIRECT_IO_BOUNCE_BYTES);
+
+	if (!bounce)
+		die("error allocating aligned buffer");
+
+	while (count) {
+		off_t aligned	= round_down(offset, bs);
+		size_t pad	= offset - aligned;
+		size_t len	= min_t(size_t, round_up(pad + count, bs),
+					DIRECT_IO_BOUNCE_BYTES);
+		size_t b	= min_t(size_t, count, len - pad);
+		ssize_t r;
+
+		/*
+		 * Unaligned head/tail: read the edge blocks first so the
+		 * rewrite doesn't clobber neighbouring data:
+		 */
+		if (pad || ((pad + b) & (bs - 1))) {
+			r = pread(fd, bounce, len, aligned);
+			if (r < 0)
+				die("error reading %s for unaligned rewrite: %m", msg);
+			if ((size_t) r < len)
+				memset(bounce + r, 0, len - r);
+		}
+
+		memcpy(bounce + pad, buf, b);
+
+		r = pwrite(fd, bounce, len, aligned);
+		if (r < 0 || (size_t) r != len)
+			die("error writing %s (ret %zi err %m)", msg, r);
+
+		buf	+= b;
+		count	-= b;
+		offset	+= b;
+	}
+
+	bdev_aligned_buf_put(bounce);
+}
+
 void xpwrite(int fd, const void *buf, size_t count, off_t offset, const char *msg)
 {
+	unsigned bs = fd_direct_align(fd);
+
+	if (bs && !io_is_aligned(buf, count, offset, bs)) {
+		xpwrite_direct(fd, buf, count, offset, bs, msg);
+		return;
+	}
+
 	ssize_t r = pwrite(fd, buf, count, offset);
 
 	if (r != count)
@@ -234,6 +343,125 @@ int open_for_format(struct dev_opts *dev, bool force)
 	return ret;
 }
 
+/* Discard the head and tail of each device up front, so callers can
+ * immediately write superblocks (including the backup at the end of the
+ * device) while the bulk is discarded in the background: */
+#define DISCARD_RESERVED	(16ULL << 20)
+
+static int do_discard(int fd, u64 offset, u64 len)
+{
+	u64 range[2] = { offset, len };
+
+	return ioctl(fd, BLKDISCARD, range);
+}
+
+static void *discard_dev_thread(void *_d)
+{
+	struct discard_dev *d = _d;
+	struct discard_ctx *ctx = d->ctx;
+
+	while (d->offset < d->end) {
+		u64 len = min(ctx->chunk_size, d->end - d->offset);
+
+		/* not fatal - discard is advisory: */
+		if (do_discard(d->fd, d->offset, len)) {
+			fprintf(stderr, "BLKDISCARD error on %s: %m\n", d->path);
+			len = d->end - d->offset;
+		}
+
+		d->offset += len;
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->done += len;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+	return NULL;
+}
+
+void discard_dev_push(struct discard_ctx *ctx, const char *path, int fd)
+{
+	struct discard_dev d = {
+		.ctx	= ctx,
+		.path	= path,
+		.fd	= dup(fd),	/* the caller may close theirs */
+		.end	= get_size(fd),
+	};
+
+	if (d.fd < 0)
+		die("dup error: %m");
+
+	if (darray_push(&ctx->devs, d))
+		die("insufficient memory");
+}
+
+void discard_start(struct discard_ctx *ctx, u64 chunk_size)
+{
+	pthread_mutex_init(&ctx->lock, NULL);
+	ctx->chunk_size = chunk_size ?: DISCARD_CHUNK_DEFAULT;
+
+	darray_for_each(ctx->devs, d) {
+		u64 head = min(DISCARD_RESERVED, d->end);
+		u64 tail = min(DISCARD_RESERVED, d->end - head);
+
+		if (do_discard(d->fd, 0, head) ||
+		    (tail && do_discard(d->fd, d->end - tail, tail))) {
+			fprintf(stderr, "BLKDISCARD not supported on %s, not discarding\n",
+				d->path);
+			d->end = 0;
+			continue;
+		}
+
+		d->offset	= head;
+		d->end		-= tail;
+	}
+
+	darray_for_each(ctx->devs, d) {
+		if (d->offset >= d->end)
+			continue;
+
+		ctx->total += d->end - d->offset;
+
+		if (pthread_create(&d->thread, NULL, discard_dev_thread, d))
+			die("error creating discard thread: %m");
+		d->running = true;
+	}
+}
+
+void discard_wait(struct discard_ctx *ctx, bool quiet)
+{
+	if (!ctx->devs.nr)
+		return;
+
+	while (1) {
+		pthread_mutex_lock(&ctx->lock);
+		u64 done = ctx->done, total = ctx->total;
+		pthread_mutex_unlock(&ctx->lock);
+
+		if (!quiet && total) {
+			printf("\rDiscarding: %llu/%llu GiB",
+			       done >> 30, total >> 30);
+			fflush(stdout);
+		}
+
+		if (done >= total)
+			break;
+
+		struct timespec ts = { .tv_nsec = 100 * 1000 * 1000 };
+		nanosleep(&ts, NULL);
+	}
+
+	darray_for_each(ctx->devs, d) {
+		if (d->running)
+			pthread_join(d->thread, NULL);
+		close(d->fd);
+	}
+
+	if (!quiet && ctx->total)
+		printf("\rDiscard complete          \n");
+
+	darray_exit(&ctx->devs);
+}
+
 bool ask_yn(void)
 {
 	const char *short_yes = "yY";
@@ -263,24 +491,36 @@ static int range_cmp(const void *_l, const void *_r)
 	return 0;
 }
 
+static u64 range_sort_key(const void *_r)
+{
+	return ((const struct range *) _r)->start;
+}
+
 void ranges_sort_merge(ranges *r)
 {
 	ranges tmp = { 0 };
+	size_t a = 0, b = r->nr_sorted;
 
-	sort(r->data, r->nr, sizeof(r->data[0]), range_cmp, NULL);
+	bch2_sort_radix(r->data + r->nr_sorted, r->nr - r->nr_sorted,
+			sizeof(r->data[0]), range_sort_key, range_cmp);
 
-	/* Merge contiguous ranges: */
-	darray_for_each(*r, i) {
-		struct range *t = tmp.nr ?  &tmp.data[tmp.nr - 1] : NULL;
+	/* Merge the two sorted runs, coalescing contiguous ranges: */
+	while (a < r->nr_sorted || b < r->nr) {
+		struct range next = a < r->nr_sorted &&
+			(b == r->nr || r->data[a].start <= r->data[b].start)
+			? r->data[a++]
+			: r->data[b++];
+		struct range *t = tmp.nr ? &tmp.data[tmp.nr - 1] : NULL;
 
-		if (t && t->end >= i->start)
-			t->end = max(t->end, i->end);
+		if (t && t->end >= next.start)
+			t->end = max(t->end, next.end);
 		else
-			darray_push(&tmp, *i);
+			darray_push(&tmp, next);
 	}
 
 	darray_exit(r);
 	*r = tmp;
+	r->nr_sorted = r->nr;
 }
 
 void ranges_roundup(ranges *r, unsigned block_size)
@@ -414,34 +654,115 @@ static u32 crc32c_default(u32 crc, const void *buf, size_t size)
 
 #ifdef __x86_64__
 
-#ifdef CONFIG_X86_64
-#define REX_PRE "0x48, "
-#else
-#define REX_PRE
-#endif
+#include <immintrin.h>
+
+/*
+ * The crc32 instruction has a three cycle latency, so a single stream of
+ * crc32q leaves two thirds of the pipe idle; run three independent streams
+ * over fixed size lanes and stitch the lane crcs back together. Lanes come in
+ * several sizes so that small buffers - extent checksum granularity is
+ * typically 4k-64k - still get the interleaved path.
+ *
+ * Advancing a crc by a lane's worth of zeroes is a linear operator over
+ * GF(2); crc32c_zeros[] is that operator, built at startup by squaring the
+ * shift-by-one-bit matrix (as in crc32_combine() everywhere else) and then
+ * flattened into four byte-indexed tables per lane size:
+ */
 
+static const unsigned crc32c_lanes[] = { 4096, 1024, 256 };
+
+static u32 crc32c_zeros[ARRAY_SIZE(crc32c_lanes)][4][256];
+
+static u32 gf2_matrix_times(const u32 *mat, u32 vec)
+{
+	u32 sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(u32 *square, const u32 *mat)
+{
+	unsigned n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+static void crc32c_zeros_init(void)
+{
+	u32 even[32], odd[32], *cur = odd, *next = even;
+	unsigned bits = 1, b, n;
+
+	/* operator that advances a crc by one zero bit: */
+	odd[0] = 0x82F63B78;	/* crc32c polynomial, reflected */
+	for (n = 1; n < 32; n++)
+		odd[n] = 1U << (n - 1);
+
+	for (b = ARRAY_SIZE(crc32c_lanes); b--;) {
+		while (bits < crc32c_lanes[b] * 8) {
+			gf2_matrix_square(next, cur);
+			swap(cur, next);
+			bits <<= 1;
+		}
+
+		for (n = 0; n < 256; n++) {
+			crc32c_zeros[b][0][n] = gf2_matrix_times(cur, n);
+			crc32c_zeros[b][1][n] = gf2_matrix_times(cur, n << 8);
+			crc32c_zeros[b][2][n] = gf2_matrix_times(cur, n << 16);
+			crc32c_zeros[b][3][n] = gf2_matrix_times(cur, n << 24);
+		}
+	}
+}
+
+static inline u32 crc32c_shift(unsigned b, u32 crc)
+{
+	return crc32c_zeros[b][0][(crc >>  0) & 0xff] ^
+	       crc32c_zeros[b][1][(crc >>  8) & 0xff] ^
+	       crc32c_zeros[b][2][(crc >> 16) & 0xff] ^
+	       crc32c_zeros[b][3][(crc >> 24) & 0xff];
+}
+
+__attribute__((target("sse4.2")))
 static u32 crc32c_sse42(u32 crc, const void *buf, size_t size)
 {
-	while (size >= sizeof(long)) {
-		const unsigned long *d = buf;
+	unsigned b;
+
+	for (b = 0; b < ARRAY_SIZE(crc32c_lanes); b++) {
+		const unsigned lane = crc32c_lanes[b];
 
-		__asm__ __volatile__(
-			".byte 0xf2, " REX_PRE "0xf, 0x38, 0xf1, 0xf1;"
-			:"=S"(crc)
-			:"0"(crc), "c"(*d)
-		);
-		buf	+= sizeof(long);
-		size	-= sizeof(long);
+		while (size >= 3 * lane) {
+			const u64 *p0 = buf;
+			const u64 *p1 = buf + lane;
+			const u64 *p2 = buf + 2 * lane;
+			u64 crc0 = crc, crc1 = 0, crc2 = 0;
+			unsigned i;
+
+			for (i = 0; i < lane / 8; i++) {
+				crc0 = _mm_crc32_u64(crc0, p0[i]);
+				crc1 = _mm_crc32_u64(crc1, p1[i]);
+				crc2 = _mm_crc32_u64(crc2, p2[i]);
+			}
+
+			crc = crc32c_shift(b, crc32c_shift(b, crc0) ^ crc1) ^ crc2;
+			buf	+= 3 * lane;
+			size	-= 3 * lane;
+		}
 	}
 
-	while (size) {
-		const u8 *d = buf;
+	while (size >= sizeof(u64)) {
+		crc = _mm_crc32_u64(crc, *(const u64 *) buf);
+		buf	+= sizeof(u64);
+		size	-= sizeof(u64);
+	}
 
-		__asm__ __volatile__(
-			".byte 0xf2, 0xf, 0x38, 0xf0, 0xf1"
-			:"=S"(crc)
-			:"0"(crc), "c"(*d)
-		);
+	while (size) {
+		crc = _mm_crc32_u8(crc, *(const u8 *) buf);
 		buf	+= 1;
 		size	-= 1;
 	}
@@ -454,8 +775,10 @@ static u32 crc32c_sse42(u32 crc, const void *buf, size_t size)
 static void *resolve_crc32c(void)
 {
 #ifdef __x86_64__
-	if (__builtin_cpu_supports("sse4.2"))
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_zeros_init();
 		return crc32c_sse42;
+	}
 #endif
 	return crc32c_default;
 }
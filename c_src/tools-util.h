@@ -3,6 +3,7 @@
 
 #include <errno.h>
 #include <mntent.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -94,6 +95,41 @@ unsigned get_blocksize(int);
 struct dev_opts;
 int open_for_format(struct dev_opts *, bool);
 
+/*
+ * Chunked BLKDISCARD engine: discarding a large SSD with a single ioctl can
+ * stall for a very long time with no feedback. Instead, discard in chunks
+ * with a worker thread per device; callers push devices, call
+ * discard_start(), may overlap other work (superblock writes - the head and
+ * tail of each device are discarded synchronously at start), and must
+ * discard_wait() - which reports progress - before anything else writes to
+ * the devices.
+ */
+struct discard_ctx;
+
+struct discard_dev {
+	struct discard_ctx	*ctx;
+	const char		*path;
+	int			fd;
+	u64			offset;
+	u64			end;
+	pthread_t		thread;
+	bool			running;
+};
+
+struct discard_ctx {
+	u64			chunk_size;
+	u64			total;
+	u64			done;
+	pthread_mutex_t		lock;
+	DARRAY(struct discard_dev) devs;
+};
+
+#define DISCARD_CHUNK_DEFAULT	(2ULL << 30)
+
+void discard_dev_push(struct discard_ctx *, const char *, int);
+void discard_start(struct discard_ctx *, u64);
+void discard_wait(struct discard_ctx *, bool);
+
 bool ask_yn(void);
 
 struct range {
@@ -101,17 +137,40 @@ struct range {
 	u64		end;
 };
 
-typedef DARRAY(struct range) ranges;
+/*
+ * A set of ranges, kept as a sorted coalesced prefix plus a bounded unsorted
+ * tail: range_add() appends to the tail, coalescing with the previous add
+ * when they're contiguous, and periodically merges the tail into the prefix -
+ * so heavily duplicated/fragmented sets (dump visits the same btree nodes
+ * over and over) stay small as they're built instead of accumulating into one
+ * giant final sort.
+ */
+typedef struct {
+	DARRAY(struct range);
+	size_t		nr_sorted;
+} ranges;
+
+void ranges_sort_merge(ranges *);
 
 static inline void range_add(ranges *data, u64 offset, u64 size)
 {
+	struct range *t = data->nr > data->nr_sorted
+		? &data->data[data->nr - 1] : NULL;
+
+	if (t && t->start <= offset && offset <= t->end) {
+		t->end = max(t->end, offset + size);
+		return;
+	}
+
 	darray_push(data, ((struct range) {
 		.start = offset,
 		.end = offset + size
 	}));
-}
 
-void ranges_sort_merge(ranges *);
+	if (data->nr - data->nr_sorted >=
+	    max_t(size_t, 1024, data->nr_sorted / 4))
+		ranges_sort_merge(data);
+}
 void ranges_roundup(ranges *, unsigned);
 void ranges_rounddown(ranges *, unsigned);
 
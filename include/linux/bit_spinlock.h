@@ -1,7 +1,10 @@
 #ifndef __LINUX_BIT_SPINLOCK_H
 #define __LINUX_BIT_SPINLOCK_H
 
+#include <linux/atomic.h>
+#include <linux/hash.h>
 #include <linux/kernel.h>
+#include <linux/log2.h>
 #include <linux/preempt.h>
 #include <linux/futex.h>
 #include <urcu/futex.h>
@@ -45,11 +48,29 @@ static inline void do_futex(int nr, unsigned long *addr, unsigned long v, int fu
 	futex(addr32, futex_flags, *v32, NULL, NULL, 0);
 }
 
+/*
+ * Contended lockers spin for a bit before sleeping - bucket locks are held
+ * for a handful of instructions, so the hold time is far shorter than a
+ * futex round trip. A hashed table of waiter counts lets the unlock path
+ * skip the wake syscall when (as is nearly always the case) nobody sleeps.
+ */
+#define BIT_SPIN_NR_SPINS	512U
+#define BIT_SPIN_WAITER_SLOTS	256U
+
+extern atomic_t bit_spin_waiter_table[BIT_SPIN_WAITER_SLOTS];
+
+static inline atomic_t *bit_spin_waiters(unsigned long *addr)
+{
+	return bit_spin_waiter_table +
+		hash_ptr(addr, ilog2(BIT_SPIN_WAITER_SLOTS));
+}
+
 static inline void bit_spin_lock(int nr, unsigned long *_addr)
 {
 	unsigned long mask;
 	unsigned long *addr = _addr + (nr / BITS_PER_LONG);
 	unsigned long v;
+	unsigned spins;
 
 	nr &= BITS_PER_LONG - 1;
 	mask = 1UL << nr;
@@ -59,13 +80,37 @@ static inline void bit_spin_lock(int nr, unsigned long *_addr)
 		if (!(v & mask))
 			break;
 
-		do_futex(nr, addr, v, FUTEX_WAIT);
+		for (spins = 0; spins < BIT_SPIN_NR_SPINS; spins++) {
+			if (!(__atomic_load_n(addr, __ATOMIC_RELAXED) & mask))
+				break;
+			cpu_relax();
+		}
+
+		if (spins < BIT_SPIN_NR_SPINS)
+			continue;
+
+		atomic_t *w = bit_spin_waiters(addr);
+
+		atomic_inc(w);
+		/*
+		 * Order the waiter count increment against rereading the lock
+		 * word: pairs with the unlock side clearing the bit before
+		 * checking for waiters, so wakeups can't be lost.
+		 */
+		v = __atomic_load_n(addr, __ATOMIC_SEQ_CST);
+		if (v & mask)
+			do_futex(nr, addr, v, FUTEX_WAIT);
+		atomic_dec(w);
 	}
 }
 
 static inline void bit_spin_wake(int nr, unsigned long *_addr)
 {
-	do_futex(nr, _addr, INT_MAX, FUTEX_WAKE);
+	unsigned long *addr = _addr + (nr / BITS_PER_LONG);
+
+	smp_mb();
+	if (atomic_read(bit_spin_waiters(addr)))
+		do_futex(nr & (BITS_PER_LONG - 1), addr, INT_MAX, FUTEX_WAKE);
 }
 
 static inline void bit_spin_unlock(int nr, unsigned long *_addr)
@@ -76,8 +121,14 @@ static inline void bit_spin_unlock(int nr, unsigned long *_addr)
 	nr &= BITS_PER_LONG - 1;
 	mask = 1UL << nr;
 
-	__atomic_and_fetch(addr, ~mask, __ATOMIC_RELEASE);
-	do_futex(nr, addr, INT_MAX, FUTEX_WAKE);
+	/*
+	 * Full barrier between releasing the lock and checking the waiter
+	 * count; pairs with the waiter-side increment before rereading the
+	 * lock word.
+	 */
+	__atomic_and_fetch(addr, ~mask, __ATOMIC_SEQ_CST);
+	if (atomic_read(bit_spin_waiters(addr)))
+		do_futex(nr, addr, INT_MAX, FUTEX_WAKE);
 }
 
 #endif /* __LINUX_BIT_SPINLOCK_H */
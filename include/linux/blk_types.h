@@ -5,6 +5,8 @@
 #ifndef __LINUX_BLK_TYPES_H
 #define __LINUX_BLK_TYPES_H
 
+#include <pthread.h>
+
 #include <linux/atomic.h>
 #include <linux/types.h>
 #include <linux/bvec.h>
@@ -39,6 +41,23 @@ struct block_device {
 	struct gendisk *	bd_disk;
 	struct gendisk		__bd_disk;
 	int			bd_fd;
+	struct bdev_readahead	*bd_ra;
+
+	/* BLK_OPEN_MMAP: reads serviced from a mapping of the device */
+	void			*bd_mmap;
+	u64			bd_mmap_bytes;
+	pthread_rwlock_t	bd_mmap_lock;
+
+	/* ewma of bio completion times, for replica scoring: */
+	atomic64_t		bd_io_latency[2];
+
+	/*
+	 * ewma of bio error rate plus a consecutive error count, for retry
+	 * ordering and fast-fail:
+	 */
+	atomic64_t		bd_io_errors;
+	atomic64_t		bd_io_errors_seq;
+	atomic64_t		bd_io_fastfailed;
 };
 
 #define bdev_kobj(_bdev) (&((_bdev)->kobj))
@@ -88,6 +107,9 @@ struct bio {
 	bio_end_io_t		*bi_end_io;
 	void			*bi_private;
 
+	/* set at submission, for per-device latency tracking: */
+	u64			bi_submit_ns;
+
 	unsigned short		bi_vcnt;	/* how many bio_vec's */
 
 	/*
@@ -208,6 +230,7 @@ enum req_flag_bits {
 	__REQ_PREFLUSH,		/* request for cache flush */
 	__REQ_RAHEAD,		/* read ahead, can fail anytime */
 	__REQ_BACKGROUND,	/* background IO */
+	__REQ_POLLED,		/* caller is latency sensitive, poll for completion */
 	__REQ_NR_BITS,		/* stops here */
 };
 
@@ -228,6 +251,7 @@ static inline void bio_set_op_attrs(struct bio *bio, unsigned op,
 
 #define REQ_RAHEAD		(1ULL << __REQ_RAHEAD)
 #define REQ_THROTTLED		(1ULL << __REQ_THROTTLED)
+#define REQ_POLLED		(1ULL << __REQ_POLLED)
 
 #define REQ_FUA			(1ULL << __REQ_FUA)
 #define REQ_PREFLUSH		(1ULL << __REQ_PREFLUSH)
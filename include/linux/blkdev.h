@@ -37,6 +37,8 @@ typedef unsigned int __bitwise blk_mode_t;
 #define BLK_OPEN_WRITE_IOCTL	((__force blk_mode_t)(1 << 4))
 
 #define BLK_OPEN_BUFFERED	((__force blk_mode_t)(1 << 5))
+/* service reads by copying from an mmap of the device, when possible */
+#define BLK_OPEN_MMAP		((__force blk_mode_t)(1 << 6))
 
 struct inode {
 	unsigned long		i_ino;
@@ -58,6 +60,22 @@ static inline struct inode *file_inode(const struct file *f)
 void generic_make_request(struct bio *);
 int submit_bio_wait(struct bio *);
 
+/*
+ * Batch up bios submitted by this thread so the backend can hand them to the
+ * kernel in a single submission:
+ */
+#define BLK_PLUG_MAX	64U
+
+struct blk_plug {
+	struct bio	*bios;	/* singly linked via bi_next, submission order */
+	struct bio	**tail;
+	unsigned	nr;
+};
+
+void blk_start_plug(struct blk_plug *);
+void blk_finish_plug(struct blk_plug *);
+void blk_flush_current_plug(void);
+
 static inline void submit_bio(struct bio *bio)
 {
 	generic_make_request(bio);
@@ -100,6 +118,27 @@ struct bdev_handle *bdev_open_by_path(const char *, blk_mode_t, void *,
 				      const struct blk_holder_ops *);
 int lookup_bdev(const char *path, dev_t *);
 
+void *bdev_aligned_buf_get(size_t);
+void bdev_aligned_buf_put(void *);
+
+void bdev_latency_acct(struct bio *);
+
+static inline u64 bdev_io_latency(struct block_device *bdev, int rw)
+{
+	return atomic64_read(&bdev->bd_io_latency[rw]);
+}
+
+/*
+ * Health score from an ewma of completion status, 0 (healthy) to
+ * BDEV_ERROR_SCORE_MAX (every recent IO failed):
+ */
+#define BDEV_ERROR_SCORE_MAX	256
+
+static inline u64 bdev_io_error_score(struct block_device *bdev)
+{
+	return atomic64_read(&bdev->bd_io_errors);
+}
+
 struct super_block {
 	void			*s_fs_info;
 };
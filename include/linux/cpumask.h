@@ -1,16 +1,34 @@
 #ifndef __LINUX_CPUMASK_H
 #define __LINUX_CPUMASK_H
 
-#define num_online_cpus()	1U
-#define num_possible_cpus()	1U
-#define num_present_cpus()	1U
-#define num_active_cpus()	1U
-#define cpu_online(cpu)		((cpu) == 0)
-#define cpu_possible(cpu)	((cpu) == 0)
-#define cpu_present(cpu)	((cpu) == 0)
-#define cpu_active(cpu)		((cpu) == 0)
+#include <unistd.h>
 
-#define raw_smp_processor_id()	0U
+/*
+ * We don't emulate cpu hotplug or real cpumasks, but percpu data is backed by
+ * per thread slots (see percpu.h): a "possible cpu" is a registered thread
+ * slot, so for_each_possible_cpu() summing reads cover every thread's
+ * contributions. The real online cpu count is reported so callers can size
+ * thread pools and partition work:
+ */
+extern unsigned __percpu_nr_slots;
+unsigned __percpu_slot(void);
+
+static inline unsigned num_online_cpus(void)
+{
+	long nr = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return nr > 0 ? nr : 1;
+}
+
+#define num_possible_cpus()	(__percpu_nr_slots ?: 1U)
+#define num_present_cpus()	num_possible_cpus()
+#define num_active_cpus()	num_possible_cpus()
+#define cpu_online(cpu)		((cpu) < num_possible_cpus())
+#define cpu_possible(cpu)	((cpu) < num_possible_cpus())
+#define cpu_present(cpu)	((cpu) < num_possible_cpus())
+#define cpu_active(cpu)		((cpu) < num_possible_cpus())
+
+#define raw_smp_processor_id()	__percpu_slot()
 
 #define for_each_cpu(cpu, mask)			\
 	for ((cpu) = 0; (cpu) < 1; (cpu)++, (void)mask)
@@ -19,8 +37,9 @@
 #define for_each_cpu_and(cpu, mask, and)	\
 	for ((cpu) = 0; (cpu) < 1; (cpu)++, (void)mask, (void)and)
 
-#define for_each_possible_cpu(cpu) for_each_cpu((cpu), 1)
-#define for_each_online_cpu(cpu)   for_each_cpu((cpu), 1)
-#define for_each_present_cpu(cpu)  for_each_cpu((cpu), 1)
+#define for_each_possible_cpu(cpu) \
+	for ((cpu) = 0; (cpu) < num_possible_cpus(); (cpu)++)
+#define for_each_online_cpu(cpu)	for_each_possible_cpu(cpu)
+#define for_each_present_cpu(cpu)	for_each_possible_cpu(cpu)
 
 #endif /* __LINUX_CPUMASK_H */
@@ -156,6 +156,40 @@ void *__genradix_ptr_alloc(struct __genradix *, size_t, gfp_t);
 			__genradix_idx_to_offset(_radix, _idx),	\
 			_gfp))
 
+/*
+ * Last-leaf cache for repeated lookups: every genradix access walks from the
+ * root, but accessors scanning in index order mostly stay within one leaf -
+ * the cache satisfies lookups within the last leaf's span without touching
+ * the tree.
+ *
+ * Leaves are never freed or moved until genradix_free(), so a cache stays
+ * valid for the lifetime of the tree; it just won't see entries allocated
+ * after it was filled until the lookup leaves the cached span.
+ */
+struct genradix_leaf_cache {
+	void		*leaf;
+	size_t		base;	/* byte offset of start of leaf */
+};
+
+#define genradix_leaf_cache_init()	((struct genradix_leaf_cache) {})
+
+void *__genradix_ptr_cached(struct __genradix *, struct genradix_leaf_cache *,
+			    size_t);
+
+/**
+ * genradix_ptr_cached - get a pointer to a genradix entry, going through a
+ *			 last-leaf cache
+ * @_radix:	genradix to access
+ * @_cache:	a genradix_leaf_cache, dedicated to this accessor
+ * @_idx:	index to fetch
+ *
+ * Returns a pointer to entry at @_idx, or NULL if that entry does not exist.
+ */
+#define genradix_ptr_cached(_radix, _cache, _idx)		\
+	(__genradix_cast(_radix)				\
+	 __genradix_ptr_cached(&(_radix)->tree, _cache,		\
+			__genradix_idx_to_offset(_radix, _idx)))
+
 struct genradix_iter {
 	size_t			offset;
 	size_t			pos;
@@ -245,6 +279,42 @@ static inline void __genradix_iter_rewind(struct genradix_iter *iter,
 #define genradix_iter_rewind(_iter, _radix)			\
 	__genradix_iter_rewind(_iter, __genradix_obj_size(_radix))
 
+void *__genradix_iter_peek_leaf(struct genradix_iter *, struct __genradix *,
+				size_t, size_t, size_t *);
+
+/**
+ * genradix_iter_peek_leaf - get the first leaf span at or above iterator's
+ *			     current position
+ * @_iter:	a genradix_iter
+ * @_radix:	genradix being iterated over
+ * @_nr:	size_t *, set to the number of contiguous entries in the span
+ *
+ * Returns a pointer to the first entry of the next allocated leaf, with @_nr
+ * entries following it contiguously, or NULL if no more leaves exist.
+ */
+#define genradix_iter_peek_leaf(_iter, _radix, _nr)		\
+	(__genradix_cast(_radix)				\
+	 __genradix_iter_peek_leaf(_iter, &(_radix)->tree,	\
+			__genradix_objs_per_page(_radix),	\
+			__genradix_obj_size(_radix), _nr))
+
+static inline void __genradix_iter_advance_leaf(struct genradix_iter *iter,
+						size_t obj_size, size_t nr)
+{
+	size_t bytes = nr * obj_size;
+
+	if (iter->offset + bytes < iter->offset) {
+		iter->offset	= SIZE_MAX;
+		iter->pos	= SIZE_MAX;
+		return;
+	}
+
+	iter->offset += bytes;
+	if (iter->offset & (PAGE_SIZE - 1))
+		iter->offset = round_up(iter->offset, PAGE_SIZE);
+	iter->pos += nr;
+}
+
 #define genradix_for_each_from(_radix, _iter, _p, _start)	\
 	for (_iter = genradix_iter_init(_radix, _start);	\
 	     (_p = genradix_iter_peek(&_iter, _radix)) != NULL;	\
@@ -262,6 +332,23 @@ static inline void __genradix_iter_rewind(struct genradix_iter *iter,
 #define genradix_for_each(_radix, _iter, _p)			\
 	genradix_for_each_from(_radix, _iter, _p, 0)
 
+/**
+ * genradix_for_each_leaf - iterate over a genradix one leaf at a time
+ * @_radix:	genradix to iterate over
+ * @_iter:	a genradix_iter to track current position
+ * @_p:		pointer to genradix entry type; start of the current span
+ * @_nr:	size_t; number of contiguous entries at @_p
+ *
+ * Yields each allocated leaf as a contiguous array of @_nr entries, turning
+ * a per-entry tree walk into linear array sweeps; @_iter.pos is the index of
+ * the first entry in the span.
+ */
+#define genradix_for_each_leaf(_radix, _iter, _p, _nr)		\
+	for (_iter = genradix_iter_init(_radix, 0);		\
+	     (_p = genradix_iter_peek_leaf(&_iter, _radix, &(_nr))) != NULL;\
+	     __genradix_iter_advance_leaf(&_iter,		\
+			__genradix_obj_size(_radix), (_nr)))
+
 #define genradix_last_pos(_radix)				\
 	(SIZE_MAX / PAGE_SIZE * __genradix_objs_per_page(_radix) - 1)
 
@@ -5,10 +5,22 @@
 
 #define __percpu
 
-#define free_percpu(percpu)				free(percpu)
+/*
+ * Per thread percpu emulation: allocations are carved out of a reserved
+ * virtual region of identically laid out arenas, one per thread slot, so a
+ * thread's copy of any percpu object is the slot-0 pointer shifted by
+ * slot * PERCPU_ARENA_SIZE - same arrangement as the kernel's percpu area
+ * offsets. Threads claim a slot lazily on first this_cpu access and release
+ * it at exit for reuse; __percpu_nr_slots is the high water mark, so
+ * for_each_possible_cpu() summing reads cover every thread's contributions,
+ * including those of exited threads. Implemented in linux/percpu.c.
+ */
+#define PERCPU_ARENA_SIZE	(1UL << 24)
+
+void *__alloc_percpu(size_t, size_t);
+void free_percpu(void __percpu *);
 
-#define __alloc_percpu_gfp(size, align, gfp)		calloc(1, size)
-#define __alloc_percpu(size, align)			calloc(1, size)
+#define __alloc_percpu_gfp(size, align, gfp)	__alloc_percpu(size, align)
 
 #define alloc_percpu_gfp(type, gfp)					\
 	(typeof(type) __percpu *)__alloc_percpu_gfp(sizeof(type),	\
@@ -19,8 +31,9 @@
 
 #define __verify_pcpu_ptr(ptr)
 
-#define per_cpu_ptr(ptr, cpu)	(ptr)
-#define raw_cpu_ptr(ptr)	(ptr)
+#define per_cpu_ptr(ptr, cpu)						\
+	((typeof(ptr)) ((char *) (ptr) + (size_t) (cpu) * PERCPU_ARENA_SIZE))
+#define raw_cpu_ptr(ptr)	per_cpu_ptr(ptr, __percpu_slot())
 #define this_cpu_ptr(ptr)	raw_cpu_ptr(ptr)
 
 #define __pcpu_size_call_return(stem, variable)				\
@@ -163,18 +176,23 @@ do {									\
 #define __this_cpu_inc_return(pcp)	__this_cpu_add_return(pcp, 1)
 #define __this_cpu_dec_return(pcp)	__this_cpu_add_return(pcp, -1)
 
-#define this_cpu_read(pcp)		((pcp))
-#define this_cpu_write(pcp, val)	((pcp) = val)
-#define this_cpu_add(pcp, val)		((pcp) += val)
-#define this_cpu_and(pcp, val)		((pcp) &= val)
-#define this_cpu_or(pcp, val)		((pcp) |= val)
-#define this_cpu_add_return(pcp, val)	((pcp) += val)
+/*
+ * The this_cpu ops redirect to the calling thread's slot, which no other
+ * running thread writes through these ops - so plain loads and stores
+ * suffice, like the kernel's preemption-disabled versions:
+ */
+#define this_cpu_read(pcp)		(*raw_cpu_ptr(&(pcp)))
+#define this_cpu_write(pcp, val)	(*raw_cpu_ptr(&(pcp)) = (val))
+#define this_cpu_add(pcp, val)		(*raw_cpu_ptr(&(pcp)) += (val))
+#define this_cpu_and(pcp, val)		(*raw_cpu_ptr(&(pcp)) &= (val))
+#define this_cpu_or(pcp, val)		(*raw_cpu_ptr(&(pcp)) |= (val))
+#define this_cpu_add_return(pcp, val)	(*raw_cpu_ptr(&(pcp)) += (val))
+/*
+ * Atomic, because slots are recycled across threads - an exchange slot's
+ * previous owner may still be draining it:
+ */
 #define this_cpu_xchg(pcp, nval)					\
-({									\
-	typeof(pcp) _r = (pcp);						\
-	(pcp) = (nval);							\
-	_r;								\
-})
+	__atomic_exchange_n(raw_cpu_ptr(&(pcp)), nval, __ATOMIC_SEQ_CST)
 
 #define this_cpu_cmpxchg(pcp, oval, nval) \
 	__pcpu_size_call_return2(this_cpu_cmpxchg_, pcp, oval, nval)
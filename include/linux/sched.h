@@ -125,6 +125,12 @@ static inline void put_task_struct(struct task_struct *t)
 static inline void cond_resched(void) {}
 #define need_resched()	0
 
+/*
+ * Userspace can't observe whether another thread is on cpu; report the owner
+ * as running and rely on the caller's spin timeout to bound the wait.
+ */
+#define owner_on_cpu(owner)	((void) (owner), true)
+
 void schedule(void);
 
 #define	MAX_SCHEDULE_TIMEOUT	LONG_MAX
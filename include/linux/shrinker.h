@@ -23,6 +23,12 @@ struct shrinker {
 	long batch;	/* reclaim batch size, 0 = default */
 	struct list_head list;
 	void	*private_data;
+
+	/* tools runtime: */
+	char	*name;
+	unsigned long last_count;	/* count_objects(), most recent run */
+	unsigned long nr_scan_requested;
+	unsigned long nr_freed;
 };
 
 void shrinker_free(struct shrinker *);
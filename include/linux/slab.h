@@ -20,6 +20,21 @@
 #define ARCH_KMALLOC_MINALIGN		16
 #define KMALLOC_MAX_SIZE		SIZE_MAX
 
+/*
+ * Allocations at least this large (btree node buffers, mostly) are assumed
+ * shared between threads and get interleaved across NUMA nodes when libnuma
+ * is available; everything else keeps the local first-touch policy.
+ */
+#define MEM_NUMA_INTERLEAVE_MIN		(64UL << 10)
+
+#ifdef HAVE_LIBNUMA
+void mem_numa_interleave(void *, size_t);
+void mem_numa_pin_thread(unsigned idx);
+#else
+static inline void mem_numa_interleave(void *p, size_t size) {}
+static inline void mem_numa_pin_thread(unsigned idx) {}
+#endif
+
 static inline void *kmalloc_noprof(size_t size, gfp_t flags)
 {
 	unsigned i;
@@ -39,6 +54,8 @@ static inline void *kmalloc_noprof(size_t size, gfp_t flags)
 		if (p) {
 			if (flags & __GFP_ZERO)
 				memset(p, 0, size);
+			if (size >= MEM_NUMA_INTERLEAVE_MIN)
+				mem_numa_interleave(p, size);
 			break;
 		}
 
@@ -179,39 +196,33 @@ static inline void *kmemdup(const void *src, size_t len, gfp_t gfp)
 	return p;
 }
 
+/*
+ * Slab caches front kmalloc() with small per-thread magazines of recently
+ * freed objects, so hot fixed-size allocations (btree_trans, bios, bkey
+ * buffers) stop hammering the glibc allocator. See linux/slab.c.
+ */
+
+#define SLAB_MAX_CACHES		128U
+#define SLAB_MAGAZINE_SIZE	16U
+
 struct kmem_cache {
 	size_t		    obj_size;
+	unsigned	    idx;	/* per-thread magazine slot, or -1 */
 };
 
-static inline void *kmem_cache_alloc(struct kmem_cache *c, gfp_t gfp)
-{
-	return kmalloc(c->obj_size, gfp);
-}
+void *kmem_cache_alloc(struct kmem_cache *, gfp_t);
+void kmem_cache_free(struct kmem_cache *, void *);
+struct kmem_cache *kmem_cache_create(size_t obj_size);
+void kmem_cache_destroy(struct kmem_cache *);
 
 static inline void *kmem_cache_zalloc(struct kmem_cache *c, gfp_t gfp)
 {
-	return kzalloc(c->obj_size, gfp);
+	return kmem_cache_alloc(c, gfp|__GFP_ZERO);
 }
 
-static inline void kmem_cache_free(struct kmem_cache *c, void *p)
-{
-	kfree(p);
-}
-
-static inline void kmem_cache_destroy(struct kmem_cache *p)
-{
-	kfree(p);
-}
-
-static inline struct kmem_cache *kmem_cache_create(size_t obj_size)
-{
-	struct kmem_cache *p = kmalloc(sizeof(*p), GFP_KERNEL);
-	if (!p)
-		return NULL;
-
-	p->obj_size = obj_size;
-	return p;
-}
+/* Size-class frontend for callers that free with an explicit size: */
+void *slab_size_alloc(size_t size, gfp_t);
+void slab_size_free(void *, size_t size);
 
 #define KMEM_CACHE(_struct, _flags)	kmem_cache_create(sizeof(struct _struct))
 
@@ -233,6 +244,8 @@ static inline void *__vmalloc_noprof(unsigned long size, gfp_t flags)
 		if (p) {
 			if (flags & __GFP_ZERO)
 				memset(p, 0, size);
+			if (size >= MEM_NUMA_INTERLEAVE_MIN)
+				mem_numa_interleave(p, size);
 			break;
 		}
 
@@ -49,6 +49,7 @@ typedef raw_spinlock_t spinlock_t;
 
 #define spin_lock_init(lock)		raw_spin_lock_init(lock)
 #define spin_lock(lock)			raw_spin_lock(lock)
+#define spin_trylock(lock)		raw_spin_trylock(lock)
 #define spin_unlock(lock)		raw_spin_unlock(lock)
 
 #define spin_lock_nested(lock, n)	spin_lock(lock)
@@ -2,11 +2,16 @@
 #define __TOOLS_LINUX_TIMER_H
 
 #include <string.h>
+#include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/types.h>
 
 struct timer_list {
 	unsigned long		expires;
 	void			(*function)(struct timer_list *timer);
+	struct list_head	entry;		/* wheel bucket, under timer lock */
+	struct llist_node	submit;		/* lock free submission stack */
+	unsigned		state;
 	bool			pending;
 };
 
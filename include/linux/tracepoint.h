@@ -1,15 +1,29 @@
 #ifndef __TOOLS_LINUX_TRACEPOINT_H
 #define __TOOLS_LINUX_TRACEPOINT_H
 
+#include <linux/compiler.h>
+#include <linux/types.h>
+
 #define PARAMS(args...) args
 
 #define TP_PROTO(args...)	args
 #define TP_ARGS(args...)	args
 #define TP_CONDITION(args...)	args
 
+/*
+ * Userspace tracepoint backend (linux/tracepoint.c): when BCACHEFS_TRACE is
+ * set in the environment, events are recorded (by name) to per-thread ring
+ * buffers dumped at exit; event arguments are discarded:
+ */
+extern bool trace_ring_on;
+void __trace_ring_record(const char *);
+
 #define __DECLARE_TRACE(name, proto, args, cond, data_proto, data_args) \
 	static inline void trace_##name(proto)				\
-	{ }								\
+	{								\
+		if (unlikely(trace_ring_on))				\
+			__trace_ring_record(#name);			\
+	}								\
 	static inline void trace_##name##_rcuidle(proto)		\
 	{ }								\
 	static inline int						\
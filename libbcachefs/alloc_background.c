@@ -93,6 +93,13 @@ static void bch2_alloc_unpack_v1(struct bkey_alloc_unpacked *out,
 #undef  x
 }
 
+enum {
+	BCH_ALLOC_V2_NR_FIELDS = 0
+#define x(_name, _bits)	+ 1
+	BCH_ALLOC_FIELDS_V2()
+#undef  x
+};
+
 static int bch2_alloc_unpack_v2(struct bkey_alloc_unpacked *out,
 				struct bkey_s_c k)
 {
@@ -100,22 +107,19 @@ static int bch2_alloc_unpack_v2(struct bkey_alloc_unpacked *out,
 	const u8 *in = a.v->data;
 	const u8 *end = bkey_val_end(a);
 	unsigned fieldnr = 0;
-	int ret;
+	unsigned nr = min_t(unsigned, a.v->nr_fields, BCH_ALLOC_V2_NR_FIELDS);
+	u64 f[BCH_ALLOC_V2_NR_FIELDS];
 	u64 v;
 
 	out->gen	= a.v->gen;
 	out->oldest_gen	= a.v->oldest_gen;
 	out->data_type	= a.v->data_type;
 
+	if (bch2_varint_decode_batch(in, end, f, nr) < 0)
+		return -1;
+
 #define x(_name, _bits)							\
-	if (fieldnr < a.v->nr_fields) {					\
-		ret = bch2_varint_decode_fast(in, end, &v);		\
-		if (ret < 0)						\
-			return ret;					\
-		in += ret;						\
-	} else {							\
-		v = 0;							\
-	}								\
+	v = fieldnr < nr ? f[fieldnr] : 0;				\
 	out->_name = v;							\
 	if (v != out->_name)						\
 		return -1;						\
@@ -133,7 +137,8 @@ static int bch2_alloc_unpack_v3(struct bkey_alloc_unpacked *out,
 	const u8 *in = a.v->data;
 	const u8 *end = bkey_val_end(a);
 	unsigned fieldnr = 0;
-	int ret;
+	unsigned nr = min_t(unsigned, a.v->nr_fields, BCH_ALLOC_V2_NR_FIELDS);
+	u64 f[BCH_ALLOC_V2_NR_FIELDS];
 	u64 v;
 
 	out->gen	= a.v->gen;
@@ -143,15 +148,11 @@ static int bch2_alloc_unpack_v3(struct bkey_alloc_unpacked *out,
 	out->need_inc_gen = BCH_ALLOC_V3_NEED_INC_GEN(a.v);
 	out->journal_seq = le64_to_cpu(a.v->journal_seq);
 
+	if (bch2_varint_decode_batch(in, end, f, nr) < 0)
+		return -1;
+
 #define x(_name, _bits)							\
-	if (fieldnr < a.v->nr_fields) {					\
-		ret = bch2_varint_decode_fast(in, end, &v);		\
-		if (ret < 0)						\
-			return ret;					\
-		in += ret;						\
-	} else {							\
-		v = 0;							\
-	}								\
+	v = fieldnr < nr ? f[fieldnr] : 0;				\
 	out->_name = v;							\
 	if (v != out->_name)						\
 		return -1;						\
@@ -885,18 +886,23 @@ int bch2_trigger_alloc(struct btree_trans *trans,
 		const struct bch_alloc_v4 *new_a = bch2_alloc_to_v4(new.s_c, &new_a_convert);
 
 		percpu_down_read(&c->mark_lock);
-		struct bucket *g = gc_bucket(ca, new.k->p.offset);
+		struct bucket *g = gc_bucket_maybe(ca, new.k->p.offset);
+		if (!g) {
+			percpu_up_read(&c->mark_lock);
+			return 0;
+		}
 
 		bucket_lock(g);
 
 		g->gen_valid		= 1;
 		g->gen			= new_a->gen;
 		g->data_type		= new_a->data_type;
-		g->stripe		= new_a->stripe;
 		g->stripe_redundancy	= new_a->stripe_redundancy;
 		g->dirty_sectors	= new_a->dirty_sectors;
 		g->cached_sectors	= new_a->cached_sectors;
 
+		*gc_bucket_stripe(ca, new.k->p.offset) = new_a->stripe;
+
 		bucket_unlock(g);
 		percpu_up_read(&c->mark_lock);
 	}
@@ -1924,8 +1930,12 @@ int bch2_dev_freespace_init(struct bch_fs *c, struct bch_dev *ca,
 	 */
 	while (1) {
 		if (last_updated + HZ * 10 < jiffies) {
-			bch_info(ca, "%s: currently at %llu/%llu",
-				 __func__, iter.pos.offset, ca->mi.nbuckets);
+			bch_info(ca, "%s: currently at %llu/%llu (%llu%%)",
+				 __func__, iter.pos.offset, ca->mi.nbuckets,
+				 bucket_end > bucket_start
+				 ? (iter.pos.offset - bucket_start) * 100 /
+				   (bucket_end - bucket_start)
+				 : 100);
 			last_updated = jiffies;
 		}
 
@@ -1943,19 +1953,37 @@ int bch2_dev_freespace_init(struct bch_fs *c, struct bch_dev *ca,
 
 		if (k.k->type) {
 			/*
-			 * We process live keys in the alloc btree one at a
-			 * time:
+			 * Live keys in the alloc btree get their index updates
+			 * batched, many to a commit - a commit per bucket is
+			 * what made initializing a large device take minutes:
 			 */
-			struct bch_alloc_v4 a_convert;
-			const struct bch_alloc_v4 *a = bch2_alloc_to_v4(k, &a_convert);
+			struct bpos batch_start = iter.pos;
+			unsigned nr = 0;
 
-			ret =   bch2_bucket_do_index(trans, k, a, true) ?:
-				bch2_trans_commit(trans, NULL, NULL,
-						  BCH_TRANS_COMMIT_no_enospc);
-			if (ret)
-				goto bkey_err;
+			while (k.k->type) {
+				struct bch_alloc_v4 a_convert;
+				const struct bch_alloc_v4 *a = bch2_alloc_to_v4(k, &a_convert);
+
+				ret = bch2_bucket_do_index(trans, k, a, true);
+				if (ret)
+					break;
+
+				bch2_btree_iter_advance(&iter);
+				if (++nr >= 16 || bkey_ge(iter.pos, end))
+					break;
 
-			bch2_btree_iter_advance(&iter);
+				k = bch2_get_key_or_hole(&iter, end, &hole);
+				ret = bkey_err(k);
+				if (ret)
+					break;
+			}
+
+			ret = ret ?: bch2_trans_commit(trans, NULL, NULL,
+						       BCH_TRANS_COMMIT_no_enospc);
+			if (ret) {
+				bch2_btree_iter_set_pos(&iter, batch_start);
+				goto bkey_err;
+			}
 		} else {
 			struct bkey_i *freespace;
 
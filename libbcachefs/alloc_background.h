@@ -115,6 +115,22 @@ static inline u64 alloc_lru_idx_fragmentation(struct bch_alloc_v4 a,
 	return div_u64(d * (1ULL << 31), ca->mi.bucket_size);
 }
 
+/*
+ * Which ca->frag_hist bin a bucket belongs in, or -1 if it isn't a copygc
+ * candidate; bins match the fragmentation LRU index scale, i.e.
+ * lru idx * BCH_FRAG_HIST_BINS >> 31 lands in the same bin:
+ */
+static inline int alloc_frag_hist_bin(struct bch_dev *ca, struct bch_alloc_v4 a)
+{
+	if (!data_type_movable(a.data_type) ||
+	    !bch2_bucket_sectors_fragmented(ca, a))
+		return -1;
+
+	return min_t(u64, BCH_FRAG_HIST_BINS - 1,
+		     div_u64(bch2_bucket_sectors_dirty(a) * BCH_FRAG_HIST_BINS,
+			     ca->mi.bucket_size));
+}
+
 static inline u64 alloc_freespace_genbits(struct bch_alloc_v4 a)
 {
 	return ((u64) alloc_gc_gen(a) >> 4) << 56;
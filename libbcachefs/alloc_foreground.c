@@ -75,6 +75,35 @@ void bch2_reset_alloc_cursors(struct bch_fs *c)
 	rcu_read_unlock();
 }
 
+static void open_bucket_freelist_push(struct bch_fs *c, struct open_bucket *ob)
+{
+	struct open_bucket_freelist *f = &c->open_buckets_free[ob->class];
+
+	spin_lock(&f->lock);
+	ob->freelist	= f->freelist;
+	f->freelist	= ob - c->open_buckets;
+	f->nr_free++;
+	spin_unlock(&f->lock);
+}
+
+/* Must be called with f->lock held; drops it: */
+static struct open_bucket *open_bucket_freelist_pop(struct bch_fs *c,
+						    struct open_bucket_freelist *f)
+{
+	struct open_bucket *ob;
+
+	BUG_ON(!f->freelist || !f->nr_free);
+
+	ob = c->open_buckets + f->freelist;
+	f->freelist = ob->freelist;
+	f->nr_free--;
+	spin_unlock(&f->lock);
+
+	atomic_set(&ob->pin, 1);
+	ob->data_type = 0;
+	return ob;
+}
+
 static void bch2_open_bucket_hash_add(struct bch_fs *c, struct open_bucket *ob)
 {
 	open_bucket_idx_t idx = ob - c->open_buckets;
@@ -118,14 +147,11 @@ void __bch2_open_bucket_put(struct bch_fs *c, struct open_bucket *ob)
 
 	spin_lock(&c->freelist_lock);
 	bch2_open_bucket_hash_remove(c, ob);
-
-	ob->freelist = c->open_buckets_freelist;
-	c->open_buckets_freelist = ob - c->open_buckets;
-
-	c->open_buckets_nr_free++;
 	ca->nr_open_buckets--;
 	spin_unlock(&c->freelist_lock);
 
+	open_bucket_freelist_push(c, ob);
+
 	closure_wake_up(&c->open_buckets_wait);
 }
 
@@ -141,21 +167,6 @@ void bch2_open_bucket_write_error(struct bch_fs *c,
 			bch2_ec_bucket_cancel(c, ob);
 }
 
-static struct open_bucket *bch2_open_bucket_alloc(struct bch_fs *c)
-{
-	struct open_bucket *ob;
-
-	BUG_ON(!c->open_buckets_freelist || !c->open_buckets_nr_free);
-
-	ob = c->open_buckets + c->open_buckets_freelist;
-	c->open_buckets_freelist = ob->freelist;
-	atomic_set(&ob->pin, 1);
-	ob->data_type = 0;
-
-	c->open_buckets_nr_free--;
-	return ob;
-}
-
 static void open_bucket_free_unused(struct bch_fs *c, struct open_bucket *ob)
 {
 	BUG_ON(c->open_buckets_partial_nr >=
@@ -185,21 +196,66 @@ long bch2_bucket_alloc_new_fs(struct bch_dev *ca)
 	return -1;
 }
 
-static inline unsigned open_buckets_reserved(enum bch_watermark watermark)
+static inline enum open_bucket_class open_bucket_class(enum bch_watermark watermark)
 {
 	switch (watermark) {
-	case BCH_WATERMARK_reclaim:
-		return 0;
 	case BCH_WATERMARK_btree:
 	case BCH_WATERMARK_btree_copygc:
-		return OPEN_BUCKETS_COUNT / 4;
+	case BCH_WATERMARK_reclaim:
+		return OPEN_BUCKET_CLASS_btree;
 	case BCH_WATERMARK_copygc:
-		return OPEN_BUCKETS_COUNT / 3;
+		return OPEN_BUCKET_CLASS_copygc;
 	default:
-		return OPEN_BUCKETS_COUNT / 2;
+		return OPEN_BUCKET_CLASS_user;
 	}
 }
 
+/*
+ * Most of the old watermark reserves are now structural - a class can empty
+ * its own partition and steal from lower classes, but never dig into a higher
+ * class's partition. What remains is a small reserve within the btree class's
+ * partition, so journal reclaim can still make forward progress when btree
+ * node writes have taken everything else:
+ */
+static inline unsigned open_buckets_reserved(enum bch_watermark watermark)
+{
+	switch (watermark) {
+	case BCH_WATERMARK_btree:
+	case BCH_WATERMARK_btree_copygc:
+		return OPEN_BUCKETS_COUNT / 16;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Grab a free open bucket slot from @watermark's class partition, stealing
+ * from a lower class if it's empty; returns with the slot's freelist lock
+ * held, or NULL if every partition we're allowed to touch is empty:
+ */
+static struct open_bucket_freelist *open_bucket_freelist_get(struct bch_fs *c,
+					enum bch_watermark watermark)
+{
+	int class = open_bucket_class(watermark);
+	struct open_bucket_freelist *f = &c->open_buckets_free[class];
+
+	spin_lock(&f->lock);
+	if (likely(f->nr_free > open_buckets_reserved(watermark)))
+		return f;
+	spin_unlock(&f->lock);
+
+	while (--class >= 0) {
+		f = &c->open_buckets_free[class];
+
+		spin_lock(&f->lock);
+		if (f->nr_free)
+			return f;
+		spin_unlock(&f->lock);
+	}
+
+	return NULL;
+}
+
 static struct open_bucket *__try_alloc_bucket(struct bch_fs *c, struct bch_dev *ca,
 					      u64 bucket,
 					      enum bch_watermark watermark,
@@ -230,27 +286,29 @@ static struct open_bucket *__try_alloc_bucket(struct bch_fs *c, struct bch_dev *
 		return NULL;
 	}
 
-	spin_lock(&c->freelist_lock);
+	struct open_bucket_freelist *f = open_bucket_freelist_get(c, watermark);
 
-	if (unlikely(c->open_buckets_nr_free <= open_buckets_reserved(watermark))) {
+	if (unlikely(!f)) {
 		if (cl)
 			closure_wait(&c->open_buckets_wait, cl);
 
 		track_event_change(&c->times[BCH_TIME_blocked_allocate_open_bucket],
 				   &c->blocked_allocate_open_bucket, true);
-		spin_unlock(&c->freelist_lock);
 		return ERR_PTR(-BCH_ERR_open_buckets_empty);
 	}
 
+	ob = open_bucket_freelist_pop(c, f);
+
+	spin_lock(&c->freelist_lock);
+
 	/* Recheck under lock: */
 	if (bch2_bucket_is_open(c, ca->dev_idx, bucket)) {
 		spin_unlock(&c->freelist_lock);
 		s->skipped_open++;
+		open_bucket_freelist_push(c, ob);
 		return NULL;
 	}
 
-	ob = bch2_open_bucket_alloc(c);
-
 	spin_lock(&ob->lock);
 
 	ob->valid	= true;
@@ -456,6 +514,79 @@ next:
 	return ob;
 }
 
+static bool dev_alloc_cache_pop(struct bch_dev *ca, u64 *free_entry)
+{
+	bool ret = false;
+
+	spin_lock(&ca->alloc_cache_lock);
+	if (ca->alloc_cache_nr) {
+		*free_entry = ca->alloc_cache[--ca->alloc_cache_nr];
+		ret = true;
+	}
+	spin_unlock(&ca->alloc_cache_lock);
+	return ret;
+}
+
+static bool dev_alloc_cache_push(struct bch_dev *ca, u64 free_entry)
+{
+	bool ret = false;
+
+	spin_lock(&ca->alloc_cache_lock);
+	if (ca->alloc_cache_nr < ARRAY_SIZE(ca->alloc_cache)) {
+		ca->alloc_cache[ca->alloc_cache_nr++] = free_entry;
+		ret = true;
+	}
+	spin_unlock(&ca->alloc_cache_lock);
+	return ret;
+}
+
+/*
+ * Try a candidate banked by a previous freespace scan: candidates aren't
+ * reserved, so revalidate against the alloc btree and silently drop entries
+ * that were taken or reused since they were cached - unlike the scan path,
+ * a mismatch here isn't evidence of an inconsistency.
+ */
+static struct open_bucket *try_alloc_cached_bucket(struct btree_trans *trans,
+						   struct bch_dev *ca,
+						   enum bch_watermark watermark,
+						   u64 free_entry,
+						   struct bucket_alloc_state *s,
+						   struct closure *cl)
+{
+	struct btree_iter iter = { NULL };
+	struct bch_alloc_v4 a_convert;
+	const struct bch_alloc_v4 *a;
+	struct open_bucket *ob = NULL;
+	u64 b = free_entry & ~(~0ULL << 56);
+	unsigned genbits = free_entry >> 56;
+
+	if (b < ca->mi.first_bucket || b >= ca->mi.nbuckets)
+		return NULL;
+
+	struct bkey_s_c k = bch2_bkey_get_iter(trans, &iter,
+			       BTREE_ID_alloc, POS(ca->dev_idx, b),
+			       BTREE_ITER_CACHED);
+	int ret = bkey_err(k);
+	if (ret) {
+		ob = ERR_PTR(ret);
+		goto err;
+	}
+
+	a = bch2_alloc_to_v4(k, &a_convert);
+
+	if (a->data_type == BCH_DATA_free &&
+	    genbits == (alloc_freespace_genbits(*a) >> 56)) {
+		s->buckets_seen++;
+		ob = __try_alloc_bucket(trans->c, ca, b, watermark, a, s, cl);
+	}
+
+	if (!ob)
+		set_btree_iter_dontneed(&iter);
+err:
+	bch2_trans_iter_exit(trans, &iter);
+	return ob;
+}
+
 static struct open_bucket *bch2_bucket_alloc_freelist(struct btree_trans *trans,
 						   struct bch_dev *ca,
 						   enum bch_watermark watermark,
@@ -467,9 +598,23 @@ static struct open_bucket *bch2_bucket_alloc_freelist(struct btree_trans *trans,
 	struct open_bucket *ob = NULL;
 	u64 alloc_start = max_t(u64, ca->mi.first_bucket, READ_ONCE(ca->alloc_cursor));
 	u64 alloc_cursor = alloc_start;
+	u64 free_entry;
+	/*
+	 * Until the backpointers check has run, try_alloc_bucket() needs a
+	 * per-bucket backpointer lookup that the cached path skips:
+	 */
+	bool may_cache = trans->c->curr_recovery_pass >
+		BCH_RECOVERY_PASS_check_extents_to_backpointers;
 	int ret;
 
 	BUG_ON(ca->new_fs_bucket_idx);
+
+	while (may_cache && dev_alloc_cache_pop(ca, &free_entry)) {
+		ob = try_alloc_cached_bucket(trans, ca, watermark,
+					     free_entry, s, cl);
+		if (ob)
+			return ob;
+	}
 again:
 	for_each_btree_key_norestart(trans, iter, BTREE_ID_freespace,
 				     POS(ca->dev_idx, alloc_cursor), 0, k, ret) {
@@ -490,6 +635,18 @@ again:
 			ob = try_alloc_bucket(trans, ca, watermark,
 					      alloc_cursor, s, k, cl);
 			if (ob) {
+				/*
+				 * Bank the rest of this freespace extent for
+				 * subsequent allocations, saving them the
+				 * btree walk to get back here:
+				 */
+				if (!IS_ERR(ob) && may_cache)
+					for (u64 b = alloc_cursor + 1;
+					     b < k.k->p.offset;
+					     b++)
+						if (!dev_alloc_cache_push(ca, b))
+							break;
+
 				set_btree_iter_dontneed(&iter);
 				break;
 			}
@@ -1492,16 +1649,31 @@ void bch2_fs_allocator_foreground_init(struct bch_fs *c)
 	mutex_init(&c->write_points_hash_lock);
 	c->write_points_nr = ARRAY_SIZE(c->write_points);
 
+	for (unsigned i = 0; i < OPEN_BUCKET_CLASS_NR; i++)
+		spin_lock_init(&c->open_buckets_free[i].lock);
+
 	/* open bucket 0 is a sentinal NULL: */
 	spin_lock_init(&c->open_buckets[0].lock);
 
+	/*
+	 * Half the table for user writes, the rest split between copygc and
+	 * btree/journal - roughly the old watermark reserves:
+	 */
 	for (ob = c->open_buckets + 1;
 	     ob < c->open_buckets + ARRAY_SIZE(c->open_buckets); ob++) {
-		spin_lock_init(&ob->lock);
-		c->open_buckets_nr_free++;
+		unsigned idx = ob - c->open_buckets;
+		struct open_bucket_freelist *f =
+			&c->open_buckets_free[idx <  OPEN_BUCKETS_COUNT / 2
+					      ? OPEN_BUCKET_CLASS_user
+					      : idx < OPEN_BUCKETS_COUNT * 3 / 4
+					      ? OPEN_BUCKET_CLASS_copygc
+					      : OPEN_BUCKET_CLASS_btree];
 
-		ob->freelist = c->open_buckets_freelist;
-		c->open_buckets_freelist = ob - c->open_buckets;
+		spin_lock_init(&ob->lock);
+		ob->class	= f - c->open_buckets_free;
+		ob->freelist	= f->freelist;
+		f->freelist	= idx;
+		f->nr_free++;
 	}
 
 	writepoint_init(&c->btree_write_point,		BCH_DATA_btree);
@@ -135,6 +135,16 @@ static inline bool bch2_bucket_is_open(struct bch_fs *c, unsigned dev, u64 bucke
 	return false;
 }
 
+static inline unsigned bch2_open_buckets_nr_free(struct bch_fs *c)
+{
+	unsigned i, ret = 0;
+
+	for (i = 0; i < OPEN_BUCKET_CLASS_NR; i++)
+		ret += c->open_buckets_free[i].nr_free;
+
+	return ret;
+}
+
 static inline bool bch2_bucket_is_open_safe(struct bch_fs *c, unsigned dev, u64 bucket)
 {
 	bool ret;
@@ -44,6 +44,31 @@ enum bch_watermark {
  */
 typedef u16			open_bucket_idx_t;
 
+/*
+ * Free open bucket slots are partitioned into per write class freelists, each
+ * with its own lock, so foreground writes, copygc and btree node writes don't
+ * all serialize on a single freelist lock. Higher classes steal from lower
+ * classes' partitions when their own runs dry, which preserves the old
+ * watermark behaviour of reserving part of the table for internal writes:
+ */
+#define BCH_OPEN_BUCKET_CLASSES()	\
+	x(user)				\
+	x(copygc)			\
+	x(btree)
+
+enum open_bucket_class {
+#define x(n)	OPEN_BUCKET_CLASS_##n,
+	BCH_OPEN_BUCKET_CLASSES()
+#undef x
+	OPEN_BUCKET_CLASS_NR
+};
+
+struct open_bucket_freelist {
+	spinlock_t		lock;
+	open_bucket_idx_t	freelist;
+	open_bucket_idx_t	nr_free;
+} ____cacheline_aligned_in_smp;
+
 struct open_bucket {
 	spinlock_t		lock;
 	atomic_t		pin;
@@ -58,6 +83,8 @@ struct open_bucket {
 	enum bch_data_type	data_type:6;
 	unsigned		valid:1;
 	unsigned		on_partial_list:1;
+	/* freelist partition this slot came from and returns to: */
+	unsigned		class:2;
 
 	u8			dev;
 	u8			gen;
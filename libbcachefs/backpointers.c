@@ -11,6 +11,8 @@
 #include "error.h"
 
 #include <linux/mm.h>
+#include <linux/random.h>
+#include <linux/siphash.h>
 
 static bool extent_matches_bp(struct bch_fs *c,
 			      enum btree_id btree_id, unsigned level,
@@ -407,9 +409,133 @@ static inline bool bkey_and_val_eq(struct bkey_s_c l, struct bkey_s_c r)
 		!memcmp(l.v, r.v, bkey_val_bytes(l.k));
 }
 
+/*
+ * In the common case every backpointer we look for exists, and looking each
+ * one up from the extents walk is pure random access into the backpointers
+ * btree - the alloc-info windowing below only bounds the working set, it
+ * doesn't make the I/O sequential.
+ *
+ * Instead, when memory allows, we populate a bloom filter with one sequential
+ * scan of the backpointers btree (physical order per device, since it's keyed
+ * by bucket), and the extents walk only touches the btree on a filter miss -
+ * i.e. for backpointers that are genuinely missing or stale. A false positive
+ * means a missing backpointer goes unrepaired until the next fsck; the hash
+ * key is freshly seeded each run, so repeated runs converge.
+ */
+
+struct bp_bloom {
+	siphash_key_t	key;
+	unsigned long	*d;
+	unsigned	bits;		/* log2 of table size, in bits */
+	size_t		bytes;
+};
+
+/* 16 bits and two probes per entry: ~1.5% false positive rate */
+#define BP_BLOOM_BITS_PER_ENTRY		16
+#define BP_BLOOM_MIN_ORDER		20
+#define BP_BLOOM_MAX_ORDER		32
+
+static u64 bp_bloom_hash(struct bp_bloom *f, struct bpos bp_pos,
+			 struct bch_backpointer bp)
+{
+	return siphash(&bp, sizeof(bp), &f->key) ^
+		siphash_3u64(bp_pos.inode, bp_pos.offset, bp_pos.snapshot,
+			     &f->key);
+}
+
+static void bp_bloom_add(struct bp_bloom *f, u64 h)
+{
+	u64 mask = (1ULL << f->bits) - 1;
+
+	__set_bit(h & mask, f->d);
+	__set_bit((h >> 32) & mask, f->d);
+}
+
+static bool bp_bloom_test(struct bp_bloom *f, struct bpos bp_pos,
+			  struct bch_backpointer bp)
+{
+	u64 h = bp_bloom_hash(f, bp_pos, bp);
+	u64 mask = (1ULL << f->bits) - 1;
+
+	return test_bit(h & mask, f->d) &&
+	       test_bit((h >> 32) & mask, f->d);
+}
+
+static void bp_bloom_exit(struct bp_bloom *f)
+{
+	kvpfree(f->d, f->bytes);
+	f->d = NULL;
+}
+
+static int bch2_bp_bloom_init(struct btree_trans *trans, struct bp_bloom *f)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter node_iter;
+	struct btree *b;
+	struct sysinfo i;
+	u64 nr_est = 0;
+	int ret = 0;
+
+	/*
+	 * Size the filter by counting leaf nodes from one level up, assuming
+	 * worst case densely packed keys:
+	 */
+	__for_each_btree_node(trans, node_iter, BTREE_ID_backpointers, POS_MIN,
+			      0, 1, BTREE_ITER_PREFETCH, b, ret) {
+		if (!b->c.level) {
+			nr_est = 1;
+			break;
+		}
+
+		nr_est += b->nr.packed_keys + b->nr.unpacked_keys;
+	}
+	bch2_trans_iter_exit(trans, &node_iter);
+	if (ret)
+		return ret;
+
+	nr_est = max_t(u64, nr_est * ((btree_sectors(c) << 9) / 32), 1);
+
+	f->bits	 = clamp_t(unsigned, ilog2(nr_est * BP_BLOOM_BITS_PER_ENTRY) + 1,
+			   BP_BLOOM_MIN_ORDER, BP_BLOOM_MAX_ORDER);
+	f->bytes = 1UL << (f->bits - 3);
+
+	si_meminfo(&i);
+	if (f->bytes > div_u64(i.totalram * i.mem_unit, 8))
+		return 0;	/* fall back to per pointer lookups */
+
+	f->d = kvpmalloc(f->bytes, GFP_KERNEL);
+	if (!f->d)
+		return 0;
+	memset(f->d, 0, f->bytes);
+
+	get_random_bytes(&f->key, sizeof(f->key));
+
+	/*
+	 * The filter has to see every backpointer, including those still
+	 * sitting in the write buffer:
+	 */
+	ret = bch2_btree_write_buffer_flush_sync(trans) ?:
+		for_each_btree_key(trans, iter, BTREE_ID_backpointers, POS_MIN,
+				   BTREE_ITER_PREFETCH, k, ({
+			if (k.k->type == KEY_TYPE_backpointer)
+				bp_bloom_add(f, bp_bloom_hash(f, k.k->p,
+						*bkey_s_c_to_backpointer(k).v));
+			0;
+		}));
+	if (ret) {
+		bp_bloom_exit(f);
+		return ret;
+	}
+
+	bch_verbose(c, "%s(): using %zu MiB backpointer filter",
+		    __func__, f->bytes >> 20);
+	return 0;
+}
+
 struct extents_to_bp_state {
 	struct bpos	bucket_start;
 	struct bpos	bucket_end;
+	struct bp_bloom	bloom;
 	struct bkey_buf last_flushed;
 };
 
@@ -435,6 +561,11 @@ static int check_bp_exists(struct btree_trans *trans,
 	if (!bch2_dev_bucket_exists(c, bucket))
 		goto missing;
 
+	if (s->bloom.d &&
+	    bp_bloom_test(&s->bloom,
+			  bucket_pos_to_bp(c, bucket, bp.bucket_offset), bp))
+		return 0;
+
 	bp_k = bch2_bkey_get_iter(trans, &bp_iter, BTREE_ID_backpointers,
 				  bucket_pos_to_bp(c, bucket, bp.bucket_offset),
 				  0);
@@ -729,10 +860,22 @@ int bch2_check_extents_to_backpointers(struct bch_fs *c)
 	bch2_bkey_buf_init(&s.last_flushed);
 	bkey_init(&s.last_flushed.k->k);
 
+	ret = bch2_bp_bloom_init(trans, &s.bloom);
+	if (ret)
+		goto err;
+
 	while (1) {
-		ret = bch2_get_alloc_in_memory_pos(trans, s.bucket_start, &s.bucket_end);
-		if (ret)
-			break;
+		if (s.bloom.d) {
+			/*
+			 * With the filter, lookups into the backpointers btree
+			 * are rare - no need to run in windows:
+			 */
+			s.bucket_end = SPOS_MAX;
+		} else {
+			ret = bch2_get_alloc_in_memory_pos(trans, s.bucket_start, &s.bucket_end);
+			if (ret)
+				break;
+		}
 
 		if ( bpos_eq(s.bucket_start, POS_MIN) &&
 		    !bpos_eq(s.bucket_end, SPOS_MAX))
@@ -758,7 +901,9 @@ int bch2_check_extents_to_backpointers(struct bch_fs *c)
 
 		s.bucket_start = bpos_successor(s.bucket_end);
 	}
+err:
 	bch2_trans_put(trans);
+	bp_bloom_exit(&s.bloom);
 	bch2_bkey_buf_exit(&s.last_flushed, c);
 
 	bch_err_fn(c, ret);
@@ -435,6 +435,8 @@ BCH_DEBUG_PARAMS_DEBUG()
 	x(journal_flush_write)			\
 	x(journal_noflush_write)		\
 	x(journal_flush_seq)			\
+	x(journal_key_insert)			\
+	x(journal_reclaim_flush)		\
 	x(blocked_journal_low_on_space)		\
 	x(blocked_journal_low_on_pin)		\
 	x(blocked_journal_max_in_flight)	\
@@ -577,6 +579,14 @@ struct bch_dev {
 	u64			new_fs_bucket_idx;
 	u64			alloc_cursor;
 
+	/*
+	 * Candidate buckets banked by the last freespace scan, so one scan can
+	 * feed many allocations; not reserved - revalidated when used:
+	 */
+	spinlock_t		alloc_cache_lock;
+	u64			alloc_cache[16];
+	unsigned		alloc_cache_nr;
+
 	unsigned		nr_open_buckets;
 	unsigned		nr_btree_reserve;
 
@@ -586,6 +596,14 @@ struct bch_dev {
 
 	atomic64_t		rebalance_work;
 
+	/*
+	 * Movable fragmented buckets by occupied-sector range, seeded by
+	 * copygc from the fragmentation LRU and then maintained from bucket
+	 * accounting; heuristic only - readers must tolerate transient drift:
+	 */
+#define BCH_FRAG_HIST_BINS	16
+	atomic64_t		frag_hist[BCH_FRAG_HIST_BINS];
+
 	struct journal_device	journal;
 	u64			prev_journal_sector;
 
@@ -639,6 +657,21 @@ struct btree_debug {
 
 #define BCH_TRANSACTIONS_NR 128
 
+/*
+ * Transaction restart accounting: a small lockless table per transaction
+ * context of restart reason x source ip, since the trace events these
+ * correspond to aren't always available and restart storms are otherwise
+ * invisible. Slots are claimed with cmpxchg on ->ip; each restart site
+ * passes a fixed errcode, so ip -> err is stable once claimed:
+ */
+#define BCH_TRANS_RESTART_COUNTS_NR	16
+
+struct trans_restart_count {
+	unsigned long		ip;
+	unsigned		err;
+	atomic64_t		count;
+};
+
 struct btree_transaction_stats {
 	struct bch2_time_stats	duration;
 	struct bch2_time_stats	lock_hold_times;
@@ -647,6 +680,7 @@ struct btree_transaction_stats {
 	unsigned		journal_entries_size;
 	unsigned		max_mem;
 	char			*max_paths_text;
+	struct trans_restart_count restarts[BCH_TRANS_RESTART_COUNTS_NR];
 };
 
 struct bch_fs_pcpu {
@@ -655,6 +689,8 @@ struct bch_fs_pcpu {
 
 struct journal_seq_blacklist_table {
 	size_t			nr;
+	u64			min_seq;
+	u64			max_seq;
 	struct journal_seq_blacklist_table_entry {
 		u64		start;
 		u64		end;
@@ -682,6 +718,10 @@ struct journal_keys {
 	size_t			size;
 	atomic_t		ref;
 	bool			initial_ref_held;
+
+	/* updated racily from concurrent lookups - approximate: */
+	u64			nr_searches;
+	u64			nr_inserts;
 };
 
 struct btree_trans_buf {
@@ -756,6 +796,12 @@ struct bch_fs {
 	struct bch_dev __rcu	*devs[BCH_SB_MEMBERS_MAX];
 
 	struct bch_replicas_cpu replicas;
+	/*
+	 * Hash index over @replicas, open addressed, values are eytzinger
+	 * position + 1 (0 = empty); rebuilt with the table under mark_lock:
+	 */
+	u32			*replicas_idx_hash;
+	unsigned		replicas_idx_hash_bits;
 	struct bch_replicas_cpu replicas_gc;
 	struct mutex		replicas_gc_lock;
 	mempool_t		replicas_delta_pool;
@@ -794,6 +840,12 @@ struct bch_fs {
 
 
 	struct bch_sb_handle	disk_sb;
+	/*
+	 * csum of superblock contents as of the last successful write, so that
+	 * bch2_write_super() calls that didn't change any fields can skip
+	 * rewriting every superblock copy:
+	 */
+	struct bch_csum		disk_sb_csum;
 
 	unsigned short		block_bits;	/* ilog2(block_size) */
 
@@ -804,22 +856,33 @@ struct bch_fs {
 
 	/* snapshot.c: */
 	struct snapshot_table __rcu *snapshots;
+	struct snapshot_euler_table __rcu *snapshot_euler;
 	size_t			snapshot_table_size;
 	struct mutex		snapshot_table_lock;
 	struct rw_semaphore	snapshot_create_lock;
 
 	struct work_struct	snapshot_delete_work;
+	/* keys swept per second; UINT_MAX = unlimited: */
+	struct bch_ratelimit	snapshot_delete_rate;
 	struct work_struct	snapshot_wait_for_pagecache_and_delete_work;
 	snapshot_id_list	snapshots_unlinked;
 	struct mutex		snapshots_unlinked_lock;
 
+	/* logged_ops.c: pool of recycled logged op btree positions */
+	spinlock_t		logged_ops_pool_lock;
+	unsigned		logged_ops_pool_nr;
+	struct bpos		logged_ops_pool[16];
+
 	/* BTREE CACHE */
 	struct bio_set		btree_bio;
 	struct workqueue_struct	*io_complete_wq;
+	struct workqueue_struct	*btree_read_complete_wq;
 
 	struct btree_root	btree_roots_known[BTREE_ID_NR];
 	DARRAY(struct btree_root) btree_roots_extra;
 	struct mutex		btree_root_lock;
+	/* serializes on demand root reads in lazy_open mode: */
+	struct mutex		btree_root_read_lock;
 
 	struct btree_cache	btree_cache;
 
@@ -841,7 +904,6 @@ struct bch_fs {
 	struct closure_waitlist	btree_interior_update_wait;
 
 	struct workqueue_struct	*btree_interior_update_worker;
-	struct work_struct	btree_interior_update_work;
 
 	struct list_head	pending_node_rewrites;
 	struct mutex		pending_node_rewrites_lock;
@@ -853,6 +915,14 @@ struct bch_fs {
 		atomic64_t	bytes;
 	}			btree_write_stats[BTREE_WRITE_TYPE_NR];
 
+	/* btree_trans_commit.c: journal bandwidth shaping */
+	struct btree_commit_shaper {
+		atomic64_t	bytes[BTREE_ID_NR];
+		atomic64_t	total;
+		unsigned long	window_start;
+		spinlock_t	lock;	/* window rollover */
+	}			btree_commit_shaper;
+
 	/* btree_iter.c: */
 	struct seqmutex		btree_trans_lock;
 	struct list_head	btree_trans_list;
@@ -872,6 +942,7 @@ struct bch_fs {
 	struct workqueue_struct	*btree_io_complete_wq;
 	/* copygc needs its own workqueue for index updates.. */
 	struct workqueue_struct	*copygc_wq;
+	struct workqueue_struct	*move_write_wq;
 	/*
 	 * Use a dedicated wq for write ref holder tasks. Required to avoid
 	 * dependency problems with other wq tasks that can block on ref
@@ -902,6 +973,12 @@ struct bch_fs {
 	seqcount_t			usage_lock;
 	struct bch_fs_usage		*usage_base;
 	struct bch_fs_usage __percpu	*usage[JOURNAL_BUF_NR];
+	/*
+	 * Replicas entries that may have deltas accumulated in the
+	 * corresponding usage[] buffer, so reads and acc_to_base() only fold
+	 * the entries that changed instead of the whole table:
+	 */
+	unsigned long			*usage_dirty[JOURNAL_BUF_NR];
 	struct bch_fs_usage __percpu	*usage_gc;
 	u64 __percpu		*online_reserved;
 
@@ -922,8 +999,7 @@ struct bch_fs {
 	u64			blocked_allocate;
 	u64			blocked_allocate_open_bucket;
 
-	open_bucket_idx_t	open_buckets_freelist;
-	open_bucket_idx_t	open_buckets_nr_free;
+	struct open_bucket_freelist open_buckets_free[OPEN_BUCKET_CLASS_NR];
 	struct closure_waitlist	open_buckets_wait;
 	struct open_bucket	open_buckets[OPEN_BUCKETS_COUNT];
 	open_bucket_idx_t	open_buckets_hash[OPEN_BUCKETS_COUNT];
@@ -951,6 +1027,12 @@ struct bch_fs {
 	enum btree_id		gc_gens_btree;
 	struct bpos		gc_gens_pos;
 
+	/*
+	 * Bounded-memory gc: when marking in windowed passes, set on every
+	 * pass but the first, where only per-bucket state should be updated:
+	 */
+	bool			gc_bucket_only;
+
 	/*
 	 * Tracks GC's progress - everything in the range [ZERO_KEY..gc_cur_pos]
 	 * has been marked by GC.
@@ -993,6 +1075,7 @@ struct bch_fs {
 	atomic64_t		key_version;
 
 	mempool_t		large_bkey_pool;
+	struct bkey_i * __percpu *large_bkey_cache;
 
 	/* MOVE.C */
 	struct list_head	moving_context_list;
@@ -1007,6 +1090,7 @@ struct bch_fs {
 	s64			copygc_wait_at;
 	s64			copygc_wait;
 	bool			copygc_running;
+	bool			copygc_frag_hist_seeded;
 	wait_queue_head_t	copygc_running_wq;
 
 	/* STRIPES: */
@@ -1030,6 +1114,11 @@ struct bch_fs {
 	struct work_struct	ec_stripe_create_work;
 	u64			ec_stripe_hint;
 
+	/* reconstruct read stripe cache: */
+	struct list_head	ec_stripe_cache;
+	struct mutex		ec_stripe_cache_lock;
+	unsigned		ec_stripe_cache_nr;
+
 	struct work_struct	ec_stripe_delete_work;
 
 	struct bio_set		ec_bioset;
@@ -1108,6 +1197,9 @@ struct bch_fs {
 
 	struct btree_transaction_stats btree_transaction_stats[BCH_TRANSACTIONS_NR];
 
+	/* six lock slowpath hits, by btree: */
+	atomic_long_t		btree_lock_contended[BTREE_ID_NR];
+
 	/* ERRORS */
 	struct list_head	fsck_error_msgs;
 	struct mutex		fsck_error_msgs_lock;
@@ -287,7 +287,50 @@ struct bkey __bch2_bkey_unpack_key(const struct bkey_format *format,
 	return out;
 }
 
+/*
+ * Specialized for formats where size and both version fields are zero width -
+ * they then unpack to their field offset, no bit stream work needed:
+ */
+struct bkey __bch2_bkey_unpack_key_no_size_version(const struct bkey_format *format,
+						   const struct bkey_packed *in)
+{
+	struct unpack_state state = unpack_state_init(format, in);
+	struct bkey out;
+
+	EBUG_ON(format->nr_fields != BKEY_NR_FIELDS);
+	EBUG_ON(format->bits_per_field[BKEY_FIELD_SIZE] ||
+		format->bits_per_field[BKEY_FIELD_VERSION_HI] ||
+		format->bits_per_field[BKEY_FIELD_VERSION_LO]);
+	EBUG_ON(in->u64s < format->key_u64s);
+	EBUG_ON(in->format != KEY_FORMAT_LOCAL_BTREE);
+	EBUG_ON(in->u64s - format->key_u64s + BKEY_U64s > U8_MAX);
+
+	out.u64s	= BKEY_U64s + in->u64s - format->key_u64s;
+	out.format	= KEY_FORMAT_CURRENT;
+	out.needs_whiteout = in->needs_whiteout;
+	out.type	= in->type;
+	out.pad[0]	= 0;
+
+	out.p.inode	= get_inc_field(&state, BKEY_FIELD_INODE);
+	out.p.offset	= get_inc_field(&state, BKEY_FIELD_OFFSET);
+	out.p.snapshot	= get_inc_field(&state, BKEY_FIELD_SNAPSHOT);
+	out.size	= le64_to_cpu(format->field_offset[BKEY_FIELD_SIZE]);
+	out.version.hi	= le64_to_cpu(format->field_offset[BKEY_FIELD_VERSION_HI]);
+	out.version.lo	= le64_to_cpu(format->field_offset[BKEY_FIELD_VERSION_LO]);
+
+	return out;
+}
+
 #ifndef HAVE_BCACHEFS_COMPILED_UNPACK
+int bch2_compile_bkey_format(const struct bkey_format *format, void *out)
+{
+	return !format->bits_per_field[BKEY_FIELD_SIZE] &&
+	       !format->bits_per_field[BKEY_FIELD_VERSION_HI] &&
+	       !format->bits_per_field[BKEY_FIELD_VERSION_LO]
+		? BKEY_UNPACK_no_size_version
+		: BKEY_UNPACK_generic;
+}
+
 struct bpos __bkey_unpack_pos(const struct bkey_format *format,
 				     const struct bkey_packed *in)
 {
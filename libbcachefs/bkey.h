@@ -15,17 +15,17 @@ enum bkey_invalid_flags {
 	BKEY_INVALID_JOURNAL		= (1U << 2),
 };
 
-#if 0
-
 /*
- * compiled unpack functions are disabled, pending a new interface for
- * dynamically allocating executable memory:
+ * In the kernel, compiled unpack functions are disabled pending a new
+ * interface for dynamically allocating executable memory; in userspace btree
+ * node aux_data is mmapped PROT_EXEC (see btree_node_data_alloc()), so we can
+ * use them - they specialize the unpack to the node's bkey_format, which beats
+ * both the generic C loop and generic vector kernels for the common
+ * fixed-width formats:
  */
-
-#ifdef CONFIG_X86_64
+#if defined(CONFIG_X86_64) && !defined(__KERNEL__)
 #define HAVE_BCACHEFS_COMPILED_UNPACK	1
 #endif
-#endif
 
 void bch2_bkey_packed_to_binary_text(struct printbuf *,
 				     const struct bkey_format *,
@@ -405,6 +405,21 @@ bool bch2_bkey_transform(const struct bkey_format *,
 struct bkey __bch2_bkey_unpack_key(const struct bkey_format *,
 				   const struct bkey_packed *);
 
+/*
+ * On builds without the dynamically compiled unpack, we instead match the
+ * node's format against statically specialized unpack variants when the format
+ * is set: bch2_compile_bkey_format() returns the variant, stashed in
+ * b->unpack_fn_len. Nearly every non-extent btree node has zero width size and
+ * version fields, so that one shape covers most unpacks:
+ */
+enum bkey_unpack_variant {
+	BKEY_UNPACK_generic,
+	BKEY_UNPACK_no_size_version,
+};
+
+struct bkey __bch2_bkey_unpack_key_no_size_version(const struct bkey_format *,
+						   const struct bkey_packed *);
+
 #ifndef HAVE_BCACHEFS_COMPILED_UNPACK
 struct bpos __bkey_unpack_pos(const struct bkey_format *,
 			      const struct bkey_packed *);
@@ -450,6 +465,8 @@ __bkey_unpack_key_format_checked(const struct btree *b,
 
 			BUG_ON(memcmp(dst, &dst2, sizeof(*dst)));
 		}
+	} else if (b->unpack_fn_len == BKEY_UNPACK_no_size_version) {
+		*dst = __bch2_bkey_unpack_key_no_size_version(&b->format, src);
 	} else {
 		*dst = __bch2_bkey_unpack_key(&b->format, src);
 	}
@@ -535,17 +552,13 @@ static inline u64 bkey_field_max(const struct bkey_format *f,
 		: U64_MAX;
 }
 
-#ifdef HAVE_BCACHEFS_COMPILED_UNPACK
-
+/*
+ * With HAVE_BCACHEFS_COMPILED_UNPACK, emits a specialized unpack function into
+ * @out and returns its length; otherwise, returns the bkey_unpack_variant
+ * matching @format (@out is unused):
+ */
 int bch2_compile_bkey_format(const struct bkey_format *, void *);
 
-#else
-
-static inline int bch2_compile_bkey_format(const struct bkey_format *format,
-					  void *out) { return 0; }
-
-#endif
-
 static inline void bkey_reassemble(struct bkey_i *dst,
 				   struct bkey_s_c src)
 {
@@ -10,12 +10,32 @@ struct bkey_buf {
 	u64		onstack[12];
 };
 
+/*
+ * Large key buffers go through a one-slot percpu cache in front of the
+ * (locked) mempool: fsck's extent passes reassemble large keys in tight
+ * loops, where a buffer is typically freed and reallocated on the very next
+ * key:
+ */
+static inline struct bkey_i *bch2_large_bkey_alloc(struct bch_fs *c)
+{
+	struct bkey_i *k = this_cpu_xchg(*c->large_bkey_cache, NULL);
+
+	return k ?: mempool_alloc(&c->large_bkey_pool, GFP_NOFS);
+}
+
+static inline void bch2_large_bkey_free(struct bch_fs *c, struct bkey_i *k)
+{
+	k = this_cpu_xchg(*c->large_bkey_cache, k);
+	if (k)
+		mempool_free(k, &c->large_bkey_pool);
+}
+
 static inline void bch2_bkey_buf_realloc(struct bkey_buf *s,
 					 struct bch_fs *c, unsigned u64s)
 {
 	if (s->k == (void *) s->onstack &&
 	    u64s > ARRAY_SIZE(s->onstack)) {
-		s->k = mempool_alloc(&c->large_bkey_pool, GFP_NOFS);
+		s->k = bch2_large_bkey_alloc(c);
 		memcpy(s->k, s->onstack, sizeof(s->onstack));
 	}
 }
@@ -54,7 +74,7 @@ static inline void bch2_bkey_buf_init(struct bkey_buf *s)
 static inline void bch2_bkey_buf_exit(struct bkey_buf *s, struct bch_fs *c)
 {
 	if (s->k != (void *) s->onstack)
-		mempool_free(s->k, &c->large_bkey_pool);
+		bch2_large_bkey_free(c, s->k);
 	s->k = NULL;
 }
 
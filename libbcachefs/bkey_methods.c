@@ -246,44 +246,50 @@ fsck_err:
 void bch2_bpos_to_text(struct printbuf *out, struct bpos pos)
 {
 	if (bpos_eq(pos, POS_MIN))
-		prt_printf(out, "POS_MIN");
+		prt_str(out, "POS_MIN");
 	else if (bpos_eq(pos, POS_MAX))
-		prt_printf(out, "POS_MAX");
+		prt_str(out, "POS_MAX");
 	else if (bpos_eq(pos, SPOS_MAX))
-		prt_printf(out, "SPOS_MAX");
+		prt_str(out, "SPOS_MAX");
 	else {
 		if (pos.inode == U64_MAX)
-			prt_printf(out, "U64_MAX");
+			prt_str(out, "U64_MAX");
 		else
-			prt_printf(out, "%llu", pos.inode);
-		prt_printf(out, ":");
+			prt_u64(out, pos.inode);
+		prt_char(out, ':');
 		if (pos.offset == U64_MAX)
-			prt_printf(out, "U64_MAX");
+			prt_str(out, "U64_MAX");
 		else
-			prt_printf(out, "%llu", pos.offset);
-		prt_printf(out, ":");
+			prt_u64(out, pos.offset);
+		prt_char(out, ':');
 		if (pos.snapshot == U32_MAX)
-			prt_printf(out, "U32_MAX");
+			prt_str(out, "U32_MAX");
 		else
-			prt_printf(out, "%u", pos.snapshot);
+			prt_u64(out, pos.snapshot);
 	}
 }
 
 void bch2_bkey_to_text(struct printbuf *out, const struct bkey *k)
 {
 	if (k) {
-		prt_printf(out, "u64s %u type ", k->u64s);
+		prt_str(out, "u64s ");
+		prt_u64(out, k->u64s);
+		prt_str(out, " type ");
 
 		if (k->type < KEY_TYPE_MAX)
-			prt_printf(out, "%s ", bch2_bkey_types[k->type]);
+			prt_str(out, bch2_bkey_types[k->type]);
 		else
-			prt_printf(out, "%u ", k->type);
+			prt_u64(out, k->type);
+		prt_char(out, ' ');
 
 		bch2_bpos_to_text(out, k->p);
 
-		prt_printf(out, " len %u ver %llu", k->size, k->version.lo);
+		prt_str(out, " len ");
+		prt_u64(out, k->size);
+		prt_str(out, " ver ");
+		prt_u64(out, k->version.lo);
 	} else {
-		prt_printf(out, "(null)");
+		prt_str(out, "(null)");
 	}
 }
 
@@ -85,6 +85,7 @@ enum btree_update_flags {
 	__BTREE_TRIGGER_TRANSACTIONAL,
 	__BTREE_TRIGGER_ATOMIC,
 	__BTREE_TRIGGER_GC,
+	__BTREE_TRIGGER_GC_BUCKET_ONLY,
 	__BTREE_TRIGGER_INSERT,
 	__BTREE_TRIGGER_OVERWRITE,
 	__BTREE_TRIGGER_BUCKET_INVALIDATE,
@@ -113,6 +114,12 @@ enum btree_update_flags {
 /* We're in gc/fsck: running triggers to recalculate e.g. disk usage */
 #define BTREE_TRIGGER_GC		(1U << __BTREE_TRIGGER_GC)
 
+/*
+ * Windowed (bounded-memory) gc, mark pass for a later window: only update
+ * per-bucket state, filesystem level accounting was done on the first pass
+ */
+#define BTREE_TRIGGER_GC_BUCKET_ONLY	(1U << __BTREE_TRIGGER_GC_BUCKET_ONLY)
+
 /* @new is entering the btree */
 #define BTREE_TRIGGER_INSERT		(1U << __BTREE_TRIGGER_INSERT)
 
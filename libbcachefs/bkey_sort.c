@@ -15,21 +15,41 @@ static inline bool sort_iter_end(struct sort_iter *iter)
 	return !iter->used;
 }
 
+/*
+ * The sort_iter is maintained as a min heap ordered by cmp: the btree node
+ * read path merges one bset per historical write, so iter->used can be in the
+ * hundreds for a badly fragmented node, and keeping iter->data[] fully sorted
+ * costs O(used) compares per key emitted where the heap costs O(log(used)).
+ * For the small merges in the write path the two behave identically.
+ */
 static inline void sort_iter_sift(struct sort_iter *iter, unsigned from,
 				  sort_cmp_fn cmp)
 {
-	unsigned i;
+	unsigned i = from;
+
+	while (1) {
+		unsigned l = i * 2 + 1;
+		unsigned r = i * 2 + 2;
+		unsigned m = i;
+
+		if (l < iter->used &&
+		    cmp(iter->b, iter->data[l].k, iter->data[m].k) < 0)
+			m = l;
+		if (r < iter->used &&
+		    cmp(iter->b, iter->data[r].k, iter->data[m].k) < 0)
+			m = r;
+
+		if (m == i)
+			break;
 
-	for (i = from;
-	     i + 1 < iter->used &&
-	     cmp(iter->b, iter->data[i].k, iter->data[i + 1].k) > 0;
-	     i++)
-		swap(iter->data[i], iter->data[i + 1]);
+		swap(iter->data[i], iter->data[m]);
+		i = m;
+	}
 }
 
 static inline void sort_iter_sort(struct sort_iter *iter, sort_cmp_fn cmp)
 {
-	unsigned i = iter->used;
+	unsigned i = iter->used / 2;
 
 	while (i--)
 		sort_iter_sift(iter, i, cmp);
@@ -51,9 +71,9 @@ static inline void sort_iter_advance(struct sort_iter *iter, sort_cmp_fn cmp)
 	BUG_ON(i->k > i->end);
 
 	if (i->k == i->end)
-		array_remove_item(iter->data, iter->used, 0);
-	else
-		sort_iter_sift(iter, 0, cmp);
+		*i = iter->data[--iter->used];
+
+	sort_iter_sift(iter, 0, cmp);
 }
 
 static inline struct bkey_packed *sort_iter_next(struct sort_iter *iter,
@@ -82,13 +102,21 @@ static inline bool should_drop_next_key(struct sort_iter *iter)
 {
 	/*
 	 * key_sort_cmp() ensures that when keys compare equal the older key
-	 * comes first; so if l->k compares equal to r->k then l->k is older
-	 * and should be dropped.
+	 * comes first; so if another key compares equal to data[0].k it's
+	 * newer, data[0].k is a stale version and should be dropped.
+	 *
+	 * Any key equal to the heap's minimum must be one of its children:
+	 * every root to leaf path is nondecreasing, so an equal key deeper in
+	 * the heap implies equal keys the whole way up.
 	 */
-	return iter->used >= 2 &&
+	return (iter->used >= 2 &&
+		!bch2_bkey_cmp_packed(iter->b,
+				 iter->data[0].k,
+				 iter->data[1].k)) ||
+	       (iter->used >= 3 &&
 		!bch2_bkey_cmp_packed(iter->b,
 				 iter->data[0].k,
-				 iter->data[1].k);
+				 iter->data[2].k));
 }
 
 struct btree_nr_keys
@@ -7,6 +7,7 @@
  */
 
 #include "bcachefs.h"
+#include "bkey_cmp.h"
 #include "btree_cache.h"
 #include "bset.h"
 #include "eytzinger.h"
@@ -583,8 +584,7 @@ static unsigned rw_aux_tree_bsearch(struct btree *b,
 }
 
 static inline unsigned bkey_mantissa(const struct bkey_packed *k,
-				     const struct bkey_float *f,
-				     unsigned idx)
+				     const struct bkey_float *f)
 {
 	u64 v;
 
@@ -666,7 +666,7 @@ static __always_inline void make_bfloat(struct btree *b, struct bset_tree *t,
 	EBUG_ON(shift < 0 || shift >= BFLOAT_FAILED);
 
 	f->exponent = shift;
-	mantissa = bkey_mantissa(m, f, j);
+	mantissa = bkey_mantissa(m, f);
 
 	/*
 	 * If we've got garbage bits, set them to all 1s - it's legal for the
@@ -1095,9 +1095,38 @@ static inline void prefetch_four_cachelines(void *p)
 #endif
 }
 
+/*
+ * Inlined versions of bkey_cmp_p_or_unp()/bkey_iter_cmp_p_or_unp(), for the
+ * search hot paths: the out of line comparator costs a function call per key
+ * compared, which shows up in point lookup profiles:
+ */
+static inline int bkey_cmp_p_or_unp_inlined(const struct btree *b,
+					    const struct bkey_packed *l,
+					    const struct bkey_packed *r_packed,
+					    const struct bpos *r)
+{
+	EBUG_ON(r_packed && !bkey_packed(r_packed));
+
+	if (unlikely(!bkey_packed(l)))
+		return bpos_cmp(packed_to_bkey_c(l)->p, *r);
+
+	if (likely(r_packed))
+		return __bch2_bkey_cmp_packed_format_checked_inlined(l, r_packed, b);
+
+	return __bch2_bkey_cmp_left_packed_format_checked(b, l, r);
+}
+
+static inline int bkey_iter_cmp_p_or_unp_inlined(const struct btree *b,
+					    const struct bkey_packed *l,
+					    const struct bkey_packed *r_packed,
+					    const struct bpos *r)
+{
+	return bkey_cmp_p_or_unp_inlined(b, l, r_packed, r)
+		?: -((int) bkey_deleted(l));
+}
+
 static inline bool bkey_mantissa_bits_dropped(const struct btree *b,
-					      const struct bkey_float *f,
-					      unsigned idx)
+					      const struct bkey_float *f)
 {
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 	unsigned key_bits_start = b->format.key_u64s * 64 - b->nr_key_bits;
@@ -1123,24 +1152,47 @@ static struct bkey_packed *bset_search_tree(const struct btree *b,
 	int cmp;
 
 	do {
-		if (likely(n << 4 < t->size))
+		if (likely(n << 4 < t->size)) {
+			/*
+			 * All 16 possible nodes four levels down are the
+			 * eytzinger range [n << 4, (n << 4) + 15], and since
+			 * bset_alloc_tree() cacheline aligns the aux tree and
+			 * bkey_floats are 4 bytes, that range is exactly one
+			 * aligned cacheline - one prefetch covers every node
+			 * this descent can visit at that depth:
+			 */
 			prefetch(&base->f[n << 4]);
+		} else if (n << 2 >= t->size) {
+			/*
+			 * Within two levels of the bottom of the tree: the
+			 * search will end at this node's inorder position or
+			 * just before it, so kick off the fetch of the
+			 * candidate key cachelines while we finish the
+			 * descent - otherwise the linear search that follows
+			 * eats the full cache miss:
+			 */
+			unsigned i = __eytzinger1_to_inorder(n, t->size - 1,
+							     t->extra);
+
+			prefetch(cacheline_to_bkey(b, t, i, 0));
+			prefetch(cacheline_to_bkey(b, t, i - 1, 0));
+		}
 
 		f = &base->f[n];
 		if (unlikely(f->exponent >= BFLOAT_FAILED))
 			goto slowpath;
 
 		l = f->mantissa;
-		r = bkey_mantissa(packed_search, f, n);
+		r = bkey_mantissa(packed_search, f);
 
-		if (unlikely(l == r) && bkey_mantissa_bits_dropped(b, f, n))
+		if (unlikely(l == r) && bkey_mantissa_bits_dropped(b, f))
 			goto slowpath;
 
 		n = n * 2 + (l < r);
 		continue;
 slowpath:
 		k = tree_to_bkey(b, t, n);
-		cmp = bkey_cmp_p_or_unp(b, k, packed_search, search);
+		cmp = bkey_cmp_p_or_unp_inlined(b, k, packed_search, search);
 		if (!cmp)
 			return k;
 
@@ -1208,7 +1260,7 @@ struct bkey_packed *bch2_bset_search_linear(struct btree *b,
 {
 	if (lossy_packed_search)
 		while (m != btree_bkey_last(b, t) &&
-		       bkey_iter_cmp_p_or_unp(b, m,
+		       bkey_iter_cmp_p_or_unp_inlined(b, m,
 					lossy_packed_search, search) < 0)
 			m = bkey_p_next(m);
 
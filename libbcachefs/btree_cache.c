@@ -194,8 +194,12 @@ static inline struct btree *btree_cache_find(struct btree_cache *bc,
 				     const struct bkey_i *k)
 {
 	u64 v = btree_ptr_hash_val(k);
+	struct btree *b =
+		rhashtable_lookup_fast(&bc->table, &v, bch_btree_cache_params);
 
-	return rhashtable_lookup_fast(&bc->table, &v, bch_btree_cache_params);
+	if (b)
+		atomic64_inc(&bc->hits);
+	return b;
 }
 
 /*
@@ -376,6 +380,7 @@ out:
 	mutex_unlock(&bc->lock);
 out_nounlock:
 	ret = freed;
+	atomic64_add(freed, &bc->nr_reclaimed);
 	memalloc_nofs_restore(flags);
 	trace_and_count(c, btree_cache_scan, sc->nr_to_scan, can_free, ret);
 	return ret;
@@ -698,6 +703,8 @@ static noinline struct btree *bch2_btree_node_fill(struct btree_trans *trans,
 	struct btree *b;
 	u32 seq;
 
+	atomic64_inc(&bc->misses);
+
 	BUG_ON(level + 1 >= BTREE_MAX_DEPTH);
 	/*
 	 * Parent node must be locked, else we could read in a btree node that's
@@ -976,6 +983,8 @@ struct btree *bch2_btree_node_get(struct btree_trans *trans, struct btree_path *
 		return __bch2_btree_node_get(trans, path, k, level, lock_type, trace_ip);
 	}
 
+	atomic64_inc(&c->btree_cache.hits);
+
 	prefetch(b->aux_data);
 
 	for_each_bset(b, t) {
@@ -1096,7 +1105,7 @@ int bch2_btree_node_prefetch(struct btree_trans *trans,
 	struct btree_cache *bc = &c->btree_cache;
 	struct btree *b;
 
-	BUG_ON(trans && !btree_node_locked(path, level + 1));
+	BUG_ON(path && !btree_node_locked(path, level + 1));
 	BUG_ON(level >= BTREE_MAX_DEPTH);
 
 	b = btree_cache_find(bc, k);
@@ -1203,9 +1212,48 @@ void bch2_btree_node_to_text(struct printbuf *out, struct bch_fs *c, const struc
 	       stats.failed);
 }
 
-void bch2_btree_cache_to_text(struct printbuf *out, const struct bch_fs *c)
+void bch2_btree_cache_to_text(struct printbuf *out, struct bch_fs *c)
 {
-	prt_printf(out, "nr nodes:\t\t%u\n", c->btree_cache.used);
-	prt_printf(out, "nr dirty:\t\t%u\n", atomic_read(&c->btree_cache.dirty));
-	prt_printf(out, "cannibalize lock:\t%p\n", c->btree_cache.alloc_lock);
+	struct btree_cache *bc = &c->btree_cache;
+	u64 hits	= atomic64_read(&bc->hits);
+	u64 misses	= atomic64_read(&bc->misses);
+
+	unsigned nr[BTREE_ID_NR]	= { 0 };
+	unsigned dirty[BTREE_ID_NR]	= { 0 };
+	u64 bytes[BTREE_ID_NR]		= { 0 };
+	u64 total_bytes			= 0;
+	struct btree *b;
+
+	mutex_lock(&bc->lock);
+	list_for_each_entry(b, &bc->live, list) {
+		total_bytes += btree_buf_bytes(b);
+
+		if (b->c.btree_id < BTREE_ID_NR) {
+			nr[b->c.btree_id]++;
+			dirty[b->c.btree_id] += btree_node_dirty(b);
+			bytes[b->c.btree_id] += btree_buf_bytes(b);
+		}
+	}
+	mutex_unlock(&bc->lock);
+
+	prt_printf(out, "nr nodes:\t\t%u\n", bc->used);
+	prt_printf(out, "nr dirty:\t\t%u\n", atomic_read(&bc->dirty));
+	prt_printf(out, "total bytes:\t\t%llu\n", total_bytes);
+	prt_printf(out, "cannibalize lock:\t%p\n", bc->alloc_lock);
+
+	prt_printf(out, "hits:\t\t\t%llu\n", hits);
+	prt_printf(out, "misses:\t\t\t%llu\n", misses);
+	if (hits + misses)
+		prt_printf(out, "hit rate:\t\t%llu%%\n",
+			   div64_u64(hits * 100, hits + misses));
+	prt_printf(out, "nodes reclaimed:\t%llu\n",
+		   atomic64_read(&bc->nr_reclaimed));
+
+	for (unsigned i = 0; i < BTREE_ID_NR; i++) {
+		if (!nr[i])
+			continue;
+
+		prt_printf(out, "%s:\t%u nodes (%u dirty), %llu bytes\n",
+			   bch2_btree_id_str(i), nr[i], dirty[i], bytes[i]);
+	}
 }
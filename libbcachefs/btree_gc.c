@@ -588,9 +588,13 @@ static int bch2_check_fix_ptrs(struct btree_trans *trans, enum btree_id btree_id
 	 */
 	bkey_for_each_ptr_decode(k->k, ptrs_c, p, entry_c) {
 		struct bch_dev *ca = bch_dev_bkey_exists(c, p.ptr.dev);
-		struct bucket *g = PTR_GC_BUCKET(ca, &p.ptr);
+		struct bucket *g = PTR_GC_BUCKET_MAYBE(ca, &p.ptr);
 		enum bch_data_type data_type = bch2_bkey_ptr_data_type(*k, &entry_c->ptr);
 
+		/* Checked on the pass for the window this bucket falls in: */
+		if (!g)
+			continue;
+
 		if (!g->gen_valid &&
 		    (c->opts.reconstruct_alloc ||
 		     fsck_err(c, ptr_to_missing_alloc_key,
@@ -729,23 +733,25 @@ static int bch2_check_fix_ptrs(struct btree_trans *trans, enum btree_id btree_id
 			ptrs = bch2_bkey_ptrs(bkey_i_to_s(new));
 			bkey_for_each_ptr(ptrs, ptr) {
 				struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
-				struct bucket *g = PTR_GC_BUCKET(ca, ptr);
+				struct bucket *g = PTR_GC_BUCKET_MAYBE(ca, ptr);
 
-				ptr->gen = g->gen;
+				if (g)
+					ptr->gen = g->gen;
 			}
 		} else {
 			bch2_bkey_drop_ptrs(bkey_i_to_s(new), ptr, ({
 				struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
-				struct bucket *g = PTR_GC_BUCKET(ca, ptr);
+				struct bucket *g = PTR_GC_BUCKET_MAYBE(ca, ptr);
 				enum bch_data_type data_type = bch2_bkey_ptr_data_type(*k, ptr);
 
-				(ptr->cached &&
+				g &&
+				((ptr->cached &&
 				 (!g->gen_valid || gen_cmp(ptr->gen, g->gen) > 0)) ||
 				(!ptr->cached &&
 				 gen_cmp(ptr->gen, g->gen) < 0) ||
 				gen_cmp(g->gen, ptr->gen) > BUCKET_GC_GEN_MAX ||
 				(g->data_type &&
-				 g->data_type != data_type);
+				 g->data_type != data_type));
 			}));
 again:
 			ptrs = bch2_bkey_ptrs(bkey_i_to_s(new));
@@ -834,7 +840,9 @@ static int bch2_gc_mark_key(struct btree_trans *trans, enum btree_id btree_id,
 	}
 
 	ret = commit_do(trans, NULL, NULL, 0,
-			bch2_key_trigger(trans, btree_id, level, old, unsafe_bkey_s_c_to_s(*k), BTREE_TRIGGER_GC));
+			bch2_key_trigger(trans, btree_id, level, old, unsafe_bkey_s_c_to_s(*k),
+					 BTREE_TRIGGER_GC|
+					 (c->gc_bucket_only ? BTREE_TRIGGER_GC_BUCKET_ONLY : 0)));
 fsck_err:
 err:
 	bch_err_fn(c, ret);
@@ -921,14 +929,12 @@ static int bch2_gc_btree(struct btree_trans *trans, enum btree_id btree_id,
 	return ret;
 }
 
-static int bch2_gc_btree_init_recurse(struct btree_trans *trans, struct btree *b,
-				      unsigned target_depth)
+static int bch2_gc_btree_init_mark_keys(struct btree_trans *trans, struct btree *b)
 {
 	struct bch_fs *c = trans->c;
 	struct btree_and_journal_iter iter;
 	struct bkey_s_c k;
 	struct bkey_buf cur, prev;
-	struct printbuf buf = PRINTBUF;
 	int ret = 0;
 
 	bch2_btree_and_journal_iter_init_node_iter(&iter, c, b);
@@ -943,7 +949,7 @@ static int bch2_gc_btree_init_recurse(struct btree_trans *trans, struct btree *b
 		ret = bch2_gc_mark_key(trans, b->c.btree_id, b->c.level,
 				       false, &k, true);
 		if (ret)
-			goto fsck_err;
+			break;
 
 		if (b->c.level) {
 			bch2_bkey_buf_reassemble(&cur, c, k);
@@ -955,70 +961,183 @@ static int bch2_gc_btree_init_recurse(struct btree_trans *trans, struct btree *b
 					&prev, cur,
 					!bch2_btree_and_journal_iter_peek(&iter).k);
 			if (ret)
-				goto fsck_err;
+				break;
 		} else {
 			bch2_btree_and_journal_iter_advance(&iter);
 		}
 	}
 
-	if (b->c.level > target_depth) {
-		bch2_btree_and_journal_iter_exit(&iter);
-		bch2_btree_and_journal_iter_init_node_iter(&iter, c, b);
+	bch2_bkey_buf_exit(&cur, c);
+	bch2_bkey_buf_exit(&prev, c);
+	bch2_btree_and_journal_iter_exit(&iter);
+	return ret;
+}
 
-		while ((k = bch2_btree_and_journal_iter_peek(&iter)).k) {
-			struct btree *child;
+static int bch2_gc_btree_init_recurse(struct btree_trans *, struct btree *, unsigned);
 
-			bch2_bkey_buf_reassemble(&cur, c, k);
-			bch2_btree_and_journal_iter_advance(&iter);
+static int bch2_gc_mark_subtree(struct btree_trans *trans, struct bkey_buf *cur,
+				enum btree_id btree_id, unsigned level,
+				unsigned target_depth)
+{
+	struct bch_fs *c = trans->c;
+	struct printbuf buf = PRINTBUF;
+	struct btree *child;
+	int ret;
 
-			child = bch2_btree_node_get_noiter(trans, cur.k,
-						b->c.btree_id, b->c.level - 1,
-						false);
-			ret = PTR_ERR_OR_ZERO(child);
-
-			if (ret == -EIO) {
-				bch2_topology_error(c);
-
-				if (__fsck_err(c,
-					  FSCK_CAN_FIX|
-					  FSCK_CAN_IGNORE|
-					  FSCK_NO_RATELIMIT,
-					  btree_node_read_error,
-					  "Unreadable btree node at btree %s level %u:\n"
-					  "  %s",
-					  bch2_btree_id_str(b->c.btree_id),
-					  b->c.level - 1,
-					  (printbuf_reset(&buf),
-					   bch2_bkey_val_to_text(&buf, c, bkey_i_to_s_c(cur.k)), buf.buf)) &&
-				    should_restart_for_topology_repair(c)) {
-					bch_info(c, "Halting mark and sweep to start topology repair pass");
-					ret = bch2_run_explicit_recovery_pass(c, BCH_RECOVERY_PASS_check_topology);
-					goto fsck_err;
-				} else {
-					/* Continue marking when opted to not
-					 * fix the error: */
-					ret = 0;
-					set_bit(BCH_FS_initial_gc_unfixed, &c->flags);
-					continue;
-				}
-			} else if (ret) {
-				bch_err_msg(c, ret, "getting btree node");
-				break;
-			}
+	child = bch2_btree_node_get_noiter(trans, cur->k, btree_id, level, false);
+	ret = PTR_ERR_OR_ZERO(child);
 
-			ret = bch2_gc_btree_init_recurse(trans, child,
-							 target_depth);
-			six_unlock_read(&child->c.lock);
+	if (ret == -EIO) {
+		bch2_topology_error(c);
 
-			if (ret)
-				break;
+		if (__fsck_err(c,
+			  FSCK_CAN_FIX|
+			  FSCK_CAN_IGNORE|
+			  FSCK_NO_RATELIMIT,
+			  btree_node_read_error,
+			  "Unreadable btree node at btree %s level %u:\n"
+			  "  %s",
+			  bch2_btree_id_str(btree_id),
+			  level,
+			  (printbuf_reset(&buf),
+			   bch2_bkey_val_to_text(&buf, c, bkey_i_to_s_c(cur->k)), buf.buf)) &&
+		    should_restart_for_topology_repair(c)) {
+			bch_info(c, "Halting mark and sweep to start topology repair pass");
+			ret = bch2_run_explicit_recovery_pass(c, BCH_RECOVERY_PASS_check_topology);
+			goto fsck_err;
+		} else {
+			/* Continue marking when opted to not
+			 * fix the error: */
+			ret = 0;
+			set_bit(BCH_FS_initial_gc_unfixed, &c->flags);
+			goto fsck_err;
 		}
+	} else if (ret) {
+		bch_err_msg(c, ret, "getting btree node");
+		goto fsck_err;
 	}
+
+	ret = bch2_gc_btree_init_recurse(trans, child, target_depth);
+	six_unlock_read(&child->c.lock);
 fsck_err:
+	printbuf_exit(&buf);
+	return ret;
+}
+
+static int bch2_gc_btree_init_recurse(struct btree_trans *trans, struct btree *b,
+				      unsigned target_depth)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_and_journal_iter iter;
+	struct bkey_s_c k;
+	struct bkey_buf cur;
+	int ret;
+
+	ret = bch2_gc_btree_init_mark_keys(trans, b);
+	if (ret || b->c.level <= target_depth)
+		return ret;
+
+	bch2_bkey_buf_init(&cur);
+	bch2_btree_and_journal_iter_init_node_iter(&iter, c, b);
+
+	while ((k = bch2_btree_and_journal_iter_peek(&iter)).k) {
+		bch2_bkey_buf_reassemble(&cur, c, k);
+		bch2_btree_and_journal_iter_advance(&iter);
+
+		ret = bch2_gc_mark_subtree(trans, &cur, b->c.btree_id,
+					   b->c.level - 1, target_depth);
+		if (ret)
+			break;
+	}
+
 	bch2_bkey_buf_exit(&cur, c);
-	bch2_bkey_buf_exit(&prev, c);
 	bch2_btree_and_journal_iter_exit(&iter);
-	printbuf_exit(&buf);
+	return ret;
+}
+
+struct gc_subtree_work {
+	struct work_struct	work;
+	struct bch_fs		*c;
+	struct bkey_buf		k;
+	enum btree_id		btree_id;
+	unsigned		level;
+	unsigned		target_depth;
+	int			ret;
+};
+
+static void bch2_gc_subtree_work_fn(struct work_struct *work)
+{
+	struct gc_subtree_work *w = container_of(work, struct gc_subtree_work, work);
+	struct btree_trans *trans = bch2_trans_get(w->c);
+
+	w->ret = bch2_gc_mark_subtree(trans, &w->k, w->btree_id, w->level,
+				      w->target_depth);
+	bch2_trans_put(trans);
+}
+
+/*
+ * Map-reduce over the btree for the initial mark: the root's children are
+ * independent subtrees, marked concurrently from the workqueue pool with a
+ * transaction per worker. The mark phase is cpu bound on bkey decode and the
+ * triggers, and those are already cross-thread safe - bucket accounting takes
+ * bucket locks and the usage counters are percpu - while the topology checks
+ * only ever compare keys within one node, which belongs to exactly one
+ * worker. Recursion below the root stays serial within each worker.
+ */
+static int bch2_gc_btree_init_parallel(struct btree_trans *trans, struct btree *b,
+				       unsigned target_depth)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_and_journal_iter iter;
+	struct bkey_s_c k;
+	struct gc_subtree_work *w = NULL;
+	unsigned i, nr = 0;
+	int ret;
+
+	if (b->c.level > target_depth && num_online_cpus() > 1) {
+		bch2_btree_and_journal_iter_init_node_iter(&iter, c, b);
+		while (bch2_btree_and_journal_iter_peek(&iter).k) {
+			nr++;
+			bch2_btree_and_journal_iter_advance(&iter);
+		}
+		bch2_btree_and_journal_iter_exit(&iter);
+
+		if (nr > 1)
+			w = kcalloc(nr, sizeof(*w), GFP_KERNEL);
+	}
+
+	if (!w)
+		return bch2_gc_btree_init_recurse(trans, b, target_depth);
+
+	ret = bch2_gc_btree_init_mark_keys(trans, b);
+	if (ret)
+		goto out;
+
+	i = 0;
+	bch2_btree_and_journal_iter_init_node_iter(&iter, c, b);
+	while ((k = bch2_btree_and_journal_iter_peek(&iter)).k && i < nr) {
+		w[i].c		= c;
+		w[i].btree_id	= b->c.btree_id;
+		w[i].level	= b->c.level - 1;
+		w[i].target_depth = target_depth;
+		bch2_bkey_buf_init(&w[i].k);
+		bch2_bkey_buf_reassemble(&w[i].k, c, k);
+		INIT_WORK(&w[i].work, bch2_gc_subtree_work_fn);
+		queue_work(system_unbound_wq, &w[i].work);
+		i++;
+
+		bch2_btree_and_journal_iter_advance(&iter);
+	}
+	bch2_btree_and_journal_iter_exit(&iter);
+
+	while (i) {
+		i--;
+		flush_work(&w[i].work);
+		bch2_bkey_buf_exit(&w[i].k, c);
+		ret = ret ?: w[i].ret;
+	}
+out:
+	kfree(w);
 	return ret;
 }
 
@@ -1059,7 +1178,7 @@ static int bch2_gc_btree_init(struct btree_trans *trans,
 	}
 
 	if (b->c.level >= target_depth)
-		ret = bch2_gc_btree_init_recurse(trans, b, target_depth);
+		ret = bch2_gc_btree_init_parallel(trans, b, target_depth);
 
 	if (!ret) {
 		struct bkey_s_c k = bkey_i_to_s_c(&b->key);
@@ -1184,17 +1303,28 @@ static void bch2_mark_pending_btree_node_frees(struct bch_fs *c)
 }
 #endif
 
+static void bch2_gc_alloc_free(struct bch_fs *c)
+{
+	for_each_member_device(c, ca) {
+		struct bucket_array *buckets =
+			rcu_dereference_protected(ca->buckets_gc, 1);
+
+		if (buckets)
+			kvpfree(buckets, sizeof(struct bucket_array) +
+				(buckets->window_end - buckets->window_start) *
+				(sizeof(struct bucket) + sizeof(u32)));
+		ca->buckets_gc = NULL;
+	}
+}
+
 static void bch2_gc_free(struct bch_fs *c)
 {
 	genradix_free(&c->reflink_gc_table);
 	genradix_free(&c->gc_stripes);
 
-	for_each_member_device(c, ca) {
-		kvpfree(rcu_dereference_protected(ca->buckets_gc, 1),
-			sizeof(struct bucket_array) +
-			ca->mi.nbuckets * sizeof(struct bucket));
-		ca->buckets_gc = NULL;
+	bch2_gc_alloc_free(c);
 
+	for_each_member_device(c, ca) {
 		free_percpu(ca->usage_gc);
 		ca->usage_gc = NULL;
 	}
@@ -1370,6 +1500,7 @@ static int bch2_alloc_write_key(struct btree_trans *trans,
 	struct bch_alloc_v4 old_convert, new;
 	const struct bch_alloc_v4 *old;
 	enum bch_data_type type;
+	u32 gc_stripe;
 	int ret;
 
 	old = bch2_alloc_to_v4(k, &old_convert);
@@ -1377,6 +1508,7 @@ static int bch2_alloc_write_key(struct btree_trans *trans,
 
 	percpu_down_read(&c->mark_lock);
 	b = gc_bucket(ca, iter->pos.offset);
+	gc_stripe = *gc_bucket_stripe(ca, iter->pos.offset);
 
 	/*
 	 * b->data_type doesn't yet include need_discard & need_gc_gen states -
@@ -1384,7 +1516,7 @@ static int bch2_alloc_write_key(struct btree_trans *trans,
 	 */
 	type = __alloc_data_type(b->dirty_sectors,
 				 b->cached_sectors,
-				 b->stripe,
+				 gc_stripe,
 				 *old,
 				 b->data_type);
 	if (b->data_type != type) {
@@ -1438,12 +1570,21 @@ static int bch2_alloc_write_key(struct btree_trans *trans,
 			  dirty_sectors);
 	copy_bucket_field(alloc_key_cached_sectors_wrong,
 			  cached_sectors);
-	copy_bucket_field(alloc_key_stripe_wrong,
-			  stripe);
 	copy_bucket_field(alloc_key_stripe_redundancy_wrong,
 			  stripe_redundancy);
 #undef copy_bucket_field
 
+	if (c->opts.reconstruct_alloc ||
+	    fsck_err_on(new.stripe != gc_stripe, c,
+			alloc_key_stripe_wrong,
+			"bucket %llu:%llu gen %u data type %s has wrong stripe"
+			": got %u, should be %u",
+			iter->pos.inode, iter->pos.offset,
+			gc.gen,
+			bch2_data_type_str(gc.data_type),
+			new.stripe, gc_stripe))
+		new.stripe = gc_stripe;
+
 	if (!bch2_alloc_v4_cmp(*old, new))
 		return 0;
 
@@ -1471,10 +1612,17 @@ static int bch2_gc_alloc_done(struct bch_fs *c, bool metadata_only)
 	int ret = 0;
 
 	for_each_member_device(c, ca) {
+		struct bucket_array *buckets = gc_bucket_array(ca);
+		u64 start	= max_t(u64, ca->mi.first_bucket, buckets->window_start);
+		u64 end		= min_t(u64, ca->mi.nbuckets, buckets->window_end);
+
+		if (start >= end)
+			continue;
+
 		ret = bch2_trans_run(c,
 			for_each_btree_key_upto_commit(trans, iter, BTREE_ID_alloc,
-					POS(ca->dev_idx, ca->mi.first_bucket),
-					POS(ca->dev_idx, ca->mi.nbuckets - 1),
+					POS(ca->dev_idx, start),
+					POS(ca->dev_idx, end - 1),
 					BTREE_ITER_SLOTS|BTREE_ITER_PREFETCH, k,
 					NULL, NULL, BCH_TRANS_COMMIT_lazy_rw,
 				bch2_alloc_write_key(trans, &iter, k, metadata_only)));
@@ -1488,11 +1636,16 @@ static int bch2_gc_alloc_done(struct bch_fs *c, bool metadata_only)
 	return ret;
 }
 
-static int bch2_gc_alloc_start(struct bch_fs *c, bool metadata_only)
+static int bch2_gc_alloc_start(struct bch_fs *c, bool metadata_only,
+			       u64 window_start, u64 window_size)
 {
 	for_each_member_device(c, ca) {
+		u64 start = window_size ? min_t(u64, window_start, ca->mi.nbuckets) : 0;
+		u64 end	  = window_size
+			? min_t(u64, window_start + window_size, ca->mi.nbuckets)
+			: ca->mi.nbuckets;
 		struct bucket_array *buckets = kvpmalloc(sizeof(struct bucket_array) +
-				ca->mi.nbuckets * sizeof(struct bucket),
+				(end - start) * (sizeof(struct bucket) + sizeof(u32)),
 				GFP_KERNEL|__GFP_ZERO);
 		if (!buckets) {
 			percpu_ref_put(&ca->ref);
@@ -1502,6 +1655,9 @@ static int bch2_gc_alloc_start(struct bch_fs *c, bool metadata_only)
 
 		buckets->first_bucket	= ca->mi.first_bucket;
 		buckets->nbuckets	= ca->mi.nbuckets;
+		buckets->window_start	= start;
+		buckets->window_end	= end;
+		buckets->stripe		= (u32 *) (buckets->b + (end - start));
 		rcu_assign_pointer(ca->buckets_gc, buckets);
 	}
 
@@ -1509,23 +1665,25 @@ static int bch2_gc_alloc_start(struct bch_fs *c, bool metadata_only)
 		for_each_btree_key(trans, iter, BTREE_ID_alloc, POS_MIN,
 					 BTREE_ITER_PREFETCH, k, ({
 			struct bch_dev *ca = bch_dev_bkey_exists(c, k.k->p.inode);
-			struct bucket *g = gc_bucket(ca, k.k->p.offset);
+			struct bucket *g = gc_bucket_maybe(ca, k.k->p.offset);
 
 			struct bch_alloc_v4 a_convert;
 			const struct bch_alloc_v4 *a = bch2_alloc_to_v4(k, &a_convert);
 
-			g->gen_valid	= 1;
-			g->gen		= a->gen;
-
-			if (metadata_only &&
-			    (a->data_type == BCH_DATA_user ||
-			     a->data_type == BCH_DATA_cached ||
-			     a->data_type == BCH_DATA_parity)) {
-				g->data_type		= a->data_type;
-				g->dirty_sectors	= a->dirty_sectors;
-				g->cached_sectors	= a->cached_sectors;
-				g->stripe		= a->stripe;
-				g->stripe_redundancy	= a->stripe_redundancy;
+			if (g) {
+				g->gen_valid	= 1;
+				g->gen		= a->gen;
+
+				if (metadata_only &&
+				    (a->data_type == BCH_DATA_user ||
+				     a->data_type == BCH_DATA_cached ||
+				     a->data_type == BCH_DATA_parity)) {
+					g->data_type		= a->data_type;
+					g->dirty_sectors	= a->dirty_sectors;
+					g->cached_sectors	= a->cached_sectors;
+					g->stripe_redundancy	= a->stripe_redundancy;
+					*gc_bucket_stripe(ca, k.k->p.offset) = a->stripe;
+				}
 			}
 
 			0;
@@ -1556,6 +1714,7 @@ static void bch2_gc_alloc_reset(struct bch_fs *c, bool metadata_only)
 static int bch2_gc_write_reflink_key(struct btree_trans *trans,
 				     struct btree_iter *iter,
 				     struct bkey_s_c k,
+				     struct genradix_leaf_cache *cache,
 				     size_t *idx)
 {
 	struct bch_fs *c = trans->c;
@@ -1567,7 +1726,7 @@ static int bch2_gc_write_reflink_key(struct btree_trans *trans,
 	if (!refcount)
 		return 0;
 
-	while ((r = genradix_ptr(&c->reflink_gc_table, *idx)) &&
+	while ((r = genradix_ptr_cached(&c->reflink_gc_table, cache, *idx)) &&
 	       r->offset < k.k->p.offset)
 		++*idx;
 
@@ -1603,6 +1762,7 @@ fsck_err:
 
 static int bch2_gc_reflink_done(struct bch_fs *c, bool metadata_only)
 {
+	struct genradix_leaf_cache cache = genradix_leaf_cache_init();
 	size_t idx = 0;
 
 	if (metadata_only)
@@ -1613,7 +1773,7 @@ static int bch2_gc_reflink_done(struct bch_fs *c, bool metadata_only)
 				BTREE_ID_reflink, POS_MIN,
 				BTREE_ITER_PREFETCH, k,
 				NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
-			bch2_gc_write_reflink_key(trans, &iter, k, &idx)));
+			bch2_gc_write_reflink_key(trans, &iter, k, &cache, &idx)));
 	c->reflink_gc_nr = 0;
 	return ret;
 }
@@ -1656,9 +1816,11 @@ static void bch2_gc_reflink_reset(struct bch_fs *c, bool metadata_only)
 {
 	struct genradix_iter iter;
 	struct reflink_gc *r;
+	size_t nr;
 
-	genradix_for_each(&c->reflink_gc_table, iter, r)
-		r->refcount = 0;
+	genradix_for_each_leaf(&c->reflink_gc_table, iter, r, nr)
+		while (nr--)
+			(r++)->refcount = 0;
 }
 
 static int bch2_gc_write_stripes_key(struct btree_trans *trans,
@@ -1758,29 +1920,78 @@ static void bch2_gc_stripes_reset(struct bch_fs *c, bool metadata_only)
  */
 int bch2_gc(struct bch_fs *c, bool initial, bool metadata_only)
 {
+	u64 window_size = 0, nr_windows = 1;
 	unsigned iter = 0;
 	int ret;
 
 	lockdep_assert_held(&c->state_lock);
 
+	/*
+	 * Bounded-memory mode: mark in windowed passes so that per-bucket gc
+	 * state for only one window per device is resident at a time, trading
+	 * extra btree scans for a memory ceiling. Offline fsck only - with
+	 * multiple scans gc_pos can't be used to keep concurrent updates in
+	 * sync, and during recovery there are none.
+	 */
+	if (initial && !metadata_only && c->opts.gc_window_size) {
+		window_size = c->opts.gc_window_size;
+
+		for_each_member_device(c, ca)
+			nr_windows = max(nr_windows,
+					 DIV_ROUND_UP(ca->mi.nbuckets, window_size));
+
+		if (nr_windows > 1)
+			bch_info(c, "check_allocations: %llu windows of %llu buckets per device",
+				 nr_windows, window_size);
+		else
+			window_size = 0;
+	}
+
 	down_write(&c->gc_lock);
 
 	bch2_btree_interior_updates_flush(c);
 
 	ret   = bch2_gc_start(c) ?:
-		bch2_gc_alloc_start(c, metadata_only) ?:
+		(nr_windows == 1
+		 ? bch2_gc_alloc_start(c, metadata_only, 0, 0)
+		 : 0) ?:
 		bch2_gc_reflink_start(c, metadata_only);
 	if (ret)
 		goto out;
 again:
-	gc_pos_set(c, gc_phase(GC_PHASE_START));
+	for (u64 w = 0; w < nr_windows; w++) {
+		c->gc_bucket_only = w > 0;
 
-	bch2_mark_superblocks(c);
+		if (nr_windows > 1) {
+			ret = bch2_gc_alloc_start(c, metadata_only,
+						  w * window_size, window_size);
+			if (ret)
+				goto out;
+		}
 
-	ret = bch2_gc_btrees(c, initial, metadata_only);
+		gc_pos_set(c, gc_phase(GC_PHASE_START));
 
-	if (ret)
-		goto out;
+		bch2_mark_superblocks(c);
+
+		ret = bch2_gc_btrees(c, initial, metadata_only);
+
+		if (ret)
+			goto out;
+
+		if (nr_windows > 1) {
+			bch2_journal_block(&c->journal);
+			ret = bch2_gc_alloc_done(c, metadata_only);
+			bch2_journal_unblock(&c->journal);
+
+			percpu_down_write(&c->mark_lock);
+			bch2_gc_alloc_free(c);
+			percpu_up_write(&c->mark_lock);
+
+			if (ret)
+				goto out;
+		}
+	}
+	c->gc_bucket_only = false;
 
 #if 0
 	bch2_mark_pending_btree_node_frees(c);
@@ -1803,7 +2014,8 @@ again:
 		__gc_pos_set(c, gc_phase(GC_PHASE_NOT_RUNNING));
 
 		bch2_gc_stripes_reset(c, metadata_only);
-		bch2_gc_alloc_reset(c, metadata_only);
+		if (nr_windows == 1)
+			bch2_gc_alloc_reset(c, metadata_only);
 		bch2_gc_reflink_reset(c, metadata_only);
 		ret = bch2_gc_reset(c);
 		if (ret)
@@ -1814,12 +2026,15 @@ again:
 		goto again;
 	}
 out:
+	c->gc_bucket_only = false;
 	if (!ret) {
 		bch2_journal_block(&c->journal);
 
 		ret   = bch2_gc_stripes_done(c, metadata_only) ?:
 			bch2_gc_reflink_done(c, metadata_only) ?:
-			bch2_gc_alloc_done(c, metadata_only) ?:
+			(nr_windows == 1
+			 ? bch2_gc_alloc_done(c, metadata_only)
+			 : 0) ?:
 			bch2_gc_done(c, initial, metadata_only);
 
 		bch2_journal_unblock(&c->journal);
@@ -1906,7 +2121,7 @@ static int bch2_alloc_write_oldest_gen(struct btree_trans *trans, struct btree_i
 
 int bch2_gc_gens(struct bch_fs *c)
 {
-	u64 b, start_time = local_clock();
+	u64 start_time = local_clock();
 	int ret;
 
 	/*
@@ -1932,9 +2147,9 @@ int bch2_gc_gens(struct bch_fs *c)
 			goto err;
 		}
 
-		for (b = gens->first_bucket;
-		     b < gens->nbuckets; b++)
-			ca->oldest_gen[b] = gens->b[b];
+		memcpy(ca->oldest_gen + gens->first_bucket,
+		       gens->b + gens->first_bucket,
+		       gens->nbuckets - gens->first_bucket);
 	}
 
 	for (unsigned i = 0; i < BTREE_ID_NR; i++)
@@ -23,6 +23,10 @@
 
 #include <linux/sched/mm.h>
 
+#ifndef __KERNEL__
+#include "node_cache.h"
+#endif
+
 void bch2_btree_node_io_unlock(struct btree *b)
 {
 	EBUG_ON(!btree_node_write_in_flight(b));
@@ -1308,13 +1312,24 @@ start:
 				bkey_i_to_s_c(&b->key),
 				&failed, &rb->pick) > 0;
 
+#ifndef __KERNEL__
+		void *cache_slot = !bio->bi_status
+			? bch2_node_cache_save_start(c, b)
+			: NULL;
+#endif
 		if (!bio->bi_status &&
 		    !bch2_btree_node_read_done(c, ca, b, can_retry, &saw_error)) {
 			if (retry)
 				bch_info(c, "retry success");
+#ifndef __KERNEL__
+			bch2_node_cache_save_end(c, cache_slot, !saw_error);
+#endif
 			break;
 		}
 
+#ifndef __KERNEL__
+		bch2_node_cache_save_end(c, cache_slot, false);
+#endif
 		saw_error = true;
 
 		if (!can_retry) {
@@ -1353,7 +1368,7 @@ static void btree_node_read_endio(struct bio *bio)
 		bch2_latency_acct(ca, rb->start_time, READ);
 	}
 
-	queue_work(c->io_complete_wq, &rb->work);
+	queue_work(c->btree_read_complete_wq, &rb->work);
 }
 
 struct btree_node_read_all {
@@ -1619,7 +1634,7 @@ static int btree_node_read_all_replicas(struct bch_fs *c, struct btree *b, bool
 		btree_node_read_all_replicas_done(&ra->cl.work);
 	} else {
 		continue_at(&ra->cl, btree_node_read_all_replicas_done,
-			    c->io_complete_wq);
+			    c->btree_read_complete_wq);
 	}
 
 	return 0;
@@ -1641,6 +1656,24 @@ void bch2_btree_node_read(struct btree_trans *trans, struct btree *b,
 	    !btree_node_read_all_replicas(c, b, sync))
 		return;
 
+#ifndef __KERNEL__
+	/*
+	 * Try the shared node cache before going to disk; hits get the full
+	 * bch2_btree_node_read_done() verification, and any failure falls back
+	 * to a normal read:
+	 */
+	if (bch2_node_cache_read(c, b)) {
+		bool saw_error = false;
+
+		if (!bch2_btree_node_read_done(c, NULL, b, true, &saw_error) &&
+		    !saw_error) {
+			clear_btree_node_read_in_flight(b);
+			wake_up_bit(&b->flags, BTREE_NODE_read_in_flight);
+			return;
+		}
+	}
+#endif
+
 	ret = bch2_bkey_pick_read_device(c, bkey_i_to_s_c(&b->key),
 					 NULL, &pick);
 
@@ -1666,7 +1699,8 @@ void bch2_btree_node_read(struct btree_trans *trans, struct btree *b,
 
 	bio = bio_alloc_bioset(NULL,
 			       buf_pages(b->data, btree_buf_bytes(b)),
-			       REQ_OP_READ|REQ_SYNC|REQ_META,
+			       REQ_OP_READ|REQ_SYNC|REQ_META|
+			       (sync ? REQ_POLLED : 0),
 			       GFP_NOFS,
 			       &c->btree_bio);
 	rb = container_of(bio, struct btree_read_bio, bio);
@@ -1699,7 +1733,7 @@ void bch2_btree_node_read(struct btree_trans *trans, struct btree *b,
 		if (sync)
 			btree_node_read_work(&rb->work);
 		else
-			queue_work(c->io_complete_wq, &rb->work);
+			queue_work(c->btree_read_complete_wq, &rb->work);
 	}
 }
 
@@ -1755,6 +1789,24 @@ int bch2_btree_root_read(struct bch_fs *c, enum btree_id id,
 	return bch2_trans_run(c, __bch2_btree_root_read(trans, id, k, level));
 }
 
+/*
+ * In lazy_open mode btree roots aren't read at open time; the first traversal
+ * of each btree ends up here, from btree_path_lock_root():
+ */
+int bch2_btree_root_read_lazy(struct btree_trans *trans, enum btree_id id)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_root *r = bch2_btree_id_root(c, id);
+	int ret = 0;
+
+	mutex_lock(&c->btree_root_read_lock);
+	if (!READ_ONCE(r->b))
+		ret = __bch2_btree_root_read(trans, id, &r->key, r->level);
+	mutex_unlock(&c->btree_root_read_lock);
+
+	return ret;
+}
+
 static void bch2_btree_complete_write(struct bch_fs *c, struct btree *b,
 				      struct btree_write *w)
 {
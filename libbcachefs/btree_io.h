@@ -133,6 +133,7 @@ int bch2_btree_node_read_done(struct bch_fs *, struct bch_dev *,
 void bch2_btree_node_read(struct btree_trans *, struct btree *, bool);
 int bch2_btree_root_read(struct bch_fs *, enum btree_id,
 			 const struct bkey_i *, unsigned);
+int bch2_btree_root_read_lazy(struct btree_trans *, enum btree_id);
 
 bool bch2_btree_post_write_cleanup(struct bch_fs *, struct btree *);
 
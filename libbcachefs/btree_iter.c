@@ -4,11 +4,13 @@
 #include "bkey_methods.h"
 #include "bkey_buf.h"
 #include "btree_cache.h"
+#include "btree_io.h"
 #include "btree_iter.h"
 #include "btree_journal_iter.h"
 #include "btree_key_cache.h"
 #include "btree_locking.h"
 #include "btree_update.h"
+#include "darray.h"
 #include "debug.h"
 #include "error.h"
 #include "extents.h"
@@ -18,8 +20,10 @@
 #include "snapshot.h"
 #include "trace.h"
 
+#include <linux/blkdev.h>
 #include <linux/random.h>
 #include <linux/prefetch.h>
+#include <linux/sort.h>
 
 static inline void btree_path_list_remove(struct btree_trans *, struct btree_path *);
 static inline void btree_path_list_add(struct btree_trans *,
@@ -741,6 +745,14 @@ static inline int btree_path_lock_root(struct btree_trans *trans,
 
 	while (1) {
 		b = READ_ONCE(*rootp);
+		if (unlikely(!b)) {
+			/* lazy_open: this root hasn't been read yet */
+			ret = bch2_btree_root_read_lazy(trans, path->btree_id);
+			if (ret)
+				return ret;
+			continue;
+		}
+
 		path->level = READ_ONCE(b->c.level);
 
 		if (unlikely(path->level < depth_want)) {
@@ -796,11 +808,13 @@ static int btree_path_prefetch(struct btree_trans *trans, struct btree_path *pat
 	struct bkey_buf tmp;
 	unsigned nr = test_bit(BCH_FS_started, &c->flags)
 		? (path->level > 1 ? 0 :  2)
-		: (path->level > 1 ? 1 : 16);
+		: c->opts.btree_node_prefetch_limit;
 	bool was_locked = btree_node_locked(path, path->level);
+	struct blk_plug plug;
 	int ret = 0;
 
 	bch2_bkey_buf_init(&tmp);
+	blk_start_plug(&plug);
 
 	while (nr-- && !ret) {
 		if (!bch2_btree_node_relock(trans, path, path->level))
@@ -816,6 +830,8 @@ static int btree_path_prefetch(struct btree_trans *trans, struct btree_path *pat
 					       path->level - 1);
 	}
 
+	blk_finish_plug(&plug);
+
 	if (!was_locked)
 		btree_node_unlock(trans, path, path->level);
 
@@ -831,11 +847,13 @@ static int btree_path_prefetch_j(struct btree_trans *trans, struct btree_path *p
 	struct bkey_buf tmp;
 	unsigned nr = test_bit(BCH_FS_started, &c->flags)
 		? (path->level > 1 ? 0 :  2)
-		: (path->level > 1 ? 1 : 16);
+		: c->opts.btree_node_prefetch_limit;
 	bool was_locked = btree_node_locked(path, path->level);
+	struct blk_plug plug;
 	int ret = 0;
 
 	bch2_bkey_buf_init(&tmp);
+	blk_start_plug(&plug);
 
 	while (nr-- && !ret) {
 		if (!bch2_btree_node_relock(trans, path, path->level))
@@ -851,6 +869,8 @@ static int btree_path_prefetch_j(struct btree_trans *trans, struct btree_path *p
 					       path->level - 1);
 	}
 
+	blk_finish_plug(&plug);
+
 	if (!was_locked)
 		btree_node_unlock(trans, path, path->level);
 
@@ -1364,6 +1384,108 @@ void __noreturn bch2_trans_restart_error(struct btree_trans *trans, u32 restart_
 	      (void *) trans->last_begin_ip);
 }
 
+void bch2_trans_restart_account(struct btree_trans *trans, int err, unsigned long ip)
+{
+	struct btree_transaction_stats *s = btree_trans_stats(trans);
+
+	if (!s)
+		return;
+
+	for (struct trans_restart_count *r = s->restarts;
+	     r < s->restarts + ARRAY_SIZE(s->restarts);
+	     r++) {
+		unsigned long old = READ_ONCE(r->ip);
+
+		if (!old && (old = cmpxchg(&r->ip, 0, ip)) == 0) {
+			r->err = err;
+			old = ip;
+		}
+
+		if (old == ip) {
+			atomic64_inc(&r->count);
+			return;
+		}
+	}
+
+	/* table full for this transaction context; drop on the floor */
+}
+
+struct trans_restart_site {
+	u64		count;
+	unsigned long	ip;
+	unsigned	err;
+	const char	*fn;
+};
+
+static int trans_restart_site_cmp(const void *_l, const void *_r)
+{
+	const struct trans_restart_site *l = _l, *r = _r;
+
+	return cmp_int(r->count, l->count);
+}
+
+/*
+ * Restart report: top restart sites across all transaction contexts, sorted
+ * by count. ips resolve with addr2line/gdb against this binary (or
+ * kallsyms, in the kernel):
+ */
+void bch2_trans_restarts_to_text(struct printbuf *out, struct bch_fs *c,
+				 u64 elapsed_ns)
+{
+	DARRAY(struct trans_restart_site) sites = { 0 };
+	u64 total = 0;
+
+	for (unsigned i = 0; i < BCH_TRANSACTIONS_NR; i++) {
+		struct btree_transaction_stats *s = &c->btree_transaction_stats[i];
+
+		for (struct trans_restart_count *r = s->restarts;
+		     r < s->restarts + ARRAY_SIZE(s->restarts);
+		     r++) {
+			u64 count = atomic64_read(&r->count);
+
+			if (!count)
+				continue;
+
+			total += count;
+			darray_push(&sites, ((struct trans_restart_site) {
+				.count	= count,
+				.ip	= r->ip,
+				.err	= r->err,
+				.fn	= bch2_btree_transaction_fns[i] ?:
+					  "(unknown)",
+			}));
+		}
+	}
+
+	if (!total) {
+		prt_printf(out, "no transaction restarts recorded");
+		prt_newline(out);
+		darray_exit(&sites);
+		return;
+	}
+
+	prt_printf(out, "%llu transaction restarts", total);
+	if (elapsed_ns)
+		prt_printf(out, " (%llu/sec)",
+			   div64_u64(total * NSEC_PER_SEC, elapsed_ns));
+	prt_newline(out);
+
+	sort(sites.data, sites.nr, sizeof(sites.data[0]),
+	     trans_restart_site_cmp, NULL);
+
+	darray_for_each(sites, s) {
+		prt_printf(out, "%10llu %3llu%% %-40s %s (ip %lx)",
+			   s->count,
+			   s->count * 100 / total,
+			   bch2_err_str(s->err),
+			   s->fn,
+			   s->ip);
+		prt_newline(out);
+	}
+
+	darray_exit(&sites);
+}
+
 void __noreturn bch2_trans_in_restart_error(struct btree_trans *trans)
 {
 	panic("in transaction restart: %s, last restarted by %pS\n",
@@ -1597,7 +1719,6 @@ btree_path_idx_t bch2_path_get(struct btree_trans *trans,
 	struct btree_path *path;
 	bool cached = flags & BTREE_ITER_CACHED;
 	bool intent = flags & BTREE_ITER_INTENT;
-	struct trans_for_each_path_inorder_iter iter;
 	btree_path_idx_t path_pos = 0, path_idx;
 
 	bch2_trans_verify_not_in_restart(trans);
@@ -1605,15 +1726,27 @@ btree_path_idx_t bch2_path_get(struct btree_trans *trans,
 
 	btree_trans_sort_paths(trans);
 
-	trans_for_each_path_inorder(trans, path, iter) {
-		if (__btree_path_cmp(path,
-				     btree_id,
-				     cached,
-				     pos,
-				     level) > 0)
-			break;
+	/*
+	 * Binary search for the last path that sorts <= the one we want -
+	 * transactions can accumulate dozens of paths (fsck's extent passes
+	 * keep ~40 live), enough for a linear scan per lookup to show up in
+	 * profiles:
+	 */
+	{
+		unsigned l = 0, r = trans->nr_sorted;
 
-		path_pos = iter.path_idx;
+		while (l < r) {
+			unsigned m = l + ((r - l) >> 1);
+
+			if (__btree_path_cmp(trans->paths + trans->sorted[m],
+					     btree_id, cached, pos, level) > 0)
+				r = m;
+			else
+				l = m + 1;
+		}
+
+		if (l)
+			path_pos = trans->sorted[l - 1];
 	}
 
 	if (path_pos &&
@@ -2943,12 +3076,15 @@ struct btree_trans *__bch2_trans_get(struct bch_fs *c, unsigned fn_idx)
 {
 	struct btree_trans *trans;
 
-	if (IS_ENABLED(__KERNEL__)) {
-		trans = this_cpu_xchg(c->btree_trans_bufs->trans, NULL);
-		if (trans) {
-			memset(trans, 0, offsetof(struct btree_trans, list));
-			goto got_trans;
-		}
+	trans = this_cpu_xchg(c->btree_trans_bufs->trans, NULL);
+	if (trans) {
+		void *mem		= trans->mem;
+		unsigned mem_bytes	= trans->mem_bytes;
+
+		memset(trans, 0, offsetof(struct btree_trans, list));
+		trans->mem		= mem;
+		trans->mem_bytes	= mem_bytes;
+		goto got_trans;
 	}
 
 	trans = mempool_alloc(&c->btree_trans_pool, GFP_NOFS);
@@ -3006,7 +3142,7 @@ got_trans:
 
 		struct btree_transaction_stats *s = &c->btree_transaction_stats[fn_idx];
 
-		if (s->max_mem) {
+		if (s->max_mem && !trans->mem) {
 			unsigned expected_mem_bytes = roundup_pow_of_two(s->max_mem);
 
 			trans->mem = kmalloc(expected_mem_bytes, GFP_KERNEL);
@@ -3085,16 +3221,24 @@ void bch2_trans_put(struct btree_trans *trans)
 	if (paths_allocated != trans->_paths_allocated)
 		kfree_rcu_mightsleep(paths_allocated);
 
-	if (trans->mem_bytes == BTREE_TRANS_MEM_MAX)
+	if (trans->mem_bytes == BTREE_TRANS_MEM_MAX) {
 		mempool_free(trans->mem, &c->btree_trans_mem_pool);
-	else
-		kfree(trans->mem);
+		trans->mem = NULL;
+		trans->mem_bytes = 0;
+	}
 
-	/* Userspace doesn't have a real percpu implementation: */
-	if (IS_ENABLED(__KERNEL__))
-		trans = this_cpu_xchg(c->btree_trans_bufs->trans, trans);
+	/*
+	 * Cache the trans together with its arena, so that steady state trans
+	 * get/put cycles don't hit the allocator at all. In userspace the
+	 * percpu shim backs this with per thread slots, which are recycled
+	 * across threads - this_cpu_xchg() in the shim stays atomic to cover
+	 * a slot's previous owner still draining it:
+	 */
+	trans = this_cpu_xchg(c->btree_trans_bufs->trans, trans);
 
 	if (trans) {
+		kfree(trans->mem);
+
 		closure_sync(&trans->ref);
 
 		seqmutex_lock(&c->btree_trans_lock);
@@ -3205,7 +3349,11 @@ void bch2_fs_btree_iter_exit(struct bch_fs *c)
 			struct btree_trans *trans =
 				per_cpu_ptr(c->btree_trans_bufs, cpu)->trans;
 
+			/* in userspace, every "cpu" shares one slot: */
+			per_cpu_ptr(c->btree_trans_bufs, cpu)->trans = NULL;
+
 			if (trans) {
+				kfree(trans->mem);
 				closure_sync(&trans->ref);
 
 				seqmutex_lock(&c->btree_trans_lock);
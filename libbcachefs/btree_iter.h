@@ -309,6 +309,9 @@ static inline void bch2_trans_verify_not_in_restart(struct btree_trans *trans)
 		bch2_trans_in_restart_error(trans);
 }
 
+void bch2_trans_restart_account(struct btree_trans *, int, unsigned long);
+void bch2_trans_restarts_to_text(struct printbuf *, struct bch_fs *, u64);
+
 __always_inline
 static int btree_trans_restart_nounlock(struct btree_trans *trans, int err)
 {
@@ -317,6 +320,7 @@ static int btree_trans_restart_nounlock(struct btree_trans *trans, int err)
 
 	trans->restarted = err;
 	trans->last_restarted_ip = _THIS_IP_;
+	bch2_trans_restart_account(trans, err, trans->last_restarted_ip);
 	return -err;
 }
 
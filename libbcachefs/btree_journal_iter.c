@@ -47,16 +47,39 @@ static size_t __bch2_journal_key_search(struct journal_keys *keys,
 					enum btree_id id, unsigned level,
 					struct bpos pos)
 {
-	size_t l = 0, r = keys->nr, m;
+	size_t gap_size = keys->size - keys->nr;
+	size_t l, r, m;
+
+	keys->nr_searches++;
+
+	/*
+	 * The gap buffer is two sorted contiguous regions with the empty space
+	 * at @gap between them; one comparison against the last key before the
+	 * gap picks the region, and the binary search then probes plain array
+	 * indexes instead of remapping across the gap on every iteration:
+	 */
+	if (keys->gap == keys->nr ||
+	    (keys->gap &&
+	     __journal_key_cmp(id, level, pos, keys->d + keys->gap - 1) <= 0)) {
+		l = 0;
+		r = keys->gap;
+	} else {
+		l = keys->gap + gap_size;
+		r = keys->size;
+	}
 
 	while (l < r) {
 		m = l + ((r - l) >> 1);
-		if (__journal_key_cmp(id, level, pos, idx_to_key(keys, m)) > 0)
+		if (__journal_key_cmp(id, level, pos, keys->d + m) > 0)
 			l = m + 1;
 		else
 			r = m;
 	}
 
+	/* back to a logical index: */
+	if (l > keys->gap)
+		l -= gap_size;
+
 	BUG_ON(l < keys->nr &&
 	       __journal_key_cmp(id, level, pos, idx_to_key(keys, l)) > 0);
 
@@ -175,10 +198,13 @@ int bch2_journal_key_insert_take(struct bch_fs *c, enum btree_id id,
 		.journal_seq	= U32_MAX,
 	};
 	struct journal_keys *keys = &c->journal_keys;
+	u64 start_time = local_clock();
 	size_t idx = bch2_journal_key_search(keys, id, level, k->k.p);
 
 	BUG_ON(test_bit(BCH_FS_rw, &c->flags));
 
+	keys->nr_inserts++;
+
 	if (idx < keys->size &&
 	    journal_key_cmp(&n, &keys->d[idx]) == 0) {
 		if (keys->d[idx].allocated)
@@ -224,6 +250,8 @@ int bch2_journal_key_insert_take(struct bch_fs *c, enum btree_id id,
 
 	journal_iters_fix(c);
 
+	bch2_time_stats_update(&c->times[BCH_TIME_journal_key_insert], start_time);
+
 	return 0;
 }
 
@@ -434,6 +462,21 @@ static int journal_sort_key_cmp(const void *_l, const void *_r)
 		cmp_int(l->journal_offset, r->journal_offset);
 }
 
+/*
+ * Radix sort prefix for journal_sort_key_cmp(): btree, level and the top bits
+ * of the position's inode field. Comparing through ->k is a cache miss per
+ * comparison on a big journal; the prefix lets the radix passes run over flat
+ * records and leaves only same-inode-range ties for the comparator.
+ */
+static u64 journal_sort_key_prefix(const void *_k)
+{
+	const struct journal_key *k = _k;
+
+	return	((u64) k->btree_id	<< 56)|
+		((u64) k->level		<< 48)|
+		(k->k->k.p.inode	>> 16);
+}
+
 void bch2_journal_keys_put(struct bch_fs *c)
 {
 	struct journal_keys *keys = &c->journal_keys;
@@ -458,11 +501,50 @@ void bch2_journal_keys_put(struct bch_fs *c)
 	bch2_journal_entries_free(c);
 }
 
+/*
+ * Journal replay preprocessing: __journal_keys_sort() deduplicated to the
+ * newest version per (btree, level, pos) when the keys were read, but keys are
+ * additionally marked overwritten after sorting, by updates from recovery
+ * passes that run before replay. Compact those out so replay doesn't pay a
+ * transaction commit per dead key.
+ *
+ * Adjacent extent overwrites are deliberately not merged here: replay inserts
+ * at exact positions (BTREE_ITER_NOT_EXTENTS), so dropping an absorbed key's
+ * position would leave a stale key at that position in the btree unshadowed.
+ */
+void bch2_journal_keys_compact(struct bch_fs *c)
+{
+	struct journal_keys *keys = &c->journal_keys;
+	struct journal_key *src, *dst;
+
+	/* after we go RW the gap is pinned at the end of the buffer: */
+	BUG_ON(keys->gap != keys->nr);
+
+	src = dst = keys->d;
+	while (src < keys->d + keys->nr) {
+		if (src->overwritten) {
+			if (src->allocated)
+				kfree(src->k);
+			src++;
+			continue;
+		}
+
+		*dst++ = *src++;
+	}
+
+	if (dst - keys->d != keys->nr)
+		bch_verbose(c, "Journal keys: dropped %zu overwritten keys before replay",
+			    keys->nr - (dst - keys->d));
+
+	keys->nr = keys->gap = dst - keys->d;
+}
+
 static void __journal_keys_sort(struct journal_keys *keys)
 {
 	struct journal_key *src, *dst;
 
-	sort(keys->d, keys->nr, sizeof(keys->d[0]), journal_sort_key_cmp, NULL);
+	bch2_sort_radix(keys->d, keys->nr, sizeof(keys->d[0]),
+			journal_sort_key_prefix, journal_sort_key_cmp);
 
 	src = dst = keys->d;
 	while (src < keys->d + keys->nr) {
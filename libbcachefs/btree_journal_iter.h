@@ -49,6 +49,7 @@ void bch2_btree_and_journal_iter_init_node_iter(struct btree_and_journal_iter *,
 						struct bch_fs *,
 						struct btree *);
 
+void bch2_journal_keys_compact(struct bch_fs *);
 void bch2_journal_keys_put(struct bch_fs *);
 
 static inline void bch2_journal_keys_put_initial(struct bch_fs *c)
@@ -370,6 +370,101 @@ btree_key_cache_create(struct btree_trans *trans, struct btree_path *path)
 	return ck;
 }
 
+/* How many keys past the one that missed a batched fill will populate: */
+#define BTREE_KEY_CACHE_FILL_BATCH	8
+
+/*
+ * Opportunistically add @k to the key cache, without involving a btree_path:
+ * the entry is created unlocked and valid, never dirty, so it doesn't touch
+ * the transaction's lock state. Allocations are nowait and failures just mean
+ * the next lookup fills the slow way.
+ */
+static void btree_key_cache_prefill_one(struct btree_trans *trans,
+					enum btree_id btree, struct bkey_s_c k)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_key_cache *bc = &c->btree_key_cache;
+	struct bkey_cached *ck;
+	unsigned u64s;
+
+	if (bch2_btree_key_cache_find(c, btree, k.k->p))
+		return;
+
+	ck = kmem_cache_zalloc(bch2_key_cache, GFP_NOWAIT|__GFP_NOWARN);
+	if (!ck)
+		return;
+
+	INIT_LIST_HEAD(&ck->list);
+	bch2_btree_lock_init(&ck->c, btree_uses_pcpu_readers(btree)
+			     ? SIX_LOCK_INIT_PCPU : 0);
+	ck->c.cached = true;
+	BUG_ON(!six_trylock_intent(&ck->c.lock));
+	BUG_ON(!six_trylock_write(&ck->c.lock));
+
+	ck->c.level		= 0;
+	ck->c.btree_id		= btree;
+	ck->key.btree_id	= btree;
+	ck->key.pos		= k.k->p;
+	ck->flags		= 1U << BKEY_CACHED_ACCESSED;
+
+	u64s = roundup_pow_of_two(min_t(unsigned, 256, ((k.k->u64s + 1) * 3) / 2));
+	ck->k = kmalloc(u64s * sizeof(u64), GFP_NOWAIT|__GFP_NOWARN);
+	if (!ck->k)
+		goto err;
+	ck->u64s = u64s;
+
+	bkey_reassemble(ck->k, k);
+	ck->valid = true;
+
+	/* We raced with another fill: */
+	if (unlikely(rhashtable_lookup_insert_fast(&bc->table, &ck->hash,
+						   bch2_btree_key_cache_params)))
+		goto err;
+
+	atomic_long_inc(&bc->nr_keys);
+
+	six_unlock_write(&ck->c.lock);
+	six_unlock_intent(&ck->c.lock);
+	return;
+err:
+	kfree(ck->k);
+	six_unlock_write(&ck->c.lock);
+	six_unlock_intent(&ck->c.lock);
+	kfree(ck);
+}
+
+/*
+ * A fill did a full btree traversal for a single key: populate the cache with
+ * the keys that follow in the leaf we landed in, so sequential walks of a
+ * cached btree (fsck checking runs of adjacent inodes, fuse walking a
+ * directory's inodes) don't pay a traversal per key.
+ */
+static int btree_key_cache_fill_batch(struct btree_trans *trans,
+				      struct btree_iter *iter)
+{
+	struct bpos leaf_end = btree_iter_path(trans, iter)->l[0].b->key.k.p;
+	struct bkey_s_c k;
+	int ret;
+
+	for (unsigned nr = 0; nr < BTREE_KEY_CACHE_FILL_BATCH; nr++) {
+		if (!bch2_btree_iter_advance(iter) ||
+		    bpos_gt(iter->pos, leaf_end))
+			break;
+
+		k = bch2_btree_iter_peek(iter);
+		ret = bkey_err(k);
+		if (ret)
+			return ret;
+
+		if (!k.k || bpos_gt(k.k->p, leaf_end))
+			break;
+
+		btree_key_cache_prefill_one(trans, iter->btree_id, k);
+	}
+
+	return 0;
+}
+
 static int btree_key_cache_fill(struct btree_trans *trans,
 				struct btree_path *ck_path,
 				struct bkey_cached *ck)
@@ -451,6 +546,13 @@ static int btree_key_cache_fill(struct btree_trans *trans,
 	ck->valid = true;
 	bch2_btree_node_unlock_write(trans, ck_path, ck_path->l[0].b);
 
+	/*
+	 * Not during journal replay: the journal overlay means keys read
+	 * straight from the leaf aren't necessarily current
+	 */
+	if (likely(!trans->journal_replay_not_finished))
+		ret = btree_key_cache_fill_batch(trans, &iter);
+
 	/* We're not likely to need this iterator again: */
 	set_btree_iter_dontneed(&iter);
 err:
@@ -208,6 +208,12 @@ static inline int __btree_node_lock_nopath(struct btree_trans *trans,
 	ret = six_lock_ip_waiter(&b->lock, type, &trans->locking_wait,
 				 bch2_six_check_for_deadlock, trans, ip);
 	WRITE_ONCE(trans->locking, NULL);
+
+	/* nonzero start_time means we hit the six lock slowpath: */
+	if (unlikely(trans->locking_wait.start_time) &&
+	    b->btree_id < BTREE_ID_NR)
+		atomic_long_inc(&trans->c->btree_lock_contended[b->btree_id]);
+
 	WRITE_ONCE(trans->locking_wait.start_time, 0);
 	return ret;
 }
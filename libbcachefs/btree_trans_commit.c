@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0
 
 #include "bcachefs.h"
+#include "btree_cache.h"
 #include "btree_gc.h"
 #include "btree_io.h"
 #include "btree_iter.h"
@@ -979,6 +980,151 @@ do_bch2_trans_commit_to_journal_replay(struct btree_trans *trans)
 	return ret;
 }
 
+/*
+ * Journal bandwidth shaping:
+ *
+ * All btree updates share journal bandwidth, so a steady stream of background
+ * updates - a backpointers flush during rebalance, say - can starve foreground
+ * commits and inflate their tail latency. We track bytes journalled per btree
+ * over a decaying window, and while the journal is under pressure, commits
+ * that only touch btrees over their weighted share of the window are briefly
+ * throttled.
+ *
+ * Weights are out of 16; a weight of 16 exempts a btree entirely. Allocator
+ * btrees are exempt - they're updated from journal reclaim and the write path,
+ * where a delay feeds back into everything else.
+ */
+#define BTREE_SHAPER_WEIGHT_MAX		16U
+#define BTREE_SHAPER_WINDOW		(HZ / 2)
+#define BTREE_SHAPER_MIN_BYTES		(1U << 20)
+#define BTREE_SHAPER_DELAY		(HZ / 100)
+
+static unsigned btree_commit_weight(enum btree_id btree)
+{
+	switch (btree) {
+	case BTREE_ID_alloc:
+	case BTREE_ID_lru:
+	case BTREE_ID_freespace:
+	case BTREE_ID_need_discard:
+	case BTREE_ID_bucket_gens:
+		return BTREE_SHAPER_WEIGHT_MAX;
+	case BTREE_ID_backpointers:
+	case BTREE_ID_rebalance_work:
+		return 4;
+	default:
+		return 12;
+	}
+}
+
+static void btree_commit_shaper_account(struct btree_trans *trans)
+{
+	struct btree_commit_shaper *sh = &trans->c->btree_commit_shaper;
+
+	trans_for_each_update(trans, i) {
+		if (i->key_cache_already_flushed ||
+		    (i->flags & BTREE_UPDATE_NOJOURNAL))
+			continue;
+
+		u64 bytes = jset_u64s(i->k->k.u64s) * sizeof(u64);
+
+		atomic64_add(bytes, &sh->bytes[i->btree_id]);
+		atomic64_add(bytes, &sh->total);
+	}
+
+	if (time_after(jiffies, sh->window_start + BTREE_SHAPER_WINDOW) &&
+	    spin_trylock(&sh->lock)) {
+		if (time_after(jiffies, sh->window_start + BTREE_SHAPER_WINDOW)) {
+			sh->window_start = jiffies;
+
+			for (unsigned i = 0; i < BTREE_ID_NR; i++) {
+				u64 v = atomic64_read(&sh->bytes[i]) / 2;
+
+				atomic64_sub(v, &sh->bytes[i]);
+				atomic64_sub(v, &sh->total);
+			}
+		}
+		spin_unlock(&sh->lock);
+	}
+}
+
+static noinline bool btree_commit_should_throttle(struct btree_trans *trans, unsigned flags)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_commit_shaper *sh = &c->btree_commit_shaper;
+	struct journal *j = &c->journal;
+
+	if ((flags & BCH_WATERMARK_MASK) >= BCH_WATERMARK_reclaim ||
+	    (flags & BCH_TRANS_COMMIT_journal_reclaim))
+		return false;
+
+	/*
+	 * Only shape when journal bandwidth is actually contended - the
+	 * watermark's been raised, or clean journal space is under half.
+	 * Unlocked reads; this is a heuristic:
+	 */
+	if (j->watermark == BCH_WATERMARK_stripe &&
+	    j->space[journal_space_clean].total * 2 >=
+	    j->space[journal_space_total].total)
+		return false;
+
+	u64 total = atomic64_read(&sh->total);
+	if (total < BTREE_SHAPER_MIN_BYTES)
+		return false;
+
+	bool have_updates = false;
+
+	trans_for_each_update(trans, i) {
+		unsigned w = btree_commit_weight(i->btree_id);
+
+		if (w >= BTREE_SHAPER_WEIGHT_MAX)
+			return false;
+
+		if (atomic64_read(&sh->bytes[i->btree_id]) * BTREE_SHAPER_WEIGHT_MAX <=
+		    total * w)
+			return false;
+
+		have_updates = true;
+	}
+
+	return have_updates;
+}
+
+static noinline int btree_commit_throttle(struct btree_trans *trans)
+{
+	count_event(trans->c, trans_commit_throttled);
+
+	bch2_trans_unlock(trans);
+
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_timeout(BTREE_SHAPER_DELAY);
+
+	return bch2_trans_relock(trans);
+}
+
+void bch2_btree_commit_stats_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	struct btree_commit_shaper *sh = &c->btree_commit_shaper;
+
+	printbuf_tabstop_push(out, 20);
+	printbuf_tabstop_push(out, 10);
+	printbuf_tabstop_push(out, 10);
+
+	prt_tab(out);
+	prt_str(out, "weight");
+	prt_tab(out);
+	prt_str(out, "bytes");
+	prt_newline(out);
+
+	for (unsigned i = 0; i < BTREE_ID_NR; i++) {
+		prt_printf(out, "%s:", bch2_btree_id_str(i));
+		prt_tab(out);
+		prt_printf(out, "%u/%u", btree_commit_weight(i), BTREE_SHAPER_WEIGHT_MAX);
+		prt_tab(out);
+		prt_human_readable_u64(out, atomic64_read(&sh->bytes[i]));
+		prt_newline(out);
+	}
+}
+
 int __bch2_trans_commit(struct btree_trans *trans, unsigned flags)
 {
 	struct btree_insert_entry *errored_at = NULL;
@@ -1043,6 +1189,13 @@ int __bch2_trans_commit(struct btree_trans *trans, unsigned flags)
 
 	EBUG_ON(test_bit(BCH_FS_clean_shutdown, &c->flags));
 
+	if (c->opts.journal_write_shaping &&
+	    unlikely(btree_commit_should_throttle(trans, flags))) {
+		ret = btree_commit_throttle(trans);
+		if (ret)
+			goto out;
+	}
+
 	trans->journal_u64s		= trans->journal_entries_u64s;
 	trans->journal_transaction_names = READ_ONCE(c->opts.journal_transaction_names);
 	if (trans->journal_transaction_names)
@@ -1096,6 +1249,10 @@ retry:
 		goto err;
 
 	trace_and_count(c, transaction_commit, trans, _RET_IP_);
+
+	if (c->opts.journal_write_shaping &&
+	    likely(!(flags & BCH_TRANS_COMMIT_no_journal_res)))
+		btree_commit_shaper_account(trans);
 out:
 	if (likely(!(flags & BCH_TRANS_COMMIT_no_check_rw)))
 		bch2_write_ref_put(c, BCH_WRITE_REF_trans);
@@ -165,6 +165,11 @@ struct btree_cache {
 	atomic_t		dirty;
 	struct shrinker		*shrink;
 
+	/* cache telemetry: */
+	atomic64_t		hits;
+	atomic64_t		misses;
+	atomic64_t		nr_reclaimed;
+
 	/*
 	 * If we need to allocate memory for a new btree node and that
 	 * allocation fails, we can cannibalize another node in the btree cache
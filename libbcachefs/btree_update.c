@@ -253,8 +253,20 @@ int bch2_trans_update_extent_overwrite(struct btree_trans *trans,
 				update->k.type = KEY_TYPE_whiteout;
 		}
 
-		ret = bch2_btree_insert_nonextent(trans, btree_id, update,
-					  BTREE_UPDATE_INTERNAL_SNAPSHOT_NODE|flags);
+		/*
+		 * A bulk overwrite of a fragmented range queues one whiteout
+		 * per existing extent, and they all go at @iter's current
+		 * position when we're in the same snapshot - queue them
+		 * through @iter's path instead of doing a fresh path lookup
+		 * per key:
+		 */
+		if (bpos_eq(update->k.p, iter->pos))
+			ret = bch2_trans_update_by_path(trans, iter->path, update,
+						  BTREE_UPDATE_INTERNAL_SNAPSHOT_NODE|
+						  flags, _RET_IP_);
+		else
+			ret = bch2_btree_insert_nonextent(trans, btree_id, update,
+						  BTREE_UPDATE_INTERNAL_SNAPSHOT_NODE|flags);
 		if (ret)
 			return ret;
 	}
@@ -645,6 +657,54 @@ int bch2_btree_insert_trans(struct btree_trans *trans, enum btree_id id,
 	return ret;
 }
 
+/**
+ * bch2_btree_bulk_insert - insert a sorted run of keys through one iterator
+ * @trans:	btree transaction object
+ * @id:		btree to insert into
+ * @keys:	sorted list of keys to insert
+ * @flags:	transaction commit flags
+ *
+ * For bulk population paths (migrate, sequential imports) that insert runs of
+ * already-sorted keys: instead of a fresh iterator - and a full root-to-leaf
+ * traversal - per key, the run walks forward through a single intent
+ * iterator. Each reposition starts from the leaf the previous key landed in,
+ * so keys after the first are node-local repositions except when the run
+ * crosses a leaf boundary. Updates referencing the old position keep their
+ * own path; bch2_btree_path_make_mut() dups the path when it's repositioned
+ * out from under them.
+ *
+ * The caller commits; size runs so one run's updates fit in a single commit.
+ *
+ * Returns:	0 on success, error code on failure
+ */
+int bch2_btree_bulk_insert(struct btree_trans *trans, enum btree_id id,
+			   struct keylist *keys, enum btree_update_flags flags)
+{
+	struct btree_iter iter;
+	int ret = 0;
+
+	if (bch2_keylist_empty(keys))
+		return 0;
+
+	bch2_verify_keylist_sorted(keys);
+
+	bch2_trans_iter_init(trans, &iter, id,
+			     bkey_start_pos(&bch2_keylist_front(keys)->k),
+			     BTREE_ITER_INTENT);
+
+	for_each_keylist_key(keys, k) {
+		bch2_btree_iter_set_pos(&iter, bkey_start_pos(&k->k));
+
+		ret   = bch2_btree_iter_traverse(&iter) ?:
+			bch2_trans_update(trans, &iter, k, flags);
+		if (ret)
+			break;
+	}
+
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
 /**
  * bch2_btree_insert - insert keys into the extent btree
  * @c:			pointer to struct bch_fs
@@ -7,6 +7,7 @@
 
 struct bch_fs;
 struct btree;
+struct keylist;
 
 void bch2_btree_node_prep_for_write(struct btree_trans *,
 				    struct btree_path *, struct btree *);
@@ -56,6 +57,8 @@ int bch2_btree_insert_trans(struct btree_trans *, enum btree_id, struct bkey_i *
 			enum btree_update_flags);
 int bch2_btree_insert(struct bch_fs *, enum btree_id, struct bkey_i *,
 		     struct disk_reservation *, int flags);
+int bch2_btree_bulk_insert(struct btree_trans *, enum btree_id,
+			   struct keylist *, enum btree_update_flags);
 
 int bch2_btree_delete_range_trans(struct btree_trans *, enum btree_id,
 				  struct bpos, struct bpos, unsigned, u64 *);
@@ -144,6 +147,8 @@ void bch2_trans_commit_hook(struct btree_trans *,
 			    struct btree_trans_commit_hook *);
 int __bch2_trans_commit(struct btree_trans *, unsigned);
 
+void bch2_btree_commit_stats_to_text(struct printbuf *, struct bch_fs *);
+
 __printf(2, 3) int bch2_fs_log_msg(struct bch_fs *, const char *, ...);
 __printf(2, 3) int bch2_journal_log_msg(struct bch_fs *, const char *, ...);
 
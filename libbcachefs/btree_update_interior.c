@@ -503,6 +503,14 @@ err:
 
 /* Asynchronous interior node update machinery */
 
+/*
+ * Write-behind window: how many completed interior updates may run their final
+ * transactional commit concurrently. Bounded so a burst of splits can't eat
+ * the whole worker pool, but > 1 so the commit work of one update overlaps
+ * another waiting on its old nodes' writes.
+ */
+#define BTREE_INTERIOR_UPDATE_WRITE_BEHIND	4
+
 static void bch2_btree_update_free(struct btree_update *as, struct btree_trans *trans)
 {
 	struct bch_fs *c = as->c;
@@ -753,27 +761,6 @@ err:
 	bch2_trans_put(trans);
 }
 
-static void btree_interior_update_work(struct work_struct *work)
-{
-	struct bch_fs *c =
-		container_of(work, struct bch_fs, btree_interior_update_work);
-	struct btree_update *as;
-
-	while (1) {
-		mutex_lock(&c->btree_interior_update_lock);
-		as = list_first_entry_or_null(&c->btree_interior_updates_unwritten,
-					      struct btree_update, unwritten_list);
-		if (as && !as->nodes_written)
-			as = NULL;
-		mutex_unlock(&c->btree_interior_update_lock);
-
-		if (!as)
-			break;
-
-		btree_update_nodes_written(as);
-	}
-}
-
 static CLOSURE_CALLBACK(btree_update_set_nodes_written)
 {
 	closure_type(as, struct btree_update, cl);
@@ -783,7 +770,16 @@ static CLOSURE_CALLBACK(btree_update_set_nodes_written)
 	as->nodes_written = true;
 	mutex_unlock(&c->btree_interior_update_lock);
 
-	queue_work(c->btree_interior_update_worker, &c->btree_interior_update_work);
+	/*
+	 * We're on btree_interior_update_worker, which runs up to
+	 * BTREE_INTERIOR_UPDATE_WRITE_BEHIND updates at once: process this
+	 * update directly instead of funneling everything through a single
+	 * FIFO work item, so an update stalled waiting on an old node's write
+	 * doesn't hold up updates behind it that are ready to commit.
+	 * Dependencies between updates are already tracked explicitly, via
+	 * each update's journal pin and the node write blocking machinery.
+	 */
+	btree_update_nodes_written(as);
 }
 
 /*
@@ -2475,7 +2471,6 @@ void bch2_fs_btree_interior_update_init_early(struct bch_fs *c)
 	INIT_LIST_HEAD(&c->btree_interior_update_list);
 	INIT_LIST_HEAD(&c->btree_interior_updates_unwritten);
 	mutex_init(&c->btree_interior_update_lock);
-	INIT_WORK(&c->btree_interior_update_work, btree_interior_update_work);
 
 	INIT_LIST_HEAD(&c->pending_node_rewrites);
 	mutex_init(&c->pending_node_rewrites_lock);
@@ -2484,7 +2479,8 @@ void bch2_fs_btree_interior_update_init_early(struct bch_fs *c)
 int bch2_fs_btree_interior_update_init(struct bch_fs *c)
 {
 	c->btree_interior_update_worker =
-		alloc_workqueue("btree_update", WQ_UNBOUND|WQ_MEM_RECLAIM, 1);
+		alloc_workqueue("btree_update", WQ_UNBOUND|WQ_MEM_RECLAIM,
+				BTREE_INTERIOR_UPDATE_WRITE_BEHIND);
 	if (!c->btree_interior_update_worker)
 		return -BCH_ERR_ENOMEM_btree_interior_update_worker_init;
 
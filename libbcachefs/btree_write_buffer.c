@@ -193,18 +193,65 @@ btree_write_buffered_insert(struct btree_trans *trans,
 	return ret;
 }
 
+/*
+ * Drain spilled keys back into the flushing buffer. Only done when both
+ * buffers are empty: keys in the overflow reserve interleave in journal seq
+ * with whatever @inc held when they were spilled, and the flush path - both
+ * the slowpath's pin advancement and the same-position dedup, which breaks
+ * ties by array index - requires @flushing in journal order. With both
+ * buffers empty, everything that arrives after the drain is strictly newer.
+ *
+ * If we can't drain this time, the overflow pin keeps the journal entries
+ * alive and brings us back for another flush.
+ */
+static void wb_drain_overflow(struct btree_write_buffer *wb)
+{
+	struct bch_fs *c = container_of(wb, struct bch_fs, btree_write_buffer);
+	struct journal *j = &c->journal;
+
+	mutex_lock(&wb->overflow.lock);
+	size_t nr = wb->overflow.keys.nr;
+	if (!nr)
+		goto out;
+
+	darray_resize(&wb->flushing.keys, nr);
+	darray_resize(&wb->sorted, wb->flushing.keys.size);
+
+	if (nr > min(wb->flushing.keys.size, wb->sorted.size))
+		goto out;
+
+	bch2_journal_pin_add(j, wb->overflow.keys.data[0].journal_seq,
+			     &wb->flushing.pin,
+			     bch2_btree_write_buffer_journal_flush);
+
+	memcpy(wb->flushing.keys.data,
+	       wb->overflow.keys.data,
+	       sizeof(wb->overflow.keys.data[0]) * nr);
+	wb->flushing.keys.nr	= nr;
+	wb->overflow.keys.nr	= 0;
+
+	bch2_journal_pin_drop(j, &wb->overflow.pin);
+out:
+	mutex_unlock(&wb->overflow.lock);
+}
+
 static void move_keys_from_inc_to_flushing(struct btree_write_buffer *wb)
 {
 	struct bch_fs *c = container_of(wb, struct bch_fs, btree_write_buffer);
 	struct journal *j = &c->journal;
 
+	if (!wb->flushing.keys.nr && !wb->inc.keys.nr)
+		wb_drain_overflow(wb);
+
 	if (!wb->inc.keys.nr)
 		return;
 
 	bch2_journal_pin_add(j, wb->inc.keys.data[0].journal_seq, &wb->flushing.pin,
 			     bch2_btree_write_buffer_journal_flush);
 
-	darray_resize(&wb->flushing.keys, min_t(size_t, 1U << 20, wb->flushing.keys.nr + wb->inc.keys.nr));
+	darray_resize(&wb->flushing.keys,
+		      min_t(size_t, BTREE_WRITE_BUFFER_KEYS_MAX,
+			    wb->flushing.keys.nr + wb->inc.keys.nr));
 	darray_resize(&wb->sorted, wb->flushing.keys.size);
 
 	if (!wb->flushing.keys.nr && wb->sorted.size >= wb->inc.keys.nr) {
@@ -242,59 +289,28 @@ out:
 	BUG_ON(wb->sorted.size < wb->flushing.keys.nr);
 }
 
-static int bch2_btree_write_buffer_flush_locked(struct btree_trans *trans)
+static int wb_flush_keys_range(struct btree_trans *trans,
+			       struct wb_key_ref *start, struct wb_key_ref *end,
+			       size_t *skipped, size_t *fast, size_t *slowpath)
 {
-	struct bch_fs *c = trans->c;
-	struct journal *j = &c->journal;
-	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	struct btree_write_buffer *wb = &trans->c->btree_write_buffer;
 	struct btree_iter iter = { NULL };
-	size_t skipped = 0, fast = 0, slowpath = 0;
 	bool write_locked = false;
 	int ret = 0;
 
-	bch2_trans_unlock(trans);
-	bch2_trans_begin(trans);
-
-	mutex_lock(&wb->inc.lock);
-	move_keys_from_inc_to_flushing(wb);
-	mutex_unlock(&wb->inc.lock);
-
-	for (size_t i = 0; i < wb->flushing.keys.nr; i++) {
-		wb->sorted.data[i].idx = i;
-		wb->sorted.data[i].btree = wb->flushing.keys.data[i].btree;
-		memcpy(&wb->sorted.data[i].pos, &wb->flushing.keys.data[i].k.k.p, sizeof(struct bpos));
-	}
-	wb->sorted.nr = wb->flushing.keys.nr;
-
-	/*
-	 * We first sort so that we can detect and skip redundant updates, and
-	 * then we attempt to flush in sorted btree order, as this is most
-	 * efficient.
-	 *
-	 * However, since we're not flushing in the order they appear in the
-	 * journal we won't be able to drop our journal pin until everything is
-	 * flushed - which means this could deadlock the journal if we weren't
-	 * passing BCH_TRANS_COMMIT_journal_reclaim. This causes the update to fail
-	 * if it would block taking a journal reservation.
-	 *
-	 * If that happens, simply skip the key so we can optimistically insert
-	 * as many keys as possible in the fast path.
-	 */
-	wb_sort(wb->sorted.data, wb->sorted.nr);
-
-	darray_for_each(wb->sorted, i) {
+	for (struct wb_key_ref *i = start; i < end; i++) {
 		struct btree_write_buffered_key *k = &wb->flushing.keys.data[i->idx];
 
-		for (struct wb_key_ref *n = i + 1; n < min(i + 4, &darray_top(wb->sorted)); n++)
+		for (struct wb_key_ref *n = i + 1; n < min(i + 4, end); n++)
 			prefetch(&wb->flushing.keys.data[n->idx]);
 
 		BUG_ON(!k->journal_seq);
 
-		if (i + 1 < &darray_top(wb->sorted) &&
+		if (i + 1 < end &&
 		    wb_key_eq(i, i + 1)) {
 			struct btree_write_buffered_key *n = &wb->flushing.keys.data[i[1].idx];
 
-			skipped++;
+			(*skipped)++;
 			n->journal_seq = min_t(u64, n->journal_seq, k->journal_seq);
 			k->journal_seq = 0;
 			continue;
@@ -325,7 +341,7 @@ static int bch2_btree_write_buffer_flush_locked(struct btree_trans *trans)
 				break;
 			}
 
-			ret = wb_flush_one(trans, &iter, k, &write_locked, &fast);
+			ret = wb_flush_one(trans, &iter, k, &write_locked, fast);
 			if (!write_locked)
 				bch2_trans_begin(trans);
 		} while (bch2_err_matches(ret, BCH_ERR_transaction_restart));
@@ -333,7 +349,7 @@ static int bch2_btree_write_buffer_flush_locked(struct btree_trans *trans)
 		if (!ret) {
 			k->journal_seq = 0;
 		} else if (ret == -BCH_ERR_journal_reclaim_would_deadlock) {
-			slowpath++;
+			(*slowpath)++;
 			ret = 0;
 		} else
 			break;
@@ -344,6 +360,151 @@ static int bch2_btree_write_buffer_flush_locked(struct btree_trans *trans)
 		bch2_btree_node_unlock_write(trans, path, path->l[0].b);
 	}
 	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+struct wb_flush_work {
+	struct work_struct	work;
+	struct bch_fs		*c;
+	struct wb_key_ref	*start;
+	struct wb_key_ref	*end;
+	size_t			skipped;
+	size_t			fast;
+	size_t			slowpath;
+	int			ret;
+};
+
+static void wb_flush_work_fn(struct work_struct *work)
+{
+	struct wb_flush_work *w = container_of(work, struct wb_flush_work, work);
+	struct btree_trans *trans = bch2_trans_get(w->c);
+
+	w->ret = wb_flush_keys_range(trans, w->start, w->end,
+				     &w->skipped, &w->fast, &w->slowpath);
+	bch2_trans_put(trans);
+}
+
+/* Don't spin up workers for runs that a single thread flushes in a blink: */
+#define WB_FLUSH_KEYS_PER_WORKER	(1UL << 13)
+
+/*
+ * The sorted keys partition into contiguous runs by target leaf, so disjoint
+ * ranges of the sorted array (mostly) hit disjoint leaves and can be applied
+ * concurrently, each worker taking its own transaction and write locks. A
+ * leaf straddling two ranges just means brief write lock contention.
+ *
+ * Runs of equal keys must not straddle workers, though: the redundant-update
+ * skip is per worker, and two workers racing to insert equal keys to the same
+ * leaf could apply them in the wrong order.
+ */
+static int wb_flush_parallel(struct btree_trans *trans, unsigned nr_flushers,
+			     size_t *skipped, size_t *fast, size_t *slowpath)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	struct wb_key_ref *pos = wb->sorted.data;
+	struct wb_key_ref *top = wb->sorted.data + wb->sorted.nr;
+	int ret = 0;
+
+	struct wb_flush_work *w = kcalloc(nr_flushers, sizeof(*w), GFP_KERNEL);
+	if (!w)
+		return wb_flush_keys_range(trans, pos, top,
+					   skipped, fast, slowpath);
+
+	for (unsigned i = 0; i < nr_flushers; i++) {
+		struct wb_key_ref *end = i + 1 < nr_flushers
+			? wb->sorted.data + wb->sorted.nr * (i + 1) / nr_flushers
+			: top;
+
+		if (end < pos)
+			end = pos;
+		while (end > pos && end < top && wb_key_eq(end - 1, end))
+			end++;
+
+		w[i].c		= c;
+		w[i].start	= pos;
+		w[i].end	= end;
+		INIT_WORK(&w[i].work, wb_flush_work_fn);
+		queue_work(system_unbound_wq, &w[i].work);
+
+		pos = end;
+	}
+
+	for (unsigned i = 0; i < nr_flushers; i++) {
+		flush_work(&w[i].work);
+
+		*skipped	+= w[i].skipped;
+		*fast		+= w[i].fast;
+		*slowpath	+= w[i].slowpath;
+		ret = ret ?: w[i].ret;
+	}
+
+	kfree(w);
+	return ret;
+}
+
+static int bch2_btree_write_buffer_flush_locked(struct btree_trans *trans)
+{
+	struct bch_fs *c = trans->c;
+	struct journal *j = &c->journal;
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	size_t skipped = 0, fast = 0, slowpath = 0;
+	int ret = 0;
+
+	bch2_trans_unlock(trans);
+	bch2_trans_begin(trans);
+
+	mutex_lock(&wb->inc.lock);
+	move_keys_from_inc_to_flushing(wb);
+	mutex_unlock(&wb->inc.lock);
+
+	/*
+	 * Sizing autotune: the background flush kicks in at a quarter of
+	 * capacity, so occupancy reaching half means flushing isn't keeping up
+	 * with the fill rate and foreground updates are at risk of hitting the
+	 * must_wait watermark - grow ahead of that. The high water mark decays
+	 * across flushes so one burst doesn't keep doubling us to the cap:
+	 */
+	size_t high = wb->fill_high_water;
+	if (high > wb->inc.keys.size / 2 &&
+	    wb->inc.keys.size < BTREE_WRITE_BUFFER_KEYS_MAX)
+		bch2_btree_write_buffer_resize(c,
+			min_t(size_t, BTREE_WRITE_BUFFER_KEYS_MAX,
+			      wb->inc.keys.size * 2));
+	wb->fill_high_water = high / 2;
+
+	for (size_t i = 0; i < wb->flushing.keys.nr; i++) {
+		wb->sorted.data[i].idx = i;
+		wb->sorted.data[i].btree = wb->flushing.keys.data[i].btree;
+		memcpy(&wb->sorted.data[i].pos, &wb->flushing.keys.data[i].k.k.p, sizeof(struct bpos));
+	}
+	wb->sorted.nr = wb->flushing.keys.nr;
+
+	/*
+	 * We first sort so that we can detect and skip redundant updates, and
+	 * then we attempt to flush in sorted btree order, as this is most
+	 * efficient.
+	 *
+	 * However, since we're not flushing in the order they appear in the
+	 * journal we won't be able to drop our journal pin until everything is
+	 * flushed - which means this could deadlock the journal if we weren't
+	 * passing BCH_TRANS_COMMIT_journal_reclaim. This causes the update to fail
+	 * if it would block taking a journal reservation.
+	 *
+	 * If that happens, simply skip the key so we can optimistically insert
+	 * as many keys as possible in the fast path.
+	 */
+	wb_sort(wb->sorted.data, wb->sorted.nr);
+
+	unsigned nr_flushers = min_t(size_t, num_online_cpus(),
+				     wb->sorted.nr / WB_FLUSH_KEYS_PER_WORKER);
+
+	ret = nr_flushers > 1
+		? wb_flush_parallel(trans, nr_flushers,
+				    &skipped, &fast, &slowpath)
+		: wb_flush_keys_range(trans, wb->sorted.data,
+				      wb->sorted.data + wb->sorted.nr,
+				      &skipped, &fast, &slowpath);
 
 	if (ret)
 		goto err;
@@ -420,7 +581,8 @@ static int btree_write_buffer_flush_seq(struct btree_trans *trans, u64 seq)
 	} while (!ret &&
 		 (fetch_from_journal_err ||
 		  (wb->inc.pin.seq && wb->inc.pin.seq <= seq) ||
-		  (wb->flushing.pin.seq && wb->flushing.pin.seq <= seq)));
+		  (wb->flushing.pin.seq && wb->flushing.pin.seq <= seq) ||
+		  (wb->overflow.pin.seq && wb->overflow.pin.seq <= seq)));
 
 	return ret;
 }
@@ -483,6 +645,36 @@ static void bch2_btree_write_buffer_flush_work(struct work_struct *work)
 	bch2_write_ref_put(c, BCH_WRITE_REF_btree_write_buffer);
 }
 
+/*
+ * Neither buffer could be grown: spill to the preallocated overflow reserve
+ * rather than returning an error, which would force the caller into a
+ * synchronous flush. The keys are already durable in the journal - the
+ * reserve only has to hold them until the next flush drains it.
+ */
+static noinline int wb_key_to_overflow(struct bch_fs *c, u64 seq,
+				       enum btree_id btree, struct bkey_i *k)
+{
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	int ret;
+
+	mutex_lock(&wb->overflow.lock);
+	ret = darray_make_room_gfp(&wb->overflow.keys, 1, GFP_NOWAIT);
+	if (ret)
+		goto out;
+
+	bch2_journal_pin_add(&c->journal, seq, &wb->overflow.pin,
+			     bch2_btree_write_buffer_journal_flush);
+
+	struct btree_write_buffered_key *wb_k = &darray_top(wb->overflow.keys);
+	wb_k->journal_seq	= seq;
+	wb_k->btree		= btree;
+	bkey_copy(&wb_k->k, k);
+	wb->overflow.keys.nr++;
+out:
+	mutex_unlock(&wb->overflow.lock);
+	return ret;
+}
+
 int bch2_journal_key_to_wb_slowpath(struct bch_fs *c,
 			     struct journal_keys_to_wb *dst,
 			     enum btree_id btree, struct bkey_i *k)
@@ -503,7 +695,7 @@ retry:
 			goto retry;
 		}
 
-		return ret;
+		return wb_key_to_overflow(c, dst->seq, btree, k);
 	}
 
 	dst->room = darray_room(dst->wb->keys);
@@ -558,6 +750,9 @@ void bch2_journal_keys_to_write_buffer_end(struct bch_fs *c, struct journal_keys
 {
 	struct btree_write_buffer *wb = &c->btree_write_buffer;
 
+	wb->fill_high_water = max(wb->fill_high_water,
+				  wb->flushing.keys.nr + wb->inc.keys.nr);
+
 	if (!dst->wb->keys.nr)
 		bch2_journal_pin_drop(&c->journal, &dst->wb->pin);
 
@@ -621,12 +816,13 @@ void bch2_fs_btree_write_buffer_exit(struct bch_fs *c)
 {
 	struct btree_write_buffer *wb = &c->btree_write_buffer;
 
-	BUG_ON((wb->inc.keys.nr || wb->flushing.keys.nr) &&
+	BUG_ON((wb->inc.keys.nr || wb->flushing.keys.nr || wb->overflow.keys.nr) &&
 	       !bch2_journal_error(&c->journal));
 
 	darray_exit(&wb->sorted);
 	darray_exit(&wb->flushing.keys);
 	darray_exit(&wb->inc.keys);
+	darray_exit(&wb->overflow.keys);
 }
 
 int bch2_fs_btree_write_buffer_init(struct bch_fs *c)
@@ -635,6 +831,7 @@ int bch2_fs_btree_write_buffer_init(struct bch_fs *c)
 
 	mutex_init(&wb->inc.lock);
 	mutex_init(&wb->flushing.lock);
+	mutex_init(&wb->overflow.lock);
 	INIT_WORK(&wb->flush_work, bch2_btree_write_buffer_flush_work);
 
 	/* Will be resized by journal as needed: */
@@ -642,5 +839,6 @@ int bch2_fs_btree_write_buffer_init(struct bch_fs *c)
 
 	return  darray_make_room(&wb->inc.keys, initial_size) ?:
 		darray_make_room(&wb->flushing.keys, initial_size) ?:
-		darray_make_room(&wb->sorted, initial_size);
+		darray_make_room(&wb->sorted, initial_size) ?:
+		darray_make_room(&wb->overflow.keys, 1 << 12);
 }
@@ -8,6 +8,9 @@
 #define BTREE_WRITE_BUFERED_VAL_U64s_MAX	4
 #define BTREE_WRITE_BUFERED_U64s_MAX	(BKEY_U64s + BTREE_WRITE_BUFERED_VAL_U64s_MAX)
 
+/* Hard cap on buffer size, in keys - the sizing autotune never grows past this: */
+#define BTREE_WRITE_BUFFER_KEYS_MAX	(1U << 20)
+
 struct wb_key_ref {
 union {
 	struct {
@@ -51,7 +54,19 @@ struct btree_write_buffer {
 	DARRAY(struct wb_key_ref)	sorted;
 	struct btree_write_buffer_keys	inc;
 	struct btree_write_buffer_keys	flushing;
+	/*
+	 * Preallocated reserve for keys that arrive when neither @inc nor
+	 * @flushing can be grown; drained back into @flushing at the next
+	 * flush:
+	 */
+	struct btree_write_buffer_keys	overflow;
 	struct work_struct		flush_work;
+
+	/*
+	 * Occupancy high water mark since the last flush, for the sizing
+	 * autotune in the flush path; advisory - reads and writes may race:
+	 */
+	size_t				fill_high_water;
 };
 
 #endif /* _BCACHEFS_BTREE_WRITE_BUFFER_TYPES_H */
@@ -144,9 +144,26 @@ retry:
 		unsafe_memcpy(&ret->u, c->usage_base,
 			      __fs_usage_u64s(nr_replicas) * sizeof(u64),
 			      "embedded variable length struct");
-		for (i = 0; i < ARRAY_SIZE(c->usage); i++)
+		for (i = 0; i < ARRAY_SIZE(c->usage); i++) {
+			unsigned j;
+			int cpu;
+
 			acc_u64s_percpu((u64 *) &ret->u, (u64 __percpu *) c->usage[i],
-					__fs_usage_u64s(nr_replicas));
+					sizeof(struct bch_fs_usage) / sizeof(u64));
+
+			/*
+			 * Only replicas entries with deltas accumulated since
+			 * the last acc_to_base() need folding; the rest are
+			 * all zeroes:
+			 */
+			for_each_possible_cpu(cpu) {
+				struct bch_fs_usage *p =
+					per_cpu_ptr(c->usage[i], cpu);
+
+				for_each_set_bit(j, c->usage_dirty[i], nr_replicas)
+					ret->u.replicas[j] += p->replicas[j];
+			}
+		}
 	} while (read_seqcount_retry(&c->usage_lock, seq));
 
 	return ret;
@@ -154,16 +171,34 @@ retry:
 
 void bch2_fs_usage_acc_to_base(struct bch_fs *c, unsigned idx)
 {
-	unsigned u64s = fs_usage_u64s(c);
+	unsigned i, u64s;
+	unsigned long *dirty = c->usage_dirty[idx];
+	int cpu;
 
 	BUG_ON(idx >= ARRAY_SIZE(c->usage));
 
 	preempt_disable();
 	write_seqcount_begin(&c->usage_lock);
 
-	acc_u64s_percpu((u64 *) c->usage_base,
-			(u64 __percpu *) c->usage[idx], u64s);
-	percpu_memset(c->usage[idx], 0, u64s * sizeof(u64));
+	/*
+	 * No more writers for this journal buffer: fold and clear just the
+	 * base counters and the replicas entries that saw deltas, the rest of
+	 * the buffer is already zero:
+	 */
+	for_each_possible_cpu(cpu) {
+		struct bch_fs_usage *p = per_cpu_ptr(c->usage[idx], cpu);
+
+		acc_u64s((u64 *) c->usage_base, (u64 *) p,
+			 sizeof(struct bch_fs_usage) / sizeof(u64));
+		memset(p, 0, sizeof(struct bch_fs_usage));
+
+		for_each_set_bit(i, dirty, c->replicas.nr) {
+			c->usage_base->replicas[i] += p->replicas[i];
+			p->replicas[i] = 0;
+		}
+	}
+
+	bitmap_zero(dirty, c->replicas.nr);
 
 	rcu_read_lock();
 	for_each_member_device_rcu(c, ca, NULL) {
@@ -326,9 +361,25 @@ void bch2_dev_usage_update(struct bch_fs *c, struct bch_dev *ca,
 	u->d[old->data_type].fragmented -= bch2_bucket_sectors_fragmented(ca, *old);
 	u->d[new->data_type].fragmented += bch2_bucket_sectors_fragmented(ca, *new);
 
+	if (!gc && c->copygc_frag_hist_seeded) {
+		int old_bin = alloc_frag_hist_bin(ca, *old);
+		int new_bin = alloc_frag_hist_bin(ca, *new);
+
+		if (old_bin != new_bin) {
+			if (old_bin >= 0)
+				atomic64_dec(&ca->frag_hist[old_bin]);
+			if (new_bin >= 0)
+				atomic64_inc(&ca->frag_hist[new_bin]);
+		}
+	}
+
 	preempt_enable();
 }
 
+/*
+ * Note: doesn't fill in the stripe index, which lives outside struct bucket -
+ * bch2_dev_usage_update() doesn't consume it:
+ */
 static inline struct bch_alloc_v4 bucket_m_to_alloc(struct bucket b)
 {
 	return (struct bch_alloc_v4) {
@@ -336,7 +387,6 @@ static inline struct bch_alloc_v4 bucket_m_to_alloc(struct bucket b)
 		.data_type	= b.data_type,
 		.dirty_sectors	= b.dirty_sectors,
 		.cached_sectors	= b.cached_sectors,
-		.stripe		= b.stripe,
 	};
 }
 
@@ -349,8 +399,16 @@ void bch2_dev_usage_update_m(struct bch_fs *c, struct bch_dev *ca,
 	bch2_dev_usage_update(c, ca, &old_a, &new_a, 0, true);
 }
 
+static inline void fs_usage_dirty_set(unsigned long *dirty, unsigned idx)
+{
+	/* usually already set - avoid bouncing the cacheline: */
+	if (!test_bit(idx, dirty))
+		set_bit(idx, dirty);
+}
+
 static inline int __update_replicas(struct bch_fs *c,
 				    struct bch_fs_usage *fs_usage,
+				    unsigned long *dirty,
 				    struct bch_replicas_entry_v1 *r,
 				    s64 sectors)
 {
@@ -361,6 +419,8 @@ static inline int __update_replicas(struct bch_fs *c,
 
 	fs_usage_data_type_to_base(&fs_usage->b, r->data_type, sectors);
 	fs_usage->replicas[idx]		+= sectors;
+	if (dirty)
+		fs_usage_dirty_set(dirty, idx);
 	return 0;
 }
 
@@ -396,6 +456,8 @@ int bch2_update_replicas(struct bch_fs *c, struct bkey_s_c k,
 	fs_usage = fs_usage_ptr(c, journal_seq, gc);
 	fs_usage_data_type_to_base(&fs_usage->b, r->data_type, sectors);
 	fs_usage->replicas[idx]		+= sectors;
+	if (!gc)
+		fs_usage_dirty_set(c->usage_dirty[journal_seq & JOURNAL_BUF_MASK], idx);
 	preempt_enable();
 err:
 fsck_err:
@@ -515,7 +577,11 @@ int bch2_mark_metadata_bucket(struct bch_fs *c, struct bch_dev *ca,
 		return 0;
 
 	percpu_down_read(&c->mark_lock);
-	g = gc_bucket(ca, b);
+	g = gc_bucket_maybe(ca, b);
+	if (!g) {
+		percpu_up_read(&c->mark_lock);
+		return 0;
+	}
 
 	bucket_lock(g);
 	old = *g;
@@ -658,6 +724,7 @@ void bch2_trans_fs_usage_revert(struct btree_trans *trans,
 {
 	struct bch_fs *c = trans->c;
 	struct bch_fs_usage *dst;
+	unsigned long *dirty = c->usage_dirty[trans->journal_res.seq & JOURNAL_BUF_MASK];
 	struct replicas_delta *d, *top = (void *) deltas->d + deltas->used;
 	s64 added = 0;
 	unsigned i;
@@ -674,7 +741,7 @@ void bch2_trans_fs_usage_revert(struct btree_trans *trans,
 		case BCH_DATA_parity:
 			added += d->delta;
 		}
-		BUG_ON(__update_replicas(c, dst, &d->r, -d->delta));
+		BUG_ON(__update_replicas(c, dst, dirty, &d->r, -d->delta));
 	}
 
 	dst->b.nr_inodes -= deltas->nr_inodes;
@@ -754,6 +821,7 @@ int bch2_trans_fs_usage_apply(struct btree_trans *trans,
 	struct replicas_delta *d, *d2;
 	struct replicas_delta *top = (void *) deltas->d + deltas->used;
 	struct bch_fs_usage *dst;
+	unsigned long *dirty = c->usage_dirty[trans->journal_res.seq & JOURNAL_BUF_MASK];
 	unsigned i;
 
 	percpu_down_read(&c->mark_lock);
@@ -761,7 +829,7 @@ int bch2_trans_fs_usage_apply(struct btree_trans *trans,
 	dst = fs_usage_ptr(c, trans->journal_res.seq, false);
 
 	for (d = deltas->d; d != top; d = replicas_delta_next(d))
-		if (__update_replicas(c, dst, &d->r, d->delta))
+		if (__update_replicas(c, dst, dirty, &d->r, d->delta))
 			goto need_mark;
 
 	dst->b.nr_inodes += deltas->nr_inodes;
@@ -777,7 +845,7 @@ int bch2_trans_fs_usage_apply(struct btree_trans *trans,
 need_mark:
 	/* revert changes: */
 	for (d2 = deltas->d; d2 != d; d2 = replicas_delta_next(d2))
-		BUG_ON(__update_replicas(c, dst, &d2->r, -d2->delta));
+		BUG_ON(__update_replicas(c, dst, dirty, &d2->r, -d2->delta));
 
 	preempt_enable();
 	percpu_up_read(&c->mark_lock);
@@ -854,7 +922,17 @@ static int bch2_trigger_pointer(struct btree_trans *trans,
 		enum bch_data_type data_type = bkey_ptr_data_type(btree_id, level, k, p);
 
 		percpu_down_read(&c->mark_lock);
-		struct bucket *g = PTR_GC_BUCKET(ca, &p.ptr);
+		struct bucket *g = PTR_GC_BUCKET_MAYBE(ca, &p.ptr);
+		if (!g) {
+			/*
+			 * Out of the resident window; the bucket gets marked
+			 * on that window's pass. Staleness still matters to
+			 * the caller's replicas accounting - check it against
+			 * the regular gens array:
+			 */
+			percpu_up_read(&c->mark_lock);
+			return ptr_stale(ca, &p.ptr) ? 1 : 0;
+		}
 		bucket_lock(g);
 		struct bucket old = *g;
 
@@ -923,7 +1001,9 @@ err:
 	if (flags & BTREE_TRIGGER_GC) {
 		struct bch_fs *c = trans->c;
 
-		BUG_ON(!(flags & BTREE_TRIGGER_GC));
+		/* stripe block sectors were accounted on the first pass: */
+		if (flags & BTREE_TRIGGER_GC_BUCKET_ONLY)
+			return 0;
 
 		struct gc_stripe *m = genradix_ptr_alloc(&c->gc_stripes, p.ec.idx, GFP_KERNEL);
 		if (!m) {
@@ -962,6 +1042,7 @@ static int __trigger_extent(struct btree_trans *trans,
 			    struct bkey_s_c k, unsigned flags)
 {
 	bool gc = flags & BTREE_TRIGGER_GC;
+	bool bucket_only = flags & BTREE_TRIGGER_GC_BUCKET_ONLY;
 	struct bch_fs *c = trans->c;
 	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
 	const union bch_extent_entry *entry;
@@ -986,7 +1067,7 @@ static int __trigger_extent(struct btree_trans *trans,
 		bool stale = ret > 0;
 
 		if (p.ptr.cached) {
-			if (!stale) {
+			if (!stale && !bucket_only) {
 				ret = !gc
 					? bch2_update_cached_sectors_list(trans, p.ptr.dev, disk_sectors)
 					: update_cached_sectors(c, k, p.ptr.dev, disk_sectors, 0, true);
@@ -1012,7 +1093,7 @@ static int __trigger_extent(struct btree_trans *trans,
 		}
 	}
 
-	if (r.e.nr_devs) {
+	if (r.e.nr_devs && !bucket_only) {
 		ret = !gc
 			? bch2_update_replicas_list(trans, &r.e, dirty_sectors)
 			: bch2_update_replicas(c, k, &r.e, dirty_sectors, 0, true);
@@ -1089,7 +1170,8 @@ static int __trigger_reservation(struct btree_trans *trans,
 		d->persistent_reserved[replicas - 1] += sectors;
 	}
 
-	if (flags & BTREE_TRIGGER_GC) {
+	if ((flags & BTREE_TRIGGER_GC) &&
+	    !(flags & BTREE_TRIGGER_GC_BUCKET_ONLY)) {
 		percpu_down_read(&c->mark_lock);
 		preempt_disable();
 
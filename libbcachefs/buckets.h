@@ -37,8 +37,11 @@ static inline size_t sector_to_bucket_and_offset(const struct bch_dev *ca, secto
 }
 
 #define for_each_bucket(_b, _buckets)				\
-	for (_b = (_buckets)->b + (_buckets)->first_bucket;	\
-	     _b < (_buckets)->b + (_buckets)->nbuckets; _b++)
+	for (_b = (_buckets)->b +				\
+	     (max_t(size_t, (_buckets)->first_bucket, (_buckets)->window_start) -\
+	      (_buckets)->window_start);			\
+	     _b < (_buckets)->b +				\
+	     ((_buckets)->window_end - (_buckets)->window_start); _b++)
 
 /*
  * Ugly hack alert:
@@ -90,12 +93,46 @@ static inline struct bucket_array *gc_bucket_array(struct bch_dev *ca)
 				     lockdep_is_held(&ca->bucket_lock));
 }
 
+/*
+ * Returns NULL if @b is outside the window of buckets currently resident -
+ * it'll be marked on the pass for the window it falls in:
+ */
+static inline struct bucket *gc_bucket_maybe(struct bch_dev *ca, size_t b)
+{
+	struct bucket_array *buckets = gc_bucket_array(ca);
+
+	BUG_ON(b < buckets->first_bucket || b >= buckets->nbuckets);
+
+	if (b < buckets->window_start || b >= buckets->window_end)
+		return NULL;
+	return buckets->b + (b - buckets->window_start);
+}
+
 static inline struct bucket *gc_bucket(struct bch_dev *ca, size_t b)
+{
+	struct bucket *g = gc_bucket_maybe(ca, b);
+
+	BUG_ON(!g);
+	return g;
+}
+
+static inline u32 *gc_bucket_stripe_maybe(struct bch_dev *ca, size_t b)
 {
 	struct bucket_array *buckets = gc_bucket_array(ca);
 
 	BUG_ON(b < buckets->first_bucket || b >= buckets->nbuckets);
-	return buckets->b + b;
+
+	if (b < buckets->window_start || b >= buckets->window_end)
+		return NULL;
+	return buckets->stripe + (b - buckets->window_start);
+}
+
+static inline u32 *gc_bucket_stripe(struct bch_dev *ca, size_t b)
+{
+	u32 *stripe = gc_bucket_stripe_maybe(ca, b);
+
+	BUG_ON(!stripe);
+	return stripe;
 }
 
 static inline struct bucket_gens *bucket_gens(struct bch_dev *ca)
@@ -144,6 +181,12 @@ static inline struct bucket *PTR_GC_BUCKET(struct bch_dev *ca,
 	return gc_bucket(ca, PTR_BUCKET_NR(ca, ptr));
 }
 
+static inline struct bucket *PTR_GC_BUCKET_MAYBE(struct bch_dev *ca,
+						 const struct bch_extent_ptr *ptr)
+{
+	return gc_bucket_maybe(ca, PTR_BUCKET_NR(ca, ptr));
+}
+
 static inline enum bch_data_type ptr_data_type(const struct bkey *k,
 					       const struct bch_extent_ptr *ptr)
 {
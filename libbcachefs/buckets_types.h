@@ -7,13 +7,18 @@
 
 #define BUCKET_JOURNAL_SEQ_BITS		16
 
+/*
+ * Only the fields the extent mark loop touches live here - keeping this at 12
+ * bytes means gc's working set per bucket is a fraction of a cacheline. The
+ * stripe index, which only erasure coding marks care about, is split out into
+ * bucket_array->stripe[].
+ */
 struct bucket {
 	u8			lock;
 	u8			gen_valid:1;
 	u8			data_type:7;
 	u8			gen;
 	u8			stripe_redundancy;
-	u32			stripe;
 	u32			dirty_sectors;
 	u32			cached_sectors;
 };
@@ -22,6 +27,19 @@ struct bucket_array {
 	struct rcu_head		rcu;
 	u16			first_bucket;
 	size_t			nbuckets;
+	/*
+	 * Range of buckets b[] actually covers, for bounded-memory gc: when
+	 * gc runs in windowed passes only a window of each device's buckets
+	 * is resident at a time. [0, nbuckets) when not windowed.
+	 */
+	size_t			window_start;
+	size_t			window_end;
+	/*
+	 * Companion array to b[], in the same allocation and covering the same
+	 * window: per bucket stripe index, kept out of struct bucket so the
+	 * mark loop's cachelines stay free of cold erasure coding state:
+	 */
+	u32			*stripe;
 	struct bucket		b[];
 };
 
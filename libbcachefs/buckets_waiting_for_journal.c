@@ -5,6 +5,12 @@
 #include <linux/hash.h>
 #include <linux/random.h>
 
+static inline struct buckets_waiting_for_journal_shard *
+bucket_shard(struct buckets_waiting_for_journal *b, u64 dev_bucket)
+{
+	return b->shards + hash_64(dev_bucket, BWJ_SHARD_BITS);
+}
+
 static inline struct bucket_hashed *
 bucket_hash(struct buckets_waiting_for_journal_table *t,
 	    unsigned hash_seed_idx, u64 dev_bucket)
@@ -26,13 +32,14 @@ bool bch2_bucket_needs_journal_commit(struct buckets_waiting_for_journal *b,
 				      u64 flushed_seq,
 				      unsigned dev, u64 bucket)
 {
-	struct buckets_waiting_for_journal_table *t;
 	u64 dev_bucket = (u64) dev << 56 | bucket;
+	struct buckets_waiting_for_journal_shard *s = bucket_shard(b, dev_bucket);
+	struct buckets_waiting_for_journal_table *t;
 	bool ret = false;
 	unsigned i;
 
-	mutex_lock(&b->lock);
-	t = b->t;
+	mutex_lock(&s->lock);
+	t = s->t;
 
 	for (i = 0; i < ARRAY_SIZE(t->hash_seeds); i++) {
 		struct bucket_hashed *h = bucket_hash(t, i, dev_bucket);
@@ -43,7 +50,7 @@ bool bch2_bucket_needs_journal_commit(struct buckets_waiting_for_journal *b,
 		}
 	}
 
-	mutex_unlock(&b->lock);
+	mutex_unlock(&s->lock);
 
 	return ret;
 }
@@ -88,20 +95,21 @@ int bch2_set_bucket_needs_journal_commit(struct buckets_waiting_for_journal *b,
 					 unsigned dev, u64 bucket,
 					 u64 journal_seq)
 {
-	struct buckets_waiting_for_journal_table *t, *n;
 	struct bucket_hashed tmp, new = {
 		.dev_bucket	= (u64) dev << 56 | bucket,
 		.journal_seq	= journal_seq,
 	};
+	struct buckets_waiting_for_journal_shard *s = bucket_shard(b, new.dev_bucket);
+	struct buckets_waiting_for_journal_table *t, *n;
 	size_t i, size, new_bits, nr_elements = 1, nr_rehashes = 0;
 	int ret = 0;
 
-	mutex_lock(&b->lock);
+	mutex_lock(&s->lock);
 
-	if (likely(bucket_table_insert(b->t, &new, flushed_seq)))
+	if (likely(bucket_table_insert(s->t, &new, flushed_seq)))
 		goto out;
 
-	t = b->t;
+	t = s->t;
 	size = 1UL << t->bits;
 	for (i = 0; i < size; i++)
 		nr_elements += t->d[i].journal_seq > flushed_seq;
@@ -130,37 +138,77 @@ retry_rehash:
 			goto retry_rehash;
 	}
 
-	b->t = n;
+	s->t = n;
 	kvfree(t);
 
-	pr_debug("took %zu rehashes, table at %zu/%lu elements",
-		 nr_rehashes, nr_elements, 1UL << b->t->bits);
+	pr_debug("took %zu rehashes, shard table at %zu/%lu elements",
+		 nr_rehashes, nr_elements, 1UL << s->t->bits);
 out:
-	mutex_unlock(&b->lock);
+	mutex_unlock(&s->lock);
 
 	return ret;
 }
 
-void bch2_fs_buckets_waiting_for_journal_exit(struct bch_fs *c)
+void bch2_buckets_waiting_for_journal_to_text(struct printbuf *out, struct bch_fs *c)
 {
 	struct buckets_waiting_for_journal *b = &c->buckets_waiting_for_journal;
+	u64 flushed_seq = c->journal.flushed_seq_ondisk;
+	size_t total_size = 0, total_occupied = 0, total_live = 0;
+
+	prt_printf(out, "%-8s %8s %10s %10s\n",
+		   "shard", "size", "occupied", "live");
+
+	for (unsigned i = 0; i < BWJ_NR_SHARDS; i++) {
+		struct buckets_waiting_for_journal_shard *s = b->shards + i;
+		size_t size, occupied = 0, live = 0;
+
+		mutex_lock(&s->lock);
+		size = 1UL << s->t->bits;
+
+		for (size_t j = 0; j < size; j++) {
+			occupied	+= s->t->d[j].journal_seq != 0;
+			live		+= s->t->d[j].journal_seq > flushed_seq;
+		}
+		mutex_unlock(&s->lock);
 
-	kvfree(b->t);
+		prt_printf(out, "%-8u %8zu %10zu %10zu\n",
+			   i, size, occupied, live);
+
+		total_size	+= size;
+		total_occupied	+= occupied;
+		total_live	+= live;
+	}
+
+	prt_printf(out, "%-8s %8zu %10zu %10zu\n",
+		   "total", total_size, total_occupied, total_live);
 }
 
 #define INITIAL_TABLE_BITS		3
 
+void bch2_fs_buckets_waiting_for_journal_exit(struct bch_fs *c)
+{
+	struct buckets_waiting_for_journal *b = &c->buckets_waiting_for_journal;
+
+	for (unsigned i = 0; i < BWJ_NR_SHARDS; i++)
+		kvfree(b->shards[i].t);
+}
+
 int bch2_fs_buckets_waiting_for_journal_init(struct bch_fs *c)
 {
 	struct buckets_waiting_for_journal *b = &c->buckets_waiting_for_journal;
 
-	mutex_init(&b->lock);
+	for (unsigned i = 0; i < BWJ_NR_SHARDS; i++) {
+		struct buckets_waiting_for_journal_shard *s = b->shards + i;
 
-	b->t = kvmalloc(sizeof(*b->t) +
-			(sizeof(b->t->d[0]) << INITIAL_TABLE_BITS), GFP_KERNEL);
-	if (!b->t)
-		return -BCH_ERR_ENOMEM_buckets_waiting_for_journal_init;
+		mutex_init(&s->lock);
+
+		s->t = kvmalloc(sizeof(*s->t) +
+				(sizeof(s->t->d[0]) << INITIAL_TABLE_BITS), GFP_KERNEL);
+		if (!s->t)
+			return -BCH_ERR_ENOMEM_buckets_waiting_for_journal_init;
+
+		bucket_table_init(s->t, INITIAL_TABLE_BITS);
+	}
 
-	bucket_table_init(b->t, INITIAL_TABLE_BITS);
 	return 0;
 }
@@ -9,6 +9,8 @@ bool bch2_bucket_needs_journal_commit(struct buckets_waiting_for_journal *,
 int bch2_set_bucket_needs_journal_commit(struct buckets_waiting_for_journal *,
 					 u64, unsigned, u64, u64);
 
+void bch2_buckets_waiting_for_journal_to_text(struct printbuf *, struct bch_fs *);
+
 void bch2_fs_buckets_waiting_for_journal_exit(struct bch_fs *);
 int bch2_fs_buckets_waiting_for_journal_init(struct bch_fs *);
 
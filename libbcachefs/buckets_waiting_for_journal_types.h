@@ -2,6 +2,7 @@
 #ifndef _BUCKETS_WAITING_FOR_JOURNAL_TYPES_H
 #define _BUCKETS_WAITING_FOR_JOURNAL_TYPES_H
 
+#include <linux/cache.h>
 #include <linux/siphash.h>
 
 struct bucket_hashed {
@@ -15,9 +16,21 @@ struct buckets_waiting_for_journal_table {
 	struct bucket_hashed	d[];
 };
 
-struct buckets_waiting_for_journal {
+/*
+ * Lock striped: a bucket's shard is picked by a hash of the bucket, each
+ * shard is an independent cuckoo table under its own lock, and a shard's
+ * rehash only stalls the threads hashing to that shard:
+ */
+#define BWJ_SHARD_BITS		5
+#define BWJ_NR_SHARDS		(1U << BWJ_SHARD_BITS)
+
+struct buckets_waiting_for_journal_shard {
 	struct mutex		lock;
 	struct buckets_waiting_for_journal_table *t;
+} ____cacheline_aligned;
+
+struct buckets_waiting_for_journal {
+	struct buckets_waiting_for_journal_shard shards[BWJ_NR_SHARDS];
 };
 
 #endif /* _BUCKETS_WAITING_FOR_JOURNAL_TYPES_H */
@@ -579,6 +579,7 @@ int bch2_request_key(struct bch_sb *sb, struct bch_key *key)
 
 		bch2_passphrase_check(sb, passphrase,
 				      key, &sb_key);
+		bch2_stash_key(sb, key);
 		ret = 0;
 	}
 #endif
@@ -149,6 +149,30 @@ static inline void zlib_set_workspace(z_stream *strm, void *workspace)
 #endif
 }
 
+#ifndef __KERNEL__
+/*
+ * In userspace we keep a fully initialized decompression context per thread
+ * instead of bouncing through the mempool: initializing a static DCtx clears
+ * the whole multi hundred kilobyte workspace, and paying that per extent
+ * shows up hot on the fuse read path. Threads that decompress are long lived
+ * workers, so never freeing the per thread context is fine.
+ */
+static __thread ZSTD_DCtx *zstd_dctx_cached;
+
+static ZSTD_DCtx *zstd_dctx_get(void)
+{
+	if (!zstd_dctx_cached) {
+		size_t size = zstd_dctx_workspace_bound();
+		void *workspace = malloc(size);
+
+		if (workspace)
+			zstd_dctx_cached = zstd_init_dctx(workspace, size);
+	}
+
+	return zstd_dctx_cached;
+}
+#endif
+
 static int __bio_uncompress(struct bch_fs *c, struct bio *src,
 			    void *dst_data, struct bch_extent_crc_unpacked crc)
 {
@@ -195,6 +219,7 @@ static int __bio_uncompress(struct bch_fs *c, struct bio *src,
 		if (real_src_len > src_len - 4)
 			goto err;
 
+#ifdef __KERNEL__
 		workspace = mempool_alloc(&c->decompress_workspace, GFP_NOFS);
 		ctx = zstd_init_dctx(workspace, zstd_dctx_workspace_bound());
 
@@ -203,6 +228,15 @@ static int __bio_uncompress(struct bch_fs *c, struct bio *src,
 				src_data.b + 4, real_src_len);
 
 		mempool_free(workspace, &c->decompress_workspace);
+#else
+		ctx = zstd_dctx_get();
+		if (!ctx)
+			goto err;
+
+		ret = zstd_decompress_dctx(ctx,
+				dst_data,	dst_len,
+				src_data.b + 4, real_src_len);
+#endif
 
 		if (ret != dst_len)
 			goto err;
@@ -21,6 +21,7 @@ struct {								\
 
 typedef DARRAY(char)	darray_char;
 typedef DARRAY(char *) darray_str;
+typedef DARRAY(u64)	darray_u64;
 
 int __bch2_darray_resize(darray_char *, size_t, size_t, gfp_t);
 
@@ -780,6 +780,30 @@ static ssize_t btree_transaction_stats_read(struct file *file, char __user *buf,
 			printbuf_indent_sub(&i->buf, 2);
 		}
 
+		bool have_restarts = false;
+
+		for (struct trans_restart_count *r = s->restarts;
+		     r < s->restarts + ARRAY_SIZE(s->restarts);
+		     r++) {
+			u64 count = atomic64_read(&r->count);
+
+			if (!count)
+				continue;
+
+			if (!have_restarts) {
+				prt_printf(&i->buf, "Transaction restarts:");
+				prt_newline(&i->buf);
+				printbuf_indent_add(&i->buf, 2);
+				have_restarts = true;
+			}
+
+			prt_printf(&i->buf, "%s (ip %lx): %llu",
+				   bch2_err_str(r->err), r->ip, count);
+			prt_newline(&i->buf);
+		}
+		if (have_restarts)
+			printbuf_indent_sub(&i->buf, 2);
+
 		mutex_unlock(&s->lock);
 
 		printbuf_indent_sub(&i->buf, 2);
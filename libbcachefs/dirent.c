@@ -12,6 +12,7 @@
 #include "subvolume.h"
 
 #include <linux/dcache.h>
+#include <linux/sort.h>
 
 static unsigned bch2_dirent_name_bytes(struct bkey_s_c_dirent d)
 {
@@ -34,16 +35,34 @@ struct qstr bch2_dirent_get_name(struct bkey_s_c_dirent d)
 	return (struct qstr) QSTR_INIT(d.v->d_name, bch2_dirent_name_bytes(d));
 }
 
-static u64 bch2_dirent_hash(const struct bch_hash_info *info,
-			    const struct qstr *name)
+static __always_inline u64 __bch2_dirent_hash(const struct bch_hash_info *info,
+					      const struct qstr *name,
+					      enum bch_str_hash_type type)
 {
 	struct bch_str_hash_ctx ctx;
 
-	bch2_str_hash_init(&ctx, info);
-	bch2_str_hash_update(&ctx, info, name->name, name->len);
+	__bch2_str_hash_init(&ctx, type, info);
+	__bch2_str_hash_update(&ctx, type, name->name, name->len);
 
 	/* [0,2) reserved for dots */
-	return max_t(u64, bch2_str_hash_end(&ctx, info), 2);
+	return max_t(u64, __bch2_str_hash_end(&ctx, type), 2);
+}
+
+static u64 bch2_dirent_hash(const struct bch_hash_info *info,
+			    const struct qstr *name)
+{
+	/*
+	 * Dispatch on the hash type once, so the common types get fully
+	 * specialized and inlined hash loops:
+	 */
+	switch (info->type) {
+	case BCH_STR_HASH_crc32c:
+		return __bch2_dirent_hash(info, name, BCH_STR_HASH_crc32c);
+	case BCH_STR_HASH_siphash:
+		return __bch2_dirent_hash(info, name, BCH_STR_HASH_siphash);
+	default:
+		return __bch2_dirent_hash(info, name, info->type);
+	}
 }
 
 static u64 dirent_hash_key(const struct bch_hash_info *info, const void *key)
@@ -510,6 +529,120 @@ u64 bch2_dirent_lookup(struct bch_fs *c, subvol_inum dir,
 	return ret;
 }
 
+struct dirent_lookup_sorted {
+	u64		hash;
+	unsigned	idx;
+};
+
+static int dirent_lookup_hash_cmp(const void *_l, const void *_r)
+{
+	const struct dirent_lookup_sorted *l = _l, *r = _r;
+
+	return cmp_int(l->hash, r->hash);
+}
+
+/*
+ * bch2_dirent_lookup_bulk - resolve many names in one directory
+ *
+ * Hashes every name up front and resolves them in hash order, so the whole
+ * batch is one ascending pass over the directory's slice of the dirents btree
+ * with a single reused iterator, instead of a full btree descent per name.
+ *
+ * On success @inums[i] is the target of @names[i], or zeroed if that name
+ * doesn't exist.
+ */
+int bch2_dirent_lookup_bulk(struct bch_fs *c, subvol_inum dir,
+			    const struct bch_hash_info *hash_info,
+			    const struct qstr *names, subvol_inum *inums,
+			    unsigned nr)
+{
+	struct btree_iter iter = { NULL };
+	u32 snapshot;
+	unsigned i;
+	int ret = 0;
+
+	struct dirent_lookup_sorted *s =
+		kvmalloc_array(nr, sizeof(*s), GFP_KERNEL);
+	if (!s) {
+		for (i = 0; i < nr; i++) {
+			ret = bch2_dirent_lookup(c, dir, hash_info,
+						 &names[i], &inums[i]);
+			if (bch2_err_matches(ret, ENOENT)) {
+				inums[i] = (subvol_inum) {};
+				ret = 0;
+			}
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < nr; i++)
+		s[i] = (struct dirent_lookup_sorted) {
+			.hash	= bch2_dirent_hash(hash_info, &names[i]),
+			.idx	= i,
+		};
+	sort(s, nr, sizeof(*s), dirent_lookup_hash_cmp, NULL);
+
+	struct btree_trans *trans = bch2_trans_get(c);
+retry:
+	bch2_trans_begin(trans);
+	memset(inums, 0, nr * sizeof(*inums));
+
+	ret = bch2_subvolume_get_snapshot(trans, dir.subvol, &snapshot);
+	if (ret)
+		goto err;
+
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_dirents,
+			     SPOS(dir.inum, 0, snapshot), BTREE_ITER_SLOTS);
+
+	for (i = 0; i < nr; i++) {
+		const struct qstr *name = &names[s[i].idx];
+		subvol_inum *inum = &inums[s[i].idx];
+
+		bch2_btree_iter_set_pos(&iter,
+				SPOS(dir.inum, s[i].hash, snapshot));
+
+		while (true) {
+			struct bkey_s_c k = bch2_btree_iter_peek_slot(&iter);
+
+			ret = bkey_err(k);
+			if (ret)
+				goto err;
+
+			if (is_visible_key(bch2_dirent_hash_desc, dir, k)) {
+				if (!dirent_cmp_key(k, name)) {
+					ret = bch2_dirent_read_target(trans, dir,
+							bkey_s_c_to_dirent(k), inum);
+					if (ret < 0)
+						goto err;
+					/* not visible in this subvolume: */
+					if (ret) {
+						*inum = (subvol_inum) {};
+						ret = 0;
+					}
+					break;
+				}
+			} else if (k.k->type != KEY_TYPE_hash_whiteout) {
+				/* hole, not found */
+				break;
+			}
+
+			if (iter.pos.offset == U64_MAX)
+				break;
+			bch2_btree_iter_advance(&iter);
+		}
+	}
+err:
+	bch2_trans_iter_exit(trans, &iter);
+	if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+		goto retry;
+
+	bch2_trans_put(trans);
+	kvfree(s);
+	return ret;
+}
+
 int bch2_empty_dir_snapshot(struct btree_trans *trans, u64 dir, u32 snapshot)
 {
 	struct btree_iter iter;
@@ -68,6 +68,9 @@ int __bch2_dirent_lookup_trans(struct btree_trans *, struct btree_iter *,
 u64 bch2_dirent_lookup(struct bch_fs *, subvol_inum,
 		       const struct bch_hash_info *,
 		       const struct qstr *, subvol_inum *);
+int bch2_dirent_lookup_bulk(struct bch_fs *, subvol_inum,
+			    const struct bch_hash_info *,
+			    const struct qstr *, subvol_inum *, unsigned);
 
 int bch2_empty_dir_snapshot(struct btree_trans *, u64, u32);
 int bch2_empty_dir_trans(struct btree_trans *, subvol_inum);
@@ -259,10 +259,14 @@ static int mark_stripe_bucket(struct btree_trans *trans,
 	/* * XXX doesn't handle deletion */
 
 	percpu_down_read(&c->mark_lock);
-	g = PTR_GC_BUCKET(ca, ptr);
+	g = PTR_GC_BUCKET_MAYBE(ca, ptr);
+	if (!g)
+		goto out;
+
+	u32 *g_stripe = gc_bucket_stripe(ca, PTR_BUCKET_NR(ca, ptr));
 
 	if (g->dirty_sectors ||
-	    (g->stripe && g->stripe != k.k->p.offset)) {
+	    (*g_stripe && *g_stripe != k.k->p.offset)) {
 		bch2_fs_inconsistent(c,
 			      "bucket %u:%zu gen %u: multiple stripes using same bucket\n%s",
 			      ptr->dev, PTR_BUCKET_NR(ca, ptr), g->gen,
@@ -283,13 +287,14 @@ static int mark_stripe_bucket(struct btree_trans *trans,
 	g->data_type = data_type;
 	g->dirty_sectors += sectors;
 
-	g->stripe		= k.k->p.offset;
+	*g_stripe		= k.k->p.offset;
 	g->stripe_redundancy	= s->nr_redundant;
 	new = *g;
 err:
 	bucket_unlock(g);
 	if (!ret)
 		bch2_dev_usage_update_m(c, ca, &old, &new);
+out:
 	percpu_up_read(&c->mark_lock);
 	printbuf_exit(&buf);
 	return ret;
@@ -407,6 +412,7 @@ int bch2_trigger_stripe(struct btree_trans *trans,
 	}
 
 	if (flags & BTREE_TRIGGER_GC) {
+		bool bucket_only = flags & BTREE_TRIGGER_GC_BUCKET_ONLY;
 		struct gc_stripe *m =
 			genradix_ptr_alloc(&c->gc_stripes, idx, GFP_KERNEL);
 
@@ -415,25 +421,28 @@ int bch2_trigger_stripe(struct btree_trans *trans,
 				idx);
 			return -BCH_ERR_ENOMEM_mark_stripe;
 		}
-		/*
-		 * This will be wrong when we bring back runtime gc: we should
-		 * be unmarking the old key and then marking the new key
-		 */
-		m->alive	= true;
-		m->sectors	= le16_to_cpu(new_s->sectors);
-		m->nr_blocks	= new_s->nr_blocks;
-		m->nr_redundant	= new_s->nr_redundant;
 
-		for (unsigned i = 0; i < new_s->nr_blocks; i++)
-			m->ptrs[i] = new_s->ptrs[i];
+		if (!bucket_only) {
+			/*
+			 * This will be wrong when we bring back runtime gc: we should
+			 * be unmarking the old key and then marking the new key
+			 */
+			m->alive	= true;
+			m->sectors	= le16_to_cpu(new_s->sectors);
+			m->nr_blocks	= new_s->nr_blocks;
+			m->nr_redundant	= new_s->nr_redundant;
+
+			for (unsigned i = 0; i < new_s->nr_blocks; i++)
+				m->ptrs[i] = new_s->ptrs[i];
 
-		bch2_bkey_to_replicas(&m->r.e, new);
+			bch2_bkey_to_replicas(&m->r.e, new);
 
-		/*
-		 * gc recalculates this field from stripe ptr
-		 * references:
-		 */
-		memset(m->block_sectors, 0, sizeof(m->block_sectors));
+			/*
+			 * gc recalculates this field from stripe ptr
+			 * references:
+			 */
+			memset(m->block_sectors, 0, sizeof(m->block_sectors));
+		}
 
 		for (unsigned i = 0; i < new_s->nr_blocks; i++) {
 			int ret = mark_stripe_bucket(trans, new, i, flags);
@@ -441,16 +450,18 @@ int bch2_trigger_stripe(struct btree_trans *trans,
 				return ret;
 		}
 
-		int ret = bch2_update_replicas(c, new, &m->r.e,
-				      ((s64) m->sectors * m->nr_redundant),
-				      0, true);
-		if (ret) {
-			struct printbuf buf = PRINTBUF;
+		if (!bucket_only) {
+			int ret = bch2_update_replicas(c, new, &m->r.e,
+					      ((s64) m->sectors * m->nr_redundant),
+					      0, true);
+			if (ret) {
+				struct printbuf buf = PRINTBUF;
 
-			bch2_bkey_val_to_text(&buf, c, new);
-			bch2_fs_fatal_error(c, "no replicas entry for %s", buf.buf);
-			printbuf_exit(&buf);
-			return ret;
+				bch2_bkey_val_to_text(&buf, c, new);
+				bch2_fs_fatal_error(c, "no replicas entry for %s", buf.buf);
+				printbuf_exit(&buf);
+				return ret;
+			}
 		}
 	}
 
@@ -629,13 +640,40 @@ static void ec_validate_checksums(struct bch_fs *c, struct ec_stripe_buf *buf)
 
 /* Erasure coding: */
 
-static void ec_generate_ec(struct ec_stripe_buf *buf)
+/*
+ * Syndrome generation makes multiple passes over the data blocks (one per
+ * redundancy block); computing it in tiles small enough for a tile of every
+ * block to stay resident in cache means the later passes hit cache instead of
+ * rereading the whole stripe from memory:
+ */
+#define EC_SYNDROME_TILE_BYTES	(1U << 15)
+
+/*
+ * Granularity at which p/q writes are issued while the rest of the stripe's
+ * parity is still being computed - big enough that the writes aren't
+ * fragmented, small enough that computation and IO actually overlap:
+ */
+#define EC_WRITE_CHUNK_BYTES	(1U << 18)
+
+static void ec_generate_ec(struct ec_stripe_buf *buf,
+			   unsigned offset, unsigned bytes)
 {
 	struct bch_stripe *v = &bkey_i_to_stripe(&buf->key)->v;
 	unsigned nr_data = v->nr_blocks - v->nr_redundant;
-	unsigned bytes = le16_to_cpu(v->sectors) << 9;
+	void *data[BCH_BKEY_PTRS_MAX];
+	unsigned i;
+
+	while (bytes) {
+		unsigned b = min(bytes, EC_SYNDROME_TILE_BYTES);
 
-	raid_gen(nr_data, v->nr_redundant, bytes, buf->data);
+		for (i = 0; i < v->nr_blocks; i++)
+			data[i] = buf->data[i] + offset;
+
+		raid_gen(nr_data, v->nr_redundant, b, data);
+
+		offset	+= b;
+		bytes	-= b;
+	}
 }
 
 static unsigned ec_nr_failed(struct ec_stripe_buf *buf)
@@ -698,10 +736,11 @@ static void ec_block_endio(struct bio *bio)
 }
 
 static void ec_block_io(struct bch_fs *c, struct ec_stripe_buf *buf,
-			blk_opf_t opf, unsigned idx, struct closure *cl)
+			blk_opf_t opf, unsigned idx,
+			unsigned offset, unsigned bytes, struct closure *cl)
 {
 	struct bch_stripe *v = &bkey_i_to_stripe(&buf->key)->v;
-	unsigned offset = 0, bytes = buf->size << 9;
+	unsigned end = offset + bytes;
 	struct bch_extent_ptr *ptr = &v->ptrs[idx];
 	struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
 	enum bch_data_type data_type = idx < v->nr_blocks - v->nr_redundant
@@ -722,12 +761,12 @@ static void ec_block_io(struct bch_fs *c, struct ec_stripe_buf *buf,
 		return;
 	}
 
-	this_cpu_add(ca->io_done->sectors[rw][data_type], buf->size);
+	this_cpu_add(ca->io_done->sectors[rw][data_type], bytes >> 9);
 
-	while (offset < bytes) {
+	while (offset < end) {
 		unsigned nr_iovecs = min_t(size_t, BIO_MAX_VECS,
-					   DIV_ROUND_UP(bytes, PAGE_SIZE));
-		unsigned b = min_t(size_t, bytes - offset,
+					   DIV_ROUND_UP(end - offset, PAGE_SIZE));
+		unsigned b = min_t(size_t, end - offset,
 				   nr_iovecs << PAGE_SHIFT);
 		struct ec_bio *ec_bio;
 
@@ -781,6 +820,104 @@ err:
 	return ret;
 }
 
+/* Reconstruct read stripe cache: */
+
+/*
+ * A degraded scan hits every extent in a stripe in turn, and each reconstruct
+ * read was re-reading and re-decoding the entire stripe. Cache the last few
+ * reconstructed stripes, so the block reads and the parity decode happen once
+ * per stripe instead of once per extent.
+ *
+ * Entries are matched against the current stripe key on lookup, so any update
+ * to the stripe - deletion, reuse, a block going stale - changes the key and
+ * makes the cached copy unreachable, with no invalidation hooks needed.
+ */
+
+#define EC_STRIPE_CACHE_NR	4
+
+struct ec_stripe_cache_entry {
+	struct list_head	list;
+	struct ec_stripe_buf	buf;
+};
+
+static bool ec_stripe_buf_key_eq(struct ec_stripe_buf *a,
+				 struct ec_stripe_buf *b)
+{
+	return a->key.k.u64s == b->key.k.u64s &&
+		!memcmp(&a->key, &b->key, bkey_bytes(&a->key.k));
+}
+
+static bool ec_stripe_cache_copy(struct bch_fs *c, struct ec_stripe_buf *buf,
+				 struct bch_read_bio *rbio, unsigned offset)
+{
+	struct ec_stripe_cache_entry *e;
+	bool ret = false;
+
+	mutex_lock(&c->ec_stripe_cache_lock);
+	list_for_each_entry(e, &c->ec_stripe_cache, list)
+		if (ec_stripe_buf_key_eq(&e->buf, buf)) {
+			memcpy_to_bio(&rbio->bio, rbio->bio.bi_iter,
+				      e->buf.data[rbio->pick.ec.block] +
+				      ((offset - e->buf.offset) << 9));
+			list_move(&e->list, &c->ec_stripe_cache);
+			ret = true;
+			break;
+		}
+	mutex_unlock(&c->ec_stripe_cache_lock);
+
+	return ret;
+}
+
+/* Takes ownership of @buf's data buffers: */
+static void ec_stripe_cache_add(struct bch_fs *c, struct ec_stripe_buf *buf)
+{
+	struct ec_stripe_cache_entry *e = kzalloc(sizeof(*e), GFP_NOFS);
+
+	if (!e)
+		return;
+
+	e->buf = *buf;
+	memset(buf->data, 0, sizeof(buf->data));
+
+	mutex_lock(&c->ec_stripe_cache_lock);
+	list_add(&e->list, &c->ec_stripe_cache);
+
+	if (c->ec_stripe_cache_nr < EC_STRIPE_CACHE_NR) {
+		c->ec_stripe_cache_nr++;
+		e = NULL;
+	} else {
+		e = list_last_entry(&c->ec_stripe_cache,
+				    struct ec_stripe_cache_entry, list);
+		list_del(&e->list);
+	}
+	mutex_unlock(&c->ec_stripe_cache_lock);
+
+	if (e) {
+		ec_stripe_buf_exit(&e->buf);
+		kfree(e);
+	}
+}
+
+static void ec_stripe_cache_exit(struct bch_fs *c)
+{
+	struct ec_stripe_cache_entry *e, *n;
+
+	list_for_each_entry_safe(e, n, &c->ec_stripe_cache, list) {
+		ec_stripe_buf_exit(&e->buf);
+		kfree(e);
+	}
+}
+
+static bool ec_block_readable(struct bch_fs *c, struct ec_stripe_buf *buf,
+			      unsigned idx)
+{
+	struct bch_stripe *v = &bkey_i_to_stripe(&buf->key)->v;
+	struct bch_extent_ptr *ptr = &v->ptrs[idx];
+	struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
+
+	return bch2_dev_is_readable(ca) && !ptr_stale(ca, ptr);
+}
+
 /* recovery read path: */
 int bch2_ec_read_extent(struct btree_trans *trans, struct bch_read_bio *rbio)
 {
@@ -824,15 +961,69 @@ int bch2_ec_read_extent(struct btree_trans *trans, struct bch_read_bio *rbio)
 		goto err;
 	}
 
-	ret = ec_stripe_buf_init(buf, offset, bio_sectors(&rbio->bio));
+	if (ec_stripe_cache_copy(c, buf, rbio, offset))
+		goto err;
+
+	/*
+	 * Read and reconstruct the full stripe, not just the range this read
+	 * needs: the result goes into the stripe cache, and the next
+	 * reconstruct read is overwhelmingly likely to be from the same
+	 * stripe:
+	 */
+	ret = ec_stripe_buf_init(buf, 0, le16_to_cpu(v->sectors));
 	if (ret)
 		goto err;
 
-	for (i = 0; i < v->nr_blocks; i++)
-		ec_block_io(c, buf, REQ_OP_READ, i, &cl);
+	/*
+	 * But only read the minimum set of blocks that can reconstruct it: the
+	 * other readable data blocks, plus one parity block per missing data
+	 * block. Parity blocks are taken lowest index first, since raid_rec()
+	 * recovers a single failure with P and a double failure with P and Q:
+	 */
+	unsigned nr_data = v->nr_blocks - v->nr_redundant;
+	DECLARE_BITMAP(want, BCH_BKEY_PTRS_MAX);
+	unsigned nr_missing = 0;
+
+	bitmap_zero(want, BCH_BKEY_PTRS_MAX);
+
+	for (i = 0; i < nr_data; i++)
+		if (i != rbio->pick.ec.block &&
+		    ec_block_readable(c, buf, i))
+			__set_bit(i, want);
+		else
+			nr_missing++;
+
+	for (i = nr_data; i < v->nr_blocks && nr_missing; i++)
+		if (ec_block_readable(c, buf, i)) {
+			__set_bit(i, want);
+			nr_missing--;
+		}
+
+	for_each_set_bit(i, want, v->nr_blocks)
+		ec_block_io(c, buf, REQ_OP_READ, i, 0, buf->size << 9, &cl);
 
 	closure_sync(&cl);
 
+	for (i = 0; i < v->nr_blocks; i++)
+		if (!test_bit(i, want))
+			clear_bit(i, buf->valid);
+
+	/*
+	 * If a block we counted on failed mid-read, retry with everything else
+	 * that's still available before giving up:
+	 */
+	if (ec_nr_failed(buf) > v->nr_redundant) {
+		for (i = 0; i < v->nr_blocks; i++)
+			if (!test_bit(i, want) &&
+			    ec_block_readable(c, buf, i)) {
+				set_bit(i, buf->valid);
+				ec_block_io(c, buf, REQ_OP_READ, i, 0,
+					    buf->size << 9, &cl);
+			}
+
+		closure_sync(&cl);
+	}
+
 	if (ec_nr_failed(buf) > v->nr_redundant) {
 		bch_err_ratelimited(c,
 			"error doing reconstruct read: unable to read enough blocks");
@@ -848,6 +1039,8 @@ int bch2_ec_read_extent(struct btree_trans *trans, struct bch_read_bio *rbio)
 
 	memcpy_to_bio(&rbio->bio, rbio->bio.bi_iter,
 		      buf->data[rbio->pick.ec.block] + ((offset - buf->offset) << 9));
+
+	ec_stripe_cache_add(c, buf);
 err:
 	ec_stripe_buf_exit(buf);
 	kfree(buf);
@@ -1400,13 +1593,25 @@ static void ec_stripe_create(struct ec_stripe_new *s)
 	BUG_ON(!s->allocated);
 	BUG_ON(!s->idx);
 
-	ec_generate_ec(&s->new_stripe);
+	/*
+	 * Compute and write p/q a chunk at a time, so that syndrome generation
+	 * for the rest of the stripe overlaps the writes already issued instead
+	 * of making a full pass over the stripe before the first write goes
+	 * out:
+	 */
+	for (unsigned offset = 0, bytes = s->new_stripe.size << 9;
+	     offset < bytes;
+	     offset += EC_WRITE_CHUNK_BYTES) {
+		unsigned b = min(bytes - offset, EC_WRITE_CHUNK_BYTES);
 
-	ec_generate_checksums(&s->new_stripe);
+		ec_generate_ec(&s->new_stripe, offset, b);
+
+		for (i = nr_data; i < v->nr_blocks; i++)
+			ec_block_io(c, &s->new_stripe, REQ_OP_WRITE, i,
+				    offset, b, &s->iodone);
+	}
 
-	/* write p/q: */
-	for (i = nr_data; i < v->nr_blocks; i++)
-		ec_block_io(c, &s->new_stripe, REQ_OP_WRITE, i, &s->iodone);
+	ec_generate_checksums(&s->new_stripe);
 	closure_sync(&s->iodone);
 
 	if (ec_nr_failed(&s->new_stripe)) {
@@ -1907,7 +2112,8 @@ static int __bch2_ec_stripe_head_reuse(struct btree_trans *trans, struct ec_stri
 			__set_bit(i, h->s->blocks_allocated);
 		}
 
-		ec_block_io(c, &h->s->existing_stripe, READ, i, &h->s->iodone);
+		ec_block_io(c, &h->s->existing_stripe, READ, i, 0,
+			    h->s->existing_stripe.size << 9, &h->s->iodone);
 	}
 
 	bkey_copy(&h->s->new_stripe.key, &h->s->existing_stripe.key);
@@ -2231,6 +2437,7 @@ void bch2_fs_ec_exit(struct bch_fs *c)
 
 	BUG_ON(!list_empty(&c->ec_stripe_new_list));
 
+	ec_stripe_cache_exit(c);
 	free_heap(&c->ec_stripes_heap);
 	genradix_free(&c->stripes);
 	bioset_exit(&c->ec_bioset);
@@ -2248,6 +2455,9 @@ void bch2_fs_ec_init_early(struct bch_fs *c)
 	mutex_init(&c->ec_stripe_new_lock);
 	init_waitqueue_head(&c->ec_stripe_new_wait);
 
+	INIT_LIST_HEAD(&c->ec_stripe_cache);
+	mutex_init(&c->ec_stripe_cache_lock);
+
 	INIT_WORK(&c->ec_stripe_create_work, ec_stripe_create_work);
 	INIT_WORK(&c->ec_stripe_delete_work, ec_stripe_delete_work);
 }
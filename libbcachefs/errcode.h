@@ -12,6 +12,7 @@
 	x(ENOMEM,			ENOMEM_disk_groups_validate)		\
 	x(ENOMEM,			ENOMEM_disk_groups_to_cpu)		\
 	x(ENOMEM,			ENOMEM_mark_snapshot)			\
+	x(ENOMEM,			ENOMEM_snapshot_euler_table)		\
 	x(ENOMEM,			ENOMEM_mark_stripe)			\
 	x(ENOMEM,			ENOMEM_mark_stripe_ptr)			\
 	x(ENOMEM,			ENOMEM_btree_key_cache_create)		\
@@ -36,6 +37,8 @@
 	x(ENOMEM,			ENOMEM_sb_journal_v2_validate)		\
 	x(ENOMEM,			ENOMEM_journal_entry_add)		\
 	x(ENOMEM,			ENOMEM_journal_read_buf_realloc)	\
+	x(ENOMEM,			ENOMEM_journal_read)			\
+	x(ENOMEM,			ENOMEM_journal_replay)			\
 	x(ENOMEM,			ENOMEM_btree_interior_update_worker_init)\
 	x(ENOMEM,			ENOMEM_btree_interior_update_pool_init)	\
 	x(ENOMEM,			ENOMEM_bio_read_init)			\
@@ -71,12 +74,14 @@
 	x(ENOMEM,			ENOMEM_gc_repair_key)			\
 	x(ENOMEM,			ENOMEM_fsck_extent_ends_at)		\
 	x(ENOMEM,			ENOMEM_fsck_add_nlink)			\
+	x(ENOMEM,			ENOMEM_fsck_shards)			\
 	x(ENOMEM,			ENOMEM_journal_key_insert)		\
 	x(ENOMEM,			ENOMEM_journal_keys_sort)		\
 	x(ENOMEM,			ENOMEM_read_superblock_clean)		\
 	x(ENOMEM,			ENOMEM_fs_alloc)			\
 	x(ENOMEM,			ENOMEM_fs_name_alloc)			\
 	x(ENOMEM,			ENOMEM_fs_other_alloc)			\
+	x(ENOMEM,			ENOMEM_nocow_locks_table)		\
 	x(ENOMEM,			ENOMEM_dev_alloc)			\
 	x(ENOSPC,			ENOSPC_disk_reservation)		\
 	x(ENOSPC,			ENOSPC_bucket_alloc)			\
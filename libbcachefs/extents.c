@@ -71,6 +71,18 @@ void bch2_mark_io_failure(struct bch_io_failures *failed,
 	}
 }
 
+/*
+ * Approximate read latency from the measured random read iops stored in the
+ * superblock (`bcachefs device benchmark`), for devices with no runtime
+ * measurements yet:
+ */
+static inline u64 dev_profile_latency(struct bch_dev *ca)
+{
+	u32 iops = ca->mi.iops[BCH_IOPS_randread];
+
+	return iops ? div_u64(NSEC_PER_SEC, iops) : 0;
+}
+
 /*
  * returns true if p1 is better than p2:
  */
@@ -85,6 +97,41 @@ static inline bool ptr_better(struct bch_fs *c,
 		u64 l1 = atomic64_read(&dev1->cur_latency[READ]);
 		u64 l2 = atomic64_read(&dev2->cur_latency[READ]);
 
+#ifndef __KERNEL__
+		/*
+		 * In userspace the fs-level latency tracking starts out empty
+		 * on every invocation; fall back to the blkdev shim's
+		 * measurements, fed by every bio including the superblock and
+		 * journal reads done at open time, so that short-lived tools
+		 * still prefer the fast replica:
+		 */
+		if (!l1 && dev1->disk_sb.bdev)
+			l1 = bdev_io_latency(dev1->disk_sb.bdev, READ);
+		if (!l2 && dev2->disk_sb.bdev)
+			l2 = bdev_io_latency(dev2->disk_sb.bdev, READ);
+#endif
+
+		if (!l1)
+			l1 = dev_profile_latency(dev1);
+		if (!l2)
+			l2 = dev_profile_latency(dev2);
+
+#ifndef __KERNEL__
+		/*
+		 * Also penalize devices that have been returning errors: a
+		 * failed read costs a full device timeout before failover, so
+		 * an unhealthy replica should only be tried when the healthy
+		 * ones are gone. The penalty dwarfs normal device latencies
+		 * without making the pick deterministic, so the occasional
+		 * read still lands on the unhealthy device and notices
+		 * recovery:
+		 */
+		if (dev1->disk_sb.bdev)
+			l1 += bdev_io_error_score(dev1->disk_sb.bdev) << 20;
+		if (dev2->disk_sb.bdev)
+			l2 += bdev_io_error_score(dev2->disk_sb.bdev) << 20;
+#endif
+
 		/* Pick at random, biased in favor of the faster device: */
 
 		return bch2_rand_range(l1 + l2) > l1;
@@ -43,10 +43,23 @@ struct bch_inode_info {
 
 #define bch2_pagecache_add_put(i)	bch2_two_state_unlock(&i->ei_pagecache_lock, 0)
 #define bch2_pagecache_add_tryget(i)	bch2_two_state_trylock(&i->ei_pagecache_lock, 0)
-#define bch2_pagecache_add_get(i)	bch2_two_state_lock(&i->ei_pagecache_lock, 0)
 
 #define bch2_pagecache_block_put(i)	bch2_two_state_unlock(&i->ei_pagecache_lock, 1)
-#define bch2_pagecache_block_get(i)	bch2_two_state_lock(&i->ei_pagecache_lock, 1)
+
+static inline void __bch2_pagecache_lock(struct bch_inode_info *inode, int s)
+{
+	if (unlikely(!bch2_two_state_trylock(&inode->ei_pagecache_lock, s))) {
+		struct bch_fs *c = inode->v.i_sb->s_fs_info;
+
+		count_event(c, pagecache_lock_contended);
+
+		if (__bch2_two_state_lock(&inode->ei_pagecache_lock, s))
+			count_event(c, pagecache_lock_slept);
+	}
+}
+
+#define bch2_pagecache_add_get(i)	__bch2_pagecache_lock(i, 0)
+#define bch2_pagecache_block_get(i)	__bch2_pagecache_lock(i, 1)
 
 static inline subvol_inum inode_inum(struct bch_inode_info *inode)
 {
@@ -12,6 +12,7 @@
 #include "fsck.h"
 #include "inode.h"
 #include "keylist.h"
+#include "progress.h"
 #include "recovery.h"
 #include "snapshot.h"
 #include "super.h"
@@ -20,6 +21,10 @@
 #include <linux/bsearch.h>
 #include <linux/dcache.h> /* struct qstr */
 
+#ifndef __KERNEL__
+#include "nlink_spill.h"
+#endif
+
 /*
  * XXX: this is handling transaction restarts without returning
  * -BCH_ERR_transaction_restart_nested, this is not how we do things anymore:
@@ -962,26 +967,149 @@ fsck_err:
 	return ret;
 }
 
-int bch2_check_inodes(struct bch_fs *c)
+/*
+ * The check_inodes/check_extents/check_dirents passes each walk one btree
+ * with one thread, but the work is independent across inode numbers: all the
+ * state they carry (inode_walker, snapshots_seen, extent_ends, prev inode)
+ * is scoped to the inode currently being walked. On big filesystems we shard
+ * these passes by inode number and run the shards concurrently, each worker
+ * with its own transaction and walker state.
+ *
+ * Shard boundaries always fall between distinct inode numbers, so
+ * within-inode state never spans workers. Workers commit independently;
+ * repairs to objects outside a worker's range (e.g. dirent targets) are
+ * serialized by btree locking as usual.
+ */
+
+typedef int (*fsck_shard_fn)(struct bch_fs *, u64, u64, struct bch_progress *);
+
+struct fsck_shard {
+	struct bch_fs		*c;
+	fsck_shard_fn		fn;
+	struct bch_progress	*progress;
+	u64			start;	/* first inode number, inclusive */
+	u64			end;	/* last inode number, inclusive */
+	int			ret;
+	struct closure		cl;
+};
+
+#define FSCK_MAX_SHARDS			16
+/* sample every nth distinct inode number when picking boundaries: */
+#define FSCK_SHARD_SAMPLE		1024
+/* don't bother sharding below ~16k inodes per shard: */
+#define FSCK_MIN_SAMPLES_PER_SHARD	16
+
+static CLOSURE_CALLBACK(fsck_shard_work)
+{
+	closure_type(s, struct fsck_shard, cl);
+
+	s->ret = s->fn(s->c, s->start, s->end, s->progress);
+	closure_return(cl);
+}
+
+static int fsck_shard_boundaries(struct bch_fs *c, darray_u64 *samples)
+{
+	u64 prev = 0;
+	u64 nr = 0;
+
+	return bch2_trans_run(c,
+		for_each_btree_key(trans, iter, BTREE_ID_inodes, POS_MIN,
+				   BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k, ({
+			int _ret = 0;
+			if (!nr || k.k->p.offset != prev) {
+				prev = k.k->p.offset;
+				if (!(nr++ % FSCK_SHARD_SAMPLE))
+					_ret = darray_push(samples, prev);
+			}
+			_ret;
+		})));
+}
+
+static int bch2_fsck_sharded(struct bch_fs *c, fsck_shard_fn fn,
+			     const char *name, u64 btree_id_mask)
+{
+	darray_u64 samples = { 0 };
+	struct fsck_shard *shards = NULL;
+	struct bch_progress progress;
+	unsigned i, nr_shards;
+	struct closure cl;
+	int ret;
+
+	bch2_progress_init(c, &progress, name, btree_id_mask);
+
+	ret = fsck_shard_boundaries(c, &samples);
+	if (ret)
+		goto out;
+
+	nr_shards = clamp_t(size_t, samples.nr / FSCK_MIN_SAMPLES_PER_SHARD,
+			    1, FSCK_MAX_SHARDS);
+	if (nr_shards == 1) {
+		ret = fn(c, 0, U64_MAX, &progress);
+		goto out;
+	}
+
+	shards = kcalloc(nr_shards, sizeof(*shards), GFP_KERNEL);
+	if (!shards) {
+		ret = -BCH_ERR_ENOMEM_fsck_shards;
+		goto out;
+	}
+
+	closure_init_stack(&cl);
+
+	for (i = 0; i < nr_shards; i++) {
+		struct fsck_shard *s = shards + i;
+
+		s->c	= c;
+		s->fn	= fn;
+		s->progress = &progress;
+		s->start = i ? samples.data[samples.nr * i / nr_shards] : 0;
+		s->end	= i + 1 < nr_shards
+			? samples.data[samples.nr * (i + 1) / nr_shards] - 1
+			: U64_MAX;
+
+		closure_call(&s->cl, fsck_shard_work, system_unbound_wq, &cl);
+	}
+
+	closure_sync(&cl);
+
+	for (i = 0; i < nr_shards; i++)
+		ret = ret ?: shards[i].ret;
+out:
+	kfree(shards);
+	darray_exit(&samples);
+	return ret;
+}
+
+static int check_inodes_range(struct bch_fs *c, u64 start, u64 end,
+			      struct bch_progress *progress)
 {
 	bool full = c->opts.fsck;
 	struct bch_inode_unpacked prev = { 0 };
 	struct snapshots_seen s;
+	struct btree *last_node = NULL;
 
 	snapshots_seen_init(&s);
 
 	int ret = bch2_trans_run(c,
-		for_each_btree_key_commit(trans, iter, BTREE_ID_inodes,
-				POS_MIN,
+		for_each_btree_key_upto_commit(trans, iter, BTREE_ID_inodes,
+				POS(0, start), SPOS(0, end, U32_MAX),
 				BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k,
-				NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
-			check_inode(trans, &iter, k, &prev, &s, full)));
+				NULL, NULL, BCH_TRANS_COMMIT_no_enospc, ({
+			bch2_progress_update_iter(trans, progress, &iter, &last_node);
+			check_inode(trans, &iter, k, &prev, &s, full);
+		})));
 
 	snapshots_seen_exit(&s);
 	bch_err_fn(c, ret);
 	return ret;
 }
 
+int bch2_check_inodes(struct bch_fs *c)
+{
+	return bch2_fsck_sharded(c, check_inodes_range,
+				 "check_inodes", BIT_ULL(BTREE_ID_inodes));
+}
+
 static struct bkey_s_c_dirent dirent_get_by_pos(struct btree_trans *trans,
 						struct btree_iter *iter,
 						struct bpos pos)
@@ -1403,22 +1531,26 @@ delete:
  * Walk extents: verify that extents have a corresponding S_ISREG inode, and
  * that i_size an i_sectors are consistent
  */
-int bch2_check_extents(struct bch_fs *c)
+static int check_extents_range(struct bch_fs *c, u64 start, u64 end,
+			       struct bch_progress *progress)
 {
 	struct inode_walker w = inode_walker_init();
 	struct snapshots_seen s;
 	struct extent_ends extent_ends;
 	struct disk_reservation res = { 0 };
+	struct btree *last_node = NULL;
 
 	snapshots_seen_init(&s);
 	extent_ends_init(&extent_ends);
 
 	int ret = bch2_trans_run(c,
-		for_each_btree_key_commit(trans, iter, BTREE_ID_extents,
-				POS(BCACHEFS_ROOT_INO, 0),
+		for_each_btree_key_upto_commit(trans, iter, BTREE_ID_extents,
+				POS(max_t(u64, start, BCACHEFS_ROOT_INO), 0),
+				SPOS(end, U64_MAX, U32_MAX),
 				BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k,
 				&res, NULL,
 				BCH_TRANS_COMMIT_no_enospc, ({
+			bch2_progress_update_iter(trans, progress, &iter, &last_node);
 			bch2_disk_reservation_put(c, &res);
 			check_extent(trans, &iter, k, &w, &s, &extent_ends) ?:
 			check_extent_overbig(trans, &iter, k);
@@ -1434,6 +1566,12 @@ int bch2_check_extents(struct bch_fs *c)
 	return ret;
 }
 
+int bch2_check_extents(struct bch_fs *c)
+{
+	return bch2_fsck_sharded(c, check_extents_range,
+				 "check_extents", BIT_ULL(BTREE_ID_extents));
+}
+
 int bch2_check_indirect_extents(struct bch_fs *c)
 {
 	struct disk_reservation res = { 0 };
@@ -1794,23 +1932,28 @@ fsck_err:
  * Walk dirents: verify that they all have a corresponding S_ISDIR inode,
  * validate d_type
  */
-int bch2_check_dirents(struct bch_fs *c)
+static int check_dirents_range(struct bch_fs *c, u64 start, u64 end,
+			       struct bch_progress *progress)
 {
 	struct inode_walker dir = inode_walker_init();
 	struct inode_walker target = inode_walker_init();
 	struct snapshots_seen s;
 	struct bch_hash_info hash_info;
+	struct btree *last_node = NULL;
 
 	snapshots_seen_init(&s);
 
 	int ret = bch2_trans_run(c,
-		for_each_btree_key_commit(trans, iter, BTREE_ID_dirents,
-				POS(BCACHEFS_ROOT_INO, 0),
+		for_each_btree_key_upto_commit(trans, iter, BTREE_ID_dirents,
+				POS(max_t(u64, start, BCACHEFS_ROOT_INO), 0),
+				SPOS(end, U64_MAX, U32_MAX),
 				BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS,
 				k,
 				NULL, NULL,
-				BCH_TRANS_COMMIT_no_enospc,
-			check_dirent(trans, &iter, k, &hash_info, &dir, &target, &s)));
+				BCH_TRANS_COMMIT_no_enospc, ({
+			bch2_progress_update_iter(trans, progress, &iter, &last_node);
+			check_dirent(trans, &iter, k, &hash_info, &dir, &target, &s);
+		})));
 
 	snapshots_seen_exit(&s);
 	inode_walker_exit(&dir);
@@ -1819,6 +1962,12 @@ int bch2_check_dirents(struct bch_fs *c)
 	return ret;
 }
 
+int bch2_check_dirents(struct bch_fs *c)
+{
+	return bch2_fsck_sharded(c, check_dirents_range,
+				 "check_dirents", BIT_ULL(BTREE_ID_dirents));
+}
+
 static int check_xattr(struct btree_trans *trans, struct btree_iter *iter,
 		       struct bkey_s_c k,
 		       struct bch_hash_info *hash_info,
@@ -2318,12 +2467,125 @@ static int check_nlinks_update_hardlinks(struct bch_fs *c,
 	return 0;
 }
 
+#ifndef __KERNEL__
+/*
+ * Streaming nlink check, for userspace fsck on filesystems with a single
+ * snapshot: instead of an in-memory table with an entry per inode, dirent
+ * target inums are spilled to a temporary file as sorted runs, then merged
+ * back in inum order while walking the inodes btree - memory stays bounded
+ * regardless of inode count, and the dirents btree is only walked once.
+ *
+ * With multiple snapshots a link's visibility to an inode depends on
+ * snapshots_seen state at the dirent's position, which doesn't survive the
+ * external sort - those filesystems take the in-memory path below.
+ */
+static bool check_nlinks_can_stream(struct bch_fs *c)
+{
+	unsigned nr = 0;
+
+	int ret = bch2_trans_run(c,
+		for_each_btree_key(trans, iter, BTREE_ID_snapshots, POS_MIN, 0, k, ({
+			if (k.k->type == KEY_TYPE_snapshot && ++nr > 1)
+				break;
+			0;
+		})));
+
+	return !ret && nr <= 1;
+}
+
+static int check_nlinks_update_inode_streamed(struct btree_trans *trans, struct btree_iter *iter,
+					      struct bkey_s_c k,
+					      struct nlink_spill *spill)
+{
+	struct bch_fs *c = trans->c;
+	struct bch_inode_unpacked u;
+	u32 count;
+	int ret = 0;
+
+	if (!bkey_is_inode(k.k))
+		return 0;
+
+	BUG_ON(bch2_inode_unpack(k, &u));
+
+	if (S_ISDIR(u.bi_mode))
+		return 0;
+
+	if (!u.bi_nlink)
+		return 0;
+
+	ret = bch2_nlink_spill_count(spill, k.k->p.offset, &count);
+	if (ret)
+		return ret;
+
+	if (fsck_err_on(bch2_inode_nlink_get(&u) != count,
+			c, inode_wrong_nlink,
+			"inode %llu type %s has wrong i_nlink (%u, should be %u)",
+			u.bi_inum, bch2_d_types[mode_to_type(u.bi_mode)],
+			bch2_inode_nlink_get(&u), count)) {
+		bch2_inode_nlink_set(&u, count);
+		ret = __write_inode(trans, &u, k.k->p.snapshot);
+	}
+fsck_err:
+	return ret;
+}
+
+noinline_for_stack
+static int check_nlinks_streamed(struct bch_fs *c)
+{
+	struct nlink_spill *spill = bch2_nlink_spill_new(c);
+	int ret;
+
+	if (!spill)
+		return -BCH_ERR_ENOMEM_fsck_add_nlink;
+
+	ret = bch2_trans_run(c,
+		for_each_btree_key(trans, iter, BTREE_ID_dirents, POS_MIN,
+				   BTREE_ITER_INTENT|
+				   BTREE_ITER_PREFETCH|
+				   BTREE_ITER_ALL_SNAPSHOTS, k, ({
+			if (k.k->type == KEY_TYPE_dirent) {
+				struct bkey_s_c_dirent d = bkey_s_c_to_dirent(k);
+
+				if (d.v->d_type != DT_DIR &&
+				    d.v->d_type != DT_SUBVOL) {
+					ret = bch2_nlink_spill_add(spill,
+							le64_to_cpu(d.v->d_inum));
+					if (ret)
+						break;
+				}
+			}
+			0;
+		})));
+	if (ret)
+		goto err;
+
+	ret = bch2_nlink_spill_merge_start(spill);
+	if (ret)
+		goto err;
+
+	ret = bch2_trans_run(c,
+		for_each_btree_key_commit(trans, iter, BTREE_ID_inodes, POS_MIN,
+				BTREE_ITER_INTENT|BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k,
+				NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
+			check_nlinks_update_inode_streamed(trans, &iter, k, spill)));
+err:
+	bch2_nlink_spill_free(spill);
+	bch_err_fn(c, ret);
+	return ret;
+}
+#endif /* !__KERNEL__ */
+
 int bch2_check_nlinks(struct bch_fs *c)
 {
 	struct nlink_table links = { 0 };
 	u64 this_iter_range_start, next_iter_range_start = 0;
 	int ret = 0;
 
+#ifndef __KERNEL__
+	if (check_nlinks_can_stream(c))
+		return check_nlinks_streamed(c);
+#endif
+
 	do {
 		this_iter_range_start = next_iter_range_start;
 		next_iter_range_start = U64_MAX;
@@ -223,6 +223,20 @@ static int bch2_inode_unpack_v2(struct bch_inode_unpacked *unpacked,
 	return 0;
 }
 
+/* Number of varints each v3 field is encoded as - fields > 64 bits take two: */
+static const u8 inode_v3_field_nr_varints[] = {
+#define x(_name, _bits)	1 + (_bits > 64),
+	BCH_INODE_FIELDS_v3()
+#undef  x
+};
+
+enum {
+	INODEv3_NR_VARINTS = 0
+#define x(_name, _bits)	+ 1 + (_bits > 64)
+	BCH_INODE_FIELDS_v3()
+#undef  x
+};
+
 static int bch2_inode_unpack_v3(struct bkey_s_c k,
 				struct bch_inode_unpacked *unpacked)
 {
@@ -230,9 +244,10 @@ static int bch2_inode_unpack_v3(struct bkey_s_c k,
 	const u8 *in = inode.v->fields;
 	const u8 *end = bkey_val_end(inode);
 	unsigned nr_fields = INODEv3_NR_FIELDS(inode.v);
-	unsigned fieldnr = 0;
+	unsigned fieldnr = 0, nr_varints = 0;
+	u64 v[2], f[INODEv3_NR_VARINTS];
+	const u64 *fp = f;
 	int ret;
-	u64 v[2];
 
 	unpacked->bi_inum	= inode.k->p.offset;
 	unpacked->bi_journal_seq= le64_to_cpu(inode.v->bi_journal_seq);
@@ -243,21 +258,18 @@ static int bch2_inode_unpack_v3(struct bkey_s_c k,
 	unpacked->bi_version	= le64_to_cpu(inode.v->bi_version);
 	unpacked->bi_mode	= INODEv3_MODE(inode.v);
 
+	for (unsigned i = 0; i < min_t(unsigned, nr_fields,
+				       ARRAY_SIZE(inode_v3_field_nr_varints)); i++)
+		nr_varints += inode_v3_field_nr_varints[i];
+
+	ret = bch2_varint_decode_batch(in, end, f, nr_varints);
+	if (ret < 0)
+		return ret;
+
 #define x(_name, _bits)							\
 	if (fieldnr < nr_fields) {					\
-		ret = bch2_varint_decode_fast(in, end, &v[0]);		\
-		if (ret < 0)						\
-			return ret;					\
-		in += ret;						\
-									\
-		if (_bits > 64) {					\
-			ret = bch2_varint_decode_fast(in, end, &v[1]);	\
-			if (ret < 0)					\
-				return ret;				\
-			in += ret;					\
-		} else {						\
-			v[1] = 0;					\
-		}							\
+		v[0] = *fp++;						\
+		v[1] = _bits > 64 ? *fp++ : 0;				\
 	} else {							\
 		v[0] = v[1] = 0;					\
 	}								\
@@ -604,7 +616,8 @@ int bch2_trigger_inode(struct btree_trans *trans,
 		bkey_s_to_inode_v3(new).v->bi_journal_seq = cpu_to_le64(trans->journal_res.seq);
 	}
 
-	if (flags & BTREE_TRIGGER_GC) {
+	if ((flags & BTREE_TRIGGER_GC) &&
+	    !(flags & BTREE_TRIGGER_GC_BUCKET_ONLY)) {
 		struct bch_fs *c = trans->c;
 
 		percpu_down_read(&c->mark_lock);
@@ -715,6 +728,9 @@ int bch2_inode_create(struct btree_trans *trans,
 	if (c->opts.shard_inode_numbers) {
 		bits -= c->inode_shard_bits;
 
+		/* cpu ids may exceed the count we sized the hints array for: */
+		cpu &= (1U << c->inode_shard_bits) - 1;
+
 		min = (cpu << bits);
 		max = (cpu << bits) | ~(ULLONG_MAX << bits);
 
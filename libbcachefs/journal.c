@@ -20,6 +20,10 @@
 #include "journal_seq_blacklist.h"
 #include "trace.h"
 
+#ifndef __KERNEL__
+#include <time.h>
+#endif
+
 static const char * const bch2_journal_errors[] = {
 #define x(n)	#n,
 	JOURNAL_ERRORS()
@@ -185,8 +189,10 @@ void bch2_journal_buf_put_final(struct journal *j, u64 seq, bool write)
 
 	lockdep_assert_held(&j->lock);
 
-	if (__bch2_journal_pin_put(j, seq))
+	if (__bch2_journal_pin_put(j, seq)) {
+		__set_bit(seq & j->pin.mask, j->pin_unpinned);
 		bch2_journal_reclaim_fast(j);
+	}
 	if (write)
 		closure_call(&j->io, bch2_journal_write, c->io_complete_wq, NULL);
 }
@@ -374,6 +380,7 @@ static int journal_entry_open(struct journal *j)
 	 */
 	atomic64_inc(&j->seq);
 	journal_pin_list_init(fifo_push_ref(&j->pin), 1);
+	__clear_bit(journal_cur_seq(j) & j->pin.mask, j->pin_unpinned);
 
 	BUG_ON(j->pin.back - 1 != atomic64_read(&j->seq));
 
@@ -713,6 +720,46 @@ out:
 	return ret;
 }
 
+#ifndef __KERNEL__
+/*
+ * Flush coalescing for the tools runtime: repair-heavy fscks can issue
+ * synchronous flushes from multiple threads faster than the journal can write
+ * them, turning every commit into its own journal write. When flush requests
+ * are observed arriving on a microsecond scale, briefly hold off forcing the
+ * write so concurrent commits land in the same entry - everyone whose seq made
+ * it in returns as soon as the one write completes. The window scales with the
+ * observed arrival interval and disengages for isolated flushes, so fsync
+ * latency through fuse is unaffected.
+ */
+#define JOURNAL_COALESCE_ENGAGE_NS	(32 * NSEC_PER_USEC)
+#define JOURNAL_COALESCE_MAX_NS		(128 * NSEC_PER_USEC)
+
+static void journal_flush_coalesce(struct journal *j, u64 now)
+{
+	u64 last = j->flush_seq_last;
+	u64 ewma = j->flush_seq_interval;
+
+	/* Racing updates just lose a sample - not worth a lock: */
+	j->flush_seq_last = now;
+
+	if (!last || now <= last)
+		return;
+
+	ewma = ewma
+		? ewma - (ewma >> 3) + ((now - last) >> 3)
+		: now - last;
+	j->flush_seq_interval = ewma;
+
+	if (ewma < JOURNAL_COALESCE_ENGAGE_NS) {
+		struct timespec ts = {
+			.tv_nsec = min(ewma * 4, (u64) JOURNAL_COALESCE_MAX_NS),
+		};
+
+		nanosleep(&ts, NULL);
+	}
+}
+#endif
+
 int bch2_journal_flush_seq(struct journal *j, u64 seq)
 {
 	u64 start_time = local_clock();
@@ -724,6 +771,10 @@ int bch2_journal_flush_seq(struct journal *j, u64 seq)
 	if (seq <= j->flushed_seq_ondisk)
 		return 0;
 
+#ifndef __KERNEL__
+	journal_flush_coalesce(j, start_time);
+#endif
+
 	ret = wait_event_interruptible(j->wait, (ret2 = bch2_journal_flush_seq_async(j, seq, NULL)));
 
 	if (!ret)
@@ -1175,7 +1226,10 @@ int bch2_fs_journal_start(struct journal *j, u64 cur_seq)
 	if (nr + 1 > j->pin.size) {
 		free_fifo(&j->pin);
 		init_fifo(&j->pin, roundup_pow_of_two(nr + 1), GFP_KERNEL);
-		if (!j->pin.data) {
+		kfree(j->pin_unpinned);
+		j->pin_unpinned = kcalloc(BITS_TO_LONGS(j->pin.size),
+					  sizeof(unsigned long), GFP_KERNEL);
+		if (!j->pin.data || !j->pin_unpinned) {
 			bch_err(c, "error reallocating journal fifo (%llu open entries)", nr);
 			return -BCH_ERR_ENOMEM_journal_pin_fifo;
 		}
@@ -1192,6 +1246,7 @@ int bch2_fs_journal_start(struct journal *j, u64 cur_seq)
 
 	fifo_for_each_entry_ptr(p, &j->pin, seq)
 		journal_pin_list_init(p, 1);
+	bitmap_zero(j->pin_unpinned, j->pin.size);
 
 	genradix_for_each(&c->journal_entries, iter, _i) {
 		i = *_i;
@@ -1309,6 +1364,7 @@ void bch2_fs_journal_exit(struct journal *j)
 
 	for (i = 0; i < ARRAY_SIZE(j->buf); i++)
 		kvpfree(j->buf[i].data, j->buf[i].buf_size);
+	kfree(j->pin_unpinned);
 	free_fifo(&j->pin);
 }
 
@@ -1336,6 +1392,11 @@ int bch2_fs_journal_init(struct journal *j)
 	if (!(init_fifo(&j->pin, JOURNAL_PIN, GFP_KERNEL)))
 		return -BCH_ERR_ENOMEM_journal_pin_fifo;
 
+	j->pin_unpinned = kcalloc(BITS_TO_LONGS(j->pin.size),
+				  sizeof(unsigned long), GFP_KERNEL);
+	if (!j->pin_unpinned)
+		return -BCH_ERR_ENOMEM_journal_pin_fifo;
+
 	for (i = 0; i < ARRAY_SIZE(j->buf); i++) {
 		j->buf[i].buf_size = JOURNAL_ENTRY_SIZE_MIN;
 		j->buf[i].data = kvpmalloc(j->buf[i].buf_size, GFP_KERNEL);
@@ -1364,6 +1425,10 @@ void __bch2_journal_debug_to_text(struct printbuf *out, struct journal *j)
 	s = READ_ONCE(j->reservations);
 
 	prt_printf(out, "dirty journal entries:\t%llu/%llu\n",	fifo_used(&j->pin), j->pin.size);
+	prt_printf(out, "pinned journal entries:\t%llu\n",	bch2_journal_nr_pinned_entries(j));
+	prt_printf(out, "btree node pins:\t%llu\n",		j->nr_pins[JOURNAL_PIN_btree]);
+	prt_printf(out, "key cache pins:\t\t%llu\n",		j->nr_pins[JOURNAL_PIN_key_cache]);
+	prt_printf(out, "other pins:\t\t%llu\n",		j->nr_pins[JOURNAL_PIN_other]);
 	prt_printf(out, "seq:\t\t\t%llu\n",			journal_cur_seq(j));
 	prt_printf(out, "seq_ondisk:\t\t%llu\n",		j->seq_ondisk);
 	prt_printf(out, "last_seq:\t\t%llu\n",			journal_last_seq(j));
@@ -923,15 +923,20 @@ static int journal_read_buf_realloc(struct journal_read_buf *b,
 	return 0;
 }
 
+/*
+ * @prefetched_sectors: sectors already read into @buf from the start of the
+ * bucket, by the prefetch in bch2_journal_read_buckets()
+ */
 static int journal_read_bucket(struct bch_dev *ca,
 			       struct journal_read_buf *buf,
 			       struct journal_list *jlist,
-			       unsigned bucket)
+			       unsigned bucket,
+			       unsigned prefetched_sectors)
 {
 	struct bch_fs *c = ca->fs;
 	struct journal_device *ja = &ca->journal;
 	struct jset *j = NULL;
-	unsigned sectors, sectors_read = 0;
+	unsigned sectors, sectors_read = prefetched_sectors;
 	u64 offset = bucket_to_sector(ca, ja->buckets[bucket]),
 	    end = offset + ca->mi.bucket_size;
 	bool saw_bad = false, csum_good;
@@ -940,6 +945,9 @@ static int journal_read_bucket(struct bch_dev *ca,
 
 	pr_debug("reading %u", bucket);
 
+	if (sectors_read)
+		j = buf->data;
+
 	while (offset < end) {
 		if (!sectors_read) {
 			struct bio *bio;
@@ -1065,33 +1073,139 @@ err:
 	return ret;
 }
 
-static CLOSURE_CALLBACK(bch2_journal_read_device)
+/*
+ * Journal buckets are self describing - each one is validated from its own
+ * contents, and duplicate entries are deduplicated by sequence number in
+ * journal_entry_add() - so different ranges of a device's buckets can be read
+ * and validated concurrently. Each worker has a single bio in flight at a
+ * time, so this also bounds the in-flight IO per device:
+ */
+#define JOURNAL_READ_NR_GROUPS	4
+
+struct journal_bucket_read {
+	struct bch_dev		*ca;
+	struct journal_list	*jlist;
+	unsigned		first_bucket;
+	unsigned		nr_buckets;
+	struct closure		cl;
+};
+
+/*
+ * Checksumming and decrypting a bucket's worth of journal entries is cpu
+ * bound, and with large journal entries it no longer hides behind the reads -
+ * so the read of the next bucket is issued before the current bucket is
+ * processed. Two buffers, one bio in flight at a time per worker, as before.
+ */
+struct journal_bucket_prefetch {
+	struct bio		*bio;
+	unsigned		sectors;
+	int			ret;
+	struct completion	done;
+};
+
+static void journal_bucket_prefetch_endio(struct bio *bio)
 {
-	closure_type(ja, struct journal_device, read);
-	struct bch_dev *ca = container_of(ja, struct bch_dev, journal);
-	struct bch_fs *c = ca->fs;
-	struct journal_list *jlist =
-		container_of(cl->parent, struct journal_list, cl);
-	struct journal_replay *r, **_r;
-	struct genradix_iter iter;
-	struct journal_read_buf buf = { NULL, 0 };
+	struct journal_bucket_prefetch *pf = bio->bi_private;
+
+	pf->ret = blk_status_to_errno(bio->bi_status);
+	complete(&pf->done);
+}
+
+static void journal_bucket_prefetch_start(struct journal_bucket_prefetch *pf,
+					  struct bch_dev *ca,
+					  struct journal_read_buf *buf,
+					  unsigned bucket)
+{
+	unsigned sectors = min_t(unsigned, ca->mi.bucket_size, buf->size >> 9);
+	unsigned nr_bvecs = buf_pages(buf->data, sectors << 9);
+	struct bio *bio = bio_kmalloc(nr_bvecs, GFP_KERNEL);
+
+	if (!bio) {
+		/* no prefetch: journal_read_bucket() reads synchronously */
+		pf->bio = NULL;
+		return;
+	}
+
+	bio_init(bio, ca->disk_sb.bdev, bio->bi_inline_vecs, nr_bvecs, REQ_OP_READ);
+
+	bio->bi_iter.bi_sector	= bucket_to_sector(ca, ca->journal.buckets[bucket]);
+	bch2_bio_map(bio, buf->data, sectors << 9);
+	bio->bi_end_io		= journal_bucket_prefetch_endio;
+	bio->bi_private		= pf;
+
+	pf->bio		= bio;
+	pf->sectors	= sectors;
+	pf->ret		= 0;
+	reinit_completion(&pf->done);
+
+	submit_bio(bio);
+}
+
+/* returns sectors read, 0 on error (the sync path re-reads and reports): */
+static unsigned journal_bucket_prefetch_wait(struct journal_bucket_prefetch *pf)
+{
+	if (!pf->bio)
+		return 0;
+
+	wait_for_completion(&pf->done);
+	kfree(pf->bio);
+	pf->bio = NULL;
+
+	return pf->ret ? 0 : pf->sectors;
+}
+
+static CLOSURE_CALLBACK(bch2_journal_read_buckets)
+{
+	closure_type(r, struct journal_bucket_read, cl);
+	struct bch_dev *ca = r->ca;
+	struct journal_list *jlist = r->jlist;
+	struct journal_read_buf bufs[2] = { { NULL, 0 }, { NULL, 0 } };
+	struct journal_bucket_prefetch pf = { NULL };
 	unsigned i;
-	int ret = 0;
+	int ret;
 
-	if (!ja->nr)
-		goto out;
+	init_completion(&pf.done);
 
-	ret = journal_read_buf_realloc(&buf, PAGE_SIZE);
+	ret =   journal_read_buf_realloc(&bufs[0], PAGE_SIZE) ?:
+		journal_read_buf_realloc(&bufs[1], PAGE_SIZE);
 	if (ret)
 		goto err;
 
-	pr_debug("%u journal buckets", ja->nr);
+	journal_bucket_prefetch_start(&pf, ca, &bufs[0], r->first_bucket);
+
+	for (i = 0; i < r->nr_buckets; i++) {
+		unsigned prefetched = journal_bucket_prefetch_wait(&pf);
+
+		if (i + 1 < r->nr_buckets)
+			journal_bucket_prefetch_start(&pf, ca, &bufs[(i + 1) & 1],
+						      r->first_bucket + i + 1);
 
-	for (i = 0; i < ja->nr; i++) {
-		ret = journal_read_bucket(ca, &buf, jlist, i);
+		ret = journal_read_bucket(ca, &bufs[i & 1], jlist,
+					  r->first_bucket + i, prefetched);
 		if (ret)
 			goto err;
 	}
+out:
+	journal_bucket_prefetch_wait(&pf);
+	kvpfree(bufs[0].data, bufs[0].size);
+	kvpfree(bufs[1].data, bufs[1].size);
+	percpu_ref_put(&ca->io_ref);
+	closure_return(cl);
+	return;
+err:
+	mutex_lock(&jlist->lock);
+	jlist->ret = ret;
+	mutex_unlock(&jlist->lock);
+	goto out;
+}
+
+static void journal_read_device_finish(struct bch_fs *c, struct bch_dev *ca,
+				       struct journal_list *jlist)
+{
+	struct journal_device *ja = &ca->journal;
+	struct journal_replay *r, **_r;
+	struct genradix_iter iter;
+	unsigned i;
 
 	ja->sectors_free = ca->mi.bucket_size;
 
@@ -1142,17 +1256,8 @@ found:
 	 */
 	ja->discard_idx = ja->dirty_idx_ondisk =
 		ja->dirty_idx = (ja->cur_idx + 1) % ja->nr;
-out:
-	bch_verbose(c, "journal read done on device %s, ret %i", ca->name, ret);
-	kvpfree(buf.data, buf.size);
-	percpu_ref_put(&ca->io_ref);
-	closure_return(cl);
-	return;
-err:
-	mutex_lock(&jlist->lock);
-	jlist->ret = ret;
-	mutex_unlock(&jlist->lock);
-	goto out;
+
+	bch_verbose(c, "journal read done on device %s", ca->name);
 }
 
 void bch2_journal_ptrs_to_text(struct printbuf *out, struct bch_fs *c,
@@ -1176,6 +1281,102 @@ void bch2_journal_ptrs_to_text(struct printbuf *out, struct bch_fs *c,
 	}
 }
 
+/*
+ * Full jset validation - the bkey-level checks in jset_validate() - is cpu
+ * bound and independent per entry, so it's fanned out over worker threads
+ * once all entries have been read. Entries live in the seq-indexed
+ * journal_entries radix and each worker gets a contiguous range, so results
+ * are in sequence order and a worker's first error is the error the whole
+ * pass reports, same as the old serial loop.
+ */
+
+#define JSET_VALIDATE_PER_WORKER	32
+
+struct jset_validate_work {
+	struct work_struct	work;
+	struct bch_fs		*c;
+	struct journal_replay	**entries;
+	size_t			nr;
+	int			ret;
+};
+
+static void jset_validate_work_fn(struct work_struct *work)
+{
+	struct jset_validate_work *w =
+		container_of(work, struct jset_validate_work, work);
+
+	for (size_t i = 0; i < w->nr; i++) {
+		struct journal_replay *r = w->entries[i];
+		int ret = jset_validate(w->c,
+					bch_dev_bkey_exists(w->c, r->ptrs[0].dev),
+					&r->j, r->ptrs[0].sector, READ);
+		if (ret) {
+			w->ret = ret;
+			break;
+		}
+	}
+}
+
+static int bch2_journal_entries_validate(struct bch_fs *c)
+{
+	struct journal_replay *i, **_i;
+	struct genradix_iter radix_iter;
+	size_t nr_entries = 0, nr = 0;
+	int ret = 0;
+
+	genradix_for_each(&c->journal_entries, radix_iter, _i)
+		if (*_i && !(*_i)->ignore)
+			nr_entries++;
+
+	unsigned nr_workers = min_t(size_t, num_online_cpus(),
+				    nr_entries / JSET_VALIDATE_PER_WORKER);
+
+	struct journal_replay **entries = NULL;
+	struct jset_validate_work *w = NULL;
+
+	if (nr_workers > 1) {
+		entries	= kvpmalloc(nr_entries * sizeof(*entries), GFP_KERNEL);
+		w	= kcalloc(nr_workers, sizeof(*w), GFP_KERNEL);
+	}
+
+	if (entries && w) {
+		genradix_for_each(&c->journal_entries, radix_iter, _i)
+			if (*_i && !(*_i)->ignore)
+				entries[nr++] = *_i;
+
+		for (unsigned t = 0; t < nr_workers; t++) {
+			w[t].c		= c;
+			w[t].entries	= entries + nr * t / nr_workers;
+			w[t].nr		= entries + nr * (t + 1) / nr_workers -
+				w[t].entries;
+			INIT_WORK(&w[t].work, jset_validate_work_fn);
+			queue_work(system_unbound_wq, &w[t].work);
+		}
+
+		for (unsigned t = 0; t < nr_workers; t++) {
+			flush_work(&w[t].work);
+			ret = ret ?: w[t].ret;
+		}
+	} else {
+		genradix_for_each(&c->journal_entries, radix_iter, _i) {
+			i = *_i;
+			if (!i || i->ignore)
+				continue;
+
+			ret = jset_validate(c,
+					    bch_dev_bkey_exists(c, i->ptrs[0].dev),
+					    &i->j, i->ptrs[0].sector, READ);
+			if (ret)
+				break;
+		}
+	}
+
+	if (entries)
+		kvpfree(entries, nr_entries * sizeof(*entries));
+	kfree(w);
+	return ret;
+}
+
 int bch2_journal_read(struct bch_fs *c,
 		      u64 *last_seq,
 		      u64 *blacklist_seq,
@@ -1194,24 +1395,65 @@ int bch2_journal_read(struct bch_fs *c,
 	jlist.last_seq = 0;
 	jlist.ret = 0;
 
+	struct journal_bucket_read *reads =
+		kcalloc(c->sb.nr_devices * JOURNAL_READ_NR_GROUPS,
+			sizeof(*reads), GFP_KERNEL);
+	if (!reads)
+		return -BCH_ERR_ENOMEM_journal_read;
+
+	unsigned nr_reads = 0;
+
 	for_each_member_device(c, ca) {
+		struct journal_device *ja = &ca->journal;
+
 		if (!c->opts.fsck &&
 		    !(bch2_dev_has_data(c, ca) & (1 << BCH_DATA_journal)))
 			continue;
 
-		if ((ca->mi.state == BCH_MEMBER_STATE_rw ||
-		     ca->mi.state == BCH_MEMBER_STATE_ro) &&
-		    percpu_ref_tryget(&ca->io_ref))
-			closure_call(&ca->journal.read,
-				     bch2_journal_read_device,
+		if (!((ca->mi.state == BCH_MEMBER_STATE_rw ||
+		       ca->mi.state == BCH_MEMBER_STATE_ro) &&
+		      percpu_ref_tryget(&ca->io_ref))) {
+			degraded = true;
+			continue;
+		}
+
+		if (!ja->nr) {
+			percpu_ref_put(&ca->io_ref);
+			continue;
+		}
+
+		pr_debug("%u journal buckets", ja->nr);
+
+		unsigned nr_groups = min_t(unsigned, ja->nr,
+					   JOURNAL_READ_NR_GROUPS);
+
+		for (unsigned g = 0; g < nr_groups; g++) {
+			struct journal_bucket_read *r = &reads[nr_reads++];
+
+			r->ca		= ca;
+			r->jlist	= &jlist;
+			r->first_bucket	= ja->nr * g / nr_groups;
+			r->nr_buckets	= ja->nr * (g + 1) / nr_groups -
+				r->first_bucket;
+
+			if (g)
+				percpu_ref_get(&ca->io_ref);
+
+			closure_call(&r->cl, bch2_journal_read_buckets,
 				     system_unbound_wq,
 				     &jlist.cl);
-		else
-			degraded = true;
+		}
 	}
 
 	closure_sync(&jlist.cl);
 
+	if (!jlist.ret)
+		for (unsigned r = 0; r < nr_reads; r++)
+			if (!reads[r].first_bucket)
+				journal_read_device_finish(c, reads[r].ca, &jlist);
+
+	kfree(reads);
+
 	if (jlist.ret)
 		return jlist.ret;
 
@@ -1348,6 +1590,10 @@ int bch2_journal_read(struct bch_fs *c,
 		seq++;
 	}
 
+	ret = bch2_journal_entries_validate(c);
+	if (ret)
+		goto err;
+
 	genradix_for_each(&c->journal_entries, radix_iter, _i) {
 		struct bch_replicas_padded replicas = {
 			.e.data_type = BCH_DATA_journal,
@@ -1369,14 +1615,6 @@ int bch2_journal_read(struct bch_fs *c,
 						   i->csum_good ? " (had good copy on another device)" : "");
 		}
 
-		ret = jset_validate(c,
-				    bch_dev_bkey_exists(c, i->ptrs[0].dev),
-				    &i->j,
-				    i->ptrs[0].sector,
-				    READ);
-		if (ret)
-			goto err;
-
 		for (ptr = 0; ptr < i->nr_ptrs; ptr++)
 			replicas.e.devs[replicas.e.nr_devs++] = i->ptrs[ptr].dev;
 
@@ -298,19 +298,44 @@ void bch2_journal_reclaim_fast(struct journal *j)
 
 	/*
 	 * Unpin journal entries whose reference counts reached zero, meaning
-	 * all btree nodes got written out
+	 * all btree nodes got written out - the unpinned bitmap lets us pop
+	 * runs of entries word at a time, without touching each entry's pin
+	 * list:
 	 */
 	while (!fifo_empty(&j->pin) &&
-	       j->pin.front <= j->seq_ondisk &&
-	       !atomic_read(&fifo_peek_front(&j->pin).count)) {
-		j->pin.front++;
-		popped = true;
+	       j->pin.front <= j->seq_ondisk) {
+		u64 idx	 = j->pin.front & j->pin.mask;
+		u64 span = min3(fifo_used(&j->pin),
+				j->seq_ondisk + 1 - j->pin.front,
+				j->pin.size - idx);
+		u64 nr	 = find_next_zero_bit(j->pin_unpinned,
+					      idx + span, idx) - idx;
+
+		if (!nr)
+			break;
+
+		j->pin.front	+= nr;
+		popped		= true;
+
+		/* stopped short of the span: hit a pinned entry */
+		if (nr < span)
+			break;
 	}
 
 	if (popped)
 		bch2_journal_space_available(j);
 }
 
+u64 bch2_journal_nr_pinned_entries(struct journal *j)
+{
+	u64 seq, nr = 0;
+
+	for (seq = j->pin.front; seq < j->pin.back; seq++)
+		nr += !test_bit(seq & j->pin.mask, j->pin_unpinned);
+
+	return nr;
+}
+
 bool __bch2_journal_pin_put(struct journal *j, u64 seq)
 {
 	struct journal_entry_pin_list *pin_list = journal_seq_pin(j, seq);
@@ -322,15 +347,28 @@ void bch2_journal_pin_put(struct journal *j, u64 seq)
 {
 	if (__bch2_journal_pin_put(j, seq)) {
 		spin_lock(&j->lock);
+		__set_bit(seq & j->pin.mask, j->pin_unpinned);
 		bch2_journal_reclaim_fast(j);
 		spin_unlock(&j->lock);
 	}
 }
 
+static enum journal_pin_type journal_pin_type(journal_pin_flush_fn fn)
+{
+	if (fn == bch2_btree_node_flush0 ||
+	    fn == bch2_btree_node_flush1)
+		return JOURNAL_PIN_btree;
+	else if (fn == bch2_btree_key_cache_journal_flush)
+		return JOURNAL_PIN_key_cache;
+	else
+		return JOURNAL_PIN_other;
+}
+
 static inline bool __journal_pin_drop(struct journal *j,
 				      struct journal_entry_pin *pin)
 {
 	struct journal_entry_pin_list *pin_list;
+	u64 seq = pin->seq;
 
 	if (!journal_pin_active(pin))
 		return false;
@@ -338,16 +376,22 @@ static inline bool __journal_pin_drop(struct journal *j,
 	if (j->flush_in_progress == pin)
 		j->flush_in_progress_dropped = true;
 
-	pin_list = journal_seq_pin(j, pin->seq);
+	pin_list = journal_seq_pin(j, seq);
 	pin->seq = 0;
 	list_del_init(&pin->list);
 
+	j->nr_pins[journal_pin_type(pin->flush)]--;
+
+	if (!atomic_dec_and_test(&pin_list->count))
+		return false;
+
+	__set_bit(seq & j->pin.mask, j->pin_unpinned);
+
 	/*
 	 * Unpinning a journal entry may make journal_next_bucket() succeed, if
 	 * writing a new last_seq will now make another bucket available:
 	 */
-	return atomic_dec_and_test(&pin_list->count) &&
-		pin_list == &fifo_peek_front(&j->pin);
+	return pin_list == &fifo_peek_front(&j->pin);
 }
 
 void bch2_journal_pin_drop(struct journal *j,
@@ -359,17 +403,6 @@ void bch2_journal_pin_drop(struct journal *j,
 	spin_unlock(&j->lock);
 }
 
-static enum journal_pin_type journal_pin_type(journal_pin_flush_fn fn)
-{
-	if (fn == bch2_btree_node_flush0 ||
-	    fn == bch2_btree_node_flush1)
-		return JOURNAL_PIN_btree;
-	else if (fn == bch2_btree_key_cache_journal_flush)
-		return JOURNAL_PIN_key_cache;
-	else
-		return JOURNAL_PIN_other;
-}
-
 static inline void bch2_journal_pin_set_locked(struct journal *j, u64 seq,
 			  struct journal_entry_pin *pin,
 			  journal_pin_flush_fn flush_fn,
@@ -384,6 +417,8 @@ static inline void bch2_journal_pin_set_locked(struct journal *j, u64 seq,
 	BUG_ON(!flush_fn);
 
 	atomic_inc(&pin_list->count);
+	__clear_bit(seq & j->pin.mask, j->pin_unpinned);
+	j->nr_pins[type]++;
 	pin->seq	= seq;
 	pin->flush	= flush_fn;
 	list_add(&pin->list, &pin_list->list[type]);
@@ -574,6 +609,46 @@ static size_t journal_flush_pins(struct journal *j,
 	return nr_flushed;
 }
 
+/*
+ * Reclaim pacing: the static "keep the journal half full" target oscillates
+ * between journal-full stalls and idle flushing when the workload is bursty
+ * (e.g. fsck repair). We track the rate the journal is filling and the rate
+ * reclaim is flushing pins, both in entries/sec as EWMAs, and scale how far
+ * ahead we flush by their ratio, keeping occupancy in a band instead of
+ * chasing a fixed point:
+ */
+static void journal_reclaim_update_fill_rate(struct journal *j)
+{
+	u64 now = local_clock();
+	u64 seq = journal_cur_seq(j);
+
+	if (j->reclaim_rate_time) {
+		u64 d_t = now - j->reclaim_rate_time;
+
+		/* Too short an interval to measure: */
+		if (d_t < NSEC_PER_MSEC)
+			return;
+
+		j->reclaim_fill_rate = ewma_add(j->reclaim_fill_rate,
+				div64_u64((seq - j->reclaim_rate_seq) * NSEC_PER_SEC, d_t),
+				3);
+	}
+
+	j->reclaim_rate_time	= now;
+	j->reclaim_rate_seq	= seq;
+}
+
+static void journal_reclaim_update_flush_rate(struct journal *j,
+					      size_t nr_flushed, u64 duration)
+{
+	if (!nr_flushed || !duration)
+		return;
+
+	j->reclaim_flush_rate = ewma_add(j->reclaim_flush_rate,
+			div64_u64(nr_flushed * NSEC_PER_SEC, duration),
+			3);
+}
+
 static u64 journal_seq_to_flush(struct journal *j)
 {
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
@@ -591,6 +666,19 @@ static u64 journal_seq_to_flush(struct journal *j)
 		/* Try to keep the journal at most half full: */
 		nr_buckets = ja->nr / 2;
 
+		/*
+		 * Scale by the ratio of measured fill rate to flush
+		 * throughput, clamped so occupancy stays between 1/4 and 3/4
+		 * of the journal: flush deeper when we're falling behind,
+		 * let entries accumulate when reclaim is outpacing the
+		 * workload:
+		 */
+		if (j->reclaim_flush_rate)
+			nr_buckets = clamp_t(unsigned,
+				div64_u64((u64) nr_buckets * j->reclaim_fill_rate,
+					  j->reclaim_flush_rate),
+				ja->nr / 4, ja->nr * 3 / 4);
+
 		nr_buckets = min(nr_buckets, ja->nr);
 
 		bucket_to_flush = (ja->cur_idx + nr_buckets) % ja->nr;
@@ -658,6 +746,8 @@ static int __bch2_journal_reclaim(struct journal *j, bool direct, bool kicked)
 
 		bch2_journal_do_discards(j);
 
+		journal_reclaim_update_fill_rate(j);
+
 		seq_to_flush = journal_seq_to_flush(j);
 		min_nr = 0;
 
@@ -675,7 +765,19 @@ static int __bch2_journal_reclaim(struct journal *j, bool direct, bool kicked)
 		if (atomic_read(&c->btree_cache.dirty) * 2 > c->btree_cache.used)
 			min_nr = 1;
 
-		min_key_cache = min(bch2_nr_btree_keys_need_flush(c), (size_t) 128);
+		/*
+		 * Key cache flushing is paced by the same feedback ratio as
+		 * the journal flush target - bigger batches when the journal
+		 * is filling faster than we're draining it:
+		 */
+		size_t batch = 128;
+		if (j->reclaim_flush_rate)
+			batch = clamp_t(size_t,
+				div64_u64(128 * j->reclaim_fill_rate,
+					  j->reclaim_flush_rate),
+				32, 512);
+
+		min_key_cache = min(bch2_nr_btree_keys_need_flush(c), batch);
 
 		trace_and_count(c, journal_reclaim_start, c,
 				direct, kicked,
@@ -685,10 +787,19 @@ static int __bch2_journal_reclaim(struct journal *j, bool direct, bool kicked)
 				atomic_long_read(&c->btree_key_cache.nr_dirty),
 				atomic_long_read(&c->btree_key_cache.nr_keys));
 
+		u64 flush_start = local_clock();
+
 		nr_flushed = journal_flush_pins(j, seq_to_flush,
 						~0, 0,
 						min_nr, min_key_cache);
 
+		if (nr_flushed) {
+			journal_reclaim_update_flush_rate(j, nr_flushed,
+					local_clock() - flush_start);
+			bch2_time_stats_update(&c->times[BCH_TIME_journal_reclaim_flush],
+					       flush_start);
+		}
+
 		if (direct)
 			j->nr_direct_reclaim += nr_flushed;
 		else
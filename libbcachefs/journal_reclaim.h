@@ -33,6 +33,7 @@ journal_seq_pin(struct journal *j, u64 seq)
 }
 
 void bch2_journal_reclaim_fast(struct journal *);
+u64 bch2_journal_nr_pinned_entries(struct journal *);
 bool __bch2_journal_pin_put(struct journal *, u64);
 void bch2_journal_pin_put(struct journal *, u64);
 void bch2_journal_pin_drop(struct journal *, struct journal_entry_pin *);
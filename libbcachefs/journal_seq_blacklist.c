@@ -128,16 +128,13 @@ static int journal_seq_blacklist_table_cmp(const void *_l,
 	return cmp_int(l->start, r->start);
 }
 
-bool bch2_journal_seq_is_blacklisted(struct bch_fs *c, u64 seq,
-				     bool dirty)
+bool __bch2_journal_seq_is_blacklisted(struct bch_fs *c, u64 seq,
+				       bool dirty)
 {
 	struct journal_seq_blacklist_table *t = c->journal_seq_blacklist_table;
 	struct journal_seq_blacklist_table_entry search = { .start = seq };
 	int idx;
 
-	if (!t)
-		return false;
-
 	idx = eytzinger0_find_le(t->entries, t->nr,
 				 sizeof(t->entries[0]),
 				 journal_seq_blacklist_table_cmp,
@@ -170,11 +167,16 @@ int bch2_blacklist_table_initialize(struct bch_fs *c)
 	if (!t)
 		return -BCH_ERR_ENOMEM_blacklist_table_init;
 
-	t->nr = nr;
+	t->nr		= nr;
+	t->min_seq	= U64_MAX;
+	t->max_seq	= 0;
 
 	for (i = 0; i < nr; i++) {
 		t->entries[i].start	= le64_to_cpu(bl->start[i].start);
 		t->entries[i].end	= le64_to_cpu(bl->start[i].end);
+
+		t->min_seq = min(t->min_seq, t->entries[i].start);
+		t->max_seq = max(t->max_seq, t->entries[i].end);
 	}
 
 	eytzinger0_sort(t->entries,
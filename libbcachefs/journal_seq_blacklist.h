@@ -11,7 +11,23 @@ blacklist_nr_entries(struct bch_sb_field_journal_seq_blacklist *bl)
 		: 0;
 }
 
-bool bch2_journal_seq_is_blacklisted(struct bch_fs *, u64, bool);
+bool __bch2_journal_seq_is_blacklisted(struct bch_fs *, u64, bool);
+
+/*
+ * This sits inside the per bset validation loop of btree node reads; most
+ * filesystems have no blacklisted sequence numbers at all, and when they do,
+ * nearly every seq checked falls outside the blacklisted range - so check the
+ * merged range bounds inline before the eytzinger walk:
+ */
+static inline bool bch2_journal_seq_is_blacklisted(struct bch_fs *c, u64 seq,
+						   bool dirty)
+{
+	struct journal_seq_blacklist_table *t = c->journal_seq_blacklist_table;
+
+	return t && seq >= t->min_seq && seq < t->max_seq
+		? __bch2_journal_seq_is_blacklisted(c, seq, dirty)
+		: false;
+}
 int bch2_journal_seq_blacklist_add(struct bch_fs *c, u64, u64);
 int bch2_blacklist_table_initialize(struct bch_fs *);
 
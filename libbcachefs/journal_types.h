@@ -147,8 +147,6 @@ enum journal_errors {
 #undef x
 };
 
-typedef DARRAY(u64)		darray_u64;
-
 /* Embedded in struct bch_fs */
 struct journal {
 	/* Fastpath stuff up front: */
@@ -237,6 +235,18 @@ struct journal {
 		struct journal_entry_pin_list *data;
 	}			pin;
 
+	/*
+	 * Bitmap over pin fifo slots (indexed by seq & pin.mask) of entries
+	 * whose reference count has reached zero, maintained under @lock:
+	 * bch2_journal_reclaim_fast() pops whole runs of unpinned entries by
+	 * scanning this word at a time, instead of reading every entry's
+	 * refcount:
+	 */
+	unsigned long		*pin_unpinned;
+
+	/* Active pins by type, for the debug/sysfs surface; under @lock: */
+	u64			nr_pins[JOURNAL_PIN_NR];
+
 	struct journal_space	space[journal_space_nr];
 
 	u64			replay_journal_seq;
@@ -257,6 +267,16 @@ struct journal {
 	u64			nr_direct_reclaim;
 	u64			nr_background_reclaim;
 
+	/*
+	 * Reclaim pacing: EWMAs of the rate the journal is filling and the
+	 * rate reclaim is flushing pins, both in entries/sec; the ratio
+	 * scales how far ahead reclaim flushes:
+	 */
+	u64			reclaim_fill_rate;
+	u64			reclaim_flush_rate;
+	u64			reclaim_rate_seq;
+	u64			reclaim_rate_time;
+
 	unsigned long		last_flushed;
 	struct journal_entry_pin *flush_in_progress;
 	bool			flush_in_progress_dropped;
@@ -268,6 +288,14 @@ struct journal {
 
 	unsigned long		last_flush_write;
 
+	/*
+	 * Flush coalescing in the tools runtime: timestamp of the last
+	 * bch2_journal_flush_seq() call and EWMA of the interval between
+	 * them. Unused in the kernel:
+	 */
+	u64			flush_seq_last;
+	u64			flush_seq_interval;
+
 	u64			write_start_time;
 
 	u64			nr_flush_writes;
@@ -314,9 +342,6 @@ struct journal_device {
 
 	/* Bio for journal reads/writes to this device */
 	struct bio		*bio;
-
-	/* for bch_journal_read_device */
-	struct closure		read;
 };
 
 /*
@@ -63,6 +63,35 @@ int bch2_resume_logged_ops(struct bch_fs *c)
 	return ret;
 }
 
+/*
+ * Empty slots in the logged ops btree are found by scanning to the last key,
+ * which makes every op in flight contend on the same tail position - under a
+ * truncate storm they all serialize on transaction restarts. Finished ops
+ * return their position to a small pool so subsequent ops can blind-insert at
+ * a known-empty slot instead: independent ops then commit without conflicting,
+ * and the same handful of slots get reused rather than growing the btree tail.
+ */
+static bool logged_ops_pool_get(struct bch_fs *c, struct bpos *pos)
+{
+	bool ret = false;
+
+	spin_lock(&c->logged_ops_pool_lock);
+	if (c->logged_ops_pool_nr) {
+		*pos = c->logged_ops_pool[--c->logged_ops_pool_nr];
+		ret = true;
+	}
+	spin_unlock(&c->logged_ops_pool_lock);
+	return ret;
+}
+
+static void logged_ops_pool_put(struct bch_fs *c, struct bpos pos)
+{
+	spin_lock(&c->logged_ops_pool_lock);
+	if (c->logged_ops_pool_nr < ARRAY_SIZE(c->logged_ops_pool))
+		c->logged_ops_pool[c->logged_ops_pool_nr++] = pos;
+	spin_unlock(&c->logged_ops_pool_lock);
+}
+
 static int __bch2_logged_op_start(struct btree_trans *trans, struct bkey_i *k)
 {
 	struct btree_iter iter;
@@ -81,6 +110,19 @@ static int __bch2_logged_op_start(struct btree_trans *trans, struct bkey_i *k)
 
 int bch2_logged_op_start(struct btree_trans *trans, struct bkey_i *k)
 {
+	struct bch_fs *c = trans->c;
+	struct bpos pos;
+
+	if (logged_ops_pool_get(c, &pos)) {
+		k->k.p = pos;
+
+		int ret = commit_do(trans, NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
+				bch2_btree_insert_nonextent(trans, BTREE_ID_logged_ops, k, 0));
+		if (ret)
+			logged_ops_pool_put(c, pos);
+		return ret;
+	}
+
 	return commit_do(trans, NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
 			 __bch2_logged_op_start(trans, k));
 }
@@ -89,6 +131,8 @@ void bch2_logged_op_finish(struct btree_trans *trans, struct bkey_i *k)
 {
 	int ret = commit_do(trans, NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
 			    bch2_btree_delete(trans, BTREE_ID_logged_ops, k->k.p, 0));
+	if (!ret)
+		logged_ops_pool_put(trans->c, k->k.p);
 	/*
 	 * This needs to be a fatal error because we've left an unfinished
 	 * operation in the logged ops btree.
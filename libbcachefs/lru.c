@@ -43,10 +43,31 @@ void bch2_lru_pos_to_text(struct printbuf *out, struct bpos lru)
 static int __bch2_lru_set(struct btree_trans *trans, u16 lru_id,
 			  u64 dev_bucket, u64 time, bool set)
 {
-	return time
-		? bch2_btree_bit_mod(trans, BTREE_ID_lru,
-				     lru_pos(lru_id, dev_bucket, time), set)
-		: 0;
+	struct bpos pos = lru_pos(lru_id, dev_bucket, time);
+
+	if (!time)
+		return 0;
+
+	/*
+	 * A bucket whose state changes more than once in a transaction (e.g.
+	 * discard after invalidate) generates a delete+set pair at the
+	 * intermediate time; both would go through the write buffer only for
+	 * the flush to skip one as redundant. Catch the same-position pair
+	 * here instead and rewrite the pending update in place:
+	 */
+	for (struct jset_entry *e = trans->journal_entries;
+	     e != btree_trans_journal_entries_top(trans);
+	     e = vstruct_next(e))
+		if (e->type == BCH_JSET_ENTRY_write_buffer_keys &&
+		    e->btree_id == BTREE_ID_lru &&
+		    bpos_eq(e->start->k.p, pos)) {
+			e->start->k.type = set ? KEY_TYPE_set : KEY_TYPE_deleted;
+			count_event(trans->c, lru_update_coalesced);
+			return 0;
+		}
+
+	count_event(trans->c, lru_update);
+	return bch2_btree_bit_mod(trans, BTREE_ID_lru, pos, set);
 }
 
 int bch2_lru_del(struct btree_trans *trans, u16 lru_id, u64 dev_bucket, u64 time)
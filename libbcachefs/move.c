@@ -97,6 +97,7 @@ struct moving_io {
 	struct list_head		io_list;
 	struct move_bucket_in_flight	*b;
 	struct closure			cl;
+	struct work_struct		work;
 	bool				read_completed;
 
 	unsigned			read_sectors;
@@ -142,8 +143,13 @@ static void move_write_done(struct bch_write_op *op)
 
 static void move_write(struct moving_io *io)
 {
+	struct moving_context *ctxt = io->write.ctxt;
+
 	if (unlikely(io->rbio.bio.bi_status || io->rbio.hole)) {
+		atomic_sub(io->write_sectors, &ctxt->write_sectors);
+		atomic_dec(&ctxt->write_ios);
 		move_free(io);
+		closure_put(&ctxt->cl);
 		return;
 	}
 
@@ -156,13 +162,40 @@ static void move_write(struct moving_io *io)
 		printbuf_exit(&buf);
 	}
 
-	closure_get(&io->write.ctxt->cl);
-	atomic_add(io->write_sectors, &io->write.ctxt->write_sectors);
-	atomic_inc(&io->write.ctxt->write_ios);
-
 	bch2_data_update_read_done(&io->write, io->rbio.pick.crc);
 }
 
+static void move_write_work(struct work_struct *work)
+{
+	struct moving_io *io = container_of(work, struct moving_io, work);
+
+	atomic_dec(&io->write.ctxt->write_queued);
+	move_write(io);
+}
+
+/*
+ * Compression is always punted; so are the software checksums, which are
+ * expensive enough that a single move thread re-checksumming every extent
+ * becomes CPU bound with the devices idle. crc32c is hardware accelerated
+ * and cheaper than the worker pool round trip:
+ */
+static bool move_write_needs_worker(struct moving_io *io)
+{
+	struct bch_write_op *op = &io->write.op;
+
+	if (op->compression_opt)
+		return true;
+
+	switch (op->csum_type) {
+	case BCH_CSUM_crc64_nonzero:
+	case BCH_CSUM_crc64:
+	case BCH_CSUM_xxhash:
+		return true;
+	default:
+		return bch2_csum_type_is_encryption(op->csum_type);
+	}
+}
+
 struct moving_io *bch2_moving_ctxt_next_pending_write(struct moving_context *ctxt)
 {
 	struct moving_io *io =
@@ -189,9 +222,37 @@ void bch2_moving_ctxt_do_pending_writes(struct moving_context *ctxt)
 	struct moving_io *io;
 
 	while ((io = bch2_moving_ctxt_next_pending_write(ctxt))) {
+		struct bch_fs *c = ctxt->trans->c;
+
 		bch2_trans_unlock_long(ctxt->trans);
 		list_del(&io->read_list);
-		move_write(io);
+
+		/*
+		 * The write is accounted in flight from here, before it's
+		 * punted, so that the queue of writes waiting on the worker
+		 * pool stays bounded by move_bytes_in_flight like the rest of
+		 * the pipeline; the ref keeps @ctxt alive until the write
+		 * completes:
+		 */
+		closure_get(&ctxt->cl);
+		atomic_add(io->write_sectors, &ctxt->write_sectors);
+		atomic_inc(&ctxt->write_ios);
+
+		/*
+		 * Writes that will compress or re-checksum in software are
+		 * punted to a worker pool, so that one move thread doing e.g.
+		 * background_compression=zstd isn't limited to a single core's
+		 * worth of compression; each extent update is an independent
+		 * transaction, so they don't need to complete in submission
+		 * order:
+		 */
+		if (move_write_needs_worker(io)) {
+			atomic_inc(&ctxt->write_queued);
+			INIT_WORK(&io->work, move_write_work);
+			queue_work(c->move_write_wq, &io->work);
+		} else {
+			move_write(io);
+		}
 	}
 }
 
@@ -484,6 +545,67 @@ int bch2_move_get_io_opts_one(struct btree_trans *trans,
 	return 0;
 }
 
+#define MOVE_DEPTH_SCALE_MAX		8
+#define MOVE_DEPTH_ADJUST_INTERVAL_NS	(100 * NSEC_PER_MSEC)
+
+static u64 move_observed_latency(struct bch_fs *c)
+{
+	u64 ret = 0;
+
+	for_each_rw_member(c, ca)
+		ret = max(ret, (u64) atomic64_read(&ca->cur_latency[WRITE]));
+	return ret;
+}
+
+/*
+ * Pipeline depth auto tuning: move_bytes_in_flight/move_ios_in_flight are a
+ * baseline that suits a hard drive, but an NVMe device wants far more
+ * outstanding IO before it saturates. Scale the limits up additively while
+ * we're actually filling the pipeline and device write latency isn't
+ * degrading, back off multiplicatively when it does - the latency ewmas tell
+ * us where the device's queue depth actually is, which a static limit can't
+ * (a deeper pipeline also means more index updates in flight, which the
+ * journal coalesces into fewer, bigger journal writes).
+ */
+static void move_tune_pipeline_depth(struct moving_context *ctxt)
+{
+	struct bch_fs *c = ctxt->trans->c;
+	u64 now = local_clock();
+
+	if (!ctxt->depth_scale)
+		ctxt->depth_scale = 1;
+
+	/* Adjust at most every 100ms, the latency ewmas need time to react: */
+	if (now - ctxt->depth_last_adjust < MOVE_DEPTH_ADJUST_INTERVAL_NS)
+		return;
+	ctxt->depth_last_adjust = now;
+
+	u64 latency = move_observed_latency(c);
+	if (!latency)
+		return;
+
+	if (!ctxt->depth_latency_base)
+		ctxt->depth_latency_base = latency;
+
+	if (latency < ctxt->depth_latency_base * 2) {
+		/*
+		 * Only go deeper if the current depth is actually being used -
+		 * otherwise we're not the bottleneck and more depth just
+		 * means more memory pinned:
+		 */
+		if (ctxt->depth_scale < MOVE_DEPTH_SCALE_MAX &&
+		    atomic_read(&ctxt->read_ios) + atomic_read(&ctxt->write_ios) >=
+		    c->opts.move_ios_in_flight * ctxt->depth_scale / 2)
+			ctxt->depth_scale++;
+
+		ctxt->depth_latency_base = min(ctxt->depth_latency_base, latency);
+	} else {
+		ctxt->depth_scale = max(1U, ctxt->depth_scale / 2);
+		/* Degradation might be the new normal; track it slowly: */
+		ctxt->depth_latency_base += ctxt->depth_latency_base >> 3;
+	}
+}
+
 int bch2_move_ratelimit(struct moving_context *ctxt)
 {
 	struct bch_fs *c = ctxt->trans->c;
@@ -517,13 +639,20 @@ int bch2_move_ratelimit(struct moving_context *ctxt)
 
 	/*
 	 * XXX: these limits really ought to be per device, SSDs and hard drives
-	 * will want different limits
+	 * will want different limits - the auto tuning only tracks the slowest
+	 * device
 	 */
+	move_tune_pipeline_depth(ctxt);
+
+	u64 sectors_in_flight = ((u64) c->opts.move_bytes_in_flight >> 9) *
+		ctxt->depth_scale;
+	u32 ios_in_flight = c->opts.move_ios_in_flight * ctxt->depth_scale;
+
 	move_ctxt_wait_event(ctxt,
-		atomic_read(&ctxt->write_sectors) < c->opts.move_bytes_in_flight >> 9 &&
-		atomic_read(&ctxt->read_sectors) < c->opts.move_bytes_in_flight >> 9 &&
-		atomic_read(&ctxt->write_ios) < c->opts.move_ios_in_flight &&
-		atomic_read(&ctxt->read_ios) < c->opts.move_ios_in_flight);
+		atomic_read(&ctxt->write_sectors) < sectors_in_flight &&
+		atomic_read(&ctxt->read_sectors) < sectors_in_flight &&
+		atomic_read(&ctxt->write_ios) < ios_in_flight &&
+		atomic_read(&ctxt->read_ios) < ios_in_flight);
 
 	return 0;
 }
@@ -625,6 +754,203 @@ next_nondata:
 	return ret;
 }
 
+/*
+ * Defragmentation: rewrite runs of small logically adjacent extents back to
+ * back through a single write point, so the new allocations are physically
+ * contiguous and the extent update path merges the rewritten extents into
+ * max-sized ones.
+ *
+ * An extent is only rewritten if it's smaller than the fragmentation
+ * threshold and extends a run - it's adjacent (same inode and snapshot,
+ * contiguous offsets) to the previously rewritten extent or to the next
+ * extent in the btree: rewriting isolated small extents wouldn't make reads
+ * any more sequential.
+ */
+
+#define DEFRAGMENT_FRAG_SECTORS_DEFAULT	128
+
+static int defragment_next_is_adjacent(struct btree_trans *trans,
+				       struct btree_iter *iter,
+				       struct bkey_s_c k,
+				       unsigned frag_sectors)
+{
+	struct btree_iter next_iter;
+	struct bkey_s_c next;
+	int ret;
+
+	bch2_trans_copy_iter(&next_iter, iter);
+	bch2_btree_iter_advance(&next_iter);
+	next = bch2_btree_iter_peek(&next_iter);
+
+	ret = bkey_err(next);
+	if (!ret)
+		ret = next.k &&
+			bkey_extent_is_direct_data(next.k) &&
+			next.k->size < frag_sectors &&
+			bpos_eq(bkey_start_pos(next.k), k.k->p);
+
+	bch2_trans_iter_exit(trans, &next_iter);
+	return ret;
+}
+
+static int bch2_defragment_data_btree(struct moving_context *ctxt,
+				      struct bpos start,
+				      struct bpos end,
+				      unsigned frag_sectors,
+				      enum btree_id btree_id)
+{
+	struct btree_trans *trans = ctxt->trans;
+	struct bch_fs *c = trans->c;
+	struct per_snapshot_io_opts snapshot_io_opts;
+	struct bch_io_opts *io_opts;
+	struct bkey_buf sk;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct data_update_opts data_opts;
+	struct bpos run_end = POS_MIN;
+	int ret = 0, ret2;
+
+	per_snapshot_io_opts_init(&snapshot_io_opts, c);
+	bch2_bkey_buf_init(&sk);
+
+	if (ctxt->stats) {
+		ctxt->stats->data_type	= BCH_DATA_user;
+		ctxt->stats->pos	= BBPOS(btree_id, start);
+	}
+
+	bch2_trans_iter_init(trans, &iter, btree_id, start,
+			     BTREE_ITER_PREFETCH|
+			     BTREE_ITER_ALL_SNAPSHOTS);
+
+	while (!bch2_move_ratelimit(ctxt)) {
+		bch2_trans_begin(trans);
+
+		k = bch2_btree_iter_peek(&iter);
+		if (!k.k)
+			break;
+
+		ret = bkey_err(k);
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+			continue;
+		if (ret)
+			break;
+
+		if (bkey_ge(bkey_start_pos(k.k), end))
+			break;
+
+		if (ctxt->stats)
+			ctxt->stats->pos = BBPOS(iter.btree_id, iter.pos);
+
+		if (!bkey_extent_is_direct_data(k.k))
+			goto next_nondata;
+
+		if (k.k->size >= frag_sectors)
+			goto next;
+
+		ret2 = bpos_eq(bkey_start_pos(k.k), run_end)
+			? 1
+			: defragment_next_is_adjacent(trans, &iter, k, frag_sectors);
+		if (bch2_err_matches(ret2, BCH_ERR_transaction_restart))
+			continue;
+		if (ret2 <= 0) {
+			ret = ret2;
+			if (ret)
+				break;
+			goto next;
+		}
+
+		io_opts = bch2_move_get_io_opts(trans, &snapshot_io_opts, k);
+		ret = PTR_ERR_OR_ZERO(io_opts);
+		if (ret)
+			continue;
+
+		memset(&data_opts, 0, sizeof(data_opts));
+
+		struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+		unsigned i = 0;
+		bkey_for_each_ptr(ptrs, ptr) {
+			if (!ptr->cached)
+				data_opts.rewrite_ptrs |= 1U << i;
+			i++;
+		}
+		if (!data_opts.rewrite_ptrs)
+			goto next;
+
+		/*
+		 * The iterator gets unlocked by __bch2_read_extent - need to
+		 * save a copy of @k elsewhere:
+		 */
+		bch2_bkey_buf_reassemble(&sk, c, k);
+		k = bkey_i_to_s_c(sk.k);
+
+		ret2 = bch2_move_extent(ctxt, NULL, &iter, k, *io_opts, data_opts);
+		if (ret2) {
+			if (bch2_err_matches(ret2, BCH_ERR_transaction_restart))
+				continue;
+
+			if (ret2 == -ENOMEM) {
+				/* memory allocation failure, wait for some IO to finish */
+				bch2_move_ctxt_wait_for_io(ctxt);
+				continue;
+			}
+
+			/* XXX signal failure */
+			goto next;
+		}
+
+		run_end = k.k->p;
+next:
+		if (ctxt->stats)
+			atomic64_add(k.k->size, &ctxt->stats->sectors_seen);
+next_nondata:
+		bch2_btree_iter_advance(&iter);
+	}
+
+	bch2_trans_iter_exit(trans, &iter);
+	bch2_bkey_buf_exit(&sk, c);
+	per_snapshot_io_opts_exit(&snapshot_io_opts);
+
+	return ret;
+}
+
+int bch2_defragment_data(struct bch_fs *c,
+			 struct bbpos start,
+			 struct bbpos end,
+			 unsigned frag_sectors,
+			 struct bch_move_stats *stats,
+			 struct write_point_specifier wp)
+{
+	struct moving_context ctxt;
+	enum btree_id id;
+	int ret = 0;
+
+	if (!frag_sectors)
+		frag_sectors = DEFRAGMENT_FRAG_SECTORS_DEFAULT;
+
+	bch2_moving_ctxt_init(&ctxt, c, NULL, stats, wp, true);
+
+	for (id = start.btree;
+	     id <= min_t(unsigned, end.btree, btree_id_nr_alive(c) - 1);
+	     id++) {
+		ctxt.stats->pos = BBPOS(id, POS_MIN);
+
+		if (!btree_type_has_ptrs(id) ||
+		    !bch2_btree_id_root(c, id)->b)
+			continue;
+
+		ret = bch2_defragment_data_btree(&ctxt,
+				id == start.btree ? start.pos : POS_MIN,
+				id == end.btree   ? end.pos   : POS_MAX,
+				frag_sectors, id);
+		if (ret)
+			break;
+	}
+
+	bch2_moving_ctxt_exit(&ctxt);
+
+	return ret;
+}
+
 int __bch2_move_data(struct moving_context *ctxt,
 		     struct bbpos start,
 		     struct bbpos end,
@@ -1164,21 +1490,27 @@ static void bch2_moving_ctxt_to_text(struct printbuf *out, struct bch_fs *c, str
 {
 	struct moving_io *io;
 
+	unsigned scale = ctxt->depth_scale ?: 1;
+
 	bch2_move_stats_to_text(out, ctxt->stats);
 	printbuf_indent_add(out, 2);
 
+	prt_printf(out, "depth scale: %u", scale);
+	prt_newline(out);
+
 	prt_printf(out, "reads: ios %u/%u sectors %u/%u",
 		   atomic_read(&ctxt->read_ios),
-		   c->opts.move_ios_in_flight,
+		   c->opts.move_ios_in_flight * scale,
 		   atomic_read(&ctxt->read_sectors),
-		   c->opts.move_bytes_in_flight >> 9);
+		   (c->opts.move_bytes_in_flight >> 9) * scale);
 	prt_newline(out);
 
-	prt_printf(out, "writes: ios %u/%u sectors %u/%u",
+	prt_printf(out, "writes: ios %u/%u sectors %u/%u queued for csum/compress %u",
 		   atomic_read(&ctxt->write_ios),
-		   c->opts.move_ios_in_flight,
+		   c->opts.move_ios_in_flight * scale,
 		   atomic_read(&ctxt->write_sectors),
-		   c->opts.move_bytes_in_flight >> 9);
+		   (c->opts.move_bytes_in_flight >> 9) * scale,
+		   atomic_read(&ctxt->write_queued));
 	prt_newline(out);
 
 	printbuf_indent_add(out, 2);
@@ -34,6 +34,13 @@ struct moving_context {
 	atomic_t		write_sectors;
 	atomic_t		read_ios;
 	atomic_t		write_ios;
+	/* writes punted to the worker pool, not yet running: */
+	atomic_t		write_queued;
+
+	/* pipeline depth auto tuning: */
+	unsigned		depth_scale;
+	u64			depth_latency_base;
+	u64			depth_last_adjust;
 
 	wait_queue_head_t	wait;
 };
@@ -140,6 +147,12 @@ int bch2_evacuate_bucket(struct moving_context *,
 			   struct move_bucket_in_flight *,
 			   struct bpos, int,
 			   struct data_update_opts);
+int bch2_defragment_data(struct bch_fs *,
+			 struct bbpos,
+			 struct bbpos,
+			 unsigned,
+			 struct bch_move_stats *,
+			 struct write_point_specifier);
 int bch2_data_job(struct bch_fs *,
 		  struct bch_move_stats *,
 		  struct bch_ioctl_data);
@@ -139,6 +139,62 @@ static bool bucket_in_flight(struct buckets_in_flight *list,
 
 typedef DARRAY(struct move_bucket) move_buckets;
 
+/*
+ * Seed the per device fragmentation histograms from the fragmentation LRU;
+ * from then on they're maintained incrementally by bch2_dev_usage_update().
+ * Buckets changing state while we scan can be counted twice or missed - the
+ * histogram is a planning heuristic, not bucket accounting.
+ */
+static int bch2_copygc_frag_hist_seed(struct bch_fs *c)
+{
+	int ret = bch2_trans_run(c,
+		bch2_btree_write_buffer_tryflush(trans) ?:
+		for_each_btree_key_upto(trans, iter, BTREE_ID_lru,
+				lru_pos(BCH_LRU_FRAGMENTATION_START, 0, 0),
+				lru_pos(BCH_LRU_FRAGMENTATION_START, U64_MAX, LRU_TIME_MAX),
+				0, k, ({
+			struct bpos bucket = u64_to_bucket(k.k->p.offset);
+
+			if (bch2_dev_bucket_exists(c, bucket)) {
+				struct bch_dev *ca = bch_dev_bkey_exists(c, bucket.inode);
+				unsigned bin = min_t(u64, BCH_FRAG_HIST_BINS - 1,
+					(lru_pos_time(k.k->p) * BCH_FRAG_HIST_BINS) >> 31);
+
+				atomic64_inc(&ca->frag_hist[bin]);
+			}
+			0;
+		})));
+
+	if (!ret)
+		c->copygc_frag_hist_seeded = true;
+	return ret;
+}
+
+/*
+ * Upper bound on the fragmentation LRU walk: the smallest occupied-sector
+ * range that still holds several batches worth of candidates, per the
+ * histograms. Without a bound, stale LRU entries can walk us deep into nearly
+ * full buckets even when plenty of emptier ones exist.
+ */
+static u64 bch2_copygc_frag_cutoff(struct bch_fs *c, size_t nr_to_get)
+{
+	u64 want = nr_to_get * 4, found = 0;
+
+	if (!c->copygc_frag_hist_seeded)
+		return LRU_TIME_MAX;
+
+	for (unsigned i = 0; i < BCH_FRAG_HIST_BINS; i++) {
+		for_each_rw_member(c, ca)
+			found += max_t(s64, 0, atomic64_read(&ca->frag_hist[i]));
+
+		if (found >= want)
+			return min_t(u64, LRU_TIME_MAX,
+				     ((u64) (i + 1) << 31) / BCH_FRAG_HIST_BINS);
+	}
+
+	return LRU_TIME_MAX;
+}
+
 static int bch2_copygc_get_buckets(struct moving_context *ctxt,
 			struct buckets_in_flight *buckets_in_flight,
 			move_buckets *buckets)
@@ -147,6 +203,7 @@ static int bch2_copygc_get_buckets(struct moving_context *ctxt,
 	struct bch_fs *c = trans->c;
 	size_t nr_to_get = max_t(size_t, 16U, buckets_in_flight->nr / 4);
 	size_t saw = 0, in_flight = 0, not_movable = 0, sectors = 0;
+	u64 cutoff = bch2_copygc_frag_cutoff(c, nr_to_get);
 	int ret;
 
 	move_buckets_wait(ctxt, buckets_in_flight, false);
@@ -158,10 +215,10 @@ static int bch2_copygc_get_buckets(struct moving_context *ctxt,
 	if (bch2_fs_fatal_err_on(ret, c, "%s: error %s from bch2_btree_write_buffer_tryflush()",
 				 __func__, bch2_err_str(ret)))
 		return ret;
-
+again:
 	ret = for_each_btree_key_upto(trans, iter, BTREE_ID_lru,
 				  lru_pos(BCH_LRU_FRAGMENTATION_START, 0, 0),
-				  lru_pos(BCH_LRU_FRAGMENTATION_START, U64_MAX, LRU_TIME_MAX),
+				  lru_pos(BCH_LRU_FRAGMENTATION_START, U64_MAX, cutoff),
 				  0, k, ({
 		struct move_bucket b = { .k.bucket = u64_to_bucket(k.k->p.offset) };
 		int ret2 = 0;
@@ -188,6 +245,16 @@ err:
 		ret2;
 	}));
 
+	/*
+	 * The histogram can be optimistic (stale LRU entries, in flight
+	 * buckets) - if the bounded walk came up empty, retry unbounded so
+	 * copygc can't stall with fuller buckets still needing a move:
+	 */
+	if (ret >= 0 && !buckets->nr && cutoff != LRU_TIME_MAX) {
+		cutoff = LRU_TIME_MAX;
+		goto again;
+	}
+
 	pr_debug("have: %zu (%zu) saw %zu in flight %zu not movable %zu got %zu (%zu)/%zu buckets ret %i",
 		 buckets_in_flight->nr, buckets_in_flight->sectors,
 		 saw, in_flight, not_movable, buckets->nr, sectors, nr_to_get, ret);
@@ -302,6 +369,44 @@ void bch2_copygc_wait_to_text(struct printbuf *out, struct bch_fs *c)
 	prt_printf(out, "Currently calculated wait: ");
 	prt_human_readable_u64(out, bch2_copygc_wait_amount(c));
 	prt_newline(out);
+
+	if (!c->copygc_frag_hist_seeded)
+		return;
+
+	/*
+	 * Expected write amplification for the next batch: live sectors that
+	 * must be rewritten per sector of space reclaimed, taking the emptiest
+	 * candidates first and scoring each histogram bin at its midpoint.
+	 */
+	u64 take_buckets = 0, live = 0;
+
+	for_each_rw_member(c, ca) {
+		prt_printf(out, "dev %u fragmentation:      ", ca->dev_idx);
+		for (unsigned i = 0; i < BCH_FRAG_HIST_BINS; i++)
+			prt_printf(out, "%llu ",
+				   max_t(s64, 0, atomic64_read(&ca->frag_hist[i])));
+		prt_newline(out);
+	}
+
+	for (unsigned i = 0; i < BCH_FRAG_HIST_BINS && take_buckets < 16; i++) {
+		u64 nr = 0;
+
+		for_each_rw_member(c, ca)
+			nr += max_t(s64, 0, atomic64_read(&ca->frag_hist[i]));
+
+		nr = min_t(u64, nr, 16 - take_buckets);
+		take_buckets	+= nr;
+		live		+= nr * (2 * i + 1);
+	}
+
+	if (take_buckets) {
+		u64 total = take_buckets * 2 * BCH_FRAG_HIST_BINS;
+
+		prt_printf(out, "Expected write amp:        %llu.%02llu",
+			   live / (total - live),
+			   (live * 100 / (total - live)) % 100);
+		prt_newline(out);
+	}
 }
 
 static int bch2_copygc_thread(void *arg)
@@ -331,6 +436,12 @@ static int bch2_copygc_thread(void *arg)
 			      writepoint_ptr(&c->copygc_write_point),
 			      false);
 
+	/* on failure we just plan without the histograms: */
+	ret = bch2_copygc_frag_hist_seed(c);
+	if (ret && !bch2_err_matches(ret, EROFS))
+		bch_err_msg(c, ret, "seeding copygc fragmentation histogram");
+	ret = 0;
+
 	while (!ret && !kthread_should_stop()) {
 		bool did_work = false;
 
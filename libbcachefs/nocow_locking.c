@@ -11,12 +11,26 @@ bool bch2_bucket_nocow_is_locked(struct bucket_nocow_lock_table *t, struct bpos
 {
 	u64 dev_bucket = bucket_to_u64(bucket);
 	struct nocow_lock_bucket *l = bucket_nocow_lock(t, dev_bucket);
-	unsigned i;
+	unsigned i, seq;
+	bool ret;
+
+	/*
+	 * Optimistic read: slots are reassigned to different buckets under
+	 * l->seq, so a stable sequence number means we didn't race with a
+	 * reassignment and misattribute another bucket's lock count:
+	 */
+	do {
+		seq = read_seqcount_begin(&l->seq);
+		ret = false;
+
+		for (i = 0; i < ARRAY_SIZE(l->b); i++)
+			if (l->b[i] == dev_bucket && atomic_read(&l->l[i])) {
+				ret = true;
+				break;
+			}
+	} while (read_seqcount_retry(&l->seq, seq));
 
-	for (i = 0; i < ARRAY_SIZE(l->b); i++)
-		if (l->b[i] == dev_bucket && atomic_read(&l->l[i]))
-			return true;
-	return false;
+	return ret;
 }
 
 #define sign(v)		(v < 0 ? -1 : v > 0 ? 1 : 0)
@@ -55,9 +69,13 @@ bool __bch2_bucket_nocow_trylock(struct nocow_lock_bucket *l,
 
 	for (i = 0; i < ARRAY_SIZE(l->b); i++)
 		if (!atomic_read(&l->l[i])) {
+			write_seqcount_begin(&l->seq);
 			l->b[i] = dev_bucket;
+			write_seqcount_end(&l->seq);
 			goto take_lock;
 		}
+
+	l->collisions++;
 fail:
 	spin_unlock(&l->lock);
 	return false;
@@ -93,11 +111,16 @@ void bch2_nocow_locks_to_text(struct printbuf *out, struct bucket_nocow_lock_tab
 
 {
 	unsigned i, nr_zero = 0;
+	u64 collisions = 0;
 	struct nocow_lock_bucket *l;
 
-	for (l = t->l; l < t->l + ARRAY_SIZE(t->l); l++) {
+	prt_printf(out, "table size %u\n", 1U << t->bits);
+
+	for (l = t->l; l < t->l + (1U << t->bits); l++) {
 		unsigned v = 0;
 
+		collisions += l->collisions;
+
 		for (i = 0; i < ARRAY_SIZE(l->l); i++)
 			v |= atomic_read(&l->l[i]);
 
@@ -122,23 +145,47 @@ void bch2_nocow_locks_to_text(struct printbuf *out, struct bucket_nocow_lock_tab
 
 	if (nr_zero)
 		prt_printf(out, "(%u empty entries)\n", nr_zero);
+
+	prt_printf(out, "collisions %llu\n", collisions);
 }
 
 void bch2_fs_nocow_locking_exit(struct bch_fs *c)
 {
 	struct bucket_nocow_lock_table *t = &c->nocow_locks;
 
-	for (struct nocow_lock_bucket *l = t->l; l < t->l + ARRAY_SIZE(t->l); l++)
+	if (!t->l)
+		return;
+
+	for (struct nocow_lock_bucket *l = t->l; l < t->l + (1U << t->bits); l++)
 		for (unsigned j = 0; j < ARRAY_SIZE(l->l); j++)
 			BUG_ON(atomic_read(&l->l[j]));
+
+	kvfree(t->l);
+	t->l = NULL;
 }
 
 int bch2_fs_nocow_locking_init(struct bch_fs *c)
 {
 	struct bucket_nocow_lock_table *t = &c->nocow_locks;
 
-	for (struct nocow_lock_bucket *l = t->l; l < t->l + ARRAY_SIZE(t->l); l++)
+	/*
+	 * Parallel nocow writes land in different devices' buckets, so scale
+	 * the table with the device count to keep the collision rate of a
+	 * single device filesystem:
+	 */
+	t->bits = min_t(unsigned,
+			BUCKET_NOCOW_LOCKS_BITS + ilog2(c->sb.nr_devices ?: 1),
+			BUCKET_NOCOW_LOCKS_MAX_BITS);
+
+	t->l = kvmalloc_array(1U << t->bits, sizeof(t->l[0]),
+			      GFP_KERNEL|__GFP_ZERO);
+	if (!t->l)
+		return -BCH_ERR_ENOMEM_nocow_locks_table;
+
+	for (struct nocow_lock_bucket *l = t->l; l < t->l + (1U << t->bits); l++) {
 		spin_lock_init(&l->lock);
+		seqcount_init(&l->seq);
+	}
 
 	return 0;
 }
@@ -11,9 +11,9 @@
 static inline struct nocow_lock_bucket *bucket_nocow_lock(struct bucket_nocow_lock_table *t,
 							  u64 dev_bucket)
 {
-	unsigned h = hash_64(dev_bucket, BUCKET_NOCOW_LOCKS_BITS);
+	unsigned h = hash_64(dev_bucket, t->bits);
 
-	return t->l + (h & (BUCKET_NOCOW_LOCKS - 1));
+	return t->l + (h & ((1U << t->bits) - 1));
 }
 
 #define BUCKET_NOCOW_LOCK_UPDATE	(1 << 0)
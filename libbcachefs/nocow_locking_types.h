@@ -2,19 +2,25 @@
 #ifndef _BCACHEFS_NOCOW_LOCKING_TYPES_H
 #define _BCACHEFS_NOCOW_LOCKING_TYPES_H
 
+#include <linux/seqlock.h>
+
 #define BUCKET_NOCOW_LOCKS_BITS		10
-#define BUCKET_NOCOW_LOCKS		(1U << BUCKET_NOCOW_LOCKS_BITS)
+#define BUCKET_NOCOW_LOCKS_MAX_BITS	16
 
 struct nocow_lock_bucket {
 	struct closure_waitlist		wait;
 	spinlock_t			lock;
+	/* For optimistic readers in bch2_bucket_nocow_is_locked(): */
+	seqcount_t			seq;
 	u64				b[4];
 	atomic_t			l[4];
+	/* Times a trylock failed because all slots were taken: */
+	u64				collisions;
 } __aligned(SMP_CACHE_BYTES);
 
 struct bucket_nocow_lock_table {
-	struct nocow_lock_bucket	l[BUCKET_NOCOW_LOCKS];
+	struct nocow_lock_bucket	*l;
+	unsigned			bits;
 };
 
 #endif /* _BCACHEFS_NOCOW_LOCKING_TYPES_H */
-
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0
 
 #include <linux/kernel.h>
+#include <linux/sort.h>
 
 #include "bcachefs.h"
 #include "compress.h"
@@ -225,15 +226,52 @@ const struct bch_option bch2_opt_table[] = {
 #undef x
 };
 
+/*
+ * Option lookup is by name but the table is in declaration order, so we sort
+ * an index by name once at first use and binary search. (A compile time
+ * perfect hash would need a generator run at build time; with this many
+ * options the sorted index is a handful of cache lines and lookups are
+ * already a dozen string compares at worst.)
+ */
+static u16 bch2_opt_lookup_idx[bch2_opts_nr];
+static bool bch2_opt_lookup_ready;
+static DEFINE_MUTEX(bch2_opt_lookup_lock);
+
+static int opt_name_cmp(const void *_l, const void *_r)
+{
+	const u16 *l = _l, *r = _r;
+
+	return strcmp(bch2_opt_table[*l].attr.name,
+		      bch2_opt_table[*r].attr.name);
+}
+
 int bch2_opt_lookup(const char *name)
 {
-	const struct bch_option *i;
+	unsigned l = 0, r = bch2_opts_nr;
+
+	if (unlikely(!smp_load_acquire(&bch2_opt_lookup_ready))) {
+		mutex_lock(&bch2_opt_lookup_lock);
+		if (!bch2_opt_lookup_ready) {
+			for (unsigned i = 0; i < bch2_opts_nr; i++)
+				bch2_opt_lookup_idx[i] = i;
+			sort(bch2_opt_lookup_idx, bch2_opts_nr,
+			     sizeof(bch2_opt_lookup_idx[0]), opt_name_cmp, NULL);
+			smp_store_release(&bch2_opt_lookup_ready, true);
+		}
+		mutex_unlock(&bch2_opt_lookup_lock);
+	}
 
-	for (i = bch2_opt_table;
-	     i < bch2_opt_table + ARRAY_SIZE(bch2_opt_table);
-	     i++)
-		if (!strcmp(name, i->attr.name))
-			return i - bch2_opt_table;
+	while (l < r) {
+		unsigned m = l + (r - l) / 2;
+		int cmp = strcmp(name, bch2_opt_table[bch2_opt_lookup_idx[m]].attr.name);
+
+		if (!cmp)
+			return bch2_opt_lookup_idx[m];
+		if (cmp < 0)
+			r = m;
+		else
+			l = m + 1;
+	}
 
 	return -1;
 }
@@ -280,6 +280,13 @@ enum fsck_err_opts {
 	  OPT_BOOL(),							\
 	  BCH_SB_PRJQUOTA,		false,				\
 	  NULL,		"Enable project quotas")			\
+	x(quota_slack,			u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		4096,				\
+	  "sectors",	"Quota usage a quota entry may be off by\n"	\
+			"between folds of its sharded counters\n"	\
+			"(0: unsharded, exact enforcement)")		\
 	x(degraded,			u8,				\
 	  OPT_FS|OPT_MOUNT,						\
 	  OPT_BOOL(),							\
@@ -317,16 +324,24 @@ enum fsck_err_opts {
 	  OPT_UINT(0, U32_MAX),						\
 	  BCH_SB_JOURNAL_RECLAIM_DELAY,	100,				\
 	  NULL,		"Delay in milliseconds before automatic journal reclaim")\
+	x(journal_write_shaping,	u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		true,				\
+	  NULL,		"Throttle background btree updates when they exceed\n"\
+			"their share of journal bandwidth")		\
 	x(move_bytes_in_flight,		u32,				\
 	  OPT_HUMAN_READABLE|OPT_FS|OPT_MOUNT|OPT_RUNTIME,		\
 	  OPT_UINT(1024, U32_MAX),					\
 	  BCH2_NO_SB_OPT,		1U << 20,			\
-	  NULL,		"Maximum Amount of IO to keep in flight by the move path")\
+	  NULL,		"Baseline amount of IO to keep in flight by the move path\n"\
+			"(scaled up to 8x while device latency allows)")	\
 	x(move_ios_in_flight,		u32,				\
 	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
 	  OPT_UINT(1, 1024),						\
 	  BCH2_NO_SB_OPT,		32,				\
-	  NULL,		"Maximum number of IOs to keep in flight by the move path")\
+	  NULL,		"Baseline number of IOs to keep in flight by the move path\n"\
+			"(scaled up to 8x while device latency allows)")	\
 	x(fsck,				u8,				\
 	  OPT_FS|OPT_MOUNT,						\
 	  OPT_BOOL(),							\
@@ -353,6 +368,13 @@ enum fsck_err_opts {
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,		false,				\
 	  NULL,		"Don't replay the journal")			\
+	x(lazy_open,			u8,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Read btree roots on first access and skip\n"	\
+			"startup passes - for read only inspection,\n"	\
+			"requires norecovery and nochanges")		\
 	x(keep_journal,			u8,				\
 	  0,								\
 	  OPT_BOOL(),							\
@@ -383,11 +405,23 @@ enum fsck_err_opts {
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,			true,			\
 	  NULL,		"Use O_DIRECT (userspace only)")		\
+	x(mmap_io,			u8,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,			false,			\
+	  NULL,		"Service reads from an mmap of the device"	\
+			" (userspace only)")				\
 	x(sb,				u64,				\
 	  OPT_MOUNT,							\
 	  OPT_UINT(0, S64_MAX),						\
 	  BCH2_NO_SB_OPT,		BCH_SB_SECTOR,			\
 	  "offset",	"Sector offset of superblock")			\
+	x(sb_validate_fields,		u64,				\
+	  0,								\
+	  OPT_UINT(0, U64_MAX),						\
+	  BCH2_NO_SB_OPT,		U64_MAX,			\
+	  NULL,		"Bitmask of superblock sections to fully validate on\n"\
+			"read (metadata inspection tools only)")	\
 	x(read_only,			u8,				\
 	  OPT_FS|OPT_MOUNT,						\
 	  OPT_BOOL(),							\
@@ -403,6 +437,12 @@ enum fsck_err_opts {
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,		false,				\
 	  NULL,		"Reconstruct alloc btree")			\
+	x(gc_window_size,		u64,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_UINT(0, U64_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  NULL,		"Check allocations in windows of n buckets per device,\n"\
+			"bounding fsck memory usage at the cost of extra btree scans")\
 	x(version_upgrade,		u8,				\
 	  OPT_FS|OPT_MOUNT,						\
 	  OPT_STR(bch2_version_upgrade_opts),				\
@@ -464,7 +504,14 @@ enum fsck_err_opts {
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,		true,				\
 	  NULL,		"BTREE_ITER_PREFETCH casuse btree nodes to be\n"\
-	  " prefetched sequentially")
+	  " prefetched sequentially")					\
+	x(btree_node_prefetch_limit,	u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, 255),						\
+	  BCH2_NO_SB_OPT,		16,				\
+	  "n",		"Number of btree node reads to keep in flight\n"\
+	  " ahead of the iterator when walking btrees during\n"	\
+	  " recovery and fsck")
 
 struct bch_opts {
 #define x(_name, _bits, ...)	unsigned _name##_defined:1;
@@ -118,6 +118,8 @@ void bch2_prt_tab(struct printbuf *);
 void bch2_prt_tab_rjust(struct printbuf *);
 
 void bch2_prt_bytes_indented(struct printbuf *, const char *, unsigned);
+void bch2_prt_u64(struct printbuf *, u64);
+void bch2_prt_u64_hex(struct printbuf *, u64);
 void bch2_prt_human_readable_u64(struct printbuf *, u64);
 void bch2_prt_human_readable_s64(struct printbuf *, s64);
 void bch2_prt_units_u64(struct printbuf *, u64);
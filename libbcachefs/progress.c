@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "btree_cache.h"
+#include "btree_iter.h"
+#include "progress.h"
+
+/* Print at most every ten seconds: */
+#define PROGRESS_PRINT_INTERVAL_NS	(10ULL * NSEC_PER_SEC)
+
+/*
+ * Count the keys a pass over @btree will visit by walking the interior
+ * nodes one level up from the leaves - errors are ignored, this is only an
+ * estimate:
+ */
+static u64 progress_btree_size(struct btree_trans *trans, enum btree_id btree)
+{
+	struct btree_iter iter;
+	struct btree *b;
+	u64 nr = 0;
+	int ret;
+
+	__for_each_btree_node(trans, iter, btree, POS_MIN, 0, 1,
+			      BTREE_ITER_PREFETCH, b, ret) {
+		if (!b->c.level) {
+			/* Root is a leaf - a single node tree: */
+			nr = 1;
+			break;
+		}
+
+		nr += b->nr.packed_keys + b->nr.unpacked_keys;
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	return max_t(u64, nr, 1);
+}
+
+void bch2_progress_init(struct bch_fs *c, struct bch_progress *s,
+			const char *name, u64 btree_id_mask)
+{
+	struct btree_trans *trans = bch2_trans_get(c);
+
+	memset(s, 0, sizeof(*s));
+
+	s->c		= c;
+	s->name		= name;
+	s->start_time	= local_clock();
+
+	for (unsigned i = 0; i < BTREE_ID_NR; i++)
+		if (btree_id_mask & BIT_ULL(i))
+			s->nodes_total += progress_btree_size(trans, i);
+
+	bch2_trans_put(trans);
+
+	atomic64_set(&s->next_print, s->start_time + PROGRESS_PRINT_INTERVAL_NS);
+}
+
+static void progress_print(struct bch_progress *s)
+{
+	struct bch_fs *c = s->c;
+	u64 nodes_seen	= min_t(u64, atomic64_read(&s->nodes_seen), s->nodes_total);
+	u64 keys_seen	= atomic64_read(&s->keys_seen);
+	u64 elapsed_ms	= div_u64(local_clock() - s->start_time, NSEC_PER_MSEC);
+	u64 read_bytes	= nodes_seen * (btree_sectors(c) << 9);
+
+	if (!elapsed_ms)
+		return;
+
+	bch_info(c, "%s: %llu%% done, %llu keys/sec, %llu MiB/sec, eta %llus",
+		 s->name,
+		 nodes_seen * 100 / s->nodes_total,
+		 div_u64(keys_seen * 1000, elapsed_ms),
+		 div_u64(read_bytes >> 10, elapsed_ms),
+		 nodes_seen
+		 ? div_u64(elapsed_ms * (s->nodes_total - nodes_seen),
+			   nodes_seen * 1000)
+		 : 0);
+}
+
+void bch2_progress_update_iter(struct btree_trans *trans,
+			       struct bch_progress *s,
+			       struct btree_iter *iter,
+			       struct btree **last_node)
+{
+	struct btree *b = path_l(btree_iter_path(trans, iter))->b;
+	u64 now, next;
+
+	atomic64_inc(&s->keys_seen);
+
+	if (b != *last_node) {
+		if (*last_node)
+			atomic64_inc(&s->nodes_seen);
+		*last_node = b;
+	}
+
+	now	= local_clock();
+	next	= atomic64_read(&s->next_print);
+
+	if (now >= next &&
+	    atomic64_cmpxchg(&s->next_print, next,
+			     now + PROGRESS_PRINT_INTERVAL_NS) == next)
+		progress_print(s);
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_PROGRESS_H
+#define _BCACHEFS_PROGRESS_H
+
+/*
+ * Progress/throughput reporting for long running fsck passes: we estimate
+ * the size of the btrees a pass will walk up front, by counting leaf
+ * pointers in interior nodes - cheap, those are a fraction of a percent of
+ * the tree - then periodically report percent done, keys/sec, read
+ * bandwidth and an ETA as the pass runs.
+ *
+ * Counters are atomic so that a pass sharded across multiple workers can
+ * share one indicator; each worker keeps its own last_node cursor for
+ * counting node transitions.
+ */
+
+struct bch_progress {
+	struct bch_fs		*c;
+	const char		*name;
+	u64			start_time;
+	u64			nodes_total;
+	atomic64_t		nodes_seen;
+	atomic64_t		keys_seen;
+	atomic64_t		next_print;
+};
+
+void bch2_progress_init(struct bch_fs *, struct bch_progress *,
+			const char *, u64);
+void bch2_progress_update_iter(struct btree_trans *, struct bch_progress *,
+			       struct btree_iter *, struct btree **);
+
+#endif /* _BCACHEFS_PROGRESS_H */
@@ -348,6 +348,50 @@ static int bch2_quota_check_limit(struct bch_fs *c,
 	return 0;
 }
 
+/*
+ * Fold all sharded deltas into qc->v; caller must hold
+ * bch_memquota_type.lock. All shards are always folded together, so qc->v is
+ * only ever a snapshot of the true (nonnegative) counter value, never a
+ * partial sum:
+ */
+static void quota_counter_fold(struct memquota_counter *qc)
+{
+	unsigned s;
+
+	for (s = 0; s < BCH_QUOTA_SHARDS; s++)
+		qc->v += atomic64_xchg(&qc->pending[s], 0);
+}
+
+static void quota_fold(struct bch_memquota *mq)
+{
+	unsigned i;
+
+	for (i = 0; i < Q_COUNTERS; i++)
+		quota_counter_fold(&mq->c[i]);
+}
+
+/*
+ * Can this update skip the locked limit check and go via the sharded fast
+ * path? qc->v is read without the lock: it may be missing up to quota_slack
+ * worth of unfolded deltas, and another quota_slack may be added by
+ * concurrent fast path updates before we fold again - hence the 2x margin:
+ */
+static bool quota_counter_needs_check(struct memquota_counter *qc,
+				      s64 v, u64 slack,
+				      enum quota_acct_mode mode)
+{
+	u64 n = qc->v + v + 2 * slack;
+
+	if (mode == KEY_TYPE_QUOTA_NOCHECK)
+		return false;
+
+	if (v <= 0)
+		return qc->warning_issued != 0;
+
+	return (qc->hardlimit && n >= qc->hardlimit) ||
+	       (qc->softlimit && n >= qc->softlimit);
+}
+
 int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 		    enum quota_counters counter, s64 v,
 		    enum quota_acct_mode mode)
@@ -356,6 +400,7 @@ int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 	struct bch_memquota_type *q;
 	struct bch_memquota *mq[QTYP_NR];
 	struct quota_msgs msgs;
+	u64 slack = c->opts.quota_slack;
 	unsigned i;
 	int ret = 0;
 
@@ -367,10 +412,38 @@ int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 			return -ENOMEM;
 	}
 
+	if (slack) {
+		unsigned shard = raw_smp_processor_id() & (BCH_QUOTA_SHARDS - 1);
+		bool fast = true;
+
+		for_each_set_qtype(c, i, q, qtypes)
+			if (quota_counter_needs_check(&mq[i]->c[counter],
+						      v, slack, mode)) {
+				fast = false;
+				break;
+			}
+
+		if (fast) {
+			for_each_set_qtype(c, i, q, qtypes) {
+				struct memquota_counter *qc = &mq[i]->c[counter];
+				s64 p = atomic64_add_return(v, &qc->pending[shard]);
+				s64 thresh = slack / BCH_QUOTA_SHARDS;
+
+				if (p > thresh || p < -thresh) {
+					mutex_lock(&q->lock);
+					quota_counter_fold(qc);
+					mutex_unlock(&q->lock);
+				}
+			}
+			return 0;
+		}
+	}
+
 	for_each_set_qtype(c, i, q, qtypes)
 		mutex_lock_nested(&q->lock, i);
 
 	for_each_set_qtype(c, i, q, qtypes) {
+		quota_fold(mq[i]);
 		ret = bch2_quota_check_limit(c, i, mq[i], &msgs, counter, v, mode);
 		if (ret)
 			goto err;
@@ -424,6 +497,9 @@ int bch2_quota_transfer(struct bch_fs *c, unsigned qtypes,
 		mutex_lock_nested(&q->lock, i);
 
 	for_each_set_qtype(c, i, q, qtypes) {
+		quota_fold(src_q[i]);
+		quota_fold(dst_q[i]);
+
 		ret = bch2_quota_check_limit(c, i, dst_q[i], &msgs, Q_SPC,
 					     dst_q[i]->c[Q_SPC].v + space,
 					     mode);
@@ -861,8 +937,10 @@ static int bch2_get_quota(struct super_block *sb, struct kqid kqid,
 
 	mutex_lock(&q->lock);
 	mq = genradix_ptr(&q->table, qid);
-	if (mq)
+	if (mq) {
+		quota_fold(mq);
 		__bch2_quota_get(qdq, mq);
+	}
 	mutex_unlock(&q->lock);
 
 	return 0;
@@ -882,6 +960,7 @@ static int bch2_get_next_quota(struct super_block *sb, struct kqid *kqid,
 
 	genradix_for_each_from(&q->table, iter, mq, qid)
 		if (memcmp(mq, page_address(ZERO_PAGE(0)), sizeof(*mq))) {
+			quota_fold(mq);
 			__bch2_quota_get(qdq, mq);
 			*kqid = make_kqid(current_user_ns(), kqid->type, iter.pos);
 			goto found;
@@ -2,6 +2,7 @@
 #ifndef _BCACHEFS_QUOTA_TYPES_H
 #define _BCACHEFS_QUOTA_TYPES_H
 
+#include <linux/atomic.h>
 #include <linux/generic-radix-tree.h>
 
 struct bch_qid {
@@ -14,6 +15,13 @@ enum quota_acct_mode {
 	KEY_TYPE_QUOTA_NOCHECK,
 };
 
+/*
+ * Number of shards unfolded quota deltas are spread over, so that accounting
+ * from different cpus doesn't serialize on a single counter - must be a power
+ * of two:
+ */
+#define BCH_QUOTA_SHARDS		8
+
 struct memquota_counter {
 	u64				v;
 	u64				hardlimit;
@@ -21,6 +29,13 @@ struct memquota_counter {
 	s64				timer;
 	int				warns;
 	int				warning_issued;
+	/*
+	 * Deltas not yet folded into @v: updated with atomic adds, without
+	 * taking bch_memquota_type.lock, and folded into @v (under the lock)
+	 * when a shard's magnitude exceeds its share of the quota_slack
+	 * option - see bch2_quota_acct():
+	 */
+	atomic64_t			pending[BCH_QUOTA_SHARDS];
 };
 
 struct bch_memquota {
@@ -142,6 +142,63 @@ static int journal_sort_seq_cmp(const void *_l, const void *_r)
 	return cmp_int(l->journal_seq, r->journal_seq);
 }
 
+/*
+ * Updates to disjoint positions commute, so partitions of the sorted key
+ * array can be replayed concurrently as long as no partition boundary splits
+ * a run of keys at the same position - within a partition same-position keys
+ * are replayed in order as before:
+ */
+#define JOURNAL_REPLAY_NR_PARTITIONS	8
+
+struct journal_replay_partition {
+	struct bch_fs		*c;
+	size_t			first;
+	size_t			last;
+	DARRAY(struct journal_key *) deferred;
+	int			ret;
+	struct closure		cl;
+};
+
+static bool journal_key_same_pos(struct journal_key *l, struct journal_key *r)
+{
+	return l->btree_id == r->btree_id &&
+		l->level == r->level &&
+		bpos_eq(l->k->k.p, r->k->k.p);
+}
+
+static CLOSURE_CALLBACK(journal_replay_partition_work)
+{
+	closure_type(p, struct journal_replay_partition, cl);
+	struct bch_fs *c = p->c;
+	struct journal_keys *keys = &c->journal_keys;
+	struct btree_trans *trans = bch2_trans_get(c);
+
+	for (size_t i = p->first; i < p->last; i++) {
+		cond_resched();
+
+		struct journal_key *k = keys->d + i;
+
+		/* Skip fastpath if we're low on space in the journal */
+		int ret = c->journal.watermark ? -1 :
+			commit_do(trans, NULL, NULL,
+				  BCH_TRANS_COMMIT_no_enospc|
+				  BCH_TRANS_COMMIT_journal_reclaim|
+				  (!k->allocated ? BCH_TRANS_COMMIT_no_journal_res : 0),
+			     bch2_journal_replay_key(trans, k));
+		BUG_ON(!ret && !k->overwritten);
+		if (ret) {
+			ret = darray_push(&p->deferred, k);
+			if (ret) {
+				p->ret = ret;
+				break;
+			}
+		}
+	}
+
+	bch2_trans_put(trans);
+	closure_return(cl);
+}
+
 static int bch2_journal_replay(struct bch_fs *c)
 {
 	struct journal_keys *keys = &c->journal_keys;
@@ -162,30 +219,62 @@ static int bch2_journal_replay(struct bch_fs *c)
 	BUG_ON(!atomic_read(&keys->ref));
 
 	/*
-	 * First, attempt to replay keys in sorted order. This is more
-	 * efficient - better locality of btree access -  but some might fail if
-	 * that would cause a journal deadlock.
+	 * First, attempt to replay keys in sorted order, partitioned across
+	 * worker threads. This is more efficient - better locality of btree
+	 * access - but some might fail if that would cause a journal deadlock;
+	 * those are redone in journal seq order below.
 	 */
-	for (size_t i = 0; i < keys->nr; i++) {
-		cond_resched();
+	size_t nr_partitions = clamp_t(size_t, keys->nr / 8192,
+				       1, JOURNAL_REPLAY_NR_PARTITIONS);
+	struct journal_replay_partition *parts =
+		kcalloc(nr_partitions, sizeof(*parts), GFP_KERNEL);
+	if (!parts) {
+		ret = -BCH_ERR_ENOMEM_journal_replay;
+		goto err;
+	}
 
-		struct journal_key *k = keys->d + i;
+	struct closure cl;
+	closure_init_stack(&cl);
 
-		/* Skip fastpath if we're low on space in the journal */
-		ret = c->journal.watermark ? -1 :
-			commit_do(trans, NULL, NULL,
-				  BCH_TRANS_COMMIT_no_enospc|
-				  BCH_TRANS_COMMIT_journal_reclaim|
-				  (!k->allocated ? BCH_TRANS_COMMIT_no_journal_res : 0),
-			     bch2_journal_replay_key(trans, k));
-		BUG_ON(!ret && !k->overwritten);
-		if (ret) {
-			ret = darray_push(&keys_sorted, k);
-			if (ret)
-				goto err;
-		}
+	size_t b = 0;
+	for (size_t i = 0; i < nr_partitions; i++) {
+		size_t e = i + 1 == nr_partitions
+			? keys->nr
+			: keys->nr * (i + 1) / nr_partitions;
+
+		/* never split a run of keys at the same position: */
+		while (e > 0 && e < keys->nr &&
+		       journal_key_same_pos(keys->d + e - 1, keys->d + e))
+			e++;
+
+		if (e <= b)
+			continue;
+
+		parts[i].c	= c;
+		parts[i].first	= b;
+		parts[i].last	= e;
+		b = e;
+
+		closure_call(&parts[i].cl, journal_replay_partition_work,
+			     system_unbound_wq, &cl);
 	}
 
+	closure_sync(&cl);
+
+	for (size_t i = 0; i < nr_partitions; i++) {
+		if (!ret)
+			ret = parts[i].ret;
+
+		darray_for_each(parts[i].deferred, kp)
+			if (!ret)
+				ret = darray_push(&keys_sorted, *kp);
+
+		darray_exit(&parts[i].deferred);
+	}
+	kfree(parts);
+	if (ret)
+		goto err;
+
 	/*
 	 * Now, replay any remaining keys in the order in which they appear in
 	 * the journal, unpinning those journal entries as we go:
@@ -222,6 +311,9 @@ static int bch2_journal_replay(struct bch_fs *c)
 	bch2_trans_put(trans);
 	trans = NULL;
 
+	bch_verbose(c, "journal keys: %zu replayed, %llu inserts, %llu searches",
+		    keys->nr, keys->nr_inserts, keys->nr_searches);
+
 	if (!c->opts.keep_journal)
 		bch2_journal_keys_put_initial(c);
 
@@ -394,6 +486,13 @@ static int read_btree_roots(struct bch_fs *c)
 			continue;
 		}
 
+		/*
+		 * In lazy_open mode, roots are read on first access by
+		 * btree_path_lock_root():
+		 */
+		if (c->opts.lazy_open)
+			continue;
+
 		if (r->error) {
 			__fsck_err(c,
 				   btree_id_is_alloc(i)
@@ -420,6 +519,9 @@ static int read_btree_roots(struct bch_fs *c)
 	for (i = 0; i < BTREE_ID_NR; i++) {
 		struct btree_root *r = bch2_btree_id_root(c, i);
 
+		if (c->opts.lazy_open && r->alive)
+			continue;
+
 		if (!r->b) {
 			r->alive = false;
 			r->level = 0;
@@ -527,6 +629,12 @@ static int bch2_set_may_go_rw(struct bch_fs *c)
 	move_gap(keys->d, keys->nr, keys->size, keys->gap, keys->nr);
 	keys->gap = keys->nr;
 
+	/*
+	 * Compacting out overwritten keys memmoves the buffer, so it too has to
+	 * happen before any other thread can be iterating the overlay:
+	 */
+	bch2_journal_keys_compact(c);
+
 	set_bit(BCH_FS_may_go_rw, &c->flags);
 
 	if (keys->nr || c->opts.fsck || !c->sb.clean)
@@ -656,10 +764,145 @@ u64 bch2_fsck_recovery_passes(void)
 	return ret;
 }
 
+#ifndef __KERNEL__
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+
+/*
+ * Incremental fsck: after each successful recovery pass we persist the set of
+ * completed passes to a small state file keyed by filesystem uuid, so that an
+ * interrupted fsck resumes where it left off instead of re-running every
+ * check pass from the start.
+ *
+ * Only passes that would run purely because of -o fsck are skipped on resume:
+ * passes that rebuild in-memory state (PASS_ALWAYS), passes required because
+ * the filesystem is unclean, and passes explicitly requested by the
+ * superblock or by an earlier pass always run. The checkpoint records the
+ * superblock sequence number at save time and is removed once recovery
+ * completes, so a checkpoint left behind by an unrelated earlier run is
+ * ignored.
+ *
+ * Granularity is a whole pass: each pass fn owns its btree iteration state,
+ * so a pass interrupted partway through is simply re-run.
+ */
+
+struct recovery_checkpoint {
+	__le64			magic;
+	__le64			version;
+	__le64			sb_seq;
+	__le64			passes_complete;
+};
+
+#define RECOVERY_CHECKPOINT_MAGIC	0x6673636b636b7074ULL /* "fsckckpt" */
+#define RECOVERY_CHECKPOINT_VERSION	1
+
+static void recovery_checkpoint_path(struct bch_fs *c, char *path, size_t len)
+{
+	char uuid[40];
+
+	uuid_unparse_lower(c->sb.user_uuid.b, uuid);
+	snprintf(path, len, "/var/lib/bcachefs/fsck-checkpoint-%s", uuid);
+}
+
+static u64 recovery_checkpoint_load(struct bch_fs *c)
+{
+	struct recovery_checkpoint ckpt;
+	char path[128];
+	u64 ret = 0;
+	FILE *f;
+
+	if (!c->opts.fsck)
+		return 0;
+
+	recovery_checkpoint_path(c, path, sizeof(path));
+	f = fopen(path, "re");
+	if (!f)
+		return 0;
+
+	/*
+	 * Any superblock write since the checkpoint was saved invalidates it:
+	 * the interrupted run's partial work may have changed what later passes
+	 * would find, so only an exact sb_seq match may be resumed.
+	 */
+	if (fread(&ckpt, sizeof(ckpt), 1, f) == 1 &&
+	    le64_to_cpu(ckpt.magic)	== RECOVERY_CHECKPOINT_MAGIC &&
+	    le64_to_cpu(ckpt.version)	== RECOVERY_CHECKPOINT_VERSION &&
+	    le64_to_cpu(ckpt.sb_seq)	== le64_to_cpu(c->disk_sb.sb->seq))
+		ret = le64_to_cpu(ckpt.passes_complete);
+
+	fclose(f);
+
+	if (ret) {
+		struct printbuf buf = PRINTBUF;
+
+		prt_str(&buf, "resuming interrupted fsck, passes already done: ");
+		prt_bitflags(&buf, bch2_recovery_passes, ret);
+		bch_info(c, "%s", buf.buf);
+		printbuf_exit(&buf);
+	}
+
+	return ret;
+}
+
+static void recovery_checkpoint_save(struct bch_fs *c)
+{
+	struct recovery_checkpoint ckpt = {
+		.magic		= cpu_to_le64(RECOVERY_CHECKPOINT_MAGIC),
+		.version	= cpu_to_le64(RECOVERY_CHECKPOINT_VERSION),
+		.sb_seq		= c->disk_sb.sb->seq,
+		.passes_complete = cpu_to_le64(c->recovery_passes_complete),
+	};
+	char path[128];
+	FILE *f;
+
+	if (!c->opts.fsck)
+		return;
+
+	mkdir("/var/lib/bcachefs", 0755);
+	recovery_checkpoint_path(c, path, sizeof(path));
+	f = fopen(path, "we");
+	if (!f)
+		return;
+
+	if (fwrite(&ckpt, sizeof(ckpt), 1, f) != 1) {
+		fclose(f);
+		unlink(path);
+		return;
+	}
+
+	fclose(f);
+}
+
+static void recovery_checkpoint_drop(struct bch_fs *c)
+{
+	char path[128];
+
+	if (!c->opts.fsck)
+		return;
+
+	recovery_checkpoint_path(c, path, sizeof(path));
+	unlink(path);
+}
+#else /* __KERNEL__ */
+static u64 recovery_checkpoint_load(struct bch_fs *c)	{ return 0; }
+static void recovery_checkpoint_save(struct bch_fs *c)	{}
+static void recovery_checkpoint_drop(struct bch_fs *c)	{}
+#endif
+
 static bool should_run_recovery_pass(struct bch_fs *c, enum bch_recovery_pass pass)
 {
 	struct recovery_pass_fn *p = recovery_pass_fns + pass;
 
+	/*
+	 * lazy_open skips everything that isn't needed for read only
+	 * inspection; snapshots_read stays so that filtered btree iteration
+	 * works, and is cheap since it only touches the snapshots btree:
+	 */
+	if (c->opts.lazy_open &&
+	    pass != BCH_RECOVERY_PASS_snapshots_read)
+		return c->recovery_passes_explicit & BIT_ULL(pass);
 	if (c->opts.norecovery && pass > BCH_RECOVERY_PASS_snapshots_read)
 		return false;
 	if (c->recovery_passes_explicit & BIT_ULL(pass))
@@ -690,27 +933,305 @@ static int bch2_run_recovery_pass(struct bch_fs *c, enum bch_recovery_pass pass)
 	return 0;
 }
 
+static bool recovery_pass_checkpointed(struct bch_fs *c, u64 resume,
+				       enum bch_recovery_pass pass)
+{
+	struct recovery_pass_fn *p = recovery_pass_fns + pass;
+
+	return (resume & BIT_ULL(pass)) &&
+		(p->when & PASS_FSCK) &&
+		!(p->when & PASS_ALWAYS) &&
+		!((p->when & PASS_UNCLEAN) && !c->sb.clean) &&
+		!(c->recovery_passes_explicit & BIT_ULL(pass));
+}
+
+#ifndef __KERNEL__
+
+/*
+ * Concurrent fsck: several of the expensive fsck passes are independent of
+ * each other - the alloc/backpointers chain (check_alloc_info through
+ * bucket_gens_init) and the snapshots chain (check_snapshot_trees through
+ * check_subvols) iterate and repair disjoint btrees - so there's no reason to
+ * run one chain's btree scans while the other chain's threads sit idle.
+ *
+ * Dependencies are modelled conservatively: a pass not listed below is a
+ * barrier - it depends on every earlier pass, and every later pass depends on
+ * it - so an unlisted pass behaves exactly as in the sequential scheduler. A
+ * listed pass depends on every barrier before it plus the passes named here.
+ *
+ * c->curr_recovery_pass and c->recovery_pass_done gate allocator and
+ * backpointer behaviour all over the tree (e.g. whether the freespace btree
+ * may be used); they are kept at the first incomplete pass, which gives the
+ * same answers a sequential run would at that point.
+ */
+struct recovery_pass_dep {
+	bool		concurrent;
+	u64		depends;
+};
+
+#define D(_pass)	BIT_ULL(BCH_RECOVERY_PASS_##_pass)
+
+static const struct recovery_pass_dep recovery_pass_deps[] = {
+	[BCH_RECOVERY_PASS_check_alloc_info]		= { true, 0 },
+	[BCH_RECOVERY_PASS_check_lrus]			= { true, D(check_alloc_info) },
+	[BCH_RECOVERY_PASS_check_btree_backpointers]	= { true, D(check_lrus) },
+	[BCH_RECOVERY_PASS_check_backpointers_to_extents] = { true, D(check_btree_backpointers) },
+	[BCH_RECOVERY_PASS_check_extents_to_backpointers] = { true, D(check_backpointers_to_extents) },
+	[BCH_RECOVERY_PASS_check_alloc_to_lru_refs]	= { true, D(check_extents_to_backpointers) },
+	[BCH_RECOVERY_PASS_fs_freespace_init]		= { true, D(check_alloc_to_lru_refs) },
+	[BCH_RECOVERY_PASS_bucket_gens_init]		= { true, D(fs_freespace_init) },
+	[BCH_RECOVERY_PASS_check_snapshot_trees]	= { true, 0 },
+	[BCH_RECOVERY_PASS_check_snapshots]		= { true, D(check_snapshot_trees) },
+	[BCH_RECOVERY_PASS_check_subvols]		= { true, D(check_snapshots) },
+};
+
+#undef D
+
+static bool recovery_pass_is_concurrent(enum bch_recovery_pass pass)
+{
+	return pass < ARRAY_SIZE(recovery_pass_deps) &&
+		recovery_pass_deps[pass].concurrent;
+}
+
+static u64 recovery_pass_depends(enum bch_recovery_pass pass)
+{
+	u64 deps = recovery_pass_is_concurrent(pass)
+		? recovery_pass_deps[pass].depends
+		: BIT_ULL(pass) - 1;
+
+	for (unsigned i = 0; i < pass; i++)
+		if (!recovery_pass_is_concurrent(i))
+			deps |= BIT_ULL(i);
+	return deps;
+}
+
+struct recovery_pass_sched {
+	struct bch_fs		*c;
+	struct mutex		lock;
+	wait_queue_head_t	wait;
+	u64			resume;
+	u64			started;	/* launched, run inline, or skipped */
+	u64			done;		/* complete or skipped */
+	unsigned		nr_running;
+	unsigned long		events;
+	int			ret;
+};
+
+struct recovery_pass_job {
+	struct work_struct		work;
+	struct recovery_pass_sched	*s;
+	enum bch_recovery_pass		pass;
+};
+
+static void recovery_pass_sched_update_curr(struct recovery_pass_sched *s)
+{
+	struct bch_fs *c = s->c;
+	unsigned first_incomplete = __ffs64(~s->done);
+
+	c->curr_recovery_pass = first_incomplete;
+	c->recovery_pass_done = max(c->recovery_pass_done, first_incomplete);
+}
+
+static void recovery_pass_sched_complete(struct recovery_pass_sched *s,
+					 enum bch_recovery_pass pass, int ret)
+{
+	struct bch_fs *c = s->c;
+
+	if (ret) {
+		/* a hard error takes priority over a recovery restart: */
+		if (!s->ret || bch2_err_matches(s->ret, BCH_ERR_restart_recovery))
+			s->ret = ret;
+	} else {
+		s->done |= BIT_ULL(pass);
+		c->recovery_passes_complete |= BIT_ULL(pass);
+		recovery_pass_sched_update_curr(s);
+		recovery_checkpoint_save(c);
+	}
+	s->events++;
+}
+
+static void bch2_recovery_pass_work(struct work_struct *work)
+{
+	struct recovery_pass_job *j =
+		container_of(work, struct recovery_pass_job, work);
+	struct recovery_pass_sched *s = j->s;
+	int ret = bch2_run_recovery_pass(s->c, j->pass);
+
+	mutex_lock(&s->lock);
+	recovery_pass_sched_complete(s, j->pass, ret);
+	s->nr_running--;
+	mutex_unlock(&s->lock);
+	wake_up(&s->wait);
+	kfree(j);
+}
+
+static int bch2_run_recovery_passes_concurrent(struct bch_fs *c)
+{
+	struct recovery_pass_sched s = {
+		.c	= c,
+		.resume	= recovery_checkpoint_load(c),
+	};
+	u64 all = BIT_ULL(ARRAY_SIZE(recovery_pass_fns)) - 1;
+	int ret;
+
+	mutex_init(&s.lock);
+	init_waitqueue_head(&s.wait);
+
+	mutex_lock(&s.lock);
+	while (1) {
+		/*
+		 * A pass we already ran (or skipped) that's since been
+		 * explicitly requested - bch2_run_explicit_recovery_pass()
+		 * rewinding, or a pass skipped via checkpoint resume that a
+		 * later pass turned out to need:
+		 */
+		u64 rerun = c->recovery_passes_explicit &
+			~c->recovery_passes_complete & s.done;
+
+		if (s.ret || rerun) {
+			if (s.nr_running)
+				goto wait;
+
+			if (s.ret &&
+			    !bch2_err_matches(s.ret, BCH_ERR_restart_recovery) &&
+			    !rerun)
+				break;
+
+			/*
+			 * Rewind, as the sequential scheduler would: forget
+			 * completion of everything from the restart point on
+			 * and rerun it.
+			 */
+			unsigned rewind = min_t(unsigned, c->curr_recovery_pass,
+						ARRAY_SIZE(recovery_pass_fns));
+			if (rerun)
+				rewind = min_t(unsigned, rewind, __ffs64(rerun));
+
+			u64 mask = BIT_ULL(rewind) - 1;
+
+			s.done		&= mask;
+			s.started	= s.done;
+			s.ret		= 0;
+			c->recovery_passes_complete &= mask;
+			recovery_pass_sched_update_curr(&s);
+			continue;
+		}
+
+		if (s.done == all && !s.nr_running)
+			break;
+
+		/* launch every pass whose dependencies are satisfied: */
+		bool launched = false;
+
+		for (unsigned pass = 0; pass < ARRAY_SIZE(recovery_pass_fns); pass++) {
+			if (s.started & BIT_ULL(pass))
+				continue;
+			if (recovery_pass_depends(pass) & ~s.done)
+				continue;
+
+			s.started |= BIT_ULL(pass);
+			launched = true;
+
+			if (!should_run_recovery_pass(c, pass)) {
+				s.done |= BIT_ULL(pass);
+				recovery_pass_sched_update_curr(&s);
+				continue;
+			}
+
+			if (recovery_pass_checkpointed(c, s.resume, pass)) {
+				bch_info(c, "%s: done in interrupted run, skipping",
+					 bch2_recovery_passes[pass]);
+				c->recovery_passes_complete |= BIT_ULL(pass);
+				s.done |= BIT_ULL(pass);
+				recovery_pass_sched_update_curr(&s);
+				continue;
+			}
+
+			struct recovery_pass_job *j = recovery_pass_is_concurrent(pass)
+				? kmalloc(sizeof(*j), GFP_KERNEL)
+				: NULL;
+			if (j) {
+				j->s	= &s;
+				j->pass	= pass;
+				INIT_WORK(&j->work, bch2_recovery_pass_work);
+				s.nr_running++;
+				queue_work(system_unbound_wq, &j->work);
+			} else {
+				/*
+				 * Barriers run right here: everything before
+				 * them is complete, so nothing else can be
+				 * running or runnable:
+				 */
+				mutex_unlock(&s.lock);
+				int ret2 = bch2_run_recovery_pass(c, pass);
+				mutex_lock(&s.lock);
+				recovery_pass_sched_complete(&s, pass, ret2);
+				break;
+			}
+		}
+
+		if (launched)
+			continue;
+		if (!s.nr_running)
+			break;
+wait:
+		{
+			unsigned long seen = s.events;
+
+			mutex_unlock(&s.lock);
+			wait_event(s.wait, s.events != seen);
+			mutex_lock(&s.lock);
+		}
+	}
+	ret = s.ret;
+	mutex_unlock(&s.lock);
+
+	if (!ret)
+		recovery_checkpoint_drop(c);
+
+	return ret;
+}
+#endif /* !__KERNEL__ */
+
 static int bch2_run_recovery_passes(struct bch_fs *c)
 {
+	u64 resume;
 	int ret = 0;
 
+#ifndef __KERNEL__
+	/* only fsck has enough independent passes to schedule concurrently: */
+	if (c->opts.fsck)
+		return bch2_run_recovery_passes_concurrent(c);
+#endif
+	resume = recovery_checkpoint_load(c);
+
 	while (c->curr_recovery_pass < ARRAY_SIZE(recovery_pass_fns)) {
 		if (should_run_recovery_pass(c, c->curr_recovery_pass)) {
 			unsigned pass = c->curr_recovery_pass;
 
-			ret = bch2_run_recovery_pass(c, c->curr_recovery_pass);
-			if (bch2_err_matches(ret, BCH_ERR_restart_recovery) ||
-			    (ret && c->curr_recovery_pass < pass))
-				continue;
-			if (ret)
-				break;
+			if (recovery_pass_checkpointed(c, resume, pass)) {
+				bch_info(c, "%s: done in interrupted run, skipping",
+					 bch2_recovery_passes[pass]);
+				c->recovery_passes_complete |= BIT_ULL(pass);
+			} else {
+				ret = bch2_run_recovery_pass(c, c->curr_recovery_pass);
+				if (bch2_err_matches(ret, BCH_ERR_restart_recovery) ||
+				    (ret && c->curr_recovery_pass < pass))
+					continue;
+				if (ret)
+					break;
 
-			c->recovery_passes_complete |= BIT_ULL(c->curr_recovery_pass);
+				c->recovery_passes_complete |= BIT_ULL(c->curr_recovery_pass);
+				recovery_checkpoint_save(c);
+			}
 		}
 		c->curr_recovery_pass++;
 		c->recovery_pass_done = max(c->recovery_pass_done, c->curr_recovery_pass);
 	}
 
+	if (!ret)
+		recovery_checkpoint_drop(c);
+
 	return ret;
 }
 
@@ -774,6 +1295,13 @@ int bch2_fs_recovery(struct bch_fs *c)
 		goto err;
 	}
 
+	if (c->opts.lazy_open &&
+	    !(c->opts.norecovery && c->opts.nochanges)) {
+		bch_err(c, "lazy_open requires norecovery and nochanges");
+		ret = -EINVAL;
+		goto err;
+	}
+
 	if (!(c->opts.nochanges && c->opts.norecovery)) {
 		mutex_lock(&c->sb_lock);
 		bool write_sb = false;
@@ -216,7 +216,8 @@ static int __trigger_reflink_p(struct btree_trans *trans,
 			ret = trans_trigger_reflink_p_segment(trans, p, &idx, flags);
 	}
 
-	if (flags & BTREE_TRIGGER_GC) {
+	if ((flags & BTREE_TRIGGER_GC) &&
+	    !(flags & BTREE_TRIGGER_GC_BUCKET_ONLY)) {
 		size_t l = 0, r = c->reflink_gc_nr;
 
 		while (l < r) {
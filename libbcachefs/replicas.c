@@ -6,6 +6,8 @@
 #include "replicas.h"
 #include "super-io.h"
 
+#include <linux/jhash.h>
+
 static int bch2_cpu_replicas_to_sb_replicas(struct bch_fs *,
 					    struct bch_replicas_cpu *);
 
@@ -218,6 +220,41 @@ cpu_replicas_add_entry(struct bch_fs *c,
 	return new;
 }
 
+static inline u32 replicas_entry_hash(struct bch_replicas_entry_v1 *e)
+{
+	return jhash(e, replicas_entry_bytes(e), JHASH_INITVAL);
+}
+
+/*
+ * Rebuild the hash index over c->replicas; caller must hold mark_lock for
+ * write. Allocation failure just leaves lookups on the eytzinger search
+ * fallback:
+ */
+static void replicas_idx_hash_rebuild(struct bch_fs *c)
+{
+	struct bch_replicas_cpu *r = &c->replicas;
+	unsigned bits = 2;
+	u32 *h;
+
+	while (1U << bits < r->nr * 4)
+		bits++;
+
+	h = kcalloc(1U << bits, sizeof(u32), GFP_KERNEL);
+
+	for (unsigned i = 0; h && i < r->nr; i++) {
+		struct bch_replicas_entry_v1 *e = cpu_replicas_entry(r, i);
+		u32 slot = replicas_entry_hash(e) & (~0U >> (32 - bits));
+
+		while (h[slot])
+			slot = (slot + 1) & (~0U >> (32 - bits));
+		h[slot] = i + 1;
+	}
+
+	kfree(c->replicas_idx_hash);
+	c->replicas_idx_hash		= h;
+	c->replicas_idx_hash_bits	= bits;
+}
+
 static inline int __replicas_entry_idx(struct bch_replicas_cpu *r,
 				       struct bch_replicas_entry_v1 *search)
 {
@@ -239,8 +276,33 @@ static inline int __replicas_entry_idx(struct bch_replicas_cpu *r,
 int bch2_replicas_entry_idx(struct bch_fs *c,
 			    struct bch_replicas_entry_v1 *search)
 {
+	u32 *h = c->replicas_idx_hash;
+
 	bch2_replicas_entry_sort(search);
 
+	if (likely(h)) {
+		unsigned bytes = replicas_entry_bytes(search);
+		u32 mask = ~0U >> (32 - c->replicas_idx_hash_bits);
+		u32 slot;
+
+		if (unlikely(bytes > c->replicas.entry_size))
+			return -1;
+
+		verify_replicas_entry(search);
+
+		for (slot = replicas_entry_hash(search) & mask;
+		     h[slot];
+		     slot = (slot + 1) & mask) {
+			int idx = h[slot] - 1;
+
+			if (!memcmp(cpu_replicas_entry(&c->replicas, idx),
+				    search, bytes))
+				return idx;
+		}
+
+		return -1;
+	}
+
 	return __replicas_entry_idx(&c->replicas, search);
 }
 
@@ -313,6 +375,7 @@ static int replicas_table_update(struct bch_fs *c,
 				 struct bch_replicas_cpu *new_r)
 {
 	struct bch_fs_usage __percpu *new_usage[JOURNAL_BUF_NR];
+	unsigned long *new_dirty[JOURNAL_BUF_NR];
 	struct bch_fs_usage_online *new_scratch = NULL;
 	struct bch_fs_usage __percpu *new_gc = NULL;
 	struct bch_fs_usage *new_base = NULL;
@@ -323,10 +386,13 @@ static int replicas_table_update(struct bch_fs *c,
 	int ret = 0;
 
 	memset(new_usage, 0, sizeof(new_usage));
+	memset(new_dirty, 0, sizeof(new_dirty));
 
 	for (i = 0; i < ARRAY_SIZE(new_usage); i++)
 		if (!(new_usage[i] = __alloc_percpu_gfp(bytes,
-					sizeof(u64), GFP_KERNEL)))
+					sizeof(u64), GFP_KERNEL)) ||
+		    !(new_dirty[i] = kcalloc(BITS_TO_LONGS(new_r->nr) ?: 1,
+					sizeof(unsigned long), GFP_KERNEL)))
 			goto err;
 
 	if (!(new_base = kzalloc(bytes, GFP_KERNEL)) ||
@@ -346,17 +412,32 @@ static int replicas_table_update(struct bch_fs *c,
 		__replicas_table_update_pcpu(new_gc,		new_r,
 					     c->usage_gc,	&c->replicas);
 
-	for (i = 0; i < ARRAY_SIZE(new_usage); i++)
+	for (i = 0; i < ARRAY_SIZE(new_usage); i++) {
+		/*
+		 * Remapping moved entries to new indexes; conservatively mark
+		 * everything dirty, acc_to_base() will thin the bitmap back
+		 * out:
+		 */
+		if (c->usage[i])
+			memset(new_dirty[i], 0xff,
+			       BITS_TO_LONGS(new_r->nr) * sizeof(unsigned long));
+
 		swap(c->usage[i],	new_usage[i]);
+		swap(c->usage_dirty[i],	new_dirty[i]);
+	}
 	swap(c->usage_base,	new_base);
 	swap(c->usage_scratch,	new_scratch);
 	swap(c->usage_gc,	new_gc);
 	swap(c->replicas,	*new_r);
+
+	replicas_idx_hash_rebuild(c);
 out:
 	free_percpu(new_gc);
 	kfree(new_scratch);
-	for (i = 0; i < ARRAY_SIZE(new_usage); i++)
+	for (i = 0; i < ARRAY_SIZE(new_usage); i++) {
 		free_percpu(new_usage[i]);
+		kfree(new_dirty[i]);
+	}
 	kfree(new_base);
 	return ret;
 err:
@@ -1032,10 +1113,13 @@ void bch2_fs_replicas_exit(struct bch_fs *c)
 	unsigned i;
 
 	kfree(c->usage_scratch);
-	for (i = 0; i < ARRAY_SIZE(c->usage); i++)
+	for (i = 0; i < ARRAY_SIZE(c->usage); i++) {
 		free_percpu(c->usage[i]);
+		kfree(c->usage_dirty[i]);
+	}
 	kfree(c->usage_base);
 	kfree(c->replicas.entries);
+	kfree(c->replicas_idx_hash);
 	kfree(c->replicas_gc.entries);
 
 	mempool_exit(&c->replicas_delta_pool);
@@ -35,7 +35,7 @@ static void bch2_sb_counters_to_text(struct printbuf *out, struct bch_sb *sb,
 	unsigned int nr = bch2_sb_counter_nr_entries(ctrs);
 
 	for (i = 0; i < nr; i++) {
-		if (i < BCH_COUNTER_NR)
+		if (i < BCH_PERSISTENT_COUNTER_NR)
 			prt_printf(out, "%s ", bch2_counter_names[i]);
 		else
 			prt_printf(out, "(unknown)");
@@ -56,7 +56,7 @@ int bch2_sb_counters_to_cpu(struct bch_fs *c)
 	for (i = 0; i < BCH_COUNTER_NR; i++)
 		c->counters_on_mount[i] = 0;
 
-	for (i = 0; i < min_t(unsigned int, nr, BCH_COUNTER_NR); i++) {
+	for (i = 0; i < min_t(unsigned int, nr, BCH_PERSISTENT_COUNTER_NR); i++) {
 		val = le64_to_cpu(ctrs->d[i]);
 		percpu_u64_set(&c->counters[i], val);
 		c->counters_on_mount[i] = val;
@@ -71,9 +71,9 @@ int bch2_sb_counters_from_cpu(struct bch_fs *c)
 	unsigned int i;
 	unsigned int nr = bch2_sb_counter_nr_entries(ctrs);
 
-	if (nr < BCH_COUNTER_NR) {
+	if (nr < BCH_PERSISTENT_COUNTER_NR) {
 		ret = bch2_sb_field_resize(&c->disk_sb, counters,
-					       sizeof(*ctrs) / sizeof(u64) + BCH_COUNTER_NR);
+					       sizeof(*ctrs) / sizeof(u64) + BCH_PERSISTENT_COUNTER_NR);
 
 		if (ret) {
 			ctrs = ret;
@@ -82,7 +82,7 @@ int bch2_sb_counters_from_cpu(struct bch_fs *c)
 	}
 
 
-	for (i = 0; i < min_t(unsigned int, nr, BCH_COUNTER_NR); i++)
+	for (i = 0; i < min_t(unsigned int, nr, BCH_PERSISTENT_COUNTER_NR); i++)
 		ctrs->d[i] = cpu_to_le64(percpu_u64_get(&c->counters[i]));
 	return 0;
 }
@@ -83,9 +83,26 @@
 	x(write_buffer_flush_slowpath,			77)	\
 	x(write_buffer_flush_sync,			78)
 
+/*
+ * Counters added in the tools and not yet allocated upstream: in-memory only,
+ * never written to the superblock. Persistent counter ids are assigned by the
+ * kernel; numbers taken here would collide with future kernel counters.
+ */
+#define BCH_INMEM_COUNTERS()				\
+	x(lru_update)					\
+	x(lru_update_coalesced)				\
+	x(pagecache_lock_contended)			\
+	x(pagecache_lock_slept)				\
+	x(trans_commit_throttled)
+
 enum bch_persistent_counters {
 #define x(t, n, ...) BCH_COUNTER_##t,
 	BCH_PERSISTENT_COUNTERS()
+#undef x
+	BCH_PERSISTENT_COUNTER_NR,
+
+#define x(t) BCH_COUNTER_##t,
+	BCH_INMEM_COUNTERS()
 #undef x
 	BCH_COUNTER_NR
 };
@@ -207,7 +207,7 @@ static inline bool bch2_dev_exists(struct bch_sb *sb, unsigned dev)
 
 static inline struct bch_member_cpu bch2_mi_to_cpu(struct bch_member *mi)
 {
-	return (struct bch_member_cpu) {
+	struct bch_member_cpu ret = {
 		.nbuckets	= le64_to_cpu(mi->nbuckets),
 		.first_bucket	= le16_to_cpu(mi->first_bucket),
 		.bucket_size	= le16_to_cpu(mi->bucket_size),
@@ -221,6 +221,11 @@ static inline struct bch_member_cpu bch2_mi_to_cpu(struct bch_member *mi)
 		.freespace_initialized = BCH_MEMBER_FREESPACE_INITIALIZED(mi),
 		.valid		= bch2_member_exists(mi),
 	};
+
+	for (unsigned i = 0; i < BCH_IOPS_NR; i++)
+		ret.iops[i] = le32_to_cpu(mi->iops[i]);
+
+	return ret;
 }
 
 void bch2_sb_members_from_cpu(struct bch_fs *);
@@ -105,6 +105,106 @@ static bool bch2_snapshot_is_ancestor_early(struct bch_fs *c, u32 id, u32 ancest
 	return id == ancestor;
 }
 
+static void snapshot_euler_invalidate(struct bch_fs *c)
+{
+	struct snapshot_euler_table *et;
+
+	lockdep_assert_held(&c->snapshot_table_lock);
+
+	et = rcu_dereference_protected(c->snapshot_euler, true);
+	if (et) {
+		rcu_assign_pointer(c->snapshot_euler, NULL);
+		kvfree_rcu_mightsleep(et);
+	}
+}
+
+/*
+ * Number the snapshot tree with an Euler tour, so that ancestry queries become
+ * a single interval comparison. Parents always have higher ids than their
+ * children, i.e. lower indices in the snapshot table: a reverse index walk
+ * sees children before parents and a forward walk sees parents first, so we
+ * never need to recurse.
+ */
+int bch2_snapshot_euler_rebuild(struct bch_fs *c)
+{
+	struct snapshot_euler_table *et = NULL;
+	struct snapshot_table *t;
+	u32 *size = NULL;
+	size_t nr;
+	u32 time = 1;
+	int ret = 0;
+
+	mutex_lock(&c->snapshot_table_lock);
+	snapshot_euler_invalidate(c);
+
+	t = rcu_dereference_protected(c->snapshots, true);
+	nr = c->snapshot_table_size;
+	if (!t || !nr)
+		goto out;
+
+	et	= kvzalloc(struct_size(et, d, nr), GFP_KERNEL);
+	size	= kvzalloc(nr * sizeof(*size), GFP_KERNEL);
+	if (!et || !size) {
+		ret = -BCH_ERR_ENOMEM_snapshot_euler_table;
+		goto out;
+	}
+
+	et->size = nr;
+
+	/* subtree sizes, children before parents: */
+	for (size_t i = nr; i--; ) {
+		const struct snapshot_t *s = &t->s[i];
+
+		if (!s->tree)
+			continue;
+
+		size[i]++;
+		if (s->parent)
+			size[U32_MAX - s->parent] += size[i];
+	}
+
+	/*
+	 * Assign intervals, parents first, carving each child's interval out
+	 * of its parent's; once a node is processed size[] becomes the
+	 * allocation cursor for its children:
+	 */
+	for (size_t i = 0; i < nr; i++) {
+		const struct snapshot_t *s = &t->s[i];
+		struct snapshot_interval *d = &et->d[i];
+		u32 sz = size[i], start;
+
+		if (!s->tree)
+			continue;
+
+		if (!s->parent) {
+			start = time;
+			time += sz;
+		} else {
+			size_t p = U32_MAX - s->parent;
+
+			/* orphaned node - leave unnumbered, queries fall
+			 * back to the parent pointer walk: */
+			if (!et->d[p].start)
+				continue;
+
+			start = size[p];
+			size[p] += sz;
+		}
+
+		d->start = start;
+		d->end	 = start + sz - 1;
+		size[i]	 = start + 1;
+	}
+
+	rcu_assign_pointer(c->snapshot_euler, et);
+	et = NULL;
+out:
+	mutex_unlock(&c->snapshot_table_lock);
+	kvfree(size);
+	kvfree(et);
+	return ret;
+}
+
 static inline u32 get_ancestor_below(struct snapshot_table *t, u32 id, u32 ancestor)
 {
 	const struct snapshot_t *s = __snapshot_t(t, id);
@@ -123,9 +223,27 @@ bool __bch2_snapshot_is_ancestor(struct bch_fs *c, u32 id, u32 ancestor)
 	struct snapshot_table *t;
 	bool ret;
 
-	EBUG_ON(c->recovery_pass_done <= BCH_RECOVERY_PASS_check_snapshots);
+	EBUG_ON(c->recovery_pass_done <= BCH_RECOVERY_PASS_check_snapshots &&
+		!(c->recovery_passes_complete &
+		  BIT_ULL(BCH_RECOVERY_PASS_check_snapshots)));
 
 	rcu_read_lock();
+
+	struct snapshot_euler_table *et = rcu_dereference(c->snapshot_euler);
+	if (et) {
+		size_t i = U32_MAX - id, a = U32_MAX - ancestor;
+
+		if (i < et->size && a < et->size &&
+		    et->d[i].start && et->d[a].start) {
+			ret = et->d[i].start >= et->d[a].start &&
+			      et->d[i].start <= et->d[a].end;
+			rcu_read_unlock();
+
+			EBUG_ON(ret != bch2_snapshot_is_ancestor_early(c, id, ancestor));
+			return ret;
+		}
+	}
+
 	t = rcu_dereference(c->snapshots);
 
 	while (id && id < ancestor - IS_ANCESTOR_BITMAP)
@@ -287,6 +405,7 @@ static int __bch2_mark_snapshot(struct btree_trans *trans,
 	int ret = 0;
 
 	mutex_lock(&c->snapshot_table_lock);
+	snapshot_euler_invalidate(c);
 
 	t = snapshot_t_mut(c, id);
 	if (!t) {
@@ -863,7 +982,9 @@ int bch2_check_snapshots(struct bch_fs *c)
 				BTREE_ID_snapshots, POS_MAX,
 				BTREE_ITER_PREFETCH, k,
 				NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
-			check_snapshot(trans, &iter, k)));
+			check_snapshot(trans, &iter, k))) ?:
+		/* repairs will have dropped the euler numbering: */
+		bch2_snapshot_euler_rebuild(c);
 	bch_err_fn(c, ret);
 	return ret;
 }
@@ -1359,12 +1480,216 @@ static int bch2_fix_child_of_deleted_snapshot(struct btree_trans *trans,
 	return bch2_trans_update(trans, iter, &s->k_i, 0);
 }
 
+/*
+ * The sweep for keys in deleted snapshots walks every snapshotted btree; on a
+ * filesystem that's just pruned a large batch of snapshots that's by far the
+ * bulk of the work. The state snapshot_delete_key() carries (equiv_seen,
+ * last_pos) is scoped to the position currently being walked, so the sweep
+ * parallelizes the same way the fsck passes do: partition each btree into
+ * ranges and run them on concurrent workers, each with its own transaction.
+ *
+ * Range boundaries come from a walk of the level 1 btree nodes, and always
+ * fall at snapshot == 0 - before any key at that position - so one position's
+ * run of snapshots is never split across workers.
+ */
+
+struct snapshot_sweep_range {
+	enum btree_id		btree;
+	struct bpos		start;	/* inclusive */
+	struct bpos		end;	/* inclusive */
+};
+
+struct snapshot_sweep {
+	struct bch_fs		*c;
+	snapshot_id_list	*deleted;
+	DARRAY(struct snapshot_sweep_range) ranges;
+	atomic_t		cursor;
+};
+
+struct snapshot_sweep_worker {
+	struct snapshot_sweep	*s;
+	int			ret;
+	struct closure		cl;
+};
+
+/* cut a new range every this many level 1 nodes: */
+#define SWEEP_NODES_PER_RANGE	16
+#define SWEEP_MAX_WORKERS	8
+
+static bool sweep_btree(enum btree_id id)
+{
+	/*
+	 * deleted inodes btree is maintained by a trigger on the inodes
+	 * btree - no work for us to do here, and it's not safe to scan
+	 * it because we'll see out of date keys due to the btree write
+	 * buffer:
+	 */
+	return btree_type_has_snapshots(id) &&
+		id != BTREE_ID_deleted_inodes;
+}
+
+static int snapshot_sweep_ranges(struct bch_fs *c, struct snapshot_sweep *s)
+{
+	struct btree_trans *trans = bch2_trans_get(c);
+	int ret = 0;
+
+	for (unsigned id = 0; id < BTREE_ID_NR; id++) {
+		struct btree_iter iter;
+		struct btree *b;
+		struct bpos start = POS_MIN;
+		unsigned nr = 0;
+
+		if (!sweep_btree(id))
+			continue;
+
+		__for_each_btree_node(trans, iter, id, POS_MIN, 0, 1, 0, b, ret) {
+			if (++nr % SWEEP_NODES_PER_RANGE)
+				continue;
+
+			struct bpos cut = SPOS(b->key.k.p.inode,
+					       b->key.k.p.offset, 0);
+
+			if (bpos_le(cut, start))
+				continue;
+
+			ret = darray_push(&s->ranges, ((struct snapshot_sweep_range) {
+				.btree	= id,
+				.start	= start,
+				.end	= bpos_predecessor(cut),
+			}));
+			if (ret)
+				break;
+			start = cut;
+		}
+		bch2_trans_iter_exit(trans, &iter);
+		if (ret)
+			break;
+
+		ret = darray_push(&s->ranges, ((struct snapshot_sweep_range) {
+			.btree	= id,
+			.start	= start,
+			.end	= SPOS_MAX,
+		}));
+		if (ret)
+			break;
+	}
+
+	bch2_trans_put(trans);
+	return ret;
+}
+
+static void snapshot_sweep_throttle(struct btree_trans *trans)
+{
+	struct bch_ratelimit *r = &trans->c->snapshot_delete_rate;
+	u64 delay;
+
+	if (likely(r->rate == UINT_MAX))
+		return;
+
+	bch2_ratelimit_increment(r, 1);
+
+	while ((delay = bch2_ratelimit_delay(r))) {
+		bch2_trans_unlock(trans);
+		__set_current_state(TASK_UNINTERRUPTIBLE);
+		schedule_timeout(delay);
+	}
+}
+
+static int snapshot_sweep_range(struct btree_trans *trans,
+				struct snapshot_sweep *s,
+				struct snapshot_sweep_range *r)
+{
+	struct bpos last_pos = POS_MIN;
+	snapshot_id_list equiv_seen = { 0 };
+	struct disk_reservation res = { 0 };
+
+	int ret = for_each_btree_key_upto_commit(trans, iter,
+			r->btree, r->start, r->end,
+			BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k,
+			&res, NULL, BCH_TRANS_COMMIT_no_enospc, ({
+		snapshot_sweep_throttle(trans);
+		snapshot_delete_key(trans, &iter, k, s->deleted, &equiv_seen, &last_pos);
+	})) ?:
+	      for_each_btree_key_upto_commit(trans, iter,
+			r->btree, r->start, r->end,
+			BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k,
+			&res, NULL, BCH_TRANS_COMMIT_no_enospc, ({
+		snapshot_sweep_throttle(trans);
+		move_key_to_correct_snapshot(trans, &iter, k);
+	}));
+
+	bch2_disk_reservation_put(trans->c, &res);
+	darray_exit(&equiv_seen);
+	return ret;
+}
+
+static CLOSURE_CALLBACK(snapshot_sweep_work)
+{
+	closure_type(w, struct snapshot_sweep_worker, cl);
+	struct snapshot_sweep *s = w->s;
+	struct btree_trans *trans = bch2_trans_get(s->c);
+	unsigned i;
+
+	/*
+	 * Workers claim ranges from a shared cursor, so an unbalanced
+	 * partition just means some workers finish early:
+	 */
+	while (!w->ret &&
+	       (i = atomic_inc_return(&s->cursor) - 1) < s->ranges.nr)
+		w->ret = snapshot_sweep_range(trans, s, &s->ranges.data[i]);
+
+	bch2_trans_put(trans);
+	closure_return(cl);
+}
+
+static int bch2_snapshot_sweep(struct bch_fs *c, snapshot_id_list *deleted)
+{
+	struct snapshot_sweep s = {
+		.c	= c,
+		.deleted = deleted,
+	};
+	struct snapshot_sweep_worker *workers = NULL;
+	unsigned i, nr_workers;
+	struct closure cl;
+	int ret;
+
+	bch2_ratelimit_reset(&c->snapshot_delete_rate);
+
+	ret = snapshot_sweep_ranges(c, &s);
+	if (ret)
+		goto out;
+
+	nr_workers = clamp_t(unsigned, s.ranges.nr / 4, 1, SWEEP_MAX_WORKERS);
+
+	workers = kcalloc(nr_workers, sizeof(*workers), GFP_KERNEL);
+	if (!workers) {
+		ret = -BCH_ERR_ENOMEM_fsck_shards;
+		goto out;
+	}
+
+	closure_init_stack(&cl);
+
+	for (i = 0; i < nr_workers; i++) {
+		workers[i].s = &s;
+		closure_call(&workers[i].cl, snapshot_sweep_work,
+			     system_unbound_wq, &cl);
+	}
+
+	closure_sync(&cl);
+
+	for (i = 0; i < nr_workers; i++)
+		ret = ret ?: workers[i].ret;
+out:
+	kfree(workers);
+	darray_exit(&s.ranges);
+	return ret;
+}
+
 int bch2_delete_dead_snapshots(struct bch_fs *c)
 {
 	struct btree_trans *trans;
 	snapshot_id_list deleted = { 0 };
 	snapshot_id_list deleted_interior = { 0 };
-	u32 id;
 	int ret = 0;
 
 	if (!test_and_clear_bit(BCH_FS_need_delete_dead_snapshots, &c->flags))
@@ -1411,41 +1736,11 @@ int bch2_delete_dead_snapshots(struct bch_fs *c)
 	if (ret)
 		goto err;
 
-	for (id = 0; id < BTREE_ID_NR; id++) {
-		struct bpos last_pos = POS_MIN;
-		snapshot_id_list equiv_seen = { 0 };
-		struct disk_reservation res = { 0 };
-
-		if (!btree_type_has_snapshots(id))
-			continue;
-
-		/*
-		 * deleted inodes btree is maintained by a trigger on the inodes
-		 * btree - no work for us to do here, and it's not safe to scan
-		 * it because we'll see out of date keys due to the btree write
-		 * buffer:
-		 */
-		if (id == BTREE_ID_deleted_inodes)
-			continue;
-
-		ret = for_each_btree_key_commit(trans, iter,
-				id, POS_MIN,
-				BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k,
-				&res, NULL, BCH_TRANS_COMMIT_no_enospc,
-			snapshot_delete_key(trans, &iter, k, &deleted, &equiv_seen, &last_pos)) ?:
-		      for_each_btree_key_commit(trans, iter,
-				id, POS_MIN,
-				BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k,
-				&res, NULL, BCH_TRANS_COMMIT_no_enospc,
-			move_key_to_correct_snapshot(trans, &iter, k));
-
-		bch2_disk_reservation_put(c, &res);
-		darray_exit(&equiv_seen);
-
-		bch_err_msg(c, ret, "deleting keys from dying snapshots");
-		if (ret)
-			goto err;
-	}
+	bch2_trans_unlock(trans);
+	ret = bch2_snapshot_sweep(c, &deleted);
+	bch_err_msg(c, ret, "deleting keys from dying snapshots");
+	if (ret)
+		goto err;
 
 	bch2_trans_unlock(trans);
 	down_write(&c->snapshot_create_lock);
@@ -1676,12 +1971,14 @@ int bch2_snapshots_read(struct bch_fs *c)
 			bch2_check_snapshot_needs_deletion(trans, k)) ?:
 		for_each_btree_key(trans, iter, BTREE_ID_snapshots,
 				   POS_MIN, 0, k,
-			   (set_is_ancestor_bitmap(c, k.k->p.offset), 0)));
+			   (set_is_ancestor_bitmap(c, k.k->p.offset), 0))) ?:
+		bch2_snapshot_euler_rebuild(c);
 	bch_err_fn(c, ret);
 	return ret;
 }
 
 void bch2_fs_snapshots_exit(struct bch_fs *c)
 {
+	kvfree(rcu_dereference_protected(c->snapshot_euler, true));
 	kvfree(rcu_dereference_protected(c->snapshots, true));
 }
@@ -258,6 +258,7 @@ static inline int bch2_key_has_snapshot_overwrites(struct btree_trans *trans,
 int bch2_propagate_key_to_snapshot_leaves(struct btree_trans *, enum btree_id,
 					  struct bkey_s_c, struct bpos *);
 
+int bch2_snapshot_euler_rebuild(struct bch_fs *);
 int bch2_snapshots_read(struct bch_fs *);
 void bch2_fs_snapshots_exit(struct bch_fs *);
 
@@ -83,10 +83,17 @@ struct bch_str_hash_ctx {
 	};
 };
 
-static inline void bch2_str_hash_init(struct bch_str_hash_ctx *ctx,
-				     const struct bch_hash_info *info)
+/*
+ * The __always_inline variants take the hash type as an explicit parameter, so
+ * that callers that dispatch on info->type once up front get copies with the
+ * switches below folded away - the name hashing hot paths in fsck resolve the
+ * hash type billions of times otherwise:
+ */
+static __always_inline void __bch2_str_hash_init(struct bch_str_hash_ctx *ctx,
+				enum bch_str_hash_type type,
+				const struct bch_hash_info *info)
 {
-	switch (info->type) {
+	switch (type) {
 	case BCH_STR_HASH_crc32c:
 		ctx->crc32c = crc32c(~0, &info->siphash_key.k0,
 				     sizeof(info->siphash_key.k0));
@@ -104,11 +111,17 @@ static inline void bch2_str_hash_init(struct bch_str_hash_ctx *ctx,
 	}
 }
 
-static inline void bch2_str_hash_update(struct bch_str_hash_ctx *ctx,
-				       const struct bch_hash_info *info,
-				       const void *data, size_t len)
+static inline void bch2_str_hash_init(struct bch_str_hash_ctx *ctx,
+				     const struct bch_hash_info *info)
+{
+	__bch2_str_hash_init(ctx, info->type, info);
+}
+
+static __always_inline void __bch2_str_hash_update(struct bch_str_hash_ctx *ctx,
+				enum bch_str_hash_type type,
+				const void *data, size_t len)
 {
-	switch (info->type) {
+	switch (type) {
 	case BCH_STR_HASH_crc32c:
 		ctx->crc32c = crc32c(ctx->crc32c, data, len);
 		break;
@@ -124,10 +137,17 @@ static inline void bch2_str_hash_update(struct bch_str_hash_ctx *ctx,
 	}
 }
 
-static inline u64 bch2_str_hash_end(struct bch_str_hash_ctx *ctx,
-				   const struct bch_hash_info *info)
+static inline void bch2_str_hash_update(struct bch_str_hash_ctx *ctx,
+				       const struct bch_hash_info *info,
+				       const void *data, size_t len)
+{
+	__bch2_str_hash_update(ctx, info->type, data, len);
+}
+
+static __always_inline u64 __bch2_str_hash_end(struct bch_str_hash_ctx *ctx,
+				enum bch_str_hash_type type)
 {
-	switch (info->type) {
+	switch (type) {
 	case BCH_STR_HASH_crc32c:
 		return ctx->crc32c;
 	case BCH_STR_HASH_crc64:
@@ -140,6 +160,12 @@ static inline u64 bch2_str_hash_end(struct bch_str_hash_ctx *ctx,
 	}
 }
 
+static inline u64 bch2_str_hash_end(struct bch_str_hash_ctx *ctx,
+				   const struct bch_hash_info *info)
+{
+	return __bch2_str_hash_end(ctx, info->type);
+}
+
 struct bch_hash_desc {
 	enum btree_id	btree_id;
 	u8		key_type;
@@ -27,6 +27,26 @@ struct snapshot_table {
 #endif
 };
 
+/*
+ * Euler tour interval numbering of the snapshot tree: @ancestor is an ancestor
+ * of @id iff id's start falls within ancestor's interval. Rebuilt from scratch
+ * by bch2_snapshot_euler_rebuild() and dropped whenever the snapshot table
+ * changes; start == 0 means no interval assigned.
+ */
+struct snapshot_interval {
+	u32			start;
+	u32			end;
+};
+
+struct snapshot_euler_table {
+	size_t			size;
+#ifndef RUST_BINDGEN
+	DECLARE_FLEX_ARRAY(struct snapshot_interval, d);
+#else
+	struct snapshot_interval d[0];
+#endif
+};
+
 typedef struct {
 	u32		subvol;
 	u64		inum;
@@ -344,8 +344,13 @@ static int bch2_sb_compatible(struct bch_sb *sb, struct printbuf *out)
 	return 0;
 }
 
+/*
+ * @fields is a bitmask of sections to deep-validate: single-field queries
+ * (show-super -F) needn't pay for walking every replicas/journal/counters
+ * entry. Structural checks - bounds, checksums, members - always run.
+ */
 static int bch2_sb_validate(struct bch_sb_handle *disk_sb, struct printbuf *out,
-			    int rw)
+			    int rw, u64 fields)
 {
 	struct bch_sb *sb = disk_sb->sb;
 	struct bch_sb_field_members_v1 *mi;
@@ -462,7 +467,12 @@ static int bch2_sb_validate(struct bch_sb_handle *disk_sb, struct printbuf *out,
 		return ret;
 
 	vstruct_for_each(sb, f) {
-		if (le32_to_cpu(f->type) == BCH_SB_FIELD_members_v1)
+		unsigned type = le32_to_cpu(f->type);
+
+		if (type == BCH_SB_FIELD_members_v1)
+			continue;
+
+		if (type < BCH_SB_FIELD_NR && !(fields & BIT_ULL(type)))
 			continue;
 
 		ret = bch2_sb_field_validate(sb, f, out);
@@ -696,6 +706,9 @@ retry:
 #ifndef __KERNEL__
 	if (opt_get(*opts, direct_io) == false)
 		sb->mode |= BLK_OPEN_BUFFERED;
+
+	if (opt_get(*opts, mmap_io))
+		sb->mode |= BLK_OPEN_MMAP;
 #endif
 
 	if (!opt_get(*opts, noexcl))
@@ -806,7 +819,8 @@ got_super:
 	ret = 0;
 	sb->have_layout = true;
 
-	ret = bch2_sb_validate(sb, &err, READ);
+	ret = bch2_sb_validate(sb, &err, READ,
+			       opt_get(*opts, sb_validate_fields));
 	if (ret) {
 		printk(KERN_ERR "bcachefs (%s): error validating superblock: %s\n",
 		       path, err.buf);
@@ -926,13 +940,6 @@ int bch2_write_super(struct bch_fs *c)
 	c->disk_sb.sb->magic = BCHFS_MAGIC;
 	c->disk_sb.sb->layout.magic = BCHFS_MAGIC;
 
-	le64_add_cpu(&c->disk_sb.sb->seq, 1);
-
-	struct bch_sb_field_members_v2 *mi = bch2_sb_field_get(c->disk_sb.sb, members_v2);
-	for_each_online_member(c, ca)
-		__bch2_members_v2_get_mut(mi, ca->dev_idx)->seq = c->disk_sb.sb->seq;
-	c->disk_sb.sb->write_time = cpu_to_le64(ktime_get_real_seconds());
-
 	if (test_bit(BCH_FS_error, &c->flags))
 		SET_BCH_SB_HAS_ERRORS(c->disk_sb.sb, 1);
 	if (test_bit(BCH_FS_topology_error, &c->flags))
@@ -946,13 +953,30 @@ int bch2_write_super(struct bch_fs *c)
 	bch2_sb_errors_from_cpu(c);
 	bch2_sb_downgrade_update(c);
 
+	/*
+	 * If no fields changed since the last successful write, skip rewriting
+	 * every superblock copy on every device - seq, member seqs and
+	 * write_time only advance when something else was modified:
+	 */
+	if (!bch2_crc_cmp(csum_vstruct(NULL, BCH_CSUM_crc64, null_nonce(),
+				       c->disk_sb.sb),
+			  c->disk_sb_csum))
+		goto out;
+
+	le64_add_cpu(&c->disk_sb.sb->seq, 1);
+
+	struct bch_sb_field_members_v2 *mi = bch2_sb_field_get(c->disk_sb.sb, members_v2);
+	for_each_online_member(c, ca)
+		__bch2_members_v2_get_mut(mi, ca->dev_idx)->seq = c->disk_sb.sb->seq;
+	c->disk_sb.sb->write_time = cpu_to_le64(ktime_get_real_seconds());
+
 	for_each_online_member(c, ca)
 		bch2_sb_from_fs(c, ca);
 
 	for_each_online_member(c, ca) {
 		printbuf_reset(&err);
 
-		ret = bch2_sb_validate(&ca->disk_sb, &err, WRITE);
+		ret = bch2_sb_validate(&ca->disk_sb, &err, WRITE, U64_MAX);
 		if (ret) {
 			bch2_fs_inconsistent(c, "sb invalid before write: %s", err.buf);
 			percpu_ref_put(&ca->io_ref);
@@ -1028,11 +1052,14 @@ int bch2_write_super(struct bch_fs *c)
 		sb++;
 	} while (wrote);
 
+	bool write_error = false;
 	for_each_online_member(c, ca) {
-		if (ca->sb_write_error)
+		if (ca->sb_write_error) {
 			__clear_bit(ca->dev_idx, sb_written.d);
-		else
+			write_error = true;
+		} else {
 			ca->disk_sb.seq = le64_to_cpu(ca->disk_sb.sb->seq);
+		}
 	}
 
 	nr_wrote = dev_mask_nr(&sb_written);
@@ -1061,6 +1088,14 @@ int bch2_write_super(struct bch_fs *c)
 		"Unable to write superblock to sufficient devices (from %ps)",
 		(void *) _RET_IP_))
 		ret = -1;
+
+	/*
+	 * Only remember this as the last written state if every copy made it
+	 * out, so that devices that missed this write get retried next time:
+	 */
+	if (!ret && !write_error)
+		c->disk_sb_csum = csum_vstruct(NULL, BCH_CSUM_crc64, null_nonce(),
+					       c->disk_sb.sb);
 out:
 	/* Make new options visible after they're persistent: */
 	bch2_sb_update(c);
@@ -101,10 +101,18 @@ void __bch2_print(struct bch_fs *c, const char *fmt, ...)
 			fmt += 2;
 
 		spin_lock_irqsave(&stdio->output_lock, flags);
+		bool was_empty = !stdio->output_buf.pos;
 		prt_vprintf(&stdio->output_buf, fmt, args);
 		spin_unlock_irqrestore(&stdio->output_lock, flags);
 
-		wake_up(&stdio->output_wait);
+		/*
+		 * Readers drain the whole buffer per wakeup and only sleep on
+		 * an empty buffer, so messages produced while output is
+		 * pending don't each need a wakeup - high frequency output
+		 * batches under a single reader wakeup:
+		 */
+		if (was_empty)
+			wake_up(&stdio->output_wait);
 	}
 	va_end(args);
 }
@@ -553,6 +561,17 @@ static void __bch2_fs_free(struct bch_fs *c)
 
 	darray_exit(&c->btree_roots_extra);
 	free_percpu(c->pcpu);
+	if (c->large_bkey_cache) {
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			struct bkey_i *k = *per_cpu_ptr(c->large_bkey_cache, cpu);
+
+			if (k)
+				mempool_free(k, &c->large_bkey_pool);
+		}
+		free_percpu(c->large_bkey_cache);
+	}
 	mempool_exit(&c->large_bkey_pool);
 	mempool_exit(&c->btree_bounce_pool);
 	bioset_exit(&c->btree_bio);
@@ -568,6 +587,10 @@ static void __bch2_fs_free(struct bch_fs *c)
 		destroy_workqueue(c->write_ref_wq);
 	if (c->io_complete_wq)
 		destroy_workqueue(c->io_complete_wq);
+	if (c->move_write_wq)
+		destroy_workqueue(c->move_write_wq);
+	if (c->btree_read_complete_wq)
+		destroy_workqueue(c->btree_read_complete_wq);
 	if (c->copygc_wq)
 		destroy_workqueue(c->copygc_wq);
 	if (c->btree_io_complete_wq)
@@ -741,6 +764,7 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	mutex_init(&c->sb_lock);
 	mutex_init(&c->replicas_gc_lock);
 	mutex_init(&c->btree_root_lock);
+	mutex_init(&c->btree_root_read_lock);
 	INIT_WORK(&c->read_only_work, bch2_fs_read_only_work);
 
 	refcount_set(&c->ro_ref, 1);
@@ -776,6 +800,9 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	init_rwsem(&c->snapshot_create_lock);
 
 	spin_lock_init(&c->btree_write_error_lock);
+	spin_lock_init(&c->btree_commit_shaper.lock);
+	c->btree_commit_shaper.window_start = jiffies;
+	spin_lock_init(&c->logged_ops_pool_lock);
 
 	INIT_WORK(&c->journal_seq_blacklist_gc_work,
 		  bch2_blacklist_entries_gc);
@@ -865,8 +892,12 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 				WQ_HIGHPRI|WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_UNBOUND, 512)) ||
 	    !(c->btree_io_complete_wq = alloc_workqueue("bcachefs_btree_io",
 				WQ_HIGHPRI|WQ_FREEZABLE|WQ_MEM_RECLAIM, 1)) ||
+	    !(c->btree_read_complete_wq = alloc_workqueue("bcachefs_btree_read_complete",
+				WQ_HIGHPRI|WQ_FREEZABLE|WQ_MEM_RECLAIM, 512)) ||
 	    !(c->copygc_wq = alloc_workqueue("bcachefs_copygc",
 				WQ_HIGHPRI|WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_CPU_INTENSIVE, 1)) ||
+	    !(c->move_write_wq = alloc_workqueue("bcachefs_move_write",
+				WQ_FREEZABLE|WQ_CPU_INTENSIVE, 0)) ||
 	    !(c->io_complete_wq = alloc_workqueue("bcachefs_io",
 				WQ_HIGHPRI|WQ_FREEZABLE|WQ_MEM_RECLAIM, 512)) ||
 	    !(c->write_ref_wq = alloc_workqueue("bcachefs_write_ref",
@@ -885,6 +916,7 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	    mempool_init_kvpmalloc_pool(&c->btree_bounce_pool, 1,
 					c->opts.btree_node_size) ||
 	    mempool_init_kmalloc_pool(&c->large_bkey_pool, 1, 2048) ||
+	    !(c->large_bkey_cache = alloc_percpu(struct bkey_i *)) ||
 	    !(c->unused_inode_hints = kcalloc(1U << c->inode_shard_bits,
 					      sizeof(u64), GFP_KERNEL))) {
 		ret = -BCH_ERR_ENOMEM_fs_other_alloc;
@@ -1257,6 +1289,7 @@ static struct bch_dev *__bch2_dev_alloc(struct bch_fs *c,
 	init_completion(&ca->io_ref_completion);
 
 	init_rwsem(&ca->bucket_lock);
+	spin_lock_init(&ca->alloc_cache_lock);
 
 	INIT_WORK(&ca->io_error_work, bch2_io_error_work);
 
@@ -37,6 +37,7 @@ struct bch_member_cpu {
 	u8			durability;
 	u8			freespace_initialized;
 	u8			valid;
+	u32			iops[BCH_IOPS_NR];	/* from `device benchmark` */
 };
 
 #endif /* _BCACHEFS_SUPER_TYPES_H */
@@ -20,6 +20,7 @@
 #include "btree_update_interior.h"
 #include "btree_gc.h"
 #include "buckets.h"
+#include "buckets_waiting_for_journal.h"
 #include "clock.h"
 #include "compress.h"
 #include "disk_groups.h"
@@ -162,6 +163,7 @@ read_attribute(io_latency_stats_write);
 read_attribute(congested);
 
 read_attribute(btree_write_stats);
+read_attribute(btree_commit_stats);
 
 read_attribute(btree_cache_size);
 read_attribute(compression_stats);
@@ -169,11 +171,13 @@ read_attribute(journal_debug);
 read_attribute(btree_updates);
 read_attribute(btree_cache);
 read_attribute(btree_key_cache);
+read_attribute(buckets_waiting_for_journal);
 read_attribute(stripes_heap);
 read_attribute(open_buckets);
 read_attribute(open_buckets_partial);
 read_attribute(write_points);
 read_attribute(nocow_lock_table);
+read_attribute(btree_lock_contended);
 
 #ifdef BCH_WRITE_REF_DEBUG
 read_attribute(write_refs);
@@ -198,6 +202,18 @@ static void bch2_write_refs_to_text(struct printbuf *out, struct bch_fs *c)
 }
 #endif
 
+static void bch2_btree_lock_contended_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	bch2_printbuf_tabstop_push(out, 24);
+
+	for (unsigned i = 0; i < BTREE_ID_NR; i++) {
+		prt_str(out, bch2_btree_id_str(i));
+		prt_tab(out);
+		prt_printf(out, "%li", atomic_long_read(&c->btree_lock_contended[i]));
+		prt_newline(out);
+	}
+}
+
 read_attribute(internal_uuid);
 read_attribute(disk_groups);
 
@@ -207,6 +223,9 @@ read_attribute(alloc_debug);
 #define x(t, n, ...) read_attribute(t);
 BCH_PERSISTENT_COUNTERS()
 #undef x
+#define x(t) read_attribute(t);
+BCH_INMEM_COUNTERS()
+#undef x
 
 rw_attribute(discard);
 rw_attribute(label);
@@ -214,6 +233,8 @@ rw_attribute(label);
 rw_attribute(copy_gc_enabled);
 read_attribute(copy_gc_wait);
 
+rw_attribute(snapshot_delete_rate_keys);
+
 rw_attribute(rebalance_enabled);
 sysfs_pd_controller_attribute(rebalance);
 read_attribute(rebalance_status);
@@ -392,6 +413,9 @@ SHOW(bch2_fs)
 	if (attr == &sysfs_btree_write_stats)
 		bch2_btree_write_stats_to_text(out, c);
 
+	if (attr == &sysfs_btree_commit_stats)
+		bch2_btree_commit_stats_to_text(out, c);
+
 	sysfs_printf(btree_gc_periodic, "%u",	(int) c->btree_gc_periodic);
 
 	if (attr == &sysfs_gc_gens_pos)
@@ -399,6 +423,10 @@ SHOW(bch2_fs)
 
 	sysfs_printf(copy_gc_enabled, "%i", c->copy_gc_enabled);
 
+	sysfs_printf(snapshot_delete_rate_keys, "%u",
+		     c->snapshot_delete_rate.rate != UINT_MAX
+		     ? c->snapshot_delete_rate.rate : 0);
+
 	sysfs_printf(rebalance_enabled,		"%i", c->rebalance.enabled);
 	sysfs_pd_controller_show(rebalance,	&c->rebalance.pd); /* XXX */
 
@@ -424,6 +452,9 @@ SHOW(bch2_fs)
 	if (attr == &sysfs_btree_key_cache)
 		bch2_btree_key_cache_to_text(out, &c->btree_key_cache);
 
+	if (attr == &sysfs_buckets_waiting_for_journal)
+		bch2_buckets_waiting_for_journal_to_text(out, c);
+
 	if (attr == &sysfs_stripes_heap)
 		bch2_stripes_heap_to_text(out, c);
 
@@ -459,6 +490,9 @@ SHOW(bch2_fs)
 	if (attr == &sysfs_nocow_lock_table)
 		bch2_nocow_locks_to_text(out, &c->nocow_locks);
 
+	if (attr == &sysfs_btree_lock_contended)
+		bch2_btree_lock_contended_to_text(out, c);
+
 	if (attr == &sysfs_disk_groups)
 		bch2_disk_groups_to_text(out, c);
 
@@ -486,6 +520,15 @@ STORE(bch2_fs)
 		return ret;
 	}
 
+	if (attr == &sysfs_snapshot_delete_rate_keys) {
+		/* 0 = unlimited; applies to a running sweep immediately */
+		unsigned v = 0;
+		ssize_t ret = strtoul_safe(buf, v) ?: (ssize_t) size;
+
+		c->snapshot_delete_rate.rate = v ?: UINT_MAX;
+		return ret;
+	}
+
 	if (attr == &sysfs_rebalance_enabled) {
 		ssize_t ret = strtoul_safe(buf, c->rebalance.enabled)
 			?: (ssize_t) size;
@@ -566,6 +609,7 @@ struct attribute *bch2_fs_files[] = {
 	&sysfs_minor,
 	&sysfs_btree_cache_size,
 	&sysfs_btree_write_stats,
+	&sysfs_btree_commit_stats,
 
 	&sysfs_promote_whole_extents,
 
@@ -602,6 +646,7 @@ SHOW(bch2_fs_counters)
 			prt_newline(out);					\
 		}
 	BCH_PERSISTENT_COUNTERS()
+	BCH_INMEM_COUNTERS()
 	#undef x
 	return 0;
 }
@@ -616,6 +661,7 @@ struct attribute *bch2_fs_counters_files[] = {
 #define x(t, ...) \
 	&sysfs_##t,
 	BCH_PERSISTENT_COUNTERS()
+	BCH_INMEM_COUNTERS()
 #undef x
 	NULL
 };
@@ -642,6 +688,7 @@ struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_btree_updates,
 	&sysfs_btree_cache,
 	&sysfs_btree_key_cache,
+	&sysfs_buckets_waiting_for_journal,
 	&sysfs_new_stripes,
 	&sysfs_stripes_heap,
 	&sysfs_open_buckets,
@@ -651,6 +698,7 @@ struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_write_refs,
 #endif
 	&sysfs_nocow_lock_table,
+	&sysfs_btree_lock_contended,
 	&sysfs_io_timers_read,
 	&sysfs_io_timers_write,
 
@@ -665,6 +713,8 @@ struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_copy_gc_enabled,
 	&sysfs_copy_gc_wait,
 
+	&sysfs_snapshot_delete_rate_keys,
+
 	&sysfs_rebalance_enabled,
 	&sysfs_rebalance_status,
 	sysfs_pd_controller_files(rebalance),
@@ -832,7 +882,7 @@ static void dev_alloc_debug_to_text(struct printbuf *out, struct bch_dev *ca)
 
 	prt_str(out, "open buckets allocated");
 	prt_tab(out);
-	prt_u64(out, OPEN_BUCKETS_COUNT - c->open_buckets_nr_free);
+	prt_u64(out, OPEN_BUCKETS_COUNT - bch2_open_buckets_nr_free(c));
 	prt_newline(out);
 
 	prt_str(out, "open buckets this dev");
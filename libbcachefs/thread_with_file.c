@@ -174,6 +174,7 @@ static ssize_t thread_with_stdio_write(struct file *file, const char __user *ubu
 		}
 
 		spin_lock(&thr->stdio.input_lock);
+		bool was_empty = !buf->pos;
 		if (buf->pos < WRITE_BUFFER)
 			bch2_printbuf_make_room(buf, min(b, WRITE_BUFFER - buf->pos));
 		b = min(len, printbuf_remaining_size(buf));
@@ -187,7 +188,13 @@ static ssize_t thread_with_stdio_write(struct file *file, const char __user *ubu
 		spin_unlock(&thr->stdio.input_lock);
 
 		if (b) {
-			wake_up(&thr->stdio.input_wait);
+			/*
+			 * The thread only sleeps on an empty buffer, and
+			 * drains in bulk - no wakeup needed if input was
+			 * already pending:
+			 */
+			if (was_empty)
+				wake_up(&thr->stdio.input_wait);
 		} else {
 			if ((file->f_flags & O_NONBLOCK)) {
 				ret = -EAGAIN;
@@ -261,6 +268,7 @@ int bch2_stdio_redirect_read(struct stdio_redirect *stdio, char *buf, size_t len
 
 	spin_lock(&stdio->input_lock);
 	int ret = min(len, stdio->input_buf.pos);
+	bool was_full = stdio->input_buf.pos >= WRITE_BUFFER;
 	stdio->input_buf.pos -= ret;
 	memcpy(buf, stdio->input_buf.buf, ret);
 	memmove(stdio->input_buf.buf,
@@ -268,7 +276,9 @@ int bch2_stdio_redirect_read(struct stdio_redirect *stdio, char *buf, size_t len
 		stdio->input_buf.pos);
 	spin_unlock(&stdio->input_lock);
 
-	wake_up(&stdio->input_wait);
+	/* writers only sleep on a full buffer: */
+	if (was_full && stdio->input_buf.pos < WRITE_BUFFER)
+		wake_up(&stdio->input_wait);
 	return ret;
 }
 
@@ -282,6 +292,7 @@ int bch2_stdio_redirect_readline(struct stdio_redirect *stdio, char *buf, size_t
 
 	spin_lock(&stdio->input_lock);
 	int ret = min(len, stdio->input_buf.pos);
+	bool was_full = stdio->input_buf.pos >= WRITE_BUFFER;
 	char *n = memchr(stdio->input_buf.buf, '\n', ret);
 	if (n)
 		ret = min(ret, n + 1 - stdio->input_buf.buf);
@@ -292,7 +303,9 @@ int bch2_stdio_redirect_readline(struct stdio_redirect *stdio, char *buf, size_t
 		stdio->input_buf.pos);
 	spin_unlock(&stdio->input_lock);
 
-	wake_up(&stdio->input_wait);
+	/* writers only sleep on a full buffer: */
+	if (was_full && stdio->input_buf.pos < WRITE_BUFFER)
+		wake_up(&stdio->input_wait);
 	return ret;
 }
 
@@ -2,7 +2,28 @@
 
 #include "two_state_shared_lock.h"
 
-void __bch2_two_state_lock(two_state_lock_t *lock, int s)
+/*
+ * Holders are only briefly in the critical section, so when the trylock fails
+ * spin a bit before committing to the wait queue - under mixed add/block
+ * traffic the conflicting state usually drains in well under a timeslice.
+ */
+#define TWO_STATE_LOCK_SPINS	64
+
+/* Returns true if we had to sleep: */
+bool __bch2_two_state_lock(two_state_lock_t *lock, int s)
 {
+	for (unsigned i = 0; i < TWO_STATE_LOCK_SPINS; i++) {
+		cpu_relax();
+
+		if (bch2_two_state_trylock(lock, s))
+			return false;
+	}
+
+	atomic_inc(&lock->waiters);
+	smp_mb__after_atomic();
+
 	__wait_event(lock->wait, bch2_two_state_trylock(lock, s));
+
+	atomic_dec(&lock->waiters);
+	return true;
 }
@@ -14,12 +14,14 @@
  */
 typedef struct {
 	atomic_long_t		v;
+	atomic_t		waiters;
 	wait_queue_head_t	wait;
 } two_state_lock_t;
 
 static inline void two_state_lock_init(two_state_lock_t *lock)
 {
 	atomic_long_set(&lock->v, 0);
+	atomic_set(&lock->waiters, 0);
 	init_waitqueue_head(&lock->wait);
 }
 
@@ -29,8 +31,18 @@ static inline void bch2_two_state_unlock(two_state_lock_t *lock, int s)
 
 	EBUG_ON(atomic_long_read(&lock->v) == 0);
 
-	if (atomic_long_sub_return_release(i, &lock->v) == 0)
-		wake_up_all(&lock->wait);
+	if (atomic_long_sub_return_release(i, &lock->v) == 0) {
+		/*
+		 * Only touch the wait queue if someone is sleeping on it;
+		 * pairs with the barrier in __bch2_two_state_lock() - either
+		 * the waiter's trylock sees our store to v, or we see their
+		 * waiter count increment:
+		 */
+		smp_mb__after_atomic();
+
+		if (atomic_read(&lock->waiters))
+			wake_up_all(&lock->wait);
+	}
 }
 
 static inline bool bch2_two_state_trylock(two_state_lock_t *lock, int s)
@@ -48,7 +60,7 @@ static inline bool bch2_two_state_trylock(two_state_lock_t *lock, int s)
 	return true;
 }
 
-void __bch2_two_state_lock(two_state_lock_t *, int);
+bool __bch2_two_state_lock(two_state_lock_t *, int);
 
 static inline void bch2_two_state_lock(two_state_lock_t *lock, int s)
 {
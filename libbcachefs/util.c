@@ -19,6 +19,8 @@
 #include <linux/preempt.h>
 #include <linux/random.h>
 #include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/string.h>
 #include <linux/types.h>
 #include <linux/sched/clock.h>
@@ -416,6 +418,7 @@ static inline void bch2_time_stats_update_one(struct bch2_time_stats *stats,
 		stats->min_duration = min(stats->min_duration, duration);
 		stats->total_duration += duration;
 		bch2_quantiles_update(&stats->quantiles, duration);
+		stats->duration_hist[bch2_duration_hist_idx(duration)]++;
 	}
 
 	if (time_after64(end, stats->last_event)) {
@@ -621,6 +624,59 @@ void bch2_time_stats_to_text(struct printbuf *out, struct bch2_time_stats *stats
 			prt_newline(out);
 		last_q = q;
 	}
+
+	u64 hist_total = 0;
+
+	for (i = 0; i < NR_DURATION_HIST; i++)
+		hist_total += stats->duration_hist[i];
+
+	if (hist_total) {
+		u64 cum = 0, p50 = 0, p90 = 0, p99 = 0;
+
+		prt_printf(out, "duration histogram");
+		prt_newline(out);
+		printbuf_indent_add(out, 2);
+		printbuf_tabstop_push(out, out->indent + TABSTOP_SIZE);
+
+		for (i = 0; i < NR_DURATION_HIST; i++) {
+			/* upper bound of the bucket, capped by what we saw: */
+			u64 max_ns = min(1ULL << (10 + i), stats->max_duration);
+
+			if (stats->duration_hist[i]) {
+				u = pick_time_units(max_ns);
+				prt_printf(out, "%s %llu %s:",
+					   i < NR_DURATION_HIST - 1 ? "<" : ">=",
+					   div_u64(i < NR_DURATION_HIST - 1
+						   ? max_ns : 1ULL << (9 + i),
+						   u->nsecs),
+					   u->name);
+				prt_tab(out);
+				prt_printf(out, "%llu", stats->duration_hist[i]);
+				prt_newline(out);
+			}
+
+			cum += stats->duration_hist[i];
+			if (!p50 && cum * 2	>= hist_total)
+				p50 = max_ns;
+			if (!p90 && cum * 10	>= hist_total * 9)
+				p90 = max_ns;
+			if (!p99 && cum * 100	>= hist_total * 99)
+				p99 = max_ns;
+		}
+
+		printbuf_tabstop_pop(out);
+		printbuf_indent_sub(out, 2);
+
+		prt_printf(out, "p50: ");
+		bch2_pr_time_units(out, p50);
+		prt_newline(out);
+		prt_printf(out, "p90: ");
+		bch2_pr_time_units(out, p90);
+		prt_newline(out);
+		prt_printf(out, "p99: ");
+		bch2_pr_time_units(out, p99);
+		prt_newline(out);
+	}
 }
 #else
 void bch2_time_stats_to_text(struct printbuf *out, struct bch2_time_stats *stats) {}
@@ -783,6 +839,7 @@ void bch2_pd_controller_debug_to_text(struct printbuf *out, struct bch_pd_contro
 
 /* misc: */
 
+#ifdef __KERNEL__
 void bch2_bio_map(struct bio *bio, void *base, size_t size)
 {
 	while (size) {
@@ -817,6 +874,32 @@ int bch2_bio_alloc_pages(struct bio *bio, size_t size, gfp_t gfp_mask)
 
 	return 0;
 }
+#else
+/*
+ * In userspace a struct page is just the page-aligned pointer and buffers are
+ * plain virtually contiguous memory, so there's no reason to carve a mapping
+ * into PAGE_SIZE bvecs: one segment per buffer means bio_for_each_segment()
+ * walks (and the pwritev/aio iovec gets) one entry for a whole btree node or
+ * journal write instead of 256.
+ */
+void bch2_bio_map(struct bio *bio, void *base, size_t size)
+{
+	BUG_ON(!bio_add_page(bio, virt_to_page(base), size,
+			     offset_in_page(base)));
+}
+
+int bch2_bio_alloc_pages(struct bio *bio, size_t size, gfp_t gfp_mask)
+{
+	struct page *page = alloc_pages(gfp_mask, get_order(size));
+
+	if (!page)
+		return -ENOMEM;
+
+	/* freed with one __free_page() per bvec by bio_free_pages(): */
+	bio_add_page(bio, page, size, 0);
+	return 0;
+}
+#endif
 
 size_t bch2_rand_range(size_t max)
 {
@@ -1006,6 +1089,99 @@ void sort_cmp_size(void *base, size_t num, size_t size,
 	}
 }
 
+struct radix_sort_key {
+	u64	key;
+	u32	idx;
+};
+
+/**
+ * bch2_sort_radix - hybrid radix/comparison sort for large arrays
+ * @base:	array to sort
+ * @nr:		number of elements
+ * @size:	element size
+ * @key_fn:	extracts a u64 sort key prefix from an element
+ * @cmp:	full comparator, for ties the prefix can't break
+ *
+ * Radix sorts (key, index) pairs on the extracted prefix - 8 bits per pass,
+ * skipping bytes the keys don't differ in - then gathers elements into their
+ * final order and finishes runs of equal prefixes with @cmp. Extracting the
+ * keys up front means the passes touch small fixed size records instead of
+ * chasing whatever pointers @cmp would.
+ *
+ * @cmp must order consistently with @key_fn: elements whose prefixes differ
+ * must compare in the same direction as the prefixes.
+ *
+ * Falls back to sort() for small arrays or when the scratch allocation fails,
+ * so callers can treat it as a drop in replacement. Not stable, like sort().
+ */
+void bch2_sort_radix(void *base, size_t nr, size_t size,
+		     u64 (*key_fn)(const void *),
+		     int (*cmp)(const void *, const void *))
+{
+	struct radix_sort_key *keys, *src, *dst;
+	u64 diff = 0;
+	u8 *scratch;
+	unsigned shift;
+	size_t i;
+
+	if (nr < 512 || nr > U32_MAX)
+		goto fallback;
+
+	keys = kvmalloc(nr * (sizeof(*keys) * 2 + size), GFP_KERNEL);
+	if (!keys)
+		goto fallback;
+	scratch = (u8 *) (keys + nr * 2);
+
+	for (i = 0; i < nr; i++) {
+		keys[i].key = key_fn(base + i * size);
+		keys[i].idx = i;
+		diff |= keys[i].key ^ keys[0].key;
+	}
+
+	src = keys;
+	dst = keys + nr;
+	for (shift = 0; shift < 64; shift += 8) {
+		size_t count[256] = {}, offset = 0;
+
+		if (!((diff >> shift) & 0xff))
+			continue;
+
+		for (i = 0; i < nr; i++)
+			count[(src[i].key >> shift) & 0xff]++;
+
+		for (unsigned b = 0; b < 256; b++) {
+			size_t c = count[b];
+
+			count[b] = offset;
+			offset += c;
+		}
+
+		for (i = 0; i < nr; i++)
+			dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+
+		swap(src, dst);
+	}
+
+	for (i = 0; i < nr; i++)
+		memcpy(scratch + i * size,
+		       base + (size_t) src[i].idx * size, size);
+	memcpy(base, scratch, nr * size);
+
+	for (i = 0; i < nr; i++) {
+		size_t j = i;
+
+		while (i + 1 < nr && src[i + 1].key == src[j].key)
+			i++;
+		if (i > j)
+			sort(base + j * size, i + 1 - j, size, cmp, NULL);
+	}
+
+	kvfree(keys);
+	return;
+fallback:
+	sort(base, nr, size, cmp, NULL);
+}
+
 static void mempool_free_vp(void *element, void *pool_data)
 {
 	size_t size = (size_t) pool_data;
@@ -236,7 +236,8 @@ do {									\
 #define prt_tab_rjust(_out)		bch2_prt_tab_rjust(_out)
 
 #define prt_bytes_indented(...)		bch2_prt_bytes_indented(__VA_ARGS__)
-#define prt_u64(_out, _v)		prt_printf(_out, "%llu", (u64) (_v))
+#define prt_u64(_out, _v)		bch2_prt_u64(_out, (u64) (_v))
+#define prt_u64_hex(_out, _v)		bch2_prt_u64_hex(_out, (u64) (_v))
 #define prt_human_readable_u64(...)	bch2_prt_human_readable_u64(__VA_ARGS__)
 #define prt_human_readable_s64(...)	bch2_prt_human_readable_s64(__VA_ARGS__)
 #define prt_units_u64(...)		bch2_prt_units_u64(__VA_ARGS__)
@@ -373,6 +374,23 @@ struct bch2_quantiles {
 	}		entries[NR_QUANTILES];
 };
 
+/*
+ * log2 duration histogram: bucket 0 is everything under a microsecond, bucket
+ * i covers [2^(9 + i), 2^(10 + i)) ns, the last bucket everything from ~16ms
+ * up - indexing is just a shift so the update stays cheap enough for hot
+ * paths, and unlike the quantile estimator above the buckets are stable, so
+ * tail percentiles (p99 journal flush latency, in particular) can be read
+ * off directly:
+ */
+#define NR_DURATION_HIST	16
+
+static inline unsigned bch2_duration_hist_idx(u64 duration)
+{
+	return duration < 1024
+		? 0
+		: min_t(unsigned, ilog2(duration) - 9, NR_DURATION_HIST - 1);
+}
+
 struct bch2_time_stat_buffer {
 	unsigned	nr;
 	struct bch2_time_stat_buffer_entry {
@@ -391,6 +409,7 @@ struct bch2_time_stats {
 	u64             min_freq;
 	u64		last_event;
 	struct bch2_quantiles quantiles;
+	u64		duration_hist[NR_DURATION_HIST];
 
 	struct mean_and_variance	  duration_stats;
 	struct mean_and_variance_weighted duration_stats_weighted;
@@ -742,6 +761,10 @@ void sort_cmp_size(void *base, size_t num, size_t size,
 	  int (*cmp_func)(const void *, const void *, size_t),
 	  void (*swap_func)(void *, void *, size_t));
 
+void bch2_sort_radix(void *, size_t, size_t,
+		     u64 (*)(const void *),
+		     int (*)(const void *, const void *));
+
 /* just the memmove, doesn't update @_nr */
 #define __array_insert_item(_array, _nr, _pos)				\
 	memmove(&(_array)[(_pos) + 1],					\
@@ -127,3 +127,111 @@ int bch2_varint_decode_fast(const u8 *in, const u8 *end, u64 *out)
 	*out = v;
 	return bytes;
 }
+
+static int varint_decode_run(const u8 *in, const u8 *end, u64 *out, unsigned nr)
+{
+	const u8 *start = in;
+
+	while (nr--) {
+		int ret = bch2_varint_decode_fast(in, end, out++);
+		if (ret < 0)
+			return -1;
+		in += ret;
+	}
+
+	return in - start;
+}
+
+#if defined(__x86_64__) && !defined(__KERNEL__)
+#include <immintrin.h>
+
+/*
+ * BMI2 version of the mixed width run: tzcnt caps the continuation bit scan
+ * at the first byte and bzhi replaces the two-shift mask, so each varint
+ * decodes without a branch on its length - only the rare 9 byte encoding and
+ * running off the end of the buffer drop out of the loop:
+ */
+__attribute__((target("bmi,bmi2")))
+static int varint_decode_run_bmi2(const u8 *in, const u8 *end,
+				  u64 *out, unsigned nr)
+{
+	const u8 *start = in;
+
+	while (nr) {
+#ifdef CONFIG_VALGRIND
+		VALGRIND_MAKE_MEM_DEFINED(in, 8);
+#endif
+		u64 v = get_unaligned_le64(in);
+		unsigned bytes = _tzcnt_u64(~v | (1ULL << 8)) + 1;
+
+		if (unlikely(bytes > 8 || in + bytes > end))
+			break;
+
+		*out++ = _bzhi_u64(v >> bytes, 7 * bytes);
+		in += bytes;
+		nr--;
+	}
+
+	int ret = varint_decode_run(in, end, out, nr);
+	if (ret < 0)
+		return -1;
+
+	return (in - start) + ret;
+}
+#endif
+
+/**
+ * bch2_varint_decode_batch - decode a run of varints in one pass
+ * @in:		first varint to decode
+ * @end:	end of buffer to decode from
+ * @out:	array of @nr decoded integers, on success
+ * @nr:		number of varints to decode
+ * Returns:	total size in bytes of the decoded integers - or -1 on failure
+ * (would have read past the end of the buffer)
+ *
+ * Same caveat as bch2_varint_decode_fast(): assumes it is safe to read at
+ * most 8 bytes past @end.
+ */
+int bch2_varint_decode_batch(const u8 *in, const u8 *end, u64 *out, unsigned nr)
+{
+	const u8 *start = in;
+	int ret;
+
+	/*
+	 * Single byte varints have the low bit clear, so one u64 load tests
+	 * the continuation bits of eight varints at once - and small fields
+	 * are by far the common case:
+	 */
+	while (nr >= 8 && in + 8 <= end) {
+#ifdef CONFIG_VALGRIND
+		VALGRIND_MAKE_MEM_DEFINED(in, 8);
+#endif
+		u64 v = get_unaligned_le64(in);
+
+		if (v & 0x0101010101010101ULL)
+			break;
+
+		for (unsigned i = 0; i < 8; i++)
+			*out++ = (v >> (i * 8 + 1)) & 127;
+		in += 8;
+		nr -= 8;
+	}
+
+#if defined(__x86_64__) && !defined(__KERNEL__)
+	static int (*run)(const u8 *, const u8 *, u64 *, unsigned);
+
+	if (unlikely(!run))
+		run = __builtin_cpu_supports("bmi") &&
+		      __builtin_cpu_supports("bmi2")
+			? varint_decode_run_bmi2
+			: varint_decode_run;
+
+	ret = run(in, end, out, nr);
+#else
+	ret = varint_decode_run(in, end, out, nr);
+#endif
+	if (ret < 0)
+		return -1;
+
+	return (in - start) + ret;
+}
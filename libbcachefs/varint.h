@@ -8,4 +8,6 @@ int bch2_varint_decode(const u8 *, const u8 *, u64 *);
 int bch2_varint_encode_fast(u8 *, u64);
 int bch2_varint_decode_fast(const u8 *, const u8 *, u64 *);
 
+int bch2_varint_decode_batch(const u8 *, const u8 *, u64 *, unsigned);
+
 #endif /* _BCACHEFS_VARINT_H */
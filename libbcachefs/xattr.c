@@ -16,16 +16,31 @@
 
 static const struct xattr_handler *bch2_xattr_type_to_handler(unsigned);
 
-static u64 bch2_xattr_hash(const struct bch_hash_info *info,
-			  const struct xattr_search_key *key)
+static __always_inline u64 __bch2_xattr_hash(const struct bch_hash_info *info,
+					     const struct xattr_search_key *key,
+					     enum bch_str_hash_type type)
 {
 	struct bch_str_hash_ctx ctx;
 
-	bch2_str_hash_init(&ctx, info);
-	bch2_str_hash_update(&ctx, info, &key->type, sizeof(key->type));
-	bch2_str_hash_update(&ctx, info, key->name.name, key->name.len);
+	__bch2_str_hash_init(&ctx, type, info);
+	__bch2_str_hash_update(&ctx, type, &key->type, sizeof(key->type));
+	__bch2_str_hash_update(&ctx, type, key->name.name, key->name.len);
 
-	return bch2_str_hash_end(&ctx, info);
+	return __bch2_str_hash_end(&ctx, type);
+}
+
+static u64 bch2_xattr_hash(const struct bch_hash_info *info,
+			  const struct xattr_search_key *key)
+{
+	/* Dispatch on the hash type once, as in bch2_dirent_hash(): */
+	switch (info->type) {
+	case BCH_STR_HASH_crc32c:
+		return __bch2_xattr_hash(info, key, BCH_STR_HASH_crc32c);
+	case BCH_STR_HASH_siphash:
+		return __bch2_xattr_hash(info, key, BCH_STR_HASH_siphash);
+	default:
+		return __bch2_xattr_hash(info, key, info->type);
+	}
 }
 
 static u64 xattr_hash_key(const struct bch_hash_info *info, const void *key)
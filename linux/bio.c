@@ -265,6 +265,11 @@ again:
 	if (!bio_remaining_done(bio))
 		return;
 
+	if (bio->bi_submit_ns && bio->bi_bdev) {
+		bdev_latency_acct(bio);
+		bio->bi_submit_ns = 0;
+	}
+
 	/*
 	 * Need to have a real endio function for chained bios, otherwise
 	 * various corner cases will break (like stacking block devices that
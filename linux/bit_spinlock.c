@@ -0,0 +1,13 @@
+
+#include <linux/atomic.h>
+#include <linux/bit_spinlock.h>
+
+/*
+ * Hashed per-lock waiter counts, so bit_spin_unlock() can skip the
+ * FUTEX_WAKE syscall entirely when nobody is waiting - which is nearly
+ * always, now that contended lockers spin a while before sleeping.
+ *
+ * False sharing between unrelated locks that hash to the same slot only
+ * costs a spurious wake, never a lost one.
+ */
+atomic_t bit_spin_waiter_table[BIT_SPIN_WAITER_SLOTS];
@@ -2,7 +2,9 @@
 #include <alloca.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -10,6 +12,10 @@
 
 #include <libaio.h>
 
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
 #ifdef CONFIG_VALGRIND
 #include <valgrind/memcheck.h>
 #endif
@@ -18,6 +24,8 @@
 #include <linux/blkdev.h>
 #include <linux/completion.h>
 #include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/jiffies.h>
 #include <linux/kthread.h>
 
 #include "tools-util.h"
@@ -27,37 +35,18 @@ struct fops {
 	void (*cleanup)(void);
 	void (*read)(struct bio *bio, struct iovec * iov, unsigned i);
 	void (*write)(struct bio *bio, struct iovec * iov, unsigned i);
+	void (*submit_batch)(struct bio *bios);
 };
 
 static struct fops *fops;
-static io_context_t aio_ctx;
 static atomic_t running_requests;
 
-void generic_make_request(struct bio *bio)
+static unsigned bio_to_iov(struct bio *bio, struct iovec *iov)
 {
-	struct iovec *iov;
 	struct bvec_iter iter;
 	struct bio_vec bv;
-	ssize_t ret;
-	unsigned i;
+	unsigned i = 0;
 
-	if (bio->bi_opf & REQ_PREFLUSH) {
-		ret = fdatasync(bio->bi_bdev->bd_fd);
-		if (ret) {
-			fprintf(stderr, "fsync error: %m\n");
-			bio->bi_status = BLK_STS_IOERR;
-			bio_endio(bio);
-			return;
-		}
-	}
-
-	i = 0;
-	bio_for_each_segment(bv, bio, iter)
-		i++;
-
-	iov = alloca(sizeof(*iov) * i);
-
-	i = 0;
 	bio_for_each_segment(bv, bio, iter) {
 		void *start = page_address(bv.bv_page) + bv.bv_offset;
 		size_t len = bv.bv_len;
@@ -74,6 +63,101 @@ void generic_make_request(struct bio *bio)
 #endif
 	}
 
+	return i;
+}
+
+/*
+ * Per-device IO latency, an ewma of bio completion times: the fs-level
+ * tracking in bch2_latency_acct() only sees extent and btree node IO, and
+ * starts out empty every time a tool runs - this sees every bio, including
+ * the superblock and journal reads done at open time, so replica scoring has
+ * something to go on from the first read.
+ */
+void bdev_latency_acct(struct bio *bio)
+{
+	struct block_device *bdev = bio->bi_bdev;
+	atomic64_t *latency = &bdev->bd_io_latency[bio_data_dir(bio)];
+	u64 now = local_clock();
+	u64 io_latency = time_after64(now, bio->bi_submit_ns)
+		? now - bio->bi_submit_ns
+		: 0;
+	u64 old = atomic64_read(latency);
+
+	/* Racing updates just lose a term - not worth a cmpxchg loop: */
+	atomic64_set(latency, old
+		     ? old - (old >> 3) + (io_latency >> 3)
+		     : io_latency);
+
+	/*
+	 * Error ewma with the same decay, in fixed point so a device that
+	 * fails every IO converges to BDEV_ERROR_SCORE_MAX:
+	 */
+	bool failed = bio->bi_status != BLK_STS_OK;
+	u64 old_err = atomic64_read(&bdev->bd_io_errors);
+
+	atomic64_set(&bdev->bd_io_errors,
+		     old_err - (old_err >> 3) +
+		     (failed ? BDEV_ERROR_SCORE_MAX >> 3 : 0));
+
+	if (failed)
+		atomic64_inc(&bdev->bd_io_errors_seq);
+	else
+		atomic64_set(&bdev->bd_io_errors_seq, 0);
+}
+
+#define BDEV_FAST_FAIL_THRESHOLD	16
+#define BDEV_FAST_FAIL_PROBE		32
+
+/*
+ * Fast-fail: once a device has returned enough consecutive errors, complete
+ * further reads immediately with an error instead of waiting out another
+ * device timeout - the read path fails over to the next replica. Every
+ * BDEV_FAST_FAIL_PROBE'th read is still issued so a device that comes back
+ * is noticed; writes are always issued.
+ */
+static bool bdev_fast_fail(struct bio *bio)
+{
+	struct block_device *bdev = bio->bi_bdev;
+
+	if (bio_op(bio) != REQ_OP_READ)
+		return false;
+
+	if (atomic64_read(&bdev->bd_io_errors_seq) < BDEV_FAST_FAIL_THRESHOLD)
+		return false;
+
+	return atomic64_inc_return(&bdev->bd_io_fastfailed) %
+		BDEV_FAST_FAIL_PROBE != 0;
+}
+
+static void bio_submit_one(struct bio *bio)
+{
+	struct iovec *iov;
+	ssize_t ret;
+	unsigned i;
+
+	if (bdev_fast_fail(bio)) {
+		/* Synthetic completion: don't feed the latency ewma: */
+		bio->bi_submit_ns = 0;
+		bio->bi_status = BLK_STS_IOERR;
+		bio_endio(bio);
+		return;
+	}
+
+	bio->bi_submit_ns = local_clock();
+
+	if (bio->bi_opf & REQ_PREFLUSH) {
+		ret = fdatasync(bio->bi_bdev->bd_fd);
+		if (ret) {
+			fprintf(stderr, "fsync error: %m\n");
+			bio->bi_status = BLK_STS_IOERR;
+			bio_endio(bio);
+			return;
+		}
+	}
+
+	iov = alloca(sizeof(*iov) * bio_segments(bio));
+	i = bio_to_iov(bio, iov);
+
 	switch (bio_op(bio)) {
 	case REQ_OP_READ:
 		fops->read(bio, iov, i);
@@ -92,6 +176,428 @@ void generic_make_request(struct bio *bio)
 	}
 }
 
+/*
+ * Aligned buffer pool: block devices are opened O_DIRECT by default so bulk
+ * tool I/O doesn't evict the host's page cache, but callers pass arbitrary
+ * heap buffers at byte granularity. Misaligned transfers bounce through a
+ * small pool of reusable aligned buffers instead of forcing the whole fd
+ * back to buffered mode.
+ */
+
+#define ALIGNED_BUF_POOL_SIZE	8
+#define ALIGNED_BUF_ALIGN	4096U
+
+static struct {
+	void		*buf;
+	size_t		size;
+	bool		in_use;
+} aligned_buf_pool[ALIGNED_BUF_POOL_SIZE];
+static pthread_mutex_t aligned_buf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *bdev_aligned_buf_get(size_t size)
+{
+	void *buf = NULL;
+	unsigned i;
+
+	size = round_up(size, ALIGNED_BUF_ALIGN);
+
+	pthread_mutex_lock(&aligned_buf_lock);
+	for (i = 0; i < ALIGNED_BUF_POOL_SIZE; i++)
+		if (aligned_buf_pool[i].buf &&
+		    !aligned_buf_pool[i].in_use &&
+		    aligned_buf_pool[i].size >= size) {
+			aligned_buf_pool[i].in_use = true;
+			buf = aligned_buf_pool[i].buf;
+			break;
+		}
+
+	if (!buf)
+		for (i = 0; i < ALIGNED_BUF_POOL_SIZE; i++)
+			if (!aligned_buf_pool[i].buf) {
+				buf = aligned_alloc(ALIGNED_BUF_ALIGN, size);
+				if (buf) {
+					aligned_buf_pool[i].buf		= buf;
+					aligned_buf_pool[i].size	= size;
+					aligned_buf_pool[i].in_use	= true;
+				}
+				break;
+			}
+	pthread_mutex_unlock(&aligned_buf_lock);
+
+	/* Pool full, or every free buffer too small: unpooled allocation */
+	if (!buf)
+		buf = aligned_alloc(ALIGNED_BUF_ALIGN, size);
+	return buf;
+}
+
+void bdev_aligned_buf_put(void *buf)
+{
+	unsigned i;
+
+	if (!buf)
+		return;
+
+	pthread_mutex_lock(&aligned_buf_lock);
+	for (i = 0; i < ALIGNED_BUF_POOL_SIZE; i++)
+		if (aligned_buf_pool[i].buf == buf) {
+			aligned_buf_pool[i].in_use = false;
+			buf = NULL;
+			break;
+		}
+	pthread_mutex_unlock(&aligned_buf_lock);
+
+	free(buf);
+}
+
+static void aligned_buf_pool_exit(void)
+{
+	unsigned i;
+
+	for (i = 0; i < ALIGNED_BUF_POOL_SIZE; i++) {
+		BUG_ON(aligned_buf_pool[i].in_use);
+		free(aligned_buf_pool[i].buf);
+		aligned_buf_pool[i].buf = NULL;
+	}
+}
+
+/*
+ * mmap read path: inspection commands opt in with BLK_OPEN_MMAP, and reads
+ * are then served by copying from a shared read-only mapping of the whole
+ * device - repeated runs over the same image come straight from the page
+ * cache even though the fd itself is O_DIRECT. Writes drop the mapping
+ * permanently: O_DIRECT writes bypass the page cache, so it could go stale.
+ */
+
+static void bdev_mmap_init(struct block_device *bdev, blk_mode_t mode)
+{
+	struct stat st = xfstat(bdev->bd_fd);
+	u64 bytes = 0;
+
+	pthread_rwlock_init(&bdev->bd_mmap_lock, NULL);
+
+	if (!(mode & BLK_OPEN_MMAP))
+		return;
+
+	if (S_ISREG(st.st_mode))
+		bytes = st.st_size;
+	else if (S_ISBLK(st.st_mode) &&
+		 ioctl(bdev->bd_fd, BLKGETSIZE64, &bytes))
+		bytes = 0;
+
+	if (!bytes)
+		return;
+
+	void *m = mmap(NULL, bytes, PROT_READ, MAP_SHARED, bdev->bd_fd, 0);
+	if (m == MAP_FAILED)
+		return;
+
+	bdev->bd_mmap		= m;
+	bdev->bd_mmap_bytes	= bytes;
+}
+
+static void bdev_mmap_exit(struct block_device *bdev)
+{
+	if (bdev->bd_mmap) {
+		munmap(bdev->bd_mmap, bdev->bd_mmap_bytes);
+		bdev->bd_mmap = NULL;
+	}
+}
+
+static bool bdev_mmap_get(struct bio *bio)
+{
+	struct block_device *bdev = bio->bi_bdev;
+	u64 offset = bio->bi_iter.bi_sector << 9;
+	struct bvec_iter iter;
+	struct bio_vec bv;
+	bool ret = false;
+
+	if (!bdev->bd_mmap)
+		return false;
+
+	pthread_rwlock_rdlock(&bdev->bd_mmap_lock);
+
+	if (bdev->bd_mmap &&
+	    offset + bio->bi_iter.bi_size <= bdev->bd_mmap_bytes) {
+		bio_for_each_segment(bv, bio, iter) {
+			memcpy(page_address(bv.bv_page) + bv.bv_offset,
+			       bdev->bd_mmap + offset, bv.bv_len);
+			offset += bv.bv_len;
+		}
+		ret = true;
+	}
+
+	pthread_rwlock_unlock(&bdev->bd_mmap_lock);
+
+	if (ret)
+		bio_endio(bio);
+	return ret;
+}
+
+static void bdev_mmap_invalidate(struct bio *bio)
+{
+	struct block_device *bdev = bio->bi_bdev;
+
+	if (!bdev->bd_mmap)
+		return;
+
+	pthread_rwlock_wrlock(&bdev->bd_mmap_lock);
+	bdev_mmap_exit(bdev);
+	pthread_rwlock_unlock(&bdev->bd_mmap_lock);
+}
+
+/*
+ * Readahead: detect ascending-offset read streams per bdev and pull the next
+ * window in with a single large read, so sequential btree scans (dump,
+ * list_journal) aren't bound by one round trip per node. Reads that land in
+ * the cached window complete from memory.
+ */
+
+#define RA_WINDOW_BYTES		(8U << 20)
+#define RA_ALIGN		4096U
+#define RA_MIN_STREAK		4
+
+struct bdev_readahead {
+	pthread_mutex_t		lock;
+	sector_t		next_sector;	/* where a sequential stream would continue */
+	unsigned		streak;
+	u64			buf_offset;	/* byte offset of cached window */
+	u64			buf_bytes;	/* valid bytes in window */
+	void			*buf;
+};
+
+static void bdev_readahead_init(struct block_device *bdev)
+{
+	struct bdev_readahead *ra = xcalloc(1, sizeof(*ra));
+
+	pthread_mutex_init(&ra->lock, NULL);
+	bdev->bd_ra = ra;
+}
+
+static void bdev_readahead_exit(struct block_device *bdev)
+{
+	struct bdev_readahead *ra = bdev->bd_ra;
+
+	if (ra) {
+		free(ra->buf);
+		free(ra);
+	}
+}
+
+static void bdev_readahead_invalidate(struct bio *bio)
+{
+	struct bdev_readahead *ra = bio->bi_bdev->bd_ra;
+	u64 start = bio->bi_iter.bi_sector << 9;
+	u64 end = start + bio->bi_iter.bi_size;
+
+	if (!ra)
+		return;
+
+	pthread_mutex_lock(&ra->lock);
+	if (start < ra->buf_offset + ra->buf_bytes &&
+	    end > ra->buf_offset)
+		ra->buf_bytes = 0;
+	pthread_mutex_unlock(&ra->lock);
+}
+
+static void bdev_readahead_copy(struct bdev_readahead *ra, struct bio *bio)
+{
+	u64 offset = bio->bi_iter.bi_sector << 9;
+	struct bvec_iter iter;
+	struct bio_vec bv;
+
+	bio_for_each_segment(bv, bio, iter) {
+		memcpy(page_address(bv.bv_page) + bv.bv_offset,
+		       ra->buf + (offset - ra->buf_offset),
+		       bv.bv_len);
+		offset += bv.bv_len;
+	}
+}
+
+static bool bdev_readahead_get(struct bio *bio)
+{
+	struct bdev_readahead *ra = bio->bi_bdev->bd_ra;
+	u64 start = bio->bi_iter.bi_sector << 9;
+	u64 bytes = bio->bi_iter.bi_size;
+	bool ret = false;
+
+	if (!ra || !bytes)
+		return false;
+
+	pthread_mutex_lock(&ra->lock);
+
+	if (ra->buf_bytes &&
+	    start >= ra->buf_offset &&
+	    start + bytes <= ra->buf_offset + ra->buf_bytes) {
+		ret = true;
+		goto found;
+	}
+
+	if (bio->bi_iter.bi_sector == ra->next_sector)
+		ra->streak++;
+	else
+		ra->streak = 0;
+	ra->next_sector = bio->bi_iter.bi_sector + (bytes >> 9);
+
+	if (ra->streak < RA_MIN_STREAK)
+		goto out;
+
+	if (!ra->buf) {
+		ra->buf = aligned_alloc(RA_ALIGN, RA_WINDOW_BYTES);
+		if (!ra->buf)
+			goto out;
+	}
+
+	u64 window_start = round_down(start, RA_ALIGN);
+	u64 device_bytes = round_down(get_capacity(bio->bi_bdev->bd_disk) << 9,
+				      RA_ALIGN);
+	u64 window_bytes = min_t(u64, RA_WINDOW_BYTES,
+				 device_bytes - min(device_bytes, window_start));
+
+	if (start + bytes > window_start + window_bytes)
+		goto out;
+
+	ssize_t r = pread(bio->bi_bdev->bd_fd, ra->buf,
+			  window_bytes, window_start);
+	if (r < 0 || (u64) r < start + bytes - window_start) {
+		ra->buf_bytes	= 0;
+		ra->streak	= 0;
+		goto out;
+	}
+
+	ra->buf_offset	= window_start;
+	ra->buf_bytes	= r;
+	ret = true;
+found:
+	bdev_readahead_copy(ra, bio);
+out:
+	pthread_mutex_unlock(&ra->lock);
+
+	if (ret)
+		bio_endio(bio);
+	return ret;
+}
+
+/*
+ * Plugging: queue up bios submitted by this thread and hand them to the
+ * backend in one batch, so the storm of small btree node and journal reads
+ * issued during recovery doesn't pay one syscall per bio.
+ */
+
+static __thread struct blk_plug *current_plug;
+
+static void blk_flush_plug(struct blk_plug *plug)
+{
+	struct bio *bio = plug->bios;
+
+	plug->bios	= NULL;
+	plug->tail	= &plug->bios;
+	plug->nr	= 0;
+
+	if (!bio)
+		return;
+
+	if (fops->submit_batch) {
+		/*
+		 * Stamp and fast-fail filter the batch, as bio_submit_one()
+		 * does for individually submitted bios:
+		 */
+		struct bio *batch = NULL, **tail = &batch;
+
+		while (bio) {
+			struct bio *next = bio->bi_next;
+
+			bio->bi_next = NULL;
+
+			if (bdev_fast_fail(bio)) {
+				bio->bi_submit_ns = 0;
+				bio->bi_status = BLK_STS_IOERR;
+				bio_endio(bio);
+			} else {
+				bio->bi_submit_ns = local_clock();
+				*tail	= bio;
+				tail	= &bio->bi_next;
+			}
+			bio = next;
+		}
+
+		if (batch)
+			fops->submit_batch(batch);
+	} else {
+		while (bio) {
+			struct bio *next = bio->bi_next;
+
+			bio->bi_next = NULL;
+			bio_submit_one(bio);
+			bio = next;
+		}
+	}
+}
+
+void blk_start_plug(struct blk_plug *plug)
+{
+	plug->bios	= NULL;
+	plug->tail	= &plug->bios;
+	plug->nr	= 0;
+
+	if (!current_plug)
+		current_plug = plug;
+}
+
+void blk_finish_plug(struct blk_plug *plug)
+{
+	if (current_plug != plug)
+		return;
+
+	current_plug = NULL;
+	blk_flush_plug(plug);
+}
+
+/*
+ * Called from schedule(), like the kernel flushing current->plug when a task
+ * blocks: a thread waiting for IO it still has plugged (closure_sync or
+ * submit_bio_wait under an active plug) would otherwise deadlock.
+ */
+void blk_flush_current_plug(void)
+{
+	if (current_plug)
+		blk_flush_plug(current_plug);
+}
+
+void generic_make_request(struct bio *bio)
+{
+	struct blk_plug *plug = current_plug;
+
+	if (bio_op(bio) == REQ_OP_WRITE) {
+		bdev_mmap_invalidate(bio);
+		bdev_readahead_invalidate(bio);
+	}
+
+	if (bio_op(bio) == REQ_OP_READ &&
+	    (bdev_mmap_get(bio) ||
+	     bdev_readahead_get(bio)))
+		return;
+
+	/*
+	 * Only plain reads and writes are deferred: flushes carry ordering
+	 * requirements against previously submitted IO, and polled bios are
+	 * latency critical.
+	 */
+	if (plug &&
+	    (bio_op(bio) == REQ_OP_READ ||
+	     bio_op(bio) == REQ_OP_WRITE) &&
+	    !(bio->bi_opf & (REQ_PREFLUSH|REQ_POLLED))) {
+		bio->bi_next	= NULL;
+		*plug->tail	= bio;
+		plug->tail	= &bio->bi_next;
+
+		if (++plug->nr >= BLK_PLUG_MAX)
+			blk_flush_plug(plug);
+		return;
+	}
+
+	bio_submit_one(bio);
+}
+
 static void submit_bio_wait_endio(struct bio *bio)
 {
 	complete(bio->bi_private);
@@ -162,10 +668,17 @@ sector_t get_capacity(struct gendisk *disk)
 	return bytes >> 9;
 }
 
+static void bdev_readahead_init(struct block_device *);
+static void bdev_readahead_exit(struct block_device *);
+static void uring_file_unregister(int);
+
 void bdev_release(struct bdev_handle *handle)
 {
 	fdatasync(handle->bdev->bd_fd);
+	uring_file_unregister(handle->bdev->bd_fd);
 	close(handle->bdev->bd_fd);
+	bdev_readahead_exit(handle->bdev);
+	bdev_mmap_exit(handle->bdev);
 	free(handle->bdev);
 	free(handle);
 }
@@ -205,6 +718,9 @@ struct bdev_handle *bdev_open_by_path(const char *path, blk_mode_t mode,
 	bdev->bd_disk->bdi	= &bdev->bd_disk->__bdi;
 	bdev->queue.backing_dev_info = bdev->bd_disk->bdi;
 
+	bdev_readahead_init(bdev);
+	bdev_mmap_init(bdev, mode);
+
 	struct bdev_handle *handle = calloc(sizeof(*handle), 1);
 	handle->bdev	= bdev;
 	handle->holder	= holder;
@@ -264,16 +780,43 @@ static void sync_write(struct bio *bio, struct iovec * iov, unsigned i)
 	sync_check(bio, ret);
 }
 
-static DECLARE_WAIT_QUEUE_HEAD(aio_events_completed);
+/*
+ * One aio context and completion thread per CPU (capped), with submitting
+ * threads hashed onto a queue: a single reaper thread can't keep up with a
+ * large array's worth of completions.
+ */
+
+#define AIO_MAX_QUEUES	32U
+
+struct aio_queue {
+	io_context_t		ctx;
+	struct task_struct	*task;
+	wait_queue_head_t	wait;
+};
+
+static struct aio_queue aio_queues[AIO_MAX_QUEUES];
+static unsigned nr_aio_queues;
+
+static __thread struct aio_queue *aio_cur_queue;
+
+static struct aio_queue *aio_queue(void)
+{
+	if (!aio_cur_queue)
+		aio_cur_queue = aio_queues +
+			(hash_long((unsigned long) pthread_self(), 32) %
+			 nr_aio_queues);
+	return aio_cur_queue;
+}
 
 static int aio_completion_thread(void *arg)
 {
+	struct aio_queue *q = arg;
 	struct io_event events[8], *ev;
 	int ret;
 	bool stop = false;
 
 	while (!stop) {
-		ret = io_getevents(aio_ctx, 1, ARRAY_SIZE(events),
+		ret = io_getevents(q->ctx, 1, ARRAY_SIZE(events),
 				   events, NULL);
 
 		if (ret < 0 && ret == -EINTR)
@@ -281,7 +824,7 @@ static int aio_completion_thread(void *arg)
 		if (ret < 0)
 			die("io_getevents() error: %s", strerror(-ret));
 		if (ret)
-			wake_up(&aio_events_completed);
+			wake_up(&q->wait);
 
 		for (ev = events; ev < events + ret; ev++) {
 			struct bio *bio = (struct bio *) ev->data;
@@ -304,54 +847,65 @@ static int aio_completion_thread(void *arg)
 	return 0;
 }
 
-static struct task_struct *aio_task = NULL;
-
 static void aio_init(void)
 {
-	struct task_struct *p;
-	long err = io_setup(256, &aio_ctx);
-	if (!err) {
-		p = kthread_run(aio_completion_thread, NULL, "aio_completion");
-		BUG_ON(IS_ERR(p));
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned i;
 
-		aio_task = p;
+	nr_aio_queues = clamp_t(long, nr_cpus, 1, AIO_MAX_QUEUES);
 
-	} else if (err == -ENOSYS) {
-		io_fallback();
-	} else {
-		die("io_setup() error: %s", strerror(err));
+	for (i = 0; i < nr_aio_queues; i++) {
+		struct aio_queue *q = aio_queues + i;
+		long err = io_setup(256, &q->ctx);
+
+		if (err == -ENOSYS && !i) {
+			io_fallback();
+			return;
+		} else if (err) {
+			die("io_setup() error: %s", strerror(-err));
+		}
+
+		init_waitqueue_head(&q->wait);
+
+		q->task = kthread_run(aio_completion_thread, q,
+				      "aio_completion/%u", i);
+		BUG_ON(IS_ERR(q->task));
 	}
 }
 
 static void aio_cleanup(void)
 {
-	struct task_struct *p = NULL;
-	swap(aio_task, p);
-	get_task_struct(p);
-
 	/* I mean, really?! IO_CMD_NOOP is even defined, but not implemented. */
 	int fds[2];
 	int ret = pipe(fds);
 	if (ret != 0)
 		die("pipe err: %s", strerror(ret));
 
-	/* Wake up the completion thread with spurious work. */
-	int junk = 0;
-	struct iocb iocb = {
-		.aio_lio_opcode = IO_CMD_PWRITE,
-		.data = NULL, /* Signal to stop */
-		.aio_fildes = fds[1],
-		.u.c.buf = &junk,
-		.u.c.nbytes = 1,
-	}, *iocbp = &iocb;
-	ret = io_submit(aio_ctx, 1, &iocbp);
-	if (ret != 1)
-		die("io_submit cleanup err: %s", strerror(-ret));
-
-	ret = kthread_stop(p);
-	BUG_ON(ret);
-
-	put_task_struct(p);
+	for (unsigned i = 0; i < nr_aio_queues; i++) {
+		struct aio_queue *q = aio_queues + i;
+		struct task_struct *p = NULL;
+
+		swap(q->task, p);
+		get_task_struct(p);
+
+		/* Wake up the completion thread with spurious work. */
+		int junk = 0;
+		struct iocb iocb = {
+			.aio_lio_opcode = IO_CMD_PWRITE,
+			.data = NULL, /* Signal to stop */
+			.aio_fildes = fds[1],
+			.u.c.buf = &junk,
+			.u.c.nbytes = 1,
+		}, *iocbp = &iocb;
+		ret = io_submit(q->ctx, 1, &iocbp);
+		if (ret != 1)
+			die("io_submit cleanup err: %s", strerror(-ret));
+
+		ret = kthread_stop(p);
+		BUG_ON(ret);
+
+		put_task_struct(p);
+	}
 
 	close(fds[0]);
 	close(fds[1]);
@@ -359,6 +913,7 @@ static void aio_cleanup(void)
 
 static void aio_op(struct bio *bio, struct iovec *iov, unsigned i, int opcode)
 {
+	struct aio_queue *q = aio_queue();
 	ssize_t ret;
 	struct iocb iocb = {
 		.data		= bio,
@@ -373,8 +928,8 @@ static void aio_op(struct bio *bio, struct iovec *iov, unsigned i, int opcode)
 
 	atomic_inc(&running_requests);
 
-	wait_event(aio_events_completed,
-		   (ret = io_submit(aio_ctx, 1, &iocbp)) != -EAGAIN);;
+	wait_event(q->wait,
+		   (ret = io_submit(q->ctx, 1, &iocbp)) != -EAGAIN);;
 
 	if (ret != 1)
 		die("io_submit err: %s", strerror(-ret));
@@ -390,20 +945,377 @@ static void aio_write(struct bio *bio, struct iovec * iov, unsigned i)
 	aio_op(bio, iov, i, IO_CMD_PWRITEV);
 }
 
+static void aio_submit_batch(struct bio *bios)
+{
+	struct aio_queue *q = aio_queue();
+	struct bio *bio;
+	unsigned nr = 0, nr_vecs = 0, i, v;
+	ssize_t ret;
+
+	for (bio = bios; bio; bio = bio->bi_next) {
+		nr++;
+		nr_vecs += bio_segments(bio);
+	}
+
+	struct iocb *iocbs	= xmalloc(sizeof(*iocbs) * nr);
+	struct iocb **iocbps	= xmalloc(sizeof(*iocbps) * nr);
+	struct iovec *iovs	= xmalloc(sizeof(*iovs) * nr_vecs);
+
+	i = v = 0;
+	bio = bios;
+	while (bio) {
+		struct bio *next = bio->bi_next;
+		struct iovec *iov = iovs + v;
+		unsigned n = bio_to_iov(bio, iov);
+
+		bio->bi_next = NULL;
+		v += n;
+
+		iocbs[i] = (struct iocb) {
+			.data		= bio,
+			.aio_fildes	= bio->bi_bdev->bd_fd,
+			.aio_rw_flags	= bio->bi_opf & REQ_FUA ? RWF_SYNC : 0,
+			.aio_lio_opcode	= bio_op(bio) == REQ_OP_WRITE
+					? IO_CMD_PWRITEV : IO_CMD_PREADV,
+			.u.c.buf	= iov,
+			.u.c.nbytes	= n,
+			.u.c.offset	= bio->bi_iter.bi_sector << 9,
+		};
+		iocbps[i] = &iocbs[i];
+		i++;
+		bio = next;
+	}
+
+	atomic_add(nr, &running_requests);
+
+	i = 0;
+	while (i < nr) {
+		wait_event(q->wait,
+			   (ret = io_submit(q->ctx, nr - i, iocbps + i)) != -EAGAIN);
+		if (ret < 0)
+			die("io_submit err: %s", strerror(-ret));
+		i += ret;
+	}
+
+	free(iovs);
+	free(iocbps);
+	free(iocbs);
+}
+
+#ifdef HAVE_LIBURING
+
+/*
+ * io_uring backend: a single ring shared by all devices, with the sqe side
+ * serialized by a mutex (many threads submit bios concurrently) and a
+ * dedicated completion thread reaping cqes, mirroring the aio backend.
+ *
+ * Files are registered with the ring as bdevs are first used, so the kernel
+ * skips the per-io fget/fput. Fixed buffers aren't used: bios point into
+ * arbitrary pages, not preregistered ones.
+ */
+
+#define URING_ENTRIES		256
+#define URING_MAX_FILES		64
+
+static struct io_uring uring;
+static pthread_mutex_t uring_submit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Optional second ring set up with IORING_SETUP_IOPOLL, for REQ_POLLED bios:
+ * completions are polled for instead of interrupt driven, shaving the irq
+ * latency off latency-critical metadata reads. Requires O_DIRECT fds, which
+ * is how we open block devices anyways.
+ */
+static struct io_uring uring_poll;
+static pthread_mutex_t uring_poll_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool uring_poll_enabled;
+static int uring_registered_fds[URING_MAX_FILES];
+static unsigned uring_nr_registered;
+static bool uring_have_file_table;
+
+static int uring_file_index(int fd)
+{
+	int slot = -1;
+	unsigned i;
+
+	if (!uring_have_file_table)
+		return -1;
 
-/* not implemented */
-static void uring_init(void) {
+	for (i = 0; i < uring_nr_registered; i++) {
+		if (uring_registered_fds[i] == fd)
+			return i;
+		if (uring_registered_fds[i] == -1)
+			slot = i;
+	}
+
+	if (slot < 0) {
+		if (uring_nr_registered == URING_MAX_FILES)
+			return -1;
+		slot = uring_nr_registered;
+	}
+
+	if (io_uring_register_files_update(&uring, slot, &fd, 1) != 1)
+		return -1;
+
+	uring_registered_fds[slot] = fd;
+	if ((unsigned) slot == uring_nr_registered)
+		uring_nr_registered++;
+	return slot;
+}
+
+/*
+ * Called on bdev_release(): while registered the ring holds a ref on the
+ * struct file, and fd numbers get reused - a stale entry would direct
+ * fixed-file io for a newly opened device at the released one:
+ */
+static void uring_file_unregister(int fd)
+{
+	int invalid_fd = -1;
+	unsigned i;
+
+	if (!uring_have_file_table)
+		return;
+
+	pthread_mutex_lock(&uring_submit_lock);
+	for (i = 0; i < uring_nr_registered; i++)
+		if (uring_registered_fds[i] == fd) {
+			io_uring_register_files_update(&uring, i, &invalid_fd, 1);
+			uring_registered_fds[i] = -1;
+			break;
+		}
+	pthread_mutex_unlock(&uring_submit_lock);
+}
+
+static int uring_completion_thread(void *arg)
+{
+	struct io_uring *ring = arg;
+	struct io_uring_cqe *cqe;
+	struct bio *bio;
+	int ret;
+
+	while (1) {
+		ret = io_uring_wait_cqe(ring, &cqe);
+		if (ret == -EINTR)
+			continue;
+		if (ret)
+			die("io_uring_wait_cqe() error: %s", strerror(-ret));
+
+		bio = io_uring_cqe_get_data(cqe);
+
+		/* This should only happen during blkdev_cleanup() */
+		if (!bio) {
+			BUG_ON(atomic_read(&running_requests) != 0);
+			io_uring_cqe_seen(ring, cqe);
+			break;
+		}
+
+		if (cqe->res != (int) bio->bi_iter.bi_size)
+			bio->bi_status = BLK_STS_IOERR;
+
+		io_uring_cqe_seen(ring, cqe);
+		bio_endio(bio);
+		atomic_dec(&running_requests);
+	}
+
+	return 0;
+}
+
+static struct task_struct *uring_task;
+static struct task_struct *uring_poll_task;
+
+static void uring_init(void)
+{
+	int ret = io_uring_queue_init(URING_ENTRIES, &uring, 0);
+	if (ret) {
+		io_fallback();
+		return;
+	}
+
+	/* Not fatal if unsupported, just take the fget/fput hit per io: */
+	uring_have_file_table =
+		!io_uring_register_files_sparse(&uring, URING_MAX_FILES);
+
+	uring_task = kthread_run(uring_completion_thread, &uring,
+				 "uring_completion");
+	BUG_ON(IS_ERR(uring_task));
+
+	uring_poll_enabled =
+		!io_uring_queue_init(URING_ENTRIES, &uring_poll,
+				     IORING_SETUP_IOPOLL);
+	if (uring_poll_enabled) {
+		uring_poll_task = kthread_run(uring_completion_thread,
+					      &uring_poll, "uring_poll");
+		BUG_ON(IS_ERR(uring_poll_task));
+	}
+}
+
+static void uring_stop_one(struct io_uring *ring, pthread_mutex_t *lock,
+			   struct task_struct **task)
+{
+	struct task_struct *p = NULL;
+	swap(*task, p);
+	get_task_struct(p);
+
+	pthread_mutex_lock(lock);
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+	BUG_ON(!sqe);
+	io_uring_prep_nop(sqe);
+	io_uring_sqe_set_data(sqe, NULL); /* Signal to stop */
+	io_uring_submit(ring);
+	pthread_mutex_unlock(lock);
+
+	int ret = kthread_stop(p);
+	BUG_ON(ret);
+
+	put_task_struct(p);
+
+	io_uring_queue_exit(ring);
+}
+
+static void uring_cleanup(void)
+{
+	if (uring_poll_enabled)
+		uring_stop_one(&uring_poll, &uring_poll_lock, &uring_poll_task);
+	uring_stop_one(&uring, &uring_submit_lock, &uring_task);
+}
+
+static void uring_prep_bio(struct io_uring_sqe *sqe, struct bio *bio,
+			   struct iovec *iov, unsigned i, bool fixed_files)
+{
+	int fd = bio->bi_bdev->bd_fd, idx;
+
+	if (bio_op(bio) == REQ_OP_WRITE)
+		io_uring_prep_writev(sqe, fd, iov, i,
+				     bio->bi_iter.bi_sector << 9);
+	else
+		io_uring_prep_readv(sqe, fd, iov, i,
+				    bio->bi_iter.bi_sector << 9);
+
+	idx = fixed_files ? uring_file_index(fd) : -1;
+	if (idx >= 0) {
+		sqe->fd = idx;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	}
+
+	if (bio->bi_opf & REQ_FUA)
+		sqe->rw_flags |= RWF_SYNC;
+
+	io_uring_sqe_set_data(sqe, bio);
+}
+
+static void uring_op(struct bio *bio, struct iovec *iov, unsigned i)
+{
+	bool polled = uring_poll_enabled && (bio->bi_opf & REQ_POLLED);
+	struct io_uring *ring	= polled ? &uring_poll : &uring;
+	pthread_mutex_t *lock	= polled ? &uring_poll_lock : &uring_submit_lock;
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	atomic_inc(&running_requests);
+
+	pthread_mutex_lock(lock);
+
+	while (!(sqe = io_uring_get_sqe(ring)))
+		io_uring_submit(ring);
+
+	uring_prep_bio(sqe, bio, iov, i, !polled);
+
+	do {
+		ret = io_uring_submit(ring);
+	} while (ret == -EINTR || ret == -EAGAIN);
+
+	pthread_mutex_unlock(lock);
+
+	if (ret < 0)
+		die("io_uring_submit err: %s", strerror(-ret));
+}
+
+static void uring_read(struct bio *bio, struct iovec *iov, unsigned i)
+{
+	uring_op(bio, iov, i);
+}
+
+static void uring_write(struct bio *bio, struct iovec *iov, unsigned i)
+{
+	uring_op(bio, iov, i);
+}
+
+static void uring_submit_batch(struct bio *bios)
+{
+	struct bio *bio;
+	unsigned nr = 0, nr_vecs = 0, v = 0;
+	int ret;
+
+	for (bio = bios; bio; bio = bio->bi_next) {
+		nr++;
+		nr_vecs += bio_segments(bio);
+	}
+
+	/*
+	 * The iovecs only need to live until io_uring_submit() returns -
+	 * readv/writev sqes import them at submission:
+	 */
+	struct iovec *iovs = xmalloc(sizeof(*iovs) * nr_vecs);
+
+	atomic_add(nr, &running_requests);
+
+	pthread_mutex_lock(&uring_submit_lock);
+
+	bio = bios;
+	while (bio) {
+		struct bio *next = bio->bi_next;
+		struct iovec *iov = iovs + v;
+		unsigned n = bio_to_iov(bio, iov);
+		struct io_uring_sqe *sqe;
+
+		bio->bi_next = NULL;
+		v += n;
+
+		while (!(sqe = io_uring_get_sqe(&uring)))
+			io_uring_submit(&uring);
+
+		uring_prep_bio(sqe, bio, iov, n, true);
+		bio = next;
+	}
+
+	do {
+		ret = io_uring_submit(&uring);
+	} while (ret == -EINTR || ret == -EAGAIN);
+
+	pthread_mutex_unlock(&uring_submit_lock);
+
+	if (ret < 0)
+		die("io_uring_submit err: %s", strerror(-ret));
+
+	free(iovs);
+}
+
+#else
+
+static void uring_init(void)
+{
 	io_fallback();
 }
 
+static void uring_file_unregister(int fd) {}
+
+#endif
+
 struct fops fops_list[] = {
 	{
 		.init		= uring_init,
+#ifdef HAVE_LIBURING
+		.cleanup	= uring_cleanup,
+		.read		= uring_read,
+		.write		= uring_write,
+		.submit_batch	= uring_submit_batch,
+#endif
 	}, {
 		.init		= aio_init,
 		.cleanup	= aio_cleanup,
 		.read		= aio_read,
 		.write		= aio_write,
+		.submit_batch	= aio_submit_batch,
 	}, {
 		.init		= sync_init,
 		.cleanup	= sync_cleanup,
@@ -425,4 +1337,5 @@ __attribute__((destructor(102)))
 static void blkdev_cleanup(void)
 {
 	fops->cleanup();
+	aligned_buf_pool_exit();
 }
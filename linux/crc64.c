@@ -33,14 +33,7 @@
 MODULE_DESCRIPTION("CRC64 calculations");
 MODULE_LICENSE("GPL v2");
 
-/**
- * crc64_be - Calculate bitwise big-endian ECMA-182 CRC64
- * @crc: seed value for computation. 0 or (u64)~0 for a new CRC calculation,
-	or the previous crc64 value if computing incrementally.
- * @p: pointer to buffer over which CRC64 is run
- * @len: length of buffer @p
- */
-u64 __pure crc64_be(u64 crc, const void *p, size_t len)
+static u64 crc64_be_default(u64 crc, const void *p, size_t len)
 {
 	size_t i, t;
 
@@ -53,4 +46,181 @@ u64 __pure crc64_be(u64 crc, const void *p, size_t len)
 
 	return crc;
 }
+
+#ifdef __x86_64__
+
+/*
+ * PCLMULQDQ folding implementation, following the approach of "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction" (Intel,
+ * 2009): 64 bytes are processed per iteration as four independent 128 bit
+ * streams, each folded forward by multiplying by x^512 mod P - all the fold
+ * constants are derived from the polynomial at startup, rather than pasted in
+ * as magic numbers.
+ */
+
+#include <immintrin.h>
+
+#define CRC64_POLY	0x42F0E1EBA9EA3693ULL	/* ECMA-182, sans x^64 */
+
+static struct {
+	u64	x512;	/* x^512 mod P */
+	u64	x576;
+	u64	x128;
+	u64	x192;
+	u64	mu;	/* floor(x^128 / P), sans the implicit x^64 */
+} crc64_consts;
+
+/* x^n mod P */
+static u64 crc64_xpow(unsigned n)
+{
+	u64 r = 1;
+
+	while (n--)
+		r = (r << 1) ^ ((r & (1ULL << 63)) ? CRC64_POLY : 0);
+	return r;
+}
+
+/* floor(x^128 / P): long division, P = x^64 + CRC64_POLY */
+static u64 crc64_barrett_mu(void)
+{
+	u64 q = 0, r = CRC64_POLY;
+	int i;
+
+	for (i = 63; i >= 0; i--)
+		if (r & (1ULL << 63)) {
+			q |= 1ULL << i;
+			r = (r << 1) ^ CRC64_POLY;
+		} else {
+			r <<= 1;
+		}
+	return q;
+}
+
+__attribute__((target("pclmul,sse4.1")))
+static u64 crc64_be_clmul(u64 crc, const void *p, size_t len)
+{
+	const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					  8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i k  = _mm_set_epi64x(crc64_consts.x576, crc64_consts.x512);
+	const __m128i kf = _mm_set_epi64x(crc64_consts.x192, crc64_consts.x128);
+	const __m128i *buf = p;
+	__m128i x0, x1, x2, x3, y;
+
+	x0 = _mm_shuffle_epi8(_mm_loadu_si128(buf + 0), swap);
+	x1 = _mm_shuffle_epi8(_mm_loadu_si128(buf + 1), swap);
+	x2 = _mm_shuffle_epi8(_mm_loadu_si128(buf + 2), swap);
+	x3 = _mm_shuffle_epi8(_mm_loadu_si128(buf + 3), swap);
+
+	/* seed contributes crc * x^(8*len); that's the top of the message: */
+	x0 = _mm_xor_si128(x0, _mm_set_epi64x(crc, 0));
+
+	buf += 4;
+	len -= 64;
+
+	while (len >= 64) {
+		/* fold A forward 512 bits: A_hi * x^576 + A_lo * x^512: */
+		y  = _mm_shuffle_epi8(_mm_loadu_si128(buf + 0), swap);
+		x0 = _mm_xor_si128(_mm_xor_si128(
+			_mm_clmulepi64_si128(x0, k, 0x11),
+			_mm_clmulepi64_si128(x0, k, 0x00)), y);
+		y  = _mm_shuffle_epi8(_mm_loadu_si128(buf + 1), swap);
+		x1 = _mm_xor_si128(_mm_xor_si128(
+			_mm_clmulepi64_si128(x1, k, 0x11),
+			_mm_clmulepi64_si128(x1, k, 0x00)), y);
+		y  = _mm_shuffle_epi8(_mm_loadu_si128(buf + 2), swap);
+		x2 = _mm_xor_si128(_mm_xor_si128(
+			_mm_clmulepi64_si128(x2, k, 0x11),
+			_mm_clmulepi64_si128(x2, k, 0x00)), y);
+		y  = _mm_shuffle_epi8(_mm_loadu_si128(buf + 3), swap);
+		x3 = _mm_xor_si128(_mm_xor_si128(
+			_mm_clmulepi64_si128(x3, k, 0x11),
+			_mm_clmulepi64_si128(x3, k, 0x00)), y);
+		buf += 4;
+		len -= 64;
+	}
+
+	/* fold the four streams down to one, 128 bits apart: */
+	x1 = _mm_xor_si128(x1, _mm_xor_si128(
+		_mm_clmulepi64_si128(x0, kf, 0x11),
+		_mm_clmulepi64_si128(x0, kf, 0x00)));
+	x2 = _mm_xor_si128(x2, _mm_xor_si128(
+		_mm_clmulepi64_si128(x1, kf, 0x11),
+		_mm_clmulepi64_si128(x1, kf, 0x00)));
+	x3 = _mm_xor_si128(x3, _mm_xor_si128(
+		_mm_clmulepi64_si128(x2, kf, 0x11),
+		_mm_clmulepi64_si128(x2, kf, 0x00)));
+
+	/*
+	 * Reduce the remaining 128 bit message value R to the crc,
+	 * R * x^64 mod P; first R * x^64 = R_hi * x^128 + R_lo * x^64:
+	 */
+	u64 r_hi = _mm_extract_epi64(x3, 1);
+	u64 r_lo = _mm_extract_epi64(x3, 0);
+
+	__m128i t = _mm_clmulepi64_si128(_mm_set_epi64x(0, r_hi),
+					 _mm_set_epi64x(0, crc64_consts.x128), 0x00);
+	t = _mm_xor_si128(t, _mm_set_epi64x(r_lo, 0));
+
+	/* then Barrett reduction of the 128 bit T, mu = x^64 + mu': */
+	u64 t_hi = _mm_extract_epi64(t, 1);
+	u64 t_lo = _mm_extract_epi64(t, 0);
+
+	__m128i qq = _mm_clmulepi64_si128(_mm_set_epi64x(0, t_hi),
+					  _mm_set_epi64x(0, crc64_consts.mu), 0x00);
+	u64 q = t_hi ^ _mm_extract_epi64(qq, 1);
+
+	/* crc = T ^ q * P, and q * x^64 doesn't touch the low 64 bits: */
+	__m128i qp = _mm_clmulepi64_si128(_mm_set_epi64x(0, q),
+					  _mm_set_epi64x(0, CRC64_POLY), 0x00);
+	return t_lo ^ _mm_extract_epi64(qp, 0);
+}
+
+static u64 crc64_be_pclmul(u64 crc, const void *p, size_t len)
+{
+	if (len >= 64) {
+		size_t chunk = len & ~63UL;
+
+		crc = crc64_be_clmul(crc, p, chunk);
+		p	+= chunk;
+		len	-= chunk;
+	}
+
+	return crc64_be_default(crc, p, len);
+}
+
+#endif /* __x86_64__ */
+
+static void *resolve_crc64_be(void)
+{
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1")) {
+		crc64_consts.x512	= crc64_xpow(512);
+		crc64_consts.x576	= crc64_xpow(576);
+		crc64_consts.x128	= crc64_xpow(128);
+		crc64_consts.x192	= crc64_xpow(192);
+		crc64_consts.mu		= crc64_barrett_mu();
+
+		return crc64_be_pclmul;
+	}
+#endif
+	return crc64_be_default;
+}
+
+/**
+ * crc64_be - Calculate bitwise big-endian ECMA-182 CRC64
+ * @crc: seed value for computation. 0 or (u64)~0 for a new CRC calculation,
+	or the previous crc64 value if computing incrementally.
+ * @p: pointer to buffer over which CRC64 is run
+ * @len: length of buffer @p
+ */
+u64 __pure crc64_be(u64 crc, const void *p, size_t len)
+{
+	static u64 (*real_crc64_be)(u64, const void *, size_t);
+
+	if (unlikely(!real_crc64_be))
+		real_crc64_be = resolve_crc64_be();
+
+	return real_crc64_be(crc, p, len);
+}
 EXPORT_SYMBOL_GPL(crc64_be);
@@ -77,6 +77,31 @@ void *__genradix_ptr(struct __genradix *radix, size_t offset)
 }
 EXPORT_SYMBOL(__genradix_ptr);
 
+/*
+ * As __genradix_ptr(), but satisfies lookups within the span of the last
+ * leaf accessed without walking the tree; only successful lookups are
+ * cached, so a miss on an unallocated index stays a miss:
+ */
+void *__genradix_ptr_cached(struct __genradix *radix,
+			    struct genradix_leaf_cache *cache,
+			    size_t offset)
+{
+	void *p;
+
+	if (cache->leaf &&
+	    offset - cache->base < PAGE_SIZE)
+		return cache->leaf + (offset - cache->base);
+
+	p = __genradix_ptr(radix, offset);
+	if (p) {
+		cache->base = offset & ~(size_t) (PAGE_SIZE - 1);
+		cache->leaf = p - (offset & (PAGE_SIZE - 1));
+	}
+
+	return p;
+}
+EXPORT_SYMBOL(__genradix_ptr_cached);
+
 static inline struct genradix_node *genradix_alloc_node(gfp_t gfp_mask)
 {
 	struct genradix_node *node;
@@ -213,6 +238,27 @@ restart:
 }
 EXPORT_SYMBOL(__genradix_iter_peek);
 
+/*
+ * As __genradix_iter_peek(), but also reports how many entries follow the
+ * returned one contiguously within the same leaf, so callers can sweep whole
+ * leaves as flat arrays instead of walking the tree per entry:
+ */
+void *__genradix_iter_peek_leaf(struct genradix_iter *iter,
+				struct __genradix *radix,
+				size_t objs_per_page,
+				size_t obj_size,
+				size_t *nr)
+{
+	void *p = __genradix_iter_peek(iter, radix, objs_per_page);
+
+	if (p)
+		*nr = objs_per_page -
+			(iter->offset & (PAGE_SIZE - 1)) / obj_size;
+
+	return p;
+}
+EXPORT_SYMBOL(__genradix_iter_peek_leaf);
+
 void *__genradix_iter_peek_prev(struct genradix_iter *iter,
 				struct __genradix *radix,
 				size_t objs_per_page,
@@ -512,13 +512,13 @@ EXPORT_SYMBOL(mempool_free_slab);
 void *mempool_kmalloc(gfp_t gfp_mask, void *pool_data)
 {
 	size_t size = (size_t)pool_data;
-	return kmalloc(size, gfp_mask);
+	return slab_size_alloc(size, gfp_mask);
 }
 EXPORT_SYMBOL(mempool_kmalloc);
 
 void mempool_kfree(void *element, void *pool_data)
 {
-	kfree(element);
+	slab_size_free(element, (size_t) pool_data);
 }
 EXPORT_SYMBOL(mempool_kfree);
 
@@ -0,0 +1,51 @@
+
+#ifdef HAVE_LIBNUMA
+
+#include <numa.h>
+#include <stdlib.h>
+
+#include <linux/page.h>
+#include <linux/slab.h>
+
+/*
+ * NUMA placement for the allocator shim: large long-lived allocations that
+ * are shared between threads (btree node cache buffers) get interleaved
+ * across nodes so no socket eats all the cross-interconnect traffic, while
+ * small and per-thread allocations keep the default local (first touch)
+ * policy.
+ *
+ * Worker threads can optionally be pinned round robin across nodes by
+ * setting BCACHEFS_NUMA_PIN, which together with interleaving keeps the
+ * workqueue pool's accesses balanced on multi-socket fsck hosts.
+ */
+
+static int mem_numa_nodes(void)
+{
+	static int nr_nodes;
+
+	if (!nr_nodes)
+		nr_nodes = numa_available() < 0 ? 1 : numa_max_node() + 1;
+
+	return nr_nodes;
+}
+
+void mem_numa_interleave(void *p, size_t size)
+{
+	if (mem_numa_nodes() <= 1)
+		return;
+
+	numa_interleave_memory(p, round_up(size, PAGE_SIZE),
+			       numa_all_nodes_ptr);
+}
+
+void mem_numa_pin_thread(unsigned idx)
+{
+	int nr_nodes = mem_numa_nodes();
+
+	if (nr_nodes <= 1 || !getenv("BCACHEFS_NUMA_PIN"))
+		return;
+
+	numa_run_on_node(idx % nr_nodes);
+}
+
+#endif /* HAVE_LIBNUMA */
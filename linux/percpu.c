@@ -0,0 +1,160 @@
+/*
+ * Per thread backing for the kernel percpu API: a reserved virtual region of
+ * identically laid out arenas, one per thread slot. Allocations are carved
+ * from slot 0's arena by a simple first-fit allocator; the same offset in
+ * every other arena belongs to the same allocation, so per_cpu_ptr() is just
+ * a constant-stride shift. The region is mapped MAP_NORESERVE - untouched
+ * arenas cost address space, not memory.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <linux/cache.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+
+#define PERCPU_MAX_SLOTS	256
+
+static pthread_mutex_t	percpu_lock = PTHREAD_MUTEX_INITIALIZER;
+static char		*percpu_region;
+
+struct percpu_alloc {
+	struct percpu_alloc	*next;
+	size_t			offset;
+	size_t			size;
+	bool			in_use;
+};
+
+static struct percpu_alloc	*percpu_allocs;
+static size_t			percpu_used;
+
+/* slot 0 is claimed by the first thread to touch percpu data: */
+unsigned		__percpu_nr_slots;
+
+static __thread int	percpu_thread_slot = -1;
+static unsigned		percpu_slot_freelist[PERCPU_MAX_SLOTS];
+static unsigned		percpu_slot_freelist_nr;
+static unsigned		percpu_slot_overflow;
+static pthread_key_t	percpu_slot_key;
+static pthread_once_t	percpu_slot_once = PTHREAD_ONCE_INIT;
+
+static void percpu_region_init(void)
+{
+	if (percpu_region)
+		return;
+
+	percpu_region = mmap(NULL, PERCPU_MAX_SLOTS * PERCPU_ARENA_SIZE,
+			     PROT_READ|PROT_WRITE,
+			     MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	BUG_ON(percpu_region == MAP_FAILED);
+}
+
+void *__alloc_percpu(size_t size, size_t align)
+{
+	struct percpu_alloc *a;
+
+	/* allocations on their own cachelines, or they'd bounce anyway: */
+	align = max_t(size_t, align, SMP_CACHE_BYTES);
+	size = round_up(size, align);
+
+	pthread_mutex_lock(&percpu_lock);
+	percpu_region_init();
+
+	for (a = percpu_allocs; a; a = a->next)
+		if (!a->in_use && a->size == size)
+			break;
+
+	if (a) {
+		/*
+		 * Reused allocations must read back as zeroes in every slot;
+		 * arenas past the high water mark are still untouched:
+		 */
+		for (unsigned i = 0; i < __percpu_nr_slots; i++)
+			memset(percpu_region + i * PERCPU_ARENA_SIZE + a->offset,
+			       0, a->size);
+	} else {
+		a = malloc(sizeof(*a));
+		BUG_ON(!a);
+		a->offset	= round_up(percpu_used, align);
+		a->size		= size;
+		a->next		= percpu_allocs;
+		percpu_used	= a->offset + size;
+		BUG_ON(percpu_used > PERCPU_ARENA_SIZE);
+		percpu_allocs	= a;
+	}
+
+	a->in_use = true;
+	pthread_mutex_unlock(&percpu_lock);
+
+	return percpu_region + a->offset;
+}
+
+void free_percpu(void __percpu *p)
+{
+	struct percpu_alloc *a;
+
+	if (!p)
+		return;
+
+	pthread_mutex_lock(&percpu_lock);
+	for (a = percpu_allocs; a; a = a->next)
+		if (a->in_use &&
+		    a->offset == (size_t) ((char *) p - percpu_region)) {
+			a->in_use = false;
+			break;
+		}
+	BUG_ON(!a);
+	pthread_mutex_unlock(&percpu_lock);
+}
+
+/*
+ * Slots are released at thread exit and recycled, so the slot count tracks
+ * the concurrent thread high water mark, not total threads created. Counters
+ * accumulated by an exited thread stay in its old slot, where summing reads
+ * still see them; its successor just inherits them, as a cpu would.
+ */
+static void percpu_slot_exit(void *p)
+{
+	pthread_mutex_lock(&percpu_lock);
+	percpu_slot_freelist[percpu_slot_freelist_nr++] =
+		(unsigned) (unsigned long) p - 1;
+	pthread_mutex_unlock(&percpu_lock);
+}
+
+static void percpu_slot_key_init(void)
+{
+	BUG_ON(pthread_key_create(&percpu_slot_key, percpu_slot_exit));
+}
+
+unsigned __percpu_slot(void)
+{
+	if (unlikely(percpu_thread_slot < 0)) {
+		unsigned slot;
+
+		pthread_once(&percpu_slot_once, percpu_slot_key_init);
+
+		pthread_mutex_lock(&percpu_lock);
+		if (percpu_slot_freelist_nr)
+			slot = percpu_slot_freelist[--percpu_slot_freelist_nr];
+		else if (__percpu_nr_slots < PERCPU_MAX_SLOTS)
+			slot = __percpu_nr_slots++;
+		else
+			/*
+			 * More live threads than slots; share them round
+			 * robin. this_cpu ops lose their exclusivity, but
+			 * nothing here runs anywhere near this many threads:
+			 */
+			slot = percpu_slot_overflow++ % PERCPU_MAX_SLOTS;
+		pthread_mutex_unlock(&percpu_lock);
+
+		percpu_thread_slot = slot;
+		pthread_setspecific(percpu_slot_key,
+				    (void *) (unsigned long) (slot + 1));
+	}
+
+	return percpu_thread_slot;
+}
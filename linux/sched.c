@@ -8,6 +8,8 @@
 #define CONFIG_RCU_HAVE_FUTEX 1
 #include <urcu/futex.h>
 
+#include <linux/slab.h>
+#include <linux/blkdev.h>
 #include <linux/rcupdate.h>
 #include <linux/sched.h>
 #include <linux/timer.h>
@@ -35,6 +37,7 @@ void schedule(void)
 {
 	int v;
 
+	blk_flush_current_plug();
 	rcu_quiescent_state();
 
 	while ((v = READ_ONCE(current->state)) != TASK_RUNNING)
@@ -1,7 +1,13 @@
 
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
 #include <linux/kthread.h>
 #include <linux/list.h>
 #include <linux/mm.h>
@@ -13,6 +19,19 @@
 static LIST_HEAD(shrinker_list);
 static DEFINE_MUTEX(shrinker_lock);
 
+/*
+ * Byte budget for everything behind the shrinkers - principally the btree node
+ * cache. Kernel-side, caches grow until memory pressure; here we aim for a
+ * fixed budget so a big fsck run uses the host's memory instead of thrashing,
+ * without swapping the box.
+ *
+ * Defaults to half of physical memory; BCACHEFS_CACHE_BUDGET overrides
+ * (accepts k/M/G/T suffixes).
+ */
+static unsigned long cache_budget;
+
+static unsigned long nr_shrinker_runs;
+
 void shrinker_free(struct shrinker *s)
 {
 	if (s->list.next) {
@@ -20,12 +39,24 @@ void shrinker_free(struct shrinker *s)
 		list_del(&s->list);
 		mutex_unlock(&shrinker_lock);
 	}
+	free(s->name);
 	free(s);
 }
 
 struct shrinker *shrinker_alloc(unsigned int flags, const char *fmt, ...)
 {
-	return calloc(sizeof(struct shrinker), 1);
+	struct shrinker *s = calloc(sizeof(struct shrinker), 1);
+	va_list args;
+
+	if (!s)
+		return NULL;
+
+	va_start(args, fmt);
+	if (vasprintf(&s->name, fmt, args) < 0)
+		s->name = NULL;
+	va_end(args);
+
+	return s;
 }
 
 int shrinker_register(struct shrinker *shrinker)
@@ -36,6 +67,20 @@ int shrinker_register(struct shrinker *shrinker)
 	return 0;
 }
 
+static unsigned long process_rss(void)
+{
+	unsigned long size = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+
+	return resident * PAGE_SIZE;
+}
+
 static void run_shrinkers_allocation_failed(gfp_t gfp_mask)
 {
 	struct shrinker *shrinker;
@@ -48,14 +93,59 @@ static void run_shrinkers_allocation_failed(gfp_t gfp_mask)
 
 		sc.nr_to_scan = have / 8;
 
+		shrinker->nr_scan_requested += sc.nr_to_scan;
 		shrinker->scan_objects(shrinker, &sc);
 	}
 	mutex_unlock(&shrinker_lock);
 }
 
-void run_shrinkers(gfp_t gfp_mask, bool allocation_failed)
+/*
+ * Distribute the shrink target across shrinkers in proportion to how much
+ * they're caching, weighted down by @seeks - the cost of recreating an object
+ * - instead of asking every shrinker for the full amount, which over-shrinks
+ * as soon as there's more than one.
+ *
+ * Objects are approximated as pages, as run_shrinkers() always has.
+ */
+static void run_shrinkers_scaled(gfp_t gfp_mask, unsigned long want_shrink)
 {
 	struct shrinker *shrinker;
+	unsigned long total_weight = 0;
+
+	list_for_each_entry(shrinker, &shrinker_list, list) {
+		struct shrink_control sc = { .gfp_mask	= gfp_mask, };
+
+		unsigned long count = shrinker->count_objects(shrinker, &sc);
+		if (count == SHRINK_STOP)
+			count = 0;
+
+		shrinker->last_count = count;
+		total_weight += count / (shrinker->seeks ?: 2);
+	}
+
+	if (!total_weight)
+		return;
+
+	list_for_each_entry(shrinker, &shrinker_list, list) {
+		unsigned long weight = shrinker->last_count / (shrinker->seeks ?: 2);
+		struct shrink_control sc = {
+			.gfp_mask	= gfp_mask,
+			.nr_to_scan	= (want_shrink >> PAGE_SHIFT) * weight / total_weight,
+		};
+
+		if (!sc.nr_to_scan)
+			continue;
+
+		shrinker->nr_scan_requested += sc.nr_to_scan;
+
+		unsigned long freed = shrinker->scan_objects(shrinker, &sc);
+		if (freed != SHRINK_STOP)
+			shrinker->nr_freed += freed;
+	}
+}
+
+void run_shrinkers(gfp_t gfp_mask, bool allocation_failed)
+{
 	struct sysinfo info;
 	s64 want_shrink;
 
@@ -76,19 +166,35 @@ void run_shrinkers(gfp_t gfp_mask, bool allocation_failed)
 	/* Aim for 6% of physical RAM free without anything in swap */
 	want_shrink = (info.totalram >> 4) - info.freeram
 			+ info.totalswap - info.freeswap;
+
+	/* And stay under the cache budget: */
+	want_shrink = max(want_shrink, (s64) (process_rss() - cache_budget));
 	if (want_shrink <= 0)
 		return;
 
+	nr_shrinker_runs++;
+
 	mutex_lock(&shrinker_lock);
-	list_for_each_entry(shrinker, &shrinker_list, list) {
-		struct shrink_control sc = {
-			.gfp_mask	= gfp_mask,
-			.nr_to_scan	= want_shrink >> PAGE_SHIFT
-		};
+	run_shrinkers_scaled(gfp_mask, want_shrink);
 
-		shrinker->scan_objects(shrinker, &sc);
-	}
+	/*
+	 * The caches keep accessed bits, so the first pass mostly just clears
+	 * them on hot objects and evicts cold ones - second-chance eviction.
+	 * If that didn't get us under budget, make one more pass for the
+	 * remainder; don't loop, since the allocator may hang onto freed
+	 * memory and RSS lags what we've actually released:
+	 */
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
+	unsigned long rss = process_rss();
+	if (rss > cache_budget)
+		run_shrinkers_scaled(gfp_mask, rss - cache_budget);
 	mutex_unlock(&shrinker_lock);
+
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
 }
 
 static int shrinker_thread(void *arg)
@@ -117,13 +223,58 @@ static int shrinker_thread(void *arg)
 
 struct task_struct *shrinker_task;
 
+static unsigned long parse_cache_budget(const char *s)
+{
+	char *end;
+	unsigned long v = strtoul(s, &end, 10);
+
+	switch (*end) {
+	case 't': case 'T':	v <<= 10;	fallthrough;
+	case 'g': case 'G':	v <<= 10;	fallthrough;
+	case 'm': case 'M':	v <<= 10;	fallthrough;
+	case 'k': case 'K':	v <<= 10;	break;
+	}
+
+	return v;
+}
+
 __attribute__((constructor(103)))
 static void shrinker_thread_init(void)
 {
+	struct sysinfo info;
+	char *budget = getenv("BCACHEFS_CACHE_BUDGET");
+
+	si_meminfo(&info);
+	cache_budget = info.totalram / 2;
+
+	if (budget)
+		cache_budget = parse_cache_budget(budget) ?: cache_budget;
+
 	shrinker_task = kthread_run(shrinker_thread, NULL, "shrinkers");
 	BUG_ON(IS_ERR(shrinker_task));
 }
 
+__attribute__((destructor(104)))
+static void shrinker_print_stats(void)
+{
+	struct shrinker *shrinker;
+
+	if (!getenv("BCACHEFS_SHRINKER_STATS"))
+		return;
+
+	fprintf(stderr, "shrinkers: budget %lu rss %lu runs %lu\n",
+		cache_budget, process_rss(), nr_shrinker_runs);
+
+	mutex_lock(&shrinker_lock);
+	list_for_each_entry(shrinker, &shrinker_list, list)
+		fprintf(stderr, "  %-32s count %lu scan requested %lu freed %lu\n",
+			shrinker->name ?: "(unnamed)",
+			shrinker->last_count,
+			shrinker->nr_scan_requested,
+			shrinker->nr_freed);
+	mutex_unlock(&shrinker_lock);
+}
+
 #if 0
 /*
  * We seem to be hitting a rare segfault when shutting down the shrinker thread.
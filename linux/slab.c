@@ -0,0 +1,164 @@
+
+#include <pthread.h>
+
+#include <linux/atomic.h>
+#include <linux/slab.h>
+
+/*
+ * Magazine-style frontend for kmem caches: each cache gets a slot in a
+ * per-thread table of small object stacks, so the hot alloc/free paths are a
+ * couple of loads with no locking and no trips into the glibc allocator.
+ *
+ * Objects stranded in a dead thread's magazines are returned via a pthread
+ * key destructor. Cache indices aren't reused after kmem_cache_destroy(), so
+ * a stale magazine entry can never be handed to a cache of a different size;
+ * caches created after the table fills up just fall through to kmalloc().
+ */
+
+struct slab_magazine {
+	unsigned		nr;
+	void			*objs[SLAB_MAGAZINE_SIZE];
+};
+
+static atomic_t slab_nr_caches;
+
+static __thread struct slab_magazine slab_magazines[SLAB_MAX_CACHES];
+static __thread bool slab_thread_registered;
+static pthread_key_t slab_exit_key;
+static pthread_once_t slab_exit_once = PTHREAD_ONCE_INIT;
+
+static void slab_thread_exit(void *arg)
+{
+	struct slab_magazine *mags = arg;
+
+	for (unsigned i = 0; i < SLAB_MAX_CACHES; i++)
+		while (mags[i].nr)
+			free(mags[i].objs[--mags[i].nr]);
+}
+
+static void slab_exit_key_init(void)
+{
+	pthread_key_create(&slab_exit_key, slab_thread_exit);
+}
+
+static struct slab_magazine *slab_magazine(unsigned idx)
+{
+	if (!slab_thread_registered) {
+		pthread_once(&slab_exit_once, slab_exit_key_init);
+		pthread_setspecific(slab_exit_key, slab_magazines);
+		slab_thread_registered = true;
+	}
+
+	return slab_magazines + idx;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *c, gfp_t gfp)
+{
+	if (c->idx < SLAB_MAX_CACHES) {
+		struct slab_magazine *m = slab_magazine(c->idx);
+
+		if (m->nr) {
+			void *p = m->objs[--m->nr];
+
+			if (gfp & __GFP_ZERO)
+				memset(p, 0, c->obj_size);
+			return p;
+		}
+	}
+
+	return kmalloc(c->obj_size, gfp);
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *p)
+{
+	if (!p)
+		return;
+
+	if (c->idx < SLAB_MAX_CACHES) {
+		struct slab_magazine *m = slab_magazine(c->idx);
+
+		if (m->nr < SLAB_MAGAZINE_SIZE) {
+			m->objs[m->nr++] = p;
+			return;
+		}
+	}
+
+	free(p);
+}
+
+static void kmem_cache_init(struct kmem_cache *c, size_t obj_size)
+{
+	unsigned idx = atomic_inc_return(&slab_nr_caches) - 1;
+
+	c->obj_size	= obj_size;
+	c->idx		= idx < SLAB_MAX_CACHES ? idx : -1U;
+}
+
+struct kmem_cache *kmem_cache_create(size_t obj_size)
+{
+	struct kmem_cache *c = malloc(sizeof(*c));
+
+	if (!c)
+		return NULL;
+
+	kmem_cache_init(c, obj_size);
+	return c;
+}
+
+void kmem_cache_destroy(struct kmem_cache *c)
+{
+	/*
+	 * Objects still sitting in other threads' magazines stay there - the
+	 * index is never reused, so they're simply returned when those
+	 * threads exit.
+	 */
+	free(c);
+}
+
+/*
+ * Power of two size classes for allocations that are freed with an explicit
+ * size (mempool_kmalloc() pools, bio/bvec allocations), so they get magazine
+ * caching too:
+ */
+
+#define SLAB_SIZE_CLASS_SHIFT_MIN	4U	/* 16 bytes */
+#define SLAB_SIZE_CLASS_SHIFT_MAX	14U	/* 16k */
+#define SLAB_NR_SIZE_CLASSES						\
+	(SLAB_SIZE_CLASS_SHIFT_MAX - SLAB_SIZE_CLASS_SHIFT_MIN + 1)
+
+static struct kmem_cache slab_size_caches[SLAB_NR_SIZE_CLASSES];
+
+__attribute__((constructor(101)))
+static void slab_size_caches_init(void)
+{
+	for (unsigned i = 0; i < SLAB_NR_SIZE_CLASSES; i++)
+		kmem_cache_init(&slab_size_caches[i],
+				1U << (i + SLAB_SIZE_CLASS_SHIFT_MIN));
+}
+
+static struct kmem_cache *slab_size_cache(size_t size)
+{
+	unsigned shift = max_t(unsigned, ilog2(roundup_pow_of_two(size)),
+			       SLAB_SIZE_CLASS_SHIFT_MIN);
+
+	return size && shift <= SLAB_SIZE_CLASS_SHIFT_MAX
+		? &slab_size_caches[shift - SLAB_SIZE_CLASS_SHIFT_MIN]
+		: NULL;
+}
+
+void *slab_size_alloc(size_t size, gfp_t gfp)
+{
+	struct kmem_cache *c = slab_size_cache(size);
+
+	return c ? kmem_cache_alloc(c, gfp) : kmalloc(size, gfp);
+}
+
+void slab_size_free(void *p, size_t size)
+{
+	struct kmem_cache *c = slab_size_cache(size);
+
+	if (c)
+		kmem_cache_free(c, p);
+	else
+		free(p);
+}
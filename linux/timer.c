@@ -3,6 +3,8 @@
 #include <signal.h>
 #include <time.h>
 
+#include <linux/cache.h>
+#include <linux/cpumask.h>
 #include <linux/kernel.h>
 #include <linux/kthread.h>
 #include <linux/timer.h>
@@ -23,151 +25,210 @@ static struct timespec timespec_add_ns(struct timespec a, u64 ns)
 	return a;
 }
 
-#define DECLARE_HEAP(type)						\
-struct {								\
-	size_t size, used;						\
-	type *data;							\
-}
+/*
+ * Hierarchical timer wheel: pending timers live on doubly linked bucket
+ * lists, where level l buckets span 64^l jiffies - so insert and remove are
+ * O(1) list operations, and the timer thread re-sorts a level l bucket into
+ * lower levels (a cascade) only once every 64^l jiffies.
+ *
+ * Arming a timer that isn't already pending doesn't take the timer lock at
+ * all: the timer is claimed with a cmpxchg on its state and pushed onto one
+ * of several lock free submission stacks, hashed by thread slot; the timer
+ * thread moves submissions into the wheel when it next wakes. Waking it
+ * early is only needed when the new timer expires before the thread's
+ * published wakeup time.
+ */
 
-#define heap_init(heap, _size)						\
-({									\
-	size_t _bytes;							\
-	(heap)->used = 0;						\
-	(heap)->size = (_size);						\
-	_bytes = (heap)->size * sizeof(*(heap)->data);			\
-	(heap)->data = malloc(_bytes);					\
-	(heap)->data;							\
-})
-
-#define heap_free(heap)							\
-do {									\
-	kvfree((heap)->data);						\
-	(heap)->data = NULL;						\
-} while (0)
-
-#define heap_swap(h, i, j)	swap((h)->data[i], (h)->data[j])
-
-#define heap_sift(h, i, cmp)						\
-do {									\
-	size_t _r, _j = i;						\
-									\
-	for (; _j * 2 + 1 < (h)->used; _j = _r) {			\
-		_r = _j * 2 + 1;					\
-		if (_r + 1 < (h)->used &&				\
-		    cmp((h)->data[_r], (h)->data[_r + 1]))		\
-			_r++;						\
-									\
-		if (cmp((h)->data[_r], (h)->data[_j]))			\
-			break;						\
-		heap_swap(h, _r, _j);					\
-	}								\
-} while (0)
-
-#define heap_sift_down(h, i, cmp)					\
-do {									\
-	while (i) {							\
-		size_t p = (i - 1) / 2;					\
-		if (cmp((h)->data[i], (h)->data[p]))			\
-			break;						\
-		heap_swap(h, i, p);					\
-		i = p;							\
-	}								\
-} while (0)
-
-#define heap_add(h, d, cmp)						\
-({									\
-	bool _r = !heap_full(h);					\
-	if (_r) {							\
-		size_t _i = (h)->used++;				\
-		(h)->data[_i] = d;					\
-									\
-		heap_sift_down(h, _i, cmp);				\
-		heap_sift(h, _i, cmp);					\
-	}								\
-	_r;								\
-})
-
-#define heap_del(h, i, cmp)						\
-do {									\
-	size_t _i = (i);						\
-									\
-	BUG_ON(_i >= (h)->used);					\
-	(h)->used--;							\
-	if ((_i) < (h)->used) {						\
-		heap_swap(h, _i, (h)->used);				\
-		heap_sift_down(h, _i, cmp);				\
-		heap_sift(h, _i, cmp);					\
-	}								\
-} while (0)
-
-#define heap_pop(h, d, cmp)						\
-({									\
-	bool _r = (h)->used;						\
-	if (_r) {							\
-		(d) = (h)->data[0];					\
-		heap_del(h, 0, cmp);					\
-	}								\
-	_r;								\
-})
-
-#define heap_peek(h)	((h)->used ? &(h)->data[0] : NULL)
-#define heap_full(h)	((h)->used == (h)->size)
-#define heap_empty(h)	((h)->used == 0)
-
-#define heap_resort(heap, cmp)						\
-do {									\
-	ssize_t _i;							\
-	for (_i = (ssize_t) (heap)->used / 2 -  1; _i >= 0; --_i)	\
-		heap_sift(heap, _i, cmp);				\
-} while (0)
-
-struct pending_timer {
-	struct timer_list	*timer;
-	unsigned long		expires;
+#define WHEEL_BITS		6
+#define WHEEL_SIZE		(1U << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS		5
+#define WHEEL_MAX_DELTA		(1UL << (WHEEL_BITS * WHEEL_LEVELS))
+
+/* timer->state: */
+enum {
+	TIMER_IDLE,		/* not pending */
+	TIMER_SUBMITTED,	/* on a submission stack */
+	TIMER_CANCELLED,	/* on a submission stack, but deleted again */
+	TIMER_INSERTED,		/* on a wheel bucket list */
 };
 
-static inline bool pending_timer_cmp(struct pending_timer a,
-				     struct pending_timer b)
-{
-	return a.expires < b.expires;
-}
+static struct list_head	wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static unsigned long	wheel_time;
+
+#define NR_SUBMIT_STACKS	8
 
-static DECLARE_HEAP(struct pending_timer) pending_timers;
+static struct {
+	struct llist_head	list;
+} ____cacheline_aligned submit_stacks[NR_SUBMIT_STACKS];
 
 static pthread_mutex_t	timer_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t	timer_cond = PTHREAD_COND_INITIALIZER;
 static pthread_cond_t	timer_running_cond = PTHREAD_COND_INITIALIZER;
 static unsigned long	timer_seq;
 
+/*
+ * When the timer thread will next drain the submission stacks: 0 while it's
+ * running (it will drain before sleeping without being prodded), NO_WAKE
+ * while it sleeps with nothing in the wheel.
+ */
+#define TIMER_NO_WAKE		(-1UL)
+static unsigned long	timer_next_wake;
+
 static inline bool timer_running(void)
 {
 	return timer_seq & 1;
 }
 
-static ssize_t timer_idx(struct timer_list *timer)
+/* timer_lock must be held: */
+static void wheel_insert(struct timer_list *timer)
+{
+	unsigned long delta = time_after(timer->expires, wheel_time)
+		? timer->expires - wheel_time : 1;
+	unsigned l, idx;
+
+	delta = min(delta, WHEEL_MAX_DELTA - 1);
+
+	for (l = 0; delta >= 1UL << (WHEEL_BITS * (l + 1)); l++)
+		;
+
+	idx = ((wheel_time + delta) >> (WHEEL_BITS * l)) & WHEEL_MASK;
+
+	list_add_tail(&timer->entry, &wheel[l][idx]);
+	timer->state = TIMER_INSERTED;
+}
+
+static void submit_drain(void)
+{
+	for (unsigned i = 0; i < NR_SUBMIT_STACKS; i++) {
+		struct llist_node *list = llist_del_all(&submit_stacks[i].list);
+
+		while (list) {
+			struct timer_list *timer =
+				llist_entry(list, struct timer_list, submit);
+
+			/*
+			 * The instant a timer goes idle it can be rearmed and
+			 * its submission stack link reused - read the next
+			 * pointer first:
+			 */
+			list = list->next;
+
+			if (timer->state == TIMER_CANCELLED)
+				timer->state = TIMER_IDLE;
+			else
+				wheel_insert(timer);
+		}
+	}
+}
+
+static bool submit_pending(void)
 {
-	size_t i;
+	for (unsigned i = 0; i < NR_SUBMIT_STACKS; i++)
+		if (!llist_empty(&submit_stacks[i].list))
+			return true;
 
-	for (i = 0; i < pending_timers.used; i++)
-		if (pending_timers.data[i].timer == timer)
-			return i;
+	return false;
+}
+
+static void wheel_advance(struct list_head *fired, unsigned long now)
+{
+	while (time_before(wheel_time, now)) {
+		unsigned long t = ++wheel_time;
+		struct list_head *bucket;
+
+		/*
+		 * Cascade higher levels first - a level l cascade re-sorts
+		 * into levels below l, possibly including the level 0 bucket
+		 * firing this jiffy:
+		 */
+		for (unsigned l = WHEEL_LEVELS - 1; l >= 1; l--) {
+			if (t & ((1UL << (WHEEL_BITS * l)) - 1))
+				continue;
+
+			bucket = &wheel[l][(t >> (WHEEL_BITS * l)) & WHEEL_MASK];
+
+			while (!list_empty(bucket)) {
+				struct timer_list *timer =
+					list_first_entry(bucket, struct timer_list, entry);
+
+				list_del(&timer->entry);
+				wheel_insert(timer);
+			}
+		}
 
-	return -1;
+		bucket = &wheel[0][t & WHEEL_MASK];
+		list_splice(bucket, fired);
+		INIT_LIST_HEAD(bucket);
+	}
+}
+
+static unsigned long next_expiry(void)
+{
+	unsigned long ret = TIMER_NO_WAKE;
+
+	for (unsigned d = 1; d <= WHEEL_SIZE; d++)
+		if (!list_empty(&wheel[0][(wheel_time + d) & WHEEL_MASK])) {
+			ret = wheel_time + d;
+			break;
+		}
+
+	/*
+	 * For higher levels the next event is the cascade of the next
+	 * nonempty bucket, at that bucket's level l boundary:
+	 */
+	for (unsigned l = 1; l < WHEEL_LEVELS; l++) {
+		unsigned long cur = wheel_time >> (WHEEL_BITS * l);
+
+		for (unsigned d = 1; d <= WHEEL_SIZE; d++)
+			if (!list_empty(&wheel[l][(cur + d) & WHEEL_MASK])) {
+				unsigned long t = (cur + d) << (WHEEL_BITS * l);
+
+				if (ret == TIMER_NO_WAKE || time_before(t, ret))
+					ret = t;
+				break;
+			}
+	}
+
+	return ret;
+}
+
+static void timer_wake(unsigned long expires)
+{
+	unsigned long next = __atomic_load_n(&timer_next_wake, __ATOMIC_SEQ_CST);
+
+	if (next &&
+	    (next == TIMER_NO_WAKE || time_before(expires, next))) {
+		pthread_mutex_lock(&timer_lock);
+		pthread_cond_signal(&timer_cond);
+		pthread_mutex_unlock(&timer_lock);
+	}
 }
 
 int del_timer(struct timer_list *timer)
 {
-	ssize_t idx;
+	int ret;
 
 	pthread_mutex_lock(&timer_lock);
-	idx = timer_idx(timer);
-	if (idx >= 0)
-		heap_del(&pending_timers, idx, pending_timer_cmp);
-
+	switch (timer->state) {
+	case TIMER_INSERTED:
+		list_del(&timer->entry);
+		timer->state = TIMER_IDLE;
+		ret = 1;
+		break;
+	case TIMER_SUBMITTED:
+		/* can't unlink from the submission stack - drain discards it: */
+		timer->state = TIMER_CANCELLED;
+		ret = 1;
+		break;
+	default:
+		ret = 0;
+		break;
+	}
 	timer->pending = false;
 	pthread_mutex_unlock(&timer_lock);
 
-	return idx >= 0;
+	return ret;
 }
 
 void flush_timers(void)
@@ -185,13 +246,23 @@ void flush_timers(void)
 int del_timer_sync(struct timer_list *timer)
 {
 	unsigned long seq;
-	ssize_t idx;
+	int ret;
 
 	pthread_mutex_lock(&timer_lock);
-	idx = timer_idx(timer);
-	if (idx >= 0)
-		heap_del(&pending_timers, idx, pending_timer_cmp);
-
+	switch (timer->state) {
+	case TIMER_INSERTED:
+		list_del(&timer->entry);
+		timer->state = TIMER_IDLE;
+		ret = 1;
+		break;
+	case TIMER_SUBMITTED:
+		timer->state = TIMER_CANCELLED;
+		ret = 1;
+		break;
+	default:
+		ret = 0;
+		break;
+	}
 	timer->pending = false;
 
 	seq = timer_seq;
@@ -199,78 +270,78 @@ int del_timer_sync(struct timer_list *timer)
 		pthread_cond_wait(&timer_running_cond, &timer_lock);
 	pthread_mutex_unlock(&timer_lock);
 
-	return idx >= 0;
+	return ret;
 }
 
 int mod_timer(struct timer_list *timer, unsigned long expires)
 {
-	ssize_t idx;
+	unsigned idle = TIMER_IDLE;
+	int ret;
 
-	pthread_mutex_lock(&timer_lock);
 	timer->expires = expires;
 	timer->pending = true;
-	idx = timer_idx(timer);
-
-	if (idx >= 0 &&
-	    pending_timers.data[idx].expires == expires)
-		goto out;
-
-	if (idx >= 0) {
-		pending_timers.data[idx].expires = expires;
-
-		heap_sift_down(&pending_timers, idx, pending_timer_cmp);
-		heap_sift(&pending_timers, idx, pending_timer_cmp);
-	} else {
-		if (heap_full(&pending_timers)) {
-			pending_timers.size *= 2;
-			pending_timers.data =
-				realloc(pending_timers.data,
-					pending_timers.size *
-					sizeof(struct pending_timer));
-
-			BUG_ON(!pending_timers.data);
-		}
 
-		heap_add(&pending_timers,
-			 ((struct pending_timer) {
-				.timer = timer,
-				.expires = expires,
-			 }),
-			 pending_timer_cmp);
+	if (__atomic_compare_exchange_n(&timer->state, &idle, TIMER_SUBMITTED,
+					false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		llist_add(&timer->submit,
+			  &submit_stacks[raw_smp_processor_id() &
+					 (NR_SUBMIT_STACKS - 1)].list);
+		timer_wake(expires);
+		return 0;
 	}
 
-	pthread_cond_signal(&timer_cond);
-out:
+	pthread_mutex_lock(&timer_lock);
+	switch (timer->state) {
+	case TIMER_IDLE:
+		/* raced with the timer thread expiring it - rearm: */
+		timer->pending = true;
+		wheel_insert(timer);
+		ret = 0;
+		break;
+	case TIMER_SUBMITTED:
+		/* still on a submission stack; drain sees the new expiry */
+		ret = 1;
+		break;
+	case TIMER_CANCELLED:
+		timer->state = TIMER_SUBMITTED;
+		ret = 0;
+		break;
+	default: /* TIMER_INSERTED */
+		list_del(&timer->entry);
+		wheel_insert(timer);
+		ret = 1;
+		break;
+	}
 	pthread_mutex_unlock(&timer_lock);
 
-	return idx >= 0;
+	timer_wake(expires);
+
+	return ret;
 }
 
 static bool timer_thread_stop = false;
 
 static int timer_thread(void *arg)
 {
-	struct pending_timer *p;
 	struct timespec ts;
-	unsigned long now;
 	int ret;
 
 	pthread_mutex_lock(&timer_lock);
 
 	while (!timer_thread_stop) {
-		now = jiffies;
-		p = heap_peek(&pending_timers);
+		LIST_HEAD(fired);
+		unsigned long now = jiffies;
+		unsigned long next;
 
-		if (!p) {
-			pthread_cond_wait(&timer_cond, &timer_lock);
-			continue;
-		}
+		submit_drain();
+		wheel_advance(&fired, now);
 
-		if (time_after_eq(now, p->expires)) {
-			struct timer_list *timer = p->timer;
+		while (!list_empty(&fired)) {
+			struct timer_list *timer =
+				list_first_entry(&fired, struct timer_list, entry);
 
-			heap_del(&pending_timers, 0, pending_timer_cmp);
-			BUG_ON(!timer_pending(timer));
+			list_del(&timer->entry);
+			timer->state = TIMER_IDLE;
 			timer->pending = false;
 
 			timer_seq++;
@@ -282,16 +353,34 @@ static int timer_thread(void *arg)
 
 			timer_seq++;
 			pthread_cond_broadcast(&timer_running_cond);
-			continue;
 		}
 
+		next = next_expiry();
 
-		ret = clock_gettime(CLOCK_REALTIME, &ts);
-		BUG_ON(ret);
+		/*
+		 * Publish when we'll next drain, then recheck the submission
+		 * stacks: an armer that missed the published time is
+		 * guaranteed to have pushed before our recheck, and one that
+		 * saw it takes the lock to wake us if it needs to:
+		 */
+		__atomic_store_n(&timer_next_wake, next, __ATOMIC_SEQ_CST);
 
-		ts = timespec_add_ns(ts, jiffies_to_nsecs(p->expires - now));
+		if (submit_pending()) {
+			__atomic_store_n(&timer_next_wake, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		if (next == TIMER_NO_WAKE) {
+			pthread_cond_wait(&timer_cond, &timer_lock);
+		} else {
+			ret = clock_gettime(CLOCK_REALTIME, &ts);
+			BUG_ON(ret);
 
-		pthread_cond_timedwait(&timer_cond, &timer_lock, &ts);
+			ts = timespec_add_ns(ts, jiffies_to_nsecs(next - now));
+			pthread_cond_timedwait(&timer_cond, &timer_lock, &ts);
+		}
+
+		__atomic_store_n(&timer_next_wake, 0, __ATOMIC_SEQ_CST);
 	}
 
 	pthread_mutex_unlock(&timer_lock);
@@ -304,8 +393,14 @@ struct task_struct *timer_task;
 __attribute__((constructor(103)))
 static void timers_init(void)
 {
-	heap_init(&pending_timers, 64);
-	BUG_ON(!pending_timers.data);
+	for (unsigned l = 0; l < WHEEL_LEVELS; l++)
+		for (unsigned i = 0; i < WHEEL_SIZE; i++)
+			INIT_LIST_HEAD(&wheel[l][i]);
+
+	for (unsigned i = 0; i < NR_SUBMIT_STACKS; i++)
+		init_llist_head(&submit_stacks[i].list);
+
+	wheel_time = jiffies;
 
 	timer_task = kthread_run(timer_thread, NULL, "timers");
 	BUG_ON(IS_ERR(timer_task));
@@ -0,0 +1,142 @@
+/*
+ * Userspace tracepoint backend: trace_* calls from the vendored kernel code
+ * record into per-thread ring buffers when BCACHEFS_TRACE=<path> is set, and
+ * are compiled to a branch on a global bool otherwise.
+ *
+ * At exit we write <path> in folded-stack format ("comm-tid;event count"),
+ * directly consumable by flamegraph.pl, plus <path>.events with the
+ * chronological tail of each ring ("timestamp_ns tid event") for looking at
+ * stalls in sequence.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <linux/tracepoint.h>
+
+bool trace_ring_on;
+
+static const char *trace_ring_path;
+
+#define TRACE_RING_ENTRIES	(1U << 16)
+#define TRACE_MAX_EVENTS	256
+
+struct trace_ring {
+	struct trace_ring	*next;
+	pid_t			tid;
+	unsigned		head;
+	struct trace_ring_entry {
+		u64		ts;
+		const char	*event;
+	}			entries[TRACE_RING_ENTRIES];
+
+	/* per-event totals; event names are string literals, keyed by pointer: */
+	const char		*events[TRACE_MAX_EVENTS];
+	u64			counts[TRACE_MAX_EVENTS];
+};
+
+static pthread_mutex_t	trace_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *trace_rings;
+static __thread struct trace_ring *trace_ring;
+
+static u64 trace_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct trace_ring *trace_ring_alloc(void)
+{
+	struct trace_ring *r = calloc(1, sizeof(*r));
+
+	if (!r)
+		return NULL;
+
+	r->tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&trace_rings_lock);
+	r->next = trace_rings;
+	trace_rings = r;
+	pthread_mutex_unlock(&trace_rings_lock);
+
+	return trace_ring = r;
+}
+
+void __trace_ring_record(const char *event)
+{
+	struct trace_ring *r = trace_ring ?: trace_ring_alloc();
+
+	if (!r)
+		return;
+
+	r->entries[r->head++ & (TRACE_RING_ENTRIES - 1)] =
+		(struct trace_ring_entry) { trace_ns(), event };
+
+	for (unsigned i = 0; i < TRACE_MAX_EVENTS; i++)
+		if (r->events[i] == event || !r->events[i]) {
+			r->events[i] = event;
+			r->counts[i]++;
+			break;
+		}
+}
+
+static void trace_ring_exit(void)
+{
+	extern char *program_invocation_short_name;
+	const char *comm = program_invocation_short_name;
+
+	/*
+	 * Worker threads may still be running; their rings only ever grow, so
+	 * dumping a snapshot is safe, just possibly missing the last events:
+	 */
+	FILE *f = fopen(trace_ring_path, "w");
+	if (!f) {
+		fprintf(stderr, "error opening %s: %m\n", trace_ring_path);
+		return;
+	}
+
+	for (struct trace_ring *r = trace_rings; r; r = r->next)
+		for (unsigned i = 0; i < TRACE_MAX_EVENTS && r->events[i]; i++)
+			fprintf(f, "%s-%u;%s %llu\n",
+				comm, r->tid, r->events[i], r->counts[i]);
+	fclose(f);
+
+	char *events_path = NULL;
+	if (asprintf(&events_path, "%s.events", trace_ring_path) < 0)
+		return;
+
+	f = fopen(events_path, "w");
+	if (f) {
+		for (struct trace_ring *r = trace_rings; r; r = r->next) {
+			unsigned nr = r->head < TRACE_RING_ENTRIES
+				? r->head : TRACE_RING_ENTRIES;
+
+			for (unsigned i = r->head - nr; i != r->head; i++) {
+				struct trace_ring_entry *e =
+					&r->entries[i & (TRACE_RING_ENTRIES - 1)];
+
+				fprintf(f, "%llu %u %s\n", e->ts, r->tid, e->event);
+			}
+		}
+		fclose(f);
+	}
+	free(events_path);
+}
+
+__attribute__((constructor))
+static void trace_ring_init(void)
+{
+	trace_ring_path = getenv("BCACHEFS_TRACE");
+	if (trace_ring_path) {
+		trace_ring_on = true;
+		atexit(trace_ring_exit);
+	}
+}
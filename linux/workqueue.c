@@ -1,4 +1,5 @@
 #include <pthread.h>
+#include <unistd.h>
 
 #include <linux/kthread.h>
 #include <linux/slab.h>
@@ -11,13 +12,55 @@ static LIST_HEAD(wq_list);
 struct workqueue_struct {
 	struct list_head	list;
 
-	struct work_struct	*current_work;
 	struct list_head	pending_work;
-
-	struct task_struct	*worker;
+	unsigned		nr_active;
+	unsigned		max_active;
 	char			name[24];
 };
 
+/*
+ * All workqueues are serviced by one pool of worker threads, initially sized
+ * to the cpu count: work items queued to different (or the same) workqueue run
+ * concurrently, up to each workqueue's max_active, instead of being serialized
+ * on a single thread per queue.
+ *
+ * Work items may block waiting on other work items (flush_work from within a
+ * work item, btree node writes waiting on journal work, ...), so a fixed pool
+ * deadlocks as soon as every worker is blocked on a still-pending item. Like
+ * the kernel, which spawns a replacement worker when one blocks, we grow the
+ * pool on demand: queueing work when no worker is idle spawns a new one, so
+ * there is always a runnable thread for pending work.
+ */
+
+#define WQ_POOL_MAX_WORKERS	256U
+
+struct worker {
+	struct task_struct	*task;
+	struct workqueue_struct	*wq;		/* wq of current_work */
+	struct work_struct	*current_work;
+	struct list_head	idle;
+};
+
+static struct worker	workers[WQ_POOL_MAX_WORKERS];
+static unsigned		nr_workers;
+static LIST_HEAD(idle_workers);
+
+static int worker_thread(void *);
+
+static void maybe_spawn_worker(void)
+{
+	struct worker *w;
+
+	if (nr_workers >= WQ_POOL_MAX_WORKERS)
+		return;
+
+	w = workers + nr_workers;
+	INIT_LIST_HEAD(&w->idle);
+	w->task = kthread_run(worker_thread, w, "kworker/%u", nr_workers);
+	if (!IS_ERR(w->task))
+		nr_workers++;
+}
+
 enum {
 	WORK_PENDING_BIT,
 };
@@ -44,7 +87,12 @@ static void __queue_work(struct workqueue_struct *wq,
 	BUG_ON(!list_empty(&work->entry));
 
 	list_add_tail(&work->entry, &wq->pending_work);
-	wake_up_process(wq->worker);
+
+	if (!list_empty(&idle_workers))
+		wake_up_process(list_first_entry(&idle_workers,
+						 struct worker, idle)->task);
+	else
+		maybe_spawn_worker();
 }
 
 bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
@@ -136,10 +184,8 @@ retry:
 
 static bool work_running(struct work_struct *work)
 {
-	struct workqueue_struct *wq;
-
-	list_for_each_entry(wq, &wq_list, list)
-		if (wq->current_work == work)
+	for (unsigned i = 0; i < nr_workers; i++)
+		if (workers[i].current_work == work)
 			return true;
 
 	return false;
@@ -230,38 +276,65 @@ bool cancel_delayed_work_sync(struct delayed_work *dwork)
 	return ret;
 }
 
+static struct work_struct *worker_find_work(struct worker *w)
+{
+	struct workqueue_struct *wq;
+
+	list_for_each_entry(wq, &wq_list, list) {
+		struct work_struct *work;
+
+		if (wq->nr_active >= wq->max_active)
+			continue;
+
+		work = list_first_entry_or_null(&wq->pending_work,
+				struct work_struct, entry);
+		if (work) {
+			BUG_ON(!work_pending(work));
+			list_del_init(&work->entry);
+			clear_work_pending(work);
+			wq->nr_active++;
+			w->wq = wq;
+			return work;
+		}
+	}
+
+	return NULL;
+}
+
 static int worker_thread(void *arg)
 {
-	struct workqueue_struct *wq = arg;
+	struct worker *w = arg;
 	struct work_struct *work;
 
+	mem_numa_pin_thread(w - workers);
+
 	pthread_mutex_lock(&wq_lock);
 	while (1) {
 		__set_current_state(TASK_INTERRUPTIBLE);
-		work = list_first_entry_or_null(&wq->pending_work,
-				struct work_struct, entry);
-		wq->current_work = work;
+		work = worker_find_work(w);
+		w->current_work = work;
 
 		if (kthread_should_stop()) {
-			BUG_ON(wq->current_work);
+			BUG_ON(w->current_work);
 			break;
 		}
 
 		if (!work) {
+			list_add(&w->idle, &idle_workers);
 			pthread_mutex_unlock(&wq_lock);
 			schedule();
 			pthread_mutex_lock(&wq_lock);
+			list_del_init(&w->idle);
 			continue;
 		}
 
-		BUG_ON(!work_pending(work));
-		list_del_init(&work->entry);
-		clear_work_pending(work);
-
 		pthread_mutex_unlock(&wq_lock);
 		work->func(work);
 		pthread_mutex_lock(&wq_lock);
 
+		w->current_work = NULL;
+		w->wq->nr_active--;
+
 		pthread_cond_broadcast(&work_finished);
 	}
 	pthread_mutex_unlock(&wq_lock);
@@ -271,9 +344,9 @@ static int worker_thread(void *arg)
 
 void destroy_workqueue(struct workqueue_struct *wq)
 {
-	kthread_stop(wq->worker);
-
 	pthread_mutex_lock(&wq_lock);
+	while (!list_empty(&wq->pending_work) || wq->nr_active)
+		pthread_cond_wait(&work_finished, &wq_lock);
 	list_del(&wq->list);
 	pthread_mutex_unlock(&wq_lock);
 
@@ -295,16 +368,13 @@ struct workqueue_struct *alloc_workqueue(const char *fmt,
 	INIT_LIST_HEAD(&wq->list);
 	INIT_LIST_HEAD(&wq->pending_work);
 
+	wq->max_active = max_active
+		?: (flags & WQ_UNBOUND ? WQ_UNBOUND_MAX_ACTIVE : nr_workers);
+
 	va_start(args, max_active);
 	vsnprintf(wq->name, sizeof(wq->name), fmt, args);
 	va_end(args);
 
-	wq->worker = kthread_run(worker_thread, wq, "%s", wq->name);
-	if (IS_ERR(wq->worker)) {
-		kfree(wq);
-		return NULL;
-	}
-
 	pthread_mutex_lock(&wq_lock);
 	list_add(&wq->list, &wq_list);
 	pthread_mutex_unlock(&wq_lock);
@@ -321,6 +391,17 @@ struct workqueue_struct *system_freezable_wq;
 __attribute__((constructor(102)))
 static void wq_init(void)
 {
+	nr_workers = clamp_t(long, sysconf(_SC_NPROCESSORS_ONLN),
+			     1, WQ_POOL_MAX_WORKERS);
+
+	for (unsigned i = 0; i < nr_workers; i++) {
+		struct worker *w = workers + i;
+
+		INIT_LIST_HEAD(&w->idle);
+		w->task = kthread_run(worker_thread, w, "kworker/%u", i);
+		BUG_ON(IS_ERR(w->task));
+	}
+
 	system_wq = alloc_workqueue("events", 0, 0);
 	system_highpri_wq = alloc_workqueue("events_highpri", WQ_HIGHPRI, 0);
 	system_long_wq = alloc_workqueue("events_long", 0, 0);
@@ -343,4 +424,7 @@ static void wq_cleanup(void)
 
 	system_wq = system_highpri_wq = system_long_wq = system_unbound_wq =
 		system_freezable_wq = NULL;
+
+	for (unsigned i = 0; i < nr_workers; i++)
+		kthread_stop(workers[i].task);
 }
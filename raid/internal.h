@@ -53,6 +53,9 @@
 #if HAVE_AVX2
 #define CONFIG_AVX2 1
 #endif
+#if HAVE_GFNI
+#define CONFIG_GFNI 1
+#endif
 
 #else /* if HAVE_CONFIG_H is not defined */
 
@@ -72,6 +75,7 @@
 #define CONFIG_SSE2 1
 #define CONFIG_SSSE3 1
 #define CONFIG_AVX2 1
+#define CONFIG_GFNI 1
 #endif
 #endif
 
@@ -170,6 +174,15 @@ void raid_recX_ssse3(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 void raid_rec1_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 void raid_rec2_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 void raid_recX_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_gfni_init(void);
+void raid_gen2_gfni(int nd, size_t size, void **vv);
+void raid_gen3_gfni(int nd, size_t size, void **vv);
+void raid_gen4_gfni(int nd, size_t size, void **vv);
+void raid_gen5_gfni(int nd, size_t size, void **vv);
+void raid_gen6_gfni(int nd, size_t size, void **vv);
+void raid_rec1_gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_rec2_gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_recX_gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 
 /*
  * Internal naming.
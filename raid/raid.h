@@ -53,6 +53,18 @@
  */
 void raid_init(void);
 
+/**
+ * Benchmarks the available kernels and installs the fastest ones.
+ *
+ * Call after raid_init(). The selection is written to the @cache file (and
+ * read back on later runs, skipping the benchmark), identified by kernel
+ * name; cached entries not supported by the running CPU are ignored and the
+ * benchmark is re-run, so a stale or foreign cache is harmless.
+ *
+ * Passing NULL for @cache benchmarks without persisting the result.
+ */
+void raid_tune(const char *cache);
+
 /**
  * Runs a basic functionality self test.
  *
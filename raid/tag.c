@@ -74,6 +74,16 @@ static struct raid_func {
 	{ "avx2e", raid_gen5_avx2ext },
 	{ "avx2e", raid_gen6_avx2ext },
 #endif
+#ifdef CONFIG_GFNI
+	{ "gfni", raid_gen2_gfni },
+	{ "gfni", raid_gen3_gfni },
+	{ "gfni", raid_gen4_gfni },
+	{ "gfni", raid_gen5_gfni },
+	{ "gfni", raid_gen6_gfni },
+	{ "gfni", raid_rec1_gfni },
+	{ "gfni", raid_rec2_gfni },
+	{ "gfni", raid_recX_gfni },
+#endif
 #endif
 	{ 0, 0 }
 };
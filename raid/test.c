@@ -194,6 +194,13 @@ int raid_test_rec(int mode, int nd, size_t size)
 	/* fill with pseudo-random data with the arbitrary seed "1" */
 	raid_mrand_vector(1, nd, size, v);
 
+#ifdef CONFIG_GFNI
+#ifdef CONFIG_X86_64
+	if (raid_cpu_has_gfni())
+		raid_gfni_init();
+#endif
+#endif
+
 	/* setup recov functions */
 	for (i = 0; i < np; ++i) {
 		nf[i] = 0;
@@ -208,6 +215,12 @@ int raid_test_rec(int mode, int nd, size_t size)
 			if (raid_cpu_has_avx2())
 				f[i][nf[i]++] = raid_rec1_avx2;
 #endif
+#ifdef CONFIG_GFNI
+#ifdef CONFIG_X86_64
+			if (raid_cpu_has_gfni())
+				f[i][nf[i]++] = raid_rec1_gfni;
+#endif
+#endif
 #endif
 		} else if (i == 1) {
 			f[i][nf[i]++] = raid_rec2_int8;
@@ -220,6 +233,12 @@ int raid_test_rec(int mode, int nd, size_t size)
 			if (raid_cpu_has_avx2())
 				f[i][nf[i]++] = raid_rec2_avx2;
 #endif
+#ifdef CONFIG_GFNI
+#ifdef CONFIG_X86_64
+			if (raid_cpu_has_gfni())
+				f[i][nf[i]++] = raid_rec2_gfni;
+#endif
+#endif
 #endif
 		} else {
 			f[i][nf[i]++] = raid_recX_int8;
@@ -232,6 +251,12 @@ int raid_test_rec(int mode, int nd, size_t size)
 			if (raid_cpu_has_avx2())
 				f[i][nf[i]++] = raid_recX_avx2;
 #endif
+#ifdef CONFIG_GFNI
+#ifdef CONFIG_X86_64
+			if (raid_cpu_has_gfni())
+				f[i][nf[i]++] = raid_recX_gfni;
+#endif
+#endif
 #endif
 		}
 	}
@@ -365,6 +390,15 @@ int raid_test_par(int mode, int nd, size_t size)
 		f[nf++] = raid_gen2_avx2;
 	}
 #endif
+
+#ifdef CONFIG_GFNI
+#ifdef CONFIG_X86_64
+	if (raid_cpu_has_gfni()) {
+		raid_gfni_init();
+		f[nf++] = raid_gen2_gfni;
+	}
+#endif
+#endif
 #endif /* CONFIG_X86 */
 
 	if (mode == RAID_MODE_CAUCHY) {
@@ -399,6 +433,17 @@ int raid_test_par(int mode, int nd, size_t size)
 		}
 #endif
 #endif
+
+#ifdef CONFIG_GFNI
+#ifdef CONFIG_X86_64
+		if (raid_cpu_has_gfni()) {
+			f[nf++] = raid_gen3_gfni;
+			f[nf++] = raid_gen4_gfni;
+			f[nf++] = raid_gen5_gfni;
+			f[nf++] = raid_gen6_gfni;
+		}
+#endif
+#endif
 #endif /* CONFIG_X86 */
 	} else {
 		f[nf++] = raid_genz_int32;
@@ -0,0 +1,441 @@
+/*
+ * Copyright (C) 2013 Andrea Mazzoleni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "internal.h"
+#include "cpu.h"
+#include "memory.h"
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Benchmarked kernel selection.
+ *
+ * raid_init() picks implementations from CPUID only, but the fastest kernel
+ * is machine dependent: some CPUs run the SSSE3 paths faster than the wider
+ * vector ones at the block sizes we use. raid_tune() measures the candidate
+ * kernels on the running machine and installs the fastest, caching the
+ * selection in a file so the benchmark only runs once per machine.
+ *
+ * The cache stores kernel names, not pointers, and a cached name is only
+ * applied if the kernel is compiled in and supported by the current CPU, so
+ * a cache copied from a different machine just falls back to re-tuning.
+ */
+
+/* benchmark with the block size the erasure coding code computes in */
+#define TUNE_SIZE	(32 * 1024)
+#define TUNE_ND		8
+#define TUNE_LOOPS	8
+#define TUNE_TRIALS	3
+#define TUNE_FUNC_MAX	8
+
+struct tune_gen {
+	const char *tag;
+	void (*f)(int nd, size_t size, void **vv);
+};
+
+struct tune_rec {
+	const char *tag;
+	void (*f)(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+};
+
+/* candidates for gen1..gen6, guarded by the same checks as raid_init() */
+static int tune_gen_candidates(int np, struct tune_gen *c)
+{
+	int n = 0;
+
+	if (np == 1) {
+		c[n++] = (struct tune_gen) { "int32", raid_gen1_int32 };
+		c[n++] = (struct tune_gen) { "int64", raid_gen1_int64 };
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSE2
+		if (raid_cpu_has_sse2())
+			c[n++] = (struct tune_gen) { "sse2", raid_gen1_sse2 };
+#endif
+#ifdef CONFIG_AVX2
+		if (raid_cpu_has_avx2())
+			c[n++] = (struct tune_gen) { "avx2", raid_gen1_avx2 };
+#endif
+#endif
+	} else if (np == 2) {
+		c[n++] = (struct tune_gen) { "int32", raid_gen2_int32 };
+		c[n++] = (struct tune_gen) { "int64", raid_gen2_int64 };
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSE2
+		if (raid_cpu_has_sse2()) {
+			c[n++] = (struct tune_gen) { "sse2", raid_gen2_sse2 };
+#ifdef CONFIG_X86_64
+			c[n++] = (struct tune_gen) { "sse2e", raid_gen2_sse2ext };
+#endif
+		}
+#endif
+#ifdef CONFIG_AVX2
+		if (raid_cpu_has_avx2())
+			c[n++] = (struct tune_gen) { "avx2", raid_gen2_avx2 };
+#endif
+#ifdef CONFIG_GFNI
+#ifdef CONFIG_X86_64
+		if (raid_cpu_has_gfni())
+			c[n++] = (struct tune_gen) { "gfni", raid_gen2_gfni };
+#endif
+#endif
+#endif
+	} else {
+		static void (*int8[4])(int nd, size_t size, void **vv) = {
+			raid_gen3_int8, raid_gen4_int8,
+			raid_gen5_int8, raid_gen6_int8,
+		};
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSSE3
+		static void (*ssse3[4])(int nd, size_t size, void **vv) = {
+			raid_gen3_ssse3, raid_gen4_ssse3,
+			raid_gen5_ssse3, raid_gen6_ssse3,
+		};
+#ifdef CONFIG_X86_64
+		static void (*ssse3e[4])(int nd, size_t size, void **vv) = {
+			raid_gen3_ssse3ext, raid_gen4_ssse3ext,
+			raid_gen5_ssse3ext, raid_gen6_ssse3ext,
+		};
+#endif
+#endif
+#ifdef CONFIG_AVX2
+#ifdef CONFIG_X86_64
+		static void (*avx2e[4])(int nd, size_t size, void **vv) = {
+			raid_gen3_avx2ext, raid_gen4_avx2ext,
+			raid_gen5_avx2ext, raid_gen6_avx2ext,
+		};
+#endif
+#endif
+#ifdef CONFIG_GFNI
+#ifdef CONFIG_X86_64
+		static void (*gfni[4])(int nd, size_t size, void **vv) = {
+			raid_gen3_gfni, raid_gen4_gfni,
+			raid_gen5_gfni, raid_gen6_gfni,
+		};
+#endif
+#endif
+#endif
+
+		c[n++] = (struct tune_gen) { "int8", int8[np - 3] };
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSSE3
+		if (raid_cpu_has_ssse3()) {
+			c[n++] = (struct tune_gen) { "ssse3", ssse3[np - 3] };
+#ifdef CONFIG_X86_64
+			c[n++] = (struct tune_gen) { "ssse3e", ssse3e[np - 3] };
+#endif
+		}
+#endif
+#ifdef CONFIG_AVX2
+#ifdef CONFIG_X86_64
+		if (raid_cpu_has_avx2())
+			c[n++] = (struct tune_gen) { "avx2e", avx2e[np - 3] };
+#endif
+#endif
+#ifdef CONFIG_GFNI
+#ifdef CONFIG_X86_64
+		if (raid_cpu_has_gfni())
+			c[n++] = (struct tune_gen) { "gfni", gfni[np - 3] };
+#endif
+#endif
+#endif
+	}
+
+	return n;
+}
+
+/* candidates for rec1/rec2/recX */
+static int tune_rec_candidates(int nr, struct tune_rec *c)
+{
+	int n = 0;
+
+	switch (nr) {
+	case 1:
+		c[n++] = (struct tune_rec) { "int8", raid_rec1_int8 };
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSSE3
+		if (raid_cpu_has_ssse3())
+			c[n++] = (struct tune_rec) { "ssse3", raid_rec1_ssse3 };
+#endif
+#ifdef CONFIG_AVX2
+		if (raid_cpu_has_avx2())
+			c[n++] = (struct tune_rec) { "avx2", raid_rec1_avx2 };
+#endif
+#ifdef CONFIG_GFNI
+#ifdef CONFIG_X86_64
+		if (raid_cpu_has_gfni())
+			c[n++] = (struct tune_rec) { "gfni", raid_rec1_gfni };
+#endif
+#endif
+#endif
+		break;
+	case 2:
+		c[n++] = (struct tune_rec) { "int8", raid_rec2_int8 };
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSSE3
+		if (raid_cpu_has_ssse3())
+			c[n++] = (struct tune_rec) { "ssse3", raid_rec2_ssse3 };
+#endif
+#ifdef CONFIG_AVX2
+		if (raid_cpu_has_avx2())
+			c[n++] = (struct tune_rec) { "avx2", raid_rec2_avx2 };
+#endif
+#ifdef CONFIG_GFNI
+#ifdef CONFIG_X86_64
+		if (raid_cpu_has_gfni())
+			c[n++] = (struct tune_rec) { "gfni", raid_rec2_gfni };
+#endif
+#endif
+#endif
+		break;
+	default:
+		c[n++] = (struct tune_rec) { "int8", raid_recX_int8 };
+#ifdef CONFIG_X86
+#ifdef CONFIG_SSSE3
+		if (raid_cpu_has_ssse3())
+			c[n++] = (struct tune_rec) { "ssse3", raid_recX_ssse3 };
+#endif
+#ifdef CONFIG_AVX2
+		if (raid_cpu_has_avx2())
+			c[n++] = (struct tune_rec) { "avx2", raid_recX_avx2 };
+#endif
+#ifdef CONFIG_GFNI
+#ifdef CONFIG_X86_64
+		if (raid_cpu_has_gfni())
+			c[n++] = (struct tune_rec) { "gfni", raid_recX_gfni };
+#endif
+#endif
+#endif
+		break;
+	}
+
+	return n;
+}
+
+static int64_t tune_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* the selected kernel names, in raid_tune_slots[] order */
+static const char *tune_selected[RAID_PARITY_MAX + 3];
+
+static const char *const tune_slot_names[RAID_PARITY_MAX + 3] = {
+	"gen1", "gen2", "gen3", "gen4", "gen5", "gen6",
+	"rec1", "rec2", "recX",
+};
+
+static void tune_install_gen(int np, struct tune_gen *c)
+{
+	raid_gen_ptr[np - 1] = c->f;
+	if (np == 3)
+		raid_gen3_ptr = c->f;
+	tune_selected[np - 1] = c->tag;
+}
+
+static void tune_install_rec(int nr, struct tune_rec *c)
+{
+	int i;
+
+	if (nr < 3) {
+		raid_rec_ptr[nr - 1] = c->f;
+	} else {
+		for (i = 2; i < RAID_PARITY_MAX; ++i)
+			raid_rec_ptr[i] = c->f;
+	}
+	tune_selected[RAID_PARITY_MAX + nr - 1] = c->tag;
+}
+
+static void tune_bench(void)
+{
+	void *v_alloc;
+	void **v;
+	int id[RAID_PARITY_MAX];
+	int ip[RAID_PARITY_MAX];
+	int nv, np, nr, i, j, t;
+
+	nv = TUNE_ND + RAID_PARITY_MAX + 1;
+
+	v = raid_malloc_vector(TUNE_ND, nv, TUNE_SIZE, &v_alloc);
+	if (!v)
+		return;
+
+	memset(v[nv - 1], 0, TUNE_SIZE);
+	raid_zero(v[nv - 1]);
+
+	raid_mrand_vector(1, TUNE_ND + RAID_PARITY_MAX, TUNE_SIZE, v);
+
+	for (np = 1; np <= RAID_PARITY_MAX; ++np) {
+		struct tune_gen c[TUNE_FUNC_MAX];
+		int n = tune_gen_candidates(np, c);
+		int64_t best = 0;
+
+		for (j = 0; j < n; ++j) {
+			int64_t t_min = 0;
+
+			for (t = 0; t < TUNE_TRIALS; ++t) {
+				int64_t t0 = tune_ns();
+
+				for (i = 0; i < TUNE_LOOPS; ++i)
+					c[j].f(TUNE_ND, TUNE_SIZE, v);
+
+				t0 = tune_ns() - t0;
+				if (!t_min || t0 < t_min)
+					t_min = t0;
+			}
+
+			if (!best || t_min < best) {
+				best = t_min;
+				tune_install_gen(np, &c[j]);
+			}
+		}
+	}
+
+	for (nr = 1; nr <= 3; ++nr) {
+		struct tune_rec c[TUNE_FUNC_MAX];
+		int n = tune_rec_candidates(nr, c);
+		int64_t best = 0;
+
+		for (i = 0; i < nr; ++i) {
+			/* skip parity 0, rec1 shortcuts it to plain xor */
+			id[i] = i;
+			ip[i] = i + 1;
+		}
+
+		for (j = 0; j < n; ++j) {
+			int64_t t_min = 0;
+
+			for (t = 0; t < TUNE_TRIALS; ++t) {
+				int64_t t0 = tune_ns();
+
+				for (i = 0; i < TUNE_LOOPS; ++i)
+					c[j].f(nr, id, ip, TUNE_ND,
+					       TUNE_SIZE, v);
+
+				t0 = tune_ns() - t0;
+				if (!t_min || t0 < t_min)
+					t_min = t0;
+			}
+
+			if (!best || t_min < best) {
+				best = t_min;
+				tune_install_rec(nr, &c[j]);
+			}
+		}
+	}
+
+	free(v_alloc);
+	free(v);
+}
+
+static int tune_apply(const char *slot, const char *tag)
+{
+	int np, nr, j, n;
+
+	for (np = 1; np <= RAID_PARITY_MAX; ++np) {
+		struct tune_gen c[TUNE_FUNC_MAX];
+
+		if (strcmp(slot, tune_slot_names[np - 1]) != 0)
+			continue;
+
+		n = tune_gen_candidates(np, c);
+		for (j = 0; j < n; ++j) {
+			if (strcmp(tag, c[j].tag) == 0) {
+				tune_install_gen(np, &c[j]);
+				return 0;
+			}
+		}
+		return -1;
+	}
+
+	for (nr = 1; nr <= 3; ++nr) {
+		struct tune_rec c[TUNE_FUNC_MAX];
+
+		if (strcmp(slot, tune_slot_names[RAID_PARITY_MAX + nr - 1]) != 0)
+			continue;
+
+		n = tune_rec_candidates(nr, c);
+		for (j = 0; j < n; ++j) {
+			if (strcmp(tag, c[j].tag) == 0) {
+				tune_install_rec(nr, &c[j]);
+				return 0;
+			}
+		}
+		return -1;
+	}
+
+	return -1;
+}
+
+static int tune_load(const char *path)
+{
+	char slot[16], tag[16];
+	FILE *f;
+	unsigned loaded = 0;
+	int ret = 0;
+
+	f = fopen(path, "re");
+	if (!f)
+		return -1;
+
+	while (fscanf(f, "%15s %15s", slot, tag) == 2) {
+		if (tune_apply(slot, tag) != 0) {
+			/* compiled out or CPU doesn't have it: re-tune */
+			ret = -1;
+			break;
+		}
+		++loaded;
+	}
+
+	fclose(f);
+
+	if (loaded != sizeof(tune_slot_names) / sizeof(tune_slot_names[0]))
+		ret = -1;
+
+	return ret;
+}
+
+static void tune_save(const char *path)
+{
+	FILE *f;
+	unsigned i;
+
+	f = fopen(path, "we");
+	if (!f)
+		return;
+
+	for (i = 0; i < sizeof(tune_slot_names) / sizeof(tune_slot_names[0]); ++i)
+		fprintf(f, "%s %s\n", tune_slot_names[i],
+			tune_selected[i] ? tune_selected[i] : "unknown");
+
+	fclose(f);
+}
+
+void raid_tune(const char *cache)
+{
+	if (cache && tune_load(cache) == 0) {
+		raid_mode(RAID_MODE_CAUCHY);
+		return;
+	}
+
+	tune_bench();
+	raid_mode(RAID_MODE_CAUCHY);
+
+	if (cache)
+		tune_save(cache);
+}
@@ -2450,3 +2450,460 @@ void raid_recX_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv)
 }
 #endif
 
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_GFNI)
+/*
+ * GF(2^8) multiplication as an affine transformation with GFNI.
+ *
+ * GF2P8MULB itself is useless here because it's hardwired to the AES
+ * polynomial 0x11b while this library uses 0x11d, but GF2P8AFFINEQB applies
+ * an arbitrary 8x8 bit matrix to every byte, and multiplication by a
+ * constant is linear over GF(2), so it works in any representation.
+ *
+ * GF2P8AFFINEQB computes, for output bit i, the parity of matrix byte
+ * [7 - i] ANDed with the input byte; multiplication by the constant c is
+ * then the matrix whose row for output bit i has bit j set when c * 2^j has
+ * bit i set. The 2 KiB of matrices for all constants are derived from the
+ * multiplication tables at startup by raid_gfni_init().
+ *
+ * This replaces the two table shuffles, shift, masks and extra xor per
+ * coefficient of the pshufb kernels with a single instruction, working on
+ * 64 bytes at a time.
+ */
+uint64_t raid_gfnimatrix[256] __aligned(256);
+
+#define gfnimatrix raid_gfnimatrix
+
+void raid_gfni_init(void)
+{
+	int c, k, j;
+
+	for (c = 0; c < 256; ++c) {
+		uint64_t m = 0;
+
+		for (k = 0; k < 8; ++k) {
+			uint8_t row = 0;
+
+			for (j = 0; j < 8; ++j)
+				if (gfmul[c][1 << j] & (1 << (7 - k)))
+					row |= 1 << j;
+
+			m |= (uint64_t)row << (8 * k);
+		}
+
+		gfnimatrix[c] = m;
+	}
+}
+
+/*
+ * GEN2 (RAID6 with powers of 2) GFNI implementation
+ */
+void raid_gen2_gfni(int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p;
+	uint8_t *q;
+	int d, l;
+	size_t i;
+
+	l = nd - 1;
+	p = v[nd];
+	q = v[nd + 1];
+
+	raid_avx_begin();
+
+	for (i = 0; i < size; i += 64) {
+		asm volatile ("vmovdqa64 %0,%%zmm0" : : "m" (v[l][i]));
+		asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(1, l)]));
+		asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm0,%zmm1");
+		for (d = l - 1; d >= 0; --d) {
+			asm volatile ("vmovdqa64 %0,%%zmm4" : : "m" (v[d][i]));
+			asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(1, d)]));
+			asm volatile ("vpxorq %zmm4,%zmm0,%zmm0");
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm4");
+			asm volatile ("vpxorq %zmm4,%zmm1,%zmm1");
+		}
+		asm volatile ("vmovntdq %%zmm0,%0" : "=m" (p[i]));
+		asm volatile ("vmovntdq %%zmm1,%0" : "=m" (q[i]));
+	}
+
+	raid_avx_end();
+}
+
+/*
+ * GEN3 (triple parity with Cauchy matrix) GFNI implementation
+ */
+void raid_gen3_gfni(int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p;
+	uint8_t *q;
+	uint8_t *r;
+	int d, l;
+	size_t i;
+
+	l = nd - 1;
+	p = v[nd];
+	q = v[nd + 1];
+	r = v[nd + 2];
+
+	raid_avx_begin();
+
+	for (i = 0; i < size; i += 64) {
+		asm volatile ("vpxorq %zmm0,%zmm0,%zmm0");
+		asm volatile ("vpxorq %zmm1,%zmm1,%zmm1");
+		asm volatile ("vpxorq %zmm2,%zmm2,%zmm2");
+		for (d = l; d >= 0; --d) {
+			asm volatile ("vmovdqa64 %0,%%zmm4" : : "m" (v[d][i]));
+			asm volatile ("vpbroadcastq %0,%%zmm6" : : "m" (gfnimatrix[A(1, d)]));
+			asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(2, d)]));
+			asm volatile ("vpxorq %zmm4,%zmm0,%zmm0");
+			asm volatile ("vgf2p8affineqb $0,%zmm6,%zmm4,%zmm5");
+			asm volatile ("vpxorq %zmm5,%zmm1,%zmm1");
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm5");
+			asm volatile ("vpxorq %zmm5,%zmm2,%zmm2");
+		}
+		asm volatile ("vmovntdq %%zmm0,%0" : "=m" (p[i]));
+		asm volatile ("vmovntdq %%zmm1,%0" : "=m" (q[i]));
+		asm volatile ("vmovntdq %%zmm2,%0" : "=m" (r[i]));
+	}
+
+	raid_avx_end();
+}
+
+/*
+ * GEN4 (quad parity with Cauchy matrix) GFNI implementation
+ */
+void raid_gen4_gfni(int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p;
+	uint8_t *q;
+	uint8_t *r;
+	uint8_t *s;
+	int d, l;
+	size_t i;
+
+	l = nd - 1;
+	p = v[nd];
+	q = v[nd + 1];
+	r = v[nd + 2];
+	s = v[nd + 3];
+
+	raid_avx_begin();
+
+	for (i = 0; i < size; i += 64) {
+		asm volatile ("vpxorq %zmm0,%zmm0,%zmm0");
+		asm volatile ("vpxorq %zmm1,%zmm1,%zmm1");
+		asm volatile ("vpxorq %zmm2,%zmm2,%zmm2");
+		asm volatile ("vpxorq %zmm3,%zmm3,%zmm3");
+		for (d = l; d >= 0; --d) {
+			asm volatile ("vmovdqa64 %0,%%zmm4" : : "m" (v[d][i]));
+			asm volatile ("vpxorq %zmm4,%zmm0,%zmm0");
+			asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(1, d)]));
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm5");
+			asm volatile ("vpxorq %zmm5,%zmm1,%zmm1");
+			asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(2, d)]));
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm5");
+			asm volatile ("vpxorq %zmm5,%zmm2,%zmm2");
+			asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(3, d)]));
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm5");
+			asm volatile ("vpxorq %zmm5,%zmm3,%zmm3");
+		}
+		asm volatile ("vmovntdq %%zmm0,%0" : "=m" (p[i]));
+		asm volatile ("vmovntdq %%zmm1,%0" : "=m" (q[i]));
+		asm volatile ("vmovntdq %%zmm2,%0" : "=m" (r[i]));
+		asm volatile ("vmovntdq %%zmm3,%0" : "=m" (s[i]));
+	}
+
+	raid_avx_end();
+}
+
+/*
+ * GEN5 (penta parity with Cauchy matrix) GFNI implementation
+ */
+void raid_gen5_gfni(int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p;
+	uint8_t *q;
+	uint8_t *r;
+	uint8_t *s;
+	uint8_t *t;
+	int d, l;
+	size_t i;
+
+	l = nd - 1;
+	p = v[nd];
+	q = v[nd + 1];
+	r = v[nd + 2];
+	s = v[nd + 3];
+	t = v[nd + 4];
+
+	raid_avx_begin();
+
+	for (i = 0; i < size; i += 64) {
+		asm volatile ("vpxorq %zmm0,%zmm0,%zmm0");
+		asm volatile ("vpxorq %zmm1,%zmm1,%zmm1");
+		asm volatile ("vpxorq %zmm2,%zmm2,%zmm2");
+		asm volatile ("vpxorq %zmm3,%zmm3,%zmm3");
+		asm volatile ("vpxorq %zmm8,%zmm8,%zmm8");
+		for (d = l; d >= 0; --d) {
+			asm volatile ("vmovdqa64 %0,%%zmm4" : : "m" (v[d][i]));
+			asm volatile ("vpxorq %zmm4,%zmm0,%zmm0");
+			asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(1, d)]));
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm5");
+			asm volatile ("vpxorq %zmm5,%zmm1,%zmm1");
+			asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(2, d)]));
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm5");
+			asm volatile ("vpxorq %zmm5,%zmm2,%zmm2");
+			asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(3, d)]));
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm5");
+			asm volatile ("vpxorq %zmm5,%zmm3,%zmm3");
+			asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(4, d)]));
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm5");
+			asm volatile ("vpxorq %zmm5,%zmm8,%zmm8");
+		}
+		asm volatile ("vmovntdq %%zmm0,%0" : "=m" (p[i]));
+		asm volatile ("vmovntdq %%zmm1,%0" : "=m" (q[i]));
+		asm volatile ("vmovntdq %%zmm2,%0" : "=m" (r[i]));
+		asm volatile ("vmovntdq %%zmm3,%0" : "=m" (s[i]));
+		asm volatile ("vmovntdq %%zmm8,%0" : "=m" (t[i]));
+	}
+
+	raid_avx_end();
+}
+
+/*
+ * GEN6 (hexa parity with Cauchy matrix) GFNI implementation
+ */
+void raid_gen6_gfni(int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p;
+	uint8_t *q;
+	uint8_t *r;
+	uint8_t *s;
+	uint8_t *t;
+	uint8_t *u;
+	int d, l;
+	size_t i;
+
+	l = nd - 1;
+	p = v[nd];
+	q = v[nd + 1];
+	r = v[nd + 2];
+	s = v[nd + 3];
+	t = v[nd + 4];
+	u = v[nd + 5];
+
+	raid_avx_begin();
+
+	for (i = 0; i < size; i += 64) {
+		asm volatile ("vpxorq %zmm0,%zmm0,%zmm0");
+		asm volatile ("vpxorq %zmm1,%zmm1,%zmm1");
+		asm volatile ("vpxorq %zmm2,%zmm2,%zmm2");
+		asm volatile ("vpxorq %zmm3,%zmm3,%zmm3");
+		asm volatile ("vpxorq %zmm8,%zmm8,%zmm8");
+		asm volatile ("vpxorq %zmm9,%zmm9,%zmm9");
+		for (d = l; d >= 0; --d) {
+			asm volatile ("vmovdqa64 %0,%%zmm4" : : "m" (v[d][i]));
+			asm volatile ("vpxorq %zmm4,%zmm0,%zmm0");
+			asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(1, d)]));
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm5");
+			asm volatile ("vpxorq %zmm5,%zmm1,%zmm1");
+			asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(2, d)]));
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm5");
+			asm volatile ("vpxorq %zmm5,%zmm2,%zmm2");
+			asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(3, d)]));
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm5");
+			asm volatile ("vpxorq %zmm5,%zmm3,%zmm3");
+			asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(4, d)]));
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm5");
+			asm volatile ("vpxorq %zmm5,%zmm8,%zmm8");
+			asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[A(5, d)]));
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm5");
+			asm volatile ("vpxorq %zmm5,%zmm9,%zmm9");
+		}
+		asm volatile ("vmovntdq %%zmm0,%0" : "=m" (p[i]));
+		asm volatile ("vmovntdq %%zmm1,%0" : "=m" (q[i]));
+		asm volatile ("vmovntdq %%zmm2,%0" : "=m" (r[i]));
+		asm volatile ("vmovntdq %%zmm3,%0" : "=m" (s[i]));
+		asm volatile ("vmovntdq %%zmm8,%0" : "=m" (t[i]));
+		asm volatile ("vmovntdq %%zmm9,%0" : "=m" (u[i]));
+	}
+
+	raid_avx_end();
+}
+
+/*
+ * RAID recovering for one disk GFNI implementation
+ */
+void raid_rec1_gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p;
+	uint8_t *pa;
+	uint8_t G;
+	uint8_t V;
+	size_t i;
+
+	(void)nr; /* unused, it's always 1 */
+
+	/* if it's RAID5 uses the faster function */
+	if (ip[0] == 0) {
+		raid_rec1of1(id, nd, size, vv);
+		return;
+	}
+
+	/* setup the coefficients matrix */
+	G = A(ip[0], id[0]);
+
+	/* invert it to solve the system of linear equations */
+	V = inv(G);
+
+	/* compute delta parity */
+	raid_delta_gen(1, id, ip, nd, size, vv);
+
+	p = v[nd + ip[0]];
+	pa = v[id[0]];
+
+	raid_avx_begin();
+
+	asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[V]));
+
+	for (i = 0; i < size; i += 64) {
+		asm volatile ("vmovdqa64 %0,%%zmm0" : : "m" (p[i]));
+		asm volatile ("vmovdqa64 %0,%%zmm1" : : "m" (pa[i]));
+		asm volatile ("vpxorq %zmm1,%zmm0,%zmm0");
+		asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm0,%zmm0");
+		asm volatile ("vmovdqa64 %%zmm0,%0" : "=m" (pa[i]));
+	}
+
+	raid_avx_end();
+}
+
+/*
+ * RAID recovering for two disks GFNI implementation
+ */
+void raid_rec2_gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	const int N = 2;
+	uint8_t *p[N];
+	uint8_t *pa[N];
+	uint8_t G[N * N];
+	uint8_t V[N * N];
+	size_t i;
+	int j, k;
+
+	(void)nr; /* unused, it's always 2 */
+
+	/* setup the coefficients matrix */
+	for (j = 0; j < N; ++j)
+		for (k = 0; k < N; ++k)
+			G[j * N + k] = A(ip[j], id[k]);
+
+	/* invert it to solve the system of linear equations */
+	raid_invert(G, V, N);
+
+	/* compute delta parity */
+	raid_delta_gen(N, id, ip, nd, size, vv);
+
+	for (j = 0; j < N; ++j) {
+		p[j] = v[nd + ip[j]];
+		pa[j] = v[id[j]];
+	}
+
+	raid_avx_begin();
+
+	asm volatile ("vpbroadcastq %0,%%zmm4" : : "m" (gfnimatrix[V[0]]));
+	asm volatile ("vpbroadcastq %0,%%zmm5" : : "m" (gfnimatrix[V[1]]));
+	asm volatile ("vpbroadcastq %0,%%zmm6" : : "m" (gfnimatrix[V[2]]));
+	asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[V[3]]));
+
+	for (i = 0; i < size; i += 64) {
+		asm volatile ("vmovdqa64 %0,%%zmm0" : : "m" (p[0][i]));
+		asm volatile ("vmovdqa64 %0,%%zmm2" : : "m" (pa[0][i]));
+		asm volatile ("vmovdqa64 %0,%%zmm1" : : "m" (p[1][i]));
+		asm volatile ("vmovdqa64 %0,%%zmm3" : : "m" (pa[1][i]));
+		asm volatile ("vpxorq %zmm2,%zmm0,%zmm0");
+		asm volatile ("vpxorq %zmm3,%zmm1,%zmm1");
+
+		asm volatile ("vgf2p8affineqb $0,%zmm4,%zmm0,%zmm2");
+		asm volatile ("vgf2p8affineqb $0,%zmm5,%zmm1,%zmm3");
+		asm volatile ("vpxorq %zmm3,%zmm2,%zmm2");
+		asm volatile ("vmovdqa64 %%zmm2,%0" : "=m" (pa[0][i]));
+
+		asm volatile ("vgf2p8affineqb $0,%zmm6,%zmm0,%zmm2");
+		asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm1,%zmm3");
+		asm volatile ("vpxorq %zmm3,%zmm2,%zmm2");
+		asm volatile ("vmovdqa64 %%zmm2,%0" : "=m" (pa[1][i]));
+	}
+
+	raid_avx_end();
+}
+
+/*
+ * RAID recovering GFNI implementation
+ */
+void raid_recX_gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	int N = nr;
+	uint8_t *p[RAID_PARITY_MAX];
+	uint8_t *pa[RAID_PARITY_MAX];
+	uint8_t G[RAID_PARITY_MAX * RAID_PARITY_MAX];
+	uint8_t V[RAID_PARITY_MAX * RAID_PARITY_MAX];
+	uint8_t buffer[RAID_PARITY_MAX*64+64];
+	uint8_t *pd = __align_ptr(buffer, 64);
+	size_t i;
+	int j, k;
+
+	/* setup the coefficients matrix */
+	for (j = 0; j < N; ++j)
+		for (k = 0; k < N; ++k)
+			G[j * N + k] = A(ip[j], id[k]);
+
+	/* invert it to solve the system of linear equations */
+	raid_invert(G, V, N);
+
+	/* compute delta parity */
+	raid_delta_gen(N, id, ip, nd, size, vv);
+
+	for (j = 0; j < N; ++j) {
+		p[j] = v[nd + ip[j]];
+		pa[j] = v[id[j]];
+	}
+
+	raid_avx_begin();
+
+	for (i = 0; i < size; i += 64) {
+		/* delta */
+		for (j = 0; j < N; ++j) {
+			asm volatile ("vmovdqa64 %0,%%zmm0" : : "m" (p[j][i]));
+			asm volatile ("vmovdqa64 %0,%%zmm1" : : "m" (pa[j][i]));
+			asm volatile ("vpxorq %zmm1,%zmm0,%zmm0");
+			asm volatile ("vmovdqa64 %%zmm0,%0" : "=m" (pd[j*64]));
+		}
+
+		/* reconstruct */
+		for (j = 0; j < N; ++j) {
+			asm volatile ("vpxorq %zmm0,%zmm0,%zmm0");
+
+			for (k = 0; k < N; ++k) {
+				uint8_t m = V[j * N + k];
+
+				asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfnimatrix[m]));
+				asm volatile ("vmovdqa64 %0,%%zmm4" : : "m" (pd[k*64]));
+				asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm4,%zmm4");
+				asm volatile ("vpxorq %zmm4,%zmm0,%zmm0");
+			}
+
+			asm volatile ("vmovdqa64 %%zmm0,%0" : "=m" (pa[j][i]));
+		}
+	}
+
+	raid_avx_end();
+}
+#endif
@@ -45,23 +45,31 @@ fn handle_c_command(args: Vec<String>, symlink_cmd: Option<&str>) -> i32 {
                 c::bcachefs_usage();
                 0
             },
+            "bench-compression" => c::cmd_bench_compression(argc, argv),
+            "bench-crypto" => c::cmd_bench_crypto(argc, argv),
+            "counters" => c::counters_cmds(argc, argv),
+            "daemon" => c::cmd_daemon(argc, argv),
             "data" => c::data_cmds(argc, argv),
             "device" => c::device_cmds(argc, argv),
             "dump" => c::cmd_dump(argc, argv),
+            "dump-restore" => c::cmd_dump_restore(argc, argv),
             "format" => c::cmd_format(argc, argv),
             "fs" => c::fs_cmds(argc, argv),
             "fsck" => c::cmd_fsck(argc, argv),
+            "internals" => c::internals_cmds(argc, argv),
             "list_journal" => c::cmd_list_journal(argc, argv),
             "kill_btree_node" => c::cmd_kill_btree_node(argc, argv),
             "migrate" => c::cmd_migrate(argc, argv),
             "migrate-superblock" => c::cmd_migrate_superblock(argc, argv),
             "mkfs" => c::cmd_format(argc, argv),
+            "query" => c::cmd_query(argc, argv),
             "remove-passphrase" => c::cmd_remove_passphrase(argc, argv),
             "reset-counters" => c::cmd_reset_counters(argc, argv),
             "set-option" => c::cmd_set_option(argc, argv),
             "set-passphrase" => c::cmd_set_passphrase(argc, argv),
             "setattr" => c::cmd_setattr(argc, argv),
             "show-super" => c::cmd_show_super(argc, argv),
+            "top" => c::cmd_top(argc, argv),
             "unlock" => c::cmd_unlock(argc, argv),
             "version" => c::cmd_version(argc, argv),
 
@@ -108,6 +116,15 @@ fn main() {
         None => args[1].as_str(),
     };
 
+    // Commands that do erasure coding in userspace benefit from benchmarked
+    // kernel selection; the result is cached so the benchmark runs once per
+    // machine:
+    if matches!(cmd, "fsck" | "fusemount" | "migrate") {
+        let _ = std::fs::create_dir_all("/var/lib/bcachefs");
+        let cache = CString::new("/var/lib/bcachefs/raid-tune").unwrap();
+        unsafe { c::raid_tune(cache.as_ptr()) };
+    }
+
     let ret = match cmd {
         "completions" => cmd_completions(args[1..].to_vec()),
         "list" => cmd_list(args[1..].to_vec()),
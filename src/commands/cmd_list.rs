@@ -9,22 +9,86 @@ use bch_bindgen::btree::BtreeIter;
 use bch_bindgen::btree::BtreeNodeIter;
 use bch_bindgen::btree::BtreeIterFlags;
 use clap::{Parser};
+use std::io::Write;
+
+/// One write syscall per line (what println! gives us, stdout being line
+/// buffered) dominates listing time on big btrees; batch output through a
+/// large buffer instead and flush once at the end.
+const OUTPUT_BUF_SIZE: usize = 1 << 20;
+
+fn output_buf() -> std::io::BufWriter<std::io::StdoutLock<'static>> {
+    std::io::BufWriter::with_capacity(OUTPUT_BUF_SIZE, std::io::stdout().lock())
+}
+
+/// Snapshot-scoped listing: a key is visible in snapshot `filter` if its own
+/// snapshot id equals it or is one of its ancestors. Checked before any
+/// unpacking of the value or formatting, so a filtered-out key costs only the
+/// ancestry lookup - O(1) via the Euler tour index once the snapshots table
+/// is loaded.
+fn snapshot_visible(fs: &Fs, filter: Option<u32>, key_snapshot: u32) -> bool {
+    match filter {
+        None => true,
+        Some(snap) =>
+            key_snapshot == snap ||
+            unsafe { bcachefs::__bch2_snapshot_is_ancestor(fs.raw, snap, key_snapshot) },
+    }
+}
 
 fn list_keys(fs: &Fs, opt: Cli) -> anyhow::Result<()> {
     let trans = BtreeTrans::new(fs);
     let mut iter = BtreeIter::new(&trans, opt.btree, opt.start,
         BtreeIterFlags::ALL_SNAPSHOTS|
         BtreeIterFlags::PREFETCH);
+    let mut out = output_buf();
+
+    while let Some(k) = iter.peek_and_restart()? {
+        if k.k.p > opt.end {
+            break;
+        }
+
+        if snapshot_visible(fs, opt.snapshot, k.k.p.snapshot) {
+            writeln!(&mut out, "{}", k.to_text(fs))?;
+        }
+        iter.advance();
+    }
+
+    out.flush()?;
+    Ok(())
+}
+
+/// Raw key output for piping into analysis tools: each record is the
+/// current-format struct bkey followed by its value, (u64s * 8) bytes in
+/// total, no formatting done.
+fn list_keys_binary(fs: &Fs, opt: Cli) -> anyhow::Result<()> {
+    let trans = BtreeTrans::new(fs);
+    let mut iter = BtreeIter::new(&trans, opt.btree, opt.start,
+        BtreeIterFlags::ALL_SNAPSHOTS|
+        BtreeIterFlags::PREFETCH);
+    let mut out = output_buf();
+    let bkey_bytes = std::mem::size_of::<bcachefs::bkey>();
 
     while let Some(k) = iter.peek_and_restart()? {
         if k.k.p > opt.end {
             break;
         }
 
-        println!("{}", k.to_text(fs));
+        if !snapshot_visible(fs, opt.snapshot, k.k.p.snapshot) {
+            iter.advance();
+            continue;
+        }
+
+        // the key (unpacked by the iterator) and value aren't contiguous:
+        let val_bytes = (k.k.u64s as usize * 8).saturating_sub(bkey_bytes);
+        unsafe {
+            out.write_all(std::slice::from_raw_parts(
+                k.k as *const _ as *const u8, bkey_bytes))?;
+            out.write_all(std::slice::from_raw_parts(
+                k.v as *const _ as *const u8, val_bytes))?;
+        }
         iter.advance();
     }
 
+    out.flush()?;
     Ok(())
 }
 
@@ -33,16 +97,18 @@ fn list_btree_formats(fs: &Fs, opt: Cli) -> anyhow::Result<()> {
     let mut iter = BtreeNodeIter::new(&trans, opt.btree, opt.start,
         0, opt.level,
         BtreeIterFlags::PREFETCH);
+    let mut out = output_buf();
 
     while let Some(b) = iter.peek_and_restart()? {
         if b.key.k.p > opt.end {
             break;
         }
 
-        println!("{}", b.to_text(fs));
+        writeln!(&mut out, "{}", b.to_text(fs))?;
         iter.advance();
     }
 
+    out.flush()?;
     Ok(())
 }
 
@@ -51,16 +117,18 @@ fn list_btree_nodes(fs: &Fs, opt: Cli) -> anyhow::Result<()> {
     let mut iter = BtreeNodeIter::new(&trans, opt.btree, opt.start,
         0, opt.level,
         BtreeIterFlags::PREFETCH);
+    let mut out = output_buf();
 
     while let Some(b) = iter.peek_and_restart()? {
         if b.key.k.p > opt.end {
             break;
         }
 
-        println!("{}", BkeySC::from(&b.key).to_text(fs));
+        writeln!(&mut out, "{}", BkeySC::from(&b.key).to_text(fs))?;
         iter.advance();
     }
 
+    out.flush()?;
     Ok(())
 }
 
@@ -69,22 +137,25 @@ fn list_nodes_ondisk(fs: &Fs, opt: Cli) -> anyhow::Result<()> {
     let mut iter = BtreeNodeIter::new(&trans, opt.btree, opt.start,
         0, opt.level,
         BtreeIterFlags::PREFETCH);
+    let mut out = output_buf();
 
     while let Some(b) = iter.peek_and_restart()? {
         if b.key.k.p > opt.end {
             break;
         }
 
-        println!("{}", b.ondisk_to_text(fs));
+        writeln!(&mut out, "{}", b.ondisk_to_text(fs))?;
         iter.advance();
     }
 
+    out.flush()?;
     Ok(())
 }
 
 #[derive(Clone, clap::ValueEnum, Debug)]
 enum Mode {
     Keys,
+    KeysBinary,
     Formats,
     Nodes,
     NodesOndisk,
@@ -109,6 +180,10 @@ pub struct Cli {
     #[arg(short, long, default_value="SPOS_MAX")]
     end:        bcachefs::bpos,
 
+    /// Only list keys visible in this snapshot id (keys/keys-binary modes)
+    #[arg(short = 'S', long)]
+    snapshot:   Option<u32>,
+
     #[arg(short, long, default_value="keys")]
     mode:       Mode,
 
@@ -146,10 +221,16 @@ fn cmd_list_inner(opt: Cli) -> anyhow::Result<()> {
         opt_set!(fs_opts, verbose,      1);
     }
 
+    // the ancestry index needs the snapshots table, built during recovery:
+    if opt.snapshot.is_some() {
+        opt_set!(fs_opts, norecovery,   0);
+    }
+
     let fs = Fs::open(&opt.devices, fs_opts)?;
 
     match opt.mode {
         Mode::Keys          => list_keys(&fs, opt),
+        Mode::KeysBinary    => list_keys_binary(&fs, opt),
         Mode::Formats       => list_btree_formats(&fs, opt),
         Mode::Nodes         => list_btree_nodes(&fs, opt),
         Mode::NodesOndisk   => list_nodes_ondisk(&fs, opt),
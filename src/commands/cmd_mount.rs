@@ -107,20 +107,145 @@ fn read_super_silent(path: &std::path::PathBuf) -> anyhow::Result<bch_sb_handle>
     bch_bindgen::sb_io::read_super_silent(&path, opts)
 }
 
+/// Byte offset of the superblock layout (BCH_SB_LAYOUT_SECTOR << 9), which
+/// starts with the filesystem magic.
+const BCH_SB_LAYOUT_OFFSET: u64 = 7 << 9;
+
+const BCACHE_MAGIC: [u8; 16] = [
+    0xc6, 0x85, 0x73, 0xf6, 0x4e, 0x1a, 0x45, 0xca,
+    0x82, 0x65, 0xf5, 0x7f, 0x48, 0xba, 0x6d, 0x81,
+];
+const BCHFS_MAGIC: [u8; 16] = [
+    0xc6, 0x85, 0x73, 0xf6, 0x66, 0xce, 0x90, 0xa9,
+    0xd9, 0x6a, 0x60, 0xcf, 0x80, 0x3d, 0xf7, 0xef,
+];
+
+/// Cheap pre-filter: read just the magic from the superblock layout sector,
+/// so the non-bcachefs devices that make up most of a big host are rejected
+/// with a single small read instead of a full bch2_read_super() probe.
+fn probe_device_magic(path: &std::path::Path) -> bool {
+    use std::os::unix::fs::FileExt;
+
+    let mut magic = [0u8; 16];
+    match std::fs::File::open(path) {
+        Ok(f) => {
+            f.read_exact_at(&mut magic, BCH_SB_LAYOUT_OFFSET).is_ok()
+                && (magic == BCACHE_MAGIC || magic == BCHFS_MAGIC)
+        }
+        Err(_) => false,
+    }
+}
+
+/// Probe devnodes for superblocks with the wanted UUID, in parallel: on hosts
+/// with many drives the sequential scan is what dominates mount time.
+///
+/// Only paths cross the thread boundary; matching devices have their
+/// superblock re-read on the calling thread, since bch_sb_handle holds raw
+/// pointers.
+fn scan_devices_by_uuid(devnodes: &[PathBuf], uuid: Uuid) -> Vec<PathBuf> {
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::sync::Mutex;
+
+    let nr_threads = std::cmp::min(
+        std::cmp::max(devnodes.len(), 1),
+        std::thread::available_parallelism().map_or(1, |n| n.get()),
+    );
+    let next = AtomicUsize::new(0);
+    let found = Mutex::new(Vec::new());
+
+    std::thread::scope(|s| {
+        for _ in 0..nr_threads {
+            s.spawn(|| loop {
+                let i = next.fetch_add(1, Ordering::Relaxed);
+                let Some(dev) = devnodes.get(i) else { break };
+
+                if !probe_device_magic(dev) {
+                    continue;
+                }
+                if let Ok(sb) = read_super_silent(dev) {
+                    if sb.sb().uuid() == uuid {
+                        found.lock().unwrap().push(dev.clone());
+                    }
+                }
+            });
+        }
+    });
+
+    let mut devs = found.into_inner().unwrap();
+    devs.sort();
+    devs
+}
+
+fn uuid_cache_path(uuid: Uuid) -> PathBuf {
+    PathBuf::from(format!("/run/bcachefs/dev-cache.{}", uuid))
+}
+
+/// Load the cached device set for this UUID, verifying that every listed
+/// device still has a superblock with the right UUID and that the set is
+/// complete; any mismatch falls back to a full scan.
+fn get_devices_from_cache(uuid: Uuid) -> Option<Vec<(PathBuf, bch_sb_handle)>> {
+    let contents = std::fs::read_to_string(uuid_cache_path(uuid)).ok()?;
+    let mut devs = Vec::new();
+
+    for line in contents.lines().filter(|l| !l.is_empty()) {
+        let dev = PathBuf::from(line);
+        let sb = read_super_silent(&dev).ok()?;
+
+        if sb.sb().uuid() != uuid {
+            return None;
+        }
+        devs.push((dev, sb));
+    }
+
+    if devs.is_empty() || devs.len() != devs[0].1.sb().nr_devices as usize {
+        return None;
+    }
+
+    debug!("using cached device set for {}", uuid);
+    Some(devs)
+}
+
+fn update_devices_cache(uuid: Uuid, devs: &[(PathBuf, bch_sb_handle)]) {
+    let contents = devs
+        .iter()
+        .map(|(dev, _)| format!("{}\n", dev.display()))
+        .collect::<String>();
+    let path = uuid_cache_path(uuid);
+    let tmp = path.with_extension("tmp");
+
+    // best effort - /run may not be writable:
+    let _ = std::fs::create_dir_all("/run/bcachefs")
+        .and_then(|_| std::fs::write(&tmp, contents))
+        .and_then(|_| std::fs::rename(&tmp, &path));
+}
+
 fn get_devices_by_uuid(uuid: Uuid) -> anyhow::Result<Vec<(PathBuf, bch_sb_handle)>> {
+    if let Some(devs) = get_devices_from_cache(uuid) {
+        return Ok(devs);
+    }
+
     debug!("enumerating udev devices");
     let mut udev = udev::Enumerator::new()?;
 
     udev.match_subsystem("block")?;
 
-    let devs = udev
+    let devnodes: Vec<PathBuf> = udev
         .scan_devices()?
         .into_iter()
         .filter_map(|dev| dev.devnode().map(ToOwned::to_owned))
-        .map(|dev| (dev.clone(), read_super_silent(&dev)))
-        .filter_map(|(dev, sb)| sb.ok().map(|sb| (dev, sb)))
-        .filter(|(_, sb)| sb.sb().uuid() == uuid)
         .collect();
+
+    let devs: Vec<(PathBuf, bch_sb_handle)> = scan_devices_by_uuid(&devnodes, uuid)
+        .into_iter()
+        .map(|dev| {
+            let sb = read_super_silent(&dev)?;
+            Ok((dev, sb))
+        })
+        .collect::<anyhow::Result<_>>()?;
+
+    if !devs.is_empty() {
+        update_devices_cache(uuid, &devs);
+    }
     Ok(devs)
 }
 
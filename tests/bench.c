@@ -0,0 +1,474 @@
+/*
+ * Microbenchmark suite for the hot kernels - run via `make bench`.
+ *
+ * In-memory benchmarks (bkey pack/unpack/cmp, checksums) run standalone; the
+ * compression, journal validation and btree benchmarks format a throwaway
+ * image and go through the real filesystem code. Results go to stdout as a
+ * table, and with -o to a JSON file for tracking regressions between
+ * releases in CI.
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "json.h"
+#include "libbcachefs.h"
+#include "linux/sort.h"
+#include "tools-util.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/bkey.h"
+#include "libbcachefs/btree_types.h"
+#include "libbcachefs/checksum.h"
+#include "libbcachefs/compress.h"
+#include "libbcachefs/errcode.h"
+#include "libbcachefs/journal_io.h"
+#include "libbcachefs/opts.h"
+#include "libbcachefs/super.h"
+#include "libbcachefs/tests.h"
+#include "libbcachefs/varint.h"
+
+static FILE *json_file;
+static struct json_out jout;
+
+/* defeats dead code elimination; see report(): */
+static u64 bench_sink;
+
+static u64 ns_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *name, u64 iters, u64 ns, u64 bytes)
+{
+	printf("%-28s %12llu iters %8llu ns/iter",
+	       name,
+	       (unsigned long long) iters,
+	       (unsigned long long) (ns / iters));
+	if (bytes)
+		printf(" %8llu MB/s",
+		       (unsigned long long) (bytes * 1000 / (ns ?: 1)));
+	printf("\n");
+
+	if (json_file) {
+		json_obj_start(&jout, NULL);
+		json_str(&jout, "name", name);
+		json_u64(&jout, "iters", iters);
+		json_u64(&jout, "ns", ns);
+		if (bytes)
+			json_u64(&jout, "bytes", bytes);
+		json_obj_end(&jout);
+	}
+}
+
+/* bkey pack/unpack/cmp: */
+
+static void bench_bkey(u64 nr)
+{
+	struct bkey_format_state s;
+	struct bkey k = KEY(1234, 0, 8);
+	u64 start, i;
+
+	bch2_bkey_format_init(&s);
+	for (i = 0; i < 1024; i++) {
+		k.p.offset = i << 20;
+		bch2_bkey_format_add_key(&s, &k);
+	}
+	struct bkey_format f = bch2_bkey_format_done(&s);
+	struct bkey_packed p, l, r;
+
+	start = ns_now();
+	for (i = 0; i < nr; i++) {
+		k.p.offset = i;
+		bench_sink += bch2_bkey_pack_key(&p, &k, &f);
+	}
+	report("bkey_pack", nr, ns_now() - start, 0);
+
+	start = ns_now();
+	for (i = 0; i < nr; i++)
+		bench_sink += __bch2_bkey_unpack_key(&f, &p).p.offset;
+	report("bkey_unpack", nr, ns_now() - start, 0);
+
+	struct btree *b = xcalloc(1, sizeof(*b));
+
+	b->format	= f;
+	b->nr_key_bits	= bkey_format_key_bits(&f);
+
+	k.p.offset = 1 << 20;
+	BUG_ON(!bch2_bkey_pack_key(&l, &k, &f));
+	k.p.offset = (1 << 20) + 1;
+	BUG_ON(!bch2_bkey_pack_key(&r, &k, &f));
+
+	start = ns_now();
+	for (i = 0; i < nr; i++)
+		bench_sink += bch2_bkey_cmp_packed(b, i & 1 ? &l : &r, &r);
+	report("bkey_cmp_packed", nr, ns_now() - start, 0);
+
+	free(b);
+}
+
+/* varint decode, serial vs batch: */
+
+static void bench_varint(u64 nr)
+{
+	unsigned nr_per_buf = 512;
+	u8 *buf = xmalloc(nr_per_buf * 9 + 8);
+	u64 *vals = xmalloc(nr_per_buf * sizeof(u64));
+	u64 i, start, rounds = nr / nr_per_buf;
+	unsigned len = 0;
+
+	/*
+	 * Field size mix modeled on packed inodes and alloc keys: mostly
+	 * single byte, with the occasional timestamp or sector count:
+	 */
+	for (i = 0; i < nr_per_buf; i++) {
+		u64 v = (i & 7) == 7
+			? ((u64) rand() << 32) | rand()
+			: rand() & 127;
+
+		len += bch2_varint_encode_fast(buf + len, v);
+	}
+
+	const u8 *end = buf + len;
+
+	start = ns_now();
+	for (i = 0; i < rounds; i++) {
+		const u8 *in = buf;
+
+		for (unsigned j = 0; j < nr_per_buf; j++)
+			in += bch2_varint_decode_fast(in, end, &vals[j]);
+		bench_sink += vals[nr_per_buf - 1];
+	}
+	report("varint_decode", rounds * nr_per_buf, ns_now() - start,
+	       rounds * len);
+
+	start = ns_now();
+	for (i = 0; i < rounds; i++) {
+		bch2_varint_decode_batch(buf, end, vals, nr_per_buf);
+		bench_sink += vals[nr_per_buf - 1];
+	}
+	report("varint_decode_batch", rounds * nr_per_buf, ns_now() - start,
+	       rounds * len);
+
+	free(buf);
+	free(vals);
+}
+
+/* checksums: */
+
+static void bench_checksum(u64 bytes)
+{
+	static const struct {
+		const char	*name;
+		unsigned	type;
+	} variants[] = {
+		{ "csum_crc32c",	BCH_CSUM_crc32c	},
+		{ "csum_crc64",		BCH_CSUM_crc64	},
+		{ "csum_xxhash",	BCH_CSUM_xxhash	},
+	};
+	size_t buflen = 65536;
+	void *buf = xmalloc(buflen);
+	u64 i, nr = bytes / buflen;
+
+	for (i = 0; i < buflen; i++)
+		((u8 *) buf)[i] = rand();
+
+	for (unsigned v = 0; v < ARRAY_SIZE(variants); v++) {
+		u64 start = ns_now();
+
+		for (i = 0; i < nr; i++)
+			bench_sink += bch2_checksum(NULL, variants[v].type,
+						    (struct nonce) {{ 0 }},
+						    buf, buflen).lo;
+		report(variants[v].name, nr, ns_now() - start, nr * buflen);
+	}
+
+	free(buf);
+}
+
+/* typed sort, heapsort vs. radix hybrid, on journal_key sized records: */
+
+struct sort_rec {
+	u64	key;
+	u64	pad[3];
+};
+
+static int sort_rec_cmp(const void *_l, const void *_r)
+{
+	const struct sort_rec *l = _l, *r = _r;
+
+	return cmp_int(l->key, r->key);
+}
+
+static u64 sort_rec_key(const void *_r)
+{
+	return ((const struct sort_rec *) _r)->key;
+}
+
+static void bench_sort(u64 nr)
+{
+	struct sort_rec *recs	= xmalloc(nr * sizeof(*recs));
+	struct sort_rec *tmp	= xmalloc(nr * sizeof(*recs));
+	u64 i, start;
+
+	for (i = 0; i < nr; i++)
+		recs[i].key = ((u64) rand() << 32) | rand();
+
+	memcpy(tmp, recs, nr * sizeof(*recs));
+	start = ns_now();
+	sort(tmp, nr, sizeof(*tmp), sort_rec_cmp, NULL);
+	report("sort_heap", nr, ns_now() - start, nr * sizeof(*tmp));
+	bench_sink += tmp[nr / 2].key;
+
+	memcpy(tmp, recs, nr * sizeof(*recs));
+	start = ns_now();
+	bch2_sort_radix(tmp, nr, sizeof(*tmp), sort_rec_key, sort_rec_cmp);
+	report("sort_radix", nr, ns_now() - start, nr * sizeof(*tmp));
+	bench_sink += tmp[nr / 2].key;
+
+	for (i = 1; i < nr; i++)
+		BUG_ON(tmp[i - 1].key > tmp[i].key);
+
+	free(recs);
+	free(tmp);
+}
+
+/* compression, through the write path compression code: */
+
+static void userbio_init(struct bio *bio, struct bio_vec *bv,
+			 void *buf, size_t size)
+{
+	bio_init(bio, NULL, bv, 1, 0);
+	bio->bi_iter.bi_size	= size;
+	bv->bv_page		= buf;
+	bv->bv_len		= size;
+	bv->bv_offset		= 0;
+}
+
+static void bench_compress(struct bch_fs *c, u64 bytes)
+{
+	static const struct {
+		const char			*name;
+		struct bch_compression_opt	opt;
+	} variants[] = {
+		{ "compress_lz4",	{ .type = BCH_COMPRESSION_OPT_lz4  } },
+		{ "compress_gzip",	{ .type = BCH_COMPRESSION_OPT_gzip } },
+		{ "compress_zstd",	{ .type = BCH_COMPRESSION_OPT_zstd } },
+	};
+	size_t buflen = c->opts.encoded_extent_max;
+	void *src_buf	= xmalloc(buflen);
+	void *dst_buf	= xmalloc(buflen);
+	u64 i, nr = bytes / buflen;
+
+	/* mixed entropy, so the compressors have something to chew on: */
+	for (i = 0; i < buflen; i++)
+		((u8 *) src_buf)[i] = rand() & (i & 512 ? 0xff : 0x0f);
+
+	for (unsigned v = 0; v < ARRAY_SIZE(variants); v++) {
+		if (bch2_check_set_has_compressed_data(c,
+				bch2_compression_encode(variants[v].opt)))
+			die("error initializing compression workspaces");
+
+		u64 start = ns_now();
+
+		for (i = 0; i < nr; i++) {
+			struct bio src, dst;
+			struct bio_vec src_bv, dst_bv;
+			size_t src_len = 0, dst_len = 0;
+
+			userbio_init(&src, &src_bv, src_buf, buflen);
+			userbio_init(&dst, &dst_bv, dst_buf, buflen);
+
+			bench_sink += bch2_bio_compress(c, &dst, &dst_len,
+							&src, &src_len,
+					bch2_compression_encode(variants[v].opt));
+		}
+		report(variants[v].name, nr, ns_now() - start, nr * buflen);
+	}
+
+	free(src_buf);
+	free(dst_buf);
+}
+
+/* journal entry validation: */
+
+static void bench_journal_validate(struct bch_fs *c, u64 nr)
+{
+	u64 _buf[16];
+	struct jset_entry *e = (void *) _buf;
+	struct bkey_i_cookie *k = (void *) e->_data;
+	u64 i, start;
+
+	memset(_buf, 0, sizeof(_buf));
+	bkey_cookie_init(&k->k_i);
+	k->k.p		= SPOS(0, 1234, U32_MAX);
+	e->u64s		= cpu_to_le16(k->k.u64s);
+	e->type		= BCH_JSET_ENTRY_btree_keys;
+	e->btree_id	= BTREE_ID_xattrs;
+
+	start = ns_now();
+	for (i = 0; i < nr; i++)
+		bench_sink += bch2_journal_entry_validate(c, NULL, e,
+					bcachefs_metadata_version_current,
+					0, BKEY_INVALID_JOURNAL);
+	report("journal_entry_validate", nr, ns_now() - start, 0);
+}
+
+/* btree update/lookup loops, via the vendored kernel perf tests: */
+
+static void bench_btree(struct bch_fs *c, u64 nr)
+{
+	static const char * const tests[] = {
+		"seq_insert",
+		"seq_lookup",
+		"seq_delete",
+		"rand_insert",
+		"rand_lookup",
+		"rand_delete",
+	};
+
+	for (unsigned i = 0; i < ARRAY_SIZE(tests); i++) {
+		char name[64];
+		u64 start = ns_now();
+
+		if (bch2_btree_perf_test(c, tests[i], nr, 1))
+			die("btree perf test %s failed", tests[i]);
+
+		snprintf(name, sizeof(name), "btree_%s", tests[i]);
+		report(name, nr, ns_now() - start, 0);
+	}
+}
+
+static struct bch_fs *bench_fs_create(const char *path, u64 size)
+{
+	struct bch_opts fs_opts = bch2_opts_empty();
+	struct bch_opt_strs fs_opt_strs;
+	struct dev_opts dev = dev_opts_default();
+
+	memset(&fs_opt_strs, 0, sizeof(fs_opt_strs));
+
+	dev.path = (char *) path;
+	dev.handle = bdev_open_by_path(dev.path,
+				       BLK_OPEN_READ|BLK_OPEN_WRITE,
+				       &dev, NULL);
+
+	int ret = PTR_ERR_OR_ZERO(dev.handle);
+	if (ret < 0)
+		die("error opening %s: %s", path, strerror(-ret));
+	dev.bdev = dev.handle->bdev;
+
+	dev.size	= size;
+	dev.bucket_size	= bch2_pick_bucket_size(fs_opts, &dev);
+	dev.nbuckets	= dev.size / dev.bucket_size;
+	bch2_check_bucket_size(fs_opts, &dev);
+
+	free(bch2_format(fs_opt_strs, fs_opts, format_opts_default(), &dev, 1));
+
+	struct bch_opts opts = bch2_opts_empty();
+	char *paths[1] = { (char *) path };
+
+	struct bch_fs *c = bch2_fs_open(paths, 1, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", path, bch2_err_str(PTR_ERR(c)));
+
+	return c;
+}
+
+static void bench_usage(void)
+{
+	puts("bench - microbenchmarks for the hot kernels\n"
+	     "Usage: bench [OPTION]...\n"
+	     "\n"
+	     "Options:\n"
+	     "  -n, --nr=nr                 Iterations for the cpu benchmarks (default 10M)\n"
+	     "  -b, --btree-nr=nr           Keys for the btree benchmarks (default 100k)\n"
+	     "  -o, --output=file           Also write results as JSON\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "nr",			required_argument,	NULL, 'n' },
+		{ "btree-nr",		required_argument,	NULL, 'b' },
+		{ "output",		required_argument,	NULL, 'o' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	const char *json_path = NULL;
+	u64 nr = 10000000, btree_nr = 100000;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "n:b:o:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'n':
+			if (bch2_strtoull_h(optarg, &nr) || !nr)
+				die("invalid iteration count");
+			break;
+		case 'b':
+			if (bch2_strtoull_h(optarg, &btree_nr) || !btree_nr)
+				die("invalid btree key count");
+			break;
+		case 'o':
+			json_path = optarg;
+			break;
+		case 'h':
+			bench_usage();
+			break;
+		}
+
+	if (json_path) {
+		json_file = fopen(json_path, "w");
+		if (!json_file)
+			die("error opening %s: %m", json_path);
+		json_begin(&jout, json_file);
+		json_str(&jout, "version", VERSION_STRING);
+		json_arr_start(&jout, "benchmarks");
+	}
+
+	srand(ns_now());
+
+	bench_bkey(nr);
+	bench_varint(nr);
+	bench_checksum(nr * 64);
+	bench_sort(min_t(u64, nr, 1 << 22));
+
+	char image[] = "/tmp/bcachefs-bench-XXXXXX";
+	int image_fd = mkstemp(image);
+	if (image_fd < 0)
+		die("error creating %s: %m", image);
+	if (ftruncate(image_fd, 1ULL << 30))
+		die("truncate error: %m");
+	close(image_fd);
+
+	struct bch_fs *c = bench_fs_create(image, 1ULL << 30);
+
+	bench_compress(c, nr * 16);
+	bench_journal_validate(c, nr);
+	bench_btree(c, btree_nr);
+
+	bch2_fs_stop(c);
+	unlink(image);
+
+	if (json_file) {
+		json_arr_end(&jout);
+		json_end(&jout);
+		fclose(json_file);
+	}
+
+	/* keep the compiler from discarding the benchmark loops: */
+	if (getenv("BENCH_PRINT_SINK"))
+		printf("%llu\n", (unsigned long long) bench_sink);
+
+	return 0;
+}